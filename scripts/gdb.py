@@ -187,6 +187,36 @@ class Target:
 
 			if reply[0] == 'l': return ret
 			
+	def snapshot_read(self, addr, length, chunk=1024):
+		"""Read length bytes at addr through the probe's compressed
+		qXfer:bmp-snapshot object"""
+		offset = 0
+		stream = ''
+		while True:
+			self.putpacket("qXfer:bmp-snapshot:read:%X,%X:%X,%X" %
+					(addr, length, offset, chunk))
+			reply = self.getpacket()
+			if (len(reply) == 0) or (reply[0] not in 'ml'):
+				raise Exception('Error reading snapshot at 0x%08X' % addr)
+			offset += len(reply) - 1
+			stream += reply[1:]
+			if reply[0] == 'l': break
+
+		# Records: 0x00-0x7F literal of n + 1 bytes, 0x80-0xFF run
+		# of ((n & 0x7F) << 8 | b) + 4 bytes of the value following
+		ret = []
+		i = 0
+		while i < len(stream):
+			n = ord(stream[i])
+			if n < 0x80:
+				ret.append(stream[i + 1:i + 2 + n])
+				i += n + 2
+			else:
+				count = ((n & 0x7F) << 8 | ord(stream[i + 1])) + 4
+				ret.append(stream[i + 2] * count)
+				i += 3
+		return "".join(ret)
+
 	def resume(self):
 		"""Resume target execution"""
 		self.putpacket("c")
@@ -0,0 +1,266 @@
+#!/usr/bin/env python
+
+# gdbbench.py: Measure debug link performance through the GDB protocol
+#
+# This program is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+# Results are printed one JSON object per line, so runs against different
+# firmware versions can be collected and compared by other tools.
+#
+# With -b, firmware built with ENABLE_STATS=1 is instead checked against
+# debug port budgets.  Transaction counts don't depend on the host or the
+# link speed, so running this against the simulator (PROBE_HOST=sim,
+# -d localhost:2000 -s) catches the core and STM32F1 code starting to make
+# extra accesses without any hardware.  The budgets kept with the
+# simulator, in src/platforms/sim/budgets.json, only cover its STM32F1
+# model.  Other drivers need a file of budgets measured on hardware, -B.
+
+import gdb
+import json
+import os
+import re
+import socket
+import time
+from xml.dom.minidom import parseString
+
+def memmap_regions(target, memtype):
+	"""Return (start, length) of every region of memtype in the memory map"""
+	ret = []
+	xmldom = parseString(target.memmap_read())
+	for memrange in xmldom.getElementsByTagName("memory"):
+		if memrange.getAttribute("type") != memtype: continue
+		ret.append((int(memrange.getAttribute("start"), 0),
+			    int(memrange.getAttribute("length"), 0)))
+	xmldom.unlink()
+	return ret
+
+# Budget files hold the most DP transactions and SWD bits for each
+# operation on BUDGET_LENGTH bytes, by driver name
+BUDGET_LENGTH = 16384
+BUDGET_FILE = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+			   "..", "src", "platforms", "sim", "budgets.json")
+
+class TcpSocket:
+	"""Like a serial port, for the simulator's GDB server"""
+	def __init__(self, address):
+		host, port = address.rsplit(":", 1)
+		self.sock = socket.create_connection((host, int(port)))
+		# Packets are written a character at a time
+		self.sock.setsockopt(socket.IPPROTO_TCP, socket.TCP_NODELAY, 1)
+
+	def write(self, data):
+		self.sock.sendall(data)
+
+	def read(self, size=1):
+		return self.sock.recv(size)
+
+def packet_size(target):
+	"""Maximum packet size advertised by the probe"""
+	target.putpacket("qSupported")
+	m = re.search("PacketSize=([0-9a-fA-F]+)", target.getpacket())
+	return int(m.group(1), 16) if m else 400
+
+def report(name, **values):
+	values["test"] = name
+	print(json.dumps(values, sort_keys=True))
+
+def timed(func, count):
+	"""Call func count times and return the elapsed time in seconds"""
+	start = time.time()
+	for i in range(count):
+		func(i)
+	return time.time() - start
+
+def bench_mem(target, base, length, size):
+	"""Read and write bandwidth of length bytes at base in size chunks"""
+	pattern = "".join(chr(i & 0xff) for i in range(size))
+	count = max(1, length / size)
+
+	saved = target.read_mem(base, size)
+	t = timed(lambda i: target.write_mem(base, pattern), count)
+	report("mem_write", size=size, bytes=count * size, seconds=t,
+	       kbps=count * size / t / 1024)
+	t = timed(lambda i: target.read_mem(base, size), count)
+	report("mem_read", size=size, bytes=count * size, seconds=t,
+	       kbps=count * size / t / 1024)
+	target.write_mem(base, saved)
+
+def bench_regs(target, count):
+	t = timed(lambda i: target.read_regs(), count)
+	report("g", count=count, seconds=t, latency_ms=t * 1000 / count)
+
+def bench_step(target, count):
+	def step(i):
+		target.putpacket("s")
+		reply = target.getpacket()
+		while not reply:
+			reply = target.getpacket()
+		if not reply.startswith("T"):
+			raise Exception("Invalid stop response: %r" % reply)
+	t = timed(step, count)
+	report("step", count=count, seconds=t, latency_ms=t * 1000 / count)
+
+def bench_crc(target, base, length):
+	def crc(i):
+		target.putpacket("qCRC:%08X,%08X" % (base, length))
+		reply = target.getpacket()
+		if not reply.startswith("C"):
+			raise Exception("Invalid CRC response: %r" % reply)
+	t = timed(crc, 1)
+	report("qCRC", bytes=length, seconds=t, kbps=length / t / 1024)
+
+def stats_read(target):
+	"""DP transactions and SWD bits since the last call"""
+	text = "".join(target.monitor("stats") or [])
+	target.monitor("stats reset")
+	dp = re.search("DP transactions: ([0-9]+)", text)
+	bits = re.search("SWD bits: ([0-9]+)", text)
+	if not dp or not bits:
+		raise Exception("Firmware not built with ENABLE_STATS=1")
+	return int(dp.group(1)), int(bits.group(1))
+
+def budget_packet(target, packet):
+	target.putpacket(packet)
+	reply = target.getpacket()
+	if reply != "OK" and not reply.startswith("C"):
+		raise Exception("Invalid reply to %s: %r" % (packet[:12], reply))
+
+def budget_check(target, scan, targetno, budget_file):
+	"""Measure each operation and compare it with the driver's budget"""
+	with open(budget_file) as f:
+		budgets = json.load(f)
+	stats_read(target)
+	targets = "".join(target.monitor(scan)).splitlines()
+	m = re.search("^ *%d +(.*?)\\s*$" % targetno, "\n".join(targets), re.M)
+	driver = m.group(1) if m else ""
+	if driver not in budgets:
+		raise Exception("No budget for driver %r in %s" %
+				(driver, budget_file))
+	budget = budgets[driver]
+	ops = [("scan", stats_read(target))]
+	target.attach(targetno)
+	ops.append(("attach", stats_read(target)))
+
+	base, romlen = memmap_regions(target, "flash")[0]
+	length = min(BUDGET_LENGTH, romlen)
+	budget_packet(target, "qCRC:%08X,%08X" % (base, length))
+	ops.append(("qCRC", stats_read(target)))
+	budget_packet(target, "vFlashErase:%08X,%08X" % (base, length))
+	ops.append(("vFlashErase", stats_read(target)))
+	data = "".join(chr((i * 7) & 0xff) for i in range(length))
+	for i in range(0, length, 1024):
+		budget_packet(target, "vFlashWrite:%08X:%s" %
+		              (base + i, data[i:i + 1024]))
+	budget_packet(target, "vFlashDone")
+	ops.append(("vFlashWrite", stats_read(target)))
+
+	failed = 0
+	for name, (dp, bits) in ops:
+		limit = budget[name]
+		ok = dp <= limit[0] and bits <= limit[1]
+		failed += not ok
+		report(name, driver=driver, bytes=length, transactions=dp,
+		       bits=bits, max_transactions=limit[0], max_bits=limit[1],
+		       ok=ok)
+	target.detach()
+	return failed
+
+def bench_flash(target, base, length):
+	"""Erase and program length bytes of flash at base, destroys contents"""
+	data = "".join(chr((i * 7) & 0xff) for i in range(length))
+	target.flash_probe()
+	target.flash_write_prepare(base, data)
+	t = timed(lambda i: target.flash_commit(), 1)
+	report("vFlashWrite", bytes=length, seconds=t, kbps=length / t / 1024)
+
+if __name__ == "__main__":
+	from sys import argv, platform
+	from getopt import getopt
+
+	dev = "COM1" if platform == "win32" else "/dev/ttyACM0"
+	scan = "jtag_scan"
+	targetno = 1
+	length = 16384
+	count = 100
+	flash = None
+	budgets = False
+	budget_file = BUDGET_FILE
+
+	try:
+		opts, args = getopt(argv[1:], "sd:t:l:n:f:bB:")
+		for opt in opts:
+			if opt[0] == "-s": scan = "swdp_scan"
+			elif opt[0] == "-d": dev = opt[1]
+			elif opt[0] == "-t": targetno = int(opt[1])
+			elif opt[0] == "-l": length = int(opt[1], 0)
+			elif opt[0] == "-n": count = int(opt[1], 0)
+			elif opt[0] == "-f": flash = int(opt[1], 0)
+			elif opt[0] == "-b": budgets = True
+			elif opt[0] == "-B":
+				budgets = True
+				budget_file = opt[1]
+			else: raise Exception()
+		if args: raise Exception()
+	except:
+		print("Usage %s [-s] [-d <dev>] [-t <n>] [-l <len>] [-n <count>] [-f <addr>] [-b] [-B <file>]" % argv[0])
+		print("\t-s : Use SW-DP instead of JTAG-DP")
+		print("\t-d : Use target on interface <dev>, or <host>:<port> (default: %s)" % dev)
+		print("\t-t : Connect to target #n (default: %d)" % targetno)
+		print("\t-l : Bytes moved per memory, CRC and flash test (default: %d)" % length)
+		print("\t-n : Repetitions of register and step tests (default: %d)" % count)
+		print("\t-f : Also program flash at <addr>, destroys its contents")
+		print("\t-b : Check DP transactions against the simulator's budgets, erases flash")
+		print("\t-B : As -b, with the budgets in <file>")
+		exit(-1)
+
+	if re.match(".+:[0-9]+$", dev) and not re.match("COM[0-9]+:", dev):
+		target = gdb.Target(TcpSocket(dev))
+	else:
+		from serial import Serial
+		s = Serial(dev, 115200, timeout=3)
+		s.setDTR(1)
+		while s.read(1024):
+			pass
+		target = gdb.Target(s)
+
+	if budgets:
+		exit(1 if budget_check(target, scan, targetno, budget_file) else 0)
+
+	version = "".join(target.monitor("version")).splitlines()
+	report("version", firmware=version[0] if version else "")
+	target.monitor(scan)
+	target.attach(targetno)
+
+	ram = memmap_regions(target, "ram")
+	if not ram:
+		raise Exception("Target has no RAM region in its memory map")
+	base, ramlen = ram[0]
+
+	# Hex encoded replies must fit the packet buffer
+	maxsize = (packet_size(target) - 8) / 2
+	size = 64
+	while size <= maxsize:
+		bench_mem(target, base, min(length, ramlen), size)
+		size *= 2
+
+	bench_regs(target, count)
+	bench_step(target, count)
+
+	rom = memmap_regions(target, "flash")
+	if rom:
+		bench_crc(target, rom[0][0], min(length, rom[0][1]))
+	if flash is not None:
+		bench_flash(target, flash, length)
+
+	target.detach()
@@ -26,13 +26,27 @@
 #include "exception.h"
 #include "command.h"
 #include "gdb_packet.h"
+#include "gdb_main.h"
 #include "target.h"
 #include "morse.h"
 #include "version.h"
+#include "stats.h"
+#include "dptrace.h"
+#include "hex_utils.h"
+#include "rtos.h"
 
 #ifdef PLATFORM_HAS_TRACESWO
 #	include "traceswo.h"
 #endif
+#ifdef PLATFORM_HAS_RTT
+#	include "rtt.h"
+#endif
+#ifdef PLATFORM_HAS_IMAGE
+#	include "image.h"
+#endif
+#ifdef PLATFORM_HAS_SETTINGS
+#	include "settings.h"
+#endif
 
 typedef bool (*cmd_handler)(target *t, int argc, const char **argv);
 
@@ -41,82 +55,153 @@ struct command_s {
 	cmd_handler handler;
 
 	const char *help;
+	uint8_t flags;
 };
 
 static bool cmd_version(void);
 static bool cmd_help(target *t);
 
 static bool cmd_jtag_scan(target *t, int argc, char **argv);
-static bool cmd_swdp_scan(void);
+static bool cmd_swdp_scan(target *t, int argc, const char **argv);
+static bool cmd_scan(target *t, int argc, const char **argv);
+static bool cmd_ap_search(target *t, int argc, const char **argv);
 static bool cmd_targets(void);
+static bool cmd_gang(target *t, int argc, const char **argv);
 static bool cmd_morse(void);
 static bool cmd_connect_srst(target *t, int argc, const char **argv);
 static bool cmd_hard_srst(void);
+static bool cmd_flash_diff(target *t, int argc, const char **argv);
+static bool cmd_flash_verify(target *t, int argc, const char **argv);
+static bool cmd_flash_boost(target *t, int argc, const char **argv);
+static bool cmd_halt_poll(target *t, int argc, const char **argv);
+static bool cmd_readonly(target *t, int argc, const char **argv);
+static bool cmd_fill(target *t, int argc, const char **argv);
+static bool cmd_rtos(target *t, int argc, const char **argv);
+static bool cmd_auto_scan(target *t, int argc, const char **argv);
+#ifdef ENABLE_STATS
+static bool cmd_stats(target *t, int argc, const char **argv);
+#endif
+#ifdef ENABLE_DPTRACE
+static bool cmd_swdtrace(target *t, int argc, const char **argv);
+#endif
 #ifdef PLATFORM_HAS_POWER_SWITCH
 static bool cmd_target_power(target *t, int argc, const char **argv);
 #endif
 #ifdef PLATFORM_HAS_TRACESWO
-static bool cmd_traceswo(void);
+static bool cmd_traceswo(target *t, int argc, const char **argv);
+#endif
+#ifdef PLATFORM_HAS_FREQUENCY
+static bool cmd_frequency(target *t, int argc, const char **argv);
+#endif
+#ifdef PLATFORM_HAS_RTT
+static bool cmd_rtt(target *t, int argc, const char **argv);
+#endif
+#ifdef PLATFORM_HAS_IMAGE
+static bool cmd_image(target *t, int argc, const char **argv);
+static bool cmd_program(target *t);
+#endif
+#ifdef PLATFORM_HAS_SETTINGS
+static bool cmd_config(target *t, int argc, const char **argv);
 #endif
 #ifdef PLATFORM_HAS_DEBUG
 static bool cmd_debug_bmp(target *t, int argc, const char **argv);
 #endif
 
 const struct command_s cmd_list[] = {
-	{"version", (cmd_handler)cmd_version, "Display firmware version info"},
-	{"help", (cmd_handler)cmd_help, "Display help for monitor commands"},
-	{"jtag_scan", (cmd_handler)cmd_jtag_scan, "Scan JTAG chain for devices" },
-	{"swdp_scan", (cmd_handler)cmd_swdp_scan, "Scan SW-DP for devices" },
-	{"targets", (cmd_handler)cmd_targets, "Display list of available targets" },
-	{"morse", (cmd_handler)cmd_morse, "Display morse error message" },
-	{"connect_srst", (cmd_handler)cmd_connect_srst, "Configure connect under SRST: (enable|disable)" },
-	{"hard_srst", (cmd_handler)cmd_hard_srst, "Force a pulse on the hard SRST line - disconnects target" },
+	{"version", (cmd_handler)cmd_version, "Display firmware version info", 0},
+	{"help", (cmd_handler)cmd_help, "Display help for monitor commands", 0},
+	{"jtag_scan", (cmd_handler)cmd_jtag_scan, "Scan JTAG chain for devices", CMD_HALTED },
+	{"swdp_scan", (cmd_handler)cmd_swdp_scan, "Scan SW-DP for devices: [TARGETSEL ...] for a multi-drop bus", CMD_HALTED },
+	{"scan", (cmd_handler)cmd_scan, "Repeat the last scan, 'full' ignores the cached topology: [full]", CMD_HALTED },
+	{"ap_search", (cmd_handler)cmd_ap_search, "Set the APs probed by scans: (all|gap <n>|<apsel> ...)", 0 },
+	{"targets", (cmd_handler)cmd_targets, "Display list of available targets", 0 },
+	{"gang", (cmd_handler)cmd_gang, "Flash all targets like this one together: (enable|disable)", 0 },
+	{"morse", (cmd_handler)cmd_morse, "Display morse error message", 0 },
+	{"connect_srst", (cmd_handler)cmd_connect_srst, "Configure connect under SRST: (enable|disable)", 0 },
+	{"hard_srst", (cmd_handler)cmd_hard_srst, "Force a pulse on the hard SRST line - disconnects target", CMD_HALTED },
+	{"flash_diff", (cmd_handler)cmd_flash_diff, "Only reprogram flash blocks that changed: (enable|disable)", 0 },
+	{"flash_verify", (cmd_handler)cmd_flash_verify, "Check the flash programmed by a load against its CRC: (enable|disable)", 0 },
+	{"flash_boost", (cmd_handler)cmd_flash_boost, "Speed up the target's clock while flashing: (enable|disable)", 0 },
+	{"halt_poll", (cmd_handler)cmd_halt_poll, "Set halt polling while running: (immediate|fixed <ms>|backoff <max ms>)", 0 },
+	{"readonly", (cmd_handler)cmd_readonly, "Cache reads from read-only memory while halted: (clear|<addr> <len>)", 0 },
+	{"auto_scan", (cmd_handler)cmd_auto_scan, "Scan for targets when target power appears, until GDB attaches: (enable|disable)", 0 },
+	{"rtos", (cmd_handler)cmd_rtos, "Show FreeRTOS tasks as threads: [enable|disable]", 0 },
+	{"fill", (cmd_handler)cmd_fill, "Fill memory with a repeated pattern of hex bytes: <addr> <len> <pattern>", CMD_HALTED },
+#ifdef ENABLE_STATS
+	{"stats", (cmd_handler)cmd_stats, "Display debug port and GDB packet counters: [reset]", 0 },
+#endif
+#ifdef ENABLE_DPTRACE
+	{"swdtrace", (cmd_handler)cmd_swdtrace, "Dump the last debug port transactions as hex 'us request ack waits': [clear]", 0 },
+#endif
 #ifdef PLATFORM_HAS_POWER_SWITCH
-	{"tpwr", (cmd_handler)cmd_target_power, "Supplies power to the target: (enable|disable)"},
+	{"tpwr", (cmd_handler)cmd_target_power, "Supplies power to the target: (enable|disable)", 0},
 #endif
 #ifdef PLATFORM_HAS_TRACESWO
-	{"traceswo", (cmd_handler)cmd_traceswo, "Start trace capture" },
+	{"traceswo", (cmd_handler)cmd_traceswo, "Start trace capture, Manchester or NRZ at baud: [baud|stats|filter [port mask] [nohw] [nots]]", 0 },
+#endif
+#ifdef PLATFORM_HAS_FREQUENCY
+	{"frequency", (cmd_handler)cmd_frequency, "Set maximum SWJ frequency: (<Hz>[k|M]|auto [addr])", 0 },
+#endif
+#ifdef PLATFORM_HAS_RTT
+	{"rtt", (cmd_handler)cmd_rtt, "SEGGER RTT on the UART port while the target runs: (enable|disable|address <addr>|auto)", 0 },
+#endif
+#ifdef PLATFORM_HAS_IMAGE
+	{"image", (cmd_handler)cmd_image, "Image in probe flash for 'program': ([capture]), capture records the next GDB load", 0 },
+	{"program", (cmd_handler)cmd_program, "Erase, program and verify the target from the image in probe flash", CMD_HALTED },
+#endif
+#ifdef PLATFORM_HAS_SETTINGS
+	{"config", (cmd_handler)cmd_config, "Settings applied at power up, kept in probe flash: (save|show|clear)", 0 },
 #endif
 #ifdef PLATFORM_HAS_DEBUG
-	{"debug_bmp", (cmd_handler)cmd_debug_bmp, "Output BMP \"debug\" strings to the second vcom: (enable|disable)"},
+	{"debug_bmp", (cmd_handler)cmd_debug_bmp, "Output BMP \"debug\" strings to the second vcom: (enable|disable)", 0},
 #endif
-	{NULL, NULL, NULL}
+	{NULL, NULL, NULL, 0}
 };
 
 static bool connect_assert_srst;
+static bool scanned;
+static bool last_scan_jtag;
+/* TARGETSEL values given to the last 'swdp_scan', reused by 'scan' */
+#define SWDP_TARGETSEL_MAX 8
+static uint32_t swdp_targetsel[SWDP_TARGETSEL_MAX];
+static size_t swdp_targetsel_count;
 #ifdef PLATFORM_HAS_DEBUG
 bool debug_bmp;
 #endif
 
-int command_process(target *t, char *cmd)
+/* Words of a command line looked at, any more are dropped */
+#define COMMAND_ARGC_MAX 32
+
+int command_process(target *t, char *cmd, bool running)
 {
 	const struct command_s *c;
 	int argc = 0;
-	const char **argv;
-
-	/* Initial estimate for argc */
-	for(char *s = cmd; *s; s++)
-		if((*s == ' ') || (*s == '\t')) argc++;
-
-	argv = alloca(sizeof(const char *) * argc);
+	const char *argv[COMMAND_ARGC_MAX + 1];
 
 	/* Tokenize cmd to find argv */
-	for(argc = 0, argv[argc] = strtok(cmd, " \t");
-		argv[argc]; argv[++argc] = strtok(NULL, " \t"));
+	for(char *tok = strtok(cmd, " \t"); tok && (argc < COMMAND_ARGC_MAX);
+	    tok = strtok(NULL, " \t"))
+		argv[argc++] = tok;
+	argv[argc] = NULL;
 
 	/* Look for match and call handler */
 	for(c = cmd_list; c->cmd; c++) {
 		/* Accept a partial match as GDB does.
 		 * So 'mon ver' will match 'monitor version'
 		 */
-		if ((argc == 0) || !strncmp(argv[0], c->cmd, strlen(argv[0])))
+		if ((argc == 0) || !strncmp(argv[0], c->cmd, strlen(argv[0]))) {
+			if (running && (c->flags & CMD_HALTED)) {
+				gdb_out("Halt the target first\n");
+				return 1;
+			}
 			return !c->handler(t, argc, argv);
+		}
 	}
 
 	if (!t)
 		return -1;
 
-	return target_command(t, argc, argv);
+	return target_command(t, argc, argv, running);
 }
 
 bool cmd_version(void)
@@ -150,6 +235,11 @@ static bool cmd_jtag_scan(target *t, int argc, char **argv)
 	(void)t;
 	uint8_t irlens[argc];
 
+	if (platform_swd_port()) {
+		gdb_out("JTAG is only available on the first port\n");
+		return false;
+	}
+
 	gdb_outf("Target voltage: %s\n", platform_target_voltage());
 
 	if (argc > 1) {
@@ -162,6 +252,8 @@ static bool cmd_jtag_scan(target *t, int argc, char **argv)
 	if(connect_assert_srst)
 		platform_srst_set_val(true); /* will be deasserted after attach */
 
+	scanned = true;
+	last_scan_jtag = true;
 	int devs = -1;
 	volatile struct exception e;
 	TRY_CATCH (e, EXCEPTION_ALL) {
@@ -186,17 +278,32 @@ static bool cmd_jtag_scan(target *t, int argc, char **argv)
 	return true;
 }
 
-bool cmd_swdp_scan(void)
+bool cmd_swdp_scan(target *t, int argc, const char **argv)
 {
+	(void)t;
+
+	if (argc > SWDP_TARGETSEL_MAX + 1) {
+		gdb_outf("At most %d TARGETSEL values\n", SWDP_TARGETSEL_MAX);
+		return false;
+	}
+	/* Leave the list alone when called from 'scan' */
+	if (argv) {
+		for (int i = 1; i < argc; i++)
+			swdp_targetsel[i - 1] = strtoul(argv[i], NULL, 0);
+		swdp_targetsel_count = argc - 1;
+	}
+
 	gdb_outf("Target voltage: %s\n", platform_target_voltage());
 
 	if(connect_assert_srst)
 		platform_srst_set_val(true); /* will be deasserted after attach */
 
+	scanned = true;
+	last_scan_jtag = false;
 	int devs = -1;
 	volatile struct exception e;
 	TRY_CATCH (e, EXCEPTION_ALL) {
-		devs = adiv5_swdp_scan();
+		devs = adiv5_swdp_scan(swdp_targetsel, swdp_targetsel_count);
 	}
 	switch (e.type) {
 	case EXCEPTION_TIMEOUT:
@@ -219,12 +326,97 @@ bool cmd_swdp_scan(void)
 
 }
 
+/* Scans reuse the DP topology found last time, unless asked not to */
+static bool cmd_scan(target *t, int argc, const char **argv)
+{
+	const char *args[] = {"jtag_scan"};
+
+	if (argc > 1) {
+		if (strcmp(argv[1], "full")) {
+			gdb_out("usage: monitor scan [full]\n");
+			return false;
+		}
+		adiv5_scan_cache_flush();
+	}
+	if (last_scan_jtag)
+		return cmd_jtag_scan(t, 1, (char **)args);
+	return cmd_swdp_scan(t, 0, NULL);
+}
+
+static bool cmd_ap_search(target *t, int argc, const char **argv)
+{
+	(void)t;
+	if (argc == 1) {
+		if (adiv5_ap_list_len) {
+			gdb_out("AP search: listed");
+			for (int i = 0; i < adiv5_ap_list_len; i++)
+				gdb_outf(" %d", adiv5_ap_list[i]);
+			gdb_out("\n");
+		} else if (adiv5_ap_gap) {
+			gdb_outf("AP search: until %d missing\n", adiv5_ap_gap);
+		} else {
+			gdb_out("AP search: all\n");
+		}
+		return true;
+	}
+
+	if (!strcmp(argv[1], "all")) {
+		adiv5_ap_gap = 0;
+		adiv5_ap_list_len = 0;
+	} else if (!strcmp(argv[1], "gap")) {
+		if (argc != 3)
+			return false;
+		adiv5_ap_gap = strtoul(argv[2], NULL, 0);
+		adiv5_ap_list_len = 0;
+	} else {
+		if (argc - 1 > ADIV5_AP_LIST_MAX)
+			return false;
+		for (int i = 1; i < argc; i++)
+			adiv5_ap_list[i - 1] = strtoul(argv[i], NULL, 0);
+		adiv5_ap_list_len = argc - 1;
+	}
+	/* The cached topology may have been found with other APs */
+	adiv5_scan_cache_flush();
+	return true;
+}
+
 static void display_target(int i, target *t, void *context)
 {
 	(void)context;
 	gdb_outf("%2d   %c  %s\n", i, target_attached(t)?'*':' ', target_driver_name(t));
 }
 
+static void display_gang(int i, target *t, void *context)
+{
+	int status = target_gang_status(t);
+
+	(void)context;
+	if (status)
+		gdb_outf("%2d   %s\n", i, (status < 0) ? "FAILED" : "ok");
+}
+
+static bool cmd_gang(target *t, int argc, const char **argv)
+{
+	if (argc > 1) {
+		if (!strcmp(argv[1], "enable")) {
+			if (!t) {
+				gdb_out("Attach to a target first\n");
+				return false;
+			}
+			gdb_outf("Ganged with %d targets\n", target_gang_enable(t));
+			return true;
+		} else if (!strcmp(argv[1], "disable")) {
+			target_gang_disable();
+			return true;
+		}
+		gdb_out("usage: monitor gang [enable|disable]\n");
+		return false;
+	}
+	gdb_out("No. Gang\n");
+	target_foreach(display_gang, NULL);
+	return true;
+}
+
 bool cmd_targets(void)
 {
 	gdb_out("Available Targets:\n");
@@ -263,6 +455,214 @@ static bool cmd_hard_srst(void)
 	return true;
 }
 
+static bool cmd_flash_diff(target *t, int argc, const char **argv)
+{
+	(void)t;
+	if (argc == 1)
+		gdb_outf("Differential flashing: %s\n",
+			 target_flash_diff ? "enabled" : "disabled");
+	else
+		target_flash_diff = !strcmp(argv[1], "enable");
+	return true;
+}
+
+static bool cmd_flash_verify(target *t, int argc, const char **argv)
+{
+	(void)t;
+	if (argc == 1)
+		gdb_outf("Flash verify: %s\n",
+			 target_flash_verify ? "enabled" : "disabled");
+	else
+		target_flash_verify = !strcmp(argv[1], "enable");
+	return true;
+}
+
+static bool cmd_flash_boost(target *t, int argc, const char **argv)
+{
+	(void)t;
+	if (argc == 1)
+		gdb_outf("Flash clock boost: %s\n",
+			 target_flash_boost ? "enabled" : "disabled");
+	else
+		target_flash_boost = !strcmp(argv[1], "enable");
+	return true;
+}
+
+static bool cmd_halt_poll(target *t, int argc, const char **argv)
+{
+	(void)t;
+	if (argc == 1) {
+		if (gdb_poll_interval == 0)
+			gdb_out("Halt polling: immediate\n");
+		else
+			gdb_outf("Halt polling: %s %"PRIu32" ms\n",
+			         gdb_poll_backoff ? "backoff" : "fixed",
+			         gdb_poll_interval);
+		return true;
+	}
+
+	if (!strcmp(argv[1], "immediate")) {
+		gdb_poll_interval = 0;
+		gdb_poll_backoff = false;
+		return true;
+	}
+	if ((argc != 3) ||
+	    (strcmp(argv[1], "fixed") && strcmp(argv[1], "backoff")))
+		return false;
+
+	gdb_poll_interval = strtoul(argv[2], NULL, 0);
+	gdb_poll_backoff = !strcmp(argv[1], "backoff");
+	return true;
+}
+
+#ifdef ENABLE_STATS
+struct stats stats;
+
+static bool cmd_stats(target *t, int argc, const char **argv)
+{
+	(void)t;
+	if (argc > 1) {
+		if (strcmp(argv[1], "reset"))
+			return false;
+		memset(&stats, 0, sizeof(stats));
+		return true;
+	}
+
+	gdb_outf("DP transactions: %"PRIu32", WAIT retries: %"PRIu32"\n",
+	         stats.dp_transactions, stats.dp_wait);
+	gdb_outf("FAULT ACKs: %"PRIu32", parity errors: %"PRIu32"\n",
+	         stats.dp_fault, stats.dp_parity);
+	gdb_outf("SWD bits: %"PRIu32"\n", stats.swd_bits);
+	gdb_outf("Memory read: %"PRIu32" bytes, written: %"PRIu32" bytes\n",
+	         stats.mem_read_bytes, stats.mem_write_bytes);
+	gdb_outf("Stub runs: %"PRIu32"\n", stats.stub_runs);
+	if (stats.flash_sessions) {
+		gdb_outf("Flash sessions: %"PRIu32", erase: %"PRIu32" ms, "
+		         "write: %"PRIu32" ms, done: %"PRIu32" ms\n",
+		         stats.flash_sessions, stats.flash_erase_us / 1000,
+		         stats.flash_write_us / 1000,
+		         stats.flash_done_us / 1000);
+		gdb_outf("Flash transfer: %"PRIu32" ms, stub wait: %"PRIu32
+		         " ms, status polls: %"PRIu32" ms\n",
+		         stats.flash_xfer_us / 1000,
+		         stats.flash_stub_us / 1000,
+		         stats.flash_poll_us / 1000);
+		gdb_outf("Flash skipped as erased: %"PRIu32" bytes\n",
+		         stats.flash_skipped);
+	}
+	for (int i = 0; i < STATS_PACKETS; i++) {
+		if (!stats.packet_count[i])
+			continue;
+		gdb_outf("Packet '%c': %"PRIu32" in %"PRIu32" ms\n",
+		         STATS_PACKET_FIRST + i, stats.packet_count[i],
+		         stats.packet_ms[i]);
+	}
+	return true;
+}
+#endif
+
+#ifdef ENABLE_DPTRACE
+static bool cmd_swdtrace(target *t, int argc, const char **argv)
+{
+	(void)t;
+	if (argc > 1) {
+		if (strcmp(argv[1], "clear"))
+			return false;
+		dptrace_clear();
+		return true;
+	}
+
+	/* One line per transaction, oldest first, for host scripts */
+	unsigned count = dptrace_count();
+	for (unsigned i = 0; i < count; i++) {
+		const struct dptrace_entry *e = dptrace_entry(i);
+		gdb_outf("%08"PRIx32" %02x %x %x\n", e->time_us, e->request,
+		         e->ack, e->waits);
+	}
+	return true;
+}
+#endif
+
+static bool cmd_readonly(target *t, int argc, const char **argv)
+{
+	(void)t;
+	target_addr start;
+	size_t len;
+
+	if (argc == 1) {
+		for (unsigned i = 0; target_mem_readonly_get(i, &start, &len); i++)
+			gdb_outf("Read-only: 0x%08"PRIx32" length 0x%"PRIx32"\n",
+			         start, (uint32_t)len);
+		return true;
+	}
+
+	if (!strcmp(argv[1], "clear")) {
+		target_mem_readonly_clear();
+		return true;
+	}
+	if (argc != 3)
+		return false;
+
+	start = strtoul(argv[1], NULL, 0);
+	len = strtoul(argv[2], NULL, 0);
+	if ((len == 0) || (len - 1 > (target_addr)~start)) {
+		gdb_out("Region is empty or wraps past the top of memory\n");
+		return false;
+	}
+	if (!target_mem_readonly_add(start, len)) {
+		gdb_out("Too many read-only regions\n");
+		return false;
+	}
+	return true;
+}
+
+static bool cmd_fill(target *t, int argc, const char **argv)
+{
+	uint8_t pattern[64];
+	size_t plen;
+
+	if (!t) {
+		gdb_out("Attach to a target first\n");
+		return false;
+	}
+	if (argc != 4)
+		return false;
+	plen = strlen(argv[3]);
+	if ((plen == 0) || (plen % 2) || (plen > 2 * sizeof(pattern)) ||
+	    (strspn(argv[3], "0123456789abcdefABCDEF") != plen)) {
+		gdb_out("Pattern must be up to 64 hex bytes\n");
+		return false;
+	}
+	unhexify(pattern, argv[3], plen / 2);
+
+	if (target_mem_fill(t, strtoul(argv[1], NULL, 0),
+	                    strtoul(argv[2], NULL, 0), pattern, plen / 2)) {
+		gdb_out("Fill failed\n");
+		return false;
+	}
+	return true;
+}
+
+static bool cmd_rtos(target *t, int argc, const char **argv)
+{
+	unsigned count = 0;
+
+	if (argc > 1) {
+		rtos_enable(!strcmp(argv[1], "enable"));
+		return true;
+	}
+	gdb_outf("FreeRTOS tasks: %s, symbols %s\n",
+	         rtos_enabled() ? "enabled" : "disabled",
+	         rtos_symbols_found() ? "found" : "not found");
+	if (!t)
+		return true;
+	const struct rtos_thread *th = rtos_threads(t, &count);
+	for (unsigned i = 0; th && (i < count); i++)
+		gdb_outf("0x%08" PRIx32 " %-16s %s\n", th[i].id, th[i].name,
+		         rtos_state_name(th[i].state));
+	return true;
+}
+
 #ifdef PLATFORM_HAS_POWER_SWITCH
 static bool cmd_target_power(target *t, int argc, const char **argv)
 {
@@ -277,15 +677,229 @@ static bool cmd_target_power(target *t, int argc, const char **argv)
 #endif
 
 #ifdef PLATFORM_HAS_TRACESWO
-static bool cmd_traceswo(void)
+/* Last capture started, for the settings */
+static bool traceswo_started;
+static uint32_t traceswo_baud;
+
+static bool cmd_traceswo(target *t, int argc, const char **argv)
 {
 	extern char serial_no[9];
-	traceswo_init();
+	uint32_t baud = 0;
+	(void)t;
+
+	if ((argc > 1) && !strcmp(argv[1], "stats")) {
+		uint32_t dropped, overflows;
+		traceswo_stats(&dropped, &overflows);
+		gdb_outf("Dropped %" PRIu32 " bytes in %" PRIu32 " overflows\n",
+		         dropped, overflows);
+		return true;
+	}
+	if ((argc > 1) && !strcmp(argv[1], "filter")) {
+		uint32_t ports = 0xffffffff;
+		bool drop_hw = false, drop_ts = false;
+		for (int i = 2; i < argc; i++) {
+			if (!strcmp(argv[i], "nohw"))
+				drop_hw = true;
+			else if (!strcmp(argv[i], "nots"))
+				drop_ts = true;
+			else
+				ports = strtoul(argv[i], NULL, 0);
+		}
+		traceswo_filter_set(ports, drop_hw, drop_ts);
+		return true;
+	}
+	if (argc > 1)
+		baud = strtoul(argv[1], NULL, 0);
+	if (!traceswo_init(baud)) {
+		gdb_outf("%s trace capture not supported on this probe\n",
+		         baud ? "NRZ" : "Manchester");
+		return false;
+	}
+	traceswo_started = true;
+	traceswo_baud = baud;
 	gdb_outf("%s:%02X:%02X\n", serial_no, 5, 0x85);
 	return true;
 }
 #endif
 
+#ifdef PLATFORM_HAS_FREQUENCY
+#define FREQUENCY_AUTO_START	100000
+#define FREQUENCY_AUTO_WORDS	64
+
+/* Read a block of target memory and compare it against a reference copy.
+ * A communication fault at this speed counts as a failed probe.
+ */
+static bool frequency_probe(target *t, uint32_t addr, const uint32_t *ref)
+{
+	uint32_t buf[FREQUENCY_AUTO_WORDS];
+	volatile bool ok = false;
+	volatile struct exception e;
+
+	TRY_CATCH (e, EXCEPTION_ALL) {
+		for (int i = 0; i < 4; i++) {
+			ok = !target_mem_read(t, buf, addr, sizeof(buf)) &&
+				!memcmp(buf, ref, sizeof(buf));
+			if (!ok)
+				break;
+		}
+	}
+	return ok && !e.type;
+}
+
+/* Step the clock up from a safe speed until the target starts to report
+ * faults, then back off to the last frequency that worked.
+ */
+static bool frequency_auto(target *t, uint32_t addr)
+{
+	uint32_t ref[FREQUENCY_AUTO_WORDS];
+	uint32_t good;
+	volatile struct exception e;
+
+	if (!t) {
+		gdb_out("Attach to a target first\n");
+		return false;
+	}
+
+	platform_max_frequency_set(FREQUENCY_AUTO_START);
+	good = platform_max_frequency_get();
+	TRY_CATCH (e, EXCEPTION_ALL) {
+		if (target_mem_read(t, ref, addr, sizeof(ref)))
+			e.type = EXCEPTION_ERROR;
+	}
+	if (e.type) {
+		gdb_outf("Can't read 0x%08"PRIx32" at %"PRIu32" Hz\n", addr, good);
+		return false;
+	}
+
+	for (;;) {
+		uint32_t freq = platform_max_frequency_get();
+		platform_max_frequency_set(freq + freq / 4 + 1);
+		if (platform_max_frequency_get() <= freq)
+			break;	/* Reached the platform limit */
+		if (!frequency_probe(t, addr, ref))
+			break;
+		good = platform_max_frequency_get();
+	}
+
+	platform_max_frequency_set(good);
+	/* Read once more to clear any sticky errors left by the failing step */
+	TRY_CATCH (e, EXCEPTION_ALL) {
+		target_mem_read(t, ref, addr, sizeof(ref[0]));
+	}
+	gdb_outf("Max SWJ frequency: %"PRIu32" Hz\n", good);
+	return true;
+}
+
+static bool cmd_frequency(target *t, int argc, const char **argv)
+{
+	if (argc > 1) {
+		if (!strcmp(argv[1], "auto"))
+			return frequency_auto(t,
+				argc > 2 ? strtoul(argv[2], NULL, 0) : 0);
+
+		char *p;
+		unsigned long freq = strtoul(argv[1], &p, 10);
+		unsigned long scale = 1;
+		if (!strcmp(p, "k"))
+			scale = 1000;
+		else if (!strcmp(p, "M"))
+			scale = 1000 * 1000;
+		else if (*p)
+			return false;
+		if ((p == argv[1]) || (argv[1][0] == '-') || (freq == 0) ||
+		    (freq > UINT32_MAX / scale))
+			return false;
+		platform_max_frequency_set(freq * scale);
+	}
+	gdb_outf("Max SWJ frequency: %"PRIu32" Hz\n",
+		 platform_max_frequency_get());
+	return true;
+}
+#endif
+
+#ifdef PLATFORM_HAS_RTT
+static bool cmd_rtt(target *t, int argc, const char **argv)
+{
+	(void)t;
+	if (argc > 1) {
+		if (!strcmp(argv[1], "enable"))
+			rtt_enable(true);
+		else if (!strcmp(argv[1], "disable"))
+			rtt_enable(false);
+		else if (!strcmp(argv[1], "auto"))
+			rtt_set_address(0);
+		else if (!strcmp(argv[1], "address") && (argc > 2))
+			rtt_set_address(strtoul(argv[2], NULL, 0));
+		else
+			return false;
+	}
+
+	target_addr cb;
+	gdb_outf("RTT: %s, ", rtt_enabled() ? "enabled" : "disabled");
+	if (rtt_found(&cb))
+		gdb_outf("control block at 0x%08"PRIx32"\n", cb);
+	else if (rtt_address())
+		gdb_outf("control block expected at 0x%08"PRIx32"\n",
+		         rtt_address());
+	else
+		gdb_outf("control block searched for in RAM\n");
+	return true;
+}
+#endif
+
+#ifdef PLATFORM_HAS_IMAGE
+static bool cmd_image(target *t, int argc, const char **argv)
+{
+	unsigned segments;
+	size_t size;
+	uint32_t crc;
+
+	(void)t;
+	if (argc > 1) {
+		if (strcmp(argv[1], "capture"))
+			return false;
+		if (!image_capture_start()) {
+			gdb_out("Erasing the image store failed\n");
+			return false;
+		}
+		gdb_out("The next load is stored in probe flash\n");
+		return true;
+	}
+
+	if (image_capturing())
+		gdb_out("Waiting for a load to capture\n");
+	else if (image_info(&segments, &size, &crc))
+		gdb_outf("Image: %u bytes in %u ranges, CRC 0x%08"PRIx32"\n",
+		         (unsigned)size, segments, crc);
+	else
+		gdb_out("No image stored\n");
+	return true;
+}
+
+static bool cmd_program(target *t)
+{
+	if (!t) {
+		gdb_out("Attach to a target first\n");
+		return false;
+	}
+	switch (image_program(t)) {
+	case IMAGE_PROGRAM_OK:
+		gdb_out("Programmed and verified\n");
+		return true;
+	case IMAGE_PROGRAM_NONE:
+		gdb_out("No image stored\n");
+		break;
+	case IMAGE_PROGRAM_FLASH:
+		gdb_out("Programming failed\n");
+		break;
+	case IMAGE_PROGRAM_VERIFY:
+		gdb_out("Verify failed\n");
+		break;
+	}
+	return false;
+}
+#endif
+
 #ifdef PLATFORM_HAS_DEBUG
 static bool cmd_debug_bmp(target *t, int argc, const char **argv)
 {
@@ -298,3 +912,293 @@ static bool cmd_debug_bmp(target *t, int argc, const char **argv)
 	return true;
 }
 #endif
+
+/* Repeat the last scan with no GDB to report to, so a failed one is
+ * only told by the LED */
+static void scan_quiet(void)
+{
+	volatile struct exception e;
+	volatile int devs = -1;
+
+	if (connect_assert_srst)
+		platform_srst_set_val(true);
+	TRY_CATCH (e, EXCEPTION_ALL) {
+		if (last_scan_jtag)
+			devs = jtag_scan(NULL);
+		else
+			devs = adiv5_swdp_scan(swdp_targetsel,
+			                       swdp_targetsel_count);
+	}
+	if (e.type || (devs <= 0))
+		platform_srst_set_val(false);
+	else
+		morse(NULL, false);
+}
+
+/* While nothing is attached, the target list follows the target's power.
+ * Scans wait a little for the target to come out of reset, and are
+ * retried while they find nothing. */
+#define AUTO_SCAN_INTERVAL	100	/* ms between power checks */
+#define AUTO_SCAN_SETTLE	200
+#define AUTO_SCAN_RETRY		2000
+
+static bool auto_scan;
+static bool auto_scan_powered;
+static platform_timeout auto_scan_timeout;
+
+static bool cmd_auto_scan(target *t, int argc, const char **argv)
+{
+	(void)t;
+	if (argc == 1) {
+		gdb_outf("Auto scan: %s\n", auto_scan ? "enabled" : "disabled");
+	} else if (auto_scan != !strcmp(argv[1], "enable")) {
+		auto_scan = !auto_scan;
+		auto_scan_powered = false;
+	}
+	return true;
+}
+
+int command_auto_scan(void)
+{
+	if (!auto_scan)
+		return -1;
+#ifdef PLATFORM_HAS_TARGET_SENSE
+	if (!platform_target_present()) {
+		if (auto_scan_powered)
+			target_list_free();
+		auto_scan_powered = false;
+		return AUTO_SCAN_INTERVAL;
+	}
+#endif
+	if (!auto_scan_powered) {
+		auto_scan_powered = true;
+		platform_timeout_set(&auto_scan_timeout, AUTO_SCAN_SETTLE);
+	}
+	if (target_list_empty() &&
+	    platform_timeout_is_expired(&auto_scan_timeout)) {
+		scan_quiet();
+		platform_timeout_set(&auto_scan_timeout, AUTO_SCAN_RETRY);
+	}
+	return AUTO_SCAN_INTERVAL;
+}
+
+#ifdef PLATFORM_HAS_SETTINGS
+/* The last scan, done again at power up */
+struct config_scan {
+	uint8_t jtag;
+	uint8_t count;
+	uint32_t targetsel[SWDP_TARGETSEL_MAX];
+};
+
+static void config_put_bool(uint8_t key, bool val)
+{
+	uint8_t b = val;
+	settings_put(key, &b, sizeof(b));
+}
+
+static bool config_get_bool(uint8_t key, bool *val)
+{
+	uint8_t b;
+	if (settings_get(key, &b, sizeof(b)) != sizeof(b))
+		return false;
+	*val = b;
+	return true;
+}
+
+static bool config_save(void)
+{
+	uint8_t ap[2 + ADIV5_AP_LIST_MAX] = {adiv5_ap_gap, adiv5_ap_list_len};
+	uint32_t halt_poll[2] = {gdb_poll_interval, gdb_poll_backoff};
+	const void *cache;
+	size_t cache_len = adiv5_scan_cache_get(&cache);
+
+	settings_begin();
+	config_put_bool(SETTINGS_CONNECT_SRST, connect_assert_srst);
+	config_put_bool(SETTINGS_FLASH_DIFF, target_flash_diff);
+	config_put_bool(SETTINGS_FLASH_VERIFY, target_flash_verify);
+	config_put_bool(SETTINGS_FLASH_BOOST, target_flash_boost);
+	config_put_bool(SETTINGS_AUTO_SCAN, auto_scan);
+	config_put_bool(SETTINGS_RTOS, rtos_enabled());
+	settings_put(SETTINGS_HALT_POLL, halt_poll, sizeof(halt_poll));
+	memcpy(ap + 2, adiv5_ap_list, adiv5_ap_list_len);
+	settings_put(SETTINGS_AP_SEARCH, ap, 2 + adiv5_ap_list_len);
+#ifdef PLATFORM_HAS_FREQUENCY
+	uint32_t freq = platform_max_frequency_get();
+	settings_put(SETTINGS_FREQUENCY, &freq, sizeof(freq));
+#endif
+#ifdef PLATFORM_HAS_RTT
+	uint32_t rtt[2] = {rtt_enabled(), rtt_address()};
+	settings_put(SETTINGS_RTT, rtt, sizeof(rtt));
+#endif
+#ifdef PLATFORM_HAS_TRACESWO
+	if (traceswo_started)
+		settings_put(SETTINGS_TRACESWO, &traceswo_baud,
+		             sizeof(traceswo_baud));
+#endif
+	if (scanned) {
+		struct config_scan scan = {
+			.jtag = last_scan_jtag,
+			.count = swdp_targetsel_count,
+		};
+		memcpy(scan.targetsel, swdp_targetsel,
+		       sizeof(scan.targetsel));
+		settings_put(SETTINGS_SCAN, &scan, sizeof(scan));
+		settings_put(SETTINGS_SCAN_CACHE, cache, cache_len);
+	}
+	return settings_save();
+}
+
+void command_config_load(void)
+{
+	uint8_t ap[2 + ADIV5_AP_LIST_MAX];
+	uint32_t halt_poll[2];
+	uint8_t cache[512];
+	struct config_scan scan;
+	int len;
+
+	config_get_bool(SETTINGS_CONNECT_SRST, &connect_assert_srst);
+	config_get_bool(SETTINGS_FLASH_DIFF, &target_flash_diff);
+	config_get_bool(SETTINGS_FLASH_VERIFY, &target_flash_verify);
+	config_get_bool(SETTINGS_FLASH_BOOST, &target_flash_boost);
+	config_get_bool(SETTINGS_AUTO_SCAN, &auto_scan);
+	bool rtos;
+	if (config_get_bool(SETTINGS_RTOS, &rtos))
+		rtos_enable(rtos);
+	if (settings_get(SETTINGS_HALT_POLL, halt_poll,
+	                 sizeof(halt_poll)) == sizeof(halt_poll)) {
+		gdb_poll_interval = halt_poll[0];
+		gdb_poll_backoff = halt_poll[1];
+	}
+	len = settings_get(SETTINGS_AP_SEARCH, ap, sizeof(ap));
+	if ((len >= 2) && (ap[1] <= ADIV5_AP_LIST_MAX) && (len == 2 + ap[1])) {
+		adiv5_ap_gap = ap[0];
+		adiv5_ap_list_len = ap[1];
+		memcpy(adiv5_ap_list, ap + 2, ap[1]);
+	}
+#ifdef PLATFORM_HAS_FREQUENCY
+	uint32_t freq;
+	if (settings_get(SETTINGS_FREQUENCY, &freq, sizeof(freq)) ==
+	    sizeof(freq))
+		platform_max_frequency_set(freq);
+#endif
+#ifdef PLATFORM_HAS_RTT
+	uint32_t rtt[2];
+	if (settings_get(SETTINGS_RTT, rtt, sizeof(rtt)) == sizeof(rtt)) {
+		rtt_set_address(rtt[1]);
+		rtt_enable(rtt[0]);
+	}
+#endif
+#ifdef PLATFORM_HAS_TRACESWO
+	uint32_t baud;
+	if ((settings_get(SETTINGS_TRACESWO, &baud, sizeof(baud)) ==
+	     sizeof(baud)) && traceswo_init(baud)) {
+		traceswo_started = true;
+		traceswo_baud = baud;
+	}
+#endif
+	len = settings_get(SETTINGS_SCAN_CACHE, cache, sizeof(cache));
+	if ((len > 0) && ((size_t)len <= sizeof(cache)))
+		adiv5_scan_cache_set(cache, len);
+	if ((settings_get(SETTINGS_SCAN, &scan, sizeof(scan)) ==
+	     sizeof(scan)) && (scan.count <= SWDP_TARGETSEL_MAX)) {
+		scanned = true;
+		last_scan_jtag = scan.jtag;
+		memcpy(swdp_targetsel, scan.targetsel,
+		       sizeof(swdp_targetsel));
+		swdp_targetsel_count = scan.count;
+		scan_quiet();
+	}
+}
+
+/* The stored settings, as the commands that would set them */
+static void config_show(void)
+{
+	uint8_t ap[2 + ADIV5_AP_LIST_MAX];
+	uint32_t val[2];
+	struct config_scan scan;
+	bool b;
+	int len;
+
+	if (!settings_size()) {
+		gdb_out("No settings stored\n");
+		return;
+	}
+	if (config_get_bool(SETTINGS_CONNECT_SRST, &b))
+		gdb_outf("connect_srst %s\n", b ? "enable" : "disable");
+	if (config_get_bool(SETTINGS_FLASH_DIFF, &b))
+		gdb_outf("flash_diff %s\n", b ? "enable" : "disable");
+	if (config_get_bool(SETTINGS_FLASH_VERIFY, &b))
+		gdb_outf("flash_verify %s\n", b ? "enable" : "disable");
+	if (config_get_bool(SETTINGS_FLASH_BOOST, &b))
+		gdb_outf("flash_boost %s\n", b ? "enable" : "disable");
+	if (config_get_bool(SETTINGS_AUTO_SCAN, &b))
+		gdb_outf("auto_scan %s\n", b ? "enable" : "disable");
+	if (config_get_bool(SETTINGS_RTOS, &b))
+		gdb_outf("rtos %s\n", b ? "enable" : "disable");
+	if (settings_get(SETTINGS_HALT_POLL, val, sizeof(val)) == sizeof(val)) {
+		if (val[0])
+			gdb_outf("halt_poll %s %"PRIu32"\n",
+			         val[1] ? "backoff" : "fixed", val[0]);
+		else
+			gdb_out("halt_poll immediate\n");
+	}
+	len = settings_get(SETTINGS_AP_SEARCH, ap, sizeof(ap));
+	if ((len >= 2) && (len == 2 + ap[1])) {
+		if (!ap[1])
+			gdb_outf("ap_search gap %u\n", ap[0]);
+		else {
+			gdb_out("ap_search");
+			for (int i = 0; i < ap[1]; i++)
+				gdb_outf(" %u", ap[2 + i]);
+			gdb_out("\n");
+		}
+	}
+	if (settings_get(SETTINGS_FREQUENCY, val, 4) == 4)
+		gdb_outf("frequency %"PRIu32"\n", val[0]);
+	if (settings_get(SETTINGS_RTT, val, sizeof(val)) == sizeof(val)) {
+		if (val[1])
+			gdb_outf("rtt address 0x%08"PRIx32"\n", val[1]);
+		gdb_outf("rtt %s\n", val[0] ? "enable" : "disable");
+	}
+	if (settings_get(SETTINGS_TRACESWO, val, 4) == 4) {
+		if (val[0])
+			gdb_outf("traceswo %"PRIu32"\n", val[0]);
+		else
+			gdb_out("traceswo\n");
+	}
+	if (settings_get(SETTINGS_SCAN, &scan, sizeof(scan)) == sizeof(scan)) {
+		if (scan.jtag)
+			gdb_out("jtag_scan\n");
+		else {
+			gdb_out("swdp_scan");
+			for (int i = 0; (i < scan.count) &&
+			                (i < SWDP_TARGETSEL_MAX); i++)
+				gdb_outf(" 0x%08"PRIx32, scan.targetsel[i]);
+			gdb_out("\n");
+		}
+	}
+	len = settings_get(SETTINGS_SCAN_CACHE, NULL, 0);
+	if (len > 0)
+		gdb_outf("Topology cache: %d bytes\n", len);
+}
+
+static bool cmd_config(target *t, int argc, const char **argv)
+{
+	(void)t;
+	if ((argc == 1) || !strcmp(argv[1], "show")) {
+		config_show();
+		return true;
+	}
+	if (!strcmp(argv[1], "save")) {
+		if (!config_save()) {
+			gdb_out("Saving the settings failed\n");
+			return false;
+		}
+		gdb_outf("Saved %u bytes\n", (unsigned)settings_size());
+		return true;
+	}
+	if (!strcmp(argv[1], "clear"))
+		return settings_clear();
+	return false;
+}
+#endif
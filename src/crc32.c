@@ -21,6 +21,15 @@
 #include "general.h"
 #include "target.h"
 
+/* Target memory is checksummed from reads of this size, so the adiv5
+ * queue is kept busy for long runs rather than refilled every few words.
+ */
+#ifndef CRC_READ_SIZE
+#define CRC_READ_SIZE	1024
+#endif
+
+static uint32_t crc_read_buf[CRC_READ_SIZE / 4];
+
 #if !defined(STM32F1) && !defined(STM32F4)
 static const uint32_t crc32_table[] = {
 	0x00000000, 0x04C11DB7, 0x09823B6E, 0x0D4326D9,
@@ -89,22 +98,76 @@ static const uint32_t crc32_table[] = {
 	0xBCB4666D, 0xB8757BDA, 0xB5365D03, 0xB1F740B4,
 };
 
+/* crc32_slice[n] is crc32_table followed by n + 1 zero bytes, so four
+ * bytes are taken at a time.  Filled in on first use. */
+static uint32_t crc32_slice[3][256];
+
 static uint32_t crc32_calc(uint32_t crc, uint8_t data)
 {
 	return (crc << 8) ^ crc32_table[((crc >> 24) ^ data) & 255];
 }
 
-uint32_t generic_crc32(target *t, uint32_t base, size_t len)
+static void crc32_slice_init(void)
+{
+	if (crc32_slice[0][1])
+		return;
+	for (int i = 0; i < 256; i++) {
+		uint32_t crc = crc32_table[i];
+		for (int n = 0; n < 3; n++) {
+			crc = crc32_calc(crc, 0);
+			crc32_slice[n][i] = crc;
+		}
+	}
+}
+
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len)
 {
+	const uint8_t *data = buf;
+
+	crc32_slice_init();
+	for (; len > 3; data += 4, len -= 4) {
+		crc ^= ((uint32_t)data[0] << 24) | (data[1] << 16) |
+		       (data[2] << 8) | data[3];
+		crc = crc32_slice[2][crc >> 24] ^
+		      crc32_slice[1][(crc >> 16) & 255] ^
+		      crc32_slice[0][(crc >> 8) & 255] ^
+		      crc32_table[crc & 255];
+	}
+	while (len--)
+		crc = crc32_calc(crc, *data++);
+	return crc;
+}
+
+uint32_t crc32_buf(const void *buf, size_t len)
+{
+	return crc32_update(-1, buf, len);
+}
+
+uint32_t crc32_fill(uint8_t value, size_t len)
+{
+	uint8_t fill[64];
 	uint32_t crc = -1;
-	uint8_t bytes[128];
 
+	memset(fill, value, sizeof(fill));
 	while (len) {
-		size_t read_len = MIN(sizeof(bytes), len);
-		target_mem_read(t, bytes, base, read_len);
+		size_t chunk = MIN(sizeof(fill), len);
+		crc = crc32_update(crc, fill, chunk);
+		len -= chunk;
+	}
+	return crc;
+}
+
+uint32_t generic_crc32(target *t, uint32_t base, size_t len)
+{
+	uint32_t crc = -1;
 
-		for (unsigned i = 0; i < read_len; i++)
-			crc = crc32_calc(crc, bytes[i]);
+	if (target_mem_crc32(t, &crc, base, len) == 0)
+		return crc;
+
+	while (len) {
+		size_t read_len = MIN(sizeof(crc_read_buf), len);
+		target_mem_read(t, crc_read_buf, base, read_len);
+		crc = crc32_update(crc, crc_read_buf, read_len);
 
 		base += read_len;
 		len -= read_len;
@@ -113,38 +176,128 @@ uint32_t generic_crc32(target *t, uint32_t base, size_t len)
 }
 #else
 #include <libopencm3/stm32/crc.h>
+/* The CRC unit only takes words, the last few bytes go a nibble at a time */
+static uint32_t crc32_tail(uint32_t crc, const uint8_t *data, size_t len)
+{
+	static const uint32_t nibble[16] = {
+		0x00000000, 0x04C11DB7, 0x09823B6E, 0x0D4326D9,
+		0x130476DC, 0x17C56B6B, 0x1A864DB2, 0x1E475005,
+		0x2608EDB8, 0x22C9F00F, 0x2F8AD6D6, 0x2B4BCB61,
+		0x350C9B64, 0x31CD86D3, 0x3C8EA00A, 0x384FBDBD,
+	};
+
+	while (len--) {
+		crc ^= *data++ << 24;
+		crc = (crc << 4) ^ nibble[crc >> 28];
+		crc = (crc << 4) ^ nibble[crc >> 28];
+	}
+	return crc;
+}
+
+/* The CRC unit can't be loaded, so to carry on from crc it is fed the
+ * word that takes its reset value there.  That is found by undoing the
+ * 32 shifts of a word. */
+static void crc32_seed(uint32_t crc)
+{
+	CRC_CR |= CRC_CR_RESET;
+	if (crc == 0xffffffff)
+		return;
+	for (int i = 0; i < 32; i++)
+		crc = (crc & 1) ? ((crc ^ 0x4C11DB7) >> 1) | 0x80000000 : crc >> 1;
+	CRC_DR = crc ^ 0xffffffff;
+}
+
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *data = buf;
+	uint32_t word;
+
+	crc32_seed(crc);
+
+	for (; len > 3; data += 4, len -= 4) {
+		memcpy(&word, data, sizeof(word));
+		CRC_DR = __builtin_bswap32(word);
+	}
+
+	return crc32_tail(CRC_DR, data, len);
+}
+
+uint32_t crc32_buf(const void *buf, size_t len)
+{
+	return crc32_update(-1, buf, len);
+}
+
+uint32_t crc32_fill(uint8_t value, size_t len)
+{
+	uint32_t word = value * 0x01010101;
+
+	CRC_CR |= CRC_CR_RESET;
+
+	for (; len > 3; len -= 4)
+		CRC_DR = word;
+
+	uint8_t tail[3] = {value, value, value};
+	return crc32_tail(CRC_DR, tail, len);
+}
+
 uint32_t generic_crc32(target *t, uint32_t base, size_t len)
 {
-	uint8_t bytes[128];
-	uint32_t crc;
+	size_t read_len = 0;
+	uint32_t crc = -1;
+
+	if (target_mem_crc32(t, &crc, base, len) == 0)
+		return crc;
 
 	CRC_CR |= CRC_CR_RESET;
 
-	while (len > 3) {
-		size_t read_len = MIN(sizeof(bytes), len) & ~3;
-		target_mem_read(t, bytes, base, read_len);
+	/* Only the last read can leave a byte tail */
+	while (len) {
+		read_len = MIN(sizeof(crc_read_buf), len);
+		target_mem_read(t, crc_read_buf, base, read_len);
 
-		for (unsigned i = 0; i < read_len; i += 4)
-			CRC_DR = __builtin_bswap32(*(uint32_t*)(bytes+i));
+		for (unsigned i = 0; i < read_len / 4; i++)
+			CRC_DR = __builtin_bswap32(crc_read_buf[i]);
 
 		base += read_len;
 		len -= read_len;
 	}
 
-	crc = CRC_DR;
+	return crc32_tail(CRC_DR, (uint8_t *)crc_read_buf + (read_len & ~3),
+	                  read_len & 3);
+}
+#endif
 
-	target_mem_read(t, bytes, base, len);
-	uint8_t *data = bytes;
-	while (len--) {
-		crc ^= *data++ << 24;
-		for (int i = 0; i < 8; i++) {
-			if (crc & 0x80000000)
-				crc = (crc << 1) ^ 0x4C11DB7;
-			else
-				crc <<= 1;
-		}
-	}
+/* Reflected CRC-32 (polynomial 0xEDB88320, LSB first), with no final
+ * inversion.  This is what on-chip CRC units such as the SAMD DSU compute.
+ * It isn't the checksum GDB expects, so it is only used for flash checks.
+ */
+static uint32_t crc32_ieee_calc(uint32_t crc, uint8_t data)
+{
+	crc ^= data;
+	for (int i = 0; i < 8; i++)
+		crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
 	return crc;
 }
-#endif
 
+uint32_t crc32_ieee_update(uint32_t crc, const void *buf, size_t len)
+{
+	const uint8_t *data = buf;
+
+	while (len--)
+		crc = crc32_ieee_calc(crc, *data++);
+	return crc;
+}
+
+uint32_t crc32_ieee_buf(const void *buf, size_t len)
+{
+	return crc32_ieee_update(-1, buf, len);
+}
+
+uint32_t crc32_ieee_fill(uint8_t value, size_t len)
+{
+	uint32_t crc = -1;
+
+	while (len--)
+		crc = crc32_ieee_calc(crc, value);
+	return crc;
+}
@@ -0,0 +1,55 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Ring of the last debug port transactions, so the timing of a slow or
+ * flaky session can be looked at after the fact.  Entries are small and
+ * recorded without any formatting, the monitor command dumps them.
+ */
+#include "general.h"
+#include "dptrace.h"
+
+static struct dptrace_entry dptrace_ring[DPTRACE_SIZE];
+/* Entries ever recorded, the ring index is taken modulo the size */
+static unsigned dptrace_next;
+static unsigned dptrace_first;
+
+void dptrace_record(uint32_t time_us, uint8_t request, uint8_t ack,
+                    unsigned waits)
+{
+	struct dptrace_entry *e = &dptrace_ring[dptrace_next++ % DPTRACE_SIZE];
+
+	e->time_us = time_us;
+	e->request = request;
+	e->ack = ack;
+	e->waits = MIN(waits, 0xffff);
+}
+
+void dptrace_clear(void)
+{
+	dptrace_first = dptrace_next;
+}
+
+unsigned dptrace_count(void)
+{
+	return MIN(dptrace_next - dptrace_first, DPTRACE_SIZE);
+}
+
+const struct dptrace_entry *dptrace_entry(unsigned i)
+{
+	unsigned oldest = dptrace_next - dptrace_count();
+	return &dptrace_ring[(oldest + i) % DPTRACE_SIZE];
+}
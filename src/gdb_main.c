@@ -25,6 +25,7 @@
  */
 
 #include "general.h"
+#include "exception.h"
 #include "hex_utils.h"
 #include "gdb_if.h"
 #include "gdb_packet.h"
@@ -34,6 +35,15 @@
 #include "command.h"
 #include "crc32.h"
 #include "morse.h"
+#include "snapshot.h"
+#include "stats.h"
+#include "rtos.h"
+#ifdef PLATFORM_HAS_RTT
+#	include "rtt.h"
+#endif
+#ifdef PLATFORM_HAS_IMAGE
+#	include "image.h"
+#endif
 
 enum gdb_signal {
 	GDB_SIGINT = 2,
@@ -42,28 +52,103 @@ enum gdb_signal {
 	GDB_SIGLOST = 29,
 };
 
-#define BUF_SIZE	1024
+/* GDB register number of the program counter */
+#define GDB_REG_PC	15
+
+/* Platforms with more RAM may override this for larger transfers */
+#ifndef GDB_PACKET_BUFFER_SIZE
+#define GDB_PACKET_BUFFER_SIZE	2048
+#endif
+#define BUF_SIZE	GDB_PACKET_BUFFER_SIZE
 
 #define ERROR_IF_NO_TARGET()	\
 	if(!cur_target) { gdb_putpacketz("EFF"); break; }
+#define ERROR_IF_RUNNING()	\
+	if(target_running) { gdb_putpacketz("E01"); break; }
+/* As ERROR_IF_RUNNING(), for the handlers of q and v packets */
+#define RETURN_IF_RUNNING()	\
+	if(target_running) { gdb_putpacketz("E01"); return; }
 
 static char pbuf[BUF_SIZE+1];
+/* Binary packet data, which is at most half of a hex encoded packet */
+static uint8_t scratch[BUF_SIZE / 2];
 
 static target *cur_target;
 static target *last_target;
 
+/* Halt polling while the target runs, see 'monitor halt_poll' */
+uint32_t gdb_poll_interval;
+bool gdb_poll_backoff;
+
 static void handle_q_packet(char *packet, int len);
 static void handle_v_packet(char *packet, int len);
 static void handle_z_packet(char *packet, int len);
 
+/* Range stepping state for 'vCont;r' */
+static bool range_step;
+static uint32_t range_start, range_end;
+
+/* Non-stop mode ('QNonStop:1'): resuming replies at once and the halt
+ * is sent later as a '%Stop' notification, memory and monitor commands
+ * keep working while the target runs. */
+static bool non_stop;
+static bool target_running;
+/* Halt requested by 'vCont;t', reported with signal 0 */
+static bool stop_requested;
+/* RTOS task selected by 'Hg', 0 for the running one */
+static target_addr gdb_thread;
+
+#if defined(GDB_SESSIONS)
+/* All-stop resume in a session, the halt is reported by gdb_sessions */
+static bool halt_wait;
+static bool interrupted;
+
+/* The state of each GDB connection.  The session being served has its
+ * state in the variables above, the rest is kept here meanwhile. */
+static struct gdb_session {
+	target *cur_target;
+	target *last_target;
+	bool range_step;
+	uint32_t range_start, range_end;
+	bool non_stop;
+	bool target_running;
+	bool stop_requested;
+	target_addr gdb_thread;
+	bool halt_wait;
+	bool interrupted;
+	bool noackmode;
+} sessions[GDB_SESSIONS];
+static int cur_session;
+#endif
+
 static void gdb_target_destroy_callback(struct target_controller *tc, target *t)
 {
 	(void)tc;
-	if (cur_target == t)
+	if (cur_target == t) {
 		cur_target = NULL;
+		target_running = false;
+#if defined(GDB_SESSIONS)
+		/* The halt wait ends with the caller's error reply */
+		halt_wait = false;
+#endif
+	}
 
 	if (last_target == t)
 		last_target = NULL;
+
+#if defined(GDB_SESSIONS)
+	for (int i = 0; i < GDB_SESSIONS; i++) {
+		struct gdb_session *s = &sessions[i];
+		if (i == cur_session)
+			continue;
+		if (s->cur_target == t) {
+			s->cur_target = NULL;
+			s->target_running = false;
+		}
+		if (s->last_target == t)
+			s->last_target = NULL;
+	}
+#endif
 }
 
 static void gdb_target_printf(struct target_controller *tc,
@@ -91,205 +176,616 @@ static struct target_controller gdb_controller = {
 	.system = hostio_system,
 };
 
-int gdb_main_loop(struct target_controller *tc, bool in_syscall)
+#if defined(GDB_SESSIONS)
+
+static void gdb_session_switch(int n)
 {
-	int size;
-	bool single_step = false;
+	struct gdb_session *s = &sessions[cur_session];
 
-	/* GDB protocol main loop */
-	while(1) {
-		SET_IDLE_STATE(1);
-		size = gdb_getpacket(pbuf, BUF_SIZE);
-		SET_IDLE_STATE(0);
-		switch(pbuf[0]) {
-		/* Implementation of these is mandatory! */
-		case 'g': { /* 'g': Read general registers */
-			ERROR_IF_NO_TARGET();
-			uint8_t arm_regs[target_regs_size(cur_target)];
-			target_regs_read(cur_target, arm_regs);
-			gdb_putpacket(hexify(pbuf, arm_regs, sizeof(arm_regs)),
-			              sizeof(arm_regs) * 2);
+	/* Probes with a port per session only see that port's targets */
+	platform_swd_port_select(n % PLATFORM_SWD_PORTS);
+	if (n == cur_session)
+		return;
+
+	s->cur_target = cur_target;
+	s->last_target = last_target;
+	s->range_step = range_step;
+	s->range_start = range_start;
+	s->range_end = range_end;
+	s->non_stop = non_stop;
+	s->target_running = target_running;
+	s->stop_requested = stop_requested;
+	s->gdb_thread = gdb_thread;
+	s->halt_wait = halt_wait;
+	s->interrupted = interrupted;
+	s->noackmode = gdb_noackmode();
+
+	s = &sessions[n];
+	cur_target = s->cur_target;
+	last_target = s->last_target;
+	range_step = s->range_step;
+	range_start = s->range_start;
+	range_end = s->range_end;
+	non_stop = s->non_stop;
+	target_running = s->target_running;
+	stop_requested = s->stop_requested;
+	gdb_thread = s->gdb_thread;
+	halt_wait = s->halt_wait;
+	interrupted = s->interrupted;
+	gdb_set_noackmode(s->noackmode);
+
+	cur_session = n;
+	gdb_if_session(n);
+}
+
+/* A target is debugged by one session at a time */
+static bool gdb_target_busy(target *t)
+{
+	for (int i = 0; i < GDB_SESSIONS; i++)
+		if ((i != cur_session) && (sessions[i].cur_target == t))
+			return true;
+	return false;
+}
+#else
+static bool gdb_target_busy(target *t)
+{
+	(void)t;
+	return false;
+}
+#endif
+
+static target *gdb_attach(target *t)
+{
+	if (!t || gdb_target_busy(t))
+		return NULL;
+	rtos_invalidate();
+	gdb_thread = 0;
+	return target_attach(t, &gdb_controller);
+}
+
+/* RTOS tasks are threads in all-stop mode, once the scheduler runs */
+static bool gdb_rtos(void)
+{
+	return !non_stop && cur_target && rtos_current(cur_target);
+}
+
+/* The selected task, 0 if it is the running one */
+static target_addr gdb_rtos_thread(void)
+{
+	if (!gdb_thread || !gdb_rtos() ||
+	    (gdb_thread == rtos_current(cur_target)))
+		return 0;
+	return gdb_thread;
+}
+
+struct gdb_target_find {
+	int n;
+	target *t;
+};
+
+static void gdb_target_find_cb(int i, target *t, void *context)
+{
+	struct gdb_target_find *f = context;
+	if (i == f->n)
+		f->t = t;
+}
+
+/* Target n of the 'monitor *_scan' list, as numbered for vAttach */
+static target *gdb_target_n(int n)
+{
+	struct gdb_target_find f = {.n = n};
+	target_foreach(gdb_target_find_cb, &f);
+	return f.t;
+}
+
+/* Wait up to ms between halt polls, returns true early on host input */
+static bool gdb_poll_wait(uint32_t ms)
+{
+	platform_timeout timeout;
+
+	if (ms == 0)
+		return gdb_if_pending();
+
+#if defined(PC_HOSTED)
+	/* Sleep rather than spin a core while the target runs */
+	(void)timeout;
+	return gdb_if_wait(ms);
+#endif
+	platform_timeout_set(&timeout, ms);
+	while (!gdb_if_pending())
+		if (platform_timeout_is_expired(&timeout))
+			return false;
+	return true;
+}
+
+/* With nothing attached, scan in the background until GDB sends
+ * something, see 'monitor auto_scan' */
+static void gdb_idle_wait(void)
+{
+	int wait;
+
+	while (!gdb_if_pending() && ((wait = command_auto_scan()) >= 0)) {
+		if (gdb_poll_wait(wait))
 			break;
-			}
-		case 'm': {	/* 'm addr,len': Read len bytes from addr */
-			uint32_t addr, len;
-			ERROR_IF_NO_TARGET();
-			sscanf(pbuf, "m%" SCNx32 ",%" SCNx32, &addr, &len);
-			if (len > sizeof(pbuf) / 2) {
-				gdb_putpacketz("E02");
-				break;
-			}
-			DEBUG("m packet: addr = %" PRIx32 ", len = %" PRIx32 "\n", addr, len);
-			uint8_t mem[len];
-			if (target_mem_read(cur_target, mem, addr, len))
-				gdb_putpacketz("E01");
-			else
-				gdb_putpacket(hexify(pbuf, mem, len), len*2);
+	}
+}
+
+/* Poll the target once, true if it has stopped for GDB.
+ * While range stepping, steps that stay inside the range are resumed. */
+static bool gdb_halt_check(enum target_halt_reason *reason,
+                           target_addr *watch, bool interrupted)
+{
+	*reason = target_halt_poll(cur_target, watch);
+	if (!*reason)
+		return false;
+
+	if (range_step && (*reason == TARGET_HALT_STEPPING) &&
+	    !interrupted && !gdb_if_pending()) {
+		uint32_t pc;
+		if ((target_reg_read(cur_target, GDB_REG_PC, &pc, sizeof(pc)) ==
+		     sizeof(pc)) && (pc >= range_start) && (pc < range_end)) {
+			target_halt_resume(cur_target, true);
+			return false;
+		}
+	}
+	range_step = false;
+	SET_RUN_STATE(0);
+	return true;
+}
+
+/* Translate reason to a GDB stop reply, as a notification in non-stop */
+static void gdb_send_stop(enum target_halt_reason reason, target_addr watch,
+                          bool notify)
+{
+	const char *prefix = notify ? "Stop:" : "";
+	char buf[128];
+	int sig, len;
+
+	switch (reason) {
+	case TARGET_HALT_ERROR:
+		len = snprintf(buf, sizeof(buf), "%sX%02X", prefix, GDB_SIGLOST);
+		morse("TARGET LOST.", true);
+		goto send;
+	case TARGET_HALT_REQUEST:
+		sig = stop_requested ? 0 : GDB_SIGINT;
+		break;
+	case TARGET_HALT_FAULT:
+		sig = GDB_SIGSEGV;
+		break;
+	default:
+		sig = GDB_SIGTRAP;
+	}
+	len = snprintf(buf, sizeof(buf), "%sT%02X%s", prefix, sig,
+	               non_stop ? "thread:1;" : "");
+	/* The task lists may have changed while it ran */
+	rtos_invalidate();
+	gdb_thread = 0;
+	if (gdb_rtos())
+		len += snprintf(buf + len, sizeof(buf) - len,
+		                "thread:%" PRIx32 ";", rtos_current(cur_target));
+	if (reason == TARGET_HALT_WATCHPOINT)
+		len += snprintf(buf + len, sizeof(buf) - len,
+		                "watch:%08" PRIX32 ";", watch);
+	/* Expedited registers, so a step needs no 'g' or 'p' after it */
+	const uint8_t *regs;
+	size_t nregs = target_regs_expedite(cur_target, &regs);
+	for (size_t i = 0; i < nregs; i++) {
+		uint8_t val[4];
+		if (target_reg_read(cur_target, regs[i], val, sizeof(val)) !=
+		    sizeof(val))
 			break;
+		len += snprintf(buf + len, sizeof(buf) - len, "%02x:", regs[i]);
+		hexify(buf + len, val, sizeof(val));
+		len += sizeof(val) * 2;
+		buf[len++] = ';';
+	}
+send:
+	stop_requested = false;
+	if (notify)
+		gdb_putnotification(buf, len);
+	else
+		gdb_putpacket(buf, len);
+}
+
+/* Wait for the target to halt and report the reason to GDB */
+static void gdb_halt_wait(void)
+{
+	target_addr watch;
+	enum target_halt_reason reason;
+	bool interrupted = false;
+
+	if(!cur_target) {
+		/* Report "target exited" if no target */
+		gdb_putpacketz("W00");
+		return;
+	}
+
+	uint32_t interval = gdb_poll_backoff ? 1 : gdb_poll_interval;
+	while (!gdb_halt_check(&reason, &watch, interrupted)) {
+		uint32_t wait = interval;
+#ifdef PLATFORM_HAS_RTT
+		/* RTT gets a turn on the debug port between halt polls */
+		wait = MIN(wait, rtt_poll(cur_target));
+#endif
+		if (gdb_poll_wait(wait)) {
+			unsigned char c = gdb_if_getchar_to(0);
+			if((c == '\x03') || (c == '\x04')) {
+				target_halt_request(cur_target);
+				interrupted = true;
 			}
-		case 'G': {	/* 'G XX': Write general registers */
-			ERROR_IF_NO_TARGET();
-			uint8_t arm_regs[target_regs_size(cur_target)];
-			unhexify(arm_regs, &pbuf[1], sizeof(arm_regs));
-			target_regs_write(cur_target, arm_regs);
+		}
+		if (gdb_poll_backoff)
+			interval = MIN(interval * 2, gdb_poll_interval);
+	}
+	target_running = false;
+	gdb_send_stop(reason, watch, false);
+}
+
+/* Non-stop: poll a running target until GDB sends a packet */
+static void gdb_nonstop_wait(void)
+{
+	target_addr watch;
+	enum target_halt_reason reason;
+	uint32_t interval = gdb_poll_backoff ? 1 : gdb_poll_interval;
+
+	while (target_running && !gdb_if_pending()) {
+		if (gdb_halt_check(&reason, &watch, false)) {
+			target_running = false;
+			gdb_send_stop(reason, watch, true);
+			return;
+		}
+		uint32_t wait = interval;
+#ifdef PLATFORM_HAS_RTT
+		wait = MIN(wait, rtt_poll(cur_target));
+#endif
+		gdb_poll_wait(wait);
+		if (gdb_poll_backoff)
+			interval = MIN(interval * 2, gdb_poll_interval);
+	}
+}
+
+/* Resume the target, in non-stop mode the halt is reported later */
+static void gdb_resume(bool step)
+{
+	if (!target_running) {
+		target_halt_resume(cur_target, step);
+		SET_RUN_STATE(1);
+	}
+	if (non_stop) {
+		target_running = true;
+		gdb_putpacketz("OK");
+	} else {
+#if defined(GDB_SESSIONS)
+		/* Other sessions are served while this target runs */
+		halt_wait = true;
+		interrupted = false;
+#else
+		gdb_halt_wait();
+#endif
+	}
+}
+
+/* 'vCont;action[:thread]...': Only the first action applies, as we
+ * have a single thread.  'r start,end' steps until pc leaves the range. */
+static void handle_vcont(const char *action)
+{
+	bool step = false;
+
+	if(!cur_target) {
+		gdb_putpacketz("X1D");
+		return;
+	}
+
+	switch (action[0]) {
+	case 'r':
+		if (sscanf(action, "r%" SCNx32 ",%" SCNx32,
+		           &range_start, &range_end) != 2) {
+			gdb_putpacketz("E01");
+			return;
+		}
+		range_step = true;
+		/* fall through */
+	case 's':
+	case 'S':
+		step = true;
+		/* fall through */
+	case 'c':
+	case 'C':
+		break;
+	case 't':
+		/* Non-stop only, the halt is notified as usual */
+		if (!non_stop) {
+			gdb_putpacketz("E01");
+			return;
+		}
+		if (target_running) {
+			target_halt_request(cur_target);
+			stop_requested = true;
+		}
+		gdb_putpacketz("OK");
+		return;
+	default:
+		gdb_putpacketz("E01");
+		return;
+	}
+
+	gdb_resume(step);
+}
+
+/* Handle the packet of size in pbuf, except for semihosting replies */
+static void gdb_process_packet(int size)
+{
+	bool single_step = false;
+
+#ifdef ENABLE_STATS
+	/* The reply is built in pbuf, so keep the packet type */
+	char packet_type = pbuf[0];
+	uint32_t packet_start = platform_time_ms();
+#endif
+	switch(pbuf[0]) {
+	/* Implementation of these is mandatory! */
+	case 'g': { /* 'g': Read general registers */
+		ERROR_IF_NO_TARGET();
+		ERROR_IF_RUNNING();
+		size_t len = target_regs_size(cur_target);
+		if (len > sizeof(scratch)) {
+			gdb_putpacketz("E02");
+			break;
+		}
+		if (rtos_reg_read(cur_target, gdb_rtos_thread(), -1, scratch,
+		                  sizeof(scratch)) < 0) {
+			gdb_putpacketz("E01");
+			break;
+		}
+		gdb_putpacket_hex(scratch, len);
+		break;
+		}
+	case 'm': {	/* 'm addr,len': Read len bytes from addr */
+		uint32_t addr, len;
+		ERROR_IF_NO_TARGET();
+		sscanf(pbuf, "m%" SCNx32 ",%" SCNx32, &addr, &len);
+		if (len > sizeof(scratch)) {
+			gdb_putpacketz("E02");
+			break;
+		}
+		DEBUG("m packet: addr = %" PRIx32 ", len = %" PRIx32 "\n", addr, len);
+		if (target_mem_read(cur_target, scratch, addr, len))
+			gdb_putpacketz("E01");
+		else
+			gdb_putpacket_hex(scratch, len);
+		break;
+		}
+	case 'x': {	/* 'x addr,len': Read len bytes from addr in binary */
+		uint32_t addr, len;
+		ERROR_IF_NO_TARGET();
+		sscanf(pbuf, "x%" SCNx32 ",%" SCNx32, &addr, &len);
+		if (len > sizeof(pbuf) - 2) {
+			gdb_putpacketz("E02");
+			break;
+		}
+		DEBUG("x packet: addr = %" PRIx32 ", len = %" PRIx32 "\n", addr, len);
+		/* Read straight into the reply after the 'b' marker */
+		pbuf[0] = 'b';
+		if (target_mem_read(cur_target, pbuf + 1, addr, len))
+			gdb_putpacketz("E01");
+		else
+			gdb_putpacket(pbuf, len + 1);
+		break;
+		}
+	case 'p': {	/* 'p n': Read register n */
+		ERROR_IF_NO_TARGET();
+		ERROR_IF_RUNNING();
+		uint8_t val[8];
+		int reg = strtoul(pbuf + 1, NULL, 16);
+		ssize_t len = rtos_reg_read(cur_target, gdb_rtos_thread(), reg,
+		                            val, sizeof(val));
+		if (len > 0)
+			gdb_putpacket_hex(val, len);
+		else	/* Empty reply makes GDB fall back to 'g' */
+			gdb_putpacketz(len ? "E00" : "");
+		break;
+		}
+	case 'P': {	/* 'P n=XX': Write register n */
+		ERROR_IF_NO_TARGET();
+		ERROR_IF_RUNNING();
+		uint8_t val[8];
+		char *p;
+		int reg = strtoul(pbuf + 1, &p, 16);
+		size_t len = strlen(p + 1) / 2;
+		if ((*p != '=') || (len > sizeof(val)) || gdb_rtos_thread()) {
+			gdb_putpacketz("E00");
+			break;
+		}
+		unhexify(val, p + 1, len);
+		ssize_t ret = target_reg_write(cur_target, reg, val, len);
+		if (ret > 0)
 			gdb_putpacketz("OK");
+		else
+			gdb_putpacketz(ret ? "E00" : "");
+		break;
+		}
+	case 'G': {	/* 'G XX': Write general registers */
+		ERROR_IF_NO_TARGET();
+		ERROR_IF_RUNNING();
+		size_t len = target_regs_size(cur_target);
+		if (len > (unsigned)(size - 1) / 2) {
+			gdb_putpacketz("E02");
 			break;
-			}
-		case 'M': { /* 'M addr,len:XX': Write len bytes to addr */
-			uint32_t addr, len;
-			int hex;
-			ERROR_IF_NO_TARGET();
-			sscanf(pbuf, "M%" SCNx32 ",%" SCNx32 ":%n", &addr, &len, &hex);
-			if (len > (unsigned)(size - hex) / 2) {
-				gdb_putpacketz("E02");
-				break;
-			}
-			DEBUG("M packet: addr = %" PRIx32 ", len = %" PRIx32 "\n", addr, len);
-			uint8_t mem[len];
-			unhexify(mem, pbuf + hex, len);
-			if (target_mem_write(cur_target, addr, mem, len))
-				gdb_putpacketz("E01");
-			else
-				gdb_putpacketz("OK");
+		}
+		/* Switched out tasks are only read from their stacks */
+		if (gdb_rtos_thread()) {
+			gdb_putpacketz("E01");
 			break;
-			}
-		case 's':	/* 's [addr]': Single step [start at addr] */
-			single_step = true;
-			/* fall through */
-		case 'c':	/* 'c [addr]': Continue [at addr] */
-			if(!cur_target) {
-				gdb_putpacketz("X1D");
-				break;
-			}
-
-			target_halt_resume(cur_target, single_step);
-			SET_RUN_STATE(1);
-			single_step = false;
-			/* fall through */
-		case '?': {	/* '?': Request reason for target halt */
-			/* This packet isn't documented as being mandatory,
-			 * but GDB doesn't work without it. */
-			target_addr watch;
-			enum target_halt_reason reason;
-
-			if(!cur_target) {
-				/* Report "target exited" if no target */
-				gdb_putpacketz("W00");
-				break;
-			}
-
-			/* Wait for target halt */
-			while(!(reason = target_halt_poll(cur_target, &watch))) {
-				unsigned char c = gdb_if_getchar_to(0);
-				if((c == '\x03') || (c == '\x04')) {
-					target_halt_request(cur_target);
-				}
-			}
-			SET_RUN_STATE(0);
-
-			/* Translate reason to GDB signal */
-			switch (reason) {
-			case TARGET_HALT_ERROR:
-				gdb_putpacket_f("X%02X", GDB_SIGLOST);
-				morse("TARGET LOST.", true);
-				break;
-			case TARGET_HALT_REQUEST:
-				gdb_putpacket_f("T%02X", GDB_SIGINT);
-				break;
-			case TARGET_HALT_WATCHPOINT:
-				gdb_putpacket_f("T%02Xwatch:%08X;", GDB_SIGTRAP, watch);
-				break;
-			case TARGET_HALT_FAULT:
-				gdb_putpacket_f("T%02X", GDB_SIGSEGV);
-				break;
-			default:
-				gdb_putpacket_f("T%02X", GDB_SIGTRAP);
-			}
+		}
+		unhexify(scratch, &pbuf[1], len);
+		target_regs_write(cur_target, scratch);
+		gdb_putpacketz("OK");
+		break;
+		}
+	case 'M': { /* 'M addr,len:XX': Write len bytes to addr */
+		uint32_t addr, len;
+		int hex;
+		ERROR_IF_NO_TARGET();
+		sscanf(pbuf, "M%" SCNx32 ",%" SCNx32 ":%n", &addr, &len, &hex);
+		if (len > (unsigned)(size - hex) / 2) {
+			gdb_putpacketz("E02");
 			break;
-			}
-		case 'F':	/* Semihosting call finished */
-			if (in_syscall) {
-				return hostio_reply(tc, pbuf, size);
-			} else {
-				DEBUG("*** F packet when not in syscall! '%s'\n", pbuf);
-				gdb_putpacketz("");
-			}
+		}
+		DEBUG("M packet: addr = %" PRIx32 ", len = %" PRIx32 "\n", addr, len);
+		unhexify(scratch, pbuf + hex, len);
+		rtos_invalidate();
+		if (target_mem_write(cur_target, addr, scratch, len))
+			gdb_putpacketz("E01");
+		else
+			gdb_putpacketz("OK");
+		break;
+		}
+	case 's':	/* 's [addr]': Single step [start at addr] */
+		single_step = true;
+		/* fall through */
+	case 'c':	/* 'c [addr]': Continue [at addr] */
+		if(!cur_target) {
+			gdb_putpacketz("X1D");
 			break;
+		}
 
-		/* Optional GDB packet support */
-		case '!':	/* Enable Extended GDB Protocol. */
-			/* This doesn't do anything, we support the extended
-			 * protocol anyway, but GDB will never send us a 'R'
-			 * packet unless we answer 'OK' here.
-			 */
+		gdb_resume(single_step);
+		single_step = false;
+		break;
+	case '?':	/* '?': Request reason for target halt */
+		/* This packet isn't documented as being mandatory,
+		 * but GDB doesn't work without it. */
+		if (target_running)	/* Non-stop, nothing stopped */
 			gdb_putpacketz("OK");
-			break;
+		else
+			gdb_halt_wait();
+		break;
 
-		case 0x04:
-		case 'D':	/* GDB 'detach' command. */
-			if(cur_target)
-				target_detach(cur_target);
+	case 'F':	/* Semihosting call finished */
+		DEBUG("*** F packet when not in syscall! '%s'\n", pbuf);
+		gdb_putpacketz("");
+		break;
+
+	/* Optional GDB packet support */
+	case '!':	/* Enable Extended GDB Protocol. */
+		/* This doesn't do anything, we support the extended
+		 * protocol anyway, but GDB will never send us a 'R'
+		 * packet unless we answer 'OK' here.
+		 */
+		gdb_putpacketz("OK");
+		break;
+
+	case 0x04:	/* Also what gdb_getpacket() gives for a lost connection */
+	case 'D':	/* GDB 'detach' command. */
+		if(cur_target)
+			target_detach(cur_target);
+		last_target = cur_target;
+		cur_target = NULL;
+		target_running = false;
+		gdb_putpacketz("OK");
+		/* The next GDB to connect starts off acking packets */
+		gdb_set_noackmode(false);
+		break;
+
+	case 'k':	/* Kill the target */
+		if(cur_target) {
+			target_reset(cur_target);
+			target_detach(cur_target);
 			last_target = cur_target;
 			cur_target = NULL;
-			gdb_putpacketz("OK");
-			break;
-
-		case 'k':	/* Kill the target */
-			if(cur_target) {
-				target_reset(cur_target);
-				target_detach(cur_target);
-				last_target = cur_target;
-				cur_target = NULL;
-			}
-			break;
+			target_running = false;
+		}
+		gdb_set_noackmode(false);
+		break;
 
-		case 'r':	/* Reset the target system */
-		case 'R':	/* Restart the target program */
+	case 'r':	/* Reset the target system */
+	case 'R':	/* Restart the target program */
+		ERROR_IF_RUNNING();
+		if(cur_target)
+			target_reset(cur_target);
+		else if(last_target) {
+			cur_target = gdb_attach(last_target);
 			if(cur_target)
 				target_reset(cur_target);
-			else if(last_target) {
-				cur_target = target_attach(last_target,
-						           &gdb_controller);
-				target_reset(cur_target);
-			}
-			break;
+		}
+		break;
 
-		case 'X': { /* 'X addr,len:XX': Write binary data to addr */
-			uint32_t addr, len;
-			int bin;
-			ERROR_IF_NO_TARGET();
-			sscanf(pbuf, "X%" SCNx32 ",%" SCNx32 ":%n", &addr, &len, &bin);
-			if (len > (unsigned)(size - bin)) {
-				gdb_putpacketz("E02");
-				break;
-			}
-			DEBUG("X packet: addr = %" PRIx32 ", len = %" PRIx32 "\n", addr, len);
-			if (target_mem_write(cur_target, addr, pbuf+bin, len))
-				gdb_putpacketz("E01");
-			else
-				gdb_putpacketz("OK");
+	case 'X': { /* 'X addr,len:XX': Write binary data to addr */
+		uint32_t addr, len;
+		int bin;
+		ERROR_IF_NO_TARGET();
+		sscanf(pbuf, "X%" SCNx32 ",%" SCNx32 ":%n", &addr, &len, &bin);
+		if (len > (unsigned)(size - bin)) {
+			gdb_putpacketz("E02");
 			break;
-			}
+		}
+		DEBUG("X packet: addr = %" PRIx32 ", len = %" PRIx32 "\n", addr, len);
+		rtos_invalidate();
+		if (target_mem_write(cur_target, addr, pbuf+bin, len))
+			gdb_putpacketz("E01");
+		else
+			gdb_putpacketz("OK");
+		break;
+		}
 
-		case 'q':	/* General query packet */
-			handle_q_packet(pbuf, size);
-			break;
+	case 'T':	/* 'T thread': Is thread alive */
+		if (gdb_rtos())
+			gdb_putpacketz(rtos_thread(cur_target,
+			               strtoul(pbuf + 1, NULL, 16)) ? "OK" : "E01");
+		else
+			gdb_putpacketz(non_stop ? "OK" : "");
+		break;
+
+	case 'H': {	/* 'Hg thread': Select the thread for register access */
+		target_addr id = strtoul(pbuf + 2, NULL, 16);
+		if ((pbuf[1] == 'g') && gdb_rtos())
+			gdb_thread = rtos_thread(cur_target, id) ? id : 0;
+		gdb_putpacketz("OK");
+		break;
+		}
 
-		case 'v':	/* General query packet */
+	case 'q':	/* General query packet */
+	case 'Q':	/* General set packet */
+		handle_q_packet(pbuf, size);
+		break;
+
+	case 'v':	/* General query packet */
+		if (!strncmp(pbuf, "vCont;", 6))
+			handle_vcont(pbuf + 6);
+		else
 			handle_v_packet(pbuf, size);
-			break;
+		break;
 
-		/* These packet implement hardware break-/watchpoints */
-		case 'Z':	/* Z type,addr,len: Set breakpoint packet */
-		case 'z':	/* z type,addr,len: Clear breakpoint packet */
-			ERROR_IF_NO_TARGET();
-			handle_z_packet(pbuf, size);
-			break;
+	/* These packet implement hardware break-/watchpoints */
+	case 'Z':	/* Z type,addr,len: Set breakpoint packet */
+	case 'z':	/* z type,addr,len: Clear breakpoint packet */
+		ERROR_IF_NO_TARGET();
+		handle_z_packet(pbuf, size);
+		break;
 
-		default: 	/* Packet not implemented */
-			DEBUG("*** Unsupported packet: %s\n", pbuf);
-			gdb_putpacketz("");
-		}
+	default: 	/* Packet not implemented */
+		DEBUG("*** Unsupported packet: %s\n", pbuf);
+		gdb_putpacketz("");
+	}
+	STATS_PACKET(packet_type, platform_time_ms() - packet_start);
+}
+
+int gdb_main_loop(struct target_controller *tc, bool in_syscall)
+{
+	int size;
+
+	/* GDB protocol main loop */
+	while(1) {
+		SET_IDLE_STATE(1);
+		if (target_running)
+			gdb_nonstop_wait();
+		else if (!cur_target)
+			gdb_idle_wait();
+		size = gdb_getpacket(pbuf, BUF_SIZE);
+		SET_IDLE_STATE(0);
+		if ((pbuf[0] == 'F') && in_syscall)
+			return hostio_reply(tc, pbuf, size);
+		gdb_process_packet(size);
 	}
 }
 
@@ -303,35 +799,118 @@ handle_q_string_reply(const char *str, const char *param)
 		return;
 	}
 	if (addr < strlen (str)) {
-		char reply[len+2];
-		reply[0] = 'm';
-		strncpy (reply + 1, &str[addr], len);
-		if(len > strlen(&str[addr]))
-			len = strlen(&str[addr]);
-		gdb_putpacket(reply, len + 1);
+		/* The reply is built in pbuf, which param is no longer needed in */
+		len = MIN(len, strlen(&str[addr]));
+		len = MIN(len, BUF_SIZE - 1);
+		pbuf[0] = 'm';
+		memcpy(pbuf + 1, &str[addr], len);
+		gdb_putpacket(pbuf, len + 1);
 	} else if (addr == strlen (str)) {
 		gdb_putpacketz("l");
 	} else
 		gdb_putpacketz("E01");
 }
 
+/* 'qSymbol::' offers to look up symbols, each answer is followed by the
+ * next request until there is nothing left to ask for */
+static void handle_q_symbol(const char *param)
+{
+	char reply[8 + 2 * 32 + 1] = "qSymbol:";
+
+	if (!strcmp(param, ":")) {
+		rtos_symbols_reset();
+	} else {
+		/* 'value:name', the value is empty if GDB doesn't know it */
+		const char *hex = strchr(param, ':');
+		char name[32];
+		if (hex) {
+			size_t n = MIN(strlen(hex + 1) / 2, sizeof(name) - 1);
+			unhexify(name, hex + 1, n);
+			name[n] = 0;
+			rtos_symbol_set(name, hex != param,
+			                strtoul(param, NULL, 16));
+		}
+	}
+
+	const char *sym = rtos_symbol_next();
+	if (!sym) {
+		gdb_putpacketz("OK");
+		return;
+	}
+	hexify(reply + 8, sym, strlen(sym));
+	gdb_putpacketz(reply);
+}
+
+/* Append the part of str that falls in the window being read */
+static void gdb_xfer_add(const char *str, size_t *pos, size_t offset,
+                         size_t len, size_t *n)
+{
+	size_t slen = strlen(str);
+
+	for (size_t i = 0; i < slen; i++, (*pos)++)
+		if ((*pos >= offset) && (*n < len))
+			pbuf[1 + (*n)++] = str[i];
+}
+
+/* 'qXfer:threads:read::offset,len': The document is generated again for
+ * each chunk rather than kept, the reply is built in pbuf */
+static void handle_q_threads(const char *param)
+{
+	unsigned long offset, len;
+	const struct rtos_thread *th = NULL;
+	unsigned count = 0;
+	size_t pos = 0, n = 0;
+	char line[64 + RTOS_NAME_MAX];
+
+	if (sscanf(param, "%lx,%lx", &offset, &len) != 2) {
+		gdb_putpacketz("E01");
+		return;
+	}
+	len = MIN(len, BUF_SIZE - 1);
+	if (gdb_rtos())
+		th = rtos_threads(cur_target, &count);
+
+	gdb_xfer_add("<?xml version=\"1.0\"?>\n<threads>\n", &pos, offset, len, &n);
+	if (th) {
+		for (unsigned i = 0; i < count; i++) {
+			char name[RTOS_NAME_MAX + 1];
+			/* Keep the name from breaking the XML */
+			for (unsigned j = 0; j < sizeof(name); j++) {
+				char c = th[i].name[j];
+				name[j] = (c && strchr("<>&\"'", c)) ? '_' : c;
+			}
+			snprintf(line, sizeof(line),
+			         "<thread id=\"%" PRIx32 "\" name=\"%s\">%s</thread>\n",
+			         th[i].id, name, rtos_state_name(th[i].state));
+			gdb_xfer_add(line, &pos, offset, len, &n);
+		}
+	} else if (non_stop) {
+		gdb_xfer_add("<thread id=\"1\"/>\n", &pos, offset, len, &n);
+	}
+	gdb_xfer_add("</threads>\n", &pos, offset, len, &n);
+
+	pbuf[0] = (offset + n < pos) ? 'm' : 'l';
+	gdb_putpacket(pbuf, n + 1);
+}
+
 static void
 handle_q_packet(char *packet, int len)
 {
 	uint32_t addr, alen;
+	int n = 0;
 
 	if(!strncmp(packet, "qRcmd,", 6)) {
 		char *data;
 		int datalen;
 
-		/* calculate size and allocate buffer for command */
-		datalen = (len - 6) / 2;
-		data = alloca(datalen+1);
+		/* calculate size, the command is decoded into scratch */
+		datalen = MIN((len - 6) / 2, (int)sizeof(scratch) - 1);
+		data = (char *)scratch;
 		/* dehexify command */
 		unhexify(data, packet+6, datalen);
 		data[datalen] = 0;	/* add terminating null */
 
-		int c = command_process(cur_target, data);
+		int c = command_process(cur_target, data, target_running);
 		if(c < 0)
 			gdb_putpacketz("");
 		else if(c == 0)
@@ -340,15 +919,70 @@ handle_q_packet(char *packet, int len)
 			gdb_putpacketz("E");
 
 	} else if (!strncmp (packet, "qSupported", 10)) {
-		/* Query supported protocol features */
-		gdb_putpacket_f("PacketSize=%X;qXfer:memory-map:read+;qXfer:features:read+", BUF_SIZE);
+		/* Query supported protocol features.  This starts a new
+		 * session, so go back to acknowledging packets. */
+		gdb_set_noackmode(false);
+		non_stop = false;
+		gdb_putpacket_f("PacketSize=%X;qXfer:memory-map:read+;qXfer:features:read+;qXfer:bmp-snapshot:read+;binary-upload+;QStartNoAckMode+;QNonStop+;qXfer:threads:read+", BUF_SIZE);
+
+	} else if (!strncmp(packet, "QNonStop:", 9)) {
+		non_stop = packet[9] == '1';
+		gdb_putpacketz("OK");
+
+	} else if (!strncmp(packet, "qSymbol:", 8)) {
+		handle_q_symbol(packet + 8);
+
+	} else if (gdb_rtos() && !strcmp(packet, "qfThreadInfo")) {
+		/* The reply is built in pbuf, which packet is no longer needed in */
+		unsigned count;
+		const struct rtos_thread *th = rtos_threads(cur_target, &count);
+		int n = 0;
+		for (unsigned i = 0; i < count; i++)
+			n += snprintf(pbuf + n, BUF_SIZE - n, "%c%" PRIx32,
+			              i ? ',' : 'm', th[i].id);
+		if (n)
+			gdb_putpacket(pbuf, n);
+		else
+			gdb_putpacketz("l");
+
+	} else if (gdb_rtos() && !strcmp(packet, "qC")) {
+		gdb_putpacket_f("QC%" PRIx32, rtos_current(cur_target));
+
+	} else if (gdb_rtos() && !strncmp(packet, "qThreadExtraInfo,", 17)) {
+		const struct rtos_thread *th =
+			rtos_thread(cur_target, strtoul(packet + 17, NULL, 16));
+		if (!th) {
+			gdb_putpacketz("E01");
+			return;
+		}
+		char info[RTOS_NAME_MAX + 16];
+		int n = snprintf(info, sizeof(info), "%s, %s", th->name,
+		                 rtos_state_name(th->state));
+		gdb_putpacket_hex(info, n);
+
+	} else if (non_stop && !strcmp(packet, "qfThreadInfo")) {
+		/* GDB needs a thread list in non-stop, we have one thread */
+		gdb_putpacketz("m1");
+
+	} else if ((non_stop || gdb_rtos()) && !strcmp(packet, "qsThreadInfo")) {
+		gdb_putpacketz("l");
+
+	} else if (non_stop && !strcmp(packet, "qC")) {
+		gdb_putpacketz("QC1");
+
+	} else if (!strncmp(packet, "qXfer:threads:read::", 20)) {
+		handle_q_threads(packet + 20);
+
+	} else if (!strcmp(packet, "QStartNoAckMode")) {
+		/* The reply to this packet is still acknowledged */
+		gdb_putpacketz("OK");
+		gdb_set_noackmode(true);
 
 	} else if (strncmp (packet, "qXfer:memory-map:read::", 23) == 0) {
 		/* Read target XML memory map */
 		if((!cur_target) && last_target) {
 			/* Attach to last target if detached. */
-			cur_target = target_attach(last_target,
-						   &gdb_controller);
+			cur_target = gdb_attach(last_target);
 		}
 		if (!cur_target) {
 			gdb_putpacketz("E01");
@@ -360,21 +994,65 @@ handle_q_packet(char *packet, int len)
 		/* Read target description */
 		if((!cur_target) && last_target) {
 			/* Attach to last target if detached. */
-			cur_target = target_attach(last_target,
-						   &gdb_controller);
+			cur_target = gdb_attach(last_target);
 		}
 		if (!cur_target) {
 			gdb_putpacketz("E01");
 			return;
 		}
 		handle_q_string_reply(target_tdesc(cur_target), packet + 31);
+	} else if (strncmp(packet, "qXfer:bmp-snapshot:read:", 24) == 0) {
+		/* Compressed memory snapshot, the annex is the range as
+		 * <addr>,<len> */
+		unsigned long offset, size;
+		if (sscanf(packet + 24, "%" SCNx32 ",%" SCNx32 ":%lx,%lx",
+		           &addr, &alen, &offset, &size) != 4) {
+			gdb_putpacketz("E01");
+			return;
+		}
+		if (!cur_target) {
+			gdb_putpacketz("E01");
+			return;
+		}
+		/* The reply is built in pbuf, which packet is no longer needed in */
+		size = MIN(size, BUF_SIZE - 1);
+		int n = snapshot_read(cur_target, addr, alen, offset,
+		                      (uint8_t *)pbuf + 1, size);
+		if (n < 0) {
+			gdb_putpacketz("E01");
+			return;
+		}
+		pbuf[0] = ((unsigned long)n < size) ? 'l' : 'm';
+		gdb_putpacket(pbuf, n + 1);
 	} else if (sscanf(packet, "qCRC:%" PRIx32 ",%" PRIx32, &addr, &alen) == 2) {
+		RETURN_IF_RUNNING();
 		if(!cur_target) {
 			gdb_putpacketz("E01");
 			return;
 		}
 		gdb_putpacket_f("C%lx", generic_crc32(cur_target, addr, alen));
 
+	} else if (sscanf(packet, "qSearch:memory:%" PRIx32 ";%" PRIx32 ";%n",
+	                  &addr, &alen, &n) == 2) {
+		/* The pattern is binary data, running to the end of the packet */
+		target_addr found;
+		int ret = -1;
+		RETURN_IF_RUNNING();
+		if ((n > 0) && (len - n > MEM_SEARCH_MAX)) {
+			/* GDB searches for longer patterns itself */
+			gdb_putpacketz("");
+			return;
+		}
+		if (cur_target && (n > 0) && (n < len))
+			ret = target_mem_search(cur_target, addr, alen,
+			                        packet + n, len - n, &found);
+		if (ret < 0)
+			gdb_putpacketz("E01");
+		else if (ret == 0)
+			gdb_putpacketz("0");
+		else
+			gdb_putpacket_f("1,%" PRIx32, found);
+
 	} else {
 		DEBUG("*** Unsupported packet: %s\n", packet);
 		gdb_putpacket("", 0);
@@ -390,20 +1068,36 @@ handle_v_packet(char *packet, int plen)
 
 	if (sscanf(packet, "vAttach;%08lx", &addr) == 1) {
 		/* Attach to remote target processor */
-		cur_target = target_attach_n(addr, &gdb_controller);
-		if(cur_target)
-			gdb_putpacketz("T05");
-		else
+		cur_target = gdb_attach(gdb_target_n(addr));
+		target_running = false;
+		if(!cur_target) {
 			gdb_putpacketz("E01");
+		} else if (non_stop) {
+			/* The attach halt is notified after the reply */
+			gdb_putpacketz("OK");
+			stop_requested = true;
+			gdb_send_stop(TARGET_HALT_REQUEST, 0, true);
+		} else {
+			gdb_putpacketz("T05");
+		}
+
+	} else if (!strcmp(packet, "vCont?")) {
+		/* Report supported vCont actions, 'r' is range stepping,
+		 * 't' stops the thread in non-stop mode */
+		gdb_putpacketz("vCont;c;C;s;S;r;t");
+
+	} else if (!strcmp(packet, "vStopped")) {
+		/* Each halt is notified on its own, so nothing is queued */
+		gdb_putpacketz("OK");
 
 	} else if (!strcmp(packet, "vRun;")) {
 		/* Run target program. For us (embedded) this means reset. */
+		RETURN_IF_RUNNING();
 		if(cur_target) {
 			target_reset(cur_target);
 			gdb_putpacketz("T05");
 		} else if(last_target) {
-			cur_target = target_attach(last_target,
-						   &gdb_controller);
+			cur_target = gdb_attach(last_target);
 
                         /* If we were able to attach to the target again */
                         if (cur_target) {
@@ -416,6 +1110,7 @@ handle_v_packet(char *packet, int plen)
 	} else if (sscanf(packet, "vFlashErase:%08lx,%08lx", &addr, &len) == 2) {
 		/* Erase Flash Memory */
 		DEBUG("Flash Erase %08lX %08lX\n", addr, len);
+		RETURN_IF_RUNNING();
 		if(!cur_target) { gdb_putpacketz("EFF"); return; }
 
 		if(!flash_mode) {
@@ -433,14 +1128,25 @@ handle_v_packet(char *packet, int plen)
 		/* Write Flash Memory */
 		len = plen - bin;
 		DEBUG("Flash Write %08lX %08lX\n", addr, len);
-		if(cur_target && target_flash_write(cur_target, addr, (void*)packet + bin, len) == 0)
+		RETURN_IF_RUNNING();
+		if(cur_target && target_flash_write(cur_target, addr, (void*)packet + bin, len) == 0) {
+#ifdef PLATFORM_HAS_IMAGE
+			image_capture_write(addr, packet + bin, len);
+#endif
 			gdb_putpacketz("OK");
-		else
+		} else
 			gdb_putpacketz("EFF");
 
 	} else if (!strcmp(packet, "vFlashDone")) {
 		/* Commit flash operations. */
-		gdb_putpacketz(target_flash_done(cur_target) ? "EFF" : "OK");
+		RETURN_IF_RUNNING();
+		int ret = target_flash_done(cur_target);
+#ifdef PLATFORM_HAS_IMAGE
+		/* A load that didn't fit leaves no image, see 'monitor image' */
+		if (!image_capture_done())
+			DEBUG("Image not stored\n");
+#endif
+		gdb_putpacketz(ret ? "EFF" : "OK");
 		flash_mode = 0;
 
 	} else {
@@ -478,7 +1184,129 @@ handle_z_packet(char *packet, int plen)
 	}
 }
 
+#if defined(GDB_SESSIONS)
+/* A session that lost its connection lets go of its target */
+static void gdb_session_reset(void)
+{
+	if (cur_target)
+		target_detach(cur_target);
+	cur_target = last_target = NULL;
+	range_step = non_stop = target_running = false;
+	stop_requested = halt_wait = interrupted = false;
+	gdb_set_noackmode(false);
+}
+
+/* Poll the session's running target once and report a halt.  Returns
+ * the longest wait before the next poll. */
+static uint32_t gdb_session_poll(uint32_t wait)
+{
+	target_addr watch;
+	enum target_halt_reason reason;
+
+	if (halt_wait && !cur_target) {
+		/* Report "target exited", as gdb_halt_wait() does */
+		halt_wait = false;
+		gdb_putpacketz("W00");
+		return wait;
+	}
+	if (!halt_wait && !target_running)
+		return wait;
+
+	if (gdb_halt_check(&reason, &watch, interrupted)) {
+		if (non_stop) {
+			target_running = false;
+			gdb_send_stop(reason, watch, true);
+		} else {
+			halt_wait = interrupted = false;
+			gdb_send_stop(reason, watch, false);
+		}
+		return wait;
+	}
+#ifdef PLATFORM_HAS_RTT
+	wait = MIN(wait, rtt_poll(cur_target));
+#endif
+	return wait;
+}
+
+/* Serve all the sessions from one loop.  Running targets are polled in
+ * turn and each packet is handled to completion, which is what keeps
+ * the sessions' debug port accesses apart. */
+static void gdb_sessions(void)
+{
+	uint32_t interval = gdb_poll_backoff ? 1 : gdb_poll_interval;
+
+	while (true) {
+		bool running = false, attached = false;
+		uint32_t wait = interval;
+		int timeout = -1;
+
+		for (int i = 0; i < GDB_SESSIONS; i++) {
+			gdb_session_switch(i);
+			wait = gdb_session_poll(wait);
+			running |= halt_wait || target_running;
+			attached |= cur_target != NULL;
+		}
+		if (!running)
+			interval = gdb_poll_backoff ? 1 : gdb_poll_interval;
+		else if (gdb_poll_backoff)
+			interval = MIN(interval * 2, gdb_poll_interval);
+
+		if (running) {
+			timeout = wait;
+		} else if (!attached) {
+			/* Background scans are of the first port */
+			gdb_session_switch(0);
+			timeout = command_auto_scan();
+		}
+		int n = gdb_if_wait_any(timeout);
+		if (n < 0)
+			continue;
+		gdb_session_switch(n);
+
+		if (halt_wait) {
+			/* All-stop GDB only interrupts a running target */
+			unsigned char c = gdb_if_getchar();
+			if ((c == '\x03') || (c == '\x04')) {
+				target_halt_request(cur_target);
+				interrupted = true;
+			}
+		} else {
+			int size = gdb_getpacket(pbuf, BUF_SIZE);
+			gdb_process_packet(size);
+		}
+
+		if (!gdb_if_connected())
+			gdb_session_reset();
+	}
+}
+#endif
+
+bool gdb_target_recover(void)
+{
+	volatile struct exception e;
+
+	if (!cur_target || !target_recover(cur_target))
+		return false;
+	rtos_invalidate();
+
+	/* The core runs again if debug lost power, but GDB still sees it
+	 * stopped unless it was resumed */
+	bool stopped = !target_running;
+#if defined(GDB_SESSIONS)
+	stopped &= !halt_wait;
+#endif
+	TRY_CATCH(e, EXCEPTION_ALL) {
+		if (stopped)
+			target_halt_request(cur_target);
+	}
+	return !e.type;
+}
+
 void gdb_main(void)
 {
+#if defined(GDB_SESSIONS)
+	gdb_sessions();
+#else
 	gdb_main_loop(&gdb_controller, false);
+#endif
 }
@@ -29,55 +29,127 @@
 
 #include <stdarg.h>
 
+/* Set once GDB has agreed to QStartNoAckMode */
+static bool noackmode;
+
+void gdb_set_noackmode(bool enable)
+{
+	noackmode = enable;
+}
+
+bool gdb_noackmode(void)
+{
+	return noackmode;
+}
+
+/* Packets are parsed straight from the interface's receive buffer, a
+ * contiguous block at a time.  Data runs are bounded by memchr() for the
+ * '#' and unescaped, copied and checksummed in one pass.  The state
+ * carries over between blocks, as a packet can span several.
+ */
 int gdb_getpacket(char *packet, int size)
 {
-	unsigned char c;
-	unsigned char csum;
-	char recv_csum[3];
-	int i;
+	enum { PKT_START, PKT_DATA, PKT_CSUM } state = PKT_START;
+	unsigned char csum = 0;
+	char recv_csum[2];
+	int csum_len = 0;
+	bool escape = false, overflow = false;
+	int i = 0;
 
 	while(1) {
-		/* Wait for packet start */
-		while((packet[0] = gdb_if_getchar()) != '$')
-			if(packet[0] == 0x04) return 1;
+		const uint8_t *data;
+		size_t len = gdb_if_peek(&data);
+		size_t used = 0;
 
-		i = 0; csum = 0;
-		/* Capture packet data into buffer */
-		while((c = gdb_if_getchar()) != '#') {
+		if(len == 0) {	/* Connection closed, detach */
+			packet[0] = 0x04;
+			return 1;
+		}
 
-			if(i == size) break; /* Oh shit */
+		while(used < len) {
+			const uint8_t *p = data + used;
+			size_t left = len - used;
 
-			if(c == '$') { /* Restart capture */
-				i = 0;
-				csum = 0;
-				continue;
-			}
-			if(c == '}') { /* escaped char */
-				c = gdb_if_getchar();
-				csum += c + '}';
-				packet[i++] = c ^ 0x20;
-				continue;
+			if(state == PKT_START) {
+				/* Wait for packet start, ^D detaches */
+				const uint8_t *start = memchr(p, '$', left);
+				size_t run = start ? (size_t)(start - p) : left;
+				const uint8_t *eot = memchr(p, 0x04, run);
+				if(eot) {
+					gdb_if_consume(used + (eot - p) + 1);
+					packet[0] = 0x04;
+					return 1;
+				}
+				used += run;
+				if(start) {
+					used++;
+					state = PKT_DATA;
+					i = 0; csum = 0;
+					escape = overflow = false;
+				}
+			} else if(state == PKT_DATA) {
+				/* An escaped character is never a '#' */
+				const uint8_t *end = memchr(p, '#', left);
+				size_t run = end ? (size_t)(end - p) : left;
+				for(size_t j = 0; j < run; j++) {
+					uint8_t c = p[j];
+					if(escape) {
+						escape = false;
+						csum += c;
+						c ^= 0x20;
+					} else if(c == '$') { /* Restart capture */
+						i = 0; csum = 0;
+						overflow = false;
+						continue;
+					} else {
+						csum += c;
+						if(c == '}') {
+							escape = true;
+							continue;
+						}
+					}
+					if(i == size) {
+						overflow = true;
+						continue;
+					}
+					packet[i++] = c;
+				}
+				used += run;
+				if(end) {
+					used++;
+					state = PKT_CSUM;
+					csum_len = 0;
+				}
+			} else {
+				recv_csum[csum_len++] = *p;
+				used++;
+				if(csum_len < 2)
+					continue;
+
+				uint8_t rx;
+				unhexify(&rx, recv_csum, 1);
+				/* return packet if checksum matches */
+				if(!overflow && (rx == csum)) {
+					gdb_if_consume(used);
+					goto done;
+				}
+				/* get here if checksum fails */
+				if (!noackmode)
+					gdb_if_putchar('-', 1); /* send nack */
+				state = PKT_START;
 			}
-			csum += c;
-			packet[i++] = c;
 		}
-		recv_csum[0] = gdb_if_getchar();
-		recv_csum[1] = gdb_if_getchar();
-		recv_csum[2] = 0;
-
-		/* return packet if checksum matches */
-		if(csum == strtol(recv_csum, NULL, 16)) break;
-
-		/* get here if checksum fails */
-		gdb_if_putchar('-', 1); /* send nack */
+		gdb_if_consume(used);
 	}
-	gdb_if_putchar('+', 1); /* send ack */
+done:
+	if (!noackmode)
+		gdb_if_putchar('+', 1); /* send ack */
 	packet[i] = 0;
 
 #ifdef DEBUG_GDBPACKET
 	DEBUG("%s : ", __func__);
 	for(int j = 0; j < i; j++) {
-		c = packet[j];
+		unsigned char c = packet[j];
 		if ((c >= 32) && (c < 127))
 			DEBUG("%c", c);
 		else
@@ -88,12 +160,25 @@ int gdb_getpacket(char *packet, int size)
 	return i;
 }
 
-void gdb_putpacket(const char *packet, int size)
+/* End a packet with its checksum and flush it */
+static void gdb_send_csum(unsigned char csum)
 {
-	int i;
+	static const char hexdigits[] = "0123456789ABCDEF";
+	char xmit_csum[3];
+
+	xmit_csum[0] = '#';
+	xmit_csum[1] = hexdigits[csum >> 4];
+	xmit_csum[2] = hexdigits[csum & 0xf];
+	gdb_if_write(xmit_csum, 3, 1);
+}
+
+/* Frame and send a packet.  Notifications ('%') are never acked. */
+static void gdb_send(char frame, const char *packet, int size)
+{
+	int i, start;
 	unsigned char csum;
 	unsigned char c;
-	char xmit_csum[3];
+	char esc[2];
 	int tries = 0;
 
 	do {
@@ -101,8 +186,10 @@ void gdb_putpacket(const char *packet, int size)
 		DEBUG("%s : ", __func__);
 #endif
 		csum = 0;
-		gdb_if_putchar('$', 0);
-		for(i = 0; i < size; i++) {
+		gdb_if_putchar(frame, 0);
+		/* Runs of plain characters are passed through in one
+		 * write, only the escaped ones are sent separately */
+		for(i = start = 0; i < size; i++) {
 			c = packet[i];
 #ifdef DEBUG_GDBPACKET
 			if ((c >= 32) && (c < 127))
@@ -110,23 +197,64 @@ void gdb_putpacket(const char *packet, int size)
 			else
 				DEBUG("\\x%02X", c);
 #endif
-			if((c == '$') || (c == '#') || (c == '}')) {
-				gdb_if_putchar('}', 0);
-				gdb_if_putchar(c ^ 0x20, 0);
+			if((c == '$') || (c == '#') || (c == '}') || (c == '*')) {
+				gdb_if_write(packet + start, i - start, 0);
+				esc[0] = '}';
+				esc[1] = c ^ 0x20;
+				gdb_if_write(esc, 2, 0);
 				csum += '}' + (c ^ 0x20);
+				start = i + 1;
 			} else {
-				gdb_if_putchar(c, 0);
 				csum += c;
 			}
 		}
-		gdb_if_putchar('#', 0);
-		sprintf(xmit_csum, "%02X", csum);
-		gdb_if_putchar(xmit_csum[0], 0);
-		gdb_if_putchar(xmit_csum[1], 1);
+		gdb_if_write(packet + start, size - start, 0);
+		gdb_send_csum(csum);
 #ifdef DEBUG_GDBPACKET
 		DEBUG("\n");
 #endif
-	} while((gdb_if_getchar_to(2000) != '+') && (tries++ < 3));
+	} while ((frame == '$') && !noackmode &&
+	         (gdb_if_getchar_to(2000) != '+') && (tries++ < 3));
+}
+
+void gdb_putpacket(const char *packet, int size)
+{
+	gdb_send('$', packet, size);
+}
+
+/* Digits encoded per write by gdb_putpacket_hex() */
+#define GDB_HEX_CHUNK	32
+
+/* Send buf hex encoded, as it is encoded rather than from a copy of the
+ * whole reply.  Hex digits never need escaping. */
+void gdb_putpacket_hex(const void *buf, size_t size)
+{
+	char hex[GDB_HEX_CHUNK * 2 + 1];
+	int tries = 0;
+
+	do {
+		const uint8_t *b = buf;
+		unsigned char csum = 0;
+
+		gdb_if_putchar('$', 0);
+		for (size_t i = 0; i < size; i += GDB_HEX_CHUNK) {
+			size_t n = MIN(size - i, GDB_HEX_CHUNK);
+			hexify(hex, b + i, n);
+			for (size_t j = 0; j < n * 2; j++)
+				csum += hex[j];
+			gdb_if_write(hex, n * 2, 0);
+		}
+		gdb_send_csum(csum);
+#ifdef DEBUG_GDBPACKET
+		DEBUG("%s : %u bytes\n", __func__, (unsigned)size);
+#endif
+	} while (!noackmode && (gdb_if_getchar_to(2000) != '+') &&
+	         (tries++ < 3));
+}
+
+void gdb_putnotification(const char *packet, int size)
+{
+	gdb_send('%', packet, size);
 }
 
 void gdb_putpacket_f(const char *fmt, ...)
@@ -142,15 +270,22 @@ void gdb_putpacket_f(const char *fmt, ...)
 	va_end(ap);
 }
 
+/* Console output is sent in 'O' packets of up to GDB_OUT_CHUNK characters */
+#define GDB_OUT_CHUNK	64
+
 void gdb_out(const char *buf)
 {
-	char *hexdata;
-	int i;
+	char hexdata[1 + GDB_OUT_CHUNK * 2];
+	size_t len = strlen(buf);
 
-	hexdata = alloca((i = strlen(buf)*2 + 1) + 1);
 	hexdata[0] = 'O';
-	hexify(hexdata+1, buf, strlen(buf));
-	gdb_putpacket(hexdata, i);
+	do {
+		size_t n = MIN(len, GDB_OUT_CHUNK);
+		hexify(hexdata + 1, buf, n);
+		gdb_putpacket(hexdata, 1 + n * 2);
+		buf += n;
+		len -= n;
+	} while (len);
 }
 
 void gdb_voutf(const char *fmt, va_list ap)
@@ -24,39 +24,61 @@
 #include "general.h"
 #include "hex_utils.h"
 
-static const char hexdigits[] = "0123456789abcdef";
+/* Both digits of every byte value, so a byte is encoded with one lookup */
+#define HEX_PAIRS(h) \
+	h "0" h "1" h "2" h "3" h "4" h "5" h "6" h "7" \
+	h "8" h "9" h "a" h "b" h "c" h "d" h "e" h "f"
+static const char hexpairs[] =
+	HEX_PAIRS("0") HEX_PAIRS("1") HEX_PAIRS("2") HEX_PAIRS("3")
+	HEX_PAIRS("4") HEX_PAIRS("5") HEX_PAIRS("6") HEX_PAIRS("7")
+	HEX_PAIRS("8") HEX_PAIRS("9") HEX_PAIRS("a") HEX_PAIRS("b")
+	HEX_PAIRS("c") HEX_PAIRS("d") HEX_PAIRS("e") HEX_PAIRS("f");
 
+/* Encoded from the end, so hex may be the same buffer as buf */
 char * hexify(char *hex, const void *buf, size_t size)
 {
-	char *tmp = hex;
 	const uint8_t *b = buf;
 
+	hex[size * 2] = 0;
 	while (size--) {
-		*tmp++ = hexdigits[*b >> 4];
-		*tmp++ = hexdigits[*b++ & 0xF];
+		const char *pair = &hexpairs[b[size] * 2];
+		hex[size * 2 + 1] = pair[1];
+		hex[size * 2] = pair[0];
 	}
-	*tmp++ = 0;
 
 	return hex;
 }
 
-static uint8_t unhex_digit(char hex)
+/* Without branches: '0'-'9' have bit 6 clear, and the low nibble of
+ * 'A'-'F' and 'a'-'f' is 9 less than their value */
+static inline uint8_t unhex_digit(char hex)
 {
-	uint8_t tmp = hex - '0';
-	if(tmp > 9)
-		tmp -= 'A' - '0' - 10;
-	if(tmp > 16)
-		tmp -= 'a' - 'A';
-	return tmp;
+	return (hex & 0xf) + 9 * ((hex >> 6) & 1);
 }
 
+/* Decoded from the start, so buf may be the same buffer as hex */
 char * unhexify(void *buf, const char *hex, size_t size)
 {
 	uint8_t *b = buf;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	/* Four bytes from eight digits at a time, each digit a byte lane */
+	for (; size >= 4; size -= 4, hex += 8, b += 4) {
+		uint32_t w[2];
+		memcpy(w, hex, sizeof(w));
+		for (int i = 0; i < 2; i++) {
+			uint32_t n = (w[i] & 0x0f0f0f0f) +
+			             9 * ((w[i] >> 6) & 0x01010101);
+			/* High nibbles are in the even lanes */
+			n = ((n & 0x00ff00ff) << 4) | ((n >> 8) & 0x00ff00ff);
+			b[i * 2] = n;
+			b[i * 2 + 1] = n >> 16;
+		}
+	}
+#endif
 	while (size--) {
 		*b = unhex_digit(*hex++) << 4;
 		*b++ |= unhex_digit(*hex++);
 	}
 	return buf;
 }
-
@@ -0,0 +1,201 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This file implements offline programming from an image in the probe's
+ * flash.  The image is captured from the flash writes of a GDB load, as
+ * a list of address ranges whose data follows the header in the store.
+ * The header is written last, so an interrupted capture leaves no image.
+ */
+
+#include "general.h"
+#include "target.h"
+#include "crc32.h"
+#include "image.h"
+
+#define IMAGE_MAGIC	0x474d4942	/* "BIMG" */
+#define IMAGE_SEGMENTS	16
+/* Offset of the data in the store */
+#define IMAGE_DATA	256
+
+struct image_header {
+	uint32_t magic;
+	uint32_t count;
+	uint32_t size;
+	uint32_t crc;	/* Of all the data */
+	struct {
+		uint32_t addr;
+		uint32_t len;
+	} seg[IMAGE_SEGMENTS];
+};
+
+/* Maximum write to the target, flash stubs take data in this size */
+#define IMAGE_CHUNK	1024
+
+static struct image_header capture;
+static bool capturing;
+static bool capture_failed;
+/* Data not yet in the store, which only takes whole words */
+static uint8_t capture_word[4];
+static size_t capture_word_len;
+static size_t capture_offset;
+
+bool image_capture_start(void)
+{
+	memset(&capture, 0, sizeof(capture));
+	capture_word_len = 0;
+	capture_offset = IMAGE_DATA;
+	capture_failed = false;
+	capturing = image_if_erase();
+	return capturing;
+}
+
+bool image_capturing(void)
+{
+	return capturing;
+}
+
+static void capture_store(const void *data, size_t len)
+{
+	if (!capture_failed && !image_if_write(capture_offset, data, len))
+		capture_failed = true;
+	capture_offset += len;
+}
+
+void image_capture_write(target_addr addr, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	if (!capturing || capture_failed)
+		return;
+	if (IMAGE_DATA + capture.size + len > image_if_size()) {
+		capture_failed = true;
+		return;
+	}
+
+	/* Writes following on from the last are part of its segment */
+	unsigned n = capture.count;
+	if (n && (capture.seg[n - 1].addr + capture.seg[n - 1].len == addr)) {
+		capture.seg[n - 1].len += len;
+	} else if (n < IMAGE_SEGMENTS) {
+		capture.seg[n].addr = addr;
+		capture.seg[n].len = len;
+		capture.count++;
+	} else {
+		capture_failed = true;
+		return;
+	}
+	capture.size += len;
+
+	while (len) {
+		if (capture_word_len || (len < 4)) {
+			capture_word[capture_word_len++] = *p++;
+			len--;
+			if (capture_word_len == 4) {
+				capture_store(capture_word, 4);
+				capture_word_len = 0;
+			}
+		} else {
+			size_t words = len & ~3;
+			capture_store(p, words);
+			p += words;
+			len -= words;
+		}
+	}
+}
+
+bool image_capture_done(void)
+{
+	if (!capturing)
+		return true;
+	capturing = false;
+
+	if (capture_word_len) {
+		memset(capture_word + capture_word_len, 0xff,
+		       4 - capture_word_len);
+		capture_store(capture_word, 4);
+	}
+	if (capture_failed || !capture.count)
+		return false;
+
+	capture.crc = crc32_buf(image_if_base() + IMAGE_DATA, capture.size);
+	capture.magic = IMAGE_MAGIC;
+	return image_if_write(0, &capture, sizeof(capture));
+}
+
+static const struct image_header *image_stored(void)
+{
+	const struct image_header *h = (const void *)image_if_base();
+
+	if ((h->magic != IMAGE_MAGIC) || (h->count > IMAGE_SEGMENTS) ||
+	    (h->size > image_if_size() - IMAGE_DATA) ||
+	    (crc32_buf(image_if_base() + IMAGE_DATA, h->size) != h->crc))
+		return NULL;
+	return h;
+}
+
+bool image_info(unsigned *segments, size_t *size, uint32_t *crc)
+{
+	const struct image_header *h = image_stored();
+
+	if (h == NULL)
+		return false;
+	*segments = h->count;
+	*size = h->size;
+	*crc = h->crc;
+	return true;
+}
+
+/* The image is streamed to the target straight from where the store is
+ * mapped, as GDB would send it. */
+int image_program(target *t)
+{
+	const struct image_header *h = image_stored();
+	const uint8_t *data;
+	int ret = 0;
+
+	if (h == NULL)
+		return IMAGE_PROGRAM_NONE;
+
+	/* As for GDB, so we aren't interrupted in IRQ context */
+	target_reset(t);
+	for (unsigned i = 0; i < h->count; i++)
+		ret |= target_flash_erase(t, h->seg[i].addr, h->seg[i].len);
+
+	data = image_if_base() + IMAGE_DATA;
+	for (unsigned i = 0; !ret && (i < h->count); i++) {
+		for (size_t off = 0; !ret && (off < h->seg[i].len);
+		     off += IMAGE_CHUNK) {
+			size_t len = MIN(h->seg[i].len - off, IMAGE_CHUNK);
+			ret |= target_flash_write(t, h->seg[i].addr + off,
+			                          data + off, len);
+		}
+		data += h->seg[i].len;
+	}
+	ret |= target_flash_done(t);
+	if (ret)
+		return IMAGE_PROGRAM_FLASH;
+
+	data = image_if_base() + IMAGE_DATA;
+	for (unsigned i = 0; i < h->count; i++) {
+		/* On the target if it can, as for GDB's compare-sections */
+		uint32_t crc = generic_crc32(t, h->seg[i].addr, h->seg[i].len);
+		if (crc != crc32_buf(data, h->seg[i].len))
+			return IMAGE_PROGRAM_VERIFY;
+		data += h->seg[i].len;
+	}
+	return IMAGE_PROGRAM_OK;
+}
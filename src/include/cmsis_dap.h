@@ -0,0 +1,100 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CMSIS_DAP_H
+#define __CMSIS_DAP_H
+
+/* Largest request and response, one full speed bulk packet */
+#define DAP_PACKET_SIZE	64
+
+#define DAP_INFO		0x00
+#define DAP_HOST_STATUS		0x01
+#define DAP_CONNECT		0x02
+#define DAP_DISCONNECT		0x03
+#define DAP_TRANSFER_CONFIGURE	0x04
+#define DAP_TRANSFER		0x05
+#define DAP_TRANSFER_BLOCK	0x06
+#define DAP_TRANSFER_ABORT	0x07
+#define DAP_WRITE_ABORT		0x08
+#define DAP_DELAY		0x09
+#define DAP_RESET_TARGET	0x0A
+#define DAP_SWJ_PINS		0x10
+#define DAP_SWJ_CLOCK		0x11
+#define DAP_SWJ_SEQUENCE	0x12
+#define DAP_SWD_CONFIGURE	0x13
+#define DAP_SWD_SEQUENCE	0x1D
+#define DAP_EXECUTE_COMMANDS	0x7F
+#define DAP_INVALID		0xFF
+
+/* Vendor commands giving a hosted build the JTAG primitives, which the
+ * standard commands don't map onto.  Only present when DAP_INFO_VENDOR
+ * is DAP_VENDOR_NAME. */
+#define DAP_VENDOR_NAME		"Black Sphere Technologies"
+#define DAP_VENDOR_JTAG_INIT	0x80	/* -> status */
+#define DAP_VENDOR_JTAG_RESET	0x81	/* -> status */
+#define DAP_VENDOR_JTAG_TMS	0x82	/* bits, TMS[4] -> status */
+#define DAP_VENDOR_JTAG_TDI_TDO	0x83	/* final TMS, bits, TDI[] -> status, TDO[] */
+#define DAP_VENDOR_JTAG_NEXT	0x84	/* TMS, TDI -> TDO */
+/* Bits in one DAP_VENDOR_JTAG_TDI_TDO, 0 meaning 256 */
+#define DAP_VENDOR_JTAG_BITS	256
+
+#define DAP_OK			0x00
+#define DAP_ERROR		0xFF
+
+#define DAP_INFO_VENDOR		0x01
+#define DAP_INFO_PRODUCT	0x02
+#define DAP_INFO_PROTOCOL	0x04
+#define DAP_INFO_FIRMWARE	0x09
+#define DAP_INFO_CAPABILITIES	0xF0
+#define DAP_INFO_PACKET_COUNT	0xFE
+#define DAP_INFO_PACKET_SIZE	0xFF
+
+#define DAP_CAP_SWD		(1 << 0)
+
+#define DAP_PORT_DEFAULT	0
+#define DAP_PORT_SWD		1
+
+/* Transfer request bits */
+#define DAP_TRANSFER_APnDP	(1 << 0)
+#define DAP_TRANSFER_RnW	(1 << 1)
+#define DAP_TRANSFER_A32	(3 << 2)
+#define DAP_TRANSFER_MATCH	(1 << 4)
+#define DAP_TRANSFER_MASK	(1 << 5)
+
+/* Transfer response bits */
+#define DAP_TRANSFER_OK		0x01
+#define DAP_TRANSFER_WAIT	0x02
+#define DAP_TRANSFER_FAULT	0x04
+#define DAP_TRANSFER_ERROR	0x08
+#define DAP_TRANSFER_MISMATCH	0x10
+
+#define DAP_SWJ_nRESET		(1 << 7)
+
+/* Execute one CMSIS-DAP command packet.  Returns the length of the
+ * response, or 0 for commands that don't have one. */
+size_t dap_process(const uint8_t *req, size_t len,
+                   uint8_t *resp, size_t size);
+
+/* Provided by the platform: answer a pending request, called from the
+ * GDB server's wait loops */
+#if !defined(PC_HOSTED)
+#include <libopencm3/usb/usbd.h>
+void cmsis_dap_usb_out_cb(usbd_device *dev, uint8_t ep);
+#endif
+void cmsis_dap_if_poll(void);
+
+#endif
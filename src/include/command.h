@@ -23,7 +23,16 @@
 
 #include "target.h"
 
-int command_process(target *t, char *cmd);
+/* Commands flagged CMD_HALTED are refused while 'running' */
+int command_process(target *t, char *cmd, bool running);
+/* Keep the target list up to date while no target is attached, with
+ * 'monitor auto_scan'.  Returns the ms until the next call, or -1 when
+ * it's off. */
+int command_auto_scan(void);
+#ifdef PLATFORM_HAS_SETTINGS
+/* Apply the settings in probe flash, before GDB connects */
+void command_config_load(void);
+#endif
 
 #endif
 
@@ -22,5 +22,12 @@
 #define __CRC32_H
 
 uint32_t generic_crc32(target *t, uint32_t base, int len);
+uint32_t crc32_buf(const void *buf, size_t len);
+/* Carry on a CRC of earlier data, starting from crc32_buf()'s result */
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len);
+uint32_t crc32_fill(uint8_t value, size_t len);
+uint32_t crc32_ieee_buf(const void *buf, size_t len);
+uint32_t crc32_ieee_update(uint32_t crc, const void *buf, size_t len);
+uint32_t crc32_ieee_fill(uint8_t value, size_t len);
 
 #endif
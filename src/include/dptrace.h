@@ -0,0 +1,62 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Ring of the last debug port transactions, built with ENABLE_DPTRACE=1 */
+#ifndef __DPTRACE_H
+#define __DPTRACE_H
+
+/* Request bits, the APnDP, RnW and A[3:2] bits of an SW-DP request */
+#define DPTRACE_APnDP	0x01
+#define DPTRACE_RnW	0x02
+#define DPTRACE_A	0x0c
+#define DPTRACE_JTAG	0x10	/* Made through a JTAG-DP */
+#define DPTRACE_REQUEST(APnDP, RnW, addr) \
+	(((APnDP) ? DPTRACE_APnDP : 0) | ((RnW) ? DPTRACE_RnW : 0) | \
+	 ((addr) & DPTRACE_A))
+
+#ifdef ENABLE_DPTRACE
+
+#ifndef DPTRACE_SIZE
+#define DPTRACE_SIZE	256	/* Power of two */
+#endif
+
+struct dptrace_entry {
+	uint32_t time_us;	/* When the request was sent */
+	uint8_t request;
+	uint8_t ack;		/* As on the wire, JTAG-DP has OK 2, WAIT 1 */
+	uint16_t waits;		/* WAIT responses before the ACK */
+};
+
+void dptrace_record(uint32_t time_us, uint8_t request, uint8_t ack,
+                    unsigned waits);
+void dptrace_clear(void);
+/* Up to DPTRACE_SIZE entries, the oldest first */
+unsigned dptrace_count(void);
+const struct dptrace_entry *dptrace_entry(unsigned i);
+
+#define DPTRACE_START(var) uint32_t var = platform_time_us()
+#define DPTRACE(start, request, ack, waits) \
+	dptrace_record((start), (request), (ack), (waits))
+
+#else
+
+#define DPTRACE_START(var) do {} while (0)
+#define DPTRACE(start, request, ack, waits) do { (void)(waits); } while (0)
+
+#endif
+
+#endif
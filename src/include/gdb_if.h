@@ -21,15 +21,40 @@
 #ifndef __GDB_IF_H
 #define __GDB_IF_H
 
-#if !defined(LIBFTDI)
+#if !defined(PC_HOSTED)
 #include <libopencm3/usb/usbd.h>
 void gdb_usb_out_cb(usbd_device *dev, uint8_t ep);
 #endif
 
 int gdb_if_init(void);
 unsigned char gdb_if_getchar(void);
+/* Wait for input and return how much of it is buffered contiguously at
+ * *data, 0 if the connection has closed.  gdb_if_consume() marks bytes
+ * of it as read. */
+size_t gdb_if_peek(const uint8_t **data);
+void gdb_if_consume(size_t len);
 unsigned char gdb_if_getchar_to(int timeout);
+bool gdb_if_pending(void);
+#if defined(PC_HOSTED)
+/* Block for up to ms until there is input, true if there is */
+bool gdb_if_wait(uint32_t ms);
+
+/* Concurrent GDB connections, each on its own port and attached to its
+ * own target.  The other calls work on the session set last. */
+#define GDB_SESSIONS	4
+#elif PLATFORM_SWD_PORTS > 1
+/* A GDB interface for each SWD port, session n debugs port n */
+#define GDB_SESSIONS	PLATFORM_SWD_PORTS
+#endif
+#if defined(GDB_SESSIONS)
+void gdb_if_session(int n);
+bool gdb_if_connected(void);
+/* Wait up to timeout ms (forever if < 0) for input on any session,
+ * accepting new connections.  Returns the session with input or -1. */
+int gdb_if_wait_any(int timeout);
+#endif
 void gdb_if_putchar(unsigned char c, int flush);
+void gdb_if_write(const void *buf, size_t len, int flush);
 
 #endif
 
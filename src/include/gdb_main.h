@@ -22,6 +22,14 @@
 #define __GDB_MAIN_H
 
 void gdb_main(void);
+/* After an error escaped gdb_main(), try to get the attached target back
+ * instead of dropping all targets.  False if there is none to keep. */
+bool gdb_target_recover(void);
+
+/* Halt polling while the target runs: wait gdb_poll_interval ms between
+ * polls, or back off up to that interval.  0 polls continuously. */
+extern uint32_t gdb_poll_interval;
+extern bool gdb_poll_backoff;
 
 #endif
 
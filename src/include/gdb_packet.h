@@ -27,6 +27,10 @@ int gdb_getpacket(char *packet, int size);
 void gdb_putpacket(const char *packet, int size);
 #define gdb_putpacketz(packet) gdb_putpacket((packet), strlen(packet))
 void gdb_putpacket_f(const char *packet, ...);
+void gdb_putpacket_hex(const void *buf, size_t size);
+void gdb_putnotification(const char *packet, int size);
+void gdb_set_noackmode(bool enable);
+bool gdb_noackmode(void);
 
 void gdb_out(const char *buf);
 void gdb_voutf(const char *fmt, va_list);
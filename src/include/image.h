@@ -0,0 +1,50 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Firmware image kept in the probe's spare flash, so targets can be
+ * programmed without a host */
+
+#ifndef __IMAGE_H
+#define __IMAGE_H
+
+#include "target.h"
+
+/* Erase the store and record the flash writes of the next GDB load */
+bool image_capture_start(void);
+bool image_capturing(void);
+void image_capture_write(target_addr addr, const void *data, size_t len);
+/* Write the image header, returns false if the image didn't fit */
+bool image_capture_done(void);
+
+/* Stored image, false if there is none */
+bool image_info(unsigned *segments, size_t *size, uint32_t *crc);
+
+#define IMAGE_PROGRAM_OK	0
+#define IMAGE_PROGRAM_NONE	-1	/* No valid image stored */
+#define IMAGE_PROGRAM_FLASH	-2	/* Erase or programming failed */
+#define IMAGE_PROGRAM_VERIFY	-3	/* Flash doesn't match the image */
+/* Erase, program and verify the target from the stored image */
+int image_program(target *t);
+
+/* Provided by the platform: the store is read where it is mapped, and
+ * written in whole words at word aligned offsets */
+const uint8_t *image_if_base(void);
+size_t image_if_size(void);
+bool image_if_erase(void);
+bool image_if_write(size_t offset, const void *data, size_t len);
+
+#endif
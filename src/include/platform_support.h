@@ -24,7 +24,7 @@
 #	error "Include 'general.h' instead"
 #endif
 
-#if defined(LIBFTDI)
+#if defined(PC_HOSTED)
 void platform_init(int argc, char **argv);
 #else
 void platform_init(void);
@@ -32,6 +32,7 @@ void platform_init(void);
 
 typedef struct platform_timeout platform_timeout;
 void platform_timeout_set(platform_timeout *t, uint32_t ms);
+void platform_timeout_set_us(platform_timeout *t, uint32_t us);
 bool platform_timeout_is_expired(platform_timeout *t);
 void platform_delay(uint32_t ms);
 
@@ -43,5 +44,26 @@ bool platform_target_get_power(void);
 void platform_target_set_power(bool power);
 void platform_request_boot(void);
 
+#ifdef PLATFORM_HAS_TARGET_SENSE
+/* Whether the target is powered, by the probe or from its own supply */
+bool platform_target_present(void);
+#endif
+
+#ifdef PLATFORM_HAS_FREQUENCY
+void platform_max_frequency_set(uint32_t frequency);
+uint32_t platform_max_frequency_get(void);
+#endif
+
+/* Probes with more than one SWD port drive the one selected last.  Each
+ * port has its own targets and GDB interface. */
+#ifdef PLATFORM_SWD_PORTS
+void platform_swd_port_select(unsigned n);
+unsigned platform_swd_port(void);
+#else
+#define PLATFORM_SWD_PORTS	1
+static inline void platform_swd_port_select(unsigned n) { (void)n; }
+static inline unsigned platform_swd_port(void) { return 0; }
+#endif
+
 #endif
 
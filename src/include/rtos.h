@@ -0,0 +1,67 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* FreeRTOS task awareness, so GDB sees tasks as threads */
+
+#ifndef __RTOS_H
+#define __RTOS_H
+
+#include "target.h"
+
+#ifndef RTOS_THREADS_MAX
+#define RTOS_THREADS_MAX	32
+#endif
+#define RTOS_NAME_MAX		16
+
+enum rtos_state {
+	RTOS_RUNNING,
+	RTOS_READY,
+	RTOS_BLOCKED,
+	RTOS_SUSPENDED,
+	RTOS_DELETED,
+};
+
+struct rtos_thread {
+	target_addr id;		/* TCB address */
+	enum rtos_state state;
+	char name[RTOS_NAME_MAX + 1];
+};
+
+void rtos_enable(bool enable);
+bool rtos_enabled(void);
+
+/* Symbol lookup through GDB's qSymbol.  rtos_symbol_next() returns the
+ * next symbol to ask for, or NULL once all have been answered. */
+void rtos_symbols_reset(void);
+const char *rtos_symbol_next(void);
+void rtos_symbol_set(const char *name, bool found, target_addr addr);
+bool rtos_symbols_found(void);
+
+/* Forget what was read from the target, after it ran */
+void rtos_invalidate(void);
+/* The running task, 0 if the scheduler isn't running or isn't known */
+target_addr rtos_current(target *t);
+/* All tasks, NULL if there are none */
+const struct rtos_thread *rtos_threads(target *t, unsigned *count);
+const struct rtos_thread *rtos_thread(target *t, target_addr id);
+const char *rtos_state_name(enum rtos_state state);
+/* Register of a task as target_thread_reg_read(), from its stack unless
+ * it is the running one */
+ssize_t rtos_reg_read(target *t, target_addr id, int reg, void *data,
+                      size_t max);
+
+#endif
@@ -0,0 +1,44 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* SEGGER RTT compatible channel between a running target and the host */
+
+#ifndef __RTT_H
+#define __RTT_H
+
+#include "target.h"
+
+void rtt_enable(bool enable);
+bool rtt_enabled(void);
+/* Use the control block at addr, or search RAM for it if addr is 0 */
+void rtt_set_address(target_addr addr);
+target_addr rtt_address(void);
+/* Control block in use, false if it hasn't been found yet */
+bool rtt_found(target_addr *addr);
+
+/* Move data while the target runs.  Returns the time in ms until it next
+ * wants to be called. */
+uint32_t rtt_poll(target *t);
+
+/* Provided by the platform, normally on the USB UART port */
+void rtt_if_enable(bool enable);
+/* Send to the host, returns the number of bytes taken */
+size_t rtt_if_write(const void *buf, size_t len);
+/* Receive from the host, returns the number of bytes read */
+size_t rtt_if_read(void *buf, size_t len);
+
+#endif
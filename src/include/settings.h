@@ -0,0 +1,59 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Probe settings kept in spare probe flash, applied at power up */
+
+#ifndef __SETTINGS_H
+#define __SETTINGS_H
+
+/* Keys of the stored values, never reuse one for something else */
+enum settings_key {
+	SETTINGS_CONNECT_SRST = 1,
+	SETTINGS_FLASH_DIFF,
+	SETTINGS_FLASH_VERIFY,
+	SETTINGS_HALT_POLL,
+	SETTINGS_AP_SEARCH,
+	SETTINGS_FREQUENCY,
+	SETTINGS_RTOS,
+	SETTINGS_RTT,
+	SETTINGS_TRACESWO,
+	SETTINGS_SCAN,
+	SETTINGS_SCAN_CACHE,
+	SETTINGS_FLASH_BOOST,
+	SETTINGS_AUTO_SCAN,
+};
+
+/* Values are collected with settings_put() and written by settings_save().
+ * The header is written last, so an interrupted save leaves none. */
+void settings_begin(void);
+bool settings_put(uint8_t key, const void *data, size_t len);
+bool settings_save(void);
+bool settings_clear(void);
+
+/* Length of the stored value, -1 if there is none */
+int settings_get(uint8_t key, void *data, size_t max);
+/* Bytes used by the stored values, 0 if there are none */
+size_t settings_size(void);
+
+/* Provided by the platform: the store is read where it is mapped, and
+ * written in whole words at word aligned offsets */
+const uint8_t *settings_if_base(void);
+size_t settings_if_size(void);
+bool settings_if_erase(void);
+bool settings_if_write(size_t offset, const void *data, size_t len);
+
+#endif
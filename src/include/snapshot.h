@@ -0,0 +1,36 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Run length compressed memory snapshots, read by GDB as the
+ * qXfer:bmp-snapshot object.  The stream is a sequence of records:
+ *   0x00-0x7F n         n + 1 literal bytes follow
+ *   0x80-0xFF n, b, v   ((n & 0x7F) << 8 | b) + 4 bytes of value v
+ */
+
+#ifndef __SNAPSHOT_H
+#define __SNAPSHOT_H
+
+#include "target.h"
+
+/* Compressed bytes of the len bytes at addr, starting offset bytes into
+ * the stream.  Streams are produced in order, so offset must be 0 to
+ * start one or follow on from the previous read.  Returns the number of
+ * bytes placed in buf, 0 at the end of the stream, or -1 on error. */
+int snapshot_read(target *t, target_addr addr, uint32_t len,
+                  uint32_t offset, uint8_t *buf, size_t size);
+
+#endif
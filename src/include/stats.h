@@ -0,0 +1,77 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Debug port and GDB packet counters, built with ENABLE_STATS=1 */
+#ifndef __STATS_H
+#define __STATS_H
+
+#ifdef ENABLE_STATS
+
+/* GDB packets are accounted by their first character, '?' to 'z' */
+#define STATS_PACKET_FIRST '?'
+#define STATS_PACKET_LAST  'z'
+#define STATS_PACKETS (STATS_PACKET_LAST - STATS_PACKET_FIRST + 1)
+
+struct stats {
+	uint32_t dp_transactions;
+	uint32_t dp_wait;
+	uint32_t dp_fault;
+	uint32_t dp_parity;
+	uint32_t swd_bits;	/* Clocked on the SW-DP wire */
+	uint32_t mem_read_bytes;
+	uint32_t mem_write_bytes;
+	uint32_t stub_runs;
+	/* Flash sessions, and us spent in each phase.  The erase, write and
+	 * done phases split up the vFlash packets, while the transfer, stub
+	 * and poll times are the debug port activity in any of them. */
+	uint32_t flash_sessions;
+	uint32_t flash_erase_us;
+	uint32_t flash_write_us;
+	uint32_t flash_done_us;
+	uint32_t flash_xfer_us;
+	uint32_t flash_stub_us;
+	uint32_t flash_poll_us;
+	uint32_t flash_skipped;	/* Erased bytes not programmed */
+	uint32_t packet_count[STATS_PACKETS];
+	uint32_t packet_ms[STATS_PACKETS];
+};
+
+extern struct stats stats;
+
+#define STATS_INC(field) (stats.field++)
+#define STATS_ADD(field, n) (stats.field += (n))
+#define STATS_PACKET(type, ms) do { \
+	if (((type) >= STATS_PACKET_FIRST) && ((type) <= STATS_PACKET_LAST)) { \
+		stats.packet_count[(type) - STATS_PACKET_FIRST]++; \
+		stats.packet_ms[(type) - STATS_PACKET_FIRST] += (ms); \
+	} \
+} while (0)
+/* Time a section of code into a us counter */
+#define STATS_TIME_START(var) uint32_t var = platform_time_us()
+#define STATS_TIME_ADD(field, var) (stats.field += platform_time_us() - (var))
+
+#else
+
+#define STATS_INC(field) do {} while (0)
+#define STATS_ADD(field, n) do {} while (0)
+#define STATS_PACKET(type, ms) do {} while (0)
+#define STATS_TIME_START(var) do {} while (0)
+#define STATS_TIME_ADD(field, var) do {} while (0)
+
+#endif
+
+#endif
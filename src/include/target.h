@@ -31,10 +31,25 @@ typedef struct target_s target;
 typedef uint32_t target_addr;
 struct target_controller;
 
-int adiv5_swdp_scan(void);
+int adiv5_swdp_scan(const uint32_t *targetsel, size_t count);
 int jtag_scan(const uint8_t *lrlens);
+void adiv5_scan_cache_flush(void);
+/* The topology cache as it is kept in memory, to keep it across power
+ * cycles.  Entries are checked against the DP before being used. */
+size_t adiv5_scan_cache_get(const void **data);
+bool adiv5_scan_cache_set(const void *data, size_t len);
+
+/* APs probed by a scan: those in adiv5_ap_list if it is not empty,
+ * otherwise APSELs from 0 until adiv5_ap_gap in a row are missing, or all
+ * 256 if adiv5_ap_gap is 0. */
+#define ADIV5_AP_LIST_MAX 8
+extern uint8_t adiv5_ap_gap;
+extern uint8_t adiv5_ap_list[ADIV5_AP_LIST_MAX];
+extern uint8_t adiv5_ap_list_len;
 
 bool target_foreach(void (*cb)(int i, target *t, void *context), void *context);
+bool target_list_empty(void);
+/* Targets of the SWD port in use, see platform_swd_port_select() */
 void target_list_free(void);
 
 /* Attach/detach functions */
@@ -42,22 +57,61 @@ target *target_attach(target *t, struct target_controller *);
 target *target_attach_n(int n, struct target_controller *);
 void target_detach(target *t);
 bool target_attached(target *t);
+/* Get the target back after it stopped responding, keeping its attach
+ * state, breakpoints and watchpoints.  False if it's gone. */
+bool target_recover(target *t);
 const char *target_driver_name(target *t);
 
 /* Memory access functions */
 const char *target_mem_map(target *t);
 int target_mem_read(target *t, void *dest, target_addr src, size_t len);
 int target_mem_write(target *t, target_addr dest, const void *src, size_t len);
+int target_mem_crc32(target *t, uint32_t *crc, target_addr base, size_t len);
+/* Memory besides flash that may be cached while the target is halted */
+bool target_mem_readonly_add(target_addr start, size_t len);
+void target_mem_readonly_clear(void);
+bool target_mem_readonly_get(unsigned i, target_addr *start, size_t *len);
+/* Longest pattern target_mem_search() and target_mem_fill() take */
+#define MEM_SEARCH_MAX		64
+/* Find data, returns 1 if found, 0 if not or -1 on error */
+int target_mem_search(target *t, target_addr base, size_t len,
+                      const void *data, size_t data_len, target_addr *addr);
+/* Fill memory with repeated data */
+int target_mem_fill(target *t, target_addr base, size_t len,
+                    const void *data, size_t data_len);
+/* Find data in the target's RAM regions */
+bool target_ram_search(target *t, const void *data, size_t len,
+                       target_addr *addr);
 /* Flash memory access functions */
 int target_flash_erase(target *t, target_addr addr, size_t len);
 int target_flash_write(target *t, target_addr dest, const void *src, size_t len);
 int target_flash_done(target *t);
+/* Skip erasing and programming flash blocks which already match */
+extern bool target_flash_diff;
+/* Check the flash written against a CRC of the data at the end of a session */
+extern bool target_flash_verify;
+/* Speed up the target's core clock for flash sessions and stubs */
+extern bool target_flash_boost;
+/* Repeat flash operations on each other target like t, returns how many */
+int target_gang_enable(target *t);
+void target_gang_disable(void);
+/* 0 if t is not in the gang, -1 if flashing it failed, 1 otherwise */
+int target_gang_status(target *t);
 
 /* Register access functions */
 size_t target_regs_size(target *t);
 const char *target_tdesc(target *t);
 void target_regs_read(target *t, void *data);
 void target_regs_write(target *t, const void *data);
+ssize_t target_reg_read(target *t, int reg, void *data, size_t max);
+ssize_t target_reg_write(target *t, int reg, const void *data, size_t size);
+/* GDB register numbers worth sending with a stop reply, which the target
+ * reads together after a halt.  Returns how many, 0 for none. */
+size_t target_regs_expedite(target *t, const uint8_t **regs);
+/* Register of a thread switched out by an RTOS, saved on its stack at sp.
+ * A reg of -1 reads all of them, laid out as by target_regs_read(). */
+ssize_t target_thread_reg_read(target *t, target_addr sp, int reg,
+                               void *data, size_t max);
 
 /* Halt/resume functions */
 enum target_halt_reason {
@@ -87,8 +141,10 @@ int target_breakwatch_set(target *t, enum target_breakwatch, target_addr, size_t
 int target_breakwatch_clear(target *t, enum target_breakwatch, target_addr, size_t);
 
 /* Command interpreter */
+/* Command needs a halted core, or runs stubs on it */
+#define CMD_HALTED (1 << 0)
 void target_command_help(target *t);
-int target_command(target *t, int argc, const char *argv[]);
+int target_command(target *t, int argc, const char *argv[], bool running);
 
 
 enum target_errno {
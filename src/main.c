@@ -29,17 +29,21 @@
 #include "exception.h"
 #include "gdb_packet.h"
 #include "morse.h"
+#include "command.h"
 
 int
 main(int argc, char **argv)
 {
-#if defined(LIBFTDI)
+#if defined(PC_HOSTED)
 	platform_init(argc, argv);
 #else
 	(void) argc;
 	(void) argv;
 	platform_init();
 #endif
+#ifdef PLATFORM_HAS_SETTINGS
+	command_config_load();
+#endif
 
 	while (true) {
 		volatile struct exception e;
@@ -48,8 +52,10 @@ main(int argc, char **argv)
 		}
 		if (e.type) {
 			gdb_putpacketz("EFF");
-			target_list_free();
-			morse("TARGET LOST.", 1);
+			if (!gdb_target_recover()) {
+				target_list_free();
+				morse("TARGET LOST.", 1);
+			}
 		}
 	}
 
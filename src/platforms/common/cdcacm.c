@@ -34,6 +34,12 @@
 #endif
 #include "usbuart.h"
 #include "serialno.h"
+#if defined(PLATFORM_HAS_CMSIS_DAP)
+#	include "cmsis_dap.h"
+#endif
+#if defined(PLATFORM_HAS_USB_OTG)
+#	include "usb_otg.h"
+#endif
 
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/usb/usbd.h>
@@ -43,11 +49,30 @@
 #include <stdlib.h>
 
 #define DFU_IF_NO 4
+#if defined(PLATFORM_HAS_TRACESWO)
+#	define DAP_IF_NO 6
+#	define DAP_IF_STRING 8
+#else
+#	define DAP_IF_NO 5
+#	define DAP_IF_STRING 7
+#endif
+#if defined(PLATFORM_HAS_CMSIS_DAP)
+#	define GDB2_IF_NO (DAP_IF_NO + 1)
+#	define GDB2_IF_STRING (DAP_IF_STRING + 1)
+#else
+#	define GDB2_IF_NO DAP_IF_NO
+#	define GDB2_IF_STRING DAP_IF_STRING
+#endif
 
 usbd_device * usbdev;
 
 static int configured;
-static int cdcacm_gdb_dtr = 1;
+static int cdcacm_gdb_dtr[PLATFORM_SWD_PORTS] = {
+	1,
+#if PLATFORM_SWD_PORTS > 1
+	1,
+#endif
+};
 
 static void cdcacm_set_modem_state(usbd_device *dev, int iface, bool dsr, bool dcd);
 
@@ -347,6 +372,156 @@ static const struct usb_iface_assoc_descriptor trace_assoc = {
 };
 #endif
 
+#if defined(PLATFORM_HAS_CMSIS_DAP)
+/* CMSIS-DAP v2, found by hosts from "CMSIS-DAP" in the interface string */
+static const struct usb_endpoint_descriptor dap_endp[] = {{
+	.bLength = USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType = USB_DT_ENDPOINT,
+	.bEndpointAddress = CDCACM_DAP_ENDPOINT,
+	.bmAttributes = USB_ENDPOINT_ATTR_BULK,
+	.wMaxPacketSize = DAP_PACKET_SIZE,
+	.bInterval = 0,
+}, {
+	.bLength = USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType = USB_DT_ENDPOINT,
+	.bEndpointAddress = 0x80 | CDCACM_DAP_ENDPOINT,
+	.bmAttributes = USB_ENDPOINT_ATTR_BULK,
+	.wMaxPacketSize = DAP_PACKET_SIZE,
+	.bInterval = 0,
+}};
+
+static const struct usb_interface_descriptor dap_iface = {
+	.bLength = USB_DT_INTERFACE_SIZE,
+	.bDescriptorType = USB_DT_INTERFACE,
+	.bInterfaceNumber = DAP_IF_NO,
+	.bAlternateSetting = 0,
+	.bNumEndpoints = 2,
+	.bInterfaceClass = 0xFF,
+	.bInterfaceSubClass = 0,
+	.bInterfaceProtocol = 0,
+	.iInterface = DAP_IF_STRING,
+
+	.endpoint = dap_endp,
+};
+
+static const struct usb_iface_assoc_descriptor dap_assoc = {
+	.bLength = USB_DT_INTERFACE_ASSOCIATION_SIZE,
+	.bDescriptorType = USB_DT_INTERFACE_ASSOCIATION,
+	.bFirstInterface = DAP_IF_NO,
+	.bInterfaceCount = 1,
+	.bFunctionClass = 0xFF,
+	.bFunctionSubClass = 0,
+	.bFunctionProtocol = 0,
+	.iFunction = DAP_IF_STRING,
+};
+#endif
+
+#if PLATFORM_SWD_PORTS > 1
+/* GDB interface of the second SWD port.  The notification endpoint is
+ * numbered as cdcacm_set_modem_state() expects. */
+static const struct usb_endpoint_descriptor gdb2_comm_endp[] = {{
+	.bLength = USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType = USB_DT_ENDPOINT,
+	.bEndpointAddress = 0x82 + GDB2_IF_NO,
+	.bmAttributes = USB_ENDPOINT_ATTR_INTERRUPT,
+	.wMaxPacketSize = 16,
+	.bInterval = 255,
+}};
+
+static const struct usb_endpoint_descriptor gdb2_data_endp[] = {{
+	.bLength = USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType = USB_DT_ENDPOINT,
+	.bEndpointAddress = CDCACM_GDB2_ENDPOINT,
+	.bmAttributes = USB_ENDPOINT_ATTR_BULK,
+	.wMaxPacketSize = CDCACM_PACKET_SIZE,
+	.bInterval = 1,
+}, {
+	.bLength = USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType = USB_DT_ENDPOINT,
+	.bEndpointAddress = 0x80 | CDCACM_GDB2_ENDPOINT,
+	.bmAttributes = USB_ENDPOINT_ATTR_BULK,
+	.wMaxPacketSize = CDCACM_PACKET_SIZE,
+	.bInterval = 1,
+}};
+
+static const struct {
+	struct usb_cdc_header_descriptor header;
+	struct usb_cdc_call_management_descriptor call_mgmt;
+	struct usb_cdc_acm_descriptor acm;
+	struct usb_cdc_union_descriptor cdc_union;
+} __attribute__((packed)) gdb2_cdcacm_functional_descriptors = {
+	.header = {
+		.bFunctionLength = sizeof(struct usb_cdc_header_descriptor),
+		.bDescriptorType = CS_INTERFACE,
+		.bDescriptorSubtype = USB_CDC_TYPE_HEADER,
+		.bcdCDC = 0x0110,
+	},
+	.call_mgmt = {
+		.bFunctionLength =
+			sizeof(struct usb_cdc_call_management_descriptor),
+		.bDescriptorType = CS_INTERFACE,
+		.bDescriptorSubtype = USB_CDC_TYPE_CALL_MANAGEMENT,
+		.bmCapabilities = 0,
+		.bDataInterface = GDB2_IF_NO + 1,
+	},
+	.acm = {
+		.bFunctionLength = sizeof(struct usb_cdc_acm_descriptor),
+		.bDescriptorType = CS_INTERFACE,
+		.bDescriptorSubtype = USB_CDC_TYPE_ACM,
+		.bmCapabilities = 2, /* SET_LINE_CODING supported */
+	},
+	.cdc_union = {
+		.bFunctionLength = sizeof(struct usb_cdc_union_descriptor),
+		.bDescriptorType = CS_INTERFACE,
+		.bDescriptorSubtype = USB_CDC_TYPE_UNION,
+		.bControlInterface = GDB2_IF_NO,
+		.bSubordinateInterface0 = GDB2_IF_NO + 1,
+	 }
+};
+
+static const struct usb_interface_descriptor gdb2_comm_iface[] = {{
+	.bLength = USB_DT_INTERFACE_SIZE,
+	.bDescriptorType = USB_DT_INTERFACE,
+	.bInterfaceNumber = GDB2_IF_NO,
+	.bAlternateSetting = 0,
+	.bNumEndpoints = 1,
+	.bInterfaceClass = USB_CLASS_CDC,
+	.bInterfaceSubClass = USB_CDC_SUBCLASS_ACM,
+	.bInterfaceProtocol = USB_CDC_PROTOCOL_AT,
+	.iInterface = GDB2_IF_STRING,
+
+	.endpoint = gdb2_comm_endp,
+
+	.extra = &gdb2_cdcacm_functional_descriptors,
+	.extralen = sizeof(gdb2_cdcacm_functional_descriptors)
+}};
+
+static const struct usb_interface_descriptor gdb2_data_iface[] = {{
+	.bLength = USB_DT_INTERFACE_SIZE,
+	.bDescriptorType = USB_DT_INTERFACE,
+	.bInterfaceNumber = GDB2_IF_NO + 1,
+	.bAlternateSetting = 0,
+	.bNumEndpoints = 2,
+	.bInterfaceClass = USB_CLASS_DATA,
+	.bInterfaceSubClass = 0,
+	.bInterfaceProtocol = 0,
+	.iInterface = 0,
+
+	.endpoint = gdb2_data_endp,
+}};
+
+static const struct usb_iface_assoc_descriptor gdb2_assoc = {
+	.bLength = USB_DT_INTERFACE_ASSOCIATION_SIZE,
+	.bDescriptorType = USB_DT_INTERFACE_ASSOCIATION,
+	.bFirstInterface = GDB2_IF_NO,
+	.bInterfaceCount = 2,
+	.bFunctionClass = USB_CLASS_CDC,
+	.bFunctionSubClass = USB_CDC_SUBCLASS_ACM,
+	.bFunctionProtocol = USB_CDC_PROTOCOL_AT,
+	.iFunction = 0,
+};
+#endif
+
 static const struct usb_interface ifaces[] = {{
 	.num_altsetting = 1,
 	.iface_assoc = &gdb_assoc,
@@ -371,17 +546,28 @@ static const struct usb_interface ifaces[] = {{
 	.iface_assoc = &trace_assoc,
 	.altsetting = &trace_iface,
 #endif
+#if defined(PLATFORM_HAS_CMSIS_DAP)
+}, {
+	.num_altsetting = 1,
+	.iface_assoc = &dap_assoc,
+	.altsetting = &dap_iface,
+#endif
+#if PLATFORM_SWD_PORTS > 1
+}, {
+	.num_altsetting = 1,
+	.iface_assoc = &gdb2_assoc,
+	.altsetting = gdb2_comm_iface,
+}, {
+	.num_altsetting = 1,
+	.altsetting = gdb2_data_iface,
+#endif
 }};
 
 static const struct usb_config_descriptor config = {
 	.bLength = USB_DT_CONFIGURATION_SIZE,
 	.bDescriptorType = USB_DT_CONFIGURATION,
 	.wTotalLength = 0,
-#if defined(PLATFORM_HAS_TRACESWO)
-	.bNumInterfaces = 6,
-#else
-	.bNumInterfaces = 5,
-#endif
+	.bNumInterfaces = sizeof(ifaces) / sizeof(ifaces[0]),
 	.bConfigurationValue = 1,
 	.iConfiguration = 0,
 	.bmAttributes = 0x80,
@@ -406,6 +592,12 @@ static const char *usb_strings[] = {
 #if defined(PLATFORM_HAS_TRACESWO)
 	"Black Magic Trace Capture",
 #endif
+#if defined(PLATFORM_HAS_CMSIS_DAP)
+	"Black Magic CMSIS-DAP",
+#endif
+#if PLATFORM_SWD_PORTS > 1
+	"Black Magic GDB Server 2",
+#endif
 };
 
 static void dfu_detach_complete(usbd_device *dev, struct usb_setup_data *req)
@@ -431,11 +623,18 @@ static int cdcacm_control_request(usbd_device *dev,
 	switch(req->bRequest) {
 	case USB_CDC_REQ_SET_CONTROL_LINE_STATE:
 		cdcacm_set_modem_state(dev, req->wIndex, true, true);
+#ifdef PLATFORM_HAS_UART_FLOW
+		/* The host's RTS gates the probe's RTS to the target */
+		if(req->wIndex == 2)
+			usbuart_set_control_line_state(req->wValue);
+#endif
 		/* Ignore if not for GDB interface */
-		if(req->wIndex != 0)
-			return 1;
-
-		cdcacm_gdb_dtr = req->wValue & 1;
+		if(req->wIndex == 0)
+			cdcacm_gdb_dtr[0] = req->wValue & 1;
+#if PLATFORM_SWD_PORTS > 1
+		if(req->wIndex == GDB2_IF_NO)
+			cdcacm_gdb_dtr[1] = req->wValue & 1;
+#endif
 
 		return 1;
 	case USB_CDC_REQ_SET_LINE_CODING:
@@ -447,6 +646,9 @@ static int cdcacm_control_request(usbd_device *dev,
 			usbuart_set_line_coding((struct usb_cdc_line_coding*)*buf);
 			return 1;
 		case 0:
+#if PLATFORM_SWD_PORTS > 1
+		case GDB2_IF_NO:
+#endif
 			return 1; /* Ignore on GDB Port */
 		default:
 			return 0;
@@ -481,7 +683,12 @@ int cdcacm_get_config(void)
 
 int cdcacm_get_dtr(void)
 {
-	return cdcacm_gdb_dtr;
+	return cdcacm_gdb_dtr[0];
+}
+
+int cdcacm_get_port_dtr(unsigned n)
+{
+	return cdcacm_gdb_dtr[n];
 }
 
 static void cdcacm_set_modem_state(usbd_device *dev, int iface, bool dsr, bool dcd)
@@ -504,13 +711,8 @@ static void cdcacm_set_config(usbd_device *dev, uint16_t wValue)
 	configured = wValue;
 
 	/* GDB interface */
-#if defined(STM32F4) || defined(LM4F)
 	usbd_ep_setup(dev, 0x01, USB_ENDPOINT_ATTR_BULK,
 	              CDCACM_PACKET_SIZE, gdb_usb_out_cb);
-#else
-	usbd_ep_setup(dev, 0x01, USB_ENDPOINT_ATTR_BULK,
-	              CDCACM_PACKET_SIZE, NULL);
-#endif
 	usbd_ep_setup(dev, 0x81, USB_ENDPOINT_ATTR_BULK,
 	              CDCACM_PACKET_SIZE, NULL);
 	usbd_ep_setup(dev, 0x82, USB_ENDPOINT_ATTR_INTERRUPT, 16, NULL);
@@ -528,6 +730,29 @@ static void cdcacm_set_config(usbd_device *dev, uint16_t wValue)
 					64, trace_buf_drain);
 #endif
 
+#if defined(PLATFORM_HAS_CMSIS_DAP)
+	/* CMSIS-DAP interface */
+	usbd_ep_setup(dev, CDCACM_DAP_ENDPOINT, USB_ENDPOINT_ATTR_BULK,
+	              DAP_PACKET_SIZE, cmsis_dap_usb_out_cb);
+	usbd_ep_setup(dev, 0x80 | CDCACM_DAP_ENDPOINT, USB_ENDPOINT_ATTR_BULK,
+	              DAP_PACKET_SIZE, NULL);
+#endif
+
+#if PLATFORM_SWD_PORTS > 1
+	/* GDB interface of the second SWD port */
+	usbd_ep_setup(dev, CDCACM_GDB2_ENDPOINT, USB_ENDPOINT_ATTR_BULK,
+	              CDCACM_PACKET_SIZE, gdb_usb_out_cb);
+	usbd_ep_setup(dev, 0x80 | CDCACM_GDB2_ENDPOINT, USB_ENDPOINT_ATTR_BULK,
+	              CDCACM_PACKET_SIZE, NULL);
+	usbd_ep_setup(dev, 0x82 + GDB2_IF_NO, USB_ENDPOINT_ATTR_INTERRUPT,
+	              16, NULL);
+#endif
+
+#if defined(PLATFORM_HAS_USB_OTG)
+	/* FIFO room for multi-packet GDB replies */
+	usb_otg_fifo_resize(CDCACM_GDB_ENDPOINT, CDCACM_GDB_IN_SIZE);
+#endif
+
 	usbd_register_control_callback(dev,
 			USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
 			USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
@@ -538,6 +763,9 @@ static void cdcacm_set_config(usbd_device *dev, uint16_t wValue)
 	 */
 	cdcacm_set_modem_state(dev, 0, true, true);
 	cdcacm_set_modem_state(dev, 2, true, true);
+#if PLATFORM_SWD_PORTS > 1
+	cdcacm_set_modem_state(dev, GDB2_IF_NO, true, true);
+#endif
 }
 
 /* We need a special large control buffer for this device: */
@@ -31,9 +31,25 @@
 #include <libopencm3/usb/usbd.h>
 
 #define CDCACM_PACKET_SIZE 	64
+/* Largest transfer of GDB replies, where the controller does more than
+ * a packet at a time */
+#define CDCACM_GDB_IN_SIZE	256
 
 #define CDCACM_GDB_ENDPOINT	1
 #define CDCACM_UART_ENDPOINT	3
+#if defined(PLATFORM_HAS_CMSIS_DAP)
+#if defined(PLATFORM_HAS_USB_OTG)
+#error "The OTG FS core only has endpoints 0-3, too few for CMSIS-DAP"
+#endif
+#define CDCACM_DAP_ENDPOINT	6
+#endif
+#if PLATFORM_SWD_PORTS > 1
+#if defined(PLATFORM_HAS_USB_OTG)
+#error "The OTG FS core only has endpoints 0-3, too few for a second GDB interface"
+#endif
+/* The GDB interface of the second SWD port */
+#define CDCACM_GDB2_ENDPOINT	7
+#endif
 
 extern usbd_device *usbdev;
 
@@ -41,5 +57,7 @@ void cdcacm_init(void);
 /* Returns current usb configuration, or 0 if not configured. */
 int cdcacm_get_config(void);
 int cdcacm_get_dtr(void);
+/* DTR of the GDB interface of SWD port n, cdcacm_get_dtr() is port 0's */
+int cdcacm_get_port_dtr(unsigned n);
 
 #endif
@@ -22,6 +22,13 @@
 
 #include "general.h"
 #include "swdptap.h"
+#include "stats.h"
+
+#ifdef PLATFORM_HAS_FREQUENCY
+#	define SWD_DELAY() platform_clk_delay()
+#else
+#	define SWD_DELAY() do {} while (0)
+#endif
 
 int swdptap_init(void)
 {
@@ -30,11 +37,13 @@ int swdptap_init(void)
 
 static void swdptap_turnaround(uint8_t dir)
 {
-	static uint8_t olddir = 0;
+	/* Each port's SWDIO is left as it was */
+	static uint8_t olddir[PLATFORM_SWD_PORTS];
+	unsigned port = platform_swd_port();
 
 	/* Don't turnaround if direction not changing */
-	if(dir == olddir) return;
-	olddir = dir;
+	if(dir == olddir[port]) return;
+	olddir[port] = dir;
 
 #ifdef DEBUG_SWD_BITS
 	DEBUG("%s", dir ? "\n-> ":"\n<- ");
@@ -43,7 +52,9 @@ static void swdptap_turnaround(uint8_t dir)
 	if(dir)
 		SWDIO_MODE_FLOAT();
 	gpio_set(SWCLK_PORT, SWCLK_PIN);
+	SWD_DELAY();
 	gpio_clear(SWCLK_PORT, SWCLK_PIN);
+	SWD_DELAY();
 	if(!dir)
 		SWDIO_MODE_DRIVE();
 }
@@ -56,7 +67,9 @@ bool swdptap_bit_in(void)
 
 	ret = gpio_get(SWDIO_PORT, SWDIO_PIN);
 	gpio_set(SWCLK_PORT, SWCLK_PIN);
+	SWD_DELAY();
 	gpio_clear(SWCLK_PORT, SWCLK_PIN);
+	SWD_DELAY();
 
 #ifdef DEBUG_SWD_BITS
 	DEBUG("%d", ret?1:0);
@@ -75,6 +88,82 @@ void swdptap_bit_out(bool val)
 
 	gpio_set_val(SWDIO_PORT, SWDIO_PIN, val);
 	gpio_set(SWCLK_PORT, SWCLK_PIN);
+	SWD_DELAY();
 	gpio_clear(SWCLK_PORT, SWCLK_PIN);
+	SWD_DELAY();
+}
+
+#if defined(STM32F1) && !defined(DEBUG_SWD_BITS)
+/* Word-at-a-time sequences for the STM32F1 based probes.  These replace
+ * the weak versions in swdptap_generic.c, which call swdptap_bit_in() or
+ * swdptap_bit_out() for every bit.  SWDIO is driven with a single BSRR
+ * write selected by the data bit, so the bit loop has no branches.
+ */
+static const uint32_t swdio_bsrr[2] = {SWDIO_PIN << 16, SWDIO_PIN};
+
+static inline void swdptap_clock(void)
+{
+	GPIO_BSRR(SWCLK_PORT) = SWCLK_PIN;
+	SWD_DELAY();
+	GPIO_BRR(SWCLK_PORT) = SWCLK_PIN;
+	SWD_DELAY();
 }
 
+static inline uint32_t swdptap_sample(void)
+{
+	return (GPIO_IDR(SWDIO_PORT) & SWDIO_PIN) ? 1 : 0;
+}
+
+uint32_t swdptap_seq_in(int ticks)
+{
+	uint32_t ret = 0;
+
+	STATS_ADD(swd_bits, ticks);
+	swdptap_turnaround(1);
+	for (int i = 0; i < ticks; i++) {
+		ret |= swdptap_sample() << i;
+		swdptap_clock();
+	}
+
+	return ret;
+}
+
+bool swdptap_seq_in_parity(uint32_t *ret, int ticks)
+{
+	uint32_t data = 0;
+	uint32_t parity;
+
+	STATS_ADD(swd_bits, ticks + 1);
+	swdptap_turnaround(1);
+	for (int i = 0; i < ticks; i++) {
+		data |= swdptap_sample() << i;
+		swdptap_clock();
+	}
+	parity = swdptap_sample();
+	swdptap_clock();
+
+	*ret = data;
+	return (__builtin_parity(data) ^ parity) != 0;
+}
+
+void swdptap_seq_out(uint32_t MS, int ticks)
+{
+	STATS_ADD(swd_bits, ticks);
+	swdptap_turnaround(0);
+	while (ticks--) {
+		GPIO_BSRR(SWDIO_PORT) = swdio_bsrr[MS & 1];
+		swdptap_clock();
+		MS >>= 1;
+	}
+}
+
+void swdptap_seq_out_parity(uint32_t MS, int ticks)
+{
+	uint32_t parity = __builtin_parity(ticks < 32 ? MS & ((1u << ticks) - 1) : MS);
+
+	swdptap_seq_out(MS, ticks);
+	STATS_INC(swd_bits);
+	GPIO_BSRR(SWDIO_PORT) = swdio_bsrr[parity];
+	swdptap_clock();
+}
+#endif
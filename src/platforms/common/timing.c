@@ -19,13 +19,20 @@
  */
 #include "general.h"
 
+#define TIMEOUT_MAX_US	INT32_MAX
+
+void platform_timeout_set_us(platform_timeout *t, uint32_t us)
+{
+	t->time = platform_time_us() + MIN(us, TIMEOUT_MAX_US);
+}
+
 void platform_timeout_set(platform_timeout *t, uint32_t ms)
 {
-	t->time = platform_time_ms() + ms;
+	platform_timeout_set_us(t, MIN(ms, TIMEOUT_MAX_US / 1000) * 1000);
 }
 
 bool platform_timeout_is_expired(platform_timeout *t)
 {
-	return platform_time_ms() > t->time;
+	return (int32_t)(platform_time_us() - t->time) > 0;
 }
 
@@ -20,11 +20,14 @@
 #ifndef __TIMING_H
 #define __TIMING_H
 
+/* Deadline in microseconds.  Compared allowing for wrap, so timeouts
+ * up to half the 71 minute range of the counter work. */
 struct platform_timeout {
 	uint32_t time;
 };
 
 uint32_t platform_time_ms(void);
+uint32_t platform_time_us(void);
 
 #endif /* __TIMING_H */
 
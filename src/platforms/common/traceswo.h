@@ -22,7 +22,18 @@
 
 #include <libopencm3/usb/usbd.h>
 
-void traceswo_init(void);
+/* Start trace capture.  A baud rate selects NRZ (UART) encoding, zero
+ * selects Manchester encoding.  Returns false if the probe can't do the
+ * chosen encoding. */
+bool traceswo_init(uint32_t baud);
 void trace_buf_drain(usbd_device *dev, uint8_t ep);
+/* Bytes dropped because USB fell behind, and the number of times */
+void traceswo_stats(uint32_t *dropped, uint32_t *overflows);
+
+/* Only pass on ITM packets from the stimulus ports in the mask, and
+ * optionally drop hardware source (DWT) and timestamp packets */
+void traceswo_filter_set(uint32_t ports, bool drop_hw, bool drop_ts);
+/* Filter captured data in place, returns the length left */
+int traceswo_filter(uint8_t *buf, int len);
 
 #endif
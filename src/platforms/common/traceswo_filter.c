@@ -0,0 +1,110 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This file implements filtering of the ITM packet stream captured from
+ * TRACESWO, so only the stimulus ports of interest use USB bandwidth.
+ *
+ * ARM DDI 0403D - ARMv7M Architecture Reference Manual, Appendix D4
+ */
+
+#include "general.h"
+#include "traceswo.h"
+
+#define ITM_OVERFLOW	0x70
+#define ITM_SYNC_END	0x80
+#define ITM_GTS1	0x94
+#define ITM_GTS2	0xB4
+
+static enum {
+	ITM_HEADER,
+	ITM_PAYLOAD,
+	ITM_CONTINUATION,
+} itm_state;
+static uint8_t itm_remaining;
+static bool itm_forward = true;
+
+static uint32_t filter_ports = 0xffffffff;
+static bool filter_hw;
+static bool filter_ts;
+
+void traceswo_filter_set(uint32_t ports, bool drop_hw, bool drop_ts)
+{
+	filter_ports = ports;
+	filter_hw = drop_hw;
+	filter_ts = drop_ts;
+}
+
+/* Decode a packet header, setting the state for its payload */
+static bool itm_header(uint8_t c)
+{
+	if ((c == 0) || (c == ITM_SYNC_END) || (c == ITM_OVERFLOW))
+		return true;
+
+	if (c & 0x03) {
+		/* Source packet, the size is 1, 2 or 4 bytes */
+		itm_state = ITM_PAYLOAD;
+		itm_remaining = ((c & 0x03) == 3) ? 4 : (c & 0x03);
+		if (c & 0x04)	/* Hardware source (DWT) */
+			return !filter_hw;
+		return filter_ports & (1u << (c >> 3));
+	}
+
+	if ((c & 0x0f) == 0) {
+		/* Local timestamp, format 1 has payload bytes */
+		if (c & 0x80)
+			itm_state = ITM_CONTINUATION;
+		return !filter_ts;
+	}
+
+	if ((c == ITM_GTS1) || (c == ITM_GTS2)) {
+		itm_state = ITM_CONTINUATION;
+		return !filter_ts;
+	}
+
+	/* Extension or reserved, always passed on */
+	if (c & 0x80)
+		itm_state = ITM_CONTINUATION;
+	return true;
+}
+
+int traceswo_filter(uint8_t *buf, int len)
+{
+	int out = 0;
+
+	for (int i = 0; i < len; i++) {
+		uint8_t c = buf[i];
+
+		switch (itm_state) {
+		case ITM_HEADER:
+			itm_forward = itm_header(c);
+			break;
+		case ITM_PAYLOAD:
+			if (--itm_remaining == 0)
+				itm_state = ITM_HEADER;
+			break;
+		case ITM_CONTINUATION:
+			if (!(c & 0x80))
+				itm_state = ITM_HEADER;
+			break;
+		}
+
+		if (itm_forward)
+			buf[out++] = c;
+	}
+
+	return out;
+}
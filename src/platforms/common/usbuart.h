@@ -26,6 +26,9 @@
 void usbuart_init(void);
 
 void usbuart_set_line_coding(struct usb_cdc_line_coding *coding);
+#ifdef PLATFORM_HAS_UART_FLOW
+void usbuart_set_control_line_state(uint16_t value);
+#endif
 void usbuart_usb_out_cb(usbd_device *dev, uint8_t ep);
 void usbuart_usb_in_cb(usbd_device *dev, uint8_t ep);
 
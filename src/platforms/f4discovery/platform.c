@@ -84,6 +84,8 @@ void platform_init(void)
 			GPIO_PUPD_NONE,
 			TDO_PIN);
 
+	swd_port_init();
+
 	gpio_mode_setup(LED_PORT, GPIO_MODE_OUTPUT,
 			GPIO_PUPD_NONE,
 			LED_UART | LED_IDLE_RUN | LED_ERROR | LED_BOOTLOADER);
@@ -27,11 +27,24 @@
 #include "gpio.h"
 #include "timing.h"
 #include "timing_stm32.h"
+#include "swd_port.h"
 #include "version.h"
 
 #include <setjmp.h>
 
 #define PLATFORM_HAS_TRACESWO
+#define PLATFORM_HAS_RTT
+#define PLATFORM_HAS_IMAGE
+#define PLATFORM_HAS_SETTINGS
+#define PLATFORM_HAS_FREQUENCY
+#define PLATFORM_HAS_USB_OTG
+/* The OTG FS core has no endpoints for CMSIS-DAP or a second GDB
+ * interface */
+#define PLATFORM_SWD_PORTS 1
+#define PLATFORM_HAS_UART_FLOW
+
+#define GDB_PACKET_BUFFER_SIZE 4096
+
 #define BOARD_IDENT "Black Magic Probe (F4Discovery), (Firmware " FIRMWARE_VERSION ")"
 #define DFU_IDENT   "Black Magic Firmware Upgrade (F4Discovery)"
 
@@ -50,6 +63,10 @@
  * TDO = 	PC6 (input for TRACESWO
  * nSRST =
  *
+ * UART TX/RX =	PD8/PD9
+ * UART RTS =	PD10 (output, low while the probe can take data)
+ * UART CTS =	PD11 (input, pulled low so it can be left unconnected)
+ *
  * Force DFU mode button: PA0
  */
 
@@ -64,11 +81,6 @@
 #define TCK_PIN		GPIO5
 #define TDO_PIN		GPIO6
 
-#define SWDIO_PORT 	JTAG_PORT
-#define SWCLK_PORT 	JTAG_PORT
-#define SWDIO_PIN	TMS_PIN
-#define SWCLK_PIN	TCK_PIN
-
 #define TRST_PORT	GPIOC
 #define TRST_PIN	GPIO1
 #define SRST_PORT	GPIOC
@@ -86,13 +98,6 @@
 #define TMS_SET_MODE() \
 	gpio_mode_setup(TMS_PORT, GPIO_MODE_OUTPUT, \
 	                GPIO_PUPD_NONE, TMS_PIN);
-#define SWDIO_MODE_FLOAT() \
-	gpio_mode_setup(SWDIO_PORT, GPIO_MODE_INPUT, \
-	                GPIO_PUPD_NONE, SWDIO_PIN);
-
-#define SWDIO_MODE_DRIVE() \
-	gpio_mode_setup(SWDIO_PORT, GPIO_MODE_OUTPUT, \
-	                GPIO_PUPD_NONE, SWDIO_PIN);
 
 
 #define USB_DRIVER      stm32f107_usb_driver
@@ -115,6 +120,10 @@
 #define USBUSART_TX_PIN  GPIO8
 #define USBUSART_RX_PORT GPIOD
 #define USBUSART_RX_PIN  GPIO9
+#define USBUSART_RTS_PORT GPIOD
+#define USBUSART_RTS_PIN  GPIO10
+#define USBUSART_CTS_PORT GPIOD
+#define USBUSART_CTS_PIN  GPIO11
 #define USBUSART_ISR usart3_isr
 #define USBUSART_TIM TIM4
 #define USBUSART_TIM_CLK_EN() rcc_periph_clock_enable(RCC_TIM4)
@@ -129,6 +138,14 @@
 	gpio_set_af(USBUSART_TX_PORT, GPIO_AF7, USBUSART_TX_PIN); \
 	gpio_set_af(USBUSART_RX_PORT, GPIO_AF7, USBUSART_RX_PIN); \
     } while(0)
+#define UART_FLOW_PIN_SETUP() do { \
+	gpio_set(USBUSART_RTS_PORT, USBUSART_RTS_PIN); \
+	gpio_mode_setup(USBUSART_RTS_PORT, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, \
+	                USBUSART_RTS_PIN); \
+	gpio_mode_setup(USBUSART_CTS_PORT, GPIO_MODE_AF, GPIO_PUPD_PULLDOWN, \
+	                USBUSART_CTS_PIN); \
+	gpio_set_af(USBUSART_CTS_PORT, GPIO_AF7, USBUSART_CTS_PIN); \
+    } while(0)
 
 #define TRACE_TIM TIM3
 #define TRACE_TIM_CLK_EN() rcc_periph_clock_enable(RCC_TIM3)
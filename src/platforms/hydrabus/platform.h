@@ -28,11 +28,23 @@
 #include "gpio.h"
 #include "timing.h"
 #include "timing_stm32.h"
+#include "swd_port.h"
 #include "version.h"
 
 #include <setjmp.h>
 
 #define PLATFORM_HAS_TRACESWO
+#define PLATFORM_HAS_RTT
+#define PLATFORM_HAS_IMAGE
+#define PLATFORM_HAS_SETTINGS
+#define PLATFORM_HAS_FREQUENCY
+#define PLATFORM_HAS_USB_OTG
+/* The OTG FS core has no endpoints for CMSIS-DAP or a second GDB
+ * interface */
+#define PLATFORM_SWD_PORTS 1
+
+#define GDB_PACKET_BUFFER_SIZE 4096
+
 #define BOARD_IDENT       "Black Magic Probe (HydraBus), (Firmware " FIRMWARE_VERSION ")"
 #define BOARD_IDENT_DFU   "Black Magic (Upgrade) for HydraBus, (Firmware " FIRMWARE_VERSION ")"
 #define DFU_IDENT         "Black Magic Firmware Upgrade (HydraBus)"
@@ -66,11 +78,6 @@
 #define TCK_PIN		GPIO1
 #define TDO_PIN		GPIO2
 
-#define SWDIO_PORT 	JTAG_PORT
-#define SWCLK_PORT 	JTAG_PORT
-#define SWDIO_PIN	TMS_PIN
-#define SWCLK_PIN	TCK_PIN
-
 #define TRST_PORT	GPIOC
 #define TRST_PIN	GPIO5
 #define SRST_PORT	GPIOC
@@ -86,13 +93,6 @@
 #define TMS_SET_MODE() \
 	gpio_mode_setup(TMS_PORT, GPIO_MODE_OUTPUT, \
 	                GPIO_PUPD_NONE, TMS_PIN);
-#define SWDIO_MODE_FLOAT() \
-	gpio_mode_setup(SWDIO_PORT, GPIO_MODE_INPUT, \
-	                GPIO_PUPD_NONE, SWDIO_PIN);
-
-#define SWDIO_MODE_DRIVE() \
-	gpio_mode_setup(SWDIO_PORT, GPIO_MODE_OUTPUT, \
-	                GPIO_PUPD_NONE, SWDIO_PIN);
 
 
 #define USB_DRIVER      stm32f107_usb_driver
@@ -23,6 +23,7 @@
 #include <libopencm3/lm4f/nvic.h>
 #include <libopencm3/lm4f/uart.h>
 #include <libopencm3/cm3/systick.h>
+#include <libopencm3/cm3/scb.h>
 #include <libopencm3/lm4f/usb.h>
 
 #define SYSTICKHZ	100
@@ -32,6 +33,7 @@
 #define PLL_DIV_25MHZ	16
 
 extern void trace_tick(void);
+extern void usbuart_tick(void);
 
 volatile platform_timeout * volatile head_timeout;
 uint8_t running_status;
@@ -40,7 +42,8 @@ static volatile uint32_t time_ms;
 void sys_tick_handler(void)
 {
 	trace_tick();
-	time_ms += 10;
+	usbuart_tick();
+	time_ms += SYSTICKMS;
 }
 
 uint32_t platform_time_ms(void)
@@ -48,6 +51,24 @@ uint32_t platform_time_ms(void)
 	return time_ms;
 }
 
+/* The tick count plus how far SysTick has counted down since */
+uint32_t platform_time_us(void)
+{
+	uint32_t ms, cvr, reload = STK_RVR;
+	bool pending;
+
+	do {
+		ms = time_ms;
+		cvr = STK_CVR;
+		pending = SCB_ICSR & SCB_ICSR_PENDSTSET;
+	} while (ms != time_ms);
+	if (pending && (cvr > reload / 2))
+		ms += SYSTICKMS;
+
+	return (ms * 1000) + (reload - cvr) /
+		(rcc_get_system_clock_frequency() / 8000000);
+}
+
 void
 platform_init(void)
 {
@@ -79,6 +79,8 @@ extern usbd_driver lm4f_usb_driver;
 #define USBUART_CLK	RCC_UART0
 #define USBUART_IRQ	NVIC_UART0_IRQ
 #define USBUART_ISR	uart0_isr
+#define USBUART_DMA_CHAN	8	/* U0RX */
+#define USBUART_DMA_ENC		0
 #define UART_PIN_SETUP() do {								\
 	periph_clock_enable(RCC_GPIOA);							\
 	__asm__("nop"); __asm__("nop"); __asm__("nop");					\
@@ -91,6 +93,8 @@ extern usbd_driver lm4f_usb_driver;
 #define TRACEUART_CLK	RCC_UART2
 #define TRACEUART_IRQ	NVIC_UART2_IRQ
 #define TRACEUART_ISR	uart2_isr
+#define TRACEUART_DMA_CHAN	12	/* U2RX */
+#define TRACEUART_DMA_ENC	1
 
 /* Use newlib provided integer only stdio functions */
 #define sscanf siscanf
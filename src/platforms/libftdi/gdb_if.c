@@ -20,7 +20,7 @@
 
 /* This file implements a transparent channel over which the GDB Remote
  * Serial Debugging protocol is implemented.  This implementation for Linux
- * uses a TCP server on port 2000.
+ * uses TCP servers on GDB_SESSIONS ports from 2000, one per GDB session.
  */
 #include <stdio.h>
 
@@ -29,6 +29,7 @@
 #   include <netinet/in.h>
 #   include <netinet/tcp.h>
 #   include <sys/select.h>
+#   include <unistd.h>
 #else
 #   include <winsock2.h>
 #   include <windows.h>
@@ -40,7 +41,18 @@
 #include "general.h"
 #include "gdb_if.h"
 
-static int gdb_if_serv, gdb_if_conn;
+/* One listening socket and connection per session.  Input is received
+ * in blocks, rather than with a recv() per byte. */
+static struct gdb_if_session {
+	int serv, conn;
+	uint8_t in_buf[4096];
+	size_t in_head, in_tail;
+	uint8_t out_buf[2048];
+	size_t out_len;
+} sessions[GDB_SESSIONS];
+
+/* Session the other calls work on, see gdb_if_session() */
+static struct gdb_if_session *cur = &sessions[0];
 
 int gdb_if_init(void)
 {
@@ -48,76 +60,206 @@ int gdb_if_init(void)
 	WSADATA wsaData;
 	WSAStartup(MAKEWORD(2, 2), &wsaData);
 #endif
-	struct sockaddr_in addr;
-	int opt;
+	for (int i = 0; i < GDB_SESSIONS; i++) {
+		struct gdb_if_session *s = &sessions[i];
+		struct sockaddr_in addr;
+		int opt;
 
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(2000);
-	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(2000 + i);
+		addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
-	assert((gdb_if_serv = socket(PF_INET, SOCK_STREAM, 0)) != -1);
-	opt = 1;
-	assert(setsockopt(gdb_if_serv, SOL_SOCKET, SO_REUSEADDR, (void*)&opt, sizeof(opt)) != -1);
-	assert(setsockopt(gdb_if_serv, IPPROTO_TCP, TCP_NODELAY, (void*)&opt, sizeof(opt)) != -1);
+		assert((s->serv = socket(PF_INET, SOCK_STREAM, 0)) != -1);
+		opt = 1;
+		assert(setsockopt(s->serv, SOL_SOCKET, SO_REUSEADDR, (void*)&opt, sizeof(opt)) != -1);
+		assert(setsockopt(s->serv, IPPROTO_TCP, TCP_NODELAY, (void*)&opt, sizeof(opt)) != -1);
 
-	assert(bind(gdb_if_serv, (void*)&addr, sizeof(addr)) != -1);
-	assert(listen(gdb_if_serv, 1) != -1);
+		assert(bind(s->serv, (void*)&addr, sizeof(addr)) != -1);
+		assert(listen(s->serv, 1) != -1);
+		s->conn = -1;
+	}
 
-	DEBUG("Listening on TCP:2000\n");
+	DEBUG("Listening on TCP:2000-%d\n", 2000 + GDB_SESSIONS - 1);
 
 	return 0;
 }
 
+void gdb_if_session(int n)
+{
+	cur = &sessions[n];
+}
 
-unsigned char gdb_if_getchar(void)
+bool gdb_if_connected(void)
 {
-	unsigned char ret;
-	int i = 0;
+	return cur->conn > 0;
+}
 
-	while(i <= 0) {
-		if(gdb_if_conn <= 0) {
-			gdb_if_conn = accept(gdb_if_serv, NULL, NULL);
-			DEBUG("Got connection\n");
-		}
-		i = recv(gdb_if_conn, (void*)&ret, 1, 0);
-		if(i <= 0) {
-			gdb_if_conn = -1;
-			DEBUG("Dropped broken connection\n");
-			/* Return '+' in case we were waiting for an ACK */
-			return '+';
+int gdb_if_wait_any(int timeout)
+{
+	fd_set fds;
+	struct timeval tv;
+	int max = 0;
+
+	for (int i = 0; i < GDB_SESSIONS; i++)
+		if (sessions[i].in_tail != sessions[i].in_head)
+			return i;
+
+	FD_ZERO(&fds);
+	for (int i = 0; i < GDB_SESSIONS; i++) {
+		struct gdb_if_session *s = &sessions[i];
+		int fd = (s->conn > 0) ? s->conn : s->serv;
+		FD_SET(fd, &fds);
+		max = MAX(max, fd);
+	}
+
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+	if (select(max+1, &fds, NULL, NULL, (timeout < 0) ? NULL : &tv) <= 0)
+		return -1;
+
+	for (int i = 0; i < GDB_SESSIONS; i++) {
+		struct gdb_if_session *s = &sessions[i];
+		if (s->conn > 0) {
+			if (FD_ISSET(s->conn, &fds))
+				return i;
+		} else if (FD_ISSET(s->serv, &fds)) {
+			s->conn = accept(s->serv, NULL, NULL);
+			s->in_head = s->in_tail = s->out_len = 0;
+			DEBUG("Got connection on TCP:%d\n", 2000 + i);
 		}
 	}
-	return ret;
+	return -1;
 }
 
-unsigned char gdb_if_getchar_to(int timeout)
+/* Wait up to timeout ms for input on the connection, forever if < 0 */
+static bool gdb_if_select(int timeout)
 {
 	fd_set fds;
 	struct timeval tv;
 
-	if(gdb_if_conn == -1) return -1;
-
 	tv.tv_sec = timeout / 1000;
 	tv.tv_usec = (timeout % 1000) * 1000;
 
 	FD_ZERO(&fds);
-	FD_SET(gdb_if_conn, &fds);
+	FD_SET(cur->conn, &fds);
+
+	return select(cur->conn+1, &fds, NULL, NULL,
+	              (timeout < 0) ? NULL : &tv) > 0;
+}
+
+size_t gdb_if_peek(const uint8_t **data)
+{
+	while(cur->in_tail == cur->in_head) {
+		/* Reads as a GDB detach, so the session lets go of its
+		 * target.  New connections are taken by gdb_if_wait_any(). */
+		if(cur->conn <= 0)
+			return 0;
+		int i = recv(cur->conn, (void*)cur->in_buf, sizeof(cur->in_buf), 0);
+		if(i <= 0) {
+#ifdef WIN32
+			closesocket(cur->conn);
+#else
+			close(cur->conn);
+#endif
+			cur->conn = -1;
+			cur->out_len = 0;
+			DEBUG("Dropped broken connection\n");
+			return 0;
+		}
+		cur->in_head = i;
+		cur->in_tail = 0;
+	}
+	*data = cur->in_buf + cur->in_tail;
+	return cur->in_head - cur->in_tail;
+}
 
-	if(select(gdb_if_conn+1, &fds, NULL, NULL, &tv) > 0)
+void gdb_if_consume(size_t len)
+{
+	cur->in_tail += len;
+}
+
+unsigned char gdb_if_getchar(void)
+{
+	const uint8_t *data;
+	unsigned char c;
+
+	if(!gdb_if_peek(&data))
+		return '\x04';
+	c = *data;
+	gdb_if_consume(1);
+
+	return c;
+}
+
+unsigned char gdb_if_getchar_to(int timeout)
+{
+	if(cur->in_tail != cur->in_head)
+		return gdb_if_getchar();
+	if(cur->conn <= 0) return -1;
+
+	if(gdb_if_select(timeout))
 		return gdb_if_getchar();
 
 	return -1;
 }
 
-void gdb_if_putchar(unsigned char c, int flush)
+bool gdb_if_pending(void)
 {
-	static uint8_t buf[2048];
-	static int bufsize = 0;
-	if (gdb_if_conn > 0) {
-		buf[bufsize++] = c;
-		if (flush || (bufsize == sizeof(buf))) {
-			send(gdb_if_conn, buf, bufsize, 0);
-			bufsize = 0;
-		}
+	if(cur->in_tail != cur->in_head)
+		return true;
+	if(cur->conn <= 0) return false;
+
+	return gdb_if_select(0);
+}
+
+/* Sleep in select() until GDB sends something, instead of polling */
+bool gdb_if_wait(uint32_t ms)
+{
+	if(cur->in_tail != cur->in_head)
+		return true;
+	if(cur->conn <= 0) {
+		platform_delay(ms);
+		return false;
 	}
+
+	return gdb_if_select(ms);
+}
+
+static void gdb_if_send(void)
+{
+	size_t sent = 0;
+
+	while(sent < cur->out_len) {
+		int i = send(cur->conn, (void*)(cur->out_buf + sent),
+		             cur->out_len - sent, 0);
+		if(i <= 0)
+			break;
+		sent += i;
+	}
+	cur->out_len = 0;
+}
+
+void gdb_if_write(const void *buf, size_t len, int flush)
+{
+	const unsigned char *p = buf;
+
+	if(cur->conn <= 0)
+		return;
+
+	while(len) {
+		size_t n = MIN(len, sizeof(cur->out_buf) - cur->out_len);
+		memcpy(cur->out_buf + cur->out_len, p, n);
+		cur->out_len += n;
+		p += n;
+		len -= n;
+		if(cur->out_len == sizeof(cur->out_buf))
+			gdb_if_send();
+	}
+	if(flush)
+		gdb_if_send();
+}
+
+void gdb_if_putchar(unsigned char c, int flush)
+{
+	gdb_if_write(&c, 1, flush);
 }
@@ -72,7 +72,7 @@ void
 jtagtap_tms_seq(uint32_t MS, int ticks)
 {
 	uint8_t tmp[3] = "\x4B";
-	while(ticks >= 0) {
+	while(ticks > 0) {
 		//jtagtap_next(MS & 1, 1);
 		tmp[1] = ticks<7?ticks-1:6;
 		tmp[2] = 0x80 | (MS & 0x7F);
@@ -19,6 +19,7 @@
  */
 #include "general.h"
 #include "gdb_if.h"
+#include "gdb_packet.h"
 #include "version.h"
 
 #include <assert.h>
@@ -31,17 +32,21 @@ struct ftdi_context *ftdic;
 static uint8_t outbuf[BUF_SIZE];
 static uint16_t bufptr = 0;
 
-static struct cable_desc_s {
-	int vendor;
-	int product;
-	int interface;
-	uint8_t dbus_data;
-	uint8_t dbus_ddr;
-	uint8_t cbus_data;
-	uint8_t cbus_ddr;
-	char *description;
-	char * name;
-} cable_desc[] = {
+/* Reads posted with platform_buffer_read_queue(), all collected with
+ * a single transfer by platform_buffer_sync().  The total is kept small
+ * enough not to fill the FTDI receive FIFO while commands are written. */
+#define READ_QUEUE_LEN 64
+#define READ_QUEUE_SIZE 1024
+static struct {
+	uint8_t *data;
+	int size;
+} read_queue[READ_QUEUE_LEN];
+static unsigned read_queue_len;
+static int read_size;
+
+struct cable_desc_s *active_cable;
+
+static struct cable_desc_s cable_desc[] = {
 	{
 		.vendor = 0x0403,
 		.product = 0x6010,
@@ -128,6 +133,25 @@ static struct cable_desc_s {
 		.cbus_ddr  = 0x08,
 		.name = "arm-usb-ocd-h"
 	},
+	{
+		/* SWDIO on TDO and through a resistor on TDI */
+		.vendor = 0x0403,
+		.product = 0x6010,
+		.interface = INTERFACE_A,
+		.dbus_data = 0x02,
+		.dbus_ddr  = 0x03,
+		.swd_mpsse = true,
+		.name = "ft2232h-swd"
+	},
+	{
+		.vendor = 0x0403,
+		.product = 0x6014,
+		.interface = INTERFACE_A,
+		.dbus_data = 0x02,
+		.dbus_ddr  = 0x03,
+		.swd_mpsse = true,
+		.name = "ft232h-swd"
+	},
 };
 
 void platform_init(int argc, char **argv)
@@ -161,6 +185,8 @@ void platform_init(int argc, char **argv)
 		exit(-1);
 	}
 
+	active_cable = &cable_desc[index];
+
 	if (cable_desc[index].dbus_data)
 		ftdi_init[4]= cable_desc[index].dbus_data;
 	if (cable_desc[index].dbus_ddr)
@@ -252,11 +278,61 @@ int platform_buffer_write(const uint8_t *data, int size)
 	return size;
 }
 
-int platform_buffer_read(uint8_t *data, int size)
+int platform_buffer_read_queue(uint8_t *data, int size)
+{
+	assert(size <= READ_QUEUE_SIZE);
+	if ((read_queue_len == READ_QUEUE_LEN) ||
+	    (read_size + size > READ_QUEUE_SIZE))
+		platform_buffer_sync();
+
+	read_queue[read_queue_len].data = data;
+	read_queue[read_queue_len].size = size;
+	read_queue_len++;
+	read_size += size;
+	return size;
+}
+
+void platform_buffer_sync(void)
 {
+	uint8_t inbuf[READ_QUEUE_SIZE];
+	uint8_t cmd = SEND_IMMEDIATE;
+	int size = read_size;
+
+	if (!read_queue_len) {
+		platform_buffer_flush();
+		return;
+	}
+
+	/* Don't wait for the latency timer to return the data */
+	platform_buffer_write(&cmd, 1);
+#ifdef LIBFTDI_ASYNC
+	/* Have the read in flight while the commands go out */
+	struct ftdi_transfer_control *wtc, *rtc;
+	wtc = ftdi_write_data_submit(ftdic, outbuf, bufptr);
+	rtc = ftdi_read_data_submit(ftdic, inbuf, size);
+	assert(ftdi_transfer_data_done(wtc) == bufptr);
+	assert(ftdi_transfer_data_done(rtc) == size);
+	bufptr = 0;
+#else
 	int index = 0;
 	platform_buffer_flush();
-	while((index += ftdi_read_data(ftdic, data + index, size-index)) != size);
+	while((index += ftdi_read_data(ftdic, inbuf + index, size-index)) != size);
+#endif
+
+	/* Deliver the results in the order the reads were queued */
+	uint8_t *p = inbuf;
+	for (unsigned i = 0; i < read_queue_len; i++) {
+		memcpy(read_queue[i].data, p, read_queue[i].size);
+		p += read_queue[i].size;
+	}
+	read_queue_len = 0;
+	read_size = 0;
+}
+
+int platform_buffer_read(uint8_t *data, int size)
+{
+	platform_buffer_read_queue(data, size);
+	platform_buffer_sync();
 	return size;
 }
 
@@ -291,3 +367,46 @@ uint32_t platform_time_ms(void)
 	return (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
 }
 
+uint32_t platform_time_us(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec * 1000000) + tv.tv_usec;
+}
+
+
+/* The MPSSE TCK rate is 6MHz / (1 + divisor) with the default divide
+ * by five prescaler.  This only affects JTAG and MPSSE SWD cables,
+ * other SWD cables are bit-banged.
+ */
+#define MPSSE_BASE_CLOCK 6000000
+static uint16_t tck_divisor = 1;
+
+void platform_max_frequency_set(uint32_t freq)
+{
+	uint32_t divisor;
+
+	/* TCK_DIVISOR is an MPSSE command, in bit-bang mode it would be
+	 * taken as pin data.  Bit-banged SWD runs as fast as USB allows. */
+	if (swd_bitbang) {
+		gdb_out("Bit-banged SWD clock can't be set\n");
+		return;
+	}
+	if (freq == 0)
+		freq = 1;
+	divisor = (MPSSE_BASE_CLOCK + freq - 1) / freq;
+	if (divisor > 0)
+		divisor--;
+	if (divisor > 0xffff)
+		divisor = 0xffff;
+	tck_divisor = divisor;
+
+	uint8_t cmd[3] = {TCK_DIVISOR, tck_divisor & 0xff, tck_divisor >> 8};
+	platform_buffer_write(cmd, 3);
+	platform_buffer_flush();
+}
+
+uint32_t platform_max_frequency_get(void)
+{
+	return MPSSE_BASE_CLOCK / (1 + tck_divisor);
+}
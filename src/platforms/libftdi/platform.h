@@ -37,6 +37,9 @@
 #define FT2232_PID	0x6010
 
 #define PLATFORM_HAS_DEBUG
+#define PLATFORM_HAS_FREQUENCY
+
+#define GDB_PACKET_BUFFER_SIZE 16384
 
 #define SET_RUN_STATE(state)
 #define SET_IDLE_STATE(state)
@@ -44,9 +47,30 @@
 
 extern struct ftdi_context *ftdic;
 
+struct cable_desc_s {
+	int vendor;
+	int product;
+	int interface;
+	uint8_t dbus_data;
+	uint8_t dbus_ddr;
+	uint8_t cbus_data;
+	uint8_t cbus_ddr;
+	/* SWD through MPSSE on TCK and TDI/TDO rather than bit-banged */
+	bool swd_mpsse;
+	char *description;
+	char * name;
+};
+extern struct cable_desc_s *active_cable;
+/* Set once swdptap_init() leaves MPSSE mode to bit-bang SWD */
+extern bool swd_bitbang;
+
 void platform_buffer_flush(void);
 int platform_buffer_write(const uint8_t *data, int size);
 int platform_buffer_read(uint8_t *data, int size);
+/* Queue a read of the data returned by the commands written so far,
+ * data is only valid after platform_buffer_sync() */
+int platform_buffer_read_queue(uint8_t *data, int size);
+void platform_buffer_sync(void);
 
 static inline int platform_hwversion(void)
 {
@@ -20,6 +20,9 @@
 
 /* Quick hack for bit-banging SW-DP interface over FT2232.
  * Intended as proof of concept, not for production.
+ *
+ * Cables with swd_mpsse set instead clock SWD through the MPSSE, with
+ * SWCLK on TCK and SWDIO on TDO and, through a resistor, on TDI.
  */
 
 #include <stdio.h>
@@ -28,8 +31,96 @@
 
 #include "general.h"
 #include "swdptap.h"
+#include "stats.h"
 
 static uint8_t olddir = 0;
+bool swd_bitbang;
+
+#define MPSSE_TCK	0x01
+#define MPSSE_TDI	0x02
+
+static void swdptap_mpsse_turnaround(uint8_t dir)
+{
+	uint8_t ddr = active_cable->dbus_ddr | MPSSE_TCK;
+	uint8_t cmd[5];
+	int i = 0;
+
+	if (dir == olddir)
+		return;
+	olddir = dir;
+
+	if(dir) {	/* SWDIO goes to input: release TDI */
+		cmd[i++] = SET_BITS_LOW;
+		cmd[i++] = active_cable->dbus_data & ~MPSSE_TCK;
+		cmd[i++] = ddr & ~MPSSE_TDI;
+	}
+
+	/* One clock cycle without data */
+	cmd[i++] = 0x8E;
+	cmd[i++] = 0;
+
+	if(!dir) {	/* SWDIO goes to output: drive TDI */
+		cmd[i++] = SET_BITS_LOW;
+		cmd[i++] = active_cable->dbus_data & ~MPSSE_TCK;
+		cmd[i++] = ddr | MPSSE_TDI;
+	}
+	platform_buffer_write(cmd, i);
+}
+
+/* Clock out up to 40 bits LSB first, changing on the falling edge */
+static void swdptap_mpsse_out(uint64_t MS, int ticks)
+{
+	uint8_t cmd[11];
+	int i = 0;
+
+	swdptap_mpsse_turnaround(0);
+
+	if (ticks >= 8) {
+		cmd[i++] = 0x19;
+		cmd[i++] = (ticks / 8) - 1;
+		cmd[i++] = 0;
+		for (int n = ticks / 8; n; n--) {
+			cmd[i++] = MS & 0xff;
+			MS >>= 8;
+		}
+	}
+	if (ticks & 7) {
+		cmd[i++] = 0x1B;
+		cmd[i++] = (ticks & 7) - 1;
+		cmd[i++] = MS & 0xff;
+	}
+	platform_buffer_write(cmd, i);
+}
+
+/* Clock in up to 40 bits LSB first, sampled on the rising edge */
+static uint64_t swdptap_mpsse_in(int ticks)
+{
+	uint8_t cmd[6], data[5];
+	int i = 0, bytes = ticks / 8, rticks = ticks & 7;
+	uint64_t ret = 0;
+
+	swdptap_mpsse_turnaround(1);
+
+	if (bytes) {
+		cmd[i++] = 0x28;
+		cmd[i++] = bytes - 1;
+		cmd[i++] = 0;
+	}
+	if (rticks) {
+		cmd[i++] = 0x2A;
+		cmd[i++] = rticks - 1;
+	}
+	platform_buffer_write(cmd, i);
+	platform_buffer_read(data, bytes + (rticks ? 1 : 0));
+
+	/* Partial bytes are shifted in from the top */
+	if (rticks)
+		ret = data[bytes] >> (8 - rticks);
+	while (bytes--)
+		ret = (ret << 8) | data[bytes];
+	return ret;
+}
+
 
 int swdptap_init(void)
 {
@@ -37,6 +128,14 @@ int swdptap_init(void)
 
 	assert(ftdic != NULL);
 
+	if (active_cable->swd_mpsse) {
+		/* Still in MPSSE mode from platform_init(), drive SWDIO */
+		olddir = 1;
+		swdptap_mpsse_turnaround(0);
+		platform_buffer_flush();
+		return 0;
+	}
+
 	if((err = ftdi_set_bitmode(ftdic, 0xAB, BITMODE_BITBANG)) != 0) {
 		fprintf(stderr, "ftdi_set_bitmode: %d: %s\n",
 			err, ftdi_get_error_string(ftdic));
@@ -45,6 +144,7 @@ int swdptap_init(void)
 
 	assert(ftdi_write_data(ftdic, (void*)"\xAB\xA8", 2) == 2);
 	olddir = 0;
+	swd_bitbang = true;
 
 	return 0;
 }
@@ -71,6 +171,9 @@ bool swdptap_bit_in(void)
 {
 	uint8_t ret;
 
+	if (active_cable->swd_mpsse)
+		return swdptap_mpsse_in(1);
+
 	swdptap_turnaround(1);
 
 	ftdi_read_pins(ftdic, &ret);
@@ -84,6 +187,11 @@ void swdptap_bit_out(bool val)
 {
 	uint8_t buf[3] = "\xA0\xA1\xA0";
 
+	if (active_cable->swd_mpsse) {
+		swdptap_mpsse_out(val, 1);
+		return;
+	}
+
 	swdptap_turnaround(0);
 
 	if (val) {
@@ -93,3 +201,64 @@ void swdptap_bit_out(bool val)
 	platform_buffer_write(buf, 3);
 }
 
+/* The bit-banged cables use these one bit at a time, as the generic
+ * implementations would */
+uint32_t swdptap_seq_in(int ticks)
+{
+	uint32_t ret = 0;
+
+	STATS_ADD(swd_bits, ticks);
+	if (active_cable->swd_mpsse)
+		return swdptap_mpsse_in(ticks);
+
+	for (int i = 0; i < ticks; i++)
+		if (swdptap_bit_in())
+			ret |= 1u << i;
+	return ret;
+}
+
+bool swdptap_seq_in_parity(uint32_t *ret, int ticks)
+{
+	uint64_t data;
+
+	STATS_ADD(swd_bits, ticks + 1);
+	if (active_cable->swd_mpsse) {
+		data = swdptap_mpsse_in(ticks + 1);
+	} else {
+		data = 0;
+		for (int i = 0; i <= ticks; i++)
+			if (swdptap_bit_in())
+				data |= 1ull << i;
+	}
+	*ret = ticks < 32 ? data & ((1u << ticks) - 1) : data;
+	return __builtin_parityll(data);
+}
+
+void swdptap_seq_out(uint32_t MS, int ticks)
+{
+	STATS_ADD(swd_bits, ticks);
+	if (active_cable->swd_mpsse) {
+		swdptap_mpsse_out(MS, ticks);
+		return;
+	}
+
+	while (ticks--) {
+		swdptap_bit_out(MS & 1);
+		MS >>= 1;
+	}
+}
+
+void swdptap_seq_out_parity(uint32_t MS, int ticks)
+{
+	uint64_t data = ticks < 32 ? MS & ((1u << ticks) - 1) : MS;
+
+	data |= (uint64_t)__builtin_parityll(data) << ticks;
+	STATS_ADD(swd_bits, ticks + 1);
+	if (active_cable->swd_mpsse) {
+		swdptap_mpsse_out(data, ticks + 1);
+		return;
+	}
+
+	for (int i = 0; i <= ticks; i++)
+		swdptap_bit_out((data >> i) & 1);
+}
@@ -239,12 +239,9 @@ static void adc_init(void)
 	adc_calibrate(ADC1);
 }
 
-const char *platform_target_voltage(void)
+/* Target voltage in units of 1/81910 V */
+static uint32_t platform_target_voltage_adc(void)
 {
-	if (platform_hwversion() == 0)
-		return gpio_get(GPIOB, GPIO0) ? "OK" : "ABSENT!";
-
-	static char ret[] = "0.0V";
 	const uint8_t channel = 8;
 	adc_set_regular_sequence(ADC1, 1, (uint8_t*)&channel);
 
@@ -253,13 +250,31 @@ const char *platform_target_voltage(void)
 	/* Wait for end of conversion. */
 	while (!adc_eoc(ADC1));
 
-	uint32_t val = adc_read_regular(ADC1) * 99; /* 0-4095 */
+	return adc_read_regular(ADC1) * 99; /* 0-4095 */
+}
+
+const char *platform_target_voltage(void)
+{
+	if (platform_hwversion() == 0)
+		return gpio_get(GPIOB, GPIO0) ? "OK" : "ABSENT!";
+
+	static char ret[] = "0.0V";
+	uint32_t val = platform_target_voltage_adc();
 	ret[0] = '0' + val / 81910;
 	ret[2] = '0' + (val / 8191) % 10;
 
 	return ret;
 }
 
+/* Anything over a volt on VREF, or power from the probe */
+bool platform_target_present(void)
+{
+	if (platform_hwversion() == 0)
+		return gpio_get(GPIOB, GPIO0);
+	return platform_target_get_power() ||
+	       (platform_target_voltage_adc() > 81910);
+}
+
 void platform_request_boot(void)
 {
 	/* Disconnect USB cable */
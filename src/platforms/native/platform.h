@@ -29,7 +29,10 @@
 #include "timing_stm32.h"
 
 #define PLATFORM_HAS_TRACESWO
+#define PLATFORM_HAS_RTT
 #define PLATFORM_HAS_POWER_SWITCH
+#define PLATFORM_HAS_FREQUENCY
+#define PLATFORM_HAS_TARGET_SENSE
 #ifdef ENABLE_DEBUG
 #define PLATFORM_HAS_DEBUG
 #define USBUART_DEBUG
@@ -152,6 +155,15 @@
 #define USBUSART_TIM_CLK_EN() rcc_periph_clock_enable(RCC_TIM4)
 #define USBUSART_TIM_IRQ NVIC_TIM4_IRQ
 #define USBUSART_TIM_ISR tim4_isr
+#define USBUSART_DR USART1_DR
+#define USBUSART_DMA_BUS DMA1
+#define USBUSART_DMA_CLK RCC_DMA1
+#define USBUSART_DMA_RX_CHAN DMA_CHANNEL5
+#define USBUSART_DMA_RX_IRQ NVIC_DMA1_CHANNEL5_IRQ
+#define USBUSART_DMA_RX_ISR dma1_channel5_isr
+#define USBUSART_DMA_TX_CHAN DMA_CHANNEL4
+#define USBUSART_DMA_TX_IRQ NVIC_DMA1_CHANNEL4_IRQ
+#define USBUSART_DMA_TX_ISR dma1_channel4_isr
 
 #define TRACE_TIM TIM3
 #define TRACE_TIM_CLK_EN() rcc_periph_clock_enable(RCC_TIM3)
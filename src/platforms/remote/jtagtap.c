@@ -0,0 +1,100 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* JTAG on the probe, through the Black Magic vendor CMSIS-DAP commands */
+#include "general.h"
+#include "exception.h"
+#include "jtagtap.h"
+#include "cmsis_dap.h"
+
+static void remote_jtag(const uint8_t *req, size_t len, uint8_t *resp)
+{
+	remote_xfer(req, len, resp);
+	if (resp[1] != DAP_OK)
+		raise_exception(EXCEPTION_ERROR, "Probe JTAG command failed");
+}
+
+int jtagtap_init(void)
+{
+	uint8_t req[] = {DAP_VENDOR_JTAG_INIT};
+	uint8_t resp[DAP_PACKET_SIZE];
+
+	remote_swd_flush();
+	remote_xfer(req, sizeof(req), resp);
+	return (resp[1] == DAP_OK) ? 0 : -1;
+}
+
+void jtagtap_reset(void)
+{
+	uint8_t req[] = {DAP_VENDOR_JTAG_RESET};
+	uint8_t resp[DAP_PACKET_SIZE];
+
+	remote_jtag(req, sizeof(req), resp);
+}
+
+uint8_t jtagtap_next(const uint8_t dTMS, const uint8_t dTDI)
+{
+	uint8_t req[] = {DAP_VENDOR_JTAG_NEXT, dTMS, dTDI};
+	uint8_t resp[DAP_PACKET_SIZE];
+
+	remote_xfer(req, sizeof(req), resp);
+	return resp[1];
+}
+
+void jtagtap_tms_seq(uint32_t MS, int ticks)
+{
+	uint8_t req[] = {DAP_VENDOR_JTAG_TMS, ticks,
+	                 MS, MS >> 8, MS >> 16, MS >> 24};
+	uint8_t resp[DAP_PACKET_SIZE];
+
+	if (ticks)
+		remote_jtag(req, sizeof(req), resp);
+}
+
+void jtagtap_tdi_tdo_seq(uint8_t *DO, const uint8_t final_tms,
+                         const uint8_t *DI, int ticks)
+{
+	uint8_t req[3 + DAP_VENDOR_JTAG_BITS / 8];
+	uint8_t resp[DAP_PACKET_SIZE];
+
+	while (ticks) {
+		int bits = MIN(ticks, DAP_VENDOR_JTAG_BITS);
+		int bytes = (bits + 7) / 8;
+
+		ticks -= bits;
+		req[0] = DAP_VENDOR_JTAG_TDI_TDO;
+		req[1] = ticks ? 0 : final_tms;
+		req[2] = bits % DAP_VENDOR_JTAG_BITS;
+		memcpy(req + 3, DI, bytes);
+		remote_jtag(req, 3 + bytes, resp);
+
+		if (DO) {
+			/* Bits past the end of the last byte are kept */
+			uint8_t keep = (bits % 8) ? (0xff << (bits % 8)) : 0;
+			memcpy(DO, resp + 2, bytes - 1);
+			DO[bytes - 1] = (DO[bytes - 1] & keep) |
+			                (resp[1 + bytes] & ~keep);
+			DO += bytes;
+		}
+		DI += bytes;
+	}
+}
+
+void jtagtap_tdi_seq(const uint8_t final_tms, const uint8_t *DI, int ticks)
+{
+	jtagtap_tdi_tdo_seq(NULL, final_tms, DI, ticks);
+}
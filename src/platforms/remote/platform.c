@@ -0,0 +1,198 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Hosted platform driving the wire through a Black Magic Probe.  GDB
+ * packets, target drivers and caches all run here, while the probe only
+ * executes batches of SWD and JTAG operations sent to its CMSIS-DAP
+ * interface.
+ */
+#include "general.h"
+#include "gdb_if.h"
+#include "version.h"
+#include "exception.h"
+#include "cmsis_dap.h"
+
+#include <assert.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <libusb.h>
+
+#define REMOTE_TIMEOUT	2000	/* ms, longer than the probe's WAIT retries */
+
+static libusb_context *usb_ctx;
+static libusb_device_handle *usb_handle;
+static uint8_t ep_out, ep_in;
+
+/* Claim the probe's vendor interface named CMSIS-DAP */
+static bool remote_claim(libusb_device *dev)
+{
+	struct libusb_config_descriptor *config;
+	bool found = false;
+
+	if (libusb_get_active_config_descriptor(dev, &config))
+		return false;
+
+	for (int i = 0; !found && (i < config->bNumInterfaces); i++) {
+		const struct libusb_interface_descriptor *iface =
+			&config->interface[i].altsetting[0];
+		unsigned char name[64];
+
+		if ((iface->bInterfaceClass != LIBUSB_CLASS_VENDOR_SPEC) ||
+		    (iface->bNumEndpoints != 2) || !iface->iInterface)
+			continue;
+		if (libusb_get_string_descriptor_ascii(usb_handle,
+		        iface->iInterface, name, sizeof(name)) < 0)
+			continue;
+		if (!strstr((char *)name, "CMSIS-DAP"))
+			continue;
+		if (libusb_claim_interface(usb_handle, iface->bInterfaceNumber))
+			continue;
+
+		ep_out = iface->endpoint[0].bEndpointAddress;
+		ep_in = iface->endpoint[1].bEndpointAddress;
+		found = true;
+	}
+
+	libusb_free_config_descriptor(config);
+	return found;
+}
+
+static bool remote_open(const char *serial)
+{
+	libusb_device **list;
+	ssize_t count = libusb_get_device_list(usb_ctx, &list);
+
+	for (ssize_t i = 0; !usb_handle && (i < count); i++) {
+		struct libusb_device_descriptor desc;
+		unsigned char sn[64];
+
+		if (libusb_get_device_descriptor(list[i], &desc) ||
+		    (desc.idVendor != BMP_VID) || (desc.idProduct != BMP_PID))
+			continue;
+		if (libusb_open(list[i], &usb_handle))
+			continue;
+		if ((!serial ||
+		     ((libusb_get_string_descriptor_ascii(usb_handle,
+		         desc.iSerialNumber, sn, sizeof(sn)) > 0) &&
+		      !strcmp((char *)sn, serial))) &&
+		    remote_claim(list[i]))
+			break;
+		libusb_close(usb_handle);
+		usb_handle = NULL;
+	}
+
+	libusb_free_device_list(list, 1);
+	return usb_handle != NULL;
+}
+
+size_t remote_xfer(const uint8_t *req, size_t len, uint8_t *resp)
+{
+	int n;
+
+	if (libusb_bulk_transfer(usb_handle, ep_out, (uint8_t *)req, len,
+	                         &n, REMOTE_TIMEOUT) || (n != (int)len))
+		raise_exception(EXCEPTION_ERROR, "Probe request failed");
+	if (libusb_bulk_transfer(usb_handle, ep_in, resp, DAP_PACKET_SIZE,
+	                         &n, REMOTE_TIMEOUT) || (n < 2) ||
+	    (resp[0] != req[0]))
+		raise_exception(EXCEPTION_ERROR, "Probe response failed");
+	return n;
+}
+
+void platform_init(int argc, char **argv)
+{
+	uint8_t info[] = {DAP_INFO, DAP_INFO_VENDOR};
+	uint8_t resp[DAP_PACKET_SIZE];
+	char *serial = NULL;
+	int c;
+
+	while((c = getopt(argc, argv, "s:")) != -1) {
+		switch(c) {
+		case 's':
+			serial = optarg;
+			break;
+		}
+	}
+
+	printf("\nBlack Magic Probe (" FIRMWARE_VERSION ")\n");
+	printf("Copyright (C) 2015  Black Sphere Technologies Ltd.\n");
+	printf("License GPLv3+: GNU GPL version 3 or later "
+	       "<http://gnu.org/licenses/gpl.html>\n\n");
+
+	if (libusb_init(&usb_ctx)) {
+		fprintf(stderr, "libusb_init failed\n");
+		exit(-1);
+	}
+	if (!remote_open(serial)) {
+		fprintf(stderr, "No Black Magic Probe with a CMSIS-DAP "
+		        "interface found\n");
+		exit(-1);
+	}
+
+	/* The JTAG vendor commands are ours, check they are there */
+	size_t len = remote_xfer(info, sizeof(info), resp);
+	if ((len < 3) || strncmp((char *)resp + 2, DAP_VENDOR_NAME,
+	                         len - 2)) {
+		fprintf(stderr, "Probe firmware doesn't support remote use\n");
+		exit(-1);
+	}
+
+	assert(gdb_if_init() == 0);
+}
+
+void platform_srst_set_val(bool assert)
+{
+	uint8_t req[] = {DAP_SWJ_PINS, assert ? 0 : DAP_SWJ_nRESET,
+	                 DAP_SWJ_nRESET, 0, 0, 0, 0};
+	uint8_t resp[DAP_PACKET_SIZE];
+
+	remote_swd_flush();
+	remote_xfer(req, sizeof(req), resp);
+}
+
+bool platform_srst_get_val(void)
+{
+	uint8_t req[] = {DAP_SWJ_PINS, 0, 0, 0, 0, 0, 0};
+	uint8_t resp[DAP_PACKET_SIZE];
+
+	remote_xfer(req, sizeof(req), resp);
+	return !(resp[1] & DAP_SWJ_nRESET);
+}
+
+const char *platform_target_voltage(void)
+{
+	return "not supported";
+}
+
+void platform_delay(uint32_t ms)
+{
+	usleep(ms * 1000);
+}
+
+uint32_t platform_time_ms(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+}
+
+uint32_t platform_time_us(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec * 1000000) + tv.tv_usec;
+}
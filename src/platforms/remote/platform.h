@@ -0,0 +1,60 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Hosted build using a Black Magic Probe's CMSIS-DAP interface as the
+ * adapter, so that only the wire protocol runs on the probe */
+#ifndef __PLATFORM_H
+#define __PLATFORM_H
+
+#include "timing.h"
+
+#ifndef WIN32
+#	include <alloca.h>
+#else
+#	ifndef alloca
+#		define alloca __builtin_alloca
+#	endif
+#endif
+
+#define BMP_VID		0x1d50
+#define BMP_PID		0x6018
+
+#define PLATFORM_HAS_DEBUG
+
+#define GDB_PACKET_BUFFER_SIZE 16384
+
+#define SET_RUN_STATE(state)
+#define SET_IDLE_STATE(state)
+#define SET_ERROR_STATE(state)
+
+/* Execute one CMSIS-DAP command on the probe, returns the response
+ * length.  Raises an exception if the probe doesn't answer. */
+size_t remote_xfer(const uint8_t *req, size_t len, uint8_t *resp);
+
+/* Send SWD output still collected in swdptap.c */
+void remote_swd_flush(void);
+
+/* Have the probe execute the whole transfers of a SW-DP */
+struct ADIv5_DP_s;
+void remote_dp_init(struct ADIv5_DP_s *dp);
+
+static inline int platform_hwversion(void)
+{
+	        return 0;
+}
+
+#endif
@@ -0,0 +1,152 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* SW-DP transactions executed by the probe.  The queue is sent as
+ * DAP_Transfer commands, so a whole run costs one USB round trip.  The
+ * probe returns the value of each AP read, which is turned back into
+ * the posted reads the rest of the SW-DP code expects.
+ */
+#include "general.h"
+#include "exception.h"
+#include "adiv5.h"
+#include "cmsis_dap.h"
+
+/* Last AP read, returned by the next one as the SW-DP posts them */
+static uint32_t remote_ap_posted;
+
+static uint32_t remote_get32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Send as many of the len transactions as fit in one DAP_Transfer.
+ * Returns how many are done with. */
+static unsigned remote_dp_run(ADIv5_DP_t *dp, struct adiv5_dp_txn *txn,
+                              unsigned len)
+{
+	uint8_t req[DAP_PACKET_SIZE], resp[DAP_PACKET_SIZE];
+	size_t n = 3;
+	unsigned count, reads = 0;
+
+	/* With a FAULT latched, AP accesses aren't made until it's cleared */
+	if (dp->fault) {
+		for (count = 0; count < len; count++) {
+			if (!(txn[count].addr & ADIV5_APnDP))
+				break;
+			if (txn[count].result)
+				*txn[count].result = 0;
+		}
+		if (count)
+			return count;
+	}
+
+	remote_swd_flush();
+	for (count = 0; count < len; count++) {
+		struct adiv5_dp_txn *t = &txn[count];
+		bool ap = t->addr & ADIV5_APnDP;
+
+		if (dp->fault && ap)
+			break;
+		if ((n + (t->RnW ? 1 : 5) > sizeof(req)) ||
+		    (t->RnW && (3 + 4 * (reads + 1) > sizeof(resp))))
+			break;
+		req[n++] = (ap ? DAP_TRANSFER_APnDP : 0) |
+		           (t->RnW ? DAP_TRANSFER_RnW : 0) |
+		           (t->addr & DAP_TRANSFER_A32);
+		if (t->RnW) {
+			reads++;
+		} else {
+			req[n++] = t->value;
+			req[n++] = t->value >> 8;
+			req[n++] = t->value >> 16;
+			req[n++] = t->value >> 24;
+		}
+	}
+	req[0] = DAP_TRANSFER;
+	req[1] = 0;
+	req[2] = count;
+	remote_xfer(req, n, resp);
+
+	unsigned done = MIN(resp[1], count);
+	const uint8_t *data = resp + 3;
+	for (unsigned i = 0; i < done; i++) {
+		struct adiv5_dp_txn *t = &txn[i];
+		uint32_t val = 0;
+		if (t->RnW) {
+			val = remote_get32(data);
+			data += 4;
+		}
+		if (t->addr & ADIV5_APnDP) {
+			dp->unchecked = adiv5_ap_reg_bus(t->addr);
+			if (t->RnW) {
+				uint32_t posted = remote_ap_posted;
+				remote_ap_posted = val;
+				val = posted;
+			}
+		}
+		if (t->result)
+			*t->result = val;
+	}
+
+	if ((resp[2] == DAP_TRANSFER_OK) && done)
+		return done;
+
+	adiv5_dp_cache_invalidate(dp);
+	if (resp[2] == DAP_TRANSFER_FAULT) {
+		/* The rest is sent again, without the AP accesses */
+		if (dp->fault)
+			return count;
+		dp->fault = 1;
+		dp->unchecked = true;
+		return done;
+	}
+	if (resp[2] == DAP_TRANSFER_WAIT)
+		raise_exception(EXCEPTION_TIMEOUT, "SWDP ACK timeout");
+	raise_exception(EXCEPTION_ERROR, "SWDP invalid ACK");
+	return 0;
+}
+
+static uint32_t remote_dp_low_access(ADIv5_DP_t *dp, uint8_t RnW,
+                                     uint16_t addr, uint32_t value)
+{
+	uint32_t ret = 0;
+	struct adiv5_dp_txn txn = {
+		.RnW = RnW, .addr = addr, .value = value, .result = &ret,
+	};
+
+	while (!remote_dp_run(dp, &txn, 1));
+	return ret;
+}
+
+static void remote_dp_flush(ADIv5_DP_t *dp)
+{
+	unsigned len = dp->queue_len;
+
+	/* Empty the queue first, so an exception leaves it consistent */
+	dp->queue_len = 0;
+	for (unsigned i = 0; i < len; )
+		i += remote_dp_run(dp, &dp->queue[i], len - i);
+}
+
+void remote_dp_init(ADIv5_DP_t *dp)
+{
+	dp->low_access = remote_dp_low_access;
+	dp->flush = remote_dp_flush;
+	/* USB failures are exceptions, so these have to catch them */
+	dp->try_low_access = adiv5_dp_try_low_access_generic;
+	dp->try_flush = adiv5_dp_try_flush_generic;
+}
@@ -0,0 +1,143 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Raw SWD sequences on the probe.  Output is collected into a single
+ * DAP_SWD_Sequence command, which is only sent once input is needed or
+ * the packet is full.  The probe turns the line around itself.
+ */
+#include "general.h"
+#include "exception.h"
+#include "swdptap.h"
+#include "cmsis_dap.h"
+
+#define SEQ_MAX_BITS	64
+
+static uint8_t seq_req[DAP_PACKET_SIZE];
+static size_t seq_len;
+static unsigned seq_count;
+/* Info byte and length of the output sequence being filled */
+static size_t seq_info;
+static unsigned seq_bits;
+
+static void remote_swd_send(uint8_t *resp)
+{
+	seq_req[0] = DAP_SWD_SEQUENCE;
+	seq_req[1] = seq_count;
+	remote_xfer(seq_req, seq_len, resp);
+	seq_count = 0;
+	seq_bits = 0;
+	if (resp[1] != DAP_OK)
+		raise_exception(EXCEPTION_ERROR, "Probe SWD sequence failed");
+}
+
+void remote_swd_flush(void)
+{
+	uint8_t resp[DAP_PACKET_SIZE];
+
+	if (seq_count)
+		remote_swd_send(resp);
+}
+
+static void remote_swd_add(void)
+{
+	if (!seq_count)
+		seq_len = 2;
+	seq_count++;
+}
+
+static void remote_swd_out(bool bit)
+{
+	if (!seq_bits || (seq_bits == SEQ_MAX_BITS)) {
+		/* Leave room for an input sequence after a full output one */
+		if (seq_len + 2 + SEQ_MAX_BITS / 8 > sizeof(seq_req))
+			remote_swd_flush();
+		remote_swd_add();
+		seq_info = seq_len++;
+		seq_bits = 0;
+	}
+	if (!(seq_bits % 8))
+		seq_req[seq_len++] = 0;
+	seq_req[seq_len - 1] |= bit << (seq_bits % 8);
+	seq_bits++;
+	seq_req[seq_info] = seq_bits % SEQ_MAX_BITS;
+}
+
+/* Input ends the packet, so its data is all of the response */
+static uint64_t remote_swd_in(int ticks)
+{
+	uint8_t resp[DAP_PACKET_SIZE];
+	uint64_t ret = 0;
+
+	if (seq_count && (seq_len + 1 > sizeof(seq_req)))
+		remote_swd_flush();
+	remote_swd_add();
+	seq_req[seq_len++] = 0x80 | (ticks % SEQ_MAX_BITS);
+	remote_swd_send(resp);
+
+	for (int i = 0; i < (ticks + 7) / 8; i++)
+		ret |= (uint64_t)resp[2 + i] << (8 * i);
+	if (ticks < SEQ_MAX_BITS)
+		ret &= (1ULL << ticks) - 1;
+	return ret;
+}
+
+int swdptap_init(void)
+{
+	uint8_t req[] = {DAP_CONNECT, DAP_PORT_SWD};
+	uint8_t resp[DAP_PACKET_SIZE];
+
+	remote_swd_flush();
+	remote_xfer(req, sizeof(req), resp);
+	return (resp[1] == DAP_PORT_SWD) ? 0 : -1;
+}
+
+bool swdptap_bit_in(void)
+{
+	return remote_swd_in(1);
+}
+
+void swdptap_bit_out(bool val)
+{
+	remote_swd_out(val);
+}
+
+uint32_t swdptap_seq_in(int ticks)
+{
+	return remote_swd_in(ticks);
+}
+
+bool swdptap_seq_in_parity(uint32_t *ret, int ticks)
+{
+	uint64_t val = remote_swd_in(ticks + 1);
+
+	*ret = val & ((1ULL << ticks) - 1);
+	return __builtin_parityll(val);
+}
+
+void swdptap_seq_out(uint32_t MS, int ticks)
+{
+	for (int i = 0; i < ticks; i++)
+		remote_swd_out((MS >> i) & 1);
+}
+
+void swdptap_seq_out_parity(uint32_t MS, int ticks)
+{
+	swdptap_seq_out(MS, ticks);
+	if (ticks < 32)
+		MS &= (1u << ticks) - 1;
+	remote_swd_out(__builtin_parity(MS));
+}
@@ -1,9 +1,6 @@
 /*
  * This file is part of the Black Magic Debug project.
  *
- * Copyright (C) 2015  Black Sphere Technologies Ltd.
- * Written by Gareth McMullin <gareth@blacksphere.co.nz>
- *
  * This program is free software: you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
  * the Free Software Foundation, either version 3 of the License, or
@@ -17,24 +14,23 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
-#include "libopencm3/stm32/flash.h"
-#include "stub.h"
 
-#define SR_ERROR_MASK 0x14
+/* The simulated target is only wired for SWD, TDO floats high */
+#include "general.h"
+#include "jtagtap.h"
 
-void __attribute__((naked))
-stm32f1_flash_write_stub(uint16_t *dest, uint16_t *src, uint32_t size)
+int jtagtap_init(void)
 {
-	for (int i; i < size; i += 2) {
-		FLASH_CR = FLASH_CR_PG;
-		*dest++ = *src++;
-		while (FLASH_SR & FLASH_SR_BSY)
-			;
-	}
-
-	if (FLASH_SR & SR_ERROR_MASK)
-		stub_exit(1);
+	return 0;
+}
 
-	stub_exit(0);
+void jtagtap_reset(void)
+{
 }
 
+uint8_t jtagtap_next(const uint8_t dTMS, const uint8_t dTDI)
+{
+	(void)dTMS;
+	(void)dTDI;
+	return 1;
+}
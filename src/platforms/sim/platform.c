@@ -0,0 +1,168 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Hosted platform talking to the in-process target model instead of a
+ * cable, so the protocol layers can be profiled without hardware noise.
+ */
+#include "general.h"
+#include "gdb_if.h"
+#include "version.h"
+#include "rtt.h"
+#include "image.h"
+#include "settings.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+void platform_init(int argc, char **argv)
+{
+	unsigned wait = 0, glitch = 0;
+	int c;
+
+	while((c = getopt(argc, argv, "w:g:")) != -1) {
+		switch(c) {
+		case 'w':
+			wait = strtoul(optarg, NULL, 0);
+			break;
+		case 'g':
+			/* Power glitch of the debug domain after this many
+			 * requests on the wire */
+			glitch = strtoul(optarg, NULL, 0);
+			break;
+		}
+	}
+
+	printf("\nBlack Magic Probe (" FIRMWARE_VERSION ")\n");
+	printf("Copyright (C) 2015  Black Sphere Technologies Ltd.\n");
+	printf("License GPLv3+: GNU GPL version 3 or later "
+	       "<http://gnu.org/licenses/gpl.html>\n\n");
+	printf("Simulated STM32F103, %u WAIT responses per AP access\n", wait);
+
+	sim_target_init(wait, glitch);
+	assert(gdb_if_init() == 0);
+}
+
+/* RTT up data goes to stdout, there is no input */
+void rtt_if_enable(bool enable)
+{
+	(void)enable;
+}
+
+size_t rtt_if_write(const void *buf, size_t len)
+{
+	len = fwrite(buf, 1, len, stdout);
+	fflush(stdout);
+	return len;
+}
+
+size_t rtt_if_read(void *buf, size_t len)
+{
+	(void)buf;
+	(void)len;
+	return 0;
+}
+
+/* Image store in RAM, behaving like flash that is erased to 0xff */
+static uint8_t sim_image[64 * 1024];
+
+const uint8_t *image_if_base(void)
+{
+	return sim_image;
+}
+
+size_t image_if_size(void)
+{
+	return sizeof(sim_image);
+}
+
+bool image_if_erase(void)
+{
+	memset(sim_image, 0xff, sizeof(sim_image));
+	return true;
+}
+
+bool image_if_write(size_t offset, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	assert(!(offset & 3) && !(len & 3));
+	for (size_t i = 0; i < len; i++)
+		sim_image[offset + i] &= p[i];
+	return !memcmp(sim_image + offset, data, len);
+}
+
+/* Settings last as long as the process */
+static uint8_t sim_settings[4 * 1024];
+
+const uint8_t *settings_if_base(void)
+{
+	return sim_settings;
+}
+
+size_t settings_if_size(void)
+{
+	return sizeof(sim_settings);
+}
+
+bool settings_if_erase(void)
+{
+	memset(sim_settings, 0xff, sizeof(sim_settings));
+	return true;
+}
+
+bool settings_if_write(size_t offset, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	assert(!(offset & 3) && !(len & 3));
+	for (size_t i = 0; i < len; i++)
+		sim_settings[offset + i] &= p[i];
+	return !memcmp(sim_settings + offset, data, len);
+}
+
+void platform_srst_set_val(bool assert)
+{
+	(void)assert;
+}
+
+bool platform_srst_get_val(void) { return false; }
+
+const char *platform_target_voltage(void)
+{
+	return "simulated";
+}
+
+void platform_delay(uint32_t ms)
+{
+	usleep(ms * 1000);
+}
+
+uint32_t platform_time_ms(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+}
+
+uint32_t platform_time_us(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec * 1000000) + tv.tv_usec;
+}
@@ -0,0 +1,63 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Hosted build against a simulated target, no hardware required */
+#ifndef __PLATFORM_H
+#define __PLATFORM_H
+
+#include "timing.h"
+
+#ifndef WIN32
+#	include <alloca.h>
+#else
+#	ifndef alloca
+#		define alloca __builtin_alloca
+#	endif
+#endif
+
+#define PLATFORM_HAS_DEBUG
+#define PLATFORM_HAS_RTT
+#define PLATFORM_HAS_IMAGE
+#define PLATFORM_HAS_SETTINGS
+
+#define GDB_PACKET_BUFFER_SIZE 16384
+
+#define SET_RUN_STATE(state)
+#define SET_IDLE_STATE(state)
+#define SET_ERROR_STATE(state)
+
+/* SW-DP acknowledge codes, as returned by the model */
+#define SIM_ACK_OK	0x01
+#define SIM_ACK_WAIT	0x02
+#define SIM_ACK_FAULT	0x04
+
+/* Model of an STM32F103 medium density part, see sim_target.c */
+void sim_target_init(unsigned wait, unsigned glitch);
+/* Called for each request on the wire, false while the DP ignores them */
+bool sim_dp_request(void);
+void sim_dp_line_reset(void);
+uint8_t sim_dp_ack(bool APnDP);
+uint32_t sim_dp_read(bool APnDP, uint8_t addr);
+void sim_dp_write(bool APnDP, uint8_t addr, uint32_t value);
+void sim_dp_write_error(void);
+
+static inline int platform_hwversion(void)
+{
+	        return 0;
+}
+
+#endif
@@ -0,0 +1,836 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Model of an STM32F103 medium density part behind a SW-DP, just detailed
+ * enough for the probe to scan, attach, read and write memory, step, and
+ * program flash.
+ *
+ * - The DP has posted AP reads, sticky errors, overrun detection and
+ *   optional WAIT responses.  It can optionally drop off the wire once,
+ *   losing the debug power domain, until the next line reset.
+ * - The AHB-AP has CSW, TAR, DRW and the banked data registers.
+ * - The core model covers DHCSR, DCRSR, DCRDR, DFSR and AIRCR resets.
+ *   Single steps advance the PC by one 16-bit instruction.
+ * - The FPEC supports unlocking, page and mass erase and halfword programming.
+ * - The RCC has CR and CFGR, with the HSI and PLL ready as soon as enabled.
+ *
+ * The core executes no code.  When it resumes at one of the probe's own
+ * flash or memory stubs, their effect is applied directly and the core halts
+ * on the stub's breakpoint.  A running flash stub drains its ring buffer
+ * whenever the probe reads from the bus.  Any other code runs until a halt
+ * request.
+ *
+ * budgets.json holds the debug port budgets for this model checked by
+ * scripts/gdbbench.py -b.
+ */
+#include "general.h"
+#include "adiv5.h"
+
+#define SIM_FLASH_BASE	0x08000000
+#define SIM_FLASH_SIZE	0x20000
+#define SIM_FLASH_PAGE	0x400
+#define SIM_RAM_BASE	0x20000000
+#define SIM_RAM_SIZE	0x5000
+#define SIM_PPB_BASE	0xE0000000
+#define SIM_PPB_SIZE	0x100000
+#define SIM_FPEC_BASE	0x40022000
+#define SIM_FPEC_SIZE	0x400
+#define SIM_RCC_BASE	0x40021000
+#define SIM_RCC_SIZE	0x400
+
+#define SIM_DP_IDCODE	0x1BA01477
+#define SIM_AP_IDR	0x14770011
+#define SIM_AP_CSW	0x23000040
+#define SIM_ROM_TABLE	0xE00FF000
+#define SIM_SCS		0xE000E000
+
+#define DHCSR		0xE000EDF0
+#define DCRSR		0xE000EDF4
+#define DCRDR		0xE000EDF8
+#define DEMCR		0xE000EDFC
+#define DFSR		0xE000ED30
+#define AIRCR		0xE000ED0C
+#define CPUID		0xE000ED00
+#define CPACR		0xE000ED88
+#define CFSR		0xE000ED28
+#define HFSR		0xE000ED2C
+#define FPB_CTRL	0xE0002000
+#define DWT_CTRL	0xE0001000
+#define DBGMCU_IDCODE	0xE0042000
+
+#define DHCSR_C_DEBUGEN	(1 << 0)
+#define DHCSR_C_HALT	(1 << 1)
+#define DHCSR_C_STEP	(1 << 2)
+#define DHCSR_S_REGRDY	(1 << 16)
+#define DHCSR_S_HALT	(1 << 17)
+#define DHCSR_S_RESET_ST (1 << 25)
+#define DFSR_HALTED	(1 << 0)
+#define DFSR_BKPT	(1 << 1)
+#define DFSR_VCATCH	(1 << 3)
+
+#define FPEC_ACR	0x00
+#define FPEC_KEYR	0x04
+#define FPEC_SR		0x0C
+#define FPEC_CR		0x10
+#define FPEC_AR		0x14
+#define FPEC_OBR	0x1C
+#define FPEC_WRPR	0x20
+#define FPEC_CR_PG	(1 << 0)
+#define FPEC_CR_PER	(1 << 1)
+#define FPEC_CR_MER	(1 << 2)
+#define FPEC_CR_STRT	(1 << 6)
+#define FPEC_CR_LOCK	(1 << 7)
+#define FPEC_SR_PGERR	(1 << 2)
+#define FPEC_SR_WRPRTERR (1 << 4)
+#define FPEC_SR_EOP	(1 << 5)
+
+#define RCC_CR		0x00
+#define RCC_CFGR	0x04
+#define RCC_CR_HSION	(1 << 0)
+#define RCC_CR_HSIRDY	(1 << 1)
+#define RCC_CR_PLLON	(1 << 24)
+#define RCC_CR_PLLRDY	(1 << 25)
+#define RCC_CFGR_SW	0x3
+#define RCC_CFGR_SWS	0xc
+
+static const uint16_t stm32f1_stub[] = {
+#include "flashstub/stm32f1.stub"
+};
+
+static const uint16_t crc32_stub[] = {
+#include "flashstub/crc32.stub"
+};
+
+static const uint16_t memsearch_stub[] = {
+#include "flashstub/memsearch.stub"
+};
+
+static const uint16_t memfill_stub[] = {
+#include "flashstub/memfill.stub"
+};
+
+static uint8_t sim_flash[SIM_FLASH_SIZE];
+static uint8_t sim_ram[SIM_RAM_SIZE];
+/* Backing store for the system control space and debug components */
+static uint8_t sim_ppb[SIM_PPB_SIZE];
+
+static struct {
+	unsigned wait;		/* WAIT responses before each AP access */
+	unsigned waited;
+	unsigned glitch;	/* Requests until the debug domain loses power */
+	bool lost;		/* Off the wire until a line reset */
+	uint32_t ctrlstat;
+	uint32_t select;
+	uint32_t rdbuff;
+	uint32_t csw;
+	uint32_t tar;
+} dp;
+
+static struct {
+	uint32_t regs[128];	/* indexed by DCRSR REGSEL */
+	uint32_t dhcsr;		/* C_* control bits */
+	bool halted;
+	bool reset_st;
+} core;
+
+/* Flash stub streaming from its ring buffer */
+static struct {
+	bool running;
+	uint32_t pc;
+	uint32_t dest;
+	uint32_t ring;
+	uint32_t size;
+} stub;
+
+static struct {
+	uint32_t sr;
+	uint32_t cr;
+	uint32_t ar;
+	uint32_t acr;
+	unsigned keys;		/* unlock sequence progress */
+} fpec;
+
+static struct {
+	uint32_t cr;
+	uint32_t cfgr;
+} rcc;
+
+static uint32_t sim_get32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void sim_put32(uint8_t *p, uint32_t val)
+{
+	p[0] = val;
+	p[1] = val >> 8;
+	p[2] = val >> 16;
+	p[3] = val >> 24;
+}
+
+static uint32_t ppb_get(uint32_t addr)
+{
+	return sim_get32(&sim_ppb[addr - SIM_PPB_BASE]);
+}
+
+static void ppb_put(uint32_t addr, uint32_t val)
+{
+	sim_put32(&sim_ppb[addr - SIM_PPB_BASE], val);
+}
+
+/* Component and peripheral ID registers of a 4KiB CoreSight block, with
+ * the JEP-106 designer continuation count in bits 8-11 */
+static void sim_component(uint32_t base, uint8_t cid_class,
+                          uint16_t designer, uint16_t part)
+{
+	static const uint8_t cidr[] = {0x0d, 0x00, 0x05, 0xb1};
+
+	for (int i = 0; i < 4; i++)
+		ppb_put(base + 0xff0 + 4 * i, cidr[i] | (i == 1 ? cid_class << 4 : 0));
+	ppb_put(base + 0xfe0, part & 0xff);
+	ppb_put(base + 0xfe4, ((designer & 0xf) << 4) | ((part >> 8) & 0xf));
+	ppb_put(base + 0xfe8, 0x08 | ((designer >> 4) & 0x7));
+	ppb_put(base + 0xfec, 0x00);
+	ppb_put(base + 0xfd0, (designer >> 8) & 0xf);
+}
+
+static void sim_core_reset(void)
+{
+	memset(core.regs, 0, sizeof(core.regs));
+	stub.running = false;
+	core.regs[13] = core.regs[17] = sim_get32(&sim_flash[0]);
+	core.regs[15] = sim_get32(&sim_flash[4]) & ~1;
+	core.regs[16] = 0x01000000;
+	core.reset_st = true;
+
+	fpec.cr = FPEC_CR_LOCK;
+	fpec.acr = 0x10;
+	fpec.keys = 0;
+	rcc.cr = RCC_CR_HSION;
+	rcc.cfgr = 0;
+
+	/* Halt on the reset vector if asked to */
+	if ((core.dhcsr & DHCSR_C_DEBUGEN) && (ppb_get(DEMCR) & 1)) {
+		core.halted = true;
+		ppb_put(DFSR, ppb_get(DFSR) | DFSR_VCATCH);
+	} else {
+		core.halted = false;
+	}
+}
+
+void sim_target_init(unsigned wait, unsigned glitch)
+{
+	memset(&dp, 0, sizeof(dp));
+	dp.wait = wait;
+	dp.glitch = glitch;
+	dp.csw = SIM_AP_CSW;
+
+	memset(sim_flash, 0xff, sizeof(sim_flash));
+
+	/* ROM table with the SCS as its only entry */
+	ppb_put(SIM_ROM_TABLE, ((SIM_SCS - SIM_ROM_TABLE) & ~0xfff) | 3);
+	sim_component(SIM_ROM_TABLE, 0x1, 0x020, 0x410);	/* ST */
+	sim_component(SIM_SCS, 0xe, 0x43b, 0x000);	/* ARM */
+
+	ppb_put(CPUID, 0x412fc231);		/* Cortex-M3 r2p1 */
+	ppb_put(FPB_CTRL, 0x10000260);		/* 6 code, 2 literal comparators */
+	ppb_put(DWT_CTRL, 0x40000000);		/* 4 comparators */
+	ppb_put(DBGMCU_IDCODE, 0x20036410);	/* STM32F1 medium density */
+
+	sim_core_reset();
+	core.reset_st = false;
+}
+
+static uint8_t *sim_mem(uint32_t addr)
+{
+	if (addr - SIM_FLASH_BASE < SIM_FLASH_SIZE)
+		return &sim_flash[addr - SIM_FLASH_BASE];
+	if (addr - SIM_RAM_BASE < SIM_RAM_SIZE)
+		return &sim_ram[addr - SIM_RAM_BASE];
+	if (addr - SIM_PPB_BASE < SIM_PPB_SIZE)
+		return &sim_ppb[addr - SIM_PPB_BASE];
+	return NULL;
+}
+
+static void sim_flash_program(uint32_t addr, uint16_t val)
+{
+	uint8_t *p = &sim_flash[addr - SIM_FLASH_BASE];
+	uint16_t old = p[0] | (p[1] << 8);
+
+	/* Only an erased halfword can be programmed, except with zero */
+	if ((old != 0xffff) && val) {
+		fpec.sr |= FPEC_SR_PGERR;
+		return;
+	}
+	p[0] = val;
+	p[1] = val >> 8;
+	fpec.sr |= FPEC_SR_EOP;
+}
+
+static void sim_fpec_write(uint32_t reg, uint32_t val)
+{
+	static const uint32_t keys[] = {0x45670123, 0xcdef89ab};
+
+	switch (reg) {
+	case FPEC_KEYR:
+		if ((fpec.keys < 2) && (val == keys[fpec.keys]))
+			fpec.keys++;
+		else
+			fpec.keys = 3;	/* locked until reset */
+		if (fpec.keys == 2)
+			fpec.cr &= ~FPEC_CR_LOCK;
+		break;
+	case FPEC_SR:
+		fpec.sr &= ~(val & (FPEC_SR_PGERR | FPEC_SR_WRPRTERR | FPEC_SR_EOP));
+		break;
+	case FPEC_CR:
+		if (fpec.cr & FPEC_CR_LOCK)
+			break;
+		fpec.cr = val & ~FPEC_CR_STRT;
+		if (!(val & FPEC_CR_STRT))
+			break;
+		if (val & FPEC_CR_MER) {
+			memset(sim_flash, 0xff, sizeof(sim_flash));
+			fpec.sr |= FPEC_SR_EOP;
+		} else if ((val & FPEC_CR_PER) &&
+		           (fpec.ar - SIM_FLASH_BASE < SIM_FLASH_SIZE)) {
+			uint32_t page = (fpec.ar - SIM_FLASH_BASE) & ~(SIM_FLASH_PAGE - 1);
+			memset(&sim_flash[page], 0xff, SIM_FLASH_PAGE);
+			fpec.sr |= FPEC_SR_EOP;
+		}
+		break;
+	case FPEC_AR:
+		fpec.ar = val;
+		break;
+	case FPEC_ACR:
+		fpec.acr = val & 0x1f;
+		break;
+	}
+}
+
+static uint32_t sim_fpec_read(uint32_t reg)
+{
+	switch (reg) {
+	case FPEC_ACR:
+		/* PRFTBS follows PRFTBE */
+		return fpec.acr | ((fpec.acr & 0x10) << 1);
+	case FPEC_SR:
+		return fpec.sr;
+	case FPEC_CR:
+		return fpec.cr;
+	case FPEC_AR:
+		return fpec.ar;
+	case FPEC_WRPR:
+		return 0xffffffff;
+	default:
+		return 0;
+	}
+}
+
+static uint32_t sim_rcc_read(uint32_t reg)
+{
+	switch (reg) {
+	case RCC_CR:
+		return rcc.cr | ((rcc.cr & RCC_CR_HSION) ? RCC_CR_HSIRDY : 0) |
+		       ((rcc.cr & RCC_CR_PLLON) ? RCC_CR_PLLRDY : 0);
+	case RCC_CFGR:
+		return rcc.cfgr | ((rcc.cfgr & RCC_CFGR_SW) << 2);
+	default:
+		return 0;
+	}
+}
+
+static void sim_rcc_write(uint32_t reg, uint32_t val)
+{
+	switch (reg) {
+	case RCC_CR:
+		rcc.cr = val & ~(RCC_CR_HSIRDY | RCC_CR_PLLRDY);
+		break;
+	case RCC_CFGR:
+		rcc.cfgr = val & ~RCC_CFGR_SWS;
+		break;
+	}
+}
+
+/* Offset of the stub's "bkpt #code" from its start, or -1 */
+static int sim_stub_bkpt(const uint16_t *stub, size_t size, uint8_t code)
+{
+	for (unsigned i = 0; i < size / 2; i++)
+		if (stub[i] == (0xbe00 | code))
+			return i * 2;
+	return -1;
+}
+
+static bool sim_stub_at(uint32_t pc, const uint16_t *stub, size_t size)
+{
+	if ((pc - SIM_RAM_BASE > SIM_RAM_SIZE) ||
+	    (pc - SIM_RAM_BASE + size > SIM_RAM_SIZE))
+		return false;
+	return !memcmp(&sim_ram[pc - SIM_RAM_BASE], stub, size);
+}
+
+static uint32_t sim_crc32(uint32_t crc, uint32_t addr, uint32_t len)
+{
+	while (len--) {
+		uint8_t *p = sim_mem(addr++);
+		crc ^= (p ? *p : 0) << 24;
+		for (int i = 0; i < 8; i++)
+			crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+	}
+	return crc;
+}
+
+static uint8_t sim_byte(uint32_t addr)
+{
+	uint8_t *p = sim_mem(addr);
+	return p ? *p : 0;
+}
+
+/* As memsearch.s, the first match or one past the last possible start */
+static uint32_t sim_memsearch(uint32_t addr, uint32_t len,
+                              uint32_t pat, uint32_t plen)
+{
+	uint32_t last = addr + len - plen;
+
+	for (; addr <= last; addr++) {
+		uint32_t i;
+		for (i = 0; i < plen; i++)
+			if (sim_byte(addr + i) != sim_byte(pat + i))
+				break;
+		if (i == plen)
+			return addr;
+	}
+	return addr;
+}
+
+static uint32_t sim_memfill(uint32_t addr, uint32_t len,
+                            uint32_t pat, uint32_t plen)
+{
+	for (uint32_t i = 0; i < len; i++) {
+		uint8_t *p = sim_mem(addr + i);
+		if (p)
+			*p = sim_byte(pat + i % plen);
+	}
+	return addr + len;
+}
+
+/* Halt on the breakpoint at pc, as if execution had reached it */
+static void sim_core_bkpt(uint32_t pc)
+{
+	core.regs[15] = pc;
+	core.halted = true;
+	ppb_put(DFSR, ppb_get(DFSR) | DFSR_BKPT);
+}
+
+/* Drain the ring of a running flash stub, as its loop would */
+static void sim_stub_poll(void)
+{
+	if (!stub.running || core.halted)
+		return;
+
+	uint8_t *hdr = sim_mem(stub.ring);
+	if (!hdr || !sim_mem(stub.ring + 0x10 + stub.size - 1))
+		return;
+	uint32_t stop = sim_get32(hdr + 0xc);
+	uint32_t wp = sim_get32(hdr);
+	uint32_t rp = sim_get32(hdr + 4);
+
+	for (; rp != wp; rp += 2) {
+		uint8_t *src = hdr + 0x10 + (rp & (stub.size - 1));
+		if (fpec.cr & FPEC_CR_LOCK)
+			fpec.sr |= FPEC_SR_PGERR;
+		else if (stub.dest - SIM_FLASH_BASE < SIM_FLASH_SIZE)
+			sim_flash_program(stub.dest, src[0] | (src[1] << 8));
+		stub.dest += 2;
+		if (fpec.sr & (FPEC_SR_PGERR | FPEC_SR_WRPRTERR)) {
+			sim_put32(hdr + 8, 1);
+			stub.running = false;
+			sim_core_bkpt(stub.pc + sim_stub_bkpt(stm32f1_stub,
+			                                      sizeof(stm32f1_stub), 1));
+			return;
+		}
+	}
+	sim_put32(hdr + 4, rp);
+
+	if (stop) {
+		stub.running = false;
+		sim_core_bkpt(stub.pc + sim_stub_bkpt(stm32f1_stub,
+		                                      sizeof(stm32f1_stub), 0));
+	}
+}
+
+/* Start executing at the current pc */
+static void sim_core_run(void)
+{
+	uint32_t pc = core.regs[15];
+	uint32_t *r = core.regs;
+	uint8_t *p = sim_mem(pc);
+
+	core.halted = false;
+	stub.running = false;
+
+	if (p && (p[1] == 0xbe)) {
+		sim_core_bkpt(pc);
+	} else if (sim_stub_at(pc, stm32f1_stub, sizeof(stm32f1_stub))) {
+		/* r0: dest, r1: ring header, r2: ring size */
+		stub.running = true;
+		stub.pc = pc;
+		stub.dest = r[0];
+		stub.ring = r[1];
+		stub.size = r[2];
+		sim_stub_poll();
+	} else if (sim_stub_at(pc, crc32_stub, sizeof(crc32_stub))) {
+		/* r0: start, r1: length, r2: initial CRC, result in r0 */
+		r[0] = sim_crc32(r[2], r[0], r[1]);
+		sim_core_bkpt(pc + sim_stub_bkpt(crc32_stub, sizeof(crc32_stub), 0));
+	} else if (sim_stub_at(pc, memsearch_stub, sizeof(memsearch_stub))) {
+		/* r0: start, r1: length, r2: pattern, r3: its length */
+		r[0] = sim_memsearch(r[0], r[1], r[2], r[3]);
+		sim_core_bkpt(pc + sim_stub_bkpt(memsearch_stub,
+		                                 sizeof(memsearch_stub), 0));
+	} else if (sim_stub_at(pc, memfill_stub, sizeof(memfill_stub))) {
+		r[0] = sim_memfill(r[0], r[1], r[2], r[3]);
+		sim_core_bkpt(pc + sim_stub_bkpt(memfill_stub,
+		                                 sizeof(memfill_stub), 0));
+	}
+}
+
+static void sim_dhcsr_write(uint32_t val)
+{
+	if ((val >> 16) != 0xa05f)
+		return;
+
+	bool was_halted = core.halted;
+	core.dhcsr = val & 0xf;
+
+	if (!(core.dhcsr & DHCSR_C_DEBUGEN)) {
+		core.halted = false;
+	} else if (core.dhcsr & DHCSR_C_HALT) {
+		if (!was_halted)
+			ppb_put(DFSR, ppb_get(DFSR) | DFSR_HALTED);
+		core.halted = true;
+	} else if (was_halted && (core.dhcsr & DHCSR_C_STEP)) {
+		core.regs[15] += 2;
+		ppb_put(DFSR, ppb_get(DFSR) | DFSR_HALTED);
+	} else if (was_halted) {
+		sim_core_run();
+	}
+}
+
+static uint32_t sim_ppb_read(uint32_t addr)
+{
+	uint32_t val;
+
+	switch (addr) {
+	case DHCSR:
+		val = core.dhcsr | DHCSR_S_REGRDY;
+		if (core.halted)
+			val |= DHCSR_S_HALT;
+		if (core.reset_st)
+			val |= DHCSR_S_RESET_ST;
+		core.reset_st = false;
+		return val;
+	default:
+		return ppb_get(addr);
+	}
+}
+
+static void sim_ppb_write(uint32_t addr, uint32_t val)
+{
+	switch (addr) {
+	case DHCSR:
+		sim_dhcsr_write(val);
+		break;
+	case DCRSR:
+		if (!core.halted)
+			break;
+		if (val & (1 << 16))
+			core.regs[val & 0x7f] = ppb_get(DCRDR);
+		else
+			ppb_put(DCRDR, core.regs[val & 0x7f]);
+		break;
+	case DFSR:
+	case CFSR:
+	case HFSR:
+		ppb_put(addr, ppb_get(addr) & ~val);
+		break;
+	case AIRCR:
+		if (((val >> 16) == 0x05fa) && (val & 0x4))
+			sim_core_reset();
+		break;
+	case FPB_CTRL:
+		if (val & 0x2)
+			ppb_put(addr, (ppb_get(addr) & ~1) | (val & 1));
+		break;
+	case CPUID:
+	case CPACR:	/* no FPU */
+	case DWT_CTRL:
+	case DBGMCU_IDCODE:
+		break;
+	default:
+		/* Read-only ID registers of the debug components */
+		if ((addr & 0xf00) == 0xf00)
+			break;
+		ppb_put(addr, val);
+	}
+}
+
+/* Word read from the bus, all byte lanes valid */
+static bool sim_bus_read(uint32_t addr, uint32_t *val)
+{
+	sim_stub_poll();
+	addr &= ~3;
+	if (addr - SIM_PPB_BASE < SIM_PPB_SIZE) {
+		*val = sim_ppb_read(addr);
+		return true;
+	}
+	if (addr - SIM_FPEC_BASE < SIM_FPEC_SIZE) {
+		*val = sim_fpec_read(addr - SIM_FPEC_BASE);
+		return true;
+	}
+	if (addr - SIM_RCC_BASE < SIM_RCC_SIZE) {
+		*val = sim_rcc_read(addr - SIM_RCC_BASE);
+		return true;
+	}
+	uint8_t *p = sim_mem(addr);
+	if (!p)
+		return false;
+	*val = sim_get32(p);
+	return true;
+}
+
+/* Write of size bytes at addr, data on the matching byte lanes */
+static bool sim_bus_write(uint32_t addr, uint32_t val, unsigned size)
+{
+	unsigned lane = addr & 3;
+
+	if (addr - SIM_PPB_BASE < SIM_PPB_SIZE) {
+		if (size == 4) {
+			sim_ppb_write(addr & ~3, val);
+		} else {
+			uint32_t mask = ((1ull << (size * 8)) - 1) << (lane * 8);
+			uint32_t old = ppb_get(addr & ~3);
+			sim_ppb_write(addr & ~3, (old & ~mask) | (val & mask));
+		}
+		return true;
+	}
+	if (addr - SIM_FPEC_BASE < SIM_FPEC_SIZE) {
+		sim_fpec_write((addr & ~3) - SIM_FPEC_BASE, val);
+		return true;
+	}
+	if (addr - SIM_RCC_BASE < SIM_RCC_SIZE) {
+		sim_rcc_write((addr & ~3) - SIM_RCC_BASE, val);
+		return true;
+	}
+	if (addr - SIM_FLASH_BASE < SIM_FLASH_SIZE) {
+		/* Programmed a halfword at a time, other writes are ignored */
+		if (!(fpec.cr & FPEC_CR_PG))
+			return true;
+		if ((size != 2) || (addr & 1))
+			fpec.sr |= FPEC_SR_PGERR;
+		else
+			sim_flash_program(addr, val >> (lane * 8));
+		return true;
+	}
+	uint8_t *p = sim_mem(addr);
+	if (!p)
+		return false;
+	for (unsigned i = 0; i < size; i++)
+		p[i] = val >> ((lane + i) * 8);
+	return true;
+}
+
+static unsigned sim_csw_size(void)
+{
+	switch (dp.csw & ADIV5_AP_CSW_SIZE_MASK) {
+	case ADIV5_AP_CSW_SIZE_BYTE:
+		return 1;
+	case ADIV5_AP_CSW_SIZE_HALFWORD:
+		return 2;
+	default:
+		return 4;
+	}
+}
+
+static uint32_t sim_ap_read(uint8_t addr)
+{
+	uint32_t val = 0;
+
+	if (dp.select >> 24)
+		return 0;
+
+	switch ((dp.select & 0xf0) | addr) {
+	case 0x00:
+		return dp.csw;
+	case 0x04:
+		return dp.tar;
+	case 0x0c:
+		if (!sim_bus_read(dp.tar, &val))
+			dp.ctrlstat |= ADIV5_DP_CTRLSTAT_STICKYERR;
+		if ((dp.csw & ADIV5_AP_CSW_ADDRINC_MASK) == ADIV5_AP_CSW_ADDRINC_SINGLE)
+			dp.tar += sim_csw_size();
+		return val;
+	case 0x10: case 0x14: case 0x18: case 0x1c:
+		if (!sim_bus_read((dp.tar & ~0xf) | (addr & 0xc), &val))
+			dp.ctrlstat |= ADIV5_DP_CTRLSTAT_STICKYERR;
+		return val;
+	case 0xf8:
+		return SIM_ROM_TABLE | 3;
+	case 0xfc:
+		return SIM_AP_IDR;
+	default:
+		return 0;
+	}
+}
+
+static void sim_ap_write(uint8_t addr, uint32_t val)
+{
+	if (dp.select >> 24)
+		return;
+
+	switch ((dp.select & 0xf0) | addr) {
+	case 0x00:
+		dp.csw = (SIM_AP_CSW & ~0x3f) | (val & 0x37);
+		break;
+	case 0x04:
+		dp.tar = val;
+		break;
+	case 0x0c:
+		if (!sim_bus_write(dp.tar, val, sim_csw_size()))
+			dp.ctrlstat |= ADIV5_DP_CTRLSTAT_STICKYERR;
+		if ((dp.csw & ADIV5_AP_CSW_ADDRINC_MASK) == ADIV5_AP_CSW_ADDRINC_SINGLE)
+			dp.tar += sim_csw_size();
+		break;
+	case 0x10: case 0x14: case 0x18: case 0x1c:
+		if (!sim_bus_write((dp.tar & ~0xf) | (addr & 0xc), val, 4))
+			dp.ctrlstat |= ADIV5_DP_CTRLSTAT_STICKYERR;
+		break;
+	}
+}
+
+uint8_t sim_dp_ack(bool APnDP)
+{
+	if (!APnDP)
+		return SIM_ACK_OK;
+	if (dp.ctrlstat & (ADIV5_DP_CTRLSTAT_STICKYERR | ADIV5_DP_CTRLSTAT_WDATAERR |
+	                   ADIV5_DP_CTRLSTAT_STICKYORUN))
+		return SIM_ACK_FAULT;
+	if (dp.waited < dp.wait) {
+		dp.waited++;
+		/* With overrun detection every later access faults */
+		if (dp.ctrlstat & ADIV5_DP_CTRLSTAT_ORUNDETECT)
+			dp.ctrlstat |= ADIV5_DP_CTRLSTAT_STICKYORUN;
+		return SIM_ACK_WAIT;
+	}
+	dp.waited = 0;
+	return SIM_ACK_OK;
+}
+
+uint32_t sim_dp_read(bool APnDP, uint8_t addr)
+{
+	uint32_t ret;
+
+	if (APnDP) {
+		/* AP reads are posted, the result comes with the next one */
+		ret = dp.rdbuff;
+		dp.rdbuff = sim_ap_read(addr);
+		return ret;
+	}
+
+	switch (addr) {
+	case 0x0:
+		return SIM_DP_IDCODE;
+	case 0x4:
+		/* Power domains acknowledge their requests immediately */
+		ret = dp.ctrlstat & ~(ADIV5_DP_CTRLSTAT_CSYSPWRUPACK |
+		                      ADIV5_DP_CTRLSTAT_CDBGPWRUPACK |
+		                      ADIV5_DP_CTRLSTAT_CDBGRSTACK);
+		return ret | ((dp.ctrlstat & (ADIV5_DP_CTRLSTAT_CSYSPWRUPREQ |
+		                              ADIV5_DP_CTRLSTAT_CDBGPWRUPREQ |
+		                              ADIV5_DP_CTRLSTAT_CDBGRSTREQ)) << 1);
+	case 0x8:
+		return 0;
+	default:
+		return dp.rdbuff;
+	}
+}
+
+void sim_dp_write(bool APnDP, uint8_t addr, uint32_t value)
+{
+	if (APnDP) {
+		sim_ap_write(addr, value);
+		return;
+	}
+
+	switch (addr) {
+	case 0x0:
+		if (value & ADIV5_DP_ABORT_DAPABORT)
+			dp.waited = 0;
+		if (value & ADIV5_DP_ABORT_STKERRCLR)
+			dp.ctrlstat &= ~ADIV5_DP_CTRLSTAT_STICKYERR;
+		if (value & ADIV5_DP_ABORT_STKCMPCLR)
+			dp.ctrlstat &= ~ADIV5_DP_CTRLSTAT_STICKYCMP;
+		if (value & ADIV5_DP_ABORT_WDERRCLR)
+			dp.ctrlstat &= ~ADIV5_DP_CTRLSTAT_WDATAERR;
+		if (value & ADIV5_DP_ABORT_ORUNERRCLR)
+			dp.ctrlstat &= ~ADIV5_DP_CTRLSTAT_STICKYORUN;
+		break;
+	case 0x4:
+		/* Sticky flags are only cleared through ABORT on SW-DP */
+		dp.ctrlstat = (dp.ctrlstat & 0xb2) | (value & ~0xb2);
+		break;
+	case 0x8:
+		dp.select = value;
+		break;
+	}
+}
+
+/* The debug power domain goes down.  The core keeps running, without
+ * debug and with the FPB and DWT comparators cleared. */
+static void sim_debug_power_loss(void)
+{
+	dp.ctrlstat = 0;
+	dp.select = 0;
+	dp.csw = SIM_AP_CSW;
+	dp.tar = 0;
+	dp.lost = true;
+
+	sim_dhcsr_write(0xa05f0000);
+	ppb_put(DEMCR, 0);
+	ppb_put(FPB_CTRL, ppb_get(FPB_CTRL) & ~1);
+	for (int i = 0; i < 8; i++)
+		ppb_put(FPB_CTRL + 8 + 4 * i, 0);
+	for (int i = 0; i < 4; i++)
+		ppb_put(DWT_CTRL + 0x28 + 16 * i, 0);
+}
+
+bool sim_dp_request(void)
+{
+	if (dp.glitch && !--dp.glitch)
+		sim_debug_power_loss();
+	return !dp.lost;
+}
+
+void sim_dp_line_reset(void)
+{
+	dp.lost = false;
+}
+
+void sim_dp_write_error(void)
+{
+	dp.ctrlstat |= ADIV5_DP_CTRLSTAT_WDATAERR;
+}
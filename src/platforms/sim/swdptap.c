@@ -0,0 +1,131 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* SW-DP wire protocol of the simulated target.  Bits driven by the probe
+ * are kept until it turns the line around to read.  If the last eight
+ * form a valid request, the target answers with the ACK and, for reads,
+ * the data and parity.  The data phase of an acknowledged write is
+ * collected from the following 33 bits.  Turnaround cycles are implied
+ * by the change of direction, as on the real bit-banged ports.
+ */
+#include "general.h"
+#include "swdptap.h"
+
+/* Last bits driven outside a data phase, newest in bit 7 */
+static uint8_t swd_history;
+/* Bits driven since a request was last taken from swd_history */
+static unsigned swd_fresh;
+/* Consecutive ones driven, 50 or more are a line reset */
+static unsigned swd_ones;
+
+/* Response still to be clocked out by the target, LSB first */
+static uint64_t swd_resp;
+static unsigned swd_resp_len;
+
+/* Write data phase in progress */
+static bool swd_wdata;
+static bool swd_wdata_APnDP;
+static uint8_t swd_wdata_addr;
+static uint64_t swd_wdata_bits;
+static unsigned swd_wdata_len;
+
+int swdptap_init(void)
+{
+	swd_fresh = 0;
+	swd_resp_len = 0;
+	swd_wdata = false;
+	return 0;
+}
+
+static void swdptap_request(void)
+{
+	uint8_t request = swd_history;
+
+	swd_fresh = 0;
+
+	/* Start, stop and park bits, then parity over APnDP, RnW and A[3:2] */
+	if (((request & 0xc1) != 0x81) ||
+	    (__builtin_parity(request & 0x1e) != ((request >> 5) & 1)))
+		return;
+
+	if (!sim_dp_request())
+		return;
+
+	bool APnDP = request & 0x02;
+	bool RnW = request & 0x04;
+	uint8_t addr = (request >> 1) & 0x0c;
+	uint8_t ack = sim_dp_ack(APnDP);
+
+	swd_resp = ack;
+	swd_resp_len = 3;
+	if (ack != SIM_ACK_OK)
+		return;
+
+	if (RnW) {
+		uint32_t data = sim_dp_read(APnDP, addr);
+		swd_resp |= ((uint64_t)data << 3) |
+		            ((uint64_t)__builtin_parity(data) << 35);
+		swd_resp_len = 36;
+	} else {
+		swd_wdata = true;
+		swd_wdata_APnDP = APnDP;
+		swd_wdata_addr = addr;
+		swd_wdata_bits = 0;
+		swd_wdata_len = 0;
+	}
+}
+
+bool swdptap_bit_in(void)
+{
+	if (!swd_resp_len && (swd_fresh >= 8))
+		swdptap_request();
+
+	/* Nobody driving, the line is pulled up */
+	if (!swd_resp_len)
+		return true;
+
+	bool ret = swd_resp & 1;
+	swd_resp >>= 1;
+	swd_resp_len--;
+	return ret;
+}
+
+void swdptap_bit_out(bool val)
+{
+	/* Whatever the target had left to say is lost */
+	swd_resp_len = 0;
+
+	if (swd_wdata) {
+		swd_wdata_bits |= (uint64_t)val << swd_wdata_len++;
+		if (swd_wdata_len < 33)
+			return;
+
+		uint32_t data = swd_wdata_bits;
+		swd_wdata = false;
+		if (__builtin_parity(data) != ((swd_wdata_bits >> 32) & 1))
+			sim_dp_write_error();
+		else
+			sim_dp_write(swd_wdata_APnDP, swd_wdata_addr, data);
+		return;
+	}
+
+	swd_history = (swd_history >> 1) | (val ? 0x80 : 0);
+	swd_fresh++;
+	swd_ones = val ? swd_ones + 1 : 0;
+	if (swd_ones == 50)
+		sim_dp_line_reset();
+}
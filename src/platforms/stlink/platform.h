@@ -33,6 +33,9 @@
 #include <libopencm3/stm32/f1/memorymap.h>
 #include <libopencm3/usb/usbd.h>
 
+#define PLATFORM_HAS_FREQUENCY
+#define PLATFORM_HAS_TRACESWO
+
 #ifdef ENABLE_DEBUG
 # define PLATFORM_HAS_DEBUG
 # define USBUART_DEBUG
@@ -94,6 +97,7 @@
 #define IRQ_PRI_USBUSART_TIM	(3 << 4)
 #define IRQ_PRI_USB_VBUS	(14 << 4)
 #define IRQ_PRI_TIM3		(0 << 4)
+#define IRQ_PRI_SWO_DMA		IRQ_PRI_USB
 
 #define USBUSART USART2
 #define USBUSART_CR1 USART2_CR1
@@ -106,6 +110,29 @@
 #define USBUSART_TIM_CLK_EN() rcc_periph_clock_enable(RCC_TIM4)
 #define USBUSART_TIM_IRQ NVIC_TIM4_IRQ
 #define USBUSART_TIM_ISR tim4_isr
+#define USBUSART_DR USART2_DR
+#define USBUSART_DMA_BUS DMA1
+#define USBUSART_DMA_CLK RCC_DMA1
+#define USBUSART_DMA_RX_CHAN DMA_CHANNEL6
+#define USBUSART_DMA_RX_IRQ NVIC_DMA1_CHANNEL6_IRQ
+#define USBUSART_DMA_RX_ISR dma1_channel6_isr
+#define USBUSART_DMA_TX_CHAN DMA_CHANNEL7
+#define USBUSART_DMA_TX_IRQ NVIC_DMA1_CHANNEL7_IRQ
+#define USBUSART_DMA_TX_ISR dma1_channel7_isr
+
+/* TRACESWO is routed to PA10/USART1_RX, so only NRZ trace is captured */
+#define SWO_UART USART1
+#define SWO_UART_DR USART1_DR
+#define SWO_UART_CLK RCC_USART1
+#define SWO_UART_IRQ NVIC_USART1_IRQ
+#define SWO_UART_ISR usart1_isr
+#define SWO_UART_PORT GPIOA
+#define SWO_UART_RX_PIN GPIO10
+#define SWO_DMA_BUS DMA1
+#define SWO_DMA_CLK RCC_DMA1
+#define SWO_DMA_CHAN DMA_CHANNEL5
+#define SWO_DMA_IRQ NVIC_DMA1_CHANNEL5_IRQ
+#define SWO_DMA_ISR dma1_channel5_isr
 
 #ifdef ENABLE_DEBUG
 extern bool debug_bmp;
@@ -0,0 +1,59 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This file carries CMSIS-DAP v2 packets over the vendor bulk endpoints.
+ * Requests are received in the USB interrupt, but executed from the GDB
+ * server's wait loops, so that they never interrupt a GDB access to the
+ * wire.  The host is NAKed until each request has been answered.
+ */
+#include "general.h"
+#include "cdcacm.h"
+#include "cmsis_dap.h"
+
+static uint8_t dap_request[DAP_PACKET_SIZE];
+static volatile uint32_t dap_request_len;
+
+void cmsis_dap_usb_out_cb(usbd_device *dev, uint8_t ep)
+{
+	(void)ep;
+
+	usbd_ep_nak_set(dev, CDCACM_DAP_ENDPOINT, 1);
+	dap_request_len = usbd_ep_read_packet(dev, CDCACM_DAP_ENDPOINT,
+	                                      dap_request, sizeof(dap_request));
+	if (!dap_request_len)
+		usbd_ep_nak_set(dev, CDCACM_DAP_ENDPOINT, 0);
+}
+
+void cmsis_dap_if_poll(void)
+{
+	uint8_t response[DAP_PACKET_SIZE];
+
+	if (!dap_request_len)
+		return;
+
+	/* The host drives the first SWD port, whichever GDB is using */
+	unsigned port = platform_swd_port();
+	platform_swd_port_select(0);
+	size_t len = dap_process(dap_request, dap_request_len,
+	                         response, sizeof(response));
+	platform_swd_port_select(port);
+	dap_request_len = 0;
+	if (len && (cdcacm_get_config() == 1))
+		while (usbd_ep_write_packet(usbdev, 0x80 | CDCACM_DAP_ENDPOINT,
+		                            response, len) <= 0);
+	usbd_ep_nak_set(usbdev, CDCACM_DAP_ENDPOINT, 0);
+}
@@ -37,31 +37,44 @@ static uint16_t sector_erase_time[12]= {
 	1100, 2600, 2600, 2600,
 	2600, 2600, 2600, 2600
 };
-static uint8_t sector_num = 0xff;
+/* Sectors erased since reset, so writes don't erase them again */
+static uint16_t sector_erased;
 
-/* Find the sector number for a given address*/
-static void get_sector_num(uint32_t addr)
+/* Find the sector number for a given address, -1 if outside flash */
+static int get_sector_num(uint32_t addr)
 {
 	int i = 0;
+	if (addr < sector_addr[0])
+		return -1;
 	while(sector_addr[i+1]) {
 		if (addr < sector_addr[i+1])
-			break;
+			return i;
 		i++;
 	}
-	if (!sector_addr[i])
-		return;
-	sector_num = i;
+	return -1;
+}
+
+static void sector_erase(int sector_num)
+{
+	flash_erase_sector((sector_num & 0x1f)<<3, FLASH_PROGRAM_X32);
+	sector_erased |= 1 << sector_num;
 }
 
 void dfu_check_and_do_sector_erase(uint32_t addr)
 {
-	if(addr == sector_addr[sector_num]) {
-		flash_erase_sector((sector_num & 0x1f)<<3, FLASH_PROGRAM_X32);
-	}
+	int sector_num = get_sector_num(addr);
+	if((sector_num >= 0) && (addr == sector_addr[sector_num]))
+		sector_erase(sector_num);
 }
 
 void dfu_flash_program_buffer(uint32_t baseaddr, void *buf, int len)
 {
+	/* The first write into a sector erases it, whether or not the
+	 * host asked */
+	int sector_num = get_sector_num(baseaddr);
+	if((sector_num >= 0) && !(sector_erased & (1 << sector_num)))
+		sector_erase(sector_num);
+
 	for(int i = 0; i < len; i += 4)
 		flash_program_word(baseaddr + i, *(uint32_t*)(buf+i),
 		                   FLASH_PROGRAM_X32);
@@ -71,14 +84,19 @@ uint32_t dfu_poll_timeout(uint8_t cmd, uint32_t addr, uint16_t blocknum)
 {
 	/* Erase for big pages on STM2/4 needs "long" time
 	   Try not to hit USB timeouts*/
+	int sector_num = get_sector_num(addr);
 	if ((blocknum == 0) && (cmd == CMD_ERASE)) {
-		get_sector_num(addr);
-		if(addr == sector_addr[sector_num])
+		if((sector_num >= 0) && (addr == sector_addr[sector_num]))
 			return sector_erase_time[sector_num];
 	}
 
-	/* Programming 256 word with 100 us(max) per word*/
-	return 26;
+	/* Programming a block with 100 us(max) per word, after erasing
+	 * the sector if this is the first write into it */
+	if ((blocknum > 1) && (sector_num >= 0) &&
+	    !(sector_erased & (1 << sector_num)))
+		return sector_erase_time[sector_num] +
+		       DFU_TRANSFER_SIZE / 4 / 10 + 1;
+	return DFU_TRANSFER_SIZE / 4 / 10 + 1;
 }
 
 void dfu_protect_enable(void)
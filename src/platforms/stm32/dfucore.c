@@ -35,7 +35,7 @@
 
 usbd_device *usbdev;
 /* We need a special large control buffer for this device: */
-uint8_t usbd_control_buffer[1024];
+uint8_t usbd_control_buffer[DFU_TRANSFER_SIZE];
 
 static uint32_t max_address;
 
@@ -43,11 +43,23 @@ static enum dfu_state usbdfu_state = STATE_DFU_IDLE;
 
 static char *get_dev_unique_id(char *serial_no);
 
-static struct {
-	uint8_t buf[sizeof(usbd_control_buffer)];
+/* Flash programmed between USB polls */
+#define PROG_CHUNK	256
+
+/* Received blocks are queued and programmed from dfu_main(), so the
+ * host can send the next block while the last is written out. */
+struct prog_block {
+	uint8_t buf[DFU_TRANSFER_SIZE];
 	uint16_t len;
-	uint32_t addr;
 	uint16_t blocknum;
+	uint32_t addr;	/* Flash address, or the command argument */
+	uint16_t done;
+};
+
+static struct {
+	struct prog_block queue[2];
+	uint8_t head, count;
+	uint32_t addr;	/* Address pointer set by CMD_SETADDR */
 } prog;
 static uint8_t current_error;
 
@@ -73,7 +85,7 @@ const struct usb_dfu_descriptor dfu_function = {
 	.bDescriptorType = DFU_FUNCTIONAL,
 	.bmAttributes = USB_DFU_CAN_DOWNLOAD | USB_DFU_CAN_UPLOAD | USB_DFU_WILL_DETACH,
 	.wDetachTimeout = 255,
-	.wTransferSize = 1024,
+	.wTransferSize = DFU_TRANSFER_SIZE,
 	.bcdDFUVersion = 0x011A,
 };
 
@@ -139,14 +151,64 @@ static uint32_t get_le32(const void *vp)
 	return ((uint32_t)p[3] << 24) + ((uint32_t)p[2] << 16) + (p[1] << 8) + p[0];
 }
 
+/* Do some of the work at the head of the queue */
+static void prog_step(void)
+{
+	struct prog_block *b = &prog.queue[prog.head];
+
+	flash_unlock();
+	if(b->blocknum == 0) {
+		switch(b->buf[0]) {
+		case CMD_ERASE:
+			dfu_check_and_do_sector_erase(b->addr);
+		}
+		b->done = b->len;
+	} else {
+		uint16_t len = MIN(b->len - b->done, PROG_CHUNK);
+		dfu_flash_program_buffer(b->addr + b->done, b->buf + b->done,
+					 len);
+		b->done += len;
+	}
+	flash_lock();
+
+	if(b->done == b->len) {
+		prog.head ^= 1;
+		prog.count--;
+	}
+}
+
+/* Program everything queued, for anything which reads back flash */
+static void prog_flush(void)
+{
+	while(prog.count)
+		prog_step();
+}
+
 static uint8_t usbdfu_getstatus(uint32_t *bwPollTimeout)
 {
 	switch(usbdfu_state) {
 	case STATE_DFU_DNLOAD_SYNC:
-		usbdfu_state = STATE_DFU_DNBUSY;
-		*bwPollTimeout = dfu_poll_timeout(prog.buf[0],
-					get_le32(prog.buf + 1),
-					prog.blocknum);
+		/* Busy until the oldest block is done if the queue is full,
+		 * otherwise ready for the next straight away */
+		if(prog.count == 2) {
+			struct prog_block *b = &prog.queue[prog.head];
+			usbdfu_state = STATE_DFU_DNBUSY;
+			*bwPollTimeout = dfu_poll_timeout(b->buf[0], b->addr,
+							  b->blocknum);
+		} else {
+			usbdfu_state = STATE_DFU_DNLOAD_IDLE;
+		}
+		return DFU_STATUS_OK;
+
+	case STATE_DFU_DNBUSY:
+		/* Still writing out the queue */
+		if(prog.count == 2) {
+			struct prog_block *b = &prog.queue[prog.head];
+			*bwPollTimeout = dfu_poll_timeout(b->buf[0], b->addr,
+							  b->blocknum);
+		} else {
+			usbdfu_state = STATE_DFU_DNLOAD_IDLE;
+		}
 		return DFU_STATUS_OK;
 
 	case STATE_DFU_MANIFEST_SYNC:
@@ -167,30 +229,8 @@ usbdfu_getstatus_complete(usbd_device *dev, struct usb_setup_data *req)
 	(void)dev;
 
 	switch(usbdfu_state) {
-	case STATE_DFU_DNBUSY:
-
-		flash_unlock();
-		if(prog.blocknum == 0) {
-			int32_t addr = get_le32(prog.buf + 1);
-			switch(prog.buf[0]) {
-			case CMD_ERASE:
-				dfu_check_and_do_sector_erase(addr);
-			}
-		} else {
-			uint32_t baseaddr = prog.addr +
-				((prog.blocknum - 2) *
-					dfu_function.wTransferSize);
-			dfu_flash_program_buffer(baseaddr, prog.buf, prog.len);
-		}
-		flash_lock();
-
-		/* We jump straight to dfuDNLOAD-IDLE,
-		 * skipping dfuDNLOAD-SYNC
-		 */
-		usbdfu_state = STATE_DFU_DNLOAD_IDLE;
-		return;
-
 	case STATE_DFU_MANIFEST:
+		prog_flush();
 		dfu_detach();
 		return; /* Will never return */
 	default:
@@ -213,19 +253,38 @@ static int usbdfu_control_request(usbd_device *dev,
 			usbdfu_state = STATE_DFU_MANIFEST_SYNC;
 			return 1;
 		} else {
-			/* Copy download data for use on GET_STATUS */
-			prog.blocknum = req->wValue;
-			prog.len = *len;
-			memcpy(prog.buf, *buf, *len);
-			if ((req->wValue == 0) && (prog.buf[0] == CMD_SETADDR)) {
-				uint32_t addr = get_le32(prog.buf + 1);
-				if ((addr < app_address) || (addr >= max_address)) {
-					current_error = DFU_STATUS_ERR_TARGET;
-					usbdfu_state = STATE_DFU_ERROR;
+			/* Queue download data, there is always room as
+			 * GET_STATUS doesn't go idle with the queue full */
+			struct prog_block *b =
+				&prog.queue[(prog.head + prog.count) & 1];
+			if ((*len > sizeof(b->buf)) || (prog.count == 2)) {
+				current_error = DFU_STATUS_ERR_STALLEDPKT;
+				usbdfu_state = STATE_DFU_ERROR;
+				return 1;
+			}
+			if (req->wValue == 0) {
+				uint32_t addr = get_le32(*buf + 1);
+				if ((*buf)[0] == CMD_SETADDR) {
+					if ((addr < app_address) ||
+					    (addr >= max_address)) {
+						current_error = DFU_STATUS_ERR_TARGET;
+						usbdfu_state = STATE_DFU_ERROR;
+					} else {
+						prog.addr = addr;
+						usbdfu_state = STATE_DFU_DNLOAD_SYNC;
+					}
 					return 1;
-				} else
-					prog.addr = addr;
+				}
+				b->addr = addr;
+			} else {
+				b->addr = prog.addr + ((req->wValue - 2) *
+					dfu_function.wTransferSize);
 			}
+			b->blocknum = req->wValue;
+			b->len = *len;
+			b->done = 0;
+			memcpy(b->buf, *buf, *len);
+			prog.count++;
 			usbdfu_state = STATE_DFU_DNLOAD_SYNC;
 			return 1;
 		}
@@ -242,11 +301,12 @@ static int usbdfu_control_request(usbd_device *dev,
 		if ((usbdfu_state == STATE_DFU_IDLE) ||
 			(usbdfu_state == STATE_DFU_DNLOAD_IDLE) ||
 			(usbdfu_state == STATE_DFU_UPLOAD_IDLE)) {
-			prog.blocknum = req->wValue;
+			uint16_t blocknum = req->wValue;
+			prog_flush();
 			usbdfu_state = STATE_DFU_UPLOAD_IDLE;
-			if(prog.blocknum > 1) {
+			if(blocknum > 1) {
 				uint32_t baseaddr = prog.addr +
-					((prog.blocknum - 2) *
+					((blocknum - 2) *
 					 dfu_function.wTransferSize);
 				memcpy(*buf, (void*)baseaddr, *len);
 			}
@@ -296,8 +356,11 @@ void dfu_init(const usbd_driver *driver, dfu_mode_t mode)
 
 void dfu_main(void)
 {
-	while (1)
+	while (1) {
 		usbd_poll(usbdev);
+		if (prog.count)
+			prog_step();
+	}
 }
 
 #if defined(DFU_IFACE_STRING_OFFSET)
@@ -25,90 +25,211 @@
 #include "general.h"
 #include "cdcacm.h"
 #include "gdb_if.h"
+#if defined(PLATFORM_HAS_CMSIS_DAP)
+#	include "cmsis_dap.h"
+#endif
+#if defined(PLATFORM_HAS_USB_OTG)
+#	include "usb_otg.h"
+#endif
+
+/* Receive ring, filled from the USB interrupt */
+#define GDB_IF_OUT_SIZE	(16 * CDCACM_PACKET_SIZE)
 
-static uint32_t count_out;
-static uint32_t count_in;
-static uint32_t out_ptr;
-static uint8_t buffer_out[CDCACM_PACKET_SIZE];
-static uint8_t buffer_in[CDCACM_PACKET_SIZE];
-#ifdef STM32F4
-static volatile uint32_t count_new;
-static uint8_t double_buffer_out[CDCACM_PACKET_SIZE];
+#if defined(GDB_SESSIONS)
+#	define GDB_IF_COUNT	GDB_SESSIONS
+#else
+#	define GDB_IF_COUNT	1
 #endif
 
-void gdb_if_putchar(unsigned char c, int flush)
+/* The state of each GDB interface, the calls below use cur's */
+static struct gdb_if_port {
+	volatile uint32_t head_out, tail_out;
+	volatile bool out_nak;
+	bool connected;
+	uint32_t count_in;
+	uint32_t last_in;
+	uint8_t buffer_out[GDB_IF_OUT_SIZE];
+#if defined(PLATFORM_HAS_USB_OTG)
+	/* Replies go out as multi-packet transfers, as large as the FIFO */
+	uint8_t buffer_in[CDCACM_GDB_IN_SIZE];
+#else
+	uint8_t buffer_in[CDCACM_PACKET_SIZE];
+#endif
+} gdb_ports[GDB_IF_COUNT];
+
+static const uint8_t gdb_if_ep[GDB_IF_COUNT] = {
+	CDCACM_GDB_ENDPOINT,
+#if GDB_IF_COUNT > 1
+	CDCACM_GDB2_ENDPOINT,
+#endif
+};
+
+static struct gdb_if_port *cur = &gdb_ports[0];
+#define CUR_N		(cur - gdb_ports)
+#define CUR_EP		(gdb_if_ep[CUR_N])
+
+/* Endpoints with a TX FIFO of their own take multi-packet transfers, the
+ * others are sent a packet at a time */
+#if defined(PLATFORM_HAS_USB_OTG)
+#	define GDB_IF_OTG()	(usb_otg_fifo_size(CUR_EP) >= CDCACM_PACKET_SIZE)
+#	define GDB_IF_IN_SIZE	(GDB_IF_OTG() ? MIN(CDCACM_GDB_IN_SIZE, \
+				 usb_otg_fifo_size(CUR_EP)) : CDCACM_PACKET_SIZE)
+#else
+#	define GDB_IF_OTG()	false
+#	define GDB_IF_IN_SIZE	CDCACM_PACKET_SIZE
+#endif
+
+/* Send one transfer on the GDB endpoint, false if nobody is listening */
+static bool gdb_if_send(const uint8_t *buf, uint32_t len)
+{
+	/* Refuse to send if USB isn't configured, and
+	 * don't bother if nobody's listening */
+	if((cdcacm_get_config() != 1) || !cdcacm_get_port_dtr(CUR_N)) {
+		cur->count_in = 0;
+		return false;
+	}
+#if defined(PLATFORM_HAS_USB_OTG)
+	if (GDB_IF_OTG()) {
+		while (usb_otg_ep_busy(CUR_EP));
+		usb_otg_ep_write(CUR_EP, buf, len);
+	} else
+#endif
+	while(usbd_ep_write_packet(usbdev, CUR_EP, buf, len) <= 0);
+	cur->last_in = len;
+	return true;
+}
+
+void gdb_if_write(const void *buf, size_t len, int flush)
 {
-	buffer_in[count_in++] = c;
-	if(flush || (count_in == CDCACM_PACKET_SIZE)) {
-		/* Refuse to send if USB isn't configured, and
-		 * don't bother if nobody's listening */
-		if((cdcacm_get_config() != 1) || !cdcacm_get_dtr()) {
-			count_in = 0;
-			return;
+	const uint8_t *p = buf;
+	const uint32_t size = GDB_IF_IN_SIZE;
+
+	while (len) {
+		if ((cur->count_in == 0) && (len >= size)) {
+			/* Whole transfers go straight from the caller's buffer */
+			if (!gdb_if_send(p, size))
+				return;
+			p += size;
+			len -= size;
+			continue;
+		}
+		uint32_t n = MIN(len, size - cur->count_in);
+		memcpy(cur->buffer_in + cur->count_in, p, n);
+		cur->count_in += n;
+		p += n;
+		len -= n;
+		if (cur->count_in == size) {
+			cur->count_in = 0;
+			if (!gdb_if_send(cur->buffer_in, size))
+				return;
 		}
-		while(usbd_ep_write_packet(usbdev, CDCACM_GDB_ENDPOINT,
-			buffer_in, count_in) <= 0);
+	}
 
-		if (flush && (count_in == CDCACM_PACKET_SIZE)) {
-			/* We need to send an empty packet for some hosts
-			 * to accept this as a complete transfer. */
+	if (!flush)
+		return;
+
+	if (cur->count_in) {
+		uint32_t n = cur->count_in;
+		cur->count_in = 0;
+		gdb_if_send(cur->buffer_in, n);
+	} else if (cur->last_in && !(cur->last_in % CDCACM_PACKET_SIZE)) {
+		/* We need to send an empty packet for some hosts
+		 * to accept this as a complete transfer. */
+		if (GDB_IF_OTG())
+			gdb_if_send(NULL, 0);
+		else
 			/* libopencm3 needs a change for us to confirm when
 			 * that transfer is complete, so we just send a packet
 			 * containing a null byte for now.
 			 */
-			while (usbd_ep_write_packet(usbdev, CDCACM_GDB_ENDPOINT,
-				"\0", 1) <= 0);
-		}
-
-		count_in = 0;
+			gdb_if_send((const uint8_t *)"\0", 1);
 	}
+	cur->last_in = 0;
+}
+
+void gdb_if_putchar(unsigned char c, int flush)
+{
+	gdb_if_write(&c, 1, flush);
 }
 
-#ifdef STM32F4
 void gdb_usb_out_cb(usbd_device *dev, uint8_t ep)
 {
-	(void)ep;
-	usbd_ep_nak_set(dev, CDCACM_GDB_ENDPOINT, 1);
-	count_new = usbd_ep_read_packet(dev, CDCACM_GDB_ENDPOINT,
-	                                double_buffer_out, CDCACM_PACKET_SIZE);
-	if(!count_new) {
-		usbd_ep_nak_set(dev, CDCACM_GDB_ENDPOINT, 0);
-	}
+	struct gdb_if_port *p = &gdb_ports[0];
+	uint8_t buf[CDCACM_PACKET_SIZE];
+
+	for (unsigned i = 1; i < GDB_IF_COUNT; i++)
+		if (gdb_if_ep[i] == (ep & 0x7f))
+			p = &gdb_ports[i];
+	ep = gdb_if_ep[p - gdb_ports];
+
+	usbd_ep_nak_set(dev, ep, 1);
+	uint32_t count = usbd_ep_read_packet(dev, ep, buf, CDCACM_PACKET_SIZE);
+
+	for (uint32_t i = 0; i < count; i++)
+		p->buffer_out[p->head_out++ % GDB_IF_OUT_SIZE] = buf[i];
+
+	/* Keep NAKing the host until there is room for another packet */
+	if (GDB_IF_OUT_SIZE - (p->head_out - p->tail_out) >= CDCACM_PACKET_SIZE)
+		usbd_ep_nak_set(dev, ep, 0);
+	else
+		p->out_nak = true;
 }
-#endif
 
-static void gdb_if_update_buf(void)
+/* Accept packets from the host again once the ring has drained */
+static void gdb_if_out_resume(void)
 {
-	while (cdcacm_get_config() != 1);
-#ifdef STM32F4
 	asm volatile ("cpsid i; isb");
-	if (count_new) {
-		memcpy(buffer_out, double_buffer_out, count_new);
-		count_out = count_new;
-		count_new = 0;
-		out_ptr = 0;
-		usbd_ep_nak_set(usbdev, CDCACM_GDB_ENDPOINT, 0);
+	if (cur->out_nak && (GDB_IF_OUT_SIZE -
+	                     (cur->head_out - cur->tail_out) >= CDCACM_PACKET_SIZE)) {
+		cur->out_nak = false;
+		usbd_ep_nak_set(usbdev, CUR_EP, 0);
 	}
 	asm volatile ("cpsie i; isb");
-#else
-	count_out = usbd_ep_read_packet(usbdev, CDCACM_GDB_ENDPOINT,
-	                                buffer_out, CDCACM_PACKET_SIZE);
-	out_ptr = 0;
+}
+
+size_t gdb_if_peek(const uint8_t **data)
+{
+	while (cur->tail_out == cur->head_out) {
+		/* Detach if port closed */
+		if (!cdcacm_get_port_dtr(CUR_N))
+			return 0;
+
+		while (cdcacm_get_config() != 1);
+#if defined(PLATFORM_HAS_CMSIS_DAP)
+		cmsis_dap_if_poll();
 #endif
+	}
+
+	/* Up to the end of the ring, the rest is returned next time */
+	uint32_t tail = cur->tail_out % GDB_IF_OUT_SIZE;
+	*data = &cur->buffer_out[tail];
+	return MIN(cur->head_out - cur->tail_out, GDB_IF_OUT_SIZE - tail);
+}
+
+void gdb_if_consume(size_t len)
+{
+	cur->tail_out += len;
+	if (cur->out_nak)
+		gdb_if_out_resume();
 }
 
 unsigned char gdb_if_getchar(void)
 {
+	const uint8_t *data;
+	unsigned char c;
 
-	while (!(out_ptr < count_out)) {
-		/* Detach if port closed */
-		if (!cdcacm_get_dtr())
-			return 0x04;
+	if (!gdb_if_peek(&data))
+		return 0x04;
+	c = *data;
+	gdb_if_consume(1);
 
-		gdb_if_update_buf();
-	}
+	return c;
+}
 
-	return buffer_out[out_ptr++];
+/* Input received by the interrupt handler, or the port was closed */
+bool gdb_if_pending(void)
+{
+	return (cur->head_out != cur->tail_out) || !cdcacm_get_port_dtr(CUR_N);
 }
 
 unsigned char gdb_if_getchar_to(int timeout)
@@ -116,17 +237,74 @@ unsigned char gdb_if_getchar_to(int timeout)
 	platform_timeout t;
 	platform_timeout_set(&t, timeout);
 
-	if (!(out_ptr < count_out)) do {
+	if (cur->head_out == cur->tail_out) do {
 		/* Detach if port closed */
-		if (!cdcacm_get_dtr())
+		if (!cdcacm_get_port_dtr(CUR_N))
 			return 0x04;
 
-		gdb_if_update_buf();
-	} while (!platform_timeout_is_expired(&t) && !(out_ptr < count_out));
+		while (cdcacm_get_config() != 1);
+#if defined(PLATFORM_HAS_CMSIS_DAP)
+		cmsis_dap_if_poll();
+#endif
+	} while (!platform_timeout_is_expired(&t) &&
+	         (cur->head_out == cur->tail_out));
 
-	if(out_ptr < count_out)
+	if (cur->head_out != cur->tail_out)
 		return gdb_if_getchar();
 
 	return -1;
 }
 
+#if defined(GDB_SESSIONS)
+void gdb_if_session(int n)
+{
+	cur = &gdb_ports[n];
+}
+
+bool gdb_if_connected(void)
+{
+	return cdcacm_get_port_dtr(CUR_N);
+}
+
+/* A session has input, or its port was closed since it was last seen
+ * open, which is reported once */
+static bool gdb_if_ready(int n)
+{
+	struct gdb_if_port *p = &gdb_ports[n];
+	bool dtr = cdcacm_get_port_dtr(n);
+
+	if (p->head_out != p->tail_out)
+		return true;
+	if (p->connected && !dtr) {
+		p->connected = false;
+		return true;
+	}
+	p->connected = dtr;
+	return false;
+}
+
+int gdb_if_wait_any(int timeout)
+{
+	/* Start after the session served last, so none is starved */
+	static int next;
+	platform_timeout t;
+
+	platform_timeout_set(&t, timeout < 0 ? 0 : timeout);
+	do {
+		for (int i = 0; i < GDB_SESSIONS; i++) {
+			int n = (next + i) % GDB_SESSIONS;
+			if (gdb_if_ready(n)) {
+				next = n + 1;
+				return n;
+			}
+		}
+
+		while (cdcacm_get_config() != 1);
+#if defined(PLATFORM_HAS_CMSIS_DAP)
+		cmsis_dap_if_poll();
+#endif
+	} while ((timeout < 0) || !platform_timeout_is_expired(&t));
+
+	return -1;
+}
+#endif
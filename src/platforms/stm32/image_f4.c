@@ -0,0 +1,71 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Image store in the last two 128k sectors of 1M STM32F4 parts,
+ * kept clear of the firmware by f4discovery.ld.  The sector below holds
+ * the settings, see settings_f4.c. */
+
+#include "general.h"
+#include "image.h"
+
+#include <libopencm3/stm32/f4/flash.h>
+
+#define IMAGE_BASE	0x080C0000
+#define IMAGE_SECTOR	10
+#define IMAGE_SECTORS	2
+#define IMAGE_SIZE	(IMAGE_SECTORS * 0x20000)
+
+const uint8_t *image_if_base(void)
+{
+	return (const uint8_t *)IMAGE_BASE;
+}
+
+size_t image_if_size(void)
+{
+	return IMAGE_SIZE;
+}
+
+bool image_if_erase(void)
+{
+	flash_unlock();
+	for (int i = 0; i < IMAGE_SECTORS; i++)
+		flash_erase_sector(((IMAGE_SECTOR + i) & 0x1f) << 3,
+		                   FLASH_PROGRAM_X32);
+	flash_lock();
+
+	const uint32_t *p = (const uint32_t *)IMAGE_BASE;
+	for (size_t i = 0; i < IMAGE_SIZE / 4; i++)
+		if (p[i] != 0xffffffff)
+			return false;
+	return true;
+}
+
+bool image_if_write(size_t offset, const void *data, size_t len)
+{
+	const uint8_t *src = data;
+	uint32_t word;
+
+	flash_unlock();
+	for (size_t i = 0; i < len; i += 4) {
+		/* GDB packet data needn't be aligned */
+		memcpy(&word, src + i, 4);
+		flash_program_word(IMAGE_BASE + offset + i, word,
+		                   FLASH_PROGRAM_X32);
+	}
+	flash_lock();
+	return !memcmp((const void *)(IMAGE_BASE + offset), data, len);
+}
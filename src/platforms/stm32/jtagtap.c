@@ -58,11 +58,77 @@ inline uint8_t jtagtap_next(uint8_t dTMS, uint8_t dTDI)
 	gpio_set_val(TMS_PORT, TMS_PIN, dTMS);
 	gpio_set_val(TDI_PORT, TDI_PIN, dTDI);
 	gpio_set(TCK_PORT, TCK_PIN);
+	platform_clk_delay();
 	ret = gpio_get(TDO_PORT, TDO_PIN);
 	gpio_clear(TCK_PORT, TCK_PIN);
+	platform_clk_delay();
 
 	//DEBUG("jtagtap_next(TMS = %d, TDI = %d) = %d\n", dTMS, dTDI, ret);
 
 	return ret != 0;
 }
 
+
+/* Sequences for the STM32 based probes.  These replace the weak versions
+ * in jtagtap_generic.c, which call jtagtap_next() for every bit.  TMS is
+ * only changed for the final bit and TDI is driven with a single BSRR
+ * write selected by the data bit, so the bit loop has few branches.
+ */
+static const uint32_t tdi_bsrr[2] = {TDI_PIN << 16, TDI_PIN};
+static const uint32_t tms_bsrr[2] = {TMS_PIN << 16, TMS_PIN};
+
+static inline uint32_t jtagtap_clock(uint32_t tdi)
+{
+	uint32_t tdo;
+
+	GPIO_BSRR(TDI_PORT) = tdi_bsrr[tdi];
+	GPIO_BSRR(TCK_PORT) = TCK_PIN;
+	platform_clk_delay();
+	tdo = (GPIO_IDR(TDO_PORT) & TDO_PIN) ? 1 : 0;
+	GPIO_BSRR(TCK_PORT) = TCK_PIN << 16;
+	platform_clk_delay();
+
+	return tdo;
+}
+
+void jtagtap_tms_seq(uint32_t MS, int ticks)
+{
+	while (ticks--) {
+		GPIO_BSRR(TMS_PORT) = tms_bsrr[MS & 1];
+		jtagtap_clock(1);
+		MS >>= 1;
+	}
+}
+
+static inline void jtagtap_seq(uint8_t *DO, const uint8_t final_tms,
+                               const uint8_t *DI, int ticks)
+{
+	uint8_t in = 0, out = 0;
+
+	GPIO_BSRR(TMS_PORT) = tms_bsrr[0];
+	for (int i = 0; i < ticks; i++) {
+		unsigned bit = i & 7;
+		/* Read DI before DO is written, they may be the same */
+		if (bit == 0)
+			in = DI[i / 8];
+		if (i == ticks - 1)
+			GPIO_BSRR(TMS_PORT) = tms_bsrr[final_tms ? 1 : 0];
+		out |= jtagtap_clock((in >> bit) & 1) << bit;
+		if (DO && ((bit == 7) || (i == ticks - 1))) {
+			uint8_t mask = 0xff >> (7 - bit);
+			DO[i / 8] = (DO[i / 8] & ~mask) | out;
+			out = 0;
+		}
+	}
+}
+
+void jtagtap_tdi_tdo_seq(uint8_t *DO, const uint8_t final_tms,
+                         const uint8_t *DI, int ticks)
+{
+	jtagtap_seq(DO, final_tms, DI, ticks);
+}
+
+void jtagtap_tdi_seq(const uint8_t final_tms, const uint8_t *DI, int ticks)
+{
+	jtagtap_seq(NULL, final_tms, DI, ticks);
+}
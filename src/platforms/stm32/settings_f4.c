@@ -0,0 +1,67 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Settings store in the 128k sector below the image store of 1M STM32F4
+ * parts, kept clear of the firmware by f4discovery.ld */
+
+#include "general.h"
+#include "settings.h"
+
+#include <libopencm3/stm32/f4/flash.h>
+
+#define SETTINGS_BASE	0x080A0000
+#define SETTINGS_SECTOR	9
+#define SETTINGS_SIZE	0x20000
+
+const uint8_t *settings_if_base(void)
+{
+	return (const uint8_t *)SETTINGS_BASE;
+}
+
+size_t settings_if_size(void)
+{
+	return SETTINGS_SIZE;
+}
+
+bool settings_if_erase(void)
+{
+	flash_unlock();
+	flash_erase_sector((SETTINGS_SECTOR & 0x1f) << 3, FLASH_PROGRAM_X32);
+	flash_lock();
+
+	/* Only the start of the sector is ever used */
+	const uint32_t *p = (const uint32_t *)SETTINGS_BASE;
+	for (size_t i = 0; i < 1024 / 4; i++)
+		if (p[i] != 0xffffffff)
+			return false;
+	return true;
+}
+
+bool settings_if_write(size_t offset, const void *data, size_t len)
+{
+	const uint8_t *src = data;
+	uint32_t word;
+
+	flash_unlock();
+	for (size_t i = 0; i < len; i += 4) {
+		memcpy(&word, src + i, 4);
+		flash_program_word(SETTINGS_BASE + offset + i, word,
+		                   FLASH_PROGRAM_X32);
+	}
+	flash_lock();
+	return !memcmp((const void *)(SETTINGS_BASE + offset), data, len);
+}
@@ -0,0 +1,50 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* SWD port selection for probes with more than one, see swd_port.h */
+#include "general.h"
+
+static const struct swd_port swd_ports[PLATFORM_SWD_PORTS] = {
+	{JTAG_PORT, TMS_PIN, JTAG_PORT, TCK_PIN},
+#if PLATFORM_SWD_PORTS > 1
+	{SWDIO2_PORT, SWDIO2_PIN, SWCLK2_PORT, SWCLK2_PIN},
+#endif
+};
+
+const struct swd_port *swd_port = swd_ports;
+
+void platform_swd_port_select(unsigned n)
+{
+	if (n < PLATFORM_SWD_PORTS)
+		swd_port = &swd_ports[n];
+}
+
+unsigned platform_swd_port(void)
+{
+	return swd_port - swd_ports;
+}
+
+void swd_port_init(void)
+{
+	for (unsigned i = 1; i < PLATFORM_SWD_PORTS; i++) {
+		const struct swd_port *p = &swd_ports[i];
+		gpio_mode_setup(p->swclk_port, GPIO_MODE_OUTPUT,
+		                GPIO_PUPD_NONE, p->swclk_pin);
+		gpio_mode_setup(p->swdio_port, GPIO_MODE_OUTPUT,
+		                GPIO_PUPD_NONE, p->swdio_pin);
+	}
+}
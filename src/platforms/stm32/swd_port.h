@@ -0,0 +1,51 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __SWD_PORT_H
+#define __SWD_PORT_H
+
+/* Independent SWD ports, for platforms defining PLATFORM_SWD_PORTS with
+ * the pins of the second one in SWDIO2_PORT/PIN and SWCLK2_PORT/PIN.
+ * The first port is on the JTAG pins.  swdptap.c drives the port
+ * selected by platform_swd_port_select().
+ */
+
+struct swd_port {
+	uint32_t swdio_port;
+	uint16_t swdio_pin;
+	uint32_t swclk_port;
+	uint16_t swclk_pin;
+};
+
+extern const struct swd_port *swd_port;
+
+/* Pins of the ports after the first, whose GPIO clocks must be on */
+void swd_port_init(void);
+
+#define SWDIO_PORT	(swd_port->swdio_port)
+#define SWCLK_PORT	(swd_port->swclk_port)
+#define SWDIO_PIN	(swd_port->swdio_pin)
+#define SWCLK_PIN	(swd_port->swclk_pin)
+
+#define SWDIO_MODE_FLOAT() \
+	gpio_mode_setup(SWDIO_PORT, GPIO_MODE_INPUT, \
+	                GPIO_PUPD_NONE, SWDIO_PIN);
+
+#define SWDIO_MODE_DRIVE() \
+	gpio_mode_setup(SWDIO_PORT, GPIO_MODE_OUTPUT, \
+	                GPIO_PUPD_NONE, SWDIO_PIN);
+
+#endif
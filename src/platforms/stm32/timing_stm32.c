@@ -21,15 +21,27 @@
 
 #include <libopencm3/cm3/systick.h>
 #include <libopencm3/cm3/scb.h>
+#include <libopencm3/stm32/rcc.h>
 
 uint8_t running_status;
 static volatile uint32_t time_ms;
 
+#define TICK_MS	100
+
+/* Delay loop iterations per half clock in the SWD/JTAG bit loops */
+uint32_t swd_delay_cnt;
+
+/* Approximate CPU cycles for one SWCLK/TCK period with no delay, and
+ * for each additional iteration of the delay loop on both clock edges.
+ */
+#define BITBANG_BASE_CYCLES	20
+#define BITBANG_DELAY_CYCLES	8
+
 void platform_timing_init(void)
 {
 	/* Setup heartbeat timer */
 	systick_set_clocksource(STK_CSR_CLKSOURCE_AHB_DIV8);
-	systick_set_reload(900000);	/* Interrupt us at 10 Hz */
+	systick_set_reload(rcc_ahb_frequency / 8 / (1000 / TICK_MS));	/* Interrupt us at 10 Hz */
 	SCB_SHPR(11) &= ~((15 << 4) & 0xff);
 	SCB_SHPR(11) |= ((14 << 4) & 0xff);
 	systick_interrupt_enable();
@@ -48,7 +60,7 @@ void sys_tick_handler(void)
 	if(running_status)
 		gpio_toggle(LED_PORT, LED_IDLE_RUN);
 
-	time_ms += 100;
+	time_ms += TICK_MS;
 
 	SET_ERROR_STATE(morse_update());
 }
@@ -58,3 +70,44 @@ uint32_t platform_time_ms(void)
 	return time_ms;
 }
 
+/* The tick count plus how far SysTick has counted down since */
+uint32_t platform_time_us(void)
+{
+	uint32_t ms, cvr, reload = STK_RVR;
+	bool pending;
+
+	do {
+		ms = time_ms;
+		cvr = STK_CVR;
+		pending = SCB_ICSR & SCB_ICSR_PENDSTSET;
+	} while (ms != time_ms);
+	/* Wrapped with the interrupt not taken yet, e.g. called from a
+	 * higher priority handler */
+	if (pending && (cvr > reload / 2))
+		ms += TICK_MS;
+
+	return (ms * 1000) + (reload - cvr) / (rcc_ahb_frequency / 8000000);
+}
+
+
+void platform_max_frequency_set(uint32_t freq)
+{
+	uint32_t cycles;
+
+	if (freq == 0)
+		freq = 1;
+	cycles = rcc_ahb_frequency / freq;
+	if (cycles <= BITBANG_BASE_CYCLES) {
+		swd_delay_cnt = 0;
+		return;
+	}
+	/* Round up so that we never run faster than requested */
+	swd_delay_cnt = (cycles - BITBANG_BASE_CYCLES + BITBANG_DELAY_CYCLES - 1) /
+		BITBANG_DELAY_CYCLES;
+}
+
+uint32_t platform_max_frequency_get(void)
+{
+	return rcc_ahb_frequency /
+		(BITBANG_BASE_CYCLES + BITBANG_DELAY_CYCLES * swd_delay_cnt);
+}
@@ -20,8 +20,16 @@
 #define __TIMING_STM32_H
 
 extern uint8_t running_status;
+extern uint32_t swd_delay_cnt;
 
 void platform_timing_init(void);
 
+/* Stretch a half period of SWCLK/TCK as set by platform_max_frequency_set() */
+static inline void platform_clk_delay(void)
+{
+	for (uint32_t cnt = swd_delay_cnt; cnt; cnt--)
+		__asm__ volatile("nop");
+}
+
 #endif
 
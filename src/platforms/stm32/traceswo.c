@@ -30,15 +30,32 @@
  * The idea is to use TIM3 input capture modes to capture pulse timings.
  * These can be capture directly to RAM by DMA.
  * The core can then process the buffer to extract the frame.
+ *
+ * Probes that also have TRACESWO on a USART RX pin (SWO_UART) can capture
+ * NRZ encoded trace at a given baud rate instead.  The USART fills a
+ * circular DMA buffer which is drained to USB, so no interrupt is taken
+ * per bit or byte.
  */
 #include "general.h"
 #include "cdcacm.h"
+#include "traceswo.h"
 
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/stm32/timer.h>
 #include <libopencm3/stm32/f1/rcc.h>
+#ifdef SWO_UART
+#	include <libopencm3/stm32/usart.h>
+#	include <libopencm3/stm32/dma.h>
+#endif
+
+#ifdef SWO_UART
+static bool swo_uart_active;
+static void traceswo_uart_init(uint32_t baud);
+static void traceswo_uart_push(void);
+#endif
 
-void traceswo_init(void)
+#ifdef TRACE_TIM
+static void traceswo_manchester_init(void)
 {
 	TRACE_TIM_CLK_EN();
 
@@ -75,33 +92,114 @@ void traceswo_init(void)
 
 	timer_enable_counter(TRACE_TIM);
 }
+#endif
+
+bool traceswo_init(uint32_t baud)
+{
+#ifdef SWO_UART
+	if (baud) {
+		traceswo_uart_init(baud);
+		return true;
+	}
+#endif
+#ifdef TRACE_TIM
+	if (!baud) {
+		traceswo_manchester_init();
+		return true;
+	}
+#endif
+	return false;
+}
+
+#ifdef TRACE_TIM
+/* Decoded trace waiting for the USB endpoint.  trace_buf_push() runs in
+ * the capture interrupt, trace_buf_drain() on IN completion with the
+ * capture interrupt masked.  When the buffer is full data is dropped,
+ * and an ITM overflow packet marks the gap once there is room again. */
+#define TRACE_BUF_SIZE 2048
+#define ITM_OVERFLOW 0x70
+
+static uint8_t trace_buf[TRACE_BUF_SIZE];
+static volatile uint32_t trace_buf_in;
+static volatile uint32_t trace_buf_out;
+static volatile bool trace_ep_busy;
+static bool trace_overflow;
+static uint32_t trace_dropped;
+static uint32_t trace_overflows;
+
+static void trace_buf_send(usbd_device *dev, uint8_t ep)
+{
+	uint32_t in = trace_buf_in, out = trace_buf_out;
+	uint32_t len = ((in >= out) ? in : TRACE_BUF_SIZE) - out;
 
-static uint8_t trace_usb_buf[64];
-static uint8_t trace_usb_buf_size;
+	if (len > 64)
+		len = 64;
+	trace_ep_busy = len &&
+		(usbd_ep_write_packet(dev, ep, &trace_buf[out], len) == len);
+	if (trace_ep_busy)
+		trace_buf_out = (out + len) % TRACE_BUF_SIZE;
+}
 
 void trace_buf_push(uint8_t *buf, int len)
 {
-	if (usbd_ep_write_packet(usbdev, 0x85, buf, len) != len) {
-		if (trace_usb_buf_size + len > 64) {
-			/* Stall if upstream to too slow. */
-			usbd_ep_stall_set(usbdev, 0x85, 1);
-			trace_usb_buf_size = 0;
-			return;
+	uint32_t in = trace_buf_in;
+
+	len = traceswo_filter(buf, len);
+
+	for (int i = 0; i < len; i++) {
+		uint32_t next = (in + 1) % TRACE_BUF_SIZE;
+		if (trace_overflow && (next != trace_buf_out)) {
+			trace_buf[in] = ITM_OVERFLOW;
+			in = next;
+			next = (in + 1) % TRACE_BUF_SIZE;
+			trace_overflow = false;
+		}
+		if (next == trace_buf_out) {
+			if (!trace_overflow)
+				trace_overflows++;
+			trace_overflow = true;
+			trace_dropped += len - i;
+			break;
 		}
-		memcpy(trace_usb_buf + trace_usb_buf_size, buf, len);
-		trace_usb_buf_size += len;
+		trace_buf[in] = buf[i];
+		in = next;
 	}
+	trace_buf_in = in;
+
+	if (!trace_ep_busy)
+		trace_buf_send(usbdev, 0x85);
 }
+#endif
 
 void trace_buf_drain(usbd_device *dev, uint8_t ep)
 {
-	if (!trace_usb_buf_size)
+#ifdef SWO_UART
+	if (swo_uart_active) {
+		traceswo_uart_push();
 		return;
+	}
+#endif
+#ifdef TRACE_TIM
+	nvic_disable_irq(TRACE_IRQ);
+	trace_buf_send(dev, ep);
+	nvic_enable_irq(TRACE_IRQ);
+#else
+	(void)dev;
+	(void)ep;
+#endif
+}
 
-	usbd_ep_write_packet(dev, ep, trace_usb_buf, trace_usb_buf_size);
-	trace_usb_buf_size = 0;
+void traceswo_stats(uint32_t *dropped, uint32_t *overflows)
+{
+#ifdef TRACE_TIM
+	*dropped = trace_dropped;
+	*overflows = trace_overflows;
+#else
+	*dropped = *overflows = 0;
+#endif
 }
 
+#ifdef TRACE_TIM
 #define ALLOWED_DUTY_ERROR 5
 
 void TRACE_ISR(void)
@@ -183,3 +281,108 @@ flush_and_reset:
 	decbuf_pos = 0;
 	memset(decbuf, 0, sizeof(decbuf));
 }
+#endif
+
+#ifdef SWO_UART
+#define SWO_BUF_SIZE 1024
+
+static uint8_t swo_buf[SWO_BUF_SIZE];
+static uint32_t swo_buf_out;
+
+static void traceswo_uart_init(uint32_t baud)
+{
+#ifdef TRACE_TIM
+	/* Stop the Manchester decoder */
+	timer_disable_counter(TRACE_TIM);
+	nvic_disable_irq(TRACE_IRQ);
+#endif
+	rcc_periph_clock_enable(SWO_UART_CLK);
+	rcc_periph_clock_enable(SWO_DMA_CLK);
+
+	gpio_set_mode(SWO_UART_PORT, GPIO_MODE_INPUT,
+	              GPIO_CNF_INPUT_PULL_UPDOWN, SWO_UART_RX_PIN);
+	gpio_set(SWO_UART_PORT, SWO_UART_RX_PIN);
+
+	usart_disable(SWO_UART);
+	usart_set_baudrate(SWO_UART, baud);
+	usart_set_databits(SWO_UART, 8);
+	usart_set_stopbits(SWO_UART, USART_STOPBITS_1);
+	usart_set_mode(SWO_UART, USART_MODE_RX);
+	usart_set_parity(SWO_UART, USART_PARITY_NONE);
+	usart_set_flow_control(SWO_UART, USART_FLOWCONTROL_NONE);
+
+	/* Receive into the circular buffer */
+	dma_channel_reset(SWO_DMA_BUS, SWO_DMA_CHAN);
+	dma_set_peripheral_address(SWO_DMA_BUS, SWO_DMA_CHAN,
+	                           (uint32_t)&SWO_UART_DR);
+	dma_set_memory_address(SWO_DMA_BUS, SWO_DMA_CHAN, (uint32_t)swo_buf);
+	dma_set_number_of_data(SWO_DMA_BUS, SWO_DMA_CHAN, SWO_BUF_SIZE);
+	dma_set_read_from_peripheral(SWO_DMA_BUS, SWO_DMA_CHAN);
+	dma_enable_memory_increment_mode(SWO_DMA_BUS, SWO_DMA_CHAN);
+	dma_set_peripheral_size(SWO_DMA_BUS, SWO_DMA_CHAN, DMA_CCR_PSIZE_8BIT);
+	dma_set_memory_size(SWO_DMA_BUS, SWO_DMA_CHAN, DMA_CCR_MSIZE_8BIT);
+	dma_enable_circular_mode(SWO_DMA_BUS, SWO_DMA_CHAN);
+	dma_set_priority(SWO_DMA_BUS, SWO_DMA_CHAN, DMA_CCR_PL_HIGH);
+	dma_enable_half_transfer_interrupt(SWO_DMA_BUS, SWO_DMA_CHAN);
+	dma_enable_transfer_complete_interrupt(SWO_DMA_BUS, SWO_DMA_CHAN);
+	dma_enable_channel(SWO_DMA_BUS, SWO_DMA_CHAN);
+	swo_buf_out = 0;
+
+	/* Half/full buffer and line idle interrupts drain to USB.  They
+	 * share the USB priority, as the endpoint callback drains too. */
+	nvic_set_priority(SWO_DMA_IRQ, IRQ_PRI_SWO_DMA);
+	nvic_enable_irq(SWO_DMA_IRQ);
+	nvic_set_priority(SWO_UART_IRQ, IRQ_PRI_SWO_DMA);
+	nvic_enable_irq(SWO_UART_IRQ);
+	USART_CR1(SWO_UART) |= USART_CR1_IDLEIE;
+	usart_enable_rx_dma(SWO_UART);
+	usart_enable(SWO_UART);
+
+	swo_uart_active = true;
+	usbd_ep_stall_set(usbdev, 0x85, 0);
+}
+
+/* Send what the DMA has written since the last call, through the ITM
+ * filter.  A filtered packet is kept until the endpoint takes it.  Data
+ * is lost if USB falls a whole buffer behind. */
+static void traceswo_uart_push(void)
+{
+	static uint8_t pkt[64];
+	static int pkt_len;
+	uint32_t in = SWO_BUF_SIZE -
+		dma_get_number_of_data(SWO_DMA_BUS, SWO_DMA_CHAN);
+	if (in == SWO_BUF_SIZE)
+		in = 0;
+
+	while (1) {
+		while ((pkt_len < 64) && (in != swo_buf_out)) {
+			uint32_t len = ((in > swo_buf_out) ? in : SWO_BUF_SIZE) -
+			               swo_buf_out;
+			if (len > (uint32_t)(64 - pkt_len))
+				len = 64 - pkt_len;
+			memcpy(&pkt[pkt_len], &swo_buf[swo_buf_out], len);
+			pkt_len += traceswo_filter(&pkt[pkt_len], len);
+			swo_buf_out = (swo_buf_out + len) % SWO_BUF_SIZE;
+		}
+		if (!pkt_len ||
+		    (usbd_ep_write_packet(usbdev, 0x85, pkt, pkt_len) != pkt_len))
+			break;
+		pkt_len = 0;
+	}
+}
+
+void SWO_DMA_ISR(void)
+{
+	dma_clear_interrupt_flags(SWO_DMA_BUS, SWO_DMA_CHAN,
+	                          DMA_HTIF | DMA_TCIF);
+	traceswo_uart_push();
+}
+
+void SWO_UART_ISR(void)
+{
+	/* Reading SR then DR clears the idle flag */
+	if (USART_SR(SWO_UART) & USART_SR_IDLE)
+		(void)USART_DR(SWO_UART);
+	traceswo_uart_push();
+}
+#endif
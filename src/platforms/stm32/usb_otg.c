@@ -0,0 +1,108 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This file implements multi-packet IN transfers on the STM32F4 OTG FS
+ * core, see RM0090 section 34.
+ */
+#include "general.h"
+#include "cdcacm.h"
+#include "usb_otg.h"
+
+#include <libopencm3/cm3/common.h>
+
+/* The registers used here, by offset so as not to depend on which
+ * libopencm3 spells them how */
+#define OTG_FS_BASE		0x50000000
+#define OTG_GRSTCTL		MMIO32(OTG_FS_BASE + 0x010)
+#define OTG_GRXFSIZ		MMIO32(OTG_FS_BASE + 0x024)
+#define OTG_DIEPTXF0		MMIO32(OTG_FS_BASE + 0x028)
+#define OTG_DIEPTXF(x)		MMIO32(OTG_FS_BASE + 0x104 + 4 * ((x) - 1))
+#define OTG_DIEPCTL(x)		MMIO32(OTG_FS_BASE + 0x900 + 0x20 * (x))
+#define OTG_DIEPTSIZ(x)		MMIO32(OTG_FS_BASE + 0x910 + 0x20 * (x))
+#define OTG_FIFO(x)		MMIO32(OTG_FS_BASE + 0x1000 * ((x) + 1))
+
+#define OTG_GRSTCTL_TXFFLSH	(1 << 5)
+#define OTG_GRSTCTL_TXFNUM(x)	((x) << 6)
+#define OTG_DIEPCTL_EPENA	(1U << 31)
+#define OTG_DIEPCTL_CNAK	(1 << 26)
+#define OTG_DIEPTSIZ_PKTCNT(x)	((x) << 19)
+#define OTG_DIEPTSIZ_PKTCNT_MASK	(0x3ff << 19)
+
+/* FIFO RAM and IN endpoints of the FS core, in words */
+#define OTG_FIFO_WORDS		320
+#define OTG_IN_EPS		4
+
+static uint32_t otg_fifo_reg(uint8_t ep)
+{
+	return ep ? OTG_DIEPTXF(ep) : OTG_DIEPTXF0;
+}
+
+void usb_otg_fifo_resize(uint8_t ep, uint16_t size)
+{
+	uint32_t top = OTG_GRXFSIZ & 0xffff;
+
+	ep &= 0x7f;
+	if (!ep || (ep >= OTG_IN_EPS))
+		return;
+	/* Above everything else allocated */
+	for (uint8_t i = 0; i < OTG_IN_EPS; i++) {
+		uint32_t txf = otg_fifo_reg(i);
+		if ((i != ep) && (txf >> 16))
+			top = MAX(top, (txf & 0xffff) + (txf >> 16));
+	}
+	uint32_t words = MIN(size / 4, OTG_FIFO_WORDS - top);
+	if (words <= (OTG_DIEPTXF(ep) >> 16))
+		return;
+
+	OTG_DIEPTXF(ep) = (words << 16) | top;
+	OTG_GRSTCTL = OTG_GRSTCTL_TXFFLSH | OTG_GRSTCTL_TXFNUM(ep);
+	while (OTG_GRSTCTL & OTG_GRSTCTL_TXFFLSH);
+}
+
+uint16_t usb_otg_fifo_size(uint8_t ep)
+{
+	ep &= 0x7f;
+	if (ep >= OTG_IN_EPS)
+		return 0;
+	return (otg_fifo_reg(ep) >> 16) * 4;
+}
+
+bool usb_otg_ep_busy(uint8_t ep)
+{
+	ep &= 0x7f;
+	return (OTG_DIEPCTL(ep) & OTG_DIEPCTL_EPENA) ||
+	       (OTG_DIEPTSIZ(ep) & OTG_DIEPTSIZ_PKTCNT_MASK);
+}
+
+void usb_otg_ep_write(uint8_t ep, const void *buf, uint16_t len)
+{
+	const uint8_t *p = buf;
+	uint32_t packets = MAX(1, (len + CDCACM_PACKET_SIZE - 1) /
+	                          CDCACM_PACKET_SIZE);
+
+	ep &= 0x7f;
+	OTG_DIEPTSIZ(ep) = OTG_DIEPTSIZ_PKTCNT(packets) | len;
+	OTG_DIEPCTL(ep) |= OTG_DIEPCTL_EPENA | OTG_DIEPCTL_CNAK;
+
+	/* The FIFO only takes words, the last one padded */
+	for (uint16_t i = 0; i < len; i += 4) {
+		uint32_t word = 0;
+		for (uint16_t j = 0; (j < 4) && (i + j < len); j++)
+			word |= p[i + j] << (8 * j);
+		OTG_FIFO(ep) = word;
+	}
+}
@@ -0,0 +1,37 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __USB_OTG_H
+#define __USB_OTG_H
+
+/* Multi-packet IN transfers on the OTG FS core, which libopencm3 only
+ * drives a packet at a time.  The whole transfer is loaded into the
+ * endpoint's TX FIFO and goes out back to back, with one interrupt when
+ * it completes. */
+
+/* Move an IN endpoint's TX FIFO into unused FIFO RAM and grow it towards
+ * size bytes.  Call once all endpoints are set up. */
+void usb_otg_fifo_resize(uint8_t ep, uint16_t size);
+/* Bytes the endpoint's TX FIFO holds, the largest transfer.  0 for
+ * endpoints beyond those the core has FIFOs for. */
+uint16_t usb_otg_fifo_size(uint8_t ep);
+
+bool usb_otg_ep_busy(uint8_t ep);
+/* Start a transfer of up to usb_otg_fifo_size() bytes, 0 sending a zero
+ * length packet.  The endpoint must not be busy. */
+void usb_otg_ep_write(uint8_t ep, const void *buf, uint16_t len);
+
+#endif
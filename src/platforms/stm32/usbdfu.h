@@ -27,6 +27,14 @@
 #define CMD_ERASE	0x41
 extern uint32_t app_address;
 
+/* Largest DNLOAD block.  Two are buffered besides the control buffer,
+ * sized to leave the F1 parts most of their RAM. */
+#if defined(STM32F4) || defined(STM32F2)
+#	define DFU_TRANSFER_SIZE	4096
+#else
+#	define DFU_TRANSFER_SIZE	2048
+#endif
+
 typedef enum {
     DFU_MODE = 0,
     UPD_MODE = 1
@@ -22,6 +22,9 @@
 #include <libopencm3/stm32/gpio.h>
 #include <libopencm3/stm32/usart.h>
 #include <libopencm3/stm32/timer.h>
+#ifdef USBUSART_DMA_BUS
+#	include <libopencm3/stm32/dma.h>
+#endif
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/cm3/scs.h>
 #include <libopencm3/usb/usbd.h>
@@ -29,6 +32,9 @@
 
 #include "general.h"
 #include "cdcacm.h"
+#ifdef PLATFORM_HAS_RTT
+#	include "rtt.h"
+#endif
 
 #define USBUART_TIMER_FREQ_HZ 1000000U /* 1us per tick */
 #define USBUART_RUN_FREQ_HZ 5000U /* 200us (or 100 characters at 2Mbps) */
@@ -42,6 +48,105 @@ static uint8_t buf_rx_in;
 /* Fifo out pointer, writes assumed to be atomic, should be only incremented outside RX ISR */
 static uint8_t buf_rx_out;
 
+#ifdef USBUSART_DMA_BUS
+#define DMA_RX_SIZE 512
+
+/* RX ring written by circular DMA, the FIFO above only carries debug output */
+static uint8_t buf_rx_dma[DMA_RX_SIZE];
+/* Ring out pointer, the in pointer is derived from the DMA counter */
+static uint16_t buf_rx_dma_out;
+
+static uint16_t usbuart_dma_in(void)
+{
+	uint16_t in = DMA_RX_SIZE -
+		dma_get_number_of_data(USBUSART_DMA_BUS, USBUSART_DMA_RX_CHAN);
+	return in % DMA_RX_SIZE;
+}
+
+#define TX_FIFO_SIZE 256
+
+/* TX ring filled from the OUT endpoint and drained by DMA */
+static uint8_t buf_tx[TX_FIFO_SIZE];
+/* Only written by the OUT endpoint callback */
+static volatile uint16_t buf_tx_in;
+/* Only written by the TX DMA interrupt */
+static volatile uint16_t buf_tx_out;
+/* Length of the DMA transfer in flight, zero when idle */
+static volatile uint16_t buf_tx_busy;
+static volatile bool buf_tx_nak;
+
+static uint16_t usbuart_tx_free(void)
+{
+	return (TX_FIFO_SIZE + buf_tx_out - buf_tx_in - 1) % TX_FIFO_SIZE;
+}
+
+/* Start the DMA on the contiguous part of the ring, if anything is queued */
+static void usbuart_tx_start(void)
+{
+	uint16_t in = buf_tx_in;
+	if (in == buf_tx_out)
+		return;
+
+	buf_tx_busy = ((in > buf_tx_out) ? in : TX_FIFO_SIZE) - buf_tx_out;
+	dma_set_memory_address(USBUSART_DMA_BUS, USBUSART_DMA_TX_CHAN,
+			       (uint32_t)&buf_tx[buf_tx_out]);
+	dma_set_number_of_data(USBUSART_DMA_BUS, USBUSART_DMA_TX_CHAN,
+			       buf_tx_busy);
+	dma_enable_channel(USBUSART_DMA_BUS, USBUSART_DMA_TX_CHAN);
+}
+#endif
+
+#ifdef PLATFORM_HAS_RTT
+/* While RTT is enabled, host data on the UART port goes to the target's
+ * RTT down buffer instead of the UART */
+#define RTT_DOWN_SIZE 128
+
+static bool rtt_active;
+static uint8_t buf_rtt_down[RTT_DOWN_SIZE];
+/* Only written by the OUT endpoint callback */
+static volatile uint16_t buf_rtt_in;
+/* Only written by rtt_if_read() */
+static volatile uint16_t buf_rtt_out;
+static volatile bool buf_rtt_nak;
+
+static uint16_t rtt_down_free(void)
+{
+	return (RTT_DOWN_SIZE + buf_rtt_out - buf_rtt_in - 1) % RTT_DOWN_SIZE;
+}
+#endif
+
+#ifdef PLATFORM_HAS_UART_FLOW
+/* RTS is driven by software, as the DMA empties the USART so quickly the
+ * USART's own RTS never drops.  It is low while the RX buffer has a
+ * quarter free and the host has its RTS raised.  CTS is left to the
+ * USART, which holds off transmitting while the target raises it. */
+static bool usbuart_host_rts = true;
+
+static void usbuart_flow_update(void)
+{
+#ifdef USBUSART_DMA_BUS
+	const uint16_t size = DMA_RX_SIZE;
+	uint16_t used = (DMA_RX_SIZE + usbuart_dma_in() - buf_rx_dma_out) %
+		DMA_RX_SIZE;
+#else
+	const uint16_t size = FIFO_SIZE;
+	uint16_t used = (FIFO_SIZE + buf_rx_in - buf_rx_out) % FIFO_SIZE;
+#endif
+
+	if (usbuart_host_rts && (used < size - size / 4))
+		gpio_clear(USBUSART_RTS_PORT, USBUSART_RTS_PIN);
+	else
+		gpio_set(USBUSART_RTS_PORT, USBUSART_RTS_PIN);
+}
+
+void usbuart_set_control_line_state(uint16_t value)
+{
+	/* Bit 0 is DTR, bit 1 RTS */
+	usbuart_host_rts = value & (1 << 1);
+	usbuart_flow_update();
+}
+#endif
+
 static void usbuart_run(void);
 
 void usbuart_init(void)
@@ -56,13 +161,71 @@ void usbuart_init(void)
 	usart_set_stopbits(USBUSART, USART_STOPBITS_1);
 	usart_set_mode(USBUSART, USART_MODE_TX_RX);
 	usart_set_parity(USBUSART, USART_PARITY_NONE);
+#ifdef PLATFORM_HAS_UART_FLOW
+	UART_FLOW_PIN_SETUP();
+	usart_set_flow_control(USBUSART, USART_FLOWCONTROL_CTS);
+#else
 	usart_set_flow_control(USBUSART, USART_FLOWCONTROL_NONE);
+#endif
 
 	/* Finally enable the USART. */
 	usart_enable(USBUSART);
 
+#ifdef USBUSART_DMA_BUS
+	/* Receive into a circular buffer, the DMA half/full and the USART
+	 * idle line interrupts only schedule the deferred processing. */
+	rcc_periph_clock_enable(USBUSART_DMA_CLK);
+	dma_channel_reset(USBUSART_DMA_BUS, USBUSART_DMA_RX_CHAN);
+	dma_set_peripheral_address(USBUSART_DMA_BUS, USBUSART_DMA_RX_CHAN,
+				   (uint32_t)&USBUSART_DR);
+	dma_set_memory_address(USBUSART_DMA_BUS, USBUSART_DMA_RX_CHAN,
+			       (uint32_t)buf_rx_dma);
+	dma_set_number_of_data(USBUSART_DMA_BUS, USBUSART_DMA_RX_CHAN,
+			       DMA_RX_SIZE);
+	dma_set_read_from_peripheral(USBUSART_DMA_BUS, USBUSART_DMA_RX_CHAN);
+	dma_enable_memory_increment_mode(USBUSART_DMA_BUS, USBUSART_DMA_RX_CHAN);
+	dma_set_peripheral_size(USBUSART_DMA_BUS, USBUSART_DMA_RX_CHAN,
+				DMA_CCR_PSIZE_8BIT);
+	dma_set_memory_size(USBUSART_DMA_BUS, USBUSART_DMA_RX_CHAN,
+			    DMA_CCR_MSIZE_8BIT);
+	dma_enable_circular_mode(USBUSART_DMA_BUS, USBUSART_DMA_RX_CHAN);
+	dma_set_priority(USBUSART_DMA_BUS, USBUSART_DMA_RX_CHAN,
+			 DMA_CCR_PL_MEDIUM);
+	dma_enable_half_transfer_interrupt(USBUSART_DMA_BUS,
+					   USBUSART_DMA_RX_CHAN);
+	dma_enable_transfer_complete_interrupt(USBUSART_DMA_BUS,
+					       USBUSART_DMA_RX_CHAN);
+	dma_enable_channel(USBUSART_DMA_BUS, USBUSART_DMA_RX_CHAN);
+	nvic_set_priority(USBUSART_DMA_RX_IRQ, IRQ_PRI_USBUSART);
+	nvic_enable_irq(USBUSART_DMA_RX_IRQ);
+
+	usart_enable_rx_dma(USBUSART);
+	USBUSART_CR1 |= USART_CR1_IDLEIE;
+
+	/* Transmit one contiguous chunk of the TX ring at a time.  The
+	 * interrupt shares the USB priority so it never preempts an endpoint
+	 * callback halfway through updating the ring or the NAK state. */
+	dma_channel_reset(USBUSART_DMA_BUS, USBUSART_DMA_TX_CHAN);
+	dma_set_peripheral_address(USBUSART_DMA_BUS, USBUSART_DMA_TX_CHAN,
+				   (uint32_t)&USBUSART_DR);
+	dma_set_read_from_memory(USBUSART_DMA_BUS, USBUSART_DMA_TX_CHAN);
+	dma_enable_memory_increment_mode(USBUSART_DMA_BUS, USBUSART_DMA_TX_CHAN);
+	dma_set_peripheral_size(USBUSART_DMA_BUS, USBUSART_DMA_TX_CHAN,
+				DMA_CCR_PSIZE_8BIT);
+	dma_set_memory_size(USBUSART_DMA_BUS, USBUSART_DMA_TX_CHAN,
+			    DMA_CCR_MSIZE_8BIT);
+	dma_set_priority(USBUSART_DMA_BUS, USBUSART_DMA_TX_CHAN,
+			 DMA_CCR_PL_MEDIUM);
+	dma_enable_transfer_complete_interrupt(USBUSART_DMA_BUS,
+					       USBUSART_DMA_TX_CHAN);
+	nvic_set_priority(USBUSART_DMA_TX_IRQ, IRQ_PRI_USB);
+	nvic_enable_irq(USBUSART_DMA_TX_IRQ);
+
+	usart_enable_tx_dma(USBUSART);
+#else
 	/* Enable interrupts */
 	USBUSART_CR1 |= USART_CR1_RXNEIE;
+#endif
 	nvic_set_priority(USBUSART_IRQ, IRQ_PRI_USBUSART);
 	nvic_enable_irq(USBUSART_IRQ);
 
@@ -95,15 +258,17 @@ static void usbuart_run(void)
 	if (cdcacm_get_config() != 1)
 	{
 		buf_rx_out = buf_rx_in;
+#ifdef USBUSART_DMA_BUS
+		buf_rx_dma_out = usbuart_dma_in();
+#endif
 	}
+#ifdef PLATFORM_HAS_UART_FLOW
+	/* Runs every few characters while there is data, so the target is
+	 * told to stop well before the buffer overflows */
+	usbuart_flow_update();
+#endif
 
-	/* if fifo empty, nothing further to do */
-	if (buf_rx_in == buf_rx_out) {
-		/* turn off LED, disable IRQ */
-		timer_disable_irq(USBUSART_TIM, TIM_DIER_UIE);
-		gpio_clear(LED_PORT_UART, LED_UART);
-	}
-	else
+	if (buf_rx_in != buf_rx_out)
 	{
 		uint8_t packet_buf[CDCACM_PACKET_SIZE];
 		uint8_t packet_size = 0;
@@ -126,7 +291,29 @@ static void usbuart_run(void)
 		buf_rx_out += usbd_ep_write_packet(usbdev,
 				CDCACM_UART_ENDPOINT, packet_buf, packet_size);
 		buf_rx_out %= FIFO_SIZE;
+		return;
+	}
+
+#ifdef USBUSART_DMA_BUS
+	uint16_t buf_in = usbuart_dma_in();
+	if (buf_in != buf_rx_dma_out)
+	{
+		/* send the contiguous part of the ring straight from memory */
+		uint16_t len = ((buf_in > buf_rx_dma_out) ? buf_in : DMA_RX_SIZE) -
+			buf_rx_dma_out;
+		if (len > CDCACM_PACKET_SIZE)
+			len = CDCACM_PACKET_SIZE;
+
+		buf_rx_dma_out += usbd_ep_write_packet(usbdev,
+				CDCACM_UART_ENDPOINT, &buf_rx_dma[buf_rx_dma_out], len);
+		buf_rx_dma_out %= DMA_RX_SIZE;
+		return;
 	}
+#endif
+
+	/* fifo empty, turn off LED, disable IRQ */
+	timer_disable_irq(USBUSART_TIM, TIM_DIER_UIE);
+	gpio_clear(LED_PORT_UART, LED_UART);
 }
 
 void usbuart_set_line_coding(struct usb_cdc_line_coding *coding)
@@ -171,6 +358,21 @@ void usbuart_usb_out_cb(usbd_device *dev, uint8_t ep)
 	int len = usbd_ep_read_packet(dev, CDCACM_UART_ENDPOINT,
 					buf, CDCACM_PACKET_SIZE);
 
+#ifdef PLATFORM_HAS_RTT
+	if (rtt_active) {
+		for (int i = 0; i < len; i++) {
+			buf_rtt_down[buf_rtt_in] = buf[i];
+			buf_rtt_in = (buf_rtt_in + 1) % RTT_DOWN_SIZE;
+		}
+		/* Hold off the host until the target takes some */
+		if (rtt_down_free() < CDCACM_PACKET_SIZE) {
+			buf_rtt_nak = true;
+			usbd_ep_nak_set(dev, CDCACM_UART_ENDPOINT, 1);
+		}
+		return;
+	}
+#endif
+
 #if defined(BLACKMAGIC)
 	/* Don't bother if uart is disabled.
 	 * This will be the case on mini while we're being debugged.
@@ -179,10 +381,29 @@ void usbuart_usb_out_cb(usbd_device *dev, uint8_t ep)
 		return;
 #endif
 
+#ifdef USBUSART_DMA_BUS
+	/* The endpoint is NAKed before the ring can overflow */
+	for(int i = 0; i < len; i++) {
+		buf_tx[buf_tx_in] = buf[i];
+		buf_tx_in = (buf_tx_in + 1) % TX_FIFO_SIZE;
+	}
+
+	if (!buf_tx_busy) {
+		gpio_set(LED_PORT_UART, LED_UART);
+		usbuart_tx_start();
+	}
+
+	/* Hold off the host until the DMA makes room for another packet */
+	if (usbuart_tx_free() < CDCACM_PACKET_SIZE) {
+		buf_tx_nak = true;
+		usbd_ep_nak_set(dev, CDCACM_UART_ENDPOINT, 1);
+	}
+#else
 	gpio_set(LED_PORT_UART, LED_UART);
 	for(int i = 0; i < len; i++)
 		usart_send_blocking(USBUSART, buf[i]);
 	gpio_clear(LED_PORT_UART, LED_UART);
+#endif
 }
 
 #ifdef USBUART_DEBUG
@@ -202,12 +423,106 @@ int usbuart_debug_write(const char *buf, size_t len)
 }
 #endif
 
+#ifdef PLATFORM_HAS_RTT
+void rtt_if_enable(bool enable)
+{
+	rtt_active = enable;
+	buf_rtt_out = buf_rtt_in;
+	if (buf_rtt_nak) {
+		buf_rtt_nak = false;
+		usbd_ep_nak_set(usbdev, CDCACM_UART_ENDPOINT, 0);
+	}
+}
+
+size_t rtt_if_write(const void *buf, size_t len)
+{
+	/* Nobody listening, drop it rather than stall the target */
+	if (cdcacm_get_config() != 1)
+		return len;
+
+	/* Keep the deferred UART processing off the endpoint meanwhile */
+	nvic_disable_irq(USBUSART_TIM_IRQ);
+	len = usbd_ep_write_packet(usbdev, CDCACM_UART_ENDPOINT, buf,
+	                           MIN(len, CDCACM_PACKET_SIZE));
+	nvic_enable_irq(USBUSART_TIM_IRQ);
+	return len;
+}
+
+size_t rtt_if_read(void *buf, size_t len)
+{
+	uint8_t *buf8 = buf;
+	size_t n = 0;
+
+	while ((n < len) && (buf_rtt_out != buf_rtt_in)) {
+		buf8[n++] = buf_rtt_down[buf_rtt_out];
+		buf_rtt_out = (buf_rtt_out + 1) % RTT_DOWN_SIZE;
+	}
+
+	if (buf_rtt_nak && (rtt_down_free() >= CDCACM_PACKET_SIZE)) {
+		buf_rtt_nak = false;
+		usbd_ep_nak_set(usbdev, CDCACM_UART_ENDPOINT, 0);
+	}
+	return n;
+}
+#endif
+
 void usbuart_usb_in_cb(usbd_device *dev, uint8_t ep)
 {
 	(void) dev;
 	(void) ep;
 }
 
+#ifdef USBUSART_DMA_BUS
+static void usbuart_rx_pending(void)
+{
+	/* Turn on LED and enable deferred processing */
+	gpio_set(LED_PORT_UART, LED_UART);
+	timer_enable_irq(USBUSART_TIM, TIM_DIER_UIE);
+#ifdef PLATFORM_HAS_UART_FLOW
+	usbuart_flow_update();
+#endif
+}
+
+/*
+ * Idle line, the sender paused so flush whatever the DMA has collected.
+ * Reading SR then DR clears the flag, but leave DR to the DMA while
+ * another character is waiting.
+ */
+void USBUSART_ISR(void)
+{
+	uint32_t sr = USART_SR(USBUSART);
+	if ((sr & USART_SR_IDLE) && !(sr & USART_SR_RXNE))
+		(void)USART_DR(USBUSART);
+
+	usbuart_rx_pending();
+}
+
+void USBUSART_DMA_RX_ISR(void)
+{
+	dma_clear_interrupt_flags(USBUSART_DMA_BUS, USBUSART_DMA_RX_CHAN,
+				  DMA_HTIF | DMA_TCIF);
+	usbuart_rx_pending();
+}
+
+void USBUSART_DMA_TX_ISR(void)
+{
+	dma_clear_interrupt_flags(USBUSART_DMA_BUS, USBUSART_DMA_TX_CHAN,
+				  DMA_TCIF);
+	dma_disable_channel(USBUSART_DMA_BUS, USBUSART_DMA_TX_CHAN);
+
+	buf_tx_out = (buf_tx_out + buf_tx_busy) % TX_FIFO_SIZE;
+	buf_tx_busy = 0;
+
+	if (buf_tx_nak && usbuart_tx_free() >= CDCACM_PACKET_SIZE) {
+		buf_tx_nak = false;
+		usbd_ep_nak_set(usbdev, CDCACM_UART_ENDPOINT, 0);
+	}
+
+	usbuart_tx_start();
+	if (!buf_tx_busy)
+		gpio_clear(LED_PORT_UART, LED_UART);
+}
+#else
 /*
  * Read a character from the UART RX and stuff it in a software FIFO.
  * Allowed to read from FIFO out pointer, but not write to it.
@@ -240,7 +555,11 @@ void USBUSART_ISR(void)
 		/* enable deferred processing if we put data in the FIFO */
 		timer_enable_irq(USBUSART_TIM, TIM_DIER_UIE);
 	}
+#ifdef PLATFORM_HAS_UART_FLOW
+	usbuart_flow_update();
+#endif
 }
+#endif
 
 void USBUSART_TIM_ISR(void)
 {
@@ -34,6 +34,14 @@ static volatile uint32_t count_in;
 static volatile uint8_t buffer_out[16*CDCACM_PACKET_SIZE];
 static volatile uint8_t buffer_in[CDCACM_PACKET_SIZE];
 
+void gdb_if_write(const void *buf, size_t len, int flush)
+{
+	const unsigned char *p = buf;
+
+	while (len--)
+		gdb_if_putchar(*p++, flush && !len);
+}
+
 void gdb_if_putchar(unsigned char c, int flush)
 {
 	buffer_in[count_in++] = c;
@@ -68,18 +76,44 @@ void gdb_usb_out_cb(usbd_device *dev, uint8_t ep)
 	usbd_ep_nak_set(dev, CDCACM_GDB_ENDPOINT, 0);
 }
 
-unsigned char gdb_if_getchar(void)
+size_t gdb_if_peek(const uint8_t **data)
 {
-
 	while(tail_out == head_out) {
 		/* Detach if port closed */
 		if(!cdcacm_get_dtr())
-			return 0x04;
+			return 0;
 
 		while(cdcacm_get_config() != 1);
 	}
 
-	return buffer_out[tail_out++ % sizeof(buffer_out)];
+	/* Up to the end of the ring, the rest is returned next time */
+	uint32_t tail = tail_out % sizeof(buffer_out);
+	*data = (const uint8_t *)&buffer_out[tail];
+	return MIN(head_out - tail_out, sizeof(buffer_out) - tail);
+}
+
+void gdb_if_consume(size_t len)
+{
+	tail_out += len;
+}
+
+unsigned char gdb_if_getchar(void)
+{
+	const uint8_t *data;
+	unsigned char c;
+
+	if(!gdb_if_peek(&data))
+		return 0x04;
+	c = *data;
+	gdb_if_consume(1);
+
+	return c;
+}
+
+/* Input received by the interrupt handler, or the port was closed */
+bool gdb_if_pending(void)
+{
+	return (head_out != tail_out) || !cdcacm_get_dtr();
 }
 
 unsigned char gdb_if_getchar_to(int timeout)
@@ -29,6 +29,8 @@
 
 #include "general.h"
 #include "cdcacm.h"
+#include "traceswo.h"
+#include "udma.h"
 
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/lm4f/rcc.h>
@@ -36,8 +38,28 @@
 #include <libopencm3/lm4f/uart.h>
 #include <libopencm3/usb/usbd.h>
 
-void traceswo_init(void)
+/* Received by the uDMA into the two halves of the ring, and sent on from
+ * there as whole halves complete, from the endpoint callback and from
+ * the tick for the partial half. */
+#define SWO_HALF_SIZE 512
+
+static uint8_t swo_buf[2 * SWO_HALF_SIZE];
+static struct udma_ring swo_ring;
+static bool swo_active;
+
+/* Data lost with USB a whole half behind, an ITM overflow packet marks
+ * the gap */
+#define ITM_OVERFLOW 0x70
+static bool trace_overflow;
+static uint32_t trace_dropped;
+static uint32_t trace_overflows;
+
+bool traceswo_init(uint32_t baud)
 {
+	/* Manchester encoding is not supported, only NRZ */
+	if (!baud)
+		baud = 800000;
+
 	periph_clock_enable(RCC_GPIOD);
 	periph_clock_enable(TRACEUART_CLK);
 	__asm__("nop"); __asm__("nop"); __asm__("nop");
@@ -45,37 +67,40 @@ void traceswo_init(void)
 	gpio_mode_setup(SWO_PORT, GPIO_MODE_INPUT, GPIO_PUPD_NONE, SWO_PIN);
 	gpio_set_af(SWO_PORT, 1, SWO_PIN); /* U2RX */
 
+	swo_active = false;
 	uart_disable(TRACEUART);
 
 	/* Setup UART parameters. */
 	uart_clock_from_sysclk(TRACEUART);
-	uart_set_baudrate(TRACEUART, 800000);
+	uart_set_baudrate(TRACEUART, baud);
 	uart_set_databits(TRACEUART, 8);
 	uart_set_stopbits(TRACEUART, 1);
 	uart_set_parity(TRACEUART, UART_PARITY_NONE);
 
-	// Enable FIFO
+	// Enable FIFO, the uDMA is asked for bursts at 4/8 full
 	uart_enable_fifo(TRACEUART);
-
-	// Set FIFO interrupt trigger levels to 4/8 full for RX buffer and
-	// 7/8 empty (1/8 full) for TX buffer
 	uart_set_fifo_trigger_levels(TRACEUART, UART_FIFO_RX_TRIG_1_2, UART_FIFO_TX_TRIG_7_8);
 
-	uart_clear_interrupt_flag(TRACEUART, UART_INT_RX | UART_INT_RT);
-
-	/* Enable interrupts */
-	uart_enable_interrupts(TRACEUART, UART_INT_RX | UART_INT_RT);
+	/* The uDMA takes the data, its completion comes on the UART
+	 * interrupt.  That shares the USB priority, as the endpoint
+	 * callback drains the ring too. */
+	uart_disable_interrupts(TRACEUART, UART_INT_RX | UART_INT_RT);
+	udma_ring_start(&swo_ring, TRACEUART, TRACEUART_DMA_CHAN,
+	                TRACEUART_DMA_ENC, swo_buf, SWO_HALF_SIZE);
 
 	/* Finally enable the USART. */
 	uart_enable(TRACEUART);
 
-	nvic_set_priority(TRACEUART_IRQ, 0);
+	nvic_set_priority(TRACEUART_IRQ, IRQ_PRI_USB);
 	nvic_enable_irq(TRACEUART_IRQ);
+	swo_active = true;
 
 	/* Un-stall USB endpoint */
 	usbd_ep_stall_set(usbdev, 0x85, 0);
 
 	gpio_mode_setup(GPIOD, GPIO_MODE_OUTPUT, GPIO_PUPD_NONE, GPIO3);
+
+	return true;
 }
 
 void traceswo_baud(unsigned int baud)
@@ -84,34 +109,39 @@ void traceswo_baud(unsigned int baud)
 	uart_set_databits(TRACEUART, 8);
 }
 
-#define FIFO_SIZE 256
-
-/* RX Fifo buffer */
-static volatile uint8_t buf_rx[FIFO_SIZE];
-/* Fifo in pointer, writes assumed to be atomic, should be only incremented within RX ISR */
-static volatile uint32_t buf_rx_in = 0;
-/* Fifo out pointer, writes assumed to be atomic, should be only incremented outside RX ISR */
-static volatile uint32_t buf_rx_out = 0;
+void traceswo_stats(uint32_t *dropped, uint32_t *overflows)
+{
+	*dropped = trace_dropped;
+	*overflows = trace_overflows;
+}
 
-void trace_buf_push(void)
+/* Send what the uDMA has written since the last call, through the ITM
+ * filter.  A filtered packet is kept until the endpoint takes it. */
+static void trace_buf_push(void)
 {
-	size_t len;
-
-	if (buf_rx_in == buf_rx_out) {
-		return;
-	} else if (buf_rx_in > buf_rx_out) {
-		len = buf_rx_in - buf_rx_out;
-	} else {
-		len = FIFO_SIZE - buf_rx_out;
-	}
+	static uint8_t pkt[64];
+	static int pkt_len;
+	uint32_t in = udma_ring_in(&swo_ring);
 
-	if (len > 64) {
-		len = 64;
+	if (trace_overflow && (pkt_len < 64)) {
+		pkt[pkt_len++] = ITM_OVERFLOW;
+		trace_overflow = false;
 	}
 
-	if (usbd_ep_write_packet(usbdev, 0x85, (uint8_t *)&buf_rx[buf_rx_out], len) == len) {
-		buf_rx_out += len;
-		buf_rx_out %= FIFO_SIZE;
+	while (1) {
+		while ((pkt_len < 64) && (in != udma_ring_out(&swo_ring))) {
+			uint32_t out = udma_ring_out(&swo_ring);
+			uint32_t len = ((in > out) ? in : sizeof(swo_buf)) - out;
+			if (len > (uint32_t)(64 - pkt_len))
+				len = 64 - pkt_len;
+			memcpy(&pkt[pkt_len], &swo_buf[out], len);
+			pkt_len += traceswo_filter(&pkt[pkt_len], len);
+			swo_ring.out += len;
+		}
+		if (!pkt_len ||
+		    (usbd_ep_write_packet(usbdev, 0x85, pkt, pkt_len) != pkt_len))
+			break;
+		pkt_len = 0;
 	}
 }
 
@@ -119,43 +149,26 @@ void trace_buf_drain(usbd_device *dev, uint8_t ep)
 {
 	(void) dev;
 	(void) ep;
-	trace_buf_push();
+	if (swo_active)
+		trace_buf_push();
 }
 
+/* Runs from SysTick, the partial half is sent from the UART interrupt so
+ * it can't interrupt the endpoint callback */
 void trace_tick(void)
 {
-	trace_buf_push();
+	if (swo_active)
+		nvic_set_pending_irq(TRACEUART_IRQ);
 }
 
 void TRACEUART_ISR(void)
 {
-	uint32_t flush = uart_is_interrupt_source(TRACEUART, UART_INT_RT);
-
-	while (!uart_is_rx_fifo_empty(TRACEUART)) {
-		uint32_t c = uart_recv(TRACEUART);
-
-		/* If the next increment of rx_in would put it at the same point
-		* as rx_out, the FIFO is considered full.
-		*/
-		if (((buf_rx_in + 1) % FIFO_SIZE) != buf_rx_out)
-		{
-			/* insert into FIFO */
-			buf_rx[buf_rx_in++] = c;
-
-			/* wrap out pointer */
-			if (buf_rx_in >= FIFO_SIZE)
-			{
-				buf_rx_in = 0;
-			}
-		} else {
-			flush = 1;
-			break;
-		}
-	}
+	uint32_t lost = udma_ring_rearm(&swo_ring);
 
-	if (flush) {
-		/* advance fifo out pointer by amount written */
-		trace_buf_push();
+	if (lost) {
+		trace_overflows++;
+		trace_dropped += lost;
+		trace_overflow = true;
 	}
+	trace_buf_push();
 }
-
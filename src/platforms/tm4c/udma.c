@@ -0,0 +1,162 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Just as much of the TM4C uDMA as the UART receive rings need, which
+ * libopencm3 doesn't cover for the LM4F.
+ *
+ * TM4C123GH6PM Datasheet, section 9 Micro Direct Memory Access
+ */
+#include "general.h"
+#include "udma.h"
+
+#include <libopencm3/cm3/common.h>
+
+#define SYSCTL_RCGCDMA		MMIO32(0x400FE60C)
+#define SYSCTL_PRDMA		MMIO32(0x400FEA0C)
+
+#define UDMA_BASE		0x400FF000
+#define UDMA_CFG		MMIO32(UDMA_BASE + 0x004)
+#define UDMA_CTLBASE		MMIO32(UDMA_BASE + 0x008)
+#define UDMA_USEBURSTCLR	MMIO32(UDMA_BASE + 0x01C)
+#define UDMA_REQMASKCLR		MMIO32(UDMA_BASE + 0x024)
+#define UDMA_ENASET		MMIO32(UDMA_BASE + 0x028)
+#define UDMA_ENACLR		MMIO32(UDMA_BASE + 0x02C)
+#define UDMA_ALTSET		MMIO32(UDMA_BASE + 0x030)
+#define UDMA_ALTCLR		MMIO32(UDMA_BASE + 0x034)
+#define UDMA_CHIS		MMIO32(UDMA_BASE + 0x504)
+#define UDMA_CHMAP(n)		MMIO32(UDMA_BASE + 0x510 + 4 * (n))
+
+#define UDMA_CFG_MASTEN		(1 << 0)
+
+#define UDMA_CTL_DSTINC_8	(0 << 30)
+#define UDMA_CTL_DSTSIZE_8	(0 << 28)
+#define UDMA_CTL_SRCINC_NONE	(3 << 26)
+#define UDMA_CTL_SRCSIZE_8	(0 << 24)
+#define UDMA_CTL_ARBSIZE_4	(2 << 14)
+#define UDMA_CTL_XFERSIZE(n)	(((n) - 1) << 4)
+#define UDMA_CTL_XFERSIZE_GET(c) ((((c) >> 4) & 0x3FF) + 1)
+#define UDMA_CTL_MODE_MASK	7
+#define UDMA_CTL_MODE_STOP	0
+#define UDMA_CTL_MODE_PINGPONG	3
+
+#define UART_DMACTL(uart)	MMIO32((uart) + 0xFF8)
+#define UART_DMACTL_RXDMAE	(1 << 0)
+
+#define UDMA_CHANNELS		32
+
+struct udma_ctl {
+	volatile uint32_t src_end;
+	volatile uint32_t dst_end;
+	volatile uint32_t ctl;
+	uint32_t unused;
+};
+
+/* Primary structures, then the alternate ones */
+static struct udma_ctl udma_table[2 * UDMA_CHANNELS]
+	__attribute__((aligned(1024)));
+
+static void udma_init(void)
+{
+	if (SYSCTL_RCGCDMA & 1)
+		return;
+	SYSCTL_RCGCDMA |= 1;
+	while (!(SYSCTL_PRDMA & 1));
+	UDMA_CFG = UDMA_CFG_MASTEN;
+	UDMA_CTLBASE = (uint32_t)udma_table;
+}
+
+static struct udma_ctl *udma_half(struct udma_ring *r, int alt)
+{
+	return &udma_table[r->chan + alt * UDMA_CHANNELS];
+}
+
+static void udma_half_start(struct udma_ring *r, int alt)
+{
+	struct udma_ctl *c = udma_half(r, alt);
+
+	c->dst_end = (uint32_t)&r->buf[(alt + 1) * r->half - 1];
+	c->ctl = UDMA_CTL_DSTINC_8 | UDMA_CTL_DSTSIZE_8 |
+	         UDMA_CTL_SRCINC_NONE | UDMA_CTL_SRCSIZE_8 |
+	         UDMA_CTL_ARBSIZE_4 | UDMA_CTL_XFERSIZE(r->half) |
+	         UDMA_CTL_MODE_PINGPONG;
+}
+
+void udma_ring_start(struct udma_ring *r, uint32_t uart, uint8_t chan,
+                     uint8_t enc, uint8_t *buf, uint16_t half)
+{
+	udma_init();
+
+	/* Restarting, the channel is idle with the UART disabled */
+	UDMA_ENACLR = 1 << chan;
+
+	r->chan = chan;
+	r->buf = buf;
+	r->half = half;
+	r->filled = 0;
+	r->out = 0;
+
+	UDMA_CHMAP(chan / 8) = (UDMA_CHMAP(chan / 8) & ~(0xF << (4 * (chan % 8)))) |
+	                       (enc << (4 * (chan % 8)));
+	for (int alt = 0; alt < 2; alt++) {
+		udma_half(r, alt)->src_end = uart;	/* UARTDR */
+		udma_half_start(r, alt);
+	}
+	/* Single requests too, so the UART FIFO never fills */
+	UDMA_USEBURSTCLR = 1 << chan;
+	UDMA_ALTCLR = 1 << chan;
+	UDMA_REQMASKCLR = 1 << chan;
+	UDMA_ENASET = 1 << chan;
+	UART_DMACTL(uart) |= UART_DMACTL_RXDMAE;
+}
+
+uint32_t udma_ring_rearm(struct udma_ring *r)
+{
+	uint32_t lost = 0;
+
+	UDMA_CHIS = 1 << r->chan;
+	for (int alt = 0; alt < 2; alt++) {
+		if ((udma_half(r, alt)->ctl & UDMA_CTL_MODE_MASK) !=
+		    UDMA_CTL_MODE_STOP)
+			continue;
+		udma_half_start(r, alt);
+		r->filled += r->half;
+
+		/* The other half is being written again, anything in it
+		 * from the last lap not yet read is overwritten */
+		uint32_t keep = r->filled - r->half;
+		if ((int32_t)(keep - r->out) > 0) {
+			lost += keep - r->out;
+			r->out = keep;
+		}
+	}
+	return lost;
+}
+
+uint32_t udma_ring_in(struct udma_ring *r)
+{
+	uint32_t alt, ctl;
+
+	/* Read the active half and its count consistently */
+	do {
+		alt = UDMA_ALTSET & (1 << r->chan);
+		ctl = udma_half(r, alt ? 1 : 0)->ctl;
+	} while (alt != (UDMA_ALTSET & (1 << r->chan)));
+
+	if ((ctl & UDMA_CTL_MODE_MASK) == UDMA_CTL_MODE_STOP)
+		return ((alt ? 1 : 0) + 1) * r->half % (2 * r->half);
+	return (alt ? r->half : 0) + r->half - UDMA_CTL_XFERSIZE_GET(ctl);
+}
@@ -0,0 +1,48 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifndef __UDMA_H
+#define __UDMA_H
+
+/* Receive from a UART into a ring of two halves, with the uDMA in
+ * ping-pong mode, so the data keeps flowing while a completed half is
+ * sent on.  Completion is signalled on the UART's own interrupt, which
+ * must then call udma_ring_rearm(). */
+struct udma_ring {
+	uint8_t chan;
+	uint8_t *buf;
+	uint16_t half;		/* bytes in each half, a power of 2 up to 1024 */
+	/* Running byte counts, so a reader a whole lap behind is told from
+	 * one that has caught up */
+	uint32_t filled;	/* written to the halves completed so far */
+	uint32_t out;		/* read so far, moved on by an overrun */
+};
+
+void udma_ring_start(struct udma_ring *r, uint32_t uart, uint8_t chan,
+                     uint8_t enc, uint8_t *buf, uint16_t half);
+/* Clear the completion and restart the halves that are done.  Returns
+ * the bytes lost if the reader was still in the half the uDMA moved to. */
+uint32_t udma_ring_rearm(struct udma_ring *r);
+/* Offset in the ring the uDMA writes next */
+uint32_t udma_ring_in(struct udma_ring *r);
+
+/* Offset in the ring the reader reads next */
+static inline uint32_t udma_ring_out(const struct udma_ring *r)
+{
+	return r->out & (2 * r->half - 1);
+}
+
+#endif
@@ -21,6 +21,7 @@
  */
 #include "general.h"
 #include "cdcacm.h"
+#include "udma.h"
 
 #include <libopencm3/cm3/nvic.h>
 #include <libopencm3/cm3/scs.h>
@@ -29,14 +30,11 @@
 #include <libopencm3/lm4f/rcc.h>
 #include <libopencm3/lm4f/uart.h>
 
-#define FIFO_SIZE 128
+/* RX ring the uDMA fills, the USB endpoint is fed straight from it */
+#define RX_HALF_SIZE 256
 
-/* RX Fifo buffer */
-static uint8_t buf_rx[FIFO_SIZE];
-/* Fifo in pointer, writes assumed to be atomic, should be only incremented within RX ISR */
-static uint8_t buf_rx_in;
-/* Fifo out pointer, writes assumed to be atomic, should be only incremented outside RX ISR */
-static uint8_t buf_rx_out;
+static uint8_t buf_rx[2 * RX_HALF_SIZE];
+static struct udma_ring rx_ring;
 
 void usbuart_init(void)
 {
@@ -57,19 +55,19 @@ void usbuart_init(void)
 	// Enable FIFO
 	uart_enable_fifo(USBUART);
 
-	// Set FIFO interrupt trigger levels to 1/8 full for RX buffer and
+	// Set FIFO trigger levels to 1/8 full for RX buffer and
 	// 7/8 empty (1/8 full) for TX buffer
 	uart_set_fifo_trigger_levels(USBUART, UART_FIFO_RX_TRIG_1_8, UART_FIFO_TX_TRIG_7_8);
 
-	uart_clear_interrupt_flag(USBUART, UART_INT_RX | UART_INT_RT);
-
-	/* Enable interrupts */
-	uart_enable_interrupts(UART0, UART_INT_RX| UART_INT_RT);
+	/* The uDMA takes the data, the interrupt is only its completion */
+	udma_ring_start(&rx_ring, USBUART, USBUART_DMA_CHAN,
+	                USBUART_DMA_ENC, buf_rx, RX_HALF_SIZE);
 
 	/* Finally enable the USART. */
 	uart_enable(USBUART);
 
-	//nvic_set_priority(USBUSART_IRQ, IRQ_PRI_USBUSART);
+	/* Same priority as USB, both send from the ring */
+	nvic_set_priority(USBUART_IRQ, IRQ_PRI_USB);
 	nvic_enable_irq(USBUART_IRQ);
 }
 
@@ -111,72 +109,47 @@ void usbuart_usb_out_cb(usbd_device *dev, uint8_t ep)
 		uart_send_blocking(USBUART, buf[i]);
 }
 
+/* Send from the ring for as long as the endpoint takes packets */
+static void usbuart_push(void)
+{
+	uint32_t in = udma_ring_in(&rx_ring);
+
+	/* forcibly empty fifo if no USB endpoint */
+	if (cdcacm_get_config() != 1) {
+		rx_ring.out += (in - udma_ring_out(&rx_ring)) &
+		               (sizeof(buf_rx) - 1);
+		return;
+	}
+
+	while (in != udma_ring_out(&rx_ring)) {
+		uint32_t out = udma_ring_out(&rx_ring);
+		uint32_t len = ((in > out) ? in : sizeof(buf_rx)) - out;
+		if (len > CDCACM_PACKET_SIZE)
+			len = CDCACM_PACKET_SIZE;
+		len = usbd_ep_write_packet(usbdev, CDCACM_UART_ENDPOINT,
+		                           &buf_rx[out], len);
+		if (!len)
+			break;
+		rx_ring.out += len;
+	}
+}
 
 void usbuart_usb_in_cb(usbd_device *dev, uint8_t ep)
 {
 	(void) dev;
 	(void) ep;
+	usbuart_push();
 }
 
-/*
- * Read a character from the UART RX and stuff it in a software FIFO.
- * Allowed to read from FIFO out pointer, but not write to it.
- * Allowed to write to FIFO in pointer.
- */
-void USBUART_ISR(void)
+/* Runs from SysTick, sending the partial half from the UART interrupt */
+void usbuart_tick(void)
 {
-	int flush = uart_is_interrupt_source(USBUART, UART_INT_RT);
-
-	while (!uart_is_rx_fifo_empty(USBUART)) {
-		char c = uart_recv(USBUART);
-
-		/* If the next increment of rx_in would put it at the same point
-		* as rx_out, the FIFO is considered full.
-		*/
-		if (((buf_rx_in + 1) % FIFO_SIZE) != buf_rx_out)
-		{
-			/* insert into FIFO */
-			buf_rx[buf_rx_in++] = c;
-
-			/* wrap out pointer */
-			if (buf_rx_in >= FIFO_SIZE)
-			{
-				buf_rx_in = 0;
-			}
-		} else {
-			flush = 1;
-		}
-	}
-
-	if (flush) {
-		/* forcibly empty fifo if no USB endpoint */
-		if (cdcacm_get_config() != 1)
-		{
-			buf_rx_out = buf_rx_in;
-			return;
-		}
-
-		uint8_t packet_buf[CDCACM_PACKET_SIZE];
-		uint8_t packet_size = 0;
-		uint8_t buf_out = buf_rx_out;
-
-		/* copy from uart FIFO into local usb packet buffer */
-		while (buf_rx_in != buf_out && packet_size < CDCACM_PACKET_SIZE)
-		{
-			packet_buf[packet_size++] = buf_rx[buf_out++];
-
-			/* wrap out pointer */
-			if (buf_out >= FIFO_SIZE)
-			{
-				buf_out = 0;
-			}
-
-		}
-
-		/* advance fifo out pointer by amount written */
-		buf_rx_out += usbd_ep_write_packet(usbdev,
-				CDCACM_UART_ENDPOINT, packet_buf, packet_size);
-		buf_rx_out %= FIFO_SIZE;
-	}
+	nvic_set_pending_irq(USBUART_IRQ);
 }
 
+/* A half is complete, or a tick asks for what has arrived so far */
+void USBUART_ISR(void)
+{
+	udma_ring_rearm(&rx_ring);
+	usbuart_push();
+}
@@ -0,0 +1,280 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* FreeRTOS task awareness.  GDB provides the addresses of the kernel's
+ * task lists through qSymbol, and at each stop the probe walks them with
+ * one read per task control block (TCB).  GDB then gets the thread list,
+ * names and registers from the probe instead of reading the lists itself
+ * a few bytes at a time.  Like OpenOCD, uxTopUsedPriority must be kept
+ * in the image to know how many ready lists there are.
+ */
+#include "general.h"
+#include "target.h"
+#include "rtos.h"
+
+/* FreeRTOS layout for 32-bit ports without MPU wrappers or list
+ * integrity checks, which is what OpenOCD and most IDEs assume */
+#define LIST_SIZE		20
+#define LIST_COUNT		0
+#define LIST_END		8
+#define LIST_END_NEXT		12
+#define ITEM_NEXT		4
+#define ITEM_OWNER		12
+#define TCB_TOP_OF_STACK	0
+#define TCB_STATE_ITEM		4
+#define TCB_EVENT_ITEM		24
+#ifndef RTOS_TCB_NAME
+#define RTOS_TCB_NAME		52
+#endif
+#define TCB_READ_SIZE		(RTOS_TCB_NAME + RTOS_NAME_MAX)
+
+/* Ready lists read in one go */
+#define READY_CHUNK		8
+#define PRIORITIES_MAX		256
+
+enum rtos_symbol {
+	SYM_CURRENT_TCB,
+	SYM_READY_LISTS,
+	SYM_TOP_PRIORITY,
+	SYM_DELAYED_1,
+	SYM_DELAYED_2,
+	SYM_PENDING_READY,
+	SYM_SUSPENDED,
+	SYM_TERMINATION,
+	SYM_COUNT,
+	SYM_REQUIRED = SYM_DELAYED_1,
+};
+
+static const char * const rtos_symbol_names[SYM_COUNT] = {
+	[SYM_CURRENT_TCB] = "pxCurrentTCB",
+	[SYM_READY_LISTS] = "pxReadyTasksLists",
+	[SYM_TOP_PRIORITY] = "uxTopUsedPriority",
+	[SYM_DELAYED_1] = "xDelayedTaskList1",
+	[SYM_DELAYED_2] = "xDelayedTaskList2",
+	[SYM_PENDING_READY] = "xPendingReadyList",
+	[SYM_SUSPENDED] = "xSuspendedTaskList",
+	[SYM_TERMINATION] = "xTasksWaitingTermination",
+};
+
+static struct {
+	bool enabled;
+	unsigned next_symbol;
+	uint32_t found;		/* Bit per symbol */
+	target_addr addr[SYM_COUNT];
+	/* Read from target t since it last ran */
+	target *t;
+	bool current_valid;
+	target_addr current;
+	bool threads_valid;
+	unsigned count;
+	struct rtos_thread threads[RTOS_THREADS_MAX];
+} rtos = {
+	.enabled = true,
+};
+
+static uint32_t rtos_get32(const uint8_t *p)
+{
+	uint32_t val;
+	memcpy(&val, p, sizeof(val));
+	return val;
+}
+
+void rtos_enable(bool enable)
+{
+	rtos.enabled = enable;
+	rtos_invalidate();
+}
+
+bool rtos_enabled(void) { return rtos.enabled; }
+
+void rtos_symbols_reset(void)
+{
+	rtos.next_symbol = 0;
+	rtos.found = 0;
+	rtos_invalidate();
+}
+
+const char *rtos_symbol_next(void)
+{
+	if (!rtos.enabled || (rtos.next_symbol >= SYM_COUNT))
+		return NULL;
+	return rtos_symbol_names[rtos.next_symbol];
+}
+
+void rtos_symbol_set(const char *name, bool found, target_addr addr)
+{
+	for (unsigned i = 0; i < SYM_COUNT; i++) {
+		if (strcmp(name, rtos_symbol_names[i]))
+			continue;
+		if (found) {
+			rtos.addr[i] = addr;
+			rtos.found |= 1 << i;
+		}
+		rtos.next_symbol = i + 1;
+	}
+}
+
+bool rtos_symbols_found(void)
+{
+	uint32_t required = (1 << SYM_REQUIRED) - 1;
+	return (rtos.found & required) == required;
+}
+
+void rtos_invalidate(void)
+{
+	rtos.current_valid = false;
+	rtos.threads_valid = false;
+}
+
+target_addr rtos_current(target *t)
+{
+	if (!rtos.enabled || !rtos_symbols_found())
+		return 0;
+	if (!rtos.current_valid || (rtos.t != t)) {
+		uint32_t tcb;
+		rtos_invalidate();
+		rtos.t = t;
+		rtos.current = 0;
+		if (!target_mem_read(t, &tcb, rtos.addr[SYM_CURRENT_TCB],
+		                     sizeof(tcb)))
+			rtos.current = tcb;
+		rtos.current_valid = true;
+	}
+	return rtos.current;
+}
+
+/* Add the tasks on a list, linked through the list item at item_off in
+ * each TCB.  The whole TCB header is read with each item. */
+static void rtos_list_walk(target *t, target_addr list, const uint8_t *hdr,
+                           unsigned item_off, enum rtos_state state)
+{
+	uint32_t n = rtos_get32(hdr + LIST_COUNT);
+	target_addr end = list + LIST_END;
+	target_addr item = rtos_get32(hdr + LIST_END_NEXT);
+	uint8_t tcb[TCB_READ_SIZE];
+
+	for (; n && (item != end) && (rtos.count < RTOS_THREADS_MAX); n--) {
+		target_addr id = item - item_off;
+		if (target_mem_read(t, tcb, id, sizeof(tcb)) ||
+		    (rtos_get32(tcb + item_off + ITEM_OWNER) != id))
+			return;
+
+		struct rtos_thread *th = &rtos.threads[rtos.count++];
+		th->id = id;
+		th->state = (id == rtos.current) ? RTOS_RUNNING : state;
+		memcpy(th->name, tcb + RTOS_TCB_NAME, RTOS_NAME_MAX);
+		th->name[RTOS_NAME_MAX] = 0;
+		item = rtos_get32(tcb + item_off + ITEM_NEXT);
+	}
+}
+
+static void rtos_list_read(target *t, enum rtos_symbol sym,
+                           unsigned item_off, enum rtos_state state)
+{
+	uint8_t hdr[LIST_SIZE];
+
+	if (!(rtos.found & (1 << sym)) ||
+	    target_mem_read(t, hdr, rtos.addr[sym], sizeof(hdr)))
+		return;
+	rtos_list_walk(t, rtos.addr[sym], hdr, item_off, state);
+}
+
+static void rtos_threads_read(target *t)
+{
+	uint8_t lists[READY_CHUNK * LIST_SIZE];
+	uint32_t top;
+
+	rtos.count = 0;
+	if (target_mem_read(t, &top, rtos.addr[SYM_TOP_PRIORITY], sizeof(top)))
+		return;
+	unsigned prios = MIN(top + 1, PRIORITIES_MAX);
+
+	/* The ready lists are an array, read a few headers at a time */
+	for (unsigned p = 0; p < prios; p += READY_CHUNK) {
+		unsigned n = MIN(READY_CHUNK, prios - p);
+		target_addr base = rtos.addr[SYM_READY_LISTS] + p * LIST_SIZE;
+		if (target_mem_read(t, lists, base, n * LIST_SIZE))
+			return;
+		for (unsigned i = 0; i < n; i++)
+			rtos_list_walk(t, base + i * LIST_SIZE,
+			               lists + i * LIST_SIZE, TCB_STATE_ITEM,
+			               RTOS_READY);
+	}
+	rtos_list_read(t, SYM_DELAYED_1, TCB_STATE_ITEM, RTOS_BLOCKED);
+	rtos_list_read(t, SYM_DELAYED_2, TCB_STATE_ITEM, RTOS_BLOCKED);
+	/* Tasks readied while the scheduler was suspended */
+	rtos_list_read(t, SYM_PENDING_READY, TCB_EVENT_ITEM, RTOS_READY);
+	rtos_list_read(t, SYM_SUSPENDED, TCB_STATE_ITEM, RTOS_SUSPENDED);
+	rtos_list_read(t, SYM_TERMINATION, TCB_STATE_ITEM, RTOS_DELETED);
+}
+
+const struct rtos_thread *rtos_threads(target *t, unsigned *count)
+{
+	if (!rtos_current(t))
+		return NULL;
+	if (!rtos.threads_valid) {
+		rtos_threads_read(t);
+		rtos.threads_valid = true;
+	}
+	*count = rtos.count;
+	return rtos.count ? rtos.threads : NULL;
+}
+
+const struct rtos_thread *rtos_thread(target *t, target_addr id)
+{
+	unsigned count;
+	const struct rtos_thread *th = rtos_threads(t, &count);
+
+	for (unsigned i = 0; th && (i < count); i++)
+		if (th[i].id == id)
+			return &th[i];
+	return NULL;
+}
+
+const char *rtos_state_name(enum rtos_state state)
+{
+	switch (state) {
+	case RTOS_RUNNING:
+		return "Running";
+	case RTOS_READY:
+		return "Ready";
+	case RTOS_BLOCKED:
+		return "Blocked";
+	case RTOS_SUSPENDED:
+		return "Suspended";
+	default:
+		return "Deleted";
+	}
+}
+
+ssize_t rtos_reg_read(target *t, target_addr id, int reg, void *data,
+                      size_t max)
+{
+	uint32_t sp;
+
+	if (!id || (id == rtos_current(t))) {
+		if (reg >= 0)
+			return target_reg_read(t, reg, data, max);
+		if (max < target_regs_size(t))
+			return -1;
+		target_regs_read(t, data);
+		return target_regs_size(t);
+	}
+	if (target_mem_read(t, &sp, id + TCB_TOP_OF_STACK, sizeof(sp)))
+		return -1;
+	return target_thread_reg_read(t, sp, reg, data, max);
+}
@@ -0,0 +1,190 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* SEGGER RTT compatible channel.  While the target runs, up buffer 0 of
+ * the _SEGGER_RTT control block is drained to the platform's RTT port and
+ * data from the port is written into down buffer 0.  Nothing on the
+ * target is halted, the buffers are polled between halt polls and the
+ * rate backs off while they are idle.
+ */
+#include "general.h"
+#include "target.h"
+#include "rtt.h"
+
+/* Control block: ID, then the up and down buffer counts and descriptors */
+#define RTT_ID			"SEGGER RTT"
+#define RTT_CB_MAX_UP		16
+#define RTT_CB_BUFFERS		24
+/* Buffer descriptor: name, then these four words, then flags */
+#define RTT_BUF_DESC_SIZE	24
+#define RTT_BUF_PTR		4
+#define RTT_BUF_WROFF		12
+#define RTT_BUF_RDOFF		16
+
+/* Poll interval in ms, shortest while data moves, longest while idle and
+ * between attempts to find the control block */
+#define RTT_POLL_MIN		1
+#define RTT_POLL_MAX		32
+#define RTT_FIND_INTERVAL	1000
+
+#define RTT_CHUNK		64
+
+static struct {
+	bool enabled;
+	target_addr addr;	/* Set by the user, 0 to search */
+	target *t;		/* Target the control block was found on */
+	target_addr cb;	/* 0 until found */
+	uint32_t interval;
+	uint32_t next;
+} rtt;
+
+void rtt_enable(bool enable)
+{
+	rtt.enabled = enable;
+	rtt.cb = 0;
+	rtt.next = platform_time_ms();
+	rtt_if_enable(enable);
+}
+
+bool rtt_enabled(void) { return rtt.enabled; }
+
+void rtt_set_address(target_addr addr)
+{
+	rtt.addr = addr;
+	rtt.cb = 0;
+}
+
+target_addr rtt_address(void) { return rtt.addr; }
+
+bool rtt_found(target_addr *addr)
+{
+	*addr = rtt.cb;
+	return rtt.cb != 0;
+}
+
+static bool rtt_find(target *t)
+{
+	char id[sizeof(RTT_ID)];
+	target_addr cb = rtt.addr;
+
+	if (cb == 0) {
+		if (!target_ram_search(t, RTT_ID, sizeof(RTT_ID), &cb))
+			return false;
+	} else if (target_mem_read(t, id, cb, sizeof(id)) ||
+	           memcmp(id, RTT_ID, sizeof(id))) {
+		return false;
+	}
+	rtt.t = t;
+	rtt.cb = cb;
+	return true;
+}
+
+/* Pointer, size, write and read offsets of a buffer, false if they are
+ * unreadable or make no sense */
+static bool rtt_buf_read(target *t, target_addr desc, uint32_t *buf)
+{
+	if (target_mem_read(t, buf, desc + RTT_BUF_PTR, 4 * sizeof(uint32_t)))
+		return false;
+	return (buf[1] != 0) && (buf[2] < buf[1]) && (buf[3] < buf[1]);
+}
+
+/* Each returns the number of bytes moved, or -1 if the control block
+ * looks lost */
+static int rtt_up(target *t)
+{
+	target_addr desc = rtt.cb + RTT_CB_BUFFERS;
+	uint32_t buf[4];
+	uint8_t data[RTT_CHUNK];
+
+	if (!rtt_buf_read(t, desc, buf))
+		return -1;
+	uint32_t size = buf[1], wr = buf[2], rd = buf[3];
+	if (wr == rd)
+		return 0;
+
+	/* Only the contiguous part, the rest goes next time */
+	size_t len = MIN(((wr > rd) ? wr : size) - rd, sizeof(data));
+	if (target_mem_read(t, data, buf[0] + rd, len))
+		return -1;
+	len = rtt_if_write(data, len);
+	if (len) {
+		rd = (rd + len) % size;
+		if (target_mem_write(t, desc + RTT_BUF_RDOFF, &rd, sizeof(rd)))
+			return -1;
+	}
+	return len;
+}
+
+static int rtt_down(target *t)
+{
+	uint32_t max_up;
+	uint32_t buf[4];
+	uint8_t data[RTT_CHUNK];
+
+	if (target_mem_read(t, &max_up, rtt.cb + RTT_CB_MAX_UP, sizeof(max_up)))
+		return -1;
+	target_addr desc = rtt.cb + RTT_CB_BUFFERS +
+	                   max_up * RTT_BUF_DESC_SIZE;
+	if (!rtt_buf_read(t, desc, buf))
+		return 0;	/* No down buffer */
+	uint32_t size = buf[1], wr = buf[2], rd = buf[3];
+
+	/* Free contiguous space, leaving one byte so full isn't empty */
+	size_t len = (wr >= rd) ? size - wr - (rd == 0) : rd - wr - 1;
+	len = rtt_if_read(data, MIN(len, sizeof(data)));
+	if (len == 0)
+		return 0;
+	if (target_mem_write(t, buf[0] + wr, data, len))
+		return -1;
+	wr = (wr + len) % size;
+	if (target_mem_write(t, desc + RTT_BUF_WROFF, &wr, sizeof(wr)))
+		return -1;
+	return len;
+}
+
+uint32_t rtt_poll(target *t)
+{
+	if (!rtt.enabled)
+		return UINT32_MAX;
+
+	uint32_t now = platform_time_ms();
+	if ((int32_t)(now - rtt.next) < 0)
+		return rtt.next - now;
+
+	if ((rtt.cb == 0) || (rtt.t != t)) {
+		rtt.cb = 0;
+		if (!rtt_find(t)) {
+			rtt.next = now + RTT_FIND_INTERVAL;
+			return RTT_FIND_INTERVAL;
+		}
+		rtt.interval = RTT_POLL_MIN;
+	}
+
+	int up = rtt_up(t);
+	int down = (up < 0) ? -1 : rtt_down(t);
+	if ((up < 0) || (down < 0)) {
+		/* Memory was reused or the target reset, search again */
+		rtt.cb = 0;
+		rtt.interval = RTT_POLL_MIN;
+	} else if (up || down) {
+		rtt.interval = RTT_POLL_MIN;
+	} else {
+		rtt.interval = MIN(rtt.interval * 2, RTT_POLL_MAX);
+	}
+	rtt.next = now + rtt.interval;
+	return rtt.interval;
+}
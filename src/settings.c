@@ -0,0 +1,130 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This file implements the store of probe settings.  Values are records
+ * of a key, a 16-bit length and the data, following a header with their total
+ * length and CRC.  They are all rewritten on each save, which is rare
+ * enough for the store's sector to outlive the probe.
+ */
+
+#include "general.h"
+#include "target.h"
+#include "crc32.h"
+#include "settings.h"
+
+#define SETTINGS_MAGIC	0x53504d42	/* "BMPS" */
+#ifndef SETTINGS_BUFFER_SIZE
+#define SETTINGS_BUFFER_SIZE	1024
+#endif
+
+struct settings_header {
+	uint32_t magic;
+	uint32_t size;
+	uint32_t crc;	/* Of the records */
+};
+
+/* Records of the save in progress, kept in whole words */
+static uint32_t settings_buffer[SETTINGS_BUFFER_SIZE / 4];
+static size_t settings_len;
+static bool settings_overflow;
+
+void settings_begin(void)
+{
+	settings_len = 0;
+	settings_overflow = false;
+}
+
+bool settings_put(uint8_t key, const void *data, size_t len)
+{
+	uint8_t *p = (uint8_t *)settings_buffer + settings_len;
+
+	if (settings_len + 3 + len > sizeof(settings_buffer)) {
+		settings_overflow = true;
+		return false;
+	}
+	p[0] = key;
+	p[1] = len;
+	p[2] = len >> 8;
+	memcpy(p + 3, data, len);
+	settings_len += 3 + len;
+	return true;
+}
+
+bool settings_save(void)
+{
+	struct settings_header h = {
+		.magic = SETTINGS_MAGIC,
+		.size = settings_len,
+	};
+	size_t words = (settings_len + 3) & ~3;
+
+	if (settings_overflow ||
+	    (sizeof(h) + words > settings_if_size()))
+		return false;
+	/* Padding is erased flash */
+	memset((uint8_t *)settings_buffer + settings_len, 0xff,
+	       words - settings_len);
+	h.crc = crc32_buf(settings_buffer, settings_len);
+
+	return settings_if_erase() &&
+	       settings_if_write(sizeof(h), settings_buffer, words) &&
+	       settings_if_write(0, &h, sizeof(h));
+}
+
+bool settings_clear(void)
+{
+	return settings_if_erase();
+}
+
+/* Stored records, NULL if there are none */
+static const uint8_t *settings_records(size_t *size)
+{
+	const struct settings_header *h = (const void *)settings_if_base();
+
+	if ((h->magic != SETTINGS_MAGIC) ||
+	    (h->size > settings_if_size() - sizeof(*h)) ||
+	    (crc32_buf(h + 1, h->size) != h->crc))
+		return NULL;
+	*size = h->size;
+	return (const uint8_t *)(h + 1);
+}
+
+size_t settings_size(void)
+{
+	size_t size = 0;
+	settings_records(&size);
+	return size;
+}
+
+int settings_get(uint8_t key, void *data, size_t max)
+{
+	size_t size;
+	const uint8_t *p = settings_records(&size);
+
+	if (!p)
+		return -1;
+	for (size_t i = 0; i + 3 <= size; ) {
+		size_t len = p[i + 1] | (p[i + 2] << 8);
+		if ((p[i] == key) && (i + 3 + len <= size)) {
+			if (data)
+				memcpy(data, p + i + 3, MIN(len, max));
+			return len;
+		}
+		i += 3 + len;
+	}
+	return -1;
+}
@@ -0,0 +1,149 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Compressed memory snapshots.  Target memory is read a chunk at a time
+ * and run length encoded as GDB asks for the stream, so only the chunk
+ * and the records not yet sent are held on the probe.  Runs of 0x00 in
+ * RAM and 0xFF in erased flash, which fill most images, cost 3 bytes per
+ * 32 KiB.
+ */
+#include "general.h"
+#include "target.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_CHUNK		256
+#define SNAPSHOT_LIT_MAX	128
+#define SNAPSHOT_RUN_MIN	4
+#define SNAPSHOT_RUN_MAX	(0x7FFF + SNAPSHOT_RUN_MIN)
+/* Records encoded but not yet sent, room for those from one byte */
+#define SNAPSHOT_PEND		(2 * (SNAPSHOT_LIT_MAX + 1) + 3)
+
+static struct {
+	target *t;
+	target_addr addr;
+	uint32_t len;
+	uint32_t offset;	/* Of the next byte of the stream */
+	target_addr next;	/* Next address to read */
+	bool done;		/* Final records encoded */
+	uint8_t chunk[SNAPSHOT_CHUNK];
+	unsigned chunk_len, chunk_pos;
+	uint8_t lit[SNAPSHOT_LIT_MAX];
+	unsigned lit_len;
+	uint8_t run_val;
+	uint32_t run_len;
+	uint8_t pend[SNAPSHOT_PEND];
+	unsigned pend_len, pend_pos;
+} snap;
+
+static void snapshot_lit_flush(void)
+{
+	if (!snap.lit_len)
+		return;
+	snap.pend[snap.pend_len++] = snap.lit_len - 1;
+	memcpy(snap.pend + snap.pend_len, snap.lit, snap.lit_len);
+	snap.pend_len += snap.lit_len;
+	snap.lit_len = 0;
+}
+
+/* A run too short to be worth a record joins the literals */
+static void snapshot_run_flush(void)
+{
+	if (snap.run_len >= SNAPSHOT_RUN_MIN) {
+		uint32_t n = snap.run_len - SNAPSHOT_RUN_MIN;
+		snapshot_lit_flush();
+		snap.pend[snap.pend_len++] = 0x80 | (n >> 8);
+		snap.pend[snap.pend_len++] = n & 0xff;
+		snap.pend[snap.pend_len++] = snap.run_val;
+	} else {
+		while (snap.run_len--) {
+			snap.lit[snap.lit_len++] = snap.run_val;
+			if (snap.lit_len == SNAPSHOT_LIT_MAX)
+				snapshot_lit_flush();
+		}
+	}
+	snap.run_len = 0;
+}
+
+static void snapshot_push(uint8_t b)
+{
+	if (snap.run_len && (b == snap.run_val) &&
+	    (snap.run_len < SNAPSHOT_RUN_MAX)) {
+		snap.run_len++;
+		return;
+	}
+	snapshot_run_flush();
+	snap.run_val = b;
+	snap.run_len = 1;
+}
+
+/* Encode more of the region into the pending records */
+static int snapshot_encode(void)
+{
+	while (snap.pend_len <= SNAPSHOT_PEND - (SNAPSHOT_LIT_MAX + 4)) {
+		if (snap.chunk_pos == snap.chunk_len) {
+			uint32_t left = snap.addr + snap.len - snap.next;
+			if (left == 0) {
+				snapshot_run_flush();
+				snapshot_lit_flush();
+				snap.done = true;
+				return 0;
+			}
+			snap.chunk_len = MIN(left, SNAPSHOT_CHUNK);
+			snap.chunk_pos = 0;
+			if (target_mem_read(snap.t, snap.chunk, snap.next,
+			                    snap.chunk_len))
+				return -1;
+			snap.next += snap.chunk_len;
+		}
+		snapshot_push(snap.chunk[snap.chunk_pos++]);
+	}
+	return 0;
+}
+
+int snapshot_read(target *t, target_addr addr, uint32_t len,
+                  uint32_t offset, uint8_t *buf, size_t size)
+{
+	if (offset == 0) {
+		memset(&snap, 0, sizeof(snap));
+		snap.t = t;
+		snap.addr = snap.next = addr;
+		snap.len = len;
+	} else if ((t != snap.t) || (addr != snap.addr) || (len != snap.len) ||
+	           (offset != snap.offset)) {
+		return -1;
+	}
+
+	size_t n = 0;
+	while (n < size) {
+		if (snap.pend_pos == snap.pend_len) {
+			snap.pend_pos = snap.pend_len = 0;
+			if (snap.done)
+				break;
+			if (snapshot_encode()) {
+				snap.t = NULL;
+				return -1;
+			}
+			continue;
+		}
+		size_t chunk = MIN(size - n, snap.pend_len - snap.pend_pos);
+		memcpy(buf + n, snap.pend + snap.pend_pos, chunk);
+		snap.pend_pos += chunk;
+		n += chunk;
+	}
+	snap.offset += n;
+	return n;
+}
@@ -28,6 +28,11 @@
 #include "cortexm.h"
 #include "exception.h"
 
+/* How long a DP may take to acknowledge the power up requests, in ms */
+#ifndef ADIV5_DP_POWER_UP_TIMEOUT
+#define ADIV5_DP_POWER_UP_TIMEOUT	1000
+#endif
+
 #ifndef DO_RESET_SEQ
 #define DO_RESET_SEQ 0
 #endif
@@ -105,11 +110,16 @@ static const char * const cidc_debug_strings[] =
 #define PIDR_REV_MASK 0x0FFF00000ULL /* Revision bits. */
 #define PIDR_PN_MASK  0x000000FFFULL /* Part number bits. */
 #define PIDR_ARM_BITS 0x4000BB000ULL /* These make up the ARM JEP-106 code. */
+#define PIDR_JEP106_USED  0x000080000ULL
+#define PIDR_JEP106_CODE_SHIFT 12
+#define PIDR_JEP106_CONT_SHIFT 32
 
 enum arm_arch {
 	aa_nosupport,
 	aa_cortexm,
 	aa_cortexa,
+	aa_cti,
+	aa_mtb,
 	aa_end
 };
 
@@ -173,7 +183,7 @@ static const struct {
 	{0x00d, aa_nosupport, cidc_unknown, PIDR_PN_BIT_STRINGS("CoreSight ETM11", "(Embedded Trace)")},
 	{0x490, aa_nosupport, cidc_unknown, PIDR_PN_BIT_STRINGS("Cortex-A15 GIC", "(Generic Interrupt Controller)")},
 	{0x4c7, aa_nosupport, cidc_unknown, PIDR_PN_BIT_STRINGS("Cortex-M7 PPB",  "(Private Peripheral Bus ROM Table)")},
-	{0x906, aa_nosupport, cidc_unknown, PIDR_PN_BIT_STRINGS("CoreSight CTI",  "(Cross Trigger)")},
+	{0x906, aa_cti,       cidc_unknown, PIDR_PN_BIT_STRINGS("CoreSight CTI",  "(Cross Trigger)")},
 	{0x907, aa_nosupport, cidc_unknown, PIDR_PN_BIT_STRINGS("CoreSight ETB",  "(Trace Buffer)")},
 	{0x908, aa_nosupport, cidc_unknown, PIDR_PN_BIT_STRINGS("CoreSight CSTF", "(Trace Funnel)")},
 	{0x910, aa_nosupport, cidc_unknown, PIDR_PN_BIT_STRINGS("CoreSight ETM9", "(Embedded Trace)")},
@@ -183,11 +193,12 @@ static const struct {
 	{0x917, aa_nosupport, cidc_unknown, PIDR_PN_BIT_STRINGS("CoreSight HTM",  "(AHB Trace Macrocell)")},
 	{0x920, aa_nosupport, cidc_unknown, PIDR_PN_BIT_STRINGS("CoreSight ETM11", "(Embedded Trace)")},
 	{0x921, aa_nosupport, cidc_unknown, PIDR_PN_BIT_STRINGS("Cortex-A8 ETM",  "(Embedded Trace)")},
-	{0x922, aa_nosupport, cidc_unknown, PIDR_PN_BIT_STRINGS("Cortex-A8 CTI",  "(Cross Trigger)")},
+	{0x922, aa_cti,       cidc_unknown, PIDR_PN_BIT_STRINGS("Cortex-A8 CTI",  "(Cross Trigger)")},
 	{0x923, aa_nosupport, cidc_unknown, PIDR_PN_BIT_STRINGS("Cortex-M3 TPIU", "(Trace Port Interface Unit)")},
 	{0x924, aa_nosupport, cidc_unknown, PIDR_PN_BIT_STRINGS("Cortex-M3 ETM",  "(Embedded Trace)")},
 	{0x925, aa_nosupport, cidc_unknown, PIDR_PN_BIT_STRINGS("Cortex-M4 ETM",  "(Embedded Trace)")},
 	{0x930, aa_nosupport, cidc_unknown, PIDR_PN_BIT_STRINGS("Cortex-R4 ETM",  "(Embedded Trace)")},
+	{0x932, aa_mtb,       cidc_unknown, PIDR_PN_BIT_STRINGS("MTB-M0+",        "(Micro Trace Buffer)")},
 	{0x941, aa_nosupport, cidc_unknown, PIDR_PN_BIT_STRINGS("CoreSight TPIU-Lite", "(Trace Port Interface Unit)")},
 	{0x950, aa_nosupport, cidc_unknown, PIDR_PN_BIT_STRINGS("CoreSight Component", "(unidentified Cortex-A9 component)")},
 	{0x955, aa_nosupport, cidc_unknown, PIDR_PN_BIT_STRINGS("CoreSight Component", "(unidentified Cortex-A5 component)")},
@@ -209,6 +220,7 @@ static const struct {
 };
 
 extern bool cortexa_probe(ADIv5_AP_t *apb, uint32_t debug_base);
+extern void cortexa_cti_probe(ADIv5_AP_t *apb, uint32_t cti_base);
 
 void adiv5_dp_ref(ADIv5_DP_t *dp)
 {
@@ -236,40 +248,221 @@ void adiv5_ap_unref(ADIv5_AP_t *ap)
 
 void adiv5_dp_write(ADIv5_DP_t *dp, uint16_t addr, uint32_t value)
 {
-	dp->low_access(dp, ADIV5_LOW_WRITE, addr, value);
+	adiv5_dp_low_access(dp, ADIV5_LOW_WRITE, addr, value);
 }
 
-static uint32_t adiv5_mem_read32(ADIv5_AP_t *ap, uint32_t addr)
+void adiv5_dp_queue(ADIv5_DP_t *dp, uint8_t RnW, uint16_t addr,
+                    uint32_t value, uint32_t *result)
 {
-	uint32_t ret;
-	adiv5_mem_read(ap, &ret, addr, sizeof(ret));
-	return ret;
+	if (dp->queue_len == ADIV5_DP_QUEUE_LEN)
+		dp->flush(dp);
+
+	struct adiv5_dp_txn *txn = &dp->queue[dp->queue_len++];
+	txn->RnW = RnW;
+	txn->addr = addr;
+	txn->value = value;
+	txn->result = result;
+}
+
+/* Execute queued transactions one by one, for transports that gain
+ * nothing from knowing about the following transactions. */
+void adiv5_dp_flush_generic(ADIv5_DP_t *dp)
+{
+	unsigned len = dp->queue_len;
+
+	/* Empty the queue first, so an exception leaves it consistent */
+	dp->queue_len = 0;
+	for (unsigned i = 0; i < len; i++) {
+		struct adiv5_dp_txn *txn = &dp->queue[i];
+		uint32_t ret = dp->low_access(dp, txn->RnW, txn->addr, txn->value);
+		if (txn->result)
+			*txn->result = ret;
+	}
+}
+
+/* Raise the exception for a status returned by the try_ accesses */
+void adiv5_dp_raise(int status)
+{
+	switch (status) {
+	case ADIV5_DP_OK:
+		break;
+	case ADIV5_DP_WAIT:
+		raise_exception(EXCEPTION_TIMEOUT, "DP ACK timeout");
+		break;
+	case ADIV5_DP_NOACK:
+		raise_exception(EXCEPTION_ERROR, "DP invalid ACK");
+		break;
+	case ADIV5_DP_PARITY:
+		raise_exception(EXCEPTION_ERROR, "DP parity error");
+		break;
+	default:
+		raise_exception(EXCEPTION_ERROR, "DP access failed");
+		break;
+	}
+}
+
+static int adiv5_dp_status(uint32_t type)
+{
+	if (!type)
+		return ADIV5_DP_OK;
+	return (type == EXCEPTION_TIMEOUT) ? ADIV5_DP_WAIT : ADIV5_DP_FAILED;
+}
+
+int adiv5_dp_try_low_access_generic(ADIv5_DP_t *dp, uint8_t RnW,
+                                    uint16_t addr, uint32_t value,
+                                    uint32_t *result)
+{
+	volatile struct exception e;
+
+	*result = 0;
+	TRY_CATCH (e, EXCEPTION_ALL) {
+		*result = dp->low_access(dp, RnW, addr, value);
+	}
+	return adiv5_dp_status(e.type);
+}
+
+int adiv5_dp_try_flush_generic(ADIv5_DP_t *dp)
+{
+	volatile struct exception e;
+
+	TRY_CATCH (e, EXCEPTION_ALL) {
+		dp->flush(dp);
+	}
+	return adiv5_dp_status(e.type);
+}
+
+/* Topology found by the last full scan of each DP.  A later scan of a DP
+ * with the same IDCODE and TARGETSEL, whose APs still report the same IDR
+ * and BASE, skips the AP search and ROM table walk and probes the known
+ * cores.
+ */
+#define SCAN_CACHE_DPS		4
+#define SCAN_CACHE_APS		4
+#define SCAN_CACHE_CORES	4
+
+struct scan_cache {
+	uint32_t idcode;	/* 0 while unused or incomplete */
+	uint32_t targetsel;	/* SW-DP multi-drop devices share idcode */
+	uint8_t ap_count;
+	struct {
+		uint8_t apsel;
+		uint32_t idr;
+		uint32_t base;
+	} ap[SCAN_CACHE_APS];
+	uint8_t core_count;
+	struct {
+		uint8_t apsel;
+		uint8_t arch;
+		uint16_t designer;
+		uint32_t addr;
+	} core[SCAN_CACHE_CORES];
+};
+
+static struct scan_cache scan_cache[SCAN_CACHE_DPS];
+
+uint8_t adiv5_ap_gap = 8;
+uint8_t adiv5_ap_list[ADIV5_AP_LIST_MAX];
+uint8_t adiv5_ap_list_len;
+/* Entry filled in by the full scan in progress, NULL if not recording */
+static struct scan_cache *scan_record;
+
+void adiv5_scan_cache_flush(void)
+{
+	memset(scan_cache, 0, sizeof(scan_cache));
+}
+
+size_t adiv5_scan_cache_get(const void **data)
+{
+	*data = scan_cache;
+	return sizeof(scan_cache);
+}
+
+bool adiv5_scan_cache_set(const void *data, size_t len)
+{
+	if (len != sizeof(scan_cache))
+		return false;
+	memcpy(scan_cache, data, len);
+	return true;
+}
+
+static struct scan_cache *scan_cache_find(const ADIv5_DP_t *dp)
+{
+	for (int i = 0; i < SCAN_CACHE_DPS; i++)
+		if (dp->idcode && (scan_cache[i].idcode == dp->idcode) &&
+		    (scan_cache[i].targetsel == dp->targetsel))
+			return &scan_cache[i];
+	return NULL;
 }
 
-static void adiv5_component_probe(ADIv5_AP_t *ap, uint32_t addr)
+static void scan_cache_start(const ADIv5_DP_t *dp)
+{
+	scan_record = scan_cache_find(dp);
+	for (int i = 0; (scan_record == NULL) && (i < SCAN_CACHE_DPS); i++)
+		if (scan_cache[i].idcode == 0)
+			scan_record = &scan_cache[i];
+	if (scan_record == NULL)
+		scan_record = &scan_cache[SCAN_CACHE_DPS - 1];
+	memset(scan_record, 0, sizeof(*scan_record));
+}
+
+static void scan_cache_ap(ADIv5_AP_t *ap)
+{
+	if (scan_record == NULL)
+		return;
+	if (scan_record->ap_count == SCAN_CACHE_APS) {
+		scan_record = NULL;
+		return;
+	}
+	scan_record->ap[scan_record->ap_count].apsel = ap->apsel;
+	scan_record->ap[scan_record->ap_count].idr = ap->idr;
+	scan_record->ap[scan_record->ap_count].base = ap->base;
+	scan_record->ap_count++;
+}
+
+static void scan_cache_core(ADIv5_AP_t *ap, enum arm_arch arch, uint32_t addr)
+{
+	if (scan_record == NULL)
+		return;
+	if (scan_record->core_count == SCAN_CACHE_CORES) {
+		scan_record = NULL;
+		return;
+	}
+	scan_record->core[scan_record->core_count].apsel = ap->apsel;
+	scan_record->core[scan_record->core_count].arch = arch;
+	scan_record->core[scan_record->core_count].designer = ap->designer;
+	scan_record->core[scan_record->core_count].addr = addr;
+	scan_record->core_count++;
+}
+
+/* Entries read from a ROM table at a time */
+#define ROM_TABLE_CHUNK 8
+
+/* Nesting of ROM tables followed, which bounds the recursion below even
+ * when a table points back at itself */
+#define ROM_TABLE_DEPTH_MAX 4
+
+static void adiv5_component_probe(ADIv5_AP_t *ap, uint32_t addr, int depth)
 {
 	addr &= ~3;
 	uint64_t pidr = 0;
 	uint32_t cidr = 0;
+	/* PIDR4-7, PIDR0-3 and CIDR0-3, read in one burst */
+	uint32_t id[12];
+
+	adiv5_mem_read(ap, id, addr + PIDR4_OFFSET, sizeof(id));
 
 	/* Assemble logical Product ID register value. */
-	for (int i = 0; i < 4; i++) {
-		uint32_t x = adiv5_mem_read32(ap, addr + PIDR0_OFFSET + 4*i);
-		pidr |= (x & 0xff) << (i * 8);
-	}
-	{
-		uint32_t x = adiv5_mem_read32(ap, addr + PIDR4_OFFSET);
-		pidr |= (uint64_t)x << 32;
-	}
+	for (int i = 0; i < 4; i++)
+		pidr |= (id[(PIDR0_OFFSET - PIDR4_OFFSET) / 4 + i] & 0xff) << (i * 8);
+	pidr |= (uint64_t)id[0] << 32;
 
 	/* Assemble logical Component ID register value. */
-	for (int i = 0; i < 4; i++) {
-		uint32_t x = adiv5_mem_read32(ap, addr + CIDR0_OFFSET + 4*i);
-		cidr |= ((uint64_t)(x & 0xff)) << (i * 8);
-	}
+	for (int i = 0; i < 4; i++)
+		cidr |= (id[(CIDR0_OFFSET - PIDR4_OFFSET) / 4 + i] & 0xff) << (i * 8);
 
 	if (adiv5_dp_error(ap->dp)) {
 		DEBUG("Fault reading ID registers\n");
+		scan_record = NULL;
 		return;
 	}
 
@@ -284,11 +477,26 @@ static void adiv5_component_probe(ADIv5_AP_t *ap, uint32_t addr)
 	uint32_t cid_class = (cidr & CID_CLASS_MASK) >> CID_CLASS_SHIFT;
 
 	if (cid_class == cidc_romtab) { /* ROM table, probe recursively */
+		if (depth > ROM_TABLE_DEPTH_MAX) {
+			DEBUG("0x%"PRIx32": ROM table nested too deep\n", addr);
+			return;
+		}
+		/* The top level table identifies the silicon vendor */
+		if ((ap->designer == 0) && (pidr & PIDR_JEP106_USED))
+			ap->designer =
+				(((pidr >> PIDR_JEP106_CONT_SHIFT) & 0xf) << 8) |
+				((pidr >> PIDR_JEP106_CODE_SHIFT) & 0x7f);
+		uint32_t entries[ROM_TABLE_CHUNK];
 		for (int i = 0; i < 256; i++) {
-			uint32_t entry = adiv5_mem_read32(ap, addr + i*4);
-			if (adiv5_dp_error(ap->dp)) {
-				DEBUG("Fault reading ROM table entry\n");
+			if ((i % ROM_TABLE_CHUNK) == 0) {
+				adiv5_mem_read(ap, entries, addr + i*4,
+				               sizeof(entries));
+				if (adiv5_dp_error(ap->dp)) {
+					DEBUG("Fault reading ROM table entry\n");
+					scan_record = NULL;
+				}
 			}
+			uint32_t entry = entries[i % ROM_TABLE_CHUNK];
 
 			if (entry == 0)
 				break;
@@ -296,7 +504,8 @@ static void adiv5_component_probe(ADIv5_AP_t *ap, uint32_t addr)
 			if ((entry & 1) == 0)
 				continue;
 
-			adiv5_component_probe(ap, addr + (entry & ~0xfff));
+			adiv5_component_probe(ap, addr + (entry & ~0xfff),
+			                      depth + 1);
 		}
 	} else {
 		/* Check if the component was designed by ARM, we currently do not support,
@@ -332,12 +541,25 @@ static void adiv5_component_probe(ADIv5_AP_t *ap, uint32_t addr)
 				switch (pidr_pn_bits[i].arch) {
 				case aa_cortexm:
 					DEBUG("-> cortexm_probe\n");
+					scan_cache_core(ap, aa_cortexm, addr);
 					cortexm_probe(ap);
 					break;
 				case aa_cortexa:
 					DEBUG("-> cortexa_probe\n");
+					scan_cache_core(ap, aa_cortexa, addr);
 					cortexa_probe(ap, addr);
 					break;
+				case aa_mtb:
+					/* Used by the Cortex-M driver, whichever
+					 * order the core and MTB are listed in */
+					scan_cache_core(ap, aa_mtb, addr);
+					ap->mtb = addr;
+					break;
+				case aa_cti:
+					DEBUG("-> cortexa_cti_probe\n");
+					scan_cache_core(ap, aa_cti, addr);
+					cortexa_cti_probe(ap, addr);
+					break;
 				default:
 					break;
 				}
@@ -386,30 +608,134 @@ ADIv5_AP_t *adiv5_new_ap(ADIv5_DP_t *dp, uint8_t apsel)
 }
 
 
-void adiv5_dp_init(ADIv5_DP_t *dp)
+/* Only there when the Kinetis driver is in the build */
+extern void kinetis_mdm_probe(ADIv5_AP_t *) __attribute__((weak));
+
+/* Probe the cores of a cached topology, if the APs still match it */
+static bool adiv5_dp_cached_init(ADIv5_DP_t *dp)
 {
-	volatile uint32_t ctrlstat = 0;
+	struct scan_cache *c = scan_cache_find(dp);
+	ADIv5_AP_t *aps[SCAN_CACHE_APS];
+	int n;
 
-	adiv5_dp_ref(dp);
+	if (c == NULL)
+		return false;
 
-	volatile struct exception e;
-	TRY_CATCH (e, EXCEPTION_TIMEOUT) {
-		ctrlstat = adiv5_dp_read(dp, ADIV5_DP_CTRLSTAT);
+	for (n = 0; n < c->ap_count; n++) {
+		aps[n] = adiv5_new_ap(dp, c->ap[n].apsel);
+		if ((aps[n] == NULL) || (aps[n]->idr != c->ap[n].idr) ||
+		    (aps[n]->base != c->ap[n].base))
+			break;
+	}
+	if (n < c->ap_count) {
+		DEBUG("AP %d changed, full scan\n", c->ap[n].apsel);
+		for (int i = 0; i <= n; i++)
+			if (aps[i])
+				adiv5_ap_unref(aps[i]);
+		c->idcode = 0;
+		return false;
 	}
-	if (e.type) {
+
+	for (int i = 0; i < n; i++) {
+		ADIv5_AP_t *ap = aps[i];
+
+		if (kinetis_mdm_probe)
+			kinetis_mdm_probe(ap);
+		for (int j = 0; j < c->core_count; j++) {
+			if (c->core[j].apsel != ap->apsel)
+				continue;
+			ap->designer = c->core[j].designer;
+			if (c->core[j].arch == aa_cortexm)
+				cortexm_probe(ap);
+			else if (c->core[j].arch == aa_mtb)
+				ap->mtb = c->core[j].addr;
+			else if (c->core[j].arch == aa_cti)
+				cortexa_cti_probe(ap, c->core[j].addr);
+			else
+				cortexa_probe(ap, c->core[j].addr);
+		}
+		if (ap->base == 0xffffffff)
+			adiv5_ap_unref(ap);
+	}
+	return true;
+}
+
+/* Request system and debug power up, and wait for the acknowledges.
+ * Returns CTRL/STAT as last read. */
+static uint32_t adiv5_dp_power_up(ADIv5_DP_t *dp)
+{
+	uint32_t ctrlstat = 0;
+	platform_timeout timeout;
+
+	/* A JTAG-DP returns the value with the next scan, this only checks
+	 * that the DP responds */
+	int status = adiv5_dp_try_low_access(dp, ADIV5_LOW_READ,
+	                                     ADIV5_DP_CTRLSTAT, 0, &ctrlstat);
+	if (status == ADIV5_DP_WAIT) {
 		DEBUG("DP not responding!  Trying abort sequence...\n");
 		adiv5_dp_abort(dp, ADIV5_DP_ABORT_DAPABORT);
-		ctrlstat = adiv5_dp_read(dp, ADIV5_DP_CTRLSTAT);
+	} else {
+		adiv5_dp_raise(status);
 	}
+	ctrlstat = adiv5_dp_read(dp, ADIV5_DP_CTRLSTAT);
 
 	/* Write request for system and debug power up */
+	if (dp->orun_capable)
+		ctrlstat |= ADIV5_DP_CTRLSTAT_ORUNDETECT;
 	adiv5_dp_write(dp, ADIV5_DP_CTRLSTAT,
 			ctrlstat |= ADIV5_DP_CTRLSTAT_CSYSPWRUPREQ |
 				ADIV5_DP_CTRLSTAT_CDBGPWRUPREQ);
+	dp->orundetect = dp->orun_capable;
 	/* Wait for acknowledge */
+	platform_timeout_set(&timeout, ADIV5_DP_POWER_UP_TIMEOUT);
 	while(((ctrlstat = adiv5_dp_read(dp, ADIV5_DP_CTRLSTAT)) &
 		(ADIV5_DP_CTRLSTAT_CSYSPWRUPACK | ADIV5_DP_CTRLSTAT_CDBGPWRUPACK)) !=
-		(ADIV5_DP_CTRLSTAT_CSYSPWRUPACK | ADIV5_DP_CTRLSTAT_CDBGPWRUPACK));
+		(ADIV5_DP_CTRLSTAT_CSYSPWRUPACK | ADIV5_DP_CTRLSTAT_CDBGPWRUPACK)) {
+		if (platform_timeout_is_expired(&timeout))
+			raise_exception(EXCEPTION_TIMEOUT, "DP power up timeout");
+	}
+	return ctrlstat;
+}
+
+/* Get a DP that stopped responding back, keeping its APs and the targets
+ * on them.  False if it doesn't answer, or another DP does. */
+bool adiv5_dp_recover(ADIv5_DP_t *dp)
+{
+	volatile struct exception e;
+
+	/* Nothing from before the failure can be trusted */
+	dp->queue_len = 0;
+	adiv5_dp_cache_invalidate(dp);
+	TRY_CATCH(e, EXCEPTION_ALL) {
+		if (dp->reconnect && !dp->reconnect(dp))
+			raise_exception(EXCEPTION_ERROR, "DP not found");
+		dp->unchecked = true;
+		adiv5_dp_error(dp);
+		adiv5_dp_power_up(dp);
+	}
+	if (e.type)
+		DEBUG("DP recovery failed: %s\n", e.msg);
+	return !e.type;
+}
+
+/* Check the AP is still the one found by the scan */
+bool adiv5_ap_recover(ADIv5_AP_t *ap)
+{
+	volatile struct exception e;
+	volatile uint32_t idr = 0;
+
+	TRY_CATCH(e, EXCEPTION_ALL) {
+		idr = adiv5_ap_read(ap, ADIV5_AP_IDR);
+	}
+	return !e.type && (idr == ap->idr);
+}
+
+void adiv5_dp_init(ADIv5_DP_t *dp)
+{
+	uint32_t ctrlstat;
+
+	adiv5_dp_ref(dp);
+	ctrlstat = adiv5_dp_power_up(dp);
 
 	if(DO_RESET_SEQ) {
 		/* This AP reset logic is described in ADIv5, but fails to work
@@ -432,14 +758,30 @@ void adiv5_dp_init(ADIv5_DP_t *dp)
 				ADIV5_DP_CTRLSTAT_CDBGRSTACK);
 	}
 
-	/* Probe for APs on this DP */
-	for(int i = 0; i < 256; i++) {
-		ADIv5_AP_t *ap = adiv5_new_ap(dp, i);
-		if (ap == NULL)
+	if (adiv5_dp_cached_init(dp)) {
+		adiv5_dp_unref(dp);
+		return;
+	}
+
+	/* Probe for APs on this DP, either those listed or until a run of
+	 * adiv5_ap_gap missing ones */
+	scan_cache_start(dp);
+	int count = adiv5_ap_list_len ? adiv5_ap_list_len : 256;
+	unsigned missing = 0;
+	for(int i = 0; i < count; i++) {
+		ADIv5_AP_t *ap = adiv5_new_ap(dp,
+		                              adiv5_ap_list_len ? adiv5_ap_list[i] : i);
+		if (ap == NULL) {
+			if (!adiv5_ap_list_len && adiv5_ap_gap &&
+			    (++missing == adiv5_ap_gap))
+				break;
 			continue;
+		}
+		missing = 0;
 
-		extern void kinetis_mdm_probe(ADIv5_AP_t *);
-		kinetis_mdm_probe(ap);
+		scan_cache_ap(ap);
+		if (kinetis_mdm_probe)
+			kinetis_mdm_probe(ap);
 
 		if (ap->base == 0xffffffff) {
 			/* No debug entries... useless AP */
@@ -452,8 +794,13 @@ void adiv5_dp_init(ADIv5_DP_t *dp)
 		 */
 
 		/* The rest sould only be added after checking ROM table */
-		adiv5_component_probe(ap, ap->base);
+		adiv5_component_probe(ap, ap->base, 0);
+	}
+	if (scan_record) {
+		scan_record->idcode = dp->idcode;
+		scan_record->targetsel = dp->targetsel;
 	}
+	scan_record = NULL;
 	adiv5_dp_unref(dp);
 }
 
@@ -462,8 +809,51 @@ enum align {
 	ALIGN_HALFWORD = 1,
 	ALIGN_WORD = 2
 };
-#define ALIGNOF(x) (((x) & 3) == 0 ? ALIGN_WORD : \
-                    (((x) & 1) == 0 ? ALIGN_HALFWORD : ALIGN_BYTE))
+
+/* Write SELECT for an AP register unless it is already selected */
+static void ap_select(ADIv5_AP_t *ap, uint16_t addr)
+{
+	ADIv5_DP_t *dp = ap->dp;
+	uint32_t select = ((uint32_t)ap->apsel << 24) | (addr & 0xF0);
+
+	if ((dp->cached & ADIV5_DP_CACHE_SELECT) && (dp->select == select))
+		return;
+	adiv5_dp_queue_write(dp, ADIV5_DP_SELECT, select);
+	if ((dp->select ^ select) & 0xff000000)
+		dp->cached &= ~(ADIV5_DP_CACHE_CSW | ADIV5_DP_CACHE_TAR);
+	dp->select = select;
+	dp->cached |= ADIV5_DP_CACHE_SELECT;
+}
+
+/* True if the cached value selected by flag belongs to this AP */
+static bool ap_cached(ADIv5_AP_t *ap, uint8_t flag)
+{
+	ADIv5_DP_t *dp = ap->dp;
+
+	return (dp->cached & ADIV5_DP_CACHE_SELECT) && (dp->cached & flag) &&
+	       ((dp->select >> 24) == ap->apsel);
+}
+
+/* Queue an AP register write, keeping track of CSW and TAR */
+static void ap_queue_write(ADIv5_AP_t *ap, uint16_t addr, uint32_t value)
+{
+	ap_select(ap, addr);
+	adiv5_dp_queue_write(ap->dp, addr, value);
+
+	switch (addr) {
+	case ADIV5_AP_CSW:
+		ap->dp->ap_csw = value;
+		ap->dp->cached |= ADIV5_DP_CACHE_CSW;
+		break;
+	case ADIV5_AP_TAR:
+		ap->dp->ap_tar = value;
+		ap->dp->cached |= ADIV5_DP_CACHE_TAR;
+		break;
+	case ADIV5_AP_DRW:
+		ap->dp->cached &= ~ADIV5_DP_CACHE_TAR;
+		break;
+	}
+}
 
 /* Program the CSW and TAR for sequencial access at a given width */
 static void ap_mem_access_setup(ADIv5_AP_t *ap, uint32_t addr, enum align align)
@@ -481,8 +871,27 @@ static void ap_mem_access_setup(ADIv5_AP_t *ap, uint32_t addr, enum align align)
 		csw |= ADIV5_AP_CSW_SIZE_WORD;
 		break;
 	}
-	adiv5_ap_write(ap, ADIV5_AP_CSW, csw);
-	adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_TAR, addr);
+	/* Consecutive accesses of the same width to adjacent addresses
+	 * need neither write */
+	ap_select(ap, ADIV5_AP_CSW);
+	if (!ap_cached(ap, ADIV5_DP_CACHE_CSW) || (ap->dp->ap_csw != csw))
+		ap_queue_write(ap, ADIV5_AP_CSW, csw);
+	if (!ap_cached(ap, ADIV5_DP_CACHE_TAR) || (ap->dp->ap_tar != addr))
+		ap_queue_write(ap, ADIV5_AP_TAR, addr);
+	/* TAR is unknown until the transfer completes */
+	ap->dp->cached &= ~ADIV5_DP_CACHE_TAR;
+}
+
+/* Record where TAR was left by a completed auto-incrementing transfer */
+static void ap_mem_access_done(ADIv5_AP_t *ap, uint32_t tar)
+{
+	ADIv5_DP_t *dp = ap->dp;
+
+	/* A fault since setup has invalidated the cache */
+	if (!(dp->cached & ADIV5_DP_CACHE_SELECT))
+		return;
+	dp->ap_tar = tar;
+	dp->cached |= ADIV5_DP_CACHE_TAR;
 }
 
 /* Extract read data from data lane based on align and src address */
@@ -502,47 +911,92 @@ static void * extract(void *dest, uint32_t src, uint32_t val, enum align align)
 	return (uint8_t *)dest + (1 << align);
 }
 
-void
-adiv5_mem_read(ADIv5_AP_t *ap, void *dest, uint32_t src, size_t len)
+/* Split an access into an unaligned head, a word aligned body and a
+ * tail.  Returns the length of the next piece and sets its width. */
+static size_t ap_mem_chunk(uint32_t addr, size_t len, enum align *align)
 {
-	uint32_t tmp;
-	uint32_t osrc = src;
-	enum align align = MIN(ALIGNOF(src), ALIGNOF(len));
+	if (((addr & 3) == 0) && (len >= 4)) {
+		*align = ALIGN_WORD;
+		return len & ~3;
+	}
+	if (((addr & 1) == 0) && (len >= 2)) {
+		*align = ALIGN_HALFWORD;
+		return 2;
+	}
+	*align = ALIGN_BYTE;
+	return 1;
+}
 
-	if (len == 0)
-		return;
+/* Everything is queued and flushed with adiv5_dp_try_flush(), so these
+ * return the status of the first failure and never raise */
+static int
+ap_mem_read(ADIv5_AP_t *ap, void *dest, uint32_t src, size_t len,
+            enum align align)
+{
+	uint32_t data[ADIV5_DP_QUEUE_LEN];
+	uint32_t osrc = src;
+	int status;
 
 	len >>= align;
 	ap_mem_access_setup(ap, src, align);
-	adiv5_dp_low_access(ap->dp, ADIV5_LOW_READ, ADIV5_AP_DRW, 0);
-	while (--len) {
-		tmp = adiv5_dp_low_access(ap->dp, ADIV5_LOW_READ, ADIV5_AP_DRW, 0);
-		dest = extract(dest, src, tmp, align);
+	adiv5_dp_queue_read(ap->dp, ADIV5_AP_DRW, NULL);
+	while (len) {
+		/* Post a run of reads, each returns the data for the
+		 * previous one.  The last read of all comes with a read of
+		 * CSW, which faults if the final DRW read failed. */
+		uint32_t run_src = src;
+		unsigned n = 0;
+		/* Leave room for a TAR reload, so the queue never flushes
+		 * itself */
+		while (len && (ap->dp->queue_len + 3 <= ADIV5_DP_QUEUE_LEN)) {
+			if (--len == 0) {
+				adiv5_dp_queue_read(ap->dp, ADIV5_AP_CSW,
+				                    &data[n++]);
+				break;
+			}
+			adiv5_dp_queue_read(ap->dp, ADIV5_AP_DRW, &data[n++]);
 
-		src += (1 << align);
-		/* Check for 10 bit address overflow */
-		if ((src ^ osrc) & 0xfffffc00) {
-			osrc = src;
-			adiv5_dp_low_access(ap->dp,
-					ADIV5_LOW_WRITE, ADIV5_AP_TAR, src);
-			adiv5_dp_low_access(ap->dp,
-					ADIV5_LOW_READ, ADIV5_AP_DRW, 0);
+			src += (1 << align);
+			/* Check for 10 bit address overflow */
+			if ((src ^ osrc) & 0xfffffc00) {
+				osrc = src;
+				adiv5_dp_queue_write(ap->dp, ADIV5_AP_TAR, src);
+				adiv5_dp_queue_read(ap->dp, ADIV5_AP_DRW, NULL);
+			}
+		}
+
+		status = adiv5_dp_try_flush(ap->dp);
+		if (status)
+			return status;
+		for (unsigned i = 0; i < n; i++) {
+			dest = extract(dest, run_src, data[i], align);
+			run_src += (1 << align);
 		}
 	}
-	tmp = adiv5_dp_low_access(ap->dp, ADIV5_LOW_READ, ADIV5_DP_RDBUFF, 0);
-	extract(dest, src, tmp, align);
+	/* The increment past the last element is implementation defined
+	 * if it crosses a 1k boundary */
+	src += (1 << align);
+	if (src & 0x3ff)
+		ap_mem_access_done(ap, src);
+	return ADIV5_DP_OK;
 }
 
-void
-adiv5_mem_write(ADIv5_AP_t *ap, uint32_t dest, const void *src, size_t len)
+static int
+ap_mem_write(ADIv5_AP_t *ap, uint32_t dest, const void *src, size_t len,
+             enum align align)
 {
 	uint32_t odest = dest;
-	enum align align = MIN(ALIGNOF(dest), ALIGNOF(len));
+	int status;
 
 	len >>= align;
 	ap_mem_access_setup(ap, dest, align);
 	while (len--) {
 		uint32_t tmp = 0;
+		if (ap->dp->queue_len + 2 > ADIV5_DP_QUEUE_LEN) {
+			status = adiv5_dp_try_flush(ap->dp);
+			if (status)
+				return status;
+		}
 		/* Pack data into correct data lane */
 		switch (align) {
 		case ALIGN_BYTE:
@@ -557,29 +1011,169 @@ adiv5_mem_write(ADIv5_AP_t *ap, uint32_t dest, const void *src, size_t len)
 		}
 		src = (uint8_t *)src + (1 << align);
 		dest += (1 << align);
-		adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_DRW, tmp);
+		adiv5_dp_queue_write(ap->dp, ADIV5_AP_DRW, tmp);
 
 		/* Check for 10 bit address overflow */
 		if ((dest ^ odest) & 0xfffffc00) {
 			odest = dest;
-			adiv5_dp_low_access(ap->dp,
-					ADIV5_LOW_WRITE, ADIV5_AP_TAR, dest);
+			adiv5_dp_queue_write(ap->dp, ADIV5_AP_TAR, dest);
 		}
 	}
+	status = adiv5_dp_try_flush(ap->dp);
+	if (status)
+		return status;
+	ap_mem_access_done(ap, dest);
+	return ADIV5_DP_OK;
+}
+
+int
+adiv5_mem_try_read(ADIv5_AP_t *ap, void *dest, uint32_t src, size_t len)
+{
+	while (len) {
+		enum align align;
+		size_t n = ap_mem_chunk(src, len, &align);
+
+		int status = ap_mem_read(ap, dest, src, n, align);
+		if (status)
+			return status;
+		dest = (uint8_t *)dest + n;
+		src += n;
+		len -= n;
+	}
+	return ADIV5_DP_OK;
+}
+
+int
+adiv5_mem_try_write(ADIv5_AP_t *ap, uint32_t dest, const void *src, size_t len)
+{
+	while (len) {
+		enum align align;
+		size_t n = ap_mem_chunk(dest, len, &align);
+
+		int status = ap_mem_write(ap, dest, src, n, align);
+		if (status)
+			return status;
+		src = (const uint8_t *)src + n;
+		dest += n;
+		len -= n;
+	}
+	return ADIV5_DP_OK;
+}
+
+void
+adiv5_mem_read(ADIv5_AP_t *ap, void *dest, uint32_t src, size_t len)
+{
+	adiv5_dp_raise(adiv5_mem_try_read(ap, dest, src, len));
+}
+
+void
+adiv5_mem_write(ADIv5_AP_t *ap, uint32_t dest, const void *src, size_t len)
+{
+	adiv5_dp_raise(adiv5_mem_try_write(ap, dest, src, len));
+}
+
+/* Program the CSW and TAR for word accesses that all hit addr */
+static void ap_mem_fixed_setup(ADIv5_AP_t *ap, uint32_t addr)
+{
+	uint32_t csw = ap->csw | ADIV5_AP_CSW_ADDRINC_NONE |
+	               ADIV5_AP_CSW_SIZE_WORD;
+
+	ap_select(ap, ADIV5_AP_CSW);
+	if (!ap_cached(ap, ADIV5_DP_CACHE_CSW) || (ap->dp->ap_csw != csw))
+		ap_queue_write(ap, ADIV5_AP_CSW, csw);
+	if (!ap_cached(ap, ADIV5_DP_CACHE_TAR) || (ap->dp->ap_tar != addr))
+		ap_queue_write(ap, ADIV5_AP_TAR, addr);
+}
+
+/* Write count words in turn to a single register, such as a cache
+ * maintenance operation, as one queued burst */
+void adiv5_mem_write_fixed(ADIv5_AP_t *ap, uint32_t addr,
+                           const uint32_t *src, size_t count)
+{
+	ap_mem_fixed_setup(ap, addr);
+	while (count--)
+		adiv5_dp_queue_write(ap->dp, ADIV5_AP_DRW, *src++);
+	adiv5_dp_flush(ap->dp);
+	ap_mem_access_done(ap, addr);
+}
+
+/* Polls after which a millisecond is left between reads, and between
+ * sticky error checks */
+#define POLL_BACKOFF	16
+#define POLL_CHECK	64
+
+/* Poll a word with TAR fixed.  Each DRW read returns the result of the
+ * previous one, so every poll after the first is a single transaction.
+ * Faults don't stop the reads, the periodic error check does.
+ */
+int adiv5_mem_poll32(ADIv5_AP_t *ap, uint32_t addr, uint32_t mask,
+                     uint32_t value, uint32_t timeout_ms)
+{
+	ADIv5_DP_t *dp = ap->dp;
+	platform_timeout timeout;
+	uint32_t val;
+	int ret = -1;
+	int status = ADIV5_DP_OK;
+
+	ap_mem_fixed_setup(ap, addr);
+	platform_timeout_set(&timeout, timeout_ms);
+	adiv5_dp_queue_read(dp, ADIV5_AP_DRW, NULL);
+	for (unsigned n = 1; ; n++) {
+		adiv5_dp_queue_read(dp, ADIV5_AP_DRW, &val);
+		status = adiv5_dp_try_flush(dp);
+		if (status)
+			break;
+		if ((val & mask) == value) {
+			ret = 0;
+			break;
+		}
+		if ((n % POLL_CHECK) == 0) {
+			if (adiv5_dp_error(dp))
+				return -1;
+			ap_select(ap, ADIV5_AP_CSW);
+		}
+		if (timeout_ms && platform_timeout_is_expired(&timeout))
+			break;
+		if (n >= POLL_BACKOFF)
+			platform_delay(1);
+	}
+	/* Raised only once out of the loop */
+	adiv5_dp_raise(status);
+	/* The read still in flight is checked by the next access */
+	ap_mem_access_done(ap, addr);
+	return ret;
+}
+
+/* Point TAR at addr for accesses that don't increment it, unless the
+ * cache shows it is already there */
+void adiv5_ap_tar(ADIv5_AP_t *ap, uint32_t addr)
+{
+	ap_select(ap, ADIV5_AP_TAR);
+	if (!ap_cached(ap, ADIV5_DP_CACHE_TAR) || (ap->dp->ap_tar != addr))
+		adiv5_ap_write(ap, ADIV5_AP_TAR, addr);
+}
+
+/* As adiv5_ap_tar(), but queue the write behind any pending transfers */
+void adiv5_ap_queue_tar(ADIv5_AP_t *ap, uint32_t addr)
+{
+	/* A bank 0xF0 access may have moved SELECT off TAR and DRW */
+	ap_select(ap, ADIV5_AP_TAR);
+	if (!ap_cached(ap, ADIV5_DP_CACHE_TAR) || (ap->dp->ap_tar != addr))
+		ap_queue_write(ap, ADIV5_AP_TAR, addr);
 }
 
 void adiv5_ap_write(ADIv5_AP_t *ap, uint16_t addr, uint32_t value)
 {
-	adiv5_dp_write(ap->dp, ADIV5_DP_SELECT,
-			((uint32_t)ap->apsel << 24)|(addr & 0xF0));
-	adiv5_dp_write(ap->dp, addr, value);
+	ap_queue_write(ap, addr, value);
+	adiv5_dp_flush(ap->dp);
 }
 
 uint32_t adiv5_ap_read(ADIv5_AP_t *ap, uint16_t addr)
 {
 	uint32_t ret;
-	adiv5_dp_write(ap->dp, ADIV5_DP_SELECT,
-			((uint32_t)ap->apsel << 24)|(addr & 0xF0));
+	ap_select(ap, addr);
+	if (addr == ADIV5_AP_DRW)
+		ap->dp->cached &= ~ADIV5_DP_CACHE_TAR;
 	ret = adiv5_dp_read(ap->dp, addr);
 	return ret;
 }
@@ -33,6 +33,7 @@
 #define ADIV5_DP_CTRLSTAT ADIV5_DP_REG(0x4)
 #define ADIV5_DP_SELECT   ADIV5_DP_REG(0x8)
 #define ADIV5_DP_RDBUFF   ADIV5_DP_REG(0xC)
+#define ADIV5_DP_TARGETSEL ADIV5_DP_REG(0xC)	/* SW-DP v2, write only */
 
 /* AP Abort Register (ABORT) */
 /* Bits 31:5 - Reserved */
@@ -76,6 +77,14 @@
 #define ADIV5_AP_BASE		ADIV5_AP_REG(0xF8)
 #define ADIV5_AP_IDR		ADIV5_AP_REG(0xFC)
 
+/* AP Identification Register (IDR) */
+#define ADIV5_AP_IDR_CLASS_MASK		(0xfu << 13)
+#define ADIV5_AP_IDR_CLASS_MEM		(0x8u << 13)
+#define ADIV5_AP_IDR_TYPE_MASK		(0xfu << 0)
+#define ADIV5_AP_IDR_TYPE_AHB		(0x1u << 0)
+#define ADIV5_AP_IDR_TYPE_APB		(0x2u << 0)
+#define ADIV5_AP_IDR_TYPE_AXI		(0x4u << 0)
+
 /* AP Control and Status Word (CSW) */
 #define ADIV5_AP_CSW_DBGSWENABLE	(1u << 31)
 /* Bits 30:24 - Prot, Implementation defined, for Cortex-M3: */
@@ -100,17 +109,75 @@
 #define ADIV5_LOW_WRITE		0
 #define ADIV5_LOW_READ		1
 
+/* Number of low level transactions that may be queued before the
+ * queue is implicitly flushed */
+#define ADIV5_DP_QUEUE_LEN	32
+
+/* A queued low level transaction.  The response is stored in *result
+ * when the queue is flushed, if result is not NULL. */
+struct adiv5_dp_txn {
+	uint8_t RnW;
+	uint16_t addr;
+	uint32_t value;
+	uint32_t *result;
+};
+
+/* Status returned by the try_ accesses, which never raise.  The others
+ * raise it with adiv5_dp_raise(), so only outer layers pay for the
+ * exception handling. */
+#define ADIV5_DP_OK		0
+#define ADIV5_DP_WAIT		1	/* EXCEPTION_TIMEOUT */
+#define ADIV5_DP_NOACK		2	/* EXCEPTION_ERROR from here on */
+#define ADIV5_DP_PARITY		3
+#define ADIV5_DP_FAILED		4
+
+/* Flags for ADIv5_DP_t.cached */
+#define ADIV5_DP_CACHE_SELECT	(1 << 0)
+#define ADIV5_DP_CACHE_CSW	(1 << 1)
+#define ADIV5_DP_CACHE_TAR	(1 << 2)
+
 /* Try to keep this somewhat absract for later adding SW-DP */
 typedef struct ADIv5_DP_s {
 	int refcnt;
 
 	uint32_t idcode;
+	/* SW-DP multi-drop TARGETSEL value, 0 for a single DP on the wire */
+	uint32_t targetsel;
+	/* Probe SWD port the DP is wired to */
+	uint8_t port;
 
 	uint32_t (*dp_read)(struct ADIv5_DP_s *dp, uint16_t addr);
 	uint32_t (*error)(struct ADIv5_DP_s *dp);
 	uint32_t (*low_access)(struct ADIv5_DP_s *dp, uint8_t RnW,
                                uint16_t addr, uint32_t value);
 	void (*abort)(struct ADIv5_DP_s *dp, uint32_t abort);
+	void (*flush)(struct ADIv5_DP_s *dp);
+	int (*try_low_access)(struct ADIv5_DP_s *dp, uint8_t RnW,
+	                      uint16_t addr, uint32_t value, uint32_t *result);
+	int (*try_flush)(struct ADIv5_DP_s *dp);
+	/* Optional, see adiv5_dp_recover().  Resets the wire and checks
+	 * that this DP answers there. */
+	bool (*reconnect)(struct ADIv5_DP_s *dp);
+
+	/* Overrun detection, enabled by adiv5_dp_init() for DPs that can
+	 * then send queued writes without checking each ACK */
+	bool orun_capable;
+	bool orundetect;
+
+	/* An error may have been latched since sticky errors were last
+	 * checked, see adiv5_dp_error() */
+	bool unchecked;
+
+	/* Transactions posted with adiv5_dp_queue_*() */
+	struct adiv5_dp_txn queue[ADIV5_DP_QUEUE_LEN];
+	unsigned queue_len;
+
+	/* Last values written to SELECT, and to CSW and TAR of the AP
+	 * selected there.  Only valid while the bit in cached is set. */
+	uint8_t cached;
+	uint32_t select;
+	uint32_t ap_csw;
+	uint32_t ap_tar;
 
 	union {
 		jtag_dev_t *dev;
@@ -118,27 +185,100 @@ typedef struct ADIv5_DP_s {
 	};
 } ADIv5_DP_t;
 
+/* Forget cached register values after a fault or abort */
+static inline void adiv5_dp_cache_invalidate(ADIv5_DP_t *dp)
+{
+	dp->cached = 0;
+}
+
+/* Execute all queued transactions and store their results */
+static inline void adiv5_dp_flush(ADIv5_DP_t *dp)
+{
+	if (dp->queue_len)
+		dp->flush(dp);
+}
+
+/* As adiv5_dp_flush(), returning the status instead of raising it.
+ * The queue is empty either way. */
+static inline int adiv5_dp_try_flush(ADIv5_DP_t *dp)
+{
+	return dp->queue_len ? dp->try_flush(dp) : ADIV5_DP_OK;
+}
+
 static inline uint32_t adiv5_dp_read(ADIv5_DP_t *dp, uint16_t addr)
 {
+	adiv5_dp_flush(dp);
 	return dp->dp_read(dp, addr);
 }
 
+/* True for MEM-AP registers whose accesses reach the bus, and so can
+ * fail after they have been acknowledged */
+static inline bool adiv5_ap_reg_bus(uint16_t addr)
+{
+	return (addr == ADIV5_AP_DRW) ||
+	       ((addr & ~0x0c) == ADIV5_AP_DB(0));
+}
+
+/* Check and clear sticky errors.  This is free unless a FAULT was seen,
+ * or an access that can fail unseen was made since the last check. */
 static inline uint32_t adiv5_dp_error(ADIv5_DP_t *dp)
 {
+	adiv5_dp_flush(dp);
+	if (!dp->unchecked)
+		return 0;
+	dp->unchecked = false;
+	adiv5_dp_cache_invalidate(dp);
 	return dp->error(dp);
 }
 
 static inline uint32_t adiv5_dp_low_access(struct ADIv5_DP_s *dp, uint8_t RnW,
                                            uint16_t addr, uint32_t value)
 {
+	adiv5_dp_flush(dp);
 	return dp->low_access(dp, RnW, addr, value);
 }
 
+static inline int adiv5_dp_try_low_access(struct ADIv5_DP_s *dp, uint8_t RnW,
+                                          uint16_t addr, uint32_t value,
+                                          uint32_t *result)
+{
+	int status = adiv5_dp_try_flush(dp);
+	if (status)
+		return status;
+	return dp->try_low_access(dp, RnW, addr, value, result);
+}
+
 static inline void adiv5_dp_abort(struct ADIv5_DP_s *dp, uint32_t abort)
 {
+	adiv5_dp_flush(dp);
+	adiv5_dp_cache_invalidate(dp);
 	return dp->abort(dp, abort);
 }
 
+void adiv5_dp_queue(ADIv5_DP_t *dp, uint8_t RnW, uint16_t addr,
+                    uint32_t value, uint32_t *result);
+void adiv5_dp_flush_generic(ADIv5_DP_t *dp);
+void adiv5_dp_raise(int status);
+/* For DPs that only raise, catching the exception */
+int adiv5_dp_try_low_access_generic(ADIv5_DP_t *dp, uint8_t RnW,
+                                    uint16_t addr, uint32_t value,
+                                    uint32_t *result);
+int adiv5_dp_try_flush_generic(ADIv5_DP_t *dp);
+
+/* Post a low level read, the response is stored in *result when the
+ * queue is flushed.  result may be NULL to discard the response. */
+static inline void adiv5_dp_queue_read(ADIv5_DP_t *dp, uint16_t addr,
+                                       uint32_t *result)
+{
+	adiv5_dp_queue(dp, ADIV5_LOW_READ, addr, 0, result);
+}
+
+static inline void adiv5_dp_queue_write(ADIv5_DP_t *dp, uint16_t addr,
+                                        uint32_t value)
+{
+	adiv5_dp_queue(dp, ADIV5_LOW_WRITE, addr, value, NULL);
+}
+
 typedef struct ADIv5_AP_s {
 	int refcnt;
 
@@ -149,10 +289,28 @@ typedef struct ADIv5_AP_s {
 	uint32_t cfg;
 	uint32_t base;
 	uint32_t csw;
+
+	uint16_t designer;	/* JEP-106 code from the ROM table, 0 if none */
+	uint32_t mtb;		/* Base of a Micro Trace Buffer, 0 if none */
 } ADIv5_AP_t;
 
+/* JEP-106 designer codes, continuation count in bits 8-11 */
+#define JEP106_ARM		0x43b
+#define JEP106_FREESCALE	0x00e
+#define JEP106_NXP		0x015
+#define JEP106_TI		0x017
+#define JEP106_ATMEL		0x01f
+#define JEP106_ST		0x020
+#define JEP106_NORDIC		0x244
+#define JEP106_ENERGY_MICRO	0x673
+
 void adiv5_dp_init(ADIv5_DP_t *dp);
+/* Power a DP up again after it stopped responding, and check an AP found
+ * on it before is still there.  False if the target is really gone. */
+bool adiv5_dp_recover(ADIv5_DP_t *dp);
+bool adiv5_ap_recover(ADIv5_AP_t *ap);
 void adiv5_dp_write(ADIv5_DP_t *dp, uint16_t addr, uint32_t value);
+ADIv5_DP_t *adiv5_swdp_new(void);
 
 ADIv5_AP_t *adiv5_new_ap(ADIv5_DP_t *dp, uint8_t apsel);
 void adiv5_dp_ref(ADIv5_DP_t *dp);
@@ -162,11 +320,21 @@ void adiv5_ap_unref(ADIv5_AP_t *ap);
 
 void adiv5_ap_write(ADIv5_AP_t *ap, uint16_t addr, uint32_t value);
 uint32_t adiv5_ap_read(ADIv5_AP_t *ap, uint16_t addr);
+void adiv5_ap_tar(ADIv5_AP_t *ap, uint32_t addr);
+void adiv5_ap_queue_tar(ADIv5_AP_t *ap, uint32_t addr);
 
 void adiv5_jtag_dp_handler(jtag_dev_t *dev);
 
 void adiv5_mem_read(ADIv5_AP_t *ap, void *dest, uint32_t src, size_t len);
 void adiv5_mem_write(ADIv5_AP_t *ap, uint32_t dest, const void *src, size_t len);
+/* As above, returning an ADIV5_DP_* status instead of raising it */
+int adiv5_mem_try_read(ADIv5_AP_t *ap, void *dest, uint32_t src, size_t len);
+int adiv5_mem_try_write(ADIv5_AP_t *ap, uint32_t dest, const void *src,
+                        size_t len);
+void adiv5_mem_write_fixed(ADIv5_AP_t *ap, uint32_t addr,
+                           const uint32_t *src, size_t count);
+int adiv5_mem_poll32(ADIv5_AP_t *ap, uint32_t addr, uint32_t mask,
+                     uint32_t value, uint32_t timeout_ms);
 
 #endif
 
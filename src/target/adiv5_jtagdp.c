@@ -28,6 +28,8 @@
 #include "jtag_scan.h"
 #include "jtagtap.h"
 #include "morse.h"
+#include "stats.h"
+#include "dptrace.h"
 
 #define JTAGDP_ACK_OK	0x02
 #define JTAGDP_ACK_WAIT	0x01
@@ -43,9 +45,15 @@ static uint32_t adiv5_jtagdp_error(ADIv5_DP_t *dp);
 
 static uint32_t adiv5_jtagdp_low_access(ADIv5_DP_t *dp, uint8_t RnW,
 					uint16_t addr, uint32_t value);
+static int adiv5_jtagdp_try_low_access(ADIv5_DP_t *dp, uint8_t RnW,
+				       uint16_t addr, uint32_t value,
+				       uint32_t *result);
 
 static void adiv5_jtagdp_abort(ADIv5_DP_t *dp, uint32_t abort);
 
+static void adiv5_jtagdp_flush(ADIv5_DP_t *dp);
+static int adiv5_jtagdp_try_flush(ADIv5_DP_t *dp);
+
 void adiv5_jtag_dp_handler(jtag_dev_t *dev)
 {
 	ADIv5_DP_t *dp = (void*)calloc(1, sizeof(*dp));
@@ -57,6 +65,9 @@ void adiv5_jtag_dp_handler(jtag_dev_t *dev)
 	dp->error = adiv5_jtagdp_error;
 	dp->low_access = adiv5_jtagdp_low_access;
 	dp->abort = adiv5_jtagdp_abort;
+	dp->flush = adiv5_jtagdp_flush;
+	dp->try_low_access = adiv5_jtagdp_try_low_access;
+	dp->try_flush = adiv5_jtagdp_try_flush;
 
 	adiv5_dp_init(dp);
 }
@@ -75,32 +86,64 @@ static uint32_t adiv5_jtagdp_error(ADIv5_DP_t *dp)
 				ADIV5_DP_CTRLSTAT, 0xF0000032) & 0x32;
 }
 
-static uint32_t adiv5_jtagdp_low_access(ADIv5_DP_t *dp, uint8_t RnW,
-					uint16_t addr, uint32_t value)
+static int adiv5_jtagdp_try_low_access(ADIv5_DP_t *dp, uint8_t RnW,
+				       uint16_t addr, uint32_t value,
+				       uint32_t *result)
 {
 	bool APnDP = addr & ADIV5_APnDP;
 	addr &= 0xff;
 	uint64_t request, response;
 	uint8_t ack;
+	unsigned waits = 0;
 	platform_timeout timeout;
 
 	request = ((uint64_t)value << 3) | ((addr >> 1) & 0x06) | (RnW?1:0);
 
-	jtag_dev_write_ir(dp->dev, APnDP ? IR_APACC : IR_DPACC);
+	if (jtag_dev_write_ir(dp->dev, APnDP ? IR_APACC : IR_DPACC))
+		return ADIV5_DP_NOACK;
 
+	STATS_INC(dp_transactions);
+	DPTRACE_START(start);
 	platform_timeout_set(&timeout, 2000);
 	do {
-		jtag_dev_shift_dr(dp->dev, (uint8_t*)&response, (uint8_t*)&request, 35);
+		if (jtag_dev_shift_dr(dp->dev, (uint8_t*)&response,
+		                      (uint8_t*)&request, 35))
+			response = 0;	/* Not shifted, seen as no ACK */
 		ack = response & 0x07;
+		if (ack == JTAGDP_ACK_WAIT) {
+			STATS_INC(dp_wait);
+			waits++;
+		}
 	} while(!platform_timeout_is_expired(&timeout) && (ack == JTAGDP_ACK_WAIT));
+	DPTRACE(start, DPTRACE_JTAG | DPTRACE_REQUEST(APnDP, RnW, addr), ack,
+	        waits);
+
+	if (ack != JTAGDP_ACK_OK)
+		adiv5_dp_cache_invalidate(dp);
 
 	if (ack == JTAGDP_ACK_WAIT)
-		raise_exception(EXCEPTION_TIMEOUT, "JTAG-DP ACK timeout");
+		return ADIV5_DP_WAIT;
 
 	if((ack != JTAGDP_ACK_OK))
-		raise_exception(EXCEPTION_ERROR, "JTAG-DP invalid ACK");
+		return ADIV5_DP_NOACK;
+
+	/* JTAG-DP has no FAULT response, errors only show in CTRL/STAT */
+	if (APnDP)
+		dp->unchecked = true;
+
+	*result = (uint32_t)(response >> 3);
+	return ADIV5_DP_OK;
+}
+
+static uint32_t adiv5_jtagdp_low_access(ADIv5_DP_t *dp, uint8_t RnW,
+					uint16_t addr, uint32_t value)
+{
+	uint32_t ret = 0;
+	int status = adiv5_jtagdp_try_low_access(dp, RnW, addr, value, &ret);
 
-	return (uint32_t)(response >> 3);
+	if (status)
+		adiv5_dp_raise(status);
+	return ret;
 }
 
 static void adiv5_jtagdp_abort(ADIv5_DP_t *dp, uint32_t abort)
@@ -110,3 +153,45 @@ static void adiv5_jtagdp_abort(ADIv5_DP_t *dp, uint32_t abort)
 	jtag_dev_shift_dr(dp->dev, NULL, (const uint8_t*)&request, 35);
 }
 
+/* Execute queued transactions.  Every JTAG-DP scan returns the result
+ * of the previous read, so a queued RDBUFF read is only a dummy scan to
+ * collect it.  Unless it is the last transaction, the following scan
+ * returns the same data, so the RDBUFF scan and the IR switches to
+ * DPACC and back are skipped. */
+static int adiv5_jtagdp_try_flush(ADIv5_DP_t *dp)
+{
+	unsigned len = dp->queue_len;
+	uint32_t *pending = NULL;
+
+	/* Empty the queue first, so an error leaves it consistent */
+	dp->queue_len = 0;
+	for (unsigned i = 0; i < len; i++) {
+		struct adiv5_dp_txn *txn = &dp->queue[i];
+		if ((txn->RnW == ADIV5_LOW_READ) &&
+		    (txn->addr == ADIV5_DP_RDBUFF) && !pending &&
+		    (i + 1 < len)) {
+			pending = txn->result;
+			continue;
+		}
+		uint32_t ret;
+		int status = adiv5_jtagdp_try_low_access(dp, txn->RnW, txn->addr,
+		                                         txn->value, &ret);
+		if (status)
+			return status;
+		if (pending)
+			*pending = ret;
+		pending = NULL;
+		if (txn->result)
+			*txn->result = ret;
+	}
+	return ADIV5_DP_OK;
+}
+
+static void adiv5_jtagdp_flush(ADIv5_DP_t *dp)
+{
+	int status = adiv5_jtagdp_try_flush(dp);
+
+	if (status)
+		adiv5_dp_raise(status);
+}
+
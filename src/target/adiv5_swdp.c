@@ -28,6 +28,8 @@
 #include "swdptap.h"
 #include "target.h"
 #include "target_internal.h"
+#include "stats.h"
+#include "dptrace.h"
 
 #define SWDP_ACK_OK    0x01
 #define SWDP_ACK_WAIT  0x02
@@ -39,46 +41,196 @@ static uint32_t adiv5_swdp_error(ADIv5_DP_t *dp);
 
 static uint32_t adiv5_swdp_low_access(ADIv5_DP_t *dp, uint8_t RnW,
 				      uint16_t addr, uint32_t value);
+static int adiv5_swdp_try_low_access(ADIv5_DP_t *dp, uint8_t RnW,
+				     uint16_t addr, uint32_t value,
+				     uint32_t *result);
+
+static uint8_t adiv5_swdp_request(uint8_t RnW, uint16_t addr);
 
 static void adiv5_swdp_abort(ADIv5_DP_t *dp, uint32_t abort);
 
-int adiv5_swdp_scan(void)
-{
-	uint8_t ack;
+static void adiv5_swdp_flush(ADIv5_DP_t *dp);
+static int adiv5_swdp_try_flush(ADIv5_DP_t *dp);
 
-	target_list_free();
-	ADIv5_DP_t *dp = (void*)calloc(1, sizeof(*dp));
-
-	swdptap_init();
+/* Multi-drop DP addressed by the last TARGETSEL on each port, see
+ * adiv5_swdp_select() */
+static ADIv5_DP_t *swdp_selected[PLATFORM_SWD_PORTS];
 
-	/* Switch from JTAG to SWD mode */
-	swdptap_seq_out(0xFFFF, 16);
-	for(int i = 0; i < 50; i++)
-		swdptap_bit_out(1);
-	swdptap_seq_out(0xE79E, 16); /* 0b0111100111100111 */
+static void swdp_line_reset(void)
+{
 	for(int i = 0; i < 50; i++)
 		swdptap_bit_out(1);
 	swdptap_seq_out(0, 16);
+}
+
+/* SWD v2 DPs may start out dormant, the selection alert wakes them */
+static void swdp_dormant_to_swd(void)
+{
+	static const uint32_t alert[] = {
+		0x6209F392, 0x86852D95, 0xE3DDAFE9, 0x19BC0EA2,
+	};
+
+	swdptap_seq_out(0xFF, 8);
+	for (unsigned i = 0; i < sizeof(alert) / sizeof(alert[0]); i++)
+		swdptap_seq_out(alert[i], 32);
+	/* 4 idle cycles, then the SWD activation code 0x1A */
+	swdptap_seq_out(0x1A0, 12);
+	swdp_line_reset();
+}
+
+/* Address one DP on a multi-drop bus and read its IDCODE, which must
+ * follow.  The TARGETSEL write itself gets no ACK. */
+static bool swdp_targetsel(uint32_t targetsel, uint32_t *idcode)
+{
+	uint8_t ack;
+
+	STATS_ADD(dp_transactions, 2);
+	swdp_line_reset();
+	swdptap_seq_out(adiv5_swdp_request(ADIV5_LOW_WRITE,
+	                                   ADIV5_DP_TARGETSEL), 8);
+	swdptap_seq_in(3);
+	swdptap_seq_out_parity(targetsel, 32);
 
-	/* Read the SW-DP IDCODE register to syncronise */
-	/* This could be done with adiv_swdp_low_access(), but this doesn't
-	 * allow the ack to be checked here. */
 	swdptap_seq_out(0xA5, 8);
 	ack = swdptap_seq_in(3);
-	if((ack != SWDP_ACK_OK) || swdptap_seq_in_parity(&dp->idcode, 32)) {
-		DEBUG("\n");
-		free(dp);
-		return -1;
+	return (ack == SWDP_ACK_OK) && !swdptap_seq_in_parity(idcode, 32);
+}
+
+/* Switch to the DP's port, and re-address a multi-drop DP only when
+ * another one on that port was used since */
+static bool adiv5_swdp_select(ADIv5_DP_t *dp)
+{
+	uint32_t idcode;
+
+	platform_swd_port_select(dp->port);
+	if (!dp->targetsel || (dp == swdp_selected[dp->port]))
+		return true;
+	swdp_selected[dp->port] = NULL;
+	if (!swdp_targetsel(dp->targetsel, &idcode)) {
+		DEBUG("SWDP TARGETSEL failed\n");
+		return false;
+	}
+	swdp_selected[dp->port] = dp;
+	return true;
+}
+
+/* Line reset, with the selection alert and TARGETSEL for a multi-drop DP
+ * which may be dormant after losing power, then check the IDCODE */
+static bool adiv5_swdp_reconnect(ADIv5_DP_t *dp)
+{
+	uint32_t idcode = 0;
+	uint8_t ack;
+
+	platform_swd_port_select(dp->port);
+	swdp_selected[dp->port] = NULL;
+	if (dp->targetsel) {
+		/* Through dormant state, as the scan does */
+		swdp_line_reset();
+		swdptap_seq_out(0xE3BC, 16);
+		swdp_dormant_to_swd();
+		if (!swdp_targetsel(dp->targetsel, &idcode))
+			return false;
+		swdp_selected[dp->port] = dp;
+	} else {
+		swdp_line_reset();
+		STATS_INC(dp_transactions);
+		swdptap_seq_out(0xA5, 8);
+		ack = swdptap_seq_in(3);
+		if ((ack != SWDP_ACK_OK) || swdptap_seq_in_parity(&idcode, 32))
+			return false;
 	}
+	return idcode == dp->idcode;
+}
+
+/* A SW-DP on the wire, without any of the setup done by a scan */
+ADIv5_DP_t *adiv5_swdp_new(void)
+{
+	ADIv5_DP_t *dp = (void*)calloc(1, sizeof(*dp));
 
 	dp->dp_read = adiv5_swdp_read;
 	dp->error = adiv5_swdp_error;
 	dp->low_access = adiv5_swdp_low_access;
 	dp->abort = adiv5_swdp_abort;
+	dp->flush = adiv5_swdp_flush;
+	dp->try_low_access = adiv5_swdp_try_low_access;
+	dp->try_flush = adiv5_swdp_try_flush;
+	dp->reconnect = adiv5_swdp_reconnect;
+	dp->port = platform_swd_port();
+#if defined(PLATFORM_REMOTE)
+	/* Whole transfers are handed to the probe */
+	remote_dp_init(dp);
+#endif
+	return dp;
+}
+
+/* Set up the DP found by a scan, or one at targetsel on a multi-drop bus */
+static bool adiv5_swdp_connect(uint32_t targetsel)
+{
+	uint32_t idcode;
+	uint8_t ack;
+
+	if (targetsel) {
+		if (!swdp_targetsel(targetsel, &idcode)) {
+			DEBUG("No DP at TARGETSEL %08"PRIx32"\n", targetsel);
+			return false;
+		}
+	} else {
+		/* Read the SW-DP IDCODE register to syncronise */
+		/* This could be done with adiv_swdp_low_access(), but this
+		 * doesn't allow the ack to be checked here. */
+		swdptap_seq_out(0xA5, 8);
+		ack = swdptap_seq_in(3);
+		if((ack != SWDP_ACK_OK) || swdptap_seq_in_parity(&idcode, 32)) {
+			DEBUG("\n");
+			return false;
+		}
+	}
+
+	ADIv5_DP_t *dp = adiv5_swdp_new();
+	dp->idcode = idcode;
+	dp->targetsel = targetsel;
+	if (targetsel)
+		swdp_selected[dp->port] = dp;
+	dp->orun_capable = true;
 
 	adiv5_swdp_error(dp);
 	adiv5_dp_init(dp);
+	return true;
+}
 
+/* Scan for a single SW-DP, or with a list of TARGETSEL values for the
+ * SWD v2 multi-drop DPs sharing the wire.  These get a DP each and are
+ * switched between as they are used. */
+int adiv5_swdp_scan(const uint32_t *targetsel, size_t count)
+{
+	target_list_free();
+	swdp_selected[platform_swd_port()] = NULL;
+
+	swdptap_init();
+
+	/* Switch from JTAG to SWD mode */
+	swdptap_seq_out(0xFFFF, 16);
+	for(int i = 0; i < 50; i++)
+		swdptap_bit_out(1);
+	swdptap_seq_out(0xE79E, 16); /* 0b0111100111100111 */
+	swdp_line_reset();
+
+	if (count == 0) {
+		if (!adiv5_swdp_connect(0))
+			return -1;
+		return target_list?1:0;
+	}
+
+	/* Then via dormant state, for DPs that only wake from there */
+	swdp_line_reset();
+	swdptap_seq_out(0xE3BC, 16);
+	swdp_dormant_to_swd();
+
+	bool found = false;
+	for (size_t i = 0; i < count; i++)
+		found |= adiv5_swdp_connect(targetsel[i]);
+	if (!found)
+		return -1;
 	return target_list?1:0;
 }
 
@@ -110,23 +262,17 @@ static uint32_t adiv5_swdp_error(ADIv5_DP_t *dp)
 	if(err & ADIV5_DP_CTRLSTAT_WDATAERR)
 		clr |= ADIV5_DP_ABORT_WDERRCLR;
 
-	adiv5_dp_write(dp, ADIV5_DP_ABORT, clr);
+	if (clr)
+		adiv5_dp_write(dp, ADIV5_DP_ABORT, clr);
 	dp->fault = 0;
 
 	return err;
 }
 
-static uint32_t adiv5_swdp_low_access(ADIv5_DP_t *dp, uint8_t RnW,
-				      uint16_t addr, uint32_t value)
+static uint8_t adiv5_swdp_request(uint8_t RnW, uint16_t addr)
 {
 	bool APnDP = addr & ADIV5_APnDP;
-	addr &= 0xff;
 	uint8_t request = 0x81;
-	uint32_t response = 0;
-	uint8_t ack;
-	platform_timeout timeout;
-
-	if(APnDP && dp->fault) return 0;
 
 	if(APnDP) request ^= 0x22;
 	if(RnW)   request ^= 0x24;
@@ -136,36 +282,190 @@ static uint32_t adiv5_swdp_low_access(ADIv5_DP_t *dp, uint8_t RnW,
 	if((addr == 4) || (addr == 8))
 		request ^= 0x20;
 
+	return request;
+}
+
+/* With overrun detection the data phase follows WAIT and FAULT too */
+static void adiv5_swdp_skip_data(ADIv5_DP_t *dp, uint8_t RnW)
+{
+	uint32_t dummy;
+
+	if (!dp->orundetect)
+		return;
+	if (RnW)
+		swdptap_seq_in_parity(&dummy, 32);
+	else
+		swdptap_seq_out_parity(0, 32);
+}
+
+/* Perform a single SW-DP transaction without trailing idle cycles */
+static int adiv5_swdp_transfer(ADIv5_DP_t *dp, uint8_t RnW, uint16_t addr,
+			       uint32_t value, uint32_t *response)
+{
+	bool APnDP = addr & ADIV5_APnDP;
+	uint8_t request = adiv5_swdp_request(RnW, addr);
+	uint8_t ack;
+	unsigned waits = 0;
+	platform_timeout timeout;
+
+	*response = 0;
+	if(APnDP && dp->fault) return ADIV5_DP_OK;
+
+	if (!adiv5_swdp_select(dp))
+		return ADIV5_DP_NOACK;
+	STATS_INC(dp_transactions);
+	DPTRACE_START(start);
 	platform_timeout_set(&timeout, 2000);
 	do {
 		swdptap_seq_out(request, 8);
 		ack = swdptap_seq_in(3);
+		if (ack == SWDP_ACK_WAIT) {
+			uint32_t dummy;
+			STATS_INC(dp_wait);
+			waits++;
+			/* A WAIT is an overrun, clear it before retrying */
+			adiv5_swdp_skip_data(dp, RnW);
+			if (dp->orundetect)
+				adiv5_swdp_transfer(dp, ADIV5_LOW_WRITE,
+				                    ADIV5_DP_ABORT,
+				                    ADIV5_DP_ABORT_ORUNERRCLR,
+				                    &dummy);
+		}
 	} while (!platform_timeout_is_expired(&timeout) && ack == SWDP_ACK_WAIT);
+	DPTRACE(start, DPTRACE_REQUEST(APnDP, RnW, addr), ack, waits);
+
+	if (ack != SWDP_ACK_OK)
+		adiv5_dp_cache_invalidate(dp);
 
 	if (ack == SWDP_ACK_WAIT)
-		raise_exception(EXCEPTION_TIMEOUT, "SWDP ACK timeout");
+		return ADIV5_DP_WAIT;
 
 	if(ack == SWDP_ACK_FAULT) {
+		STATS_INC(dp_fault);
+		adiv5_swdp_skip_data(dp, RnW);
 		dp->fault = 1;
-		return 0;
+		dp->unchecked = true;
+		return ADIV5_DP_OK;
 	}
 
 	if(ack != SWDP_ACK_OK)
-		raise_exception(EXCEPTION_ERROR, "SWDP invalid ACK");
+		return ADIV5_DP_NOACK;
+
+	/* Accepting an AP access means all earlier ones succeeded */
+	if (APnDP)
+		dp->unchecked = adiv5_ap_reg_bus(addr);
 
 	if(RnW) {
-		if(swdptap_seq_in_parity(&response, 32))  /* Give up on parity error */
-			raise_exception(EXCEPTION_ERROR, "SWDP Parity error");
+		if(swdptap_seq_in_parity(response, 32)) { /* Give up on parity error */
+			STATS_INC(dp_parity);
+			adiv5_dp_cache_invalidate(dp);
+			return ADIV5_DP_PARITY;
+		}
 	} else {
 		swdptap_seq_out_parity(value, 32);
 	}
 
-	/* REMOVE THIS */
+	return ADIV5_DP_OK;
+}
+
+/* Send a run of queued writes without waiting on each ACK.  Once one is
+ * not accepted, STICKYORUN is set and the DP ignores all later ones, so
+ * the AP's TAR still points at the first failed write.  Sets *next to
+ * the index of that write, from which the run must be resent, or len.
+ */
+static int adiv5_swdp_posted(ADIv5_DP_t *dp, unsigned len, unsigned *next)
+{
+	unsigned failed = len;
+	uint32_t dummy;
+
+	*next = 0;
+	for (unsigned i = 0; i < len; i++) {
+		struct adiv5_dp_txn *txn = &dp->queue[i];
+		if (txn->RnW == ADIV5_LOW_READ)
+			return ADIV5_DP_OK;
+	}
+
+	if (!adiv5_swdp_select(dp))
+		return ADIV5_DP_NOACK;
+	STATS_ADD(dp_transactions, len);
+	for (unsigned i = 0; i < len; i++) {
+		struct adiv5_dp_txn *txn = &dp->queue[i];
+		DPTRACE_START(start);
+		swdptap_seq_out(adiv5_swdp_request(txn->RnW, txn->addr), 8);
+		uint8_t ack = swdptap_seq_in(3);
+		swdptap_seq_out_parity(txn->value, 32);
+		DPTRACE(start, DPTRACE_REQUEST(txn->addr & ADIV5_APnDP,
+		                               txn->RnW, txn->addr), ack, 0);
+		if ((ack != SWDP_ACK_OK) && (failed == len))
+			failed = i;
+		if ((failed == len) && (txn->addr & ADIV5_APnDP))
+			dp->unchecked = adiv5_ap_reg_bus(txn->addr);
+	}
+
+	*next = failed;
+	if (failed == len)
+		return ADIV5_DP_OK;
+	adiv5_dp_cache_invalidate(dp);
+	return adiv5_swdp_transfer(dp, ADIV5_LOW_WRITE, ADIV5_DP_ABORT,
+	                           ADIV5_DP_ABORT_ORUNERRCLR, &dummy);
+}
+
+static int adiv5_swdp_try_low_access(ADIv5_DP_t *dp, uint8_t RnW,
+				     uint16_t addr, uint32_t value,
+				     uint32_t *result)
+{
+	int status = adiv5_swdp_transfer(dp, RnW, addr, value, result);
+
+	/* Idle cycles to clock through posted writes */
 	swdptap_seq_out(0, 8);
 
+	return status;
+}
+
+static uint32_t adiv5_swdp_low_access(ADIv5_DP_t *dp, uint8_t RnW,
+				      uint16_t addr, uint32_t value)
+{
+	uint32_t response;
+	int status = adiv5_swdp_try_low_access(dp, RnW, addr, value, &response);
+
+	if (status)
+		adiv5_dp_raise(status);
 	return response;
 }
 
+/* Queued transactions are sent back to back, the idle cycles are only
+ * needed once the whole run has been sent.  Stops at the first error. */
+static int adiv5_swdp_try_flush(ADIv5_DP_t *dp)
+{
+	unsigned len = dp->queue_len;
+	unsigned i = 0;
+	int status = ADIV5_DP_OK;
+
+	/* Empty the queue first, so an error leaves it consistent */
+	dp->queue_len = 0;
+	if (dp->orundetect && !dp->fault)
+		status = adiv5_swdp_posted(dp, len, &i);
+	/* Anything left is sent checking each ACK, retrying on WAIT */
+	for (; !status && (i < len); i++) {
+		struct adiv5_dp_txn *txn = &dp->queue[i];
+		uint32_t ret;
+		status = adiv5_swdp_transfer(dp, txn->RnW, txn->addr,
+		                             txn->value, &ret);
+		if (txn->result)
+			*txn->result = ret;
+	}
+	swdptap_seq_out(0, 8);
+	return status;
+}
+
+static void adiv5_swdp_flush(ADIv5_DP_t *dp)
+{
+	int status = adiv5_swdp_try_flush(dp);
+
+	if (status)
+		adiv5_dp_raise(status);
+}
+
 static void adiv5_swdp_abort(ADIv5_DP_t *dp, uint32_t abort)
 {
 	adiv5_dp_write(dp, ADIV5_DP_ABORT, abort);
@@ -0,0 +1,627 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* This file implements the SWD commands of the ARM CMSIS-DAP v2 protocol,
+ * so that hosts with their own debugger (pyOCD, OpenOCD) can drive the
+ * wire directly.  DAP transfers go through the SW-DP transaction queue,
+ * which sends the transfers of a request back to back.  Only the SWD
+ * port is supported, there is no SWO, UART or timestamp support.  Vendor
+ * commands add the JTAG primitives for the remote hosted build.
+ */
+
+#include "general.h"
+#include "exception.h"
+#include "swdptap.h"
+#include "jtagtap.h"
+#include "target.h"
+#include "adiv5.h"
+#include "cmsis_dap.h"
+
+/* The DP driven by the host, apart from any found by a scan */
+static ADIv5_DP_t *dap_dp;
+static uint16_t dap_match_retry;
+static uint32_t dap_match_mask = 0xffffffff;
+
+static uint16_t dap_get16(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t dap_get32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static void dap_put32(uint8_t *p, uint32_t val)
+{
+	p[0] = val;
+	p[1] = val >> 8;
+	p[2] = val >> 16;
+	p[3] = val >> 24;
+}
+
+static uint16_t dap_addr(uint8_t request)
+{
+	return ((request & DAP_TRANSFER_APnDP) ? ADIV5_APnDP : 0) |
+	       (request & DAP_TRANSFER_A32);
+}
+
+static size_t dap_info_string(uint8_t *resp, size_t size, const char *s)
+{
+	size_t len = MIN(strlen(s) + 1, size - 2);
+
+	memcpy(resp + 2, s, len);
+	resp[len + 1] = 0;
+	resp[1] = len;
+	return len + 2;
+}
+
+static size_t dap_info(uint8_t id, uint8_t *resp, size_t size)
+{
+	resp[1] = 0;
+	switch (id) {
+	case DAP_INFO_VENDOR:
+		return dap_info_string(resp, size, DAP_VENDOR_NAME);
+	case DAP_INFO_PRODUCT:
+		return dap_info_string(resp, size, BOARD_IDENT);
+	case DAP_INFO_PROTOCOL:
+		return dap_info_string(resp, size, "2.0.0");
+	case DAP_INFO_FIRMWARE:
+		return dap_info_string(resp, size, FIRMWARE_VERSION);
+	case DAP_INFO_CAPABILITIES:
+		resp[1] = 1;
+		resp[2] = DAP_CAP_SWD;
+		return 3;
+	case DAP_INFO_PACKET_COUNT:
+		resp[1] = 1;
+		resp[2] = 1;
+		return 3;
+	case DAP_INFO_PACKET_SIZE:
+		resp[1] = 2;
+		resp[2] = DAP_PACKET_SIZE & 0xff;
+		resp[3] = DAP_PACKET_SIZE >> 8;
+		return 4;
+	}
+	return 2;
+}
+
+/* Take over the wire.  Targets found by a scan are dropped, as the host
+ * may leave their DPs in any state. */
+static bool dap_connect(void)
+{
+	target_list_free();
+	swdptap_init();
+	if (!dap_dp) {
+		dap_dp = adiv5_swdp_new();
+		adiv5_dp_ref(dap_dp);
+	}
+	dap_dp->fault = 0;
+	dap_dp->orundetect = false;
+	adiv5_dp_cache_invalidate(dap_dp);
+	return true;
+}
+
+/* Progress through a DAP_Transfer or DAP_TransferBlock request.  Queued
+ * transfers are only known to have completed once the queue has been
+ * flushed without a FAULT, which is when done catches up with count. */
+struct dap_xfer {
+	uint8_t ack;
+	unsigned count, done;
+	unsigned reads, done_reads;
+	uint32_t data[DAP_PACKET_SIZE / 4];
+};
+
+static bool dap_xfer_flush(struct dap_xfer *x)
+{
+	adiv5_dp_flush(dap_dp);
+	if (dap_dp->fault) {
+		x->ack = DAP_TRANSFER_FAULT;
+		return false;
+	}
+	x->done = x->count;
+	x->done_reads = x->reads;
+	return true;
+}
+
+/* Reads with a match value are polled here, rather than queued */
+static bool dap_xfer_match(struct dap_xfer *x, uint8_t request, uint32_t match)
+{
+	uint16_t addr = dap_addr(request);
+
+	if (!dap_xfer_flush(x))
+		return false;
+	for (unsigned retry = 0; ; retry++) {
+		uint32_t val = dap_dp->dp_read(dap_dp, addr);
+		if (dap_dp->fault) {
+			x->ack = DAP_TRANSFER_FAULT;
+			return false;
+		}
+		if ((val & dap_match_mask) == match)
+			return true;
+		if (retry >= dap_match_retry) {
+			x->ack = DAP_TRANSFER_OK | DAP_TRANSFER_MISMATCH;
+			return false;
+		}
+	}
+}
+
+/* Host writes to DP registers the SW-DP driver needs to know about */
+static void dap_xfer_dp_write(uint16_t addr, uint32_t value)
+{
+	if (addr == ADIV5_DP_CTRLSTAT)
+		dap_dp->orundetect = value & ADIV5_DP_CTRLSTAT_ORUNDETECT;
+}
+
+/* Run the transfers of a DAP_Transfer request.  AP reads are posted, so
+ * each one returns the result of the one before, and RDBUFF is read to
+ * collect the last. */
+static void dap_transfer_run(struct dap_xfer *x, const uint8_t *p,
+                             const uint8_t *end, unsigned count,
+                             unsigned max_reads)
+{
+	uint32_t *posted = NULL;
+
+	for (unsigned i = 0; i < count; i++) {
+		if (p >= end)
+			break;
+		uint8_t request = *p++;
+		uint16_t addr = dap_addr(request);
+		bool ap_read = (request & (DAP_TRANSFER_APnDP |
+		                           DAP_TRANSFER_RnW |
+		                           DAP_TRANSFER_MATCH)) ==
+		               (DAP_TRANSFER_APnDP | DAP_TRANSFER_RnW);
+
+		if (posted && !ap_read) {
+			adiv5_dp_queue_read(dap_dp, ADIV5_DP_RDBUFF, posted);
+			posted = NULL;
+		}
+
+		if (request & DAP_TRANSFER_RnW) {
+			if (request & DAP_TRANSFER_MATCH) {
+				if (end - p < 4)
+					break;
+				if (!dap_xfer_match(x, request, dap_get32(p)))
+					return;
+				p += 4;
+			} else {
+				if (x->reads == max_reads)
+					break;
+				uint32_t *result = &x->data[x->reads++];
+				if (addr & ADIV5_APnDP) {
+					adiv5_dp_queue_read(dap_dp, addr, posted);
+					posted = result;
+				} else {
+					adiv5_dp_queue_read(dap_dp, addr, result);
+				}
+			}
+		} else {
+			if (end - p < 4)
+				break;
+			uint32_t value = dap_get32(p);
+			p += 4;
+			if (request & DAP_TRANSFER_MASK) {
+				dap_match_mask = value;
+			} else if (addr & ADIV5_APnDP) {
+				adiv5_dp_queue_write(dap_dp, addr, value);
+			} else {
+				/* Don't touch the DP once an AP access faulted */
+				if (!dap_xfer_flush(x))
+					return;
+				adiv5_dp_queue_write(dap_dp, addr, value);
+				dap_xfer_dp_write(addr, value);
+			}
+		}
+		x->count++;
+	}
+
+	if (posted)
+		adiv5_dp_queue_read(dap_dp, ADIV5_DP_RDBUFF, posted);
+	dap_xfer_flush(x);
+}
+
+/* Run a DAP_TransferBlock request, all to or from the same register */
+static void dap_transfer_block_run(struct dap_xfer *x, uint8_t request,
+                                   const uint8_t *p, unsigned count)
+{
+	uint16_t addr = dap_addr(request);
+	uint32_t *posted = NULL;
+
+	if (!(request & DAP_TRANSFER_RnW)) {
+		for (unsigned i = 0; i < count; i++, p += 4) {
+			adiv5_dp_queue_write(dap_dp, addr, dap_get32(p));
+			if (!(addr & ADIV5_APnDP))
+				dap_xfer_dp_write(addr, dap_get32(p));
+		}
+		x->count = count;
+		dap_xfer_flush(x);
+		return;
+	}
+
+	for (unsigned i = 0; i < count; i++) {
+		uint32_t *result = &x->data[x->reads++];
+		if (addr & ADIV5_APnDP) {
+			adiv5_dp_queue_read(dap_dp, addr, posted);
+			posted = result;
+		} else {
+			adiv5_dp_queue_read(dap_dp, addr, result);
+		}
+	}
+	if (posted)
+		adiv5_dp_queue_read(dap_dp, ADIV5_DP_RDBUFF, posted);
+	x->count = count;
+	dap_xfer_flush(x);
+}
+
+/* Turn an exception from the SW-DP driver into a transfer response */
+static void dap_xfer_exception(struct dap_xfer *x, uint32_t type)
+{
+	/* Drop whatever was still queued */
+	dap_dp->queue_len = 0;
+	if (type == EXCEPTION_TIMEOUT)
+		x->ack = DAP_TRANSFER_WAIT;
+	else
+		x->ack = DAP_TRANSFER_ERROR;
+}
+
+static void dap_xfer_start(struct dap_xfer *x)
+{
+	x->ack = DAP_TRANSFER_OK;
+	x->count = x->done = 0;
+	x->reads = x->done_reads = 0;
+	/* Let AP accesses reach the target again, it answers FAULT itself
+	 * for as long as the host leaves the sticky errors set */
+	dap_dp->fault = 0;
+}
+
+/* Length of a DAP_Transfer request, which depends on its transfers */
+static size_t dap_transfer_len(const uint8_t *req, size_t len)
+{
+	size_t n = 3;
+
+	for (unsigned i = 0; (n < len) && (i < req[2]); i++) {
+		uint8_t request = req[n++];
+		if (!(request & DAP_TRANSFER_RnW) || (request & DAP_TRANSFER_MATCH))
+			n += 4;
+	}
+	return MIN(n, len);
+}
+
+static size_t dap_transfer(const uint8_t *req, size_t len,
+                           uint8_t *resp, size_t size)
+{
+	struct dap_xfer x;
+	volatile struct exception e;
+
+	resp[1] = 0;
+	resp[2] = 0;
+	if (!dap_dp || (len < 3))
+		return 3;
+
+	dap_xfer_start(&x);
+	TRY_CATCH (e, EXCEPTION_ALL) {
+		dap_transfer_run(&x, req + 3, req + len, req[2],
+		                 MIN((size - 3) / 4, sizeof(x.data) / 4));
+	}
+	if (e.type)
+		dap_xfer_exception(&x, e.type);
+
+	resp[1] = x.done;
+	resp[2] = x.ack;
+	for (unsigned i = 0; i < x.done_reads; i++)
+		dap_put32(resp + 3 + 4 * i, x.data[i]);
+	return 3 + 4 * x.done_reads;
+}
+
+static size_t dap_transfer_block(const uint8_t *req, size_t len,
+                                 uint8_t *resp, size_t size)
+{
+	struct dap_xfer x;
+	volatile struct exception e;
+
+	resp[1] = 0;
+	resp[2] = 0;
+	resp[3] = 0;
+	if (!dap_dp || (len < 5))
+		return 4;
+
+	uint8_t request = req[4];
+	/* Only as many words as fit in the request or the response */
+	size_t max = (request & DAP_TRANSFER_RnW) ?
+	             MIN((size - 4) / 4, sizeof(x.data) / 4) : (len - 5) / 4;
+	const unsigned count = MIN(dap_get16(req + 2), max);
+
+	dap_xfer_start(&x);
+	TRY_CATCH (e, EXCEPTION_ALL) {
+		dap_transfer_block_run(&x, request, req + 5, count);
+	}
+	if (e.type)
+		dap_xfer_exception(&x, e.type);
+
+	resp[1] = x.done & 0xff;
+	resp[2] = x.done >> 8;
+	resp[3] = x.ack;
+	for (unsigned i = 0; i < x.done_reads; i++)
+		dap_put32(resp + 4 + 4 * i, x.data[i]);
+	return 4 + 4 * x.done_reads;
+}
+
+static uint8_t dap_write_abort(uint32_t abort)
+{
+	uint32_t dummy;
+
+	if (!dap_dp)
+		return DAP_ERROR;
+	int status = adiv5_dp_try_low_access(dap_dp, ADIV5_LOW_WRITE,
+	                                     ADIV5_DP_ABORT, abort, &dummy);
+	dap_dp->fault = 0;
+	return status ? DAP_ERROR : DAP_OK;
+}
+
+static void dap_seq_out(const uint8_t *data, unsigned bits)
+{
+	for (; bits > 8; bits -= 8)
+		swdptap_seq_out(*data++, 8);
+	swdptap_seq_out(*data, bits);
+}
+
+static void dap_seq_in(uint8_t *data, unsigned bits)
+{
+	for (; bits > 8; bits -= 8)
+		*data++ = swdptap_seq_in(8);
+	*data = swdptap_seq_in(bits);
+}
+
+/* Raw sequences.  The SWD primitives turn the line around themselves,
+ * with one cycle, whenever the direction changes. */
+static size_t dap_swd_sequence(const uint8_t *req, size_t len,
+                               uint8_t *resp, size_t size, size_t *used)
+{
+	const uint8_t *p = req + 2;
+	const uint8_t *end = req + len;
+	uint8_t *out = resp + 2;
+
+	resp[1] = DAP_ERROR;
+	if (len < 2)
+		return 2;
+	for (unsigned i = 0; i < req[1]; i++) {
+		if (p >= end)
+			return 2;
+		uint8_t info = *p++;
+		unsigned bits = (info & 0x3f) ? (info & 0x3f) : 64;
+		unsigned bytes = (bits + 7) / 8;
+		if (info & 0x80) {
+			if (out + bytes > resp + size)
+				return 2;
+			dap_seq_in(out, bits);
+			out += bytes;
+		} else {
+			if (p + bytes > end)
+				return 2;
+			dap_seq_out(p, bits);
+			p += bytes;
+		}
+	}
+	*used = p - req;
+	resp[1] = DAP_OK;
+	return out - resp;
+}
+
+static size_t dap_swj_sequence(const uint8_t *req, size_t len,
+                               uint8_t *resp, size_t *used)
+{
+	resp[1] = DAP_ERROR;
+	if (len < 2)
+		return 2;
+	unsigned bits = req[1] ? req[1] : 256;
+	unsigned bytes = (bits + 7) / 8;
+	if (len < 2 + bytes)
+		return 2;
+	dap_seq_out(req + 2, bits);
+	*used = 2 + bytes;
+	resp[1] = DAP_OK;
+	return 2;
+}
+
+static size_t dap_swj_pins(const uint8_t *req, uint8_t *resp)
+{
+	uint8_t value = req[1];
+	uint8_t select = req[2];
+
+	/* Only nRESET can be driven, SWCLK and SWDIO belong to the SWD port */
+	if (select & DAP_SWJ_nRESET)
+		platform_srst_set_val(!(value & DAP_SWJ_nRESET));
+	uint32_t wait = dap_get32(req + 3);
+	if (wait && (select & DAP_SWJ_nRESET)) {
+		platform_timeout t;
+		platform_timeout_set_us(&t, wait);
+		while (!platform_timeout_is_expired(&t) &&
+		       (platform_srst_get_val() != !(value & DAP_SWJ_nRESET)));
+	}
+	resp[1] = platform_srst_get_val() ? 0 : DAP_SWJ_nRESET;
+	return 2;
+}
+
+static size_t dap_jtag_tdi_tdo(const uint8_t *req, size_t len,
+                               uint8_t *resp, size_t size, size_t *used)
+{
+	resp[1] = DAP_ERROR;
+	if (len < 3)
+		return 2;
+	unsigned bits = req[2] ? req[2] : DAP_VENDOR_JTAG_BITS;
+	unsigned bytes = (bits + 7) / 8;
+	if ((len < 3 + bytes) || (size < 2 + bytes))
+		return 2;
+	jtagtap_tdi_tdo_seq(resp + 2, req[1], req + 3, bits);
+	*used = 3 + bytes;
+	resp[1] = DAP_OK;
+	return 2 + bytes;
+}
+
+/* Execute the command at req, storing the number of request bytes it
+ * used in *used.  Returns the length of its response. */
+static size_t dap_command(const uint8_t *req, size_t len,
+                          uint8_t *resp, size_t size, size_t *used);
+
+static size_t dap_execute_commands(const uint8_t *req, size_t len,
+                                   uint8_t *resp, size_t size, size_t *used)
+{
+	size_t in = 2, out = 2;
+
+	if (len < 2)
+		return 0;
+	resp[1] = 0;
+	for (unsigned i = 0; i < req[1]; i++) {
+		size_t n, rlen;
+		if ((in >= len) || (req[in] == DAP_EXECUTE_COMMANDS) ||
+		    (size - out < 4))
+			break;
+		rlen = dap_command(req + in, len - in, resp + out, size - out, &n);
+		if (resp[out] == DAP_INVALID)
+			break;
+		in += n;
+		out += rlen;
+		resp[1]++;
+	}
+	*used = in;
+	return out;
+}
+
+/* Fixed request lengths, including the command ID */
+static size_t dap_request_len(uint8_t id)
+{
+	switch (id) {
+	case DAP_INFO: return 2;
+	case DAP_HOST_STATUS: return 3;
+	case DAP_CONNECT: return 2;
+	case DAP_WRITE_ABORT: return 6;
+	case DAP_DELAY: return 3;
+	case DAP_SWJ_PINS: return 7;
+	case DAP_SWJ_CLOCK: return 5;
+	case DAP_SWD_CONFIGURE: return 2;
+	case DAP_TRANSFER_CONFIGURE: return 6;
+	case DAP_VENDOR_JTAG_TMS: return 6;
+	case DAP_VENDOR_JTAG_NEXT: return 3;
+	}
+	return 1;
+}
+
+static size_t dap_command(const uint8_t *req, size_t len,
+                          uint8_t *resp, size_t size, size_t *used)
+{
+	uint8_t id = req[0];
+
+	*used = dap_request_len(id);
+	resp[0] = id;
+	/* Responses other than Transfer data need at most 4 bytes */
+	if ((len < *used) || (size < 4)) {
+		resp[0] = DAP_INVALID;
+		return 1;
+	}
+
+	switch (id) {
+	case DAP_INFO:
+		return dap_info(req[1], resp, size);
+	case DAP_HOST_STATUS:
+		resp[1] = DAP_OK;
+		return 2;
+	case DAP_CONNECT:
+		if ((req[1] == DAP_PORT_DEFAULT) || (req[1] == DAP_PORT_SWD))
+			resp[1] = dap_connect() ? DAP_PORT_SWD : 0;
+		else
+			resp[1] = 0;
+		return 2;
+	case DAP_DISCONNECT:
+		resp[1] = DAP_OK;
+		return 2;
+	case DAP_TRANSFER_CONFIGURE:
+		/* Idle cycles and WAIT retries are the SW-DP driver's own */
+		dap_match_retry = dap_get16(req + 4);
+		resp[1] = DAP_OK;
+		return 2;
+	case DAP_TRANSFER:
+		if (len >= 3)
+			*used = dap_transfer_len(req, len);
+		return dap_transfer(req, *used, resp, size);
+	case DAP_TRANSFER_BLOCK:
+		if ((len >= 5) && !(req[4] & DAP_TRANSFER_RnW))
+			*used = MIN(5 + 4 * (size_t)dap_get16(req + 2), len);
+		else
+			*used = MIN((size_t)5, len);
+		return dap_transfer_block(req, *used, resp, size);
+	case DAP_TRANSFER_ABORT:
+		/* Transfers run to completion before the next request is read */
+		return 0;
+	case DAP_WRITE_ABORT:
+		resp[1] = dap_write_abort(dap_get32(req + 2));
+		return 2;
+	case DAP_DELAY:
+		platform_delay((dap_get16(req + 1) + 999) / 1000);
+		resp[1] = DAP_OK;
+		return 2;
+	case DAP_RESET_TARGET:
+		/* No device specific reset sequence */
+		resp[1] = DAP_OK;
+		resp[2] = 0;
+		return 3;
+	case DAP_SWJ_PINS:
+		return dap_swj_pins(req, resp);
+	case DAP_SWJ_CLOCK:
+#ifdef PLATFORM_HAS_FREQUENCY
+		platform_max_frequency_set(dap_get32(req + 1));
+#endif
+		resp[1] = DAP_OK;
+		return 2;
+	case DAP_SWJ_SEQUENCE:
+		return dap_swj_sequence(req, len, resp, used);
+	case DAP_SWD_CONFIGURE:
+		/* Only the default turnaround and no data phase on WAIT/FAULT */
+		resp[1] = (req[1] == 0) ? DAP_OK : DAP_ERROR;
+		return 2;
+	case DAP_SWD_SEQUENCE:
+		return dap_swd_sequence(req, len, resp, size, used);
+	case DAP_EXECUTE_COMMANDS:
+		return dap_execute_commands(req, len, resp, size, used);
+	case DAP_VENDOR_JTAG_INIT:
+		resp[1] = jtagtap_init() ? DAP_ERROR : DAP_OK;
+		return 2;
+	case DAP_VENDOR_JTAG_RESET:
+		jtagtap_reset();
+		resp[1] = DAP_OK;
+		return 2;
+	case DAP_VENDOR_JTAG_TMS:
+		resp[1] = (req[1] && (req[1] <= 32)) ? DAP_OK : DAP_ERROR;
+		if (resp[1] == DAP_OK)
+			jtagtap_tms_seq(dap_get32(req + 2), req[1]);
+		return 2;
+	case DAP_VENDOR_JTAG_TDI_TDO:
+		return dap_jtag_tdi_tdo(req, len, resp, size, used);
+	case DAP_VENDOR_JTAG_NEXT:
+		resp[1] = jtagtap_next(req[1], req[2]);
+		return 2;
+	}
+	resp[0] = DAP_INVALID;
+	return 1;
+}
+
+size_t dap_process(const uint8_t *req, size_t len, uint8_t *resp, size_t size)
+{
+	size_t used;
+
+	if (!len)
+		return 0;
+	return dap_command(req, len, resp, size, &used);
+}
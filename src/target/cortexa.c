@@ -57,9 +57,12 @@ static uint32_t apb_read(target *t, uint16_t reg);
 static void write_gpreg(target *t, uint8_t regno, uint32_t val);
 static uint32_t read_gpreg(target *t, uint8_t regno);
 
+#define TLB_ENTRIES 4
+
 struct cortexa_priv {
 	uint32_t base;
 	ADIv5_AP_t *apb;
+	ADIv5_AP_t *ahb;	/* System MEM-AP, NULL if there is none */
 	struct {
 		uint32_t r[16];
 		uint32_t cpsr;
@@ -71,11 +74,24 @@ struct cortexa_priv {
 	uint32_t bcr0;
 	uint32_t bvr0;
 	bool mmu_fault;
+	uint32_t cti;	/* Base of this core's CTI, 0 if none was found */
+	/* Recent translations by 4K page, flushed when the core resumes or
+	 * anything written could have changed them */
+	struct {
+		uint32_t va;
+		uint32_t pa;
+	} tlb[TLB_ENTRIES];
+	uint8_t tlb_valid;
+	uint8_t tlb_next;
 };
 
 /* This may be specific to Cortex-A9 */
 #define CACHE_LINE_LENGTH        (8*4)
 
+/* Largest translation granule, accesses through the AHB-AP are split at
+ * this boundary so each piece can be translated on its own */
+#define PAGE_SIZE                4096
+
 /* Debug APB registers */
 #define DBGDIDR                  0
 
@@ -113,6 +129,25 @@ struct cortexa_priv {
 #define DBGBCR_BAS_HIGH_HW       (0xc << 5)
 #define DBGBCR_EN                (1 << 0)
 
+/* CoreSight CTI registers */
+#define CTICONTROL               0x000
+#define CTICONTROL_GLBEN         (1 << 0)
+#define CTIINTACK                0x010
+#define CTIAPPPULSE              0x01C
+#define CTIINEN(i)               (0x020 + 4*(i))
+#define CTIOUTEN(i)              (0x0A0 + 4*(i))
+#define CTIGATE                  0x140
+#define CTILAR                   0xFB0
+#define CTILAR_KEY               0xC5ACCE55
+
+/* Cortex-A CTI triggers, and the channels used to halt and restart the
+ * cores of a cluster together */
+#define CTI_TRIGIN_DBGTRIGGER    0
+#define CTI_TRIGOUT_EDBGRQ       0
+#define CTI_TRIGOUT_DBGRESTART   1
+#define CTI_CHAN_HALT            0
+#define CTI_CHAN_RESTART         1
+
 /* Instruction encodings for accessing the coprocessor interface */
 #define MCR 0xee000010
 #define MRC 0xee100010
@@ -182,12 +217,14 @@ static const char tdesc_cortex_a[] =
 	"  </feature>"
 	"</target>";
 
+/* The APB-AP has CSW set not to increment TAR, so TAR only needs writing
+ * when moving to another register, and repeated accesses can be queued. */
 static void apb_write(target *t, uint16_t reg, uint32_t val)
 {
 	struct cortexa_priv *priv = t->priv;
 	ADIv5_AP_t *ap = priv->apb;
 	uint32_t addr = priv->base + 4*reg;
-	adiv5_ap_write(ap, ADIV5_AP_TAR, addr);
+	adiv5_ap_tar(ap, addr);
 	adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_DRW, val);
 }
 
@@ -196,14 +233,97 @@ static uint32_t apb_read(target *t, uint16_t reg)
 	struct cortexa_priv *priv = t->priv;
 	ADIv5_AP_t *ap = priv->apb;
 	uint32_t addr = priv->base + 4*reg;
-	adiv5_ap_write(ap, ADIV5_AP_TAR, addr);
+	adiv5_ap_tar(ap, addr);
 	adiv5_dp_low_access(ap->dp, ADIV5_LOW_READ, ADIV5_AP_DRW, 0);
 	return adiv5_dp_low_access(ap->dp, ADIV5_LOW_READ, ADIV5_DP_RDBUFF, 0);
 }
 
+/* Write count words to the same register, queued back to back */
+static void apb_write_block(target *t, uint16_t reg,
+                            const uint32_t *src, size_t count)
+{
+	struct cortexa_priv *priv = t->priv;
+	ADIv5_AP_t *ap = priv->apb;
+	adiv5_ap_tar(ap, priv->base + 4*reg);
+	for (size_t i = 0; i < count; i++)
+		adiv5_dp_queue_write(ap->dp, ADIV5_AP_DRW, src[i]);
+	adiv5_dp_flush(ap->dp);
+}
+
+/* Read count words from the same register.  Each posted read returns the
+ * previous one's data, so only the last needs RDBUFF. */
+static void apb_read_block(target *t, uint16_t reg,
+                           uint32_t *dest, size_t count)
+{
+	struct cortexa_priv *priv = t->priv;
+	ADIv5_AP_t *ap = priv->apb;
+	if (count == 0)
+		return;
+	adiv5_ap_tar(ap, priv->base + 4*reg);
+	adiv5_dp_queue_read(ap->dp, ADIV5_AP_DRW, NULL);
+	for (size_t i = 0; i < count - 1; i++)
+		adiv5_dp_queue_read(ap->dp, ADIV5_AP_DRW, &dest[i]);
+	adiv5_dp_queue_read(ap->dp, ADIV5_DP_RDBUFF, &dest[count - 1]);
+	adiv5_dp_flush(ap->dp);
+}
+
+static void tlb_flush(target *t)
+{
+	struct cortexa_priv *priv = t->priv;
+	priv->tlb_valid = 0;
+}
+
+static void cti_write(target *t, uint16_t reg, uint32_t val)
+{
+	struct cortexa_priv *priv = t->priv;
+	ADIv5_AP_t *ap = priv->apb;
+	adiv5_ap_tar(ap, priv->cti + reg);
+	adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_DRW, val);
+}
+
+/* Write a CTI register of every core sharing this core's APB-AP */
+static void cti_write_cluster(target *t, uint16_t reg, uint32_t val)
+{
+	struct cortexa_priv *priv = t->priv;
+	for (target *c = target_list; c; c = c->next) {
+		struct cortexa_priv *cpriv = c->priv;
+		if ((c->driver == cortexa_driver_str) &&
+		    (cpriv->apb == priv->apb) && cpriv->cti)
+			cti_write(c, reg, val);
+	}
+}
+
+/* Route every core's halt to the halt channel, and both channels back to
+ * each core, so a halt anywhere stops the whole cluster */
+static void cti_setup(target *t)
+{
+	cti_write_cluster(t, CTILAR, CTILAR_KEY);
+	cti_write_cluster(t, CTICONTROL, 0);
+	cti_write_cluster(t, CTIINTACK, 0xff);
+	cti_write_cluster(t, CTIINEN(CTI_TRIGIN_DBGTRIGGER), 1 << CTI_CHAN_HALT);
+	cti_write_cluster(t, CTIOUTEN(CTI_TRIGOUT_EDBGRQ), 1 << CTI_CHAN_HALT);
+	cti_write_cluster(t, CTIOUTEN(CTI_TRIGOUT_DBGRESTART),
+	                  1 << CTI_CHAN_RESTART);
+	cti_write_cluster(t, CTIGATE, (1 << CTI_CHAN_HALT) |
+	                              (1 << CTI_CHAN_RESTART));
+	cti_write_cluster(t, CTICONTROL, CTICONTROL_GLBEN);
+}
+
+/* Acknowledge the halt requests and restart every halted core */
+static void cti_restart(target *t)
+{
+	cti_write_cluster(t, CTIINTACK, 1 << CTI_TRIGOUT_EDBGRQ);
+	cti_write(t, CTIAPPPULSE, 1 << CTI_CHAN_RESTART);
+}
+
 static uint32_t va_to_pa(target *t, uint32_t va)
 {
 	struct cortexa_priv *priv = t->priv;
+	for (int i = 0; i < TLB_ENTRIES; i++)
+		if ((priv->tlb_valid & (1 << i)) &&
+		    (priv->tlb[i].va == (va & ~0xfff)))
+			return priv->tlb[i].pa | (va & 0xfff);
+
 	write_gpreg(t, 0, va);
 	apb_write(t, DBGITR, MCR | ATS1CPR);
 	apb_write(t, DBGITR, MRC | PAR);
@@ -213,14 +333,26 @@ static uint32_t va_to_pa(target *t, uint32_t va)
 	uint32_t pa = (par & ~0xfff) | (va & 0xfff);
 	DEBUG("%s: VA = 0x%08"PRIx32", PAR = 0x%08"PRIx32", PA = 0x%08"PRIX32"\n",
               __func__, va, par, pa);
+	if (!(par & 1)) {
+		unsigned i = priv->tlb_next;
+		priv->tlb_next = (i + 1) % TLB_ENTRIES;
+		priv->tlb[i].va = va & ~0xfff;
+		priv->tlb[i].pa = par & ~0xfff;
+		priv->tlb_valid |= 1 << i;
+	}
 	return pa;
 }
 
+/* Words moved through DCC per block transfer, bounding the stack used */
+#define DCC_CHUNK_WORDS	32
+
 static void cortexa_slow_mem_read(target *t, void *dest, target_addr src, size_t len)
 {
 	struct cortexa_priv *priv = t->priv;
 	unsigned words = (len + (src & 3) + 3) / 4;
-	uint32_t dest32[words];
+	uint32_t dest32[DCC_CHUNK_WORDS];
+	uint8_t *dest8 = dest;
+	size_t skip = src & 3;
 
 	/* Set r0 to aligned src address */
 	write_gpreg(t, 0, src & ~3);
@@ -237,10 +369,18 @@ static void cortexa_slow_mem_read(target *t, void *dest, target_addr src, size_t
 	 * ignored. */
 	apb_read(t, DBGDTRTX);
 
-	for (unsigned i = 0; i < words; i++)
-		dest32[i] = apb_read(t, DBGDTRTX);
-
-	memcpy(dest, (uint8_t*)dest32 + (src & 3), len);
+	/* Each read of DBGDTRTX issues the next load */
+	while (words) {
+		unsigned n = MIN(words, DCC_CHUNK_WORDS);
+		size_t bytes = MIN(n * 4 - skip, len);
+
+		apb_read_block(t, DBGDTRTX, dest32, n);
+		memcpy(dest8, (uint8_t*)dest32 + skip, bytes);
+		dest8 += bytes;
+		len -= bytes;
+		words -= n;
+		skip = 0;
+	}
 
 	/* Switch back to stalling DCC mode */
 	dbgdscr = (dbgdscr & ~DBGDSCR_EXTDCCMODE_MASK) | DBGDSCR_EXTDCCMODE_STALL;
@@ -277,36 +417,145 @@ static void cortexa_slow_mem_write_bytes(target *t, target_addr dest, const uint
 static void cortexa_slow_mem_write(target *t, target_addr dest, const void *src, size_t len)
 {
 	struct cortexa_priv *priv = t->priv;
-	if (len == 0)
-		return;
+	const uint8_t *src8 = src;
+
+	/* Bytes up to the first aligned word, and after the last */
+	size_t head = MIN((4 - (dest & 3)) & 3, len);
+	size_t tail = (len - head) & 3;
+	size_t words = (len - head) / 4;
+
+	if (head)
+		cortexa_slow_mem_write_bytes(t, dest, src8, head);
+	if (words && !priv->mmu_fault) {
+		uint32_t src32[DCC_CHUNK_WORDS];
+		const uint8_t *p = src8 + head;
+		write_gpreg(t, 0, dest + head);
+
+		/* Switch to fast DCC mode */
+		uint32_t dbgdscr = apb_read(t, DBGDSCR);
+		dbgdscr = (dbgdscr & ~DBGDSCR_EXTDCCMODE_MASK) | DBGDSCR_EXTDCCMODE_FAST;
+		apb_write(t, DBGDSCR, dbgdscr);
+
+		apb_write(t, DBGITR, 0xeca05e01); /* stc 14, cr5, [r0], #4 */
+
+		/* Each write of DBGDTRRX issues the next store */
+		for (size_t i = 0; i < words; ) {
+			unsigned n = MIN(words - i, DCC_CHUNK_WORDS);
+			memcpy(src32, p, n * 4);
+			apb_write_block(t, DBGDTRRX, src32, n);
+			p += n * 4;
+			i += n;
+		}
 
-	if ((dest & 3) || (len & 3)) {
-		cortexa_slow_mem_write_bytes(t, dest, src, len);
-		return;
+		/* Switch back to stalling DCC mode */
+		dbgdscr = (dbgdscr & ~DBGDSCR_EXTDCCMODE_MASK) | DBGDSCR_EXTDCCMODE_STALL;
+		apb_write(t, DBGDSCR, dbgdscr);
+
+		if (apb_read(t, DBGDSCR) & DBGDSCR_SDABORT_L) {
+			/* Memory access aborted, flag a fault */
+			apb_write(t, DBGDRCR, DBGDRCR_CSE);
+			priv->mmu_fault = true;
+		}
 	}
+	if (tail && !priv->mmu_fault)
+		cortexa_slow_mem_write_bytes(t, dest + len - tail,
+		                             src8 + len - tail, tail);
+	/* The write may have been to the page tables */
+	tlb_flush(t);
+}
 
-	write_gpreg(t, 0, dest);
-	const uint32_t *src32 = src;
+/* While halted, clean (before reading) or clean and invalidate (before
+ * writing) the data cache lines of va..va+len, so the system bus sees
+ * what the core does.  The I-cache is invalidated on resume. */
+static void cortexa_dcache_maint(target *t, uint32_t va, size_t len,
+                                 uint32_t op)
+{
+	for (uint32_t cl = va & ~(CACHE_LINE_LENGTH - 1);
+	     cl < va + len; cl += CACHE_LINE_LENGTH) {
+		write_gpreg(t, 0, cl);
+		apb_write(t, DBGITR, MCR | op);
+	}
+}
 
-	/* Switch to fast DCC mode */
-	uint32_t dbgdscr = apb_read(t, DBGDSCR);
-	dbgdscr = (dbgdscr & ~DBGDSCR_EXTDCCMODE_MASK) | DBGDSCR_EXTDCCMODE_FAST;
-	apb_write(t, DBGDSCR, dbgdscr);
+/* Memory access through the AHB-AP.  While halted each page is translated
+ * with the MMU and the caches are maintained.  While running the address
+ * is taken to be physical, and this is the only path that works at all.
+ */
+static void cortexa_mem_read(target *t, void *dest, target_addr src, size_t len)
+{
+	struct cortexa_priv *priv = t->priv;
+	uint8_t *dest8 = dest;
 
-	apb_write(t, DBGITR, 0xeca05e01); /* stc 14, cr5, [r0], #4 */
+	if (!(apb_read(t, DBGDSCR) & DBGDSCR_HALTED)) {
+		adiv5_mem_read(priv->ahb, dest, src, len);
+		return;
+	}
+	while (len && !priv->mmu_fault) {
+		size_t chunk = MIN(len, PAGE_SIZE - (src & (PAGE_SIZE - 1)));
+		uint32_t pa = va_to_pa(t, src);
+		if (priv->mmu_fault)
+			break;
+		cortexa_dcache_maint(t, src, chunk, DCCMVAC);
+		adiv5_mem_read(priv->ahb, dest8, pa, chunk);
+		dest8 += chunk;
+		src += chunk;
+		len -= chunk;
+	}
+}
 
-	for (; len; len -= 4)
-		apb_write(t, DBGDTRRX, *src32++);
+static void cortexa_mem_write(target *t, target_addr dest, const void *src, size_t len)
+{
+	struct cortexa_priv *priv = t->priv;
+	const uint8_t *src8 = src;
 
-	/* Switch back to stalling DCC mode */
-	dbgdscr = (dbgdscr & ~DBGDSCR_EXTDCCMODE_MASK) | DBGDSCR_EXTDCCMODE_STALL;
-	apb_write(t, DBGDSCR, dbgdscr);
+	if (!(apb_read(t, DBGDSCR) & DBGDSCR_HALTED)) {
+		adiv5_mem_write(priv->ahb, dest, src, len);
+		tlb_flush(t);
+		return;
+	}
+	while (len && !priv->mmu_fault) {
+		size_t chunk = MIN(len, PAGE_SIZE - (dest & (PAGE_SIZE - 1)));
+		uint32_t pa = va_to_pa(t, dest);
+		if (priv->mmu_fault)
+			break;
+		cortexa_dcache_maint(t, dest, chunk, DCCIMVAC);
+		adiv5_mem_write(priv->ahb, pa, src8, chunk);
+		src8 += chunk;
+		dest += chunk;
+		len -= chunk;
+	}
+	tlb_flush(t);
+}
 
-	if (apb_read(t, DBGDSCR) & DBGDSCR_SDABORT_L) {
-		/* Memory access aborted, flag a fault */
-		apb_write(t, DBGDRCR, DBGDRCR_CSE);
-		priv->mmu_fault = true;
+/* Find a MEM-AP onto the system bus on the same DP as the APB-AP */
+static ADIv5_AP_t *cortexa_find_ahb(ADIv5_AP_t *apb)
+{
+	for (int i = 0; i < 256; i++) {
+		if (i == apb->apsel)
+			continue;
+		ADIv5_AP_t *ap = adiv5_new_ap(apb->dp, i);
+		if (ap == NULL)
+			continue;
+		uint32_t type = ap->idr & ADIV5_AP_IDR_TYPE_MASK;
+		if (((ap->idr & ADIV5_AP_IDR_CLASS_MASK) == ADIV5_AP_IDR_CLASS_MEM) &&
+		    ((type == ADIV5_AP_IDR_TYPE_AHB) ||
+		     (type == ADIV5_AP_IDR_TYPE_AXI))) {
+			DEBUG("AP %d: system MEM-AP for Cortex-A\n", i);
+			adiv5_ap_ref(ap);
+			return ap;
+		}
+		adiv5_ap_ref(ap);
+		adiv5_ap_unref(ap);
 	}
+	return NULL;
+}
+
+static void cortexa_priv_free(void *priv)
+{
+	struct cortexa_priv *p = priv;
+	if (p->ahb)
+		adiv5_ap_unref(p->ahb);
+	adiv5_ap_unref(p->apb);
 }
 
 static bool cortexa_check_error(target *t)
@@ -324,16 +573,23 @@ bool cortexa_probe(ADIv5_AP_t *apb, uint32_t debug_base)
 
 	t = target_new();
 	adiv5_ap_ref(apb);
-	struct cortexa_priv *priv = calloc(1, sizeof(*priv));
+	struct cortexa_priv *priv = target_alloc(sizeof(*priv));
 	t->priv = priv;
-	t->priv_free = free;
+	t->priv_free = cortexa_priv_free;
 	priv->apb = apb;
-	t->mem_read = cortexa_slow_mem_read;
-	t->mem_write = cortexa_slow_mem_write;
+	priv->ahb = cortexa_find_ahb(apb);
+	if (priv->ahb) {
+		t->mem_read = cortexa_mem_read;
+		t->mem_write = cortexa_mem_write;
+	} else {
+		t->mem_read = cortexa_slow_mem_read;
+		t->mem_write = cortexa_slow_mem_write;
+	}
 
 	priv->base = debug_base;
 	/* Set up APB CSW, we won't touch this again */
-	uint32_t csw = apb->csw | ADIV5_AP_CSW_SIZE_WORD;
+	uint32_t csw = (apb->csw & ~ADIV5_AP_CSW_ADDRINC_MASK) |
+	               ADIV5_AP_CSW_ADDRINC_NONE | ADIV5_AP_CSW_SIZE_WORD;
 	adiv5_ap_write(apb, ADIV5_AP_CSW, csw);
 	uint32_t dbgdidr = apb_read(t, DBGDIDR);
 	priv->hw_breakpoint_max = ((dbgdidr >> 24) & 15)+1;
@@ -361,6 +617,22 @@ bool cortexa_probe(ADIv5_AP_t *apb, uint32_t debug_base)
 	return true;
 }
 
+/* CTIs are matched, in ROM table order, with the cores already found on
+ * the same AP */
+void cortexa_cti_probe(ADIv5_AP_t *apb, uint32_t cti_base)
+{
+	for (target *t = target_list; t; t = t->next) {
+		struct cortexa_priv *priv = t->priv;
+		if ((t->driver != cortexa_driver_str) || (priv->apb != apb) ||
+		    priv->cti)
+			continue;
+		DEBUG("CTI at 0x%08"PRIx32" for core at 0x%08"PRIx32"\n",
+		      cti_base, priv->base);
+		priv->cti = cti_base;
+		return;
+	}
+}
+
 bool cortexa_attach(target *t)
 {
 	struct cortexa_priv *priv = t->priv;
@@ -368,6 +640,7 @@ bool cortexa_attach(target *t)
 
 	/* Clear any pending fault condition */
 	target_check_error(t);
+	tlb_flush(t);
 
 	/* Enable halting debug mode */
 	uint32_t dbgdscr = apb_read(t, DBGDSCR);
@@ -390,6 +663,9 @@ bool cortexa_attach(target *t)
 	priv->hw_breakpoint_mask = 0;
 	priv->bcr0 = 0;
 
+	if (priv->cti)
+		cti_setup(t);
+
 	platform_srst_set_val(false);
 
 	return true;
@@ -424,6 +700,12 @@ void cortexa_detach(target *t)
 	apb_write(t, DBGDSCR, dbgdscr);
 	/* Clear sticky error and resume */
 	apb_write(t, DBGDRCR, DBGDRCR_CSE | DBGDRCR_RRQ);
+
+	/* Restart the rest of the cluster and stop cross halting */
+	if (priv->cti) {
+		cti_restart(t);
+		cti_write_cluster(t, CTICONTROL, 0);
+	}
 }
 
 
@@ -457,30 +739,73 @@ static void cortexa_regs_write(target *t, const void *data)
 {
 	struct cortexa_priv *priv = (struct cortexa_priv *)t->priv;
 	memcpy(&priv->reg_cache, data, t->regs_size);
+	/* A change of mode can change the translation regime */
+	tlb_flush(t);
+}
+
+/* Queued versions of apb_write/apb_read and the GPR accessors, so that the
+ * whole register save or restore goes out as one batch on the DP queue.
+ * Results are only valid after apb_flush(). */
+static void apb_queue_write(target *t, uint16_t reg, uint32_t val)
+{
+	struct cortexa_priv *priv = t->priv;
+	adiv5_ap_queue_tar(priv->apb, priv->base + 4*reg);
+	adiv5_dp_queue_write(priv->apb->dp, ADIV5_AP_DRW, val);
+}
+
+static void apb_queue_read(target *t, uint16_t reg, uint32_t *val)
+{
+	struct cortexa_priv *priv = t->priv;
+	adiv5_ap_queue_tar(priv->apb, priv->base + 4*reg);
+	adiv5_dp_queue_read(priv->apb->dp, ADIV5_AP_DRW, NULL);
+	adiv5_dp_queue_read(priv->apb->dp, ADIV5_DP_RDBUFF, val);
+}
+
+static void apb_flush(target *t)
+{
+	struct cortexa_priv *priv = t->priv;
+	adiv5_dp_flush(priv->apb->dp);
+}
+
+static void queue_read_gpreg(target *t, uint8_t regno, uint32_t *val)
+{
+	apb_queue_write(t, DBGITR, MCR | DBGDTRTXint | ((regno & 0xf) << 12));
+	apb_queue_read(t, DBGDTRTX, val);
+}
+
+static void queue_write_gpreg(target *t, uint8_t regno, uint32_t val)
+{
+	apb_queue_write(t, DBGDTRRX, val);
+	apb_queue_write(t, DBGITR, MRC | DBGDTRRXint | ((regno & 0xf) << 12));
 }
 
 static void cortexa_regs_read_internal(target *t)
 {
 	struct cortexa_priv *priv = (struct cortexa_priv *)t->priv;
+	uint32_t d[16][2];
 	/* Read general purpose registers */
 	for (int i = 0; i < 15; i++) {
-		priv->reg_cache.r[i] = read_gpreg(t, i);
+		queue_read_gpreg(t, i, &priv->reg_cache.r[i]);
 	}
 	/* Read PC, via r0.  MCR is UNPREDICTABLE for Rt = r15. */
-	apb_write(t, DBGITR, 0xe1a0000f); /* mov r0, pc */
-	priv->reg_cache.r[15] = read_gpreg(t, 0);
+	apb_queue_write(t, DBGITR, 0xe1a0000f); /* mov r0, pc */
+	queue_read_gpreg(t, 0, &priv->reg_cache.r[15]);
 	/* Read CPSR */
-	apb_write(t, DBGITR, 0xE10F0000); /* mrs r0, CPSR */
-	priv->reg_cache.cpsr = read_gpreg(t, 0);
+	apb_queue_write(t, DBGITR, 0xE10F0000); /* mrs r0, CPSR */
+	queue_read_gpreg(t, 0, &priv->reg_cache.cpsr);
 	/* Read FPSCR */
-	apb_write(t, DBGITR, 0xeef10a10); /* vmrs r0, fpscr */
-	priv->reg_cache.fpscr = read_gpreg(t, 0);
+	apb_queue_write(t, DBGITR, 0xeef10a10); /* vmrs r0, fpscr */
+	queue_read_gpreg(t, 0, &priv->reg_cache.fpscr);
 	/* Read out VFP registers */
 	for (int i = 0; i < 16; i++) {
 		/* Read D[i] to R0/R1 */
-		apb_write(t, DBGITR, 0xEC510B10 | i); /* vmov r0, r1, d0 */
-		priv->reg_cache.d[i] = ((uint64_t)read_gpreg(t, 1) << 32) | read_gpreg(t, 0);
+		apb_queue_write(t, DBGITR, 0xEC510B10 | i); /* vmov r0, r1, d0 */
+		queue_read_gpreg(t, 0, &d[i][0]);
+		queue_read_gpreg(t, 1, &d[i][1]);
 	}
+	apb_flush(t);
+	for (int i = 0; i < 16; i++)
+		priv->reg_cache.d[i] = ((uint64_t)d[i][1] << 32) | d[i][0];
 	priv->reg_cache.r[15] -= (priv->reg_cache.cpsr & CPSR_THUMB) ? 4 : 8;
 }
 
@@ -489,23 +814,24 @@ static void cortexa_regs_write_internal(target *t)
 	struct cortexa_priv *priv = (struct cortexa_priv *)t->priv;
 	/* First write back floats */
 	for (int i = 0; i < 16; i++) {
-		write_gpreg(t, 1, priv->reg_cache.d[i] >> 32);
-		write_gpreg(t, 0, priv->reg_cache.d[i]);
-		apb_write(t, DBGITR, 0xec410b10 | i); /* vmov d[i], r0, r1 */
+		queue_write_gpreg(t, 1, priv->reg_cache.d[i] >> 32);
+		queue_write_gpreg(t, 0, priv->reg_cache.d[i]);
+		apb_queue_write(t, DBGITR, 0xec410b10 | i); /* vmov d[i], r0, r1 */
 	}
 	/* Write back FPSCR */
-	write_gpreg(t, 0, priv->reg_cache.fpscr);
-	apb_write(t, DBGITR, 0xeee10a10); /* vmsr fpscr, r0 */
+	queue_write_gpreg(t, 0, priv->reg_cache.fpscr);
+	apb_queue_write(t, DBGITR, 0xeee10a10); /* vmsr fpscr, r0 */
 	/* Write back the CPSR */
-	write_gpreg(t, 0, priv->reg_cache.cpsr);
-	apb_write(t, DBGITR, 0xe12ff000); /* msr CPSR_fsxc, r0 */
+	queue_write_gpreg(t, 0, priv->reg_cache.cpsr);
+	apb_queue_write(t, DBGITR, 0xe12ff000); /* msr CPSR_fsxc, r0 */
 	/* Write back PC, via r0.  MRC clobbers CPSR instead */
-	write_gpreg(t, 0, priv->reg_cache.r[15]);
-	apb_write(t, DBGITR, 0xe1a0f000); /* mov pc, r0 */
+	queue_write_gpreg(t, 0, priv->reg_cache.r[15]);
+	apb_queue_write(t, DBGITR, 0xe1a0f000); /* mov pc, r0 */
 	/* Finally the GP registers now that we're done using them */
 	for (int i = 0; i < 15; i++) {
-		write_gpreg(t, i, priv->reg_cache.r[i]);
+		queue_write_gpreg(t, i, priv->reg_cache.r[i]);
 	}
+	apb_flush(t);
 }
 
 static void cortexa_reset(target *t)
@@ -542,9 +868,14 @@ static void cortexa_reset(target *t)
 
 static void cortexa_halt_request(target *t)
 {
+	struct cortexa_priv *priv = t->priv;
 	volatile struct exception e;
 	TRY_CATCH (e, EXCEPTION_TIMEOUT) {
-		apb_write(t, DBGDRCR, DBGDRCR_HRQ);
+		/* With a CTI this halts the whole cluster at once */
+		if (priv->cti)
+			cti_write(t, CTIAPPPULSE, 1 << CTI_CHAN_HALT);
+		else
+			apb_write(t, DBGDRCR, DBGDRCR_HRQ);
 	}
 	if (e.type) {
 		tc_printf(t, "Timeout sending interrupt, is target in WFI?\n");
@@ -598,6 +929,7 @@ static enum target_halt_reason cortexa_halt_poll(target *t, target_addr *watch)
 void cortexa_halt_resume(target *t, bool step)
 {
 	struct cortexa_priv *priv = t->priv;
+	tlb_flush(t);
 	/* Set breakpoint comarator for single stepping if needed */
 	if (step) {
 		uint32_t addr = priv->reg_cache.r[15];
@@ -635,8 +967,19 @@ void cortexa_halt_resume(target *t, bool step)
 	dbgdscr &= ~DBGDSCR_ITREN;
 	apb_write(t, DBGDSCR, dbgdscr);
 
+	/* Resuming the whole cluster goes through the CTI, a step only
+	 * restarts this core.  The halt request left by the cross trigger
+	 * must be acknowledged either way or the core halts again. */
+	if (priv->cti && !step) {
+		apb_write(t, DBGDRCR, DBGDRCR_CSE);
+		cti_restart(t);
+	} else if (priv->cti) {
+		cti_write(t, CTIINTACK, 1 << CTI_TRIGOUT_EDBGRQ);
+	}
+
 	do {
-		apb_write(t, DBGDRCR, DBGDRCR_CSE | DBGDRCR_RRQ);
+		if (!priv->cti || step)
+			apb_write(t, DBGDRCR, DBGDRCR_CSE | DBGDRCR_RRQ);
 		dbgdscr = apb_read(t, DBGDSCR);
 		DEBUG("%s: DBGDSCR = 0x%08"PRIx32"\n", __func__, dbgdscr);
 	} while (!(dbgdscr & DBGDSCR_RESTARTED) &&
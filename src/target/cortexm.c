@@ -31,16 +31,30 @@
 #include "target.h"
 #include "target_internal.h"
 #include "cortexm.h"
+#include "flashstub/stub.h"
+#include "stats.h"
 
 #include <unistd.h>
 
 static const char cortexm_driver_str[] = "ARM Cortex-M";
 
 static bool cortexm_vector_catch(target *t, int argc, char *argv[]);
+static bool cortexm_bench(target *t, int argc, char *argv[]);
+static bool cortexm_semihost_console(target *t, int argc, char *argv[]);
+static bool cortexm_profile(target *t, int argc, char *argv[]);
+static bool cortexm_cycles(target *t, int argc, char *argv[]);
+static bool cortexm_mtb(target *t, int argc, char *argv[]);
+static bool cortexm_dwt_trace(target *t, int argc, char *argv[]);
 
 const struct command_s cortexm_cmd_list[] = {
-	{"vector_catch", (cmd_handler)cortexm_vector_catch, "Catch exception vectors"},
-	{NULL, NULL, NULL}
+	{"vector_catch", (cmd_handler)cortexm_vector_catch, "Catch exception vectors", 0},
+	{"bench", (cmd_handler)cortexm_bench, "Measure debug link throughput using the first RAM region", CMD_HALTED},
+	{"semihost_console", (cmd_handler)cortexm_semihost_console, "(enable|disable) Print semihosted console output on the probe", 0},
+	{"cycles", (cmd_handler)cortexm_cycles, "Count cycles from start to stop: <start> <stop> [runs] [CPU Hz]", CMD_HALTED},
+	{"mtb", (cmd_handler)cortexm_mtb, "Micro Trace Buffer branch history: (enable <addr> <size>|disable|dump [count])", 0},
+	{"profile", (cmd_handler)cortexm_profile, "Sample the PC while running: (start <base> <granularity> [period ms]|stop|dump)", 0},
+	{"dwt_trace", (cmd_handler)cortexm_dwt_trace, "Trace accesses over SWO without halting: (<addr> [len] [value|pcvalue|pc|addr] [read|write|access]|clear)", 0},
+	{NULL, NULL, NULL, 0}
 };
 
 /* target options recognised by the Cortex-M target */
@@ -49,6 +63,10 @@ const struct command_s cortexm_cmd_list[] = {
 
 static void cortexm_regs_read(target *t, void *data);
 static void cortexm_regs_write(target *t, const void *data);
+static ssize_t cortexm_reg_read(target *t, int reg, void *data, size_t max);
+static ssize_t cortexm_reg_write(target *t, int reg, const void *data, size_t size);
+static ssize_t cortexm_thread_reg_read(target *t, target_addr sp, int reg,
+                                       void *data, size_t max);
 static uint32_t cortexm_pc_read(target *t);
 
 static void cortexm_reset(target *t);
@@ -58,12 +76,45 @@ static int cortexm_fault_unwind(target *t);
 
 static int cortexm_breakwatch_set(target *t, struct breakwatch *);
 static int cortexm_breakwatch_clear(target *t, struct breakwatch *);
+static void cortexm_breakwatch_commit(target *t);
+static bool cortexm_recover(target *t);
 static target_addr cortexm_check_watch(target *t);
 
 #define CORTEXM_MAX_WATCHPOINTS	4	/* architecture says up to 15, no implementation has > 4 */
 #define CORTEXM_MAX_BREAKPOINTS	6	/* architecture says up to 127, no implementation has > 6 */
 
-static int cortexm_hostio_request(target *t);
+#define CORTEXM_GENERAL_REG_COUNT	20	/* r0-r15, xpsr, msp, psp, special */
+#define CORTEXM_FLOAT_REG_COUNT		33	/* fpscr, s0-s31 */
+
+static int cortexm_hostio_request(target *t, uint32_t pc);
+static int cortexm_crc32(target *t, uint32_t *crc, target_addr base, size_t len);
+static int cortexm_mem_search(target *t, target_addr base, size_t len,
+                              const void *data, size_t data_len,
+                              target_addr *addr);
+static int cortexm_mem_fill(target *t, target_addr base, size_t len,
+                            const void *data, size_t data_len);
+
+/* PC sampling histogram, see cortexm_profile() */
+#define CORTEXM_PROFILE_BUCKETS	256
+
+struct cortexm_profile {
+	bool running;
+	uint32_t base;
+	uint8_t shift;		/* log2 of the bucket granularity */
+	uint32_t period;	/* ms between samples, 0 for every halt poll */
+	uint32_t next;
+	uint32_t samples;
+	uint32_t idle;		/* PCSR unavailable, core sleeping or halted */
+	uint32_t outside;
+	uint32_t bucket[CORTEXM_PROFILE_BUCKETS];
+};
+
+/* DWT comparator settings for one watchpoint */
+struct cortexm_dwt {
+	uint32_t comp;
+	uint32_t mask;
+	uint32_t func;
+};
 
 struct cortexm_priv {
 	ADIv5_AP_t *ap;
@@ -71,19 +122,61 @@ struct cortexm_priv {
 	bool on_bkpt;
 	/* Watchpoint unit status */
 	bool hw_watchpoint[CORTEXM_MAX_WATCHPOINTS];
+	uint8_t dwt_trace;	/* Those set up by monitor dwt_trace */
 	unsigned flash_patch_revision;
 	unsigned hw_watchpoint_max;
 	/* Breakpoint unit status */
 	bool hw_breakpoint[CORTEXM_MAX_BREAKPOINTS];
 	unsigned hw_breakpoint_max;
+	/* Units sized already, by an earlier attach */
+	bool bw_sized;
+	/* Comparator settings wanted at resume and last written to the
+	 * target, see cortexm_breakwatch_commit() */
+	uint32_t fpb_comp[CORTEXM_MAX_BREAKPOINTS];
+	uint32_t fpb_comp_hw[CORTEXM_MAX_BREAKPOINTS];
+	struct cortexm_dwt dwt[CORTEXM_MAX_WATCHPOINTS];
+	struct cortexm_dwt dwt_hw[CORTEXM_MAX_WATCHPOINTS];
+	bool bw_dirty;
 	/* Copy of DEMCR for vector-catch */
 	uint32_t demcr;
 	/* Cache parameters */
 	bool has_cache;
 	uint32_t dcache_minline;
+	/* Lines cleaned, and cleaned and invalidated, since the core halted,
+	 * see cortexm_cache_clean().  Not tracked while the core runs. */
+	bool cache_track;
+	struct cortexm_lines {
+		target_addr start, end;
+	} cleaned, invalidated;
+	/* Flash stub loaded for the current session, see cortexm_stub_write()
+	 * and cortexm_stub_stream() */
+	const void *stub;
+	bool stub_running;
+	uint8_t stub_half;
+	bool stub_ring;
+	uint32_t stub_ring_addr;
+	uint32_t stub_ring_size;
+	/* Semihosted console output is sent straight to GDB, see
+	 * cortexm_hostio_console() */
+	bool semihost_console;
+	struct cortexm_profile *profile;
+	uint32_t stub_wp;
+	uint32_t stub_rp;
+	uint32_t stub_arg;
+	target_addr stub_dest;
+	/* Register cache, filled by the first read after a halt.  Until
+	 * then regs_expedited has a bit for each register of the
+	 * cortexm_expedite set read, see cortexm_regs_expedite(). */
+	bool regs_valid;
+	uint32_t regs_expedited;
+	uint32_t regs[CORTEXM_GENERAL_REG_COUNT + CORTEXM_FLOAT_REG_COUNT];
 };
 
 /* Register number tables */
+/* Sent with each stop reply: r7 as the Thumb frame pointer, sp, lr, pc
+ * and xpsr, which is all GDB reads after a step */
+static const uint8_t cortexm_expedite[] = {7, 13, 14, 15, 16};
+
 static const uint32_t regnum_cortex_m[] = {
 	0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,	/* standard r0-r15 */
 	0x10,	/* xpsr */
@@ -182,6 +275,46 @@ ADIv5_AP_t *cortexm_ap(target *t)
 	return ((struct cortexm_priv *)t->priv)->ap;
 }
 
+/* Maintenance writes gathered into one burst */
+#define CORTEXM_CACHE_BATCH	32
+
+static bool cortexm_lines_hit(const struct cortexm_lines *l, target_addr line)
+{
+	return (line >= l->start) && (line < l->end);
+}
+
+/* Add [start, end) to the tracked lines, replacing them if disjoint */
+static void cortexm_lines_add(struct cortexm_lines *l,
+                              target_addr start, target_addr end)
+{
+	if ((l->start < l->end) && (start <= l->end) && (end >= l->start)) {
+		l->start = MIN(l->start, start);
+		l->end = MAX(l->end, end);
+	} else {
+		l->start = start;
+		l->end = end;
+	}
+}
+
+static void cortexm_regs_forget(struct cortexm_priv *priv)
+{
+	priv->regs_valid = false;
+	priv->regs_expedited = 0;
+}
+
+static bool cortexm_reg_cached(struct cortexm_priv *priv, unsigned i)
+{
+	return priv->regs_valid ||
+	       ((i < 32) && (priv->regs_expedited & (1u << i)));
+}
+
+static void cortexm_cache_forget(struct cortexm_priv *priv)
+{
+	priv->cache_track = false;
+	priv->cleaned.start = priv->cleaned.end = 0;
+	priv->invalidated.start = priv->invalidated.end = 0;
+}
+
 static void cortexm_cache_clean(target *t, target_addr addr, size_t len, bool invalidate)
 {
 	struct cortexm_priv *priv = t->priv;
@@ -189,6 +322,8 @@ static void cortexm_cache_clean(target *t, target_addr addr, size_t len, bool in
 		return;
 	uint32_t cache_reg = invalidate ? CORTEXM_DCCIMVAC : CORTEXM_DCCMVAC;
 	size_t minline = priv->dcache_minline;
+	uint32_t lines[CORTEXM_CACHE_BATCH];
+	size_t n = 0;
 
 	/* flush data cache for RAM regions that intersect requested region */
 	target_addr mem_end = addr + len; /* following code is NOP if wraparound */
@@ -202,9 +337,28 @@ static void cortexm_cache_clean(target *t, target_addr addr, size_t len, bool in
 		if (mem_end < ram_end)
 			ram_end = mem_end;
 		/* intersection is [ram, ram_end) */
-		for (ram &= ~(minline-1); ram < ram_end; ram += minline)
-			adiv5_mem_write(cortexm_ap(t), cache_reg, &ram, 4);
+		for (ram &= ~(minline-1); ram < ram_end; ram += minline) {
+			/* Lines already invalidated are clean as well */
+			if (priv->cache_track &&
+			    (cortexm_lines_hit(&priv->invalidated, ram) ||
+			     (!invalidate && cortexm_lines_hit(&priv->cleaned, ram))))
+				continue;
+			lines[n++] = ram;
+			if (n == CORTEXM_CACHE_BATCH) {
+				adiv5_mem_write_fixed(cortexm_ap(t), cache_reg, lines, n);
+				n = 0;
+			}
+		}
 	}
+	if (n)
+		adiv5_mem_write_fixed(cortexm_ap(t), cache_reg, lines, n);
+
+	/* A halted core won't bring the lines back into the cache */
+	target_addr start = addr & ~(minline-1);
+	target_addr end = (mem_end + minline - 1) & ~(minline-1);
+	if (priv->cache_track && (start < end))
+		cortexm_lines_add(invalidate ? &priv->invalidated : &priv->cleaned,
+		                  start, end);
 }
 
 static void cortexm_mem_read(target *t, void *dest, target_addr src, size_t len)
@@ -213,6 +367,13 @@ static void cortexm_mem_read(target *t, void *dest, target_addr src, size_t len)
 	adiv5_mem_read(cortexm_ap(t), dest, src, len);
 }
 
+static int cortexm_mem_poll32(target *t, target_addr addr, uint32_t mask,
+                              uint32_t value, uint32_t timeout_ms)
+{
+	cortexm_cache_clean(t, addr, 4, false);
+	return adiv5_mem_poll32(cortexm_ap(t), addr, mask, value, timeout_ms);
+}
+
 static void cortexm_mem_write(target *t, target_addr dest, const void *src, size_t len)
 {
 	cortexm_cache_clean(t, dest, len, true);
@@ -228,23 +389,33 @@ static bool cortexm_check_error(target *t)
 static void cortexm_priv_free(void *priv)
 {
 	adiv5_ap_unref(((struct cortexm_priv *)priv)->ap);
-	free(priv);
+	free(((struct cortexm_priv *)priv)->profile);
 }
 
+/* Bounds of the CORTEXM_DRIVER() table, provided by the linker.  Weak,
+ * as a build without any driver has no such section. */
+extern const struct cortexm_driver __start_cortexm_drivers[] __attribute__((weak));
+extern const struct cortexm_driver __stop_cortexm_drivers[] __attribute__((weak));
+
 bool cortexm_probe(ADIv5_AP_t *ap)
 {
 	target *t;
 
 	t = target_new();
 	adiv5_ap_ref(ap);
-	struct cortexm_priv *priv = calloc(1, sizeof(*priv));
+	struct cortexm_priv *priv = target_alloc(sizeof(*priv));
 	t->priv = priv;
 	t->priv_free = cortexm_priv_free;
 	priv->ap = ap;
 
 	t->check_error = cortexm_check_error;
+	t->recover = cortexm_recover;
 	t->mem_read = cortexm_mem_read;
 	t->mem_write = cortexm_mem_write;
+	t->mem_poll32 = cortexm_mem_poll32;
+	t->crc32 = cortexm_crc32;
+	t->mem_search = cortexm_mem_search;
+	t->mem_fill = cortexm_mem_fill;
 
 	t->driver = cortexm_driver_str;
 
@@ -255,12 +426,17 @@ bool cortexm_probe(ADIv5_AP_t *ap)
 	t->tdesc = tdesc_cortex_m;
 	t->regs_read = cortexm_regs_read;
 	t->regs_write = cortexm_regs_write;
+	t->reg_read = cortexm_reg_read;
+	t->reg_write = cortexm_reg_write;
+	t->thread_reg_read = cortexm_thread_reg_read;
 
 	t->reset = cortexm_reset;
 	t->halt_request = cortexm_halt_request;
 	t->halt_poll = cortexm_halt_poll;
 	t->halt_resume = cortexm_halt_resume;
 	t->regs_size = sizeof(regnum_cortex_m);
+	t->regs_expedite = cortexm_expedite;
+	t->regs_expedite_count = sizeof(cortexm_expedite);
 
 	t->breakwatch_set = cortexm_breakwatch_set;
 	t->breakwatch_clear = cortexm_breakwatch_clear;
@@ -290,31 +466,34 @@ bool cortexm_probe(ADIv5_AP_t *ap)
 		target_check_error(t);
 	}
 
-#define PROBE(x) \
-	do { if ((x)(t)) return true; else target_check_error(t); } while (0)
-
-	PROBE(stm32f1_probe);
-	PROBE(stm32f4_probe);
-	PROBE(stm32l0_probe);   /* STM32L0xx & STM32L1xx */
-	PROBE(stm32l4_probe);
-	PROBE(lpc11xx_probe);
-	PROBE(lpc15xx_probe);
-	PROBE(lpc43xx_probe);
-	PROBE(sam3x_probe);
-	PROBE(sam4l_probe);
-	PROBE(nrf51_probe);
-	PROBE(samd_probe);
-	PROBE(lmi_probe);
-	PROBE(kinetis_probe);
-	PROBE(efm32_probe);
-#undef PROBE
+	/* Drivers for the vendor named in the ROM table first, then the
+	 * rest, as not all vendors identify themselves there */
+	for (int pass = 0; pass < 2; pass++) {
+		for (const struct cortexm_driver *d = __start_cortexm_drivers;
+		     d < __stop_cortexm_drivers; d++) {
+			if ((d->designer == ap->designer) != (pass == 0))
+				continue;
+			if (d->probe(t))
+				return true;
+			target_check_error(t);
+		}
+	}
 
 	return true;
 }
 
+/* Queued word write to a debug register, with CSW already set for word
+ * access.  Goes out on the next adiv5_dp_flush(). */
+static void cortexm_queue_write32(ADIv5_AP_t *ap, uint32_t addr, uint32_t val)
+{
+	adiv5_ap_queue_tar(ap, addr);
+	adiv5_dp_queue_write(ap->dp, ADIV5_AP_DRW, val);
+}
+
 bool cortexm_attach(target *t)
 {
 	struct cortexm_priv *priv = t->priv;
+	ADIv5_AP_t *ap = cortexm_ap(t);
 	unsigned i;
 	uint32_t r;
 	int tries;
@@ -322,6 +501,7 @@ bool cortexm_attach(target *t)
 	/* Clear any pending fault condition */
 	target_check_error(t);
 
+	cortexm_regs_forget(priv);
 	target_halt_request(t);
 	tries = 10;
 	while(!platform_srst_get_val() && !target_halt_poll(t, NULL) && --tries)
@@ -329,42 +509,68 @@ bool cortexm_attach(target *t)
 	if(!tries)
 		return false;
 
+	/* size the break/watchpoint units, which can't change */
+	if (!priv->bw_sized) {
+		priv->hw_breakpoint_max = CORTEXM_MAX_BREAKPOINTS;
+		r = target_mem_read32(t, CORTEXM_FPB_CTRL);
+		if (((r >> 4) & 0xf) < priv->hw_breakpoint_max)	/* only look at NUM_COMP1 */
+			priv->hw_breakpoint_max = (r >> 4) & 0xf;
+		priv->flash_patch_revision = (r >> 28);
+		priv->hw_watchpoint_max = CORTEXM_MAX_WATCHPOINTS;
+		r = target_mem_read32(t, CORTEXM_DWT_CTRL);
+		if ((r >> 28) < priv->hw_watchpoint_max)
+			priv->hw_watchpoint_max = r >> 28;
+		priv->bw_sized = !target_check_error(t);
+	}
+
+	/* Read back all the comparators in two block reads, so only the
+	 * stale ones need clearing */
+	uint32_t fpb[CORTEXM_MAX_BREAKPOINTS];
+	uint32_t dwt[CORTEXM_MAX_WATCHPOINTS][4];
+	if (priv->hw_breakpoint_max)
+		adiv5_mem_read(ap, fpb, CORTEXM_FPB_COMP(0),
+		               priv->hw_breakpoint_max * 4);
+	if (priv->hw_watchpoint_max)
+		adiv5_mem_read(ap, dwt, CORTEXM_DWT_COMP(0),
+		               priv->hw_watchpoint_max * 16);
+
+	/* The rest of the setup goes out as one queued batch */
+	adiv5_ap_write(ap, ADIV5_AP_CSW, ap->csw | ADIV5_AP_CSW_SIZE_WORD);
+
 	/* Request halt on reset */
-	target_mem_write32(t, CORTEXM_DEMCR, priv->demcr);
+	cortexm_queue_write32(ap, CORTEXM_DEMCR, priv->demcr);
 
 	/* Reset DFSR flags */
-	target_mem_write32(t, CORTEXM_DFSR, CORTEXM_DFSR_RESETALL);
-
-	/* size the break/watchpoint units */
-	priv->hw_breakpoint_max = CORTEXM_MAX_BREAKPOINTS;
-	r = target_mem_read32(t, CORTEXM_FPB_CTRL);
-	if (((r >> 4) & 0xf) < priv->hw_breakpoint_max)	/* only look at NUM_COMP1 */
-		priv->hw_breakpoint_max = (r >> 4) & 0xf;
-	priv->flash_patch_revision = (r >> 28);
-	priv->hw_watchpoint_max = CORTEXM_MAX_WATCHPOINTS;
-	r = target_mem_read32(t, CORTEXM_DWT_CTRL);
-	if ((r >> 28) > priv->hw_watchpoint_max)
-		priv->hw_watchpoint_max = r >> 28;
+	cortexm_queue_write32(ap, CORTEXM_DFSR, CORTEXM_DFSR_RESETALL);
 
 	/* Clear any stale breakpoints */
 	for(i = 0; i < priv->hw_breakpoint_max; i++) {
-		target_mem_write32(t, CORTEXM_FPB_COMP(i), 0);
+		if (fpb[i])
+			cortexm_queue_write32(ap, CORTEXM_FPB_COMP(i), 0);
 		priv->hw_breakpoint[i] = 0;
+		priv->fpb_comp[i] = priv->fpb_comp_hw[i] = 0;
 	}
 
 	/* Clear any stale watchpoints */
 	for(i = 0; i < priv->hw_watchpoint_max; i++) {
-		target_mem_write32(t, CORTEXM_DWT_FUNC(i), 0);
+		if (dwt[i][2])
+			cortexm_queue_write32(ap, CORTEXM_DWT_FUNC(i), 0);
 		priv->hw_watchpoint[i] = 0;
+		memset(&priv->dwt[i], 0, sizeof(priv->dwt[i]));
+		memset(&priv->dwt_hw[i], 0, sizeof(priv->dwt_hw[i]));
 	}
+	priv->dwt_trace = 0;
+	priv->bw_dirty = false;
 
 	/* Flash Patch Control Register: set ENABLE */
-	target_mem_write32(t, CORTEXM_FPB_CTRL,
+	cortexm_queue_write32(ap, CORTEXM_FPB_CTRL,
 			CORTEXM_FPB_CTRL_KEY | CORTEXM_FPB_CTRL_ENABLE);
+	adiv5_dp_flush(ap->dp);
+	bool ok = !target_check_error(t);
 
 	platform_srst_set_val(false);
 
-	return true;
+	return ok;
 }
 
 void cortexm_detach(target *t)
@@ -372,101 +578,358 @@ void cortexm_detach(target *t)
 	struct cortexm_priv *priv = t->priv;
 	unsigned i;
 
+	/* Don't leave a flash stub running */
+	cortexm_stub_done(t);
+
 	/* Clear any stale breakpoints */
-	for(i = 0; i < priv->hw_breakpoint_max; i++)
+	for(i = 0; i < priv->hw_breakpoint_max; i++) {
 		target_mem_write32(t, CORTEXM_FPB_COMP(i), 0);
+		priv->fpb_comp_hw[i] = 0;
+	}
 
 	/* Clear any stale watchpoints */
-	for(i = 0; i < priv->hw_watchpoint_max; i++)
+	for(i = 0; i < priv->hw_watchpoint_max; i++) {
 		target_mem_write32(t, CORTEXM_DWT_FUNC(i), 0);
+		priv->dwt_hw[i].func = 0;
+	}
+	priv->bw_dirty = true;
 
 	/* Disable debug */
+	cortexm_regs_forget(priv);
+	cortexm_cache_forget(priv);
 	target_mem_write32(t, CORTEXM_DHCSR, CORTEXM_DHCSR_DBGKEY);
 }
 
-enum { DB_DHCSR, DB_DCRSR, DB_DCRDR, DB_DEMCR };
-
-static void cortexm_regs_read(target *t, void *data)
+/* After the DP stopped responding, from a glitch on the wire or the
+ * target losing power, power it up again on the same DP and AP.  Debug
+ * is re-enabled and DEMCR, the FPB and the DWT are set up again from
+ * what the probe has cached, so the GDB session carries on. */
+static bool cortexm_recover(target *t)
 {
+	struct cortexm_priv *priv = t->priv;
 	ADIv5_AP_t *ap = cortexm_ap(t);
-	uint32_t *regs = data;
+	volatile struct exception e;
 	unsigned i;
 
-	/* FIXME: Describe what's really going on here */
+	if (!adiv5_dp_recover(ap->dp) || !adiv5_ap_recover(ap))
+		return false;
+
+	cortexm_regs_forget(priv);
+	cortexm_cache_forget(priv);
+	priv->stub = NULL;
+	priv->stub_running = false;
+
+	/* A power on reset clears all of these, so write every comparator
+	 * whatever was last written */
+	for (i = 0; i < priv->hw_breakpoint_max; i++)
+		priv->fpb_comp_hw[i] = ~priv->fpb_comp[i];
+	for (i = 0; i < priv->hw_watchpoint_max; i++) {
+		priv->dwt_hw[i].comp = ~priv->dwt[i].comp;
+		priv->dwt_hw[i].mask = ~priv->dwt[i].mask;
+		priv->dwt_hw[i].func = ~priv->dwt[i].func;
+	}
+	priv->bw_dirty = true;
+
+	TRY_CATCH(e, EXCEPTION_ALL) {
+		/* Leave C_HALT as it is, the core may be halted or running */
+		uint32_t dhcsr = target_mem_read32(t, CORTEXM_DHCSR);
+		if (!(dhcsr & CORTEXM_DHCSR_C_DEBUGEN))
+			target_mem_write32(t, CORTEXM_DHCSR, CORTEXM_DHCSR_DBGKEY |
+			                   CORTEXM_DHCSR_C_DEBUGEN);
+		target_mem_write32(t, CORTEXM_DEMCR, priv->demcr);
+		target_mem_write32(t, CORTEXM_FPB_CTRL,
+		                   CORTEXM_FPB_CTRL_KEY | CORTEXM_FPB_CTRL_ENABLE);
+		cortexm_breakwatch_commit(t);
+	}
+	if (e.type || target_check_error(t))
+		return false;
+	DEBUG("Cortex-M recovered\n");
+	return true;
+}
+
+enum { DB_DHCSR, DB_DCRSR, DB_DCRDR, DB_DEMCR };
+
+/* Core registers are reached through DCRSR/DCRDR (ARMv7-M ARM C1.6.3).
+ * Set the AP to word transfers and point TAR at DHCSR so the banked data
+ * registers DB0-DB3 (AP 0x10-0x1c) address DHCSR, DCRSR, DCRDR and DEMCR
+ * without rewriting TAR.  The first DB access must then go through
+ * adiv5_ap_write(), which selects the AP register bank, as the queued
+ * DP accesses that follow rely on that selection. */
+static void cortexm_banked_select(ADIv5_AP_t *ap)
+{
 	adiv5_ap_write(ap, ADIV5_AP_CSW, ap->csw | ADIV5_AP_CSW_SIZE_WORD);
+	adiv5_ap_write(ap, ADIV5_AP_TAR, CORTEXM_DHCSR);
+}
 
-	/* Map the banked data registers (0x10-0x1c) to the
-	 * debug registers DHCSR, DCRSR, DCRDR and DEMCR respectively */
-	adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_TAR, CORTEXM_DHCSR);
+static void cortexm_regs_fetch(target *t)
+{
+	struct cortexm_priv *priv = t->priv;
+	ADIv5_AP_t *ap = cortexm_ap(t);
+	uint32_t *regs = priv->regs;
+	unsigned i;
+
+	cortexm_banked_select(ap);
 
 	/* Walk the regnum_cortex_m array, reading the registers it
 	 * calls out. */
 	adiv5_ap_write(ap, ADIV5_AP_DB(DB_DCRSR), regnum_cortex_m[0]); /* Required to switch banks */
 	*regs++ = adiv5_dp_read(ap->dp, ADIV5_AP_DB(DB_DCRDR));
+
+	/* The remaining registers are posted to the transaction queue
+	 * and collected from RDBUFF when it is flushed. */
 	for(i = 1; i < sizeof(regnum_cortex_m) / 4; i++) {
-		adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_DB(DB_DCRSR),
-		                    regnum_cortex_m[i]);
-		*regs++ = adiv5_dp_read(ap->dp, ADIV5_AP_DB(DB_DCRDR));
+		adiv5_dp_queue_write(ap->dp, ADIV5_AP_DB(DB_DCRSR),
+		                     regnum_cortex_m[i]);
+		adiv5_dp_queue_read(ap->dp, ADIV5_AP_DB(DB_DCRDR), NULL);
+		adiv5_dp_queue_read(ap->dp, ADIV5_DP_RDBUFF, regs++);
 	}
 	if (t->target_options & TOPT_FLAVOUR_V7MF)
 		for(i = 0; i < sizeof(regnum_cortex_mf) / 4; i++) {
-			adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE,
-			                    ADIV5_AP_DB(DB_DCRSR),
-			                    regnum_cortex_mf[i]);
-			*regs++ = adiv5_dp_read(ap->dp, ADIV5_AP_DB(DB_DCRDR));
+			adiv5_dp_queue_write(ap->dp, ADIV5_AP_DB(DB_DCRSR),
+			                     regnum_cortex_mf[i]);
+			adiv5_dp_queue_read(ap->dp, ADIV5_AP_DB(DB_DCRDR), NULL);
+			adiv5_dp_queue_read(ap->dp, ADIV5_DP_RDBUFF, regs++);
 		}
+	adiv5_dp_flush(ap->dp);
+
+	priv->regs_valid = !target_check_error(t);
+}
+
+/* Just the cortexm_expedite registers, in one batch as above */
+static void cortexm_regs_expedite(target *t)
+{
+	struct cortexm_priv *priv = t->priv;
+	ADIv5_AP_t *ap = cortexm_ap(t);
+	const uint8_t *r = cortexm_expedite;
+	unsigned i;
+
+	cortexm_banked_select(ap);
+	adiv5_ap_write(ap, ADIV5_AP_DB(DB_DCRSR), regnum_cortex_m[r[0]]);
+	priv->regs[r[0]] = adiv5_dp_read(ap->dp, ADIV5_AP_DB(DB_DCRDR));
+	for (i = 1; i < sizeof(cortexm_expedite); i++) {
+		adiv5_dp_queue_write(ap->dp, ADIV5_AP_DB(DB_DCRSR),
+		                     regnum_cortex_m[r[i]]);
+		adiv5_dp_queue_read(ap->dp, ADIV5_AP_DB(DB_DCRDR), NULL);
+		adiv5_dp_queue_read(ap->dp, ADIV5_DP_RDBUFF, &priv->regs[r[i]]);
+	}
+	adiv5_dp_flush(ap->dp);
+
+	if (target_check_error(t))
+		return;
+	for (i = 0; i < sizeof(cortexm_expedite); i++)
+		priv->regs_expedited |= 1u << r[i];
 }
 
+static void cortexm_regs_read(target *t, void *data)
+{
+	struct cortexm_priv *priv = t->priv;
+
+	if (!priv->regs_valid)
+		cortexm_regs_fetch(t);
+	memcpy(data, priv->regs, t->regs_size);
+}
+
+static uint32_t cortexm_regnum(unsigned i)
+{
+	if (i < CORTEXM_GENERAL_REG_COUNT)
+		return regnum_cortex_m[i];
+	return regnum_cortex_mf[i - CORTEXM_GENERAL_REG_COUNT];
+}
+
+/* Write one core register through the banked debug registers.  The
+ * first of a run sets up the AP, the rest go on the DP queue, so the
+ * caller flushes once at the end. */
+static void cortexm_core_reg_post(ADIv5_AP_t *ap, bool *first,
+                                  uint32_t regsel, uint32_t val)
+{
+	if (*first) {
+		cortexm_banked_select(ap);
+		adiv5_ap_write(ap, ADIV5_AP_DB(DB_DCRDR), val); /* Required to switch banks */
+		adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE,
+		                    ADIV5_AP_DB(DB_DCRSR),
+		                    CORTEXM_DCRSR_REGWnR | regsel);
+		*first = false;
+		return;
+	}
+	adiv5_dp_queue_write(ap->dp, ADIV5_AP_DB(DB_DCRDR), val);
+	adiv5_dp_queue_write(ap->dp, ADIV5_AP_DB(DB_DCRSR),
+	                     CORTEXM_DCRSR_REGWnR | regsel);
+}
+
+/* Only registers that differ from the cache are written */
 static void cortexm_regs_write(target *t, const void *data)
 {
+	struct cortexm_priv *priv = t->priv;
 	ADIv5_AP_t *ap = cortexm_ap(t);
 	const uint32_t *regs = data;
+	bool first = true;
 	unsigned i;
 
-	/* FIXME: Describe what's really going on here */
-	adiv5_ap_write(ap, ADIV5_AP_CSW, ap->csw | ADIV5_AP_CSW_SIZE_WORD);
+	for (i = 0; i < t->regs_size / 4; i++) {
+		if (cortexm_reg_cached(priv, i) && (regs[i] == priv->regs[i]))
+			continue;
+		cortexm_core_reg_post(ap, &first, cortexm_regnum(i), regs[i]);
+	}
+	if (first)
+		return;
+	adiv5_dp_flush(ap->dp);
 
-	/* Map the banked data registers (0x10-0x1c) to the
-	 * debug registers DHCSR, DCRSR, DCRDR and DEMCR respectively */
-	adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_TAR, CORTEXM_DHCSR);
+	memcpy(priv->regs, regs, t->regs_size);
+	if (target_check_error(t))
+		cortexm_regs_forget(priv);	/* May not have reached the core */
+	else
+		priv->regs_valid = true;
+}
 
-	/* Walk the regnum_cortex_m array, writing the registers it
-	 * calls out. */
-	adiv5_ap_write(ap, ADIV5_AP_DB(DB_DCRDR), *regs++); /* Required to switch banks */
-	adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_DB(DB_DCRSR),
-	                    0x10000 | regnum_cortex_m[0]);
-	for(i = 1; i < sizeof(regnum_cortex_m) / 4; i++) {
-		adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE,
-		                    ADIV5_AP_DB(DB_DCRDR), *regs++);
-		adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE, ADIV5_AP_DB(DB_DCRSR),
-		                    0x10000 | regnum_cortex_m[i]);
+/* Offset and size of GDB register reg in the 'g' packet layout */
+static ssize_t cortexm_reg_offset(target *t, int reg, size_t *size)
+{
+	*size = 4;
+	if ((reg < 0) || (unsigned)reg >= t->regs_size / 4)
+		return -1;
+	if (reg <= CORTEXM_GENERAL_REG_COUNT)	/* up to fpscr */
+		return reg * 4;
+
+	/* d0-d15 */
+	*size = 8;
+	reg -= CORTEXM_GENERAL_REG_COUNT + 1;
+	if (reg >= 16)
+		return -1;
+	return (CORTEXM_GENERAL_REG_COUNT + 1) * 4 + reg * 8;
+}
+
+static ssize_t cortexm_reg_read(target *t, int reg, void *data, size_t max)
+{
+	struct cortexm_priv *priv = t->priv;
+	size_t size;
+	ssize_t offset = cortexm_reg_offset(t, reg, &size);
+
+	if ((offset < 0) || (size > max))
+		return -1;
+	if (!cortexm_reg_cached(priv, reg)) {
+		/* The rest of a stop reply's registers come with this one */
+		if (memchr(cortexm_expedite, reg, sizeof(cortexm_expedite)))
+			cortexm_regs_expedite(t);
+		else
+			cortexm_regs_fetch(t);
 	}
-	if (t->target_options & TOPT_FLAVOUR_V7MF)
-		for(i = 0; i < sizeof(regnum_cortex_mf) / 4; i++) {
-			adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE,
-			                    ADIV5_AP_DB(DB_DCRDR), *regs++);
-			adiv5_dp_low_access(ap->dp, ADIV5_LOW_WRITE,
-			                    ADIV5_AP_DB(DB_DCRSR),
-			                    0x10000 | regnum_cortex_mf[i]);
+	memcpy(data, (uint8_t *)priv->regs + offset, size);
+	return size;
+}
+
+static ssize_t cortexm_reg_write(target *t, int reg, const void *data, size_t size)
+{
+	size_t regsize;
+	ssize_t offset = cortexm_reg_offset(t, reg, &regsize);
+	uint32_t regs[t->regs_size / 4];
+
+	if ((offset < 0) || (size != regsize))
+		return -1;
+	cortexm_regs_read(t, regs);
+	memcpy((uint8_t *)regs + offset, data, size);
+	cortexm_regs_write(t, regs);
+	return size;
+}
+
+/* Registers of a thread switched out as by the FreeRTOS ARMv6-M and
+ * ARMv7-M ports: r4-r11 below the exception frame, with EXC_RETURN and
+ * s16-s31 too if the thread used the FPU.  The registers that aren't
+ * saved are left as they are on the core.
+ */
+static int cortexm_thread_regs(target *t, uint32_t *regs, target_addr sp)
+{
+	uint32_t sw[8 + 1 + 16];	/* r4-r11, EXC_RETURN, s16-s31 */
+	uint32_t hw[8 + 18];		/* r0-r3, r12, lr, pc, xpsr, s0-s15, fpscr */
+	bool fpu = t->target_options & TOPT_FLAVOUR_V7MF;
+	unsigned sw_len = 8, hw_len = 8;
+
+	cortexm_regs_read(t, regs);
+	if (target_mem_read(t, sw, sp, 9 * 4))
+		return -1;
+	/* Ports for cores with an FPU save EXC_RETURN after r4-r11 */
+	if (fpu && ((sw[8] & 0xffffff00) == 0xffffff00)) {
+		sw_len = 9;
+		if (!(sw[8] & 0x10)) {
+			sw_len += 16;
+			hw_len += 18;
 		}
+	}
+	if ((sw_len > 9) && target_mem_read(t, &sw[9], sp + 9 * 4, 16 * 4))
+		return -1;
+	sp += sw_len * 4;
+	if (target_mem_read(t, hw, sp, hw_len * 4))
+		return -1;
+	sp += hw_len * 4;
+	/* The frame was aligned to 8 bytes */
+	if (hw[7] & (1 << 9))
+		sp += 4;
+
+	memcpy(&regs[0], &hw[0], 4 * 4);
+	memcpy(&regs[4], &sw[0], 8 * 4);
+	regs[12] = hw[4];
+	regs[REG_SP] = sp;
+	regs[REG_LR] = hw[5];
+	regs[REG_PC] = hw[6];
+	regs[REG_XPSR] = hw[7];
+	regs[REG_PSP] = sp;
+	if (hw_len > 8) {
+		regs[CORTEXM_GENERAL_REG_COUNT] = hw[24];
+		memcpy(&regs[CORTEXM_GENERAL_REG_COUNT + 1], &hw[8], 16 * 4);
+		memcpy(&regs[CORTEXM_GENERAL_REG_COUNT + 17], &sw[9], 16 * 4);
+	}
+	return 0;
 }
 
-static uint32_t cortexm_pc_read(target *t)
+static ssize_t cortexm_thread_reg_read(target *t, target_addr sp, int reg,
+                                       void *data, size_t max)
 {
-	target_mem_write32(t, CORTEXM_DCRSR, 0x0F);
+	uint32_t regs[t->regs_size / 4];
+	size_t size = t->regs_size;
+	ssize_t offset = 0;
+
+	if (reg >= 0)
+		offset = cortexm_reg_offset(t, reg, &size);
+	if ((offset < 0) || (size > max))
+		return -1;
+	if (cortexm_thread_regs(t, regs, sp))
+		return -1;
+	memcpy(data, (uint8_t *)regs + offset, size);
+	return size;
+}
+
+/* Single core registers, for when fetching the whole set isn't worth it */
+static uint32_t cortexm_core_reg_read(target *t, uint32_t regsel)
+{
+	struct cortexm_priv *priv = t->priv;
+
+	if ((regsel < 16) && cortexm_reg_cached(priv, regsel))
+		return priv->regs[regsel];
+	target_mem_write32(t, CORTEXM_DCRSR, regsel);
 	return target_mem_read32(t, CORTEXM_DCRDR);
 }
 
+static uint32_t cortexm_pc_read(target *t)
+{
+	return cortexm_core_reg_read(t, 0x0F);
+}
+
 static void cortexm_pc_write(target *t, const uint32_t val)
 {
+	struct cortexm_priv *priv = t->priv;
+
 	target_mem_write32(t, CORTEXM_DCRDR, val);
 	target_mem_write32(t, CORTEXM_DCRSR, CORTEXM_DCRSR_REGWnR | 0x0F);
+	priv->regs[15] = val;
 }
 
 /* The following three routines implement target halt/resume
  * using the core debug registers in the NVIC. */
 static void cortexm_reset(target *t)
 {
+	struct cortexm_priv *priv = t->priv;
+
+	cortexm_regs_forget(priv);
+	cortexm_cache_forget(priv);
 	if ((t->target_options & CORTEXM_TOPT_INHIBIT_SRST) == 0) {
 		platform_srst_set_val(true);
 		platform_srst_set_val(false);
@@ -494,44 +957,83 @@ static void cortexm_reset(target *t)
 	target_mem_write32(t, CORTEXM_DFSR, CORTEXM_DFSR_RESETALL);
 }
 
+/* DHCSR is accessed straight through the AP, with the status checked
+ * rather than caught, as these run on every poll of a running target */
 static void cortexm_halt_request(target *t)
 {
-	volatile struct exception e;
-	TRY_CATCH (e, EXCEPTION_TIMEOUT) {
-		target_mem_write32(t, CORTEXM_DHCSR, CORTEXM_DHCSR_DBGKEY |
-		                                          CORTEXM_DHCSR_C_HALT |
-		                                          CORTEXM_DHCSR_C_DEBUGEN);
-	}
-	if (e.type) {
+	uint32_t dhcsr = CORTEXM_DHCSR_DBGKEY | CORTEXM_DHCSR_C_HALT |
+	                 CORTEXM_DHCSR_C_DEBUGEN;
+	int status = adiv5_mem_try_write(cortexm_ap(t), CORTEXM_DHCSR,
+	                                 &dhcsr, sizeof(dhcsr));
+
+	/* Once more if the target can be got back */
+	if (status && (status != ADIV5_DP_WAIT) && target_recover(t))
+		status = adiv5_mem_try_write(cortexm_ap(t), CORTEXM_DHCSR,
+		                             &dhcsr, sizeof(dhcsr));
+
+	if (status == ADIV5_DP_WAIT)
 		tc_printf(t, "Timeout sending interrupt, is target in WFI?\n");
-	}
+	else
+		adiv5_dp_raise(status);
+}
+
+/* Read the PC sampled by the DWT, which doesn't disturb the core */
+static void cortexm_profile_sample(target *t)
+{
+	struct cortexm_profile *p = ((struct cortexm_priv *)t->priv)->profile;
+	uint32_t now = platform_time_ms();
+
+	if (p->period && ((int32_t)(now - p->next) < 0))
+		return;
+	p->next = now + p->period;
+
+	uint32_t pc = 0xffffffff;
+	if (adiv5_mem_try_read(cortexm_ap(t), &pc, CORTEXM_DWT_PCSR,
+	                       sizeof(pc)) || target_check_error(t))
+		return;
+
+	p->samples++;
+	uint32_t i = (pc - p->base) >> p->shift;
+	if (pc == 0xffffffff)
+		p->idle++;
+	else if ((pc < p->base) || (i >= CORTEXM_PROFILE_BUCKETS))
+		p->outside++;
+	else
+		p->bucket[i]++;
 }
 
 static enum target_halt_reason cortexm_halt_poll(target *t, target_addr *watch)
 {
 	struct cortexm_priv *priv = t->priv;
 
-	volatile uint32_t dhcsr = 0;
-	volatile struct exception e;
-	TRY_CATCH (e, EXCEPTION_ALL) {
-		/* If this times out because the target is in WFI then
-		 * the target is still running. */
-		dhcsr = target_mem_read32(t, CORTEXM_DHCSR);
-	}
-	switch (e.type) {
-	case EXCEPTION_ERROR:
-		/* Oh crap, there's no recovery from this... */
-		target_list_free();
-		return TARGET_HALT_ERROR;
-	case EXCEPTION_TIMEOUT:
+	uint32_t dhcsr = 0;
+	switch (adiv5_mem_try_read(cortexm_ap(t), &dhcsr, CORTEXM_DHCSR,
+	                           sizeof(dhcsr))) {
+	case ADIV5_DP_OK:
+		break;
+	case ADIV5_DP_WAIT:
 		/* Timeout isn't a problem, target could be in WFI */
 		return TARGET_HALT_RUNNING;
+	default:
+		/* Keep polling if the target can be got back.  A flash stub
+		 * that was running is lost either way. */
+		if (!priv->stub_running && target_recover(t))
+			return TARGET_HALT_RUNNING;
+		target_list_free();
+		return TARGET_HALT_ERROR;
 	}
 
-	if (!(dhcsr & CORTEXM_DHCSR_S_HALT))
+	if (!(dhcsr & CORTEXM_DHCSR_S_HALT)) {
+		if (priv->profile && priv->profile->running)
+			cortexm_profile_sample(t);
 		return TARGET_HALT_RUNNING;
+	}
 
 	/* We've halted.  Let's find out why. */
+	if (!priv->cache_track) {
+		cortexm_cache_forget(priv);
+		priv->cache_track = true;
+	}
 	uint32_t dfsr = target_mem_read32(t, CORTEXM_DFSR);
 	target_mem_write32(t, CORTEXM_DFSR, dfsr); /* write back to reset */
 
@@ -547,7 +1049,7 @@ static enum target_halt_reason cortexm_halt_poll(target *t, target_addr *watch)
 		uint16_t bkpt_instr;
 		bkpt_instr = target_mem_read16(t, pc);
 		if (bkpt_instr == 0xBEAB) {
-			if (cortexm_hostio_request(t)) {
+			if (cortexm_hostio_request(t, pc)) {
 				return TARGET_HALT_REQUEST;
 			} else {
 				target_halt_resume(t, priv->stepping);
@@ -590,9 +1092,13 @@ void cortexm_halt_resume(target *t, bool step)
 			cortexm_pc_write(t, pc + 2);
 	}
 
+	cortexm_breakwatch_commit(t);
+
 	if (priv->has_cache)
 		target_mem_write32(t, CORTEXM_ICIALLU, 0);
 
+	cortexm_regs_forget(priv);
+	cortexm_cache_forget(priv);
 	target_mem_write32(t, CORTEXM_DHCSR, dhcsr);
 }
 
@@ -655,8 +1161,8 @@ static int cortexm_fault_unwind(target *t)
 	return 0;
 }
 
-int cortexm_run_stub(target *t, uint32_t loadaddr,
-                     uint32_t r0, uint32_t r1, uint32_t r2, uint32_t r3)
+static int cortexm_stub_start(target *t, uint32_t loadaddr,
+                              uint32_t r0, uint32_t r1, uint32_t r2, uint32_t r3)
 {
 	uint32_t regs[t->regs_size / 4];
 
@@ -667,7 +1173,7 @@ int cortexm_run_stub(target *t, uint32_t loadaddr,
 	regs[3] = r3;
 	regs[15] = loadaddr;
 	regs[16] = 0x1000000;
-	regs[19] = 0;
+	regs[19] = 1;	/* PRIMASK, keep the application's interrupts out */
 
 	cortexm_regs_write(t, regs);
 
@@ -675,10 +1181,18 @@ int cortexm_run_stub(target *t, uint32_t loadaddr,
 		return -1;
 
 	/* Execute the stub */
-	enum target_halt_reason reason;
+	STATS_INC(stub_runs);
 	cortexm_halt_resume(t, 0);
+	return 0;
+}
+
+static int cortexm_stub_wait(target *t)
+{
+	enum target_halt_reason reason;
+	STATS_TIME_START(start);
 	while ((reason = cortexm_halt_poll(t, NULL)) == TARGET_HALT_RUNNING)
 		;
+	STATS_TIME_ADD(flash_stub_us, start);
 
 	if (reason == TARGET_HALT_ERROR)
 		raise_exception(EXCEPTION_ERROR, "Target lost in stub");
@@ -694,6 +1208,340 @@ int cortexm_run_stub(target *t, uint32_t loadaddr,
 	return bkpt_instr & 0xff;
 }
 
+int cortexm_run_stub(target *t, uint32_t loadaddr,
+                     uint32_t r0, uint32_t r1, uint32_t r2, uint32_t r3)
+{
+	if (cortexm_stub_start(t, loadaddr, r0, r1, r2, r3))
+		return -1;
+
+	return cortexm_stub_wait(t);
+}
+
+/* Program flash with a stub taking (dest, src, len, arg) that is left running
+ * in the background.  The stub is loaded once per flash session and works
+ * on alternate halves of the RAM buffer at bufaddr, so the next block is
+ * written over the debug port while the previous one is programmed.
+ * Errors from a block are reported by the next call or by
+ * cortexm_stub_done().
+ */
+int cortexm_stub_write(target *t, const void *stub, size_t stub_size,
+                       uint32_t loadaddr, uint32_t bufaddr, size_t bufsize,
+                       target_addr dest, const void *src, size_t len,
+                       uint32_t arg)
+{
+	struct cortexm_priv *priv = t->priv;
+
+	if (priv->stub != stub) {
+		if (cortexm_stub_sync(t))
+			return -1;
+		if (target_mem_write(t, loadaddr, stub, stub_size))
+			return -1;
+		priv->stub = stub;
+		priv->stub_half = 0;
+	}
+
+	while (len) {
+		size_t chunk = MIN(len, bufsize);
+		uint32_t buf = bufaddr + priv->stub_half * bufsize;
+
+		STATS_TIME_START(start);
+		if (target_mem_write(t, buf, src, chunk))
+			return -1;
+		STATS_TIME_ADD(flash_xfer_us, start);
+		if (cortexm_stub_sync(t))
+			return -1;
+		if (cortexm_stub_start(t, loadaddr, dest, buf, chunk, arg))
+			return -1;
+		priv->stub_running = true;
+		priv->stub_half ^= 1;
+
+		dest += chunk;
+		src = (const uint8_t *)src + chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+/* Smallest ring worth streaming through, a multiple of any stub's unit */
+#define STUB_RING_MIN 0x100
+
+/* The largest ring of up to 2 * bufsize bytes that fits in the target's
+ * RAM at bufaddr, or 0 if none does.  RAM missing from the map is left to
+ * the driver.
+ */
+static uint32_t cortexm_stub_ring_size(target *t, uint32_t bufaddr,
+                                       size_t bufsize)
+{
+	size_t avail = target_ram_avail(t, bufaddr);
+	uint32_t size = 2 * bufsize;
+
+	if (avail == 0)
+		return size;
+	avail -= MIN(avail, sizeof(struct stub_ring));
+	while ((size > avail) && (size > STUB_RING_MIN))
+		size /= 2;
+	return (size <= avail) ? size : 0;
+}
+
+/* Program flash with a stub built on stub_ring.inc, taking (dest, ring,
+ * ring size, arg).  The stub is started once and keeps programming data
+ * as it is appended to a ring following a struct stub_ring header at
+ * bufaddr.  It is only stopped by cortexm_stub_sync(), or when a write
+ * doesn't follow on from the last.  The ring is as large as the target's
+ * RAM allows, up to 2 * bufsize.  bufsize must be a power of 2.
+ */
+int cortexm_stub_stream(target *t, const void *stub, size_t stub_size,
+                        uint32_t loadaddr, uint32_t bufaddr, size_t bufsize,
+                        target_addr dest, const void *src, size_t len,
+                        uint32_t arg)
+{
+	struct cortexm_priv *priv = t->priv;
+
+	if (priv->stub != stub) {
+		if (cortexm_stub_sync(t))
+			return -1;
+		if (target_mem_write(t, loadaddr, stub, stub_size))
+			return -1;
+		priv->stub = stub;
+	}
+
+	if (priv->stub_running &&
+	    ((dest != priv->stub_dest) || (arg != priv->stub_arg)) &&
+	    cortexm_stub_sync(t))
+		return -1;
+
+	if (!priv->stub_running) {
+		struct stub_ring ring = {0};
+		uint32_t ringsize = cortexm_stub_ring_size(t, bufaddr, bufsize);
+
+		if (ringsize == 0)
+			return -1;
+		if (target_mem_write(t, bufaddr, &ring, sizeof(ring)))
+			return -1;
+		if (cortexm_stub_start(t, loadaddr, dest, bufaddr, ringsize, arg))
+			return -1;
+		priv->stub_running = true;
+		priv->stub_ring = true;
+		priv->stub_ring_addr = bufaddr;
+		priv->stub_ring_size = ringsize;
+		priv->stub_wp = priv->stub_rp = 0;
+		priv->stub_arg = arg;
+	}
+
+	const uint32_t ringsize = priv->stub_ring_size;
+	while (len) {
+		uint32_t offset = priv->stub_wp & (ringsize - 1);
+		size_t chunk = MIN(MIN(len, ringsize / 2), ringsize - offset);
+
+		/* Wait for the stub to make room */
+		STATS_TIME_START(poll);
+		while (priv->stub_wp - priv->stub_rp > ringsize - chunk) {
+			priv->stub_rp = target_mem_read32(t,
+				bufaddr + offsetof(struct stub_ring, rp));
+			if (target_check_error(t))
+				return -1;
+			if ((priv->stub_wp - priv->stub_rp > ringsize - chunk) &&
+			    (target_mem_read32(t, CORTEXM_DHCSR) &
+			     CORTEXM_DHCSR_S_HALT)) {
+				/* The stub stopped on an error */
+				cortexm_stub_sync(t);
+				return -1;
+			}
+		}
+		STATS_TIME_ADD(flash_poll_us, poll);
+
+		STATS_TIME_START(start);
+		if (target_mem_write(t, bufaddr +
+		                     offsetof(struct stub_ring, data) + offset,
+		                     src, chunk))
+			return -1;
+		priv->stub_wp += chunk;
+		target_mem_write32(t, bufaddr + offsetof(struct stub_ring, wp),
+		                   priv->stub_wp);
+		STATS_TIME_ADD(flash_xfer_us, start);
+
+		dest += chunk;
+		src = (const uint8_t *)src + chunk;
+		len -= chunk;
+	}
+	priv->stub_dest = dest;
+	return 0;
+}
+
+/* Wait for a stub started by cortexm_stub_write() or cortexm_stub_stream()
+ * to finish */
+int cortexm_stub_sync(target *t)
+{
+	struct cortexm_priv *priv = t->priv;
+
+	if (!priv->stub_running)
+		return 0;
+	priv->stub_running = false;
+	if (priv->stub_ring) {
+		/* Let the stub drain the ring and exit */
+		priv->stub_ring = false;
+		target_mem_write32(t, priv->stub_ring_addr +
+		                   offsetof(struct stub_ring, stop), 1);
+	}
+	return cortexm_stub_wait(t) ? -1 : 0;
+}
+
+/* End of the data handed to the streaming stub, 0 if none is running.
+ * Drivers with more than one flash controller can use the others meanwhile.
+ */
+target_addr cortexm_stub_stream_end(target *t)
+{
+	struct cortexm_priv *priv = t->priv;
+
+	return (priv->stub_running && priv->stub_ring) ? priv->stub_dest : 0;
+}
+
+/* End of a flash session, the stub is reloaded by the next write */
+int cortexm_stub_done(target *t)
+{
+	struct cortexm_priv *priv = t->priv;
+	int ret = cortexm_stub_sync(t);
+
+	priv->stub = NULL;
+	return ret;
+}
+
+static const uint16_t cortexm_crc32_stub[] = {
+#include "flashstub/crc32.stub"
+};
+static const uint16_t cortexm_memsearch_stub[] = {
+#include "flashstub/memsearch.stub"
+};
+static const uint16_t cortexm_memfill_stub[] = {
+#include "flashstub/memfill.stub"
+};
+
+/* RAM saved around cortexm_ram_stub(), the largest stub and its data */
+#define CORTEXM_RAM_STUB_SAVE \
+	(ALIGN(MAX(sizeof(cortexm_crc32_stub), \
+	           MAX(sizeof(cortexm_memsearch_stub), \
+	               sizeof(cortexm_memfill_stub))), 4) + MEM_SEARCH_MAX)
+
+static bool cortexm_mem_known(target *t, target_addr base, size_t len)
+{
+	for (struct target_ram *r = t->ram; r; r = r->next)
+		if (base >= r->start && base + len <= r->start + r->length)
+			return true;
+	for (struct target_flash *f = t->flash; f; f = f->next)
+		if (base >= f->start && base + len <= f->start + f->length)
+			return true;
+	return false;
+}
+
+static bool cortexm_ram_known(target *t, target_addr base, size_t len)
+{
+	for (struct target_ram *r = t->ram; r; r = r->next)
+		if (base >= r->start && base + len <= r->start + r->length)
+			return true;
+	return false;
+}
+
+/* Memory stubs work on at least this much before the core is sped up */
+#define CORTEXM_STUB_BOOST	0x1000
+
+/* Run a memory stub taking (base, len, r2, r3) and read back its r0.  The
+ * stub is loaded at the start of the first RAM region followed by data,
+ * if any, in which case r2 and r3 are the data's address and length.
+ * The region's contents are saved and restored along with the core
+ * registers.  Returns non-zero if the stub could not be used, in which
+ * case the caller accesses the memory over the debug port instead.
+ */
+static int cortexm_ram_stub(target *t, const void *stub, size_t stub_size,
+                            const void *data, size_t data_len,
+                            target_addr base, size_t len,
+                            uint32_t r2, uint32_t r3, uint32_t *result)
+{
+	struct cortexm_priv *priv = t->priv;
+	struct target_ram *ram = t->ram;
+	size_t size = ALIGN(stub_size, 4) + data_len;
+	uint8_t save[CORTEXM_RAM_STUB_SAVE];
+	uint32_t regs[CORTEXM_GENERAL_REG_COUNT + CORTEXM_FLOAT_REG_COUNT];
+	bool on_bkpt = priv->on_bkpt;
+	bool boosted = false;
+	int ret;
+
+	if ((size > sizeof(save)) || (t->regs_size > sizeof(regs)))
+		return -1;
+	if ((ram == NULL) || (ram->length < size) ||
+	    priv->stub_running || !cortexm_mem_known(t, base, len))
+		return -1;
+	/* Don't let the stub work on itself */
+	if ((base < ram->start + size) && (base + len > ram->start))
+		return -1;
+
+	cortexm_regs_read(t, regs);
+	if (target_mem_read(t, save, ram->start, size))
+		return -1;
+
+	if (len >= CORTEXM_STUB_BOOST)
+		boosted = target_clock_boost(t);
+	ret = target_mem_write(t, ram->start, stub, stub_size);
+	if (data && (ret == 0)) {
+		r2 = ram->start + ALIGN(stub_size, 4);
+		r3 = data_len;
+		ret = target_mem_write(t, r2, data, data_len);
+	}
+	if (ret == 0)
+		ret = cortexm_run_stub(t, ram->start, base, len, r2, r3);
+	if (ret == 0) {
+		target_mem_write32(t, CORTEXM_DCRSR, 0);
+		*result = target_mem_read32(t, CORTEXM_DCRDR);
+	}
+
+	target_mem_write(t, ram->start, save, size);
+	cortexm_regs_write(t, regs);
+	priv->on_bkpt = on_bkpt;
+	if (boosted)
+		target_clock_restore(t);
+	if (target_check_error(t))
+		return -1;
+	return ret ? -1 : 0;
+}
+
+static int cortexm_crc32(target *t, uint32_t *crc, target_addr base, size_t len)
+{
+	return cortexm_ram_stub(t, cortexm_crc32_stub, sizeof(cortexm_crc32_stub),
+	                        NULL, 0, base, len, *crc, 0, crc);
+}
+
+/* The stub returns the address of the first match, or one past the last
+ * address a match could start at */
+static int cortexm_mem_search(target *t, target_addr base, size_t len,
+                              const void *data, size_t data_len,
+                              target_addr *addr)
+{
+	uint32_t found;
+
+	if (cortexm_ram_stub(t, cortexm_memsearch_stub,
+	                     sizeof(cortexm_memsearch_stub), data, data_len,
+	                     base, len, 0, 0, &found))
+		return -1;
+	if (found > base + (len - data_len))
+		return 0;
+	*addr = found;
+	return 1;
+}
+
+static int cortexm_mem_fill(target *t, target_addr base, size_t len,
+                            const void *data, size_t data_len)
+{
+	uint32_t end;
+
+	/* Flash and peripherals can't be written with byte stores */
+	if (!cortexm_ram_known(t, base, len))
+		return -1;
+	if (cortexm_ram_stub(t, cortexm_memfill_stub,
+	                     sizeof(cortexm_memfill_stub), data, data_len,
+	                     base, len, 0, 0, &end))
+		return -1;
+	return (end == base + len) ? 0 : -1;
+}
+
 /* The following routines implement hardware breakpoints and watchpoints.
  * The Flash Patch and Breakpoint (FPB) and Data Watch and Trace (DWT)
  * systems are used. */
@@ -745,36 +1593,58 @@ static int cortexm_breakwatch_set(target *t, struct breakwatch *bw)
 		}
 		val |= 1;
 
-		for(i = 0; i < priv->hw_breakpoint_max; i++)
-			if (!priv->hw_breakpoint[i])
+		/* Prefer a free comparator already holding this value,
+		 * as GDB reinserts its breakpoints at every stop */
+		unsigned j = priv->hw_breakpoint_max;
+		for(i = 0; i < priv->hw_breakpoint_max; i++) {
+			if (priv->hw_breakpoint[i])
+				continue;
+			if (priv->fpb_comp_hw[i] == val)
 				break;
+			if (j == priv->hw_breakpoint_max)
+				j = i;
+		}
+		if (i == priv->hw_breakpoint_max)
+			i = j;
 
 		if (i == priv->hw_breakpoint_max)
 			return -1;
 
 		priv->hw_breakpoint[i] = true;
-		target_mem_write32(t, CORTEXM_FPB_COMP(i), val);
+		priv->fpb_comp[i] = val;
+		priv->bw_dirty = true;
 		bw->reserved[0] = i;
 		return 0;
 
 	case TARGET_WATCH_WRITE:
 	case TARGET_WATCH_READ:
-	case TARGET_WATCH_ACCESS:
-		for(i = 0; i < priv->hw_watchpoint_max; i++)
-			if (!priv->hw_watchpoint[i])
+	case TARGET_WATCH_ACCESS: {
+		struct cortexm_dwt want = {
+			.comp = val,
+			.mask = dwt_mask(bw->size),
+			.func = dwt_func(t, bw->type),
+		};
+		unsigned j = priv->hw_watchpoint_max;
+		for(i = 0; i < priv->hw_watchpoint_max; i++) {
+			if (priv->hw_watchpoint[i])
+				continue;
+			if (!memcmp(&priv->dwt_hw[i], &want, sizeof(want)))
 				break;
+			if (j == priv->hw_watchpoint_max)
+				j = i;
+		}
+		if (i == priv->hw_watchpoint_max)
+			i = j;
 
 		if (i == priv->hw_watchpoint_max)
 			return -1;
 
 		priv->hw_watchpoint[i] = true;
-
-		target_mem_write32(t, CORTEXM_DWT_COMP(i), val);
-		target_mem_write32(t, CORTEXM_DWT_MASK(i), dwt_mask(bw->size));
-		target_mem_write32(t, CORTEXM_DWT_FUNC(i), dwt_func(t, bw->type));
-
+		priv->dwt[i] = want;
+		priv->bw_dirty = true;
 		bw->reserved[0] = i;
 		return 0;
+	}
 	default:
 		return 1;
 	}
@@ -787,27 +1657,68 @@ static int cortexm_breakwatch_clear(target *t, struct breakwatch *bw)
 	switch (bw->type) {
 	case TARGET_BREAK_HARD:
 		priv->hw_breakpoint[i] = false;
-		target_mem_write32(t, CORTEXM_FPB_COMP(i), 0);
+		priv->fpb_comp[i] = 0;
+		priv->bw_dirty = true;
 		return 0;
 	case TARGET_WATCH_WRITE:
 	case TARGET_WATCH_READ:
 	case TARGET_WATCH_ACCESS:
 		priv->hw_watchpoint[i] = false;
-		target_mem_write32(t, CORTEXM_DWT_FUNC(i), 0);
+		priv->dwt[i].func = 0;
+		priv->bw_dirty = true;
 		return 0;
 	default:
 		return 1;
 	}
 }
 
+/* Write the comparators that differ from the wanted set.  Called on
+ * resume, so GDB removing and reinserting breakpoints around a stop
+ * costs no target accesses. */
+static void cortexm_breakwatch_commit(target *t)
+{
+	struct cortexm_priv *priv = t->priv;
+	unsigned i;
+
+	if (!priv->bw_dirty)
+		return;
+	priv->bw_dirty = false;
+
+	for(i = 0; i < priv->hw_breakpoint_max; i++) {
+		if (priv->fpb_comp[i] == priv->fpb_comp_hw[i])
+			continue;
+		target_mem_write32(t, CORTEXM_FPB_COMP(i), priv->fpb_comp[i]);
+		priv->fpb_comp_hw[i] = priv->fpb_comp[i];
+	}
+
+	for(i = 0; i < priv->hw_watchpoint_max; i++) {
+		struct cortexm_dwt *want = &priv->dwt[i];
+		struct cortexm_dwt *hw = &priv->dwt_hw[i];
+		/* Comparator and mask are don't care while disabled */
+		if (want->func && (want->comp != hw->comp)) {
+			target_mem_write32(t, CORTEXM_DWT_COMP(i), want->comp);
+			hw->comp = want->comp;
+		}
+		if (want->func && (want->mask != hw->mask)) {
+			target_mem_write32(t, CORTEXM_DWT_MASK(i), want->mask);
+			hw->mask = want->mask;
+		}
+		if (want->func != hw->func) {
+			target_mem_write32(t, CORTEXM_DWT_FUNC(i), want->func);
+			hw->func = want->func;
+		}
+	}
+}
+
 static target_addr cortexm_check_watch(target *t)
 {
 	struct cortexm_priv *priv = t->priv;
 	unsigned i;
 
 	for(i = 0; i < priv->hw_watchpoint_max; i++)
-		/* if SET and MATCHED then break */
-		if(priv->hw_watchpoint[i] &&
+		/* if SET and MATCHED then break, trace comparators match
+		 * without halting */
+		if(priv->hw_watchpoint[i] && !(priv->dwt_trace & (1 << i)) &&
 		   (target_mem_read32(t, CORTEXM_DWT_FUNC(i)) &
 					CORTEXM_DWT_FUNC_MATCHED))
 			break;
@@ -855,6 +1766,464 @@ static bool cortexm_vector_catch(target *t, int argc, char *argv[])
 	return true;
 }
 
+static bool cortexm_profile(target *t, int argc, char *argv[])
+{
+	struct cortexm_priv *priv = t->priv;
+	struct cortexm_profile *p = priv->profile;
+
+	if ((argc > 2) && !strcmp(argv[1], "start")) {
+		if (t->target_options & TOPT_FLAVOUR_V6M) {
+			tc_printf(t, "No DWT_PCSR on ARMv6-M\n");
+			return true;
+		}
+		if (p == NULL)
+			p = priv->profile = malloc(sizeof(*p));
+		if (p == NULL) {
+			tc_printf(t, "No memory for the profile\n");
+			return false;
+		}
+		memset(p, 0, sizeof(*p));
+		p->base = strtoul(argv[2], NULL, 0);
+		uint32_t granularity = (argc > 3) ? strtoul(argv[3], NULL, 0) : 4;
+		while ((p->shift < 31) && ((1u << p->shift) < granularity))
+			p->shift++;
+		p->period = (argc > 4) ? strtoul(argv[4], NULL, 0) : 0;
+		p->next = platform_time_ms();
+		p->running = true;
+		tc_printf(t, "Profiling 0x%08"PRIx32"-0x%08"PRIx32" in %"PRIu32
+		          " byte buckets while the target runs\n", p->base,
+		          p->base + (CORTEXM_PROFILE_BUCKETS << p->shift) - 1,
+		          (uint32_t)1 << p->shift);
+		return true;
+	}
+	if (p == NULL) {
+		tc_printf(t, "usage: monitor profile (start <base> <granularity> "
+		          "[period ms]|stop|dump)\n");
+		return true;
+	}
+	if ((argc > 1) && !strcmp(argv[1], "stop")) {
+		p->running = false;
+	} else if ((argc > 1) && !strcmp(argv[1], "dump")) {
+		for (unsigned i = 0; i < CORTEXM_PROFILE_BUCKETS; i++) {
+			if (p->bucket[i] == 0)
+				continue;
+			uint32_t permille = (uint64_t)p->bucket[i] * 1000 / p->samples;
+			tc_printf(t, "0x%08"PRIx32" %8"PRIu32" %3"PRIu32".%"PRIu32"%%\n",
+			          p->base + (i << p->shift), p->bucket[i],
+			          permille / 10, permille % 10);
+		}
+	}
+	tc_printf(t, "Profile %s: %"PRIu32" samples, %"PRIu32" idle, "
+	          "%"PRIu32" outside range\n", p->running ? "running" : "stopped",
+	          p->samples, p->idle, p->outside);
+	return true;
+}
+
+/* DWT_FUNCTION for each trace mode, on read, write and either access */
+static const struct {
+	const char *name;
+	uint32_t func[3];
+} cortexm_dwt_trace_modes[] = {
+	{"value", {CORTEXM_DWT_FUNC_TRACE_VALUE_RD,
+	           CORTEXM_DWT_FUNC_TRACE_VALUE_WR,
+	           CORTEXM_DWT_FUNC_TRACE_VALUE}},
+	{"pcvalue", {CORTEXM_DWT_FUNC_TRACE_PC_VALUE_RD,
+	             CORTEXM_DWT_FUNC_TRACE_PC_VALUE_WR,
+	             CORTEXM_DWT_FUNC_TRACE_PC_VALUE}},
+	{"pc", {0, 0, CORTEXM_DWT_FUNC_TRACE_PC}},
+	{"addr", {CORTEXM_DWT_FUNC_TRACE_VALUE_RD | CORTEXM_DWT_FUNC_EMITRANGE,
+	          CORTEXM_DWT_FUNC_TRACE_VALUE_WR | CORTEXM_DWT_FUNC_EMITRANGE,
+	          CORTEXM_DWT_FUNC_TRACE_PC | CORTEXM_DWT_FUNC_EMITRANGE}},
+};
+#define DWT_TRACE_MODES (sizeof(cortexm_dwt_trace_modes) / sizeof(cortexm_dwt_trace_modes[0]))
+static const char *const cortexm_dwt_trace_access[] = {"read", "write", "access"};
+#define DWT_TRACE_ACCESS 3
+
+/* Data trace: a DWT comparator emits hardware packets through the ITM on
+ * each matching access instead of halting the core.  The comparators
+ * are taken from those free for watchpoints and written at resume, as
+ * watchpoints are.  The TPIU is left as the application or a GDB script
+ * set it up, to match the probe's traceswo settings. */
+static bool cortexm_dwt_trace(target *t, int argc, char *argv[])
+{
+	struct cortexm_priv *priv = t->priv;
+	unsigned i;
+
+	if (t->target_options & TOPT_FLAVOUR_V6M) {
+		tc_printf(t, "No data trace on ARMv6-M\n");
+		return true;
+	}
+
+	if ((argc > 1) && !strcmp(argv[1], "clear")) {
+		for (i = 0; i < priv->hw_watchpoint_max; i++) {
+			if (!(priv->dwt_trace & (1 << i)))
+				continue;
+			priv->hw_watchpoint[i] = false;
+			priv->dwt[i].func = 0;
+		}
+		priv->dwt_trace = 0;
+		priv->bw_dirty = true;
+		return true;
+	}
+
+	if (argc > 1) {
+		uint32_t addr = strtoul(argv[1], NULL, 0);
+		uint32_t len = (argc > 2) ? strtoul(argv[2], NULL, 0) : 4;
+		const char *mode = (argc > 3) ? argv[3] : "value";
+		const char *access = (argc > 4) ? argv[4] : "write";
+		unsigned m, a;
+		uint32_t mask = 0;
+
+		for (m = 0; m < DWT_TRACE_MODES; m++)
+			if (!strcmp(mode, cortexm_dwt_trace_modes[m].name))
+				break;
+		for (a = 0; a < DWT_TRACE_ACCESS; a++)
+			if (!strcmp(access, cortexm_dwt_trace_access[a]))
+				break;
+		while ((mask < 31) && ((1u << mask) < len))
+			mask++;
+		if ((m == DWT_TRACE_MODES) ||
+		    (a == DWT_TRACE_ACCESS) ||
+		    !cortexm_dwt_trace_modes[m].func[a] ||
+		    (len != (1u << mask)) || (addr & (len - 1))) {
+			tc_printf(t, "usage: monitor dwt_trace <addr> [len] "
+			          "[value|pcvalue|pc|addr] [read|write|access]\n"
+			          "len is a power of 2 that addr is aligned to, "
+			          "pc traces any access\n");
+			return true;
+		}
+
+		for (i = 0; i < priv->hw_watchpoint_max; i++)
+			if (!priv->hw_watchpoint[i])
+				break;
+		if (i == priv->hw_watchpoint_max) {
+			tc_printf(t, "No free DWT comparator\n");
+			return true;
+		}
+
+		/* Forward DWT packets from the ITM */
+		uint32_t tcr = target_mem_read32(t, CORTEXM_ITM_TCR);
+		if (!(tcr & CORTEXM_ITM_TCR_TRACEBUSID_MASK))
+			tcr |= CORTEXM_ITM_TCR_TRACEBUSID(1);
+		target_mem_write32(t, CORTEXM_ITM_LAR, CORTEXM_ITM_LAR_KEY);
+		target_mem_write32(t, CORTEXM_ITM_TCR, tcr |
+		                   CORTEXM_ITM_TCR_ITMENA | CORTEXM_ITM_TCR_TXENA);
+
+		priv->hw_watchpoint[i] = true;
+		priv->dwt_trace |= 1 << i;
+		priv->dwt[i].comp = addr;
+		priv->dwt[i].mask = mask;
+		priv->dwt[i].func = cortexm_dwt_trace_modes[m].func[a];
+		priv->bw_dirty = true;
+	}
+
+	for (i = 0; i < priv->hw_watchpoint_max; i++) {
+		if (!(priv->dwt_trace & (1 << i)))
+			continue;
+		tc_printf(t, "DWT%u: 0x%08"PRIx32" length %"PRIu32
+		          ", function 0x%"PRIx32"\n", i, priv->dwt[i].comp,
+		          (uint32_t)1 << priv->dwt[i].mask, priv->dwt[i].func);
+	}
+	return true;
+}
+
+/* Micro Trace Buffer (MTB-M0+) registers */
+#define MTB_POSITION		0x000
+#define MTB_POSITION_WRAP	(1 << 2)
+#define MTB_MASTER		0x004
+#define MTB_MASTER_EN		(1u << 31)
+#define MTB_MASTER_MASK(x)	((x) & 0x1f)
+#define MTB_FLOW		0x008
+#define MTB_BASE		0x00C
+
+/* Each packet is the source and destination of a branch.  Bit 0 of the
+ * source marks an exception, bit 0 of the destination the first packet
+ * after tracing started. */
+#define MTB_PACKET_SIZE		8
+#define MTB_MAX_SIZE		0x10000
+#define MTB_READ_SIZE		256
+
+static bool cortexm_mtb(target *t, int argc, char *argv[])
+{
+	uint32_t mtb = cortexm_ap(t)->mtb;
+
+	if (mtb == 0) {
+		tc_printf(t, "No MTB found\n");
+		return true;
+	}
+	uint32_t sram = target_mem_read32(t, mtb + MTB_BASE);
+	uint32_t master = target_mem_read32(t, mtb + MTB_MASTER);
+	uint32_t size = 16u << MTB_MASTER_MASK(master);
+
+	if ((argc > 3) && !strcmp(argv[1], "enable")) {
+		/* The buffer is a power of two in size, aligned to its size,
+		 * and placed relative to the SRAM base */
+		target_addr addr = strtoul(argv[2], NULL, 0);
+		size = strtoul(argv[3], NULL, 0);
+		unsigned mask = 0;
+		while ((mask < 31) && ((16u << mask) < size))
+			mask++;
+		size = 16u << mask;
+		if ((size > MTB_MAX_SIZE) || (addr & (size - 1)) || (addr < sram)) {
+			tc_printf(t, "Buffer must be at most %u bytes, aligned to "
+			          "its size and above 0x%08"PRIx32"\n",
+			          MTB_MAX_SIZE, sram);
+			return true;
+		}
+		target_mem_write32(t, mtb + MTB_MASTER, 0);
+		target_mem_write32(t, mtb + MTB_FLOW, 0);
+		target_mem_write32(t, mtb + MTB_POSITION, addr - sram);
+		target_mem_write32(t, mtb + MTB_MASTER,
+		                   MTB_MASTER_EN | MTB_MASTER_MASK(mask));
+		tc_printf(t, "Tracing branches into 0x%08"PRIx32"-0x%08"PRIx32"\n",
+		          addr, addr + size - 1);
+		return true;
+	}
+	if ((argc > 1) && !strcmp(argv[1], "disable")) {
+		target_mem_write32(t, mtb + MTB_MASTER, master & ~MTB_MASTER_EN);
+		return true;
+	}
+	if ((argc < 2) || strcmp(argv[1], "dump")) {
+		tc_printf(t, "MTB at 0x%08"PRIx32" %s\n", mtb,
+		          (master & MTB_MASTER_EN) ? "enabled" : "disabled");
+		return true;
+	}
+
+	/* Stop tracing while reading, or our own halt would be recorded */
+	target_mem_write32(t, mtb + MTB_MASTER, master & ~MTB_MASTER_EN);
+	uint32_t position = target_mem_read32(t, mtb + MTB_POSITION);
+	uint32_t here = position & (size - 1) & ~(MTB_PACKET_SIZE - 1);
+	target_addr buf_addr = sram + (position & ~(size - 1) & ~7);
+	size_t count = (position & MTB_POSITION_WRAP) ? size : here;
+
+	/* Print oldest first, reading the buffer a block at a time */
+	uint8_t buf[MTB_READ_SIZE];
+	uint32_t loaded = UINT32_MAX;
+	size_t max = (argc > 2) ? strtoul(argv[2], NULL, 0) * MTB_PACKET_SIZE :
+	             count;
+	for (size_t i = count - MIN(max, count); i < count;
+	     i += MTB_PACKET_SIZE) {
+		uint32_t off = (here + size - count + i) % size;
+		uint32_t block = off & ~(MTB_READ_SIZE - 1);
+		if (block != loaded) {
+			target_mem_read(t, buf, buf_addr + block,
+			                MIN(size, MTB_READ_SIZE));
+			loaded = block;
+		}
+		uint32_t packet[2];
+		memcpy(packet, &buf[off - block], sizeof(packet));
+		tc_printf(t, "0x%08"PRIx32" -> 0x%08"PRIx32"%s%s\n",
+		          packet[0] & ~1, packet[1] & ~1,
+		          (packet[0] & 1) ? " exception" : "",
+		          (packet[1] & 1) ? " start" : "");
+	}
+	target_mem_write32(t, mtb + MTB_MASTER, master);
+	return true;
+}
+
+/* Limit on each run of 'monitor cycles' */
+#define CORTEXM_CYCLES_TIMEOUT	2000
+
+/* Run until the core reaches addr.  A hardware breakpoint at the current
+ * PC would hit at once, so step off it first. */
+static bool cortexm_run_to(target *t, target_addr addr)
+{
+	platform_timeout timeout;
+	enum target_halt_reason reason;
+
+	if (cortexm_pc_read(t) == addr) {
+		target_halt_resume(t, true);
+		while (!target_halt_poll(t, NULL))
+			;
+	}
+	if (target_breakwatch_set(t, TARGET_BREAK_HARD, addr, 2))
+		return false;
+	target_halt_resume(t, false);
+	platform_timeout_set(&timeout, CORTEXM_CYCLES_TIMEOUT);
+	while (!(reason = target_halt_poll(t, NULL)) &&
+	       !platform_timeout_is_expired(&timeout))
+		;
+	if (reason == TARGET_HALT_RUNNING)
+		target_halt_request(t);
+	while (reason == TARGET_HALT_RUNNING)
+		reason = target_halt_poll(t, NULL);
+	target_breakwatch_clear(t, TARGET_BREAK_HARD, addr, 2);
+	return (reason != TARGET_HALT_ERROR) && (cortexm_pc_read(t) == addr);
+}
+
+/* Time start to stop with DWT_CYCCNT over a number of runs, without GDB
+ * in the loop.  The counter doesn't count while halted, so the stops in
+ * between cost nothing. */
+static bool cortexm_cycles(target *t, int argc, char *argv[])
+{
+	if (argc < 3) {
+		tc_printf(t, "usage: monitor cycles <start> <stop> [runs] [CPU Hz]\n");
+		return true;
+	}
+	if (t->target_options & TOPT_FLAVOUR_V6M) {
+		tc_printf(t, "No DWT_CYCCNT on ARMv6-M\n");
+		return true;
+	}
+	target_addr start = strtoul(argv[1], NULL, 0);
+	target_addr stop = strtoul(argv[2], NULL, 0);
+	uint32_t runs = (argc > 3) ? strtoul(argv[3], NULL, 0) : 1;
+	uint32_t hz = (argc > 4) ? strtoul(argv[4], NULL, 0) : 0;
+	uint32_t min = UINT32_MAX, max = 0;
+	uint64_t total = 0;
+	uint32_t n;
+
+	uint32_t ctrl = target_mem_read32(t, CORTEXM_DWT_CTRL);
+	target_mem_write32(t, CORTEXM_DWT_CTRL, ctrl | CORTEXM_DWT_CTRL_CYCCNTENA);
+	for (n = 0; n < runs; n++) {
+		if (!cortexm_run_to(t, start)) {
+			tc_printf(t, "Didn't reach start, stopped at 0x%08"PRIx32"\n",
+			          cortexm_pc_read(t));
+			break;
+		}
+		target_mem_write32(t, CORTEXM_DWT_CYCCNT, 0);
+		if (!cortexm_run_to(t, stop)) {
+			tc_printf(t, "Didn't reach stop, stopped at 0x%08"PRIx32"\n",
+			          cortexm_pc_read(t));
+			break;
+		}
+		uint32_t cycles = target_mem_read32(t, CORTEXM_DWT_CYCCNT);
+		min = MIN(min, cycles);
+		max = MAX(max, cycles);
+		total += cycles;
+	}
+	target_mem_write32(t, CORTEXM_DWT_CTRL, ctrl);
+
+	if (n == 0)
+		return true;
+	uint32_t avg = total / n;
+	tc_printf(t, "%"PRIu32" runs, cycles min %"PRIu32" max %"PRIu32
+	          " avg %"PRIu32"\n", n, min, max, avg);
+	if (hz)
+		tc_printf(t, "time min %"PRIu32" max %"PRIu32" avg %"PRIu32" ns\n",
+		          (uint32_t)((uint64_t)min * 1000000000 / hz),
+		          (uint32_t)((uint64_t)max * 1000000000 / hz),
+		          (uint32_t)((uint64_t)avg * 1000000000 / hz));
+	return true;
+}
+
+#define CORTEXM_BENCH_SIZE	256	/* RAM window, saved and restored */
+#define CORTEXM_BENCH_BYTES	16384	/* bytes moved by block transfers */
+#define CORTEXM_BENCH_LOOPS	256	/* single accesses and register trips */
+#define CORTEXM_BENCH_STUBS	32	/* stub launches */
+
+static void cortexm_bench_report(target *t, const char *what,
+                                 uint32_t count, const char *unit,
+                                 uint32_t start)
+{
+	uint32_t ms = platform_time_ms() - start;
+
+	tc_printf(t, "%-16s %6"PRIu32" %s in %5"PRIu32" ms", what, count, unit, ms);
+	if (ms && !strcmp(unit, "bytes"))
+		tc_printf(t, ", %"PRIu32" KB/s", count / ms);
+	tc_printf(t, "\n");
+}
+
+static bool cortexm_bench(target *t, int argc, char *argv[])
+{
+	(void)argc;
+	(void)argv;
+	struct cortexm_priv *priv = t->priv;
+	struct target_ram *ram = t->ram;
+	uint8_t saved[CORTEXM_BENCH_SIZE];
+	uint8_t buf[CORTEXM_BENCH_SIZE];
+	uint32_t regs[t->regs_size / 4];
+	uint32_t start, r0;
+	target_addr base;
+	int i;
+
+	if (!ram || (ram->length < CORTEXM_BENCH_SIZE)) {
+		tc_printf(t, "No RAM region to benchmark\n");
+		return true;
+	}
+	base = ram->start;
+
+	/* Everything below is put back afterwards */
+	cortexm_regs_read(t, regs);
+	if (target_mem_read(t, saved, base, sizeof(saved))) {
+		tc_printf(t, "Failed to read RAM at 0x%08"PRIx32"\n", base);
+		return true;
+	}
+	memset(buf, 0x55, sizeof(buf));
+
+	start = platform_time_ms();
+	for (i = 0; i < CORTEXM_BENCH_BYTES; i += sizeof(buf))
+		target_mem_write(t, base, buf, sizeof(buf));
+	cortexm_bench_report(t, "Block write", CORTEXM_BENCH_BYTES, "bytes", start);
+
+	start = platform_time_ms();
+	for (i = 0; i < CORTEXM_BENCH_BYTES; i += sizeof(buf))
+		target_mem_read(t, buf, base, sizeof(buf));
+	cortexm_bench_report(t, "Block read", CORTEXM_BENCH_BYTES, "bytes", start);
+
+	start = platform_time_ms();
+	for (i = 0; i < CORTEXM_BENCH_LOOPS; i++)
+		target_mem_write8(t, base + (i % CORTEXM_BENCH_SIZE), i);
+	cortexm_bench_report(t, "Byte write", CORTEXM_BENCH_LOOPS, "bytes", start);
+
+	start = platform_time_ms();
+	for (i = 0; i < CORTEXM_BENCH_LOOPS; i++)
+		target_mem_read8(t, base + (i % CORTEXM_BENCH_SIZE));
+	cortexm_bench_report(t, "Byte read", CORTEXM_BENCH_LOOPS, "bytes", start);
+
+	start = platform_time_ms();
+	for (i = 0; i < CORTEXM_BENCH_LOOPS; i++)
+		target_mem_write16(t, base + ((i * 2) % CORTEXM_BENCH_SIZE), i);
+	cortexm_bench_report(t, "Halfword write", CORTEXM_BENCH_LOOPS * 2, "bytes", start);
+
+	start = platform_time_ms();
+	for (i = 0; i < CORTEXM_BENCH_LOOPS; i++)
+		target_mem_read16(t, base + ((i * 2) % CORTEXM_BENCH_SIZE));
+	cortexm_bench_report(t, "Halfword read", CORTEXM_BENCH_LOOPS * 2, "bytes", start);
+
+	start = platform_time_ms();
+	for (i = 0; i < CORTEXM_BENCH_LOOPS; i++)
+		target_mem_write32(t, base + ((i * 4) % CORTEXM_BENCH_SIZE), i);
+	cortexm_bench_report(t, "Word write", CORTEXM_BENCH_LOOPS * 4, "bytes", start);
+
+	start = platform_time_ms();
+	for (i = 0; i < CORTEXM_BENCH_LOOPS; i++)
+		target_mem_read32(t, base + ((i * 4) % CORTEXM_BENCH_SIZE));
+	cortexm_bench_report(t, "Word read", CORTEXM_BENCH_LOOPS * 4, "bytes", start);
+
+	/* Defeat the register cache so every read goes to the target */
+	start = platform_time_ms();
+	for (i = 0; i < CORTEXM_BENCH_LOOPS; i++) {
+		cortexm_regs_forget(priv);
+		cortexm_reg_read(t, 0, &r0, sizeof(r0));
+	}
+	cortexm_bench_report(t, "Register fetch", CORTEXM_BENCH_LOOPS, "trips", start);
+
+	/* Change the value each time, unchanged registers are not written */
+	start = platform_time_ms();
+	for (i = 0; i < CORTEXM_BENCH_LOOPS; i++) {
+		r0 ^= 1;
+		cortexm_reg_write(t, 0, &r0, sizeof(r0));
+	}
+	cortexm_bench_report(t, "Register write", CORTEXM_BENCH_LOOPS, "trips", start);
+
+	/* A stub that is just a breakpoint measures launch and halt latency */
+	target_mem_write16(t, base, 0xbe00);
+	start = platform_time_ms();
+	for (i = 0; i < CORTEXM_BENCH_STUBS; i++)
+		if (cortexm_run_stub(t, base, 0, 0, 0, 0))
+			break;
+	if (i == CORTEXM_BENCH_STUBS)
+		cortexm_bench_report(t, "Stub run", CORTEXM_BENCH_STUBS, "runs", start);
+	else
+		tc_printf(t, "Stub run failed\n");
+
+	target_mem_write(t, base, saved, sizeof(saved));
+	cortexm_regs_write(t, regs);
+	if (target_check_error(t))
+		tc_printf(t, "Failed to restore target state\n");
+	return true;
+}
+
 /* Windows defines this with some other meaning... */
 #ifdef SYS_OPEN
 #	undef SYS_OPEN
@@ -885,15 +2254,71 @@ static bool cortexm_vector_catch(target *t, int argc, char *argv[])
 #define SYS_WRITEC	0x03
 #define SYS_WRITE0	0x04
 
-static int cortexm_hostio_request(target *t)
+static bool cortexm_semihost_console(target *t, int argc, char *argv[])
+{
+	struct cortexm_priv *priv = t->priv;
+	if (argc == 1)
+		tc_printf(t, "Semihosted console on the probe: %s\n",
+		          priv->semihost_console ? "enabled" : "disabled");
+	else
+		priv->semihost_console = !strcmp(argv[1], "enable");
+	return true;
+}
+
+/* Semihosting handles that open() gave out for ":tt" */
+static bool cortexm_hostio_is_console(uint32_t handle)
+{
+	return (handle == STDOUT_FILENO + 1) || (handle == STDERR_FILENO + 1);
+}
+
+/* Length of a string in target memory.  Reads never cross a 64 byte
+ * boundary, so they can't run on much past the end of the string. */
+static size_t cortexm_hostio_strlen(target *t, target_addr addr)
+{
+	char buf[64];
+	size_t len = 0;
+	while (1) {
+		size_t chunk = sizeof(buf) - (addr & (sizeof(buf) - 1));
+		target_mem_read(t, buf, addr, chunk);
+		if (target_check_error(t))
+			return len;
+		char *end = memchr(buf, 0, chunk);
+		if (end)
+			return len + (end - buf);
+		len += chunk;
+		addr += chunk;
+	}
+}
+
+/* Print console output on the probe as GDB 'O' packets.  A File-I/O
+ * request would cost GDB reading the string back and replying, all
+ * while the core is halted. */
+static void cortexm_hostio_console(target *t, target_addr addr, size_t len)
 {
-	uint32_t arm_regs[t->regs_size];
+	char buf[64];
+	while (len) {
+		size_t chunk = MIN(len, sizeof(buf) - (addr & (sizeof(buf) - 1)));
+		target_mem_read(t, buf, addr, chunk);
+		if (target_check_error(t))
+			return;
+		tc_printf(t, "%.*s", (int)chunk, buf);
+		addr += chunk;
+		len -= chunk;
+	}
+}
+
+/* Only r0 and r1 carry the request, so those are all that's read, and
+ * the result goes back with the PC stepped past the BKPT in one queued
+ * run rather than a register file round trip each way. */
+static int cortexm_hostio_request(target *t, uint32_t pc)
+{
+	struct cortexm_priv *priv = t->priv;
+	uint32_t syscall = cortexm_core_reg_read(t, 0);
+	uint32_t arg = cortexm_core_reg_read(t, 1);
 	uint32_t params[4];
 
 	t->tc->interrupted = false;
-	target_regs_read(t, arm_regs);
-	target_mem_read(t, params, arm_regs[1], sizeof(params));
-	uint32_t syscall = arm_regs[0];
+	target_mem_read(t, params, arg, sizeof(params));
 	int32_t ret = 0;
 
 	DEBUG("syscall 0"PRIx32"%"PRIx32" (%"PRIx32" %"PRIx32" %"PRIx32" %"PRIx32")\n",
@@ -936,17 +2361,35 @@ static int cortexm_hostio_request(target *t)
 		break;
 	case SYS_READ:	/* read */
 		ret = tc_read(t, params[0] - 1, params[1], params[2]);
-		if (ret > 0)
+		/* Bytes not read, so reaching the end of file isn't an error */
+		if (ret >= 0)
 			ret = params[2] - ret;
 		break;
 	case SYS_WRITE:	/* write */
+		if (priv->semihost_console &&
+		    cortexm_hostio_is_console(params[0])) {
+			cortexm_hostio_console(t, params[1], params[2]);
+			ret = 0;
+			break;
+		}
 		ret = tc_write(t, params[0] - 1, params[1], params[2]);
 		if (ret > 0)
 			ret = params[2] - ret;
 		break;
 	case SYS_WRITEC: /* writec */
-		ret = tc_write(t, 2, arm_regs[1], 1);
+		if (priv->semihost_console)
+			cortexm_hostio_console(t, arg, 1);
+		else
+			ret = tc_write(t, 2, arg, 1);
 		break;
+	case SYS_WRITE0: { /* write0 */
+		size_t len = cortexm_hostio_strlen(t, arg);
+		if (priv->semihost_console)
+			cortexm_hostio_console(t, arg, len);
+		else if (len)
+			ret = tc_write(t, 2, arg, len);
+		break;
+		}
 	case SYS_ISTTY:	/* isatty */
 		ret = tc_isatty(t, params[0] - 1);
 		break;
@@ -977,8 +2420,16 @@ static int cortexm_hostio_request(target *t)
 		break;
 	}
 
-	arm_regs[0] = ret;
-	target_regs_write(t, arm_regs);
+	ADIv5_AP_t *ap = cortexm_ap(t);
+	bool first = true;
+	cortexm_core_reg_post(ap, &first, 0, ret);
+	cortexm_core_reg_post(ap, &first, 0x0F, pc + 2);
+	adiv5_dp_flush(ap->dp);
+	/* Resuming mustn't step over the BKPT a second time */
+	priv->on_bkpt = false;
+	if (priv->regs_valid)
+		priv->regs[0] = ret;
+	priv->regs[15] = pc + 2;
 
 	return t->tc->interrupted;
 }
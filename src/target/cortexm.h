@@ -58,10 +58,17 @@
 #define CORTEXM_DWT_BASE	(CORTEXM_PPB_BASE + 0x1000)
 
 #define CORTEXM_DWT_CTRL	(CORTEXM_DWT_BASE + 0x000)
+#define CORTEXM_DWT_CYCCNT	(CORTEXM_DWT_BASE + 0x004)
+#define CORTEXM_DWT_PCSR	(CORTEXM_DWT_BASE + 0x01C)
 #define CORTEXM_DWT_COMP(i)	(CORTEXM_DWT_BASE + 0x020 + (0x10*(i)))
 #define CORTEXM_DWT_MASK(i)	(CORTEXM_DWT_BASE + 0x024 + (0x10*(i)))
 #define CORTEXM_DWT_FUNC(i)	(CORTEXM_DWT_BASE + 0x028 + (0x10*(i)))
 
+#define CORTEXM_ITM_BASE	(CORTEXM_PPB_BASE + 0x0000)
+
+#define CORTEXM_ITM_TCR		(CORTEXM_ITM_BASE + 0xE80)
+#define CORTEXM_ITM_LAR		(CORTEXM_ITM_BASE + 0xFB0)
+
 /* Application Interrupt and Reset Control Register (AIRCR) */
 #define CORTEXM_AIRCR_VECTKEY		(0x05FA << 16)
 /* Bits 31:16 - Read as VECTKETSTAT, 0xFA05 */
@@ -143,6 +150,9 @@
 #define CORTEXM_FPB_CTRL_KEY		(1 << 1)
 #define CORTEXM_FPB_CTRL_ENABLE		(1 << 0)
 
+/* Data Watchpoint and Trace Control Register (DWT_CTRL) */
+#define CORTEXM_DWT_CTRL_CYCCNTENA	(1 << 0)
+
 /* Data Watchpoint and Trace Mask Register (DWT_MASKx) */
 #define CORTEXM_DWT_MASK_BYTE		(0 << 0)
 #define CORTEXM_DWT_MASK_HALFWORD	(1 << 0)
@@ -154,6 +164,22 @@
 #define CORTEXM_DWT_FUNC_FUNC_READ	(5 << 0)
 #define CORTEXM_DWT_FUNC_FUNC_WRITE	(6 << 0)
 #define CORTEXM_DWT_FUNC_FUNC_ACCESS	(7 << 0)
+/* Trace packets emitted on a data address match, v7m only */
+#define CORTEXM_DWT_FUNC_EMITRANGE	(1 << 5)
+#define CORTEXM_DWT_FUNC_TRACE_PC	(1 << 0)	/* or address offset with EMITRANGE */
+#define CORTEXM_DWT_FUNC_TRACE_VALUE	(2 << 0)
+#define CORTEXM_DWT_FUNC_TRACE_PC_VALUE	(3 << 0)
+#define CORTEXM_DWT_FUNC_TRACE_VALUE_RD	(12 << 0)
+#define CORTEXM_DWT_FUNC_TRACE_VALUE_WR	(13 << 0)
+#define CORTEXM_DWT_FUNC_TRACE_PC_VALUE_RD	(14 << 0)
+#define CORTEXM_DWT_FUNC_TRACE_PC_VALUE_WR	(15 << 0)
+
+/* Trace Control Register (ITM_TCR) */
+#define CORTEXM_ITM_TCR_ITMENA		(1 << 0)
+#define CORTEXM_ITM_TCR_TXENA		(1 << 3)	/* forward DWT packets */
+#define CORTEXM_ITM_TCR_TRACEBUSID(x)	((x) << 16)
+#define CORTEXM_ITM_TCR_TRACEBUSID_MASK	(0x7F << 16)
+#define CORTEXM_ITM_LAR_KEY		0xC5ACCE55
 
 #define REG_SP		13
 #define REG_LR		14
@@ -167,6 +193,18 @@
 
 #define	CORTEXM_TOPT_INHIBIT_SRST (1 << 2)
 
+/* Vendor drivers register here with CORTEXM_DRIVER(), and the linker
+ * gathers the entries of every driver in the build into one table.  The
+ * drivers for the JEP-106 designer named in the ROM table are tried
+ * first, then the rest in link order. */
+struct cortexm_driver {
+	bool (*probe)(target *t);
+	uint16_t designer;
+};
+#define CORTEXM_DRIVER(fn, jep106) \
+	static const struct cortexm_driver cortexm_driver_##fn \
+	__attribute__((used, section("cortexm_drivers"))) = {fn, jep106}
+
 bool cortexm_probe(ADIv5_AP_t *ap);
 ADIv5_AP_t *cortexm_ap(target *t);
 
@@ -175,6 +213,22 @@ void cortexm_detach(target *t);
 void cortexm_halt_resume(target *t, bool step);
 int cortexm_run_stub(target *t, uint32_t loadaddr,
                      uint32_t r0, uint32_t r1, uint32_t r2, uint32_t r3);
+int cortexm_stub_write(target *t, const void *stub, size_t stub_size,
+                       uint32_t loadaddr, uint32_t bufaddr, size_t bufsize,
+                       target_addr dest, const void *src, size_t len,
+                       uint32_t arg);
+int cortexm_stub_stream(target *t, const void *stub, size_t stub_size,
+                        uint32_t loadaddr, uint32_t bufaddr, size_t bufsize,
+                        target_addr dest, const void *src, size_t len,
+                        uint32_t arg);
+/* Ring for cortexm_stub_stream() following the largest of a driver's
+ * stubs, stub_size bytes loaded at loadaddr.  Drivers pass the largest
+ * half of the ring they want as bufsize, it is cut down to fit the RAM. */
+#define CORTEXM_STUB_RING_BASE(loadaddr, stub_size, align) \
+	ALIGN((loadaddr) + (stub_size), (align))
+int cortexm_stub_sync(target *t);
+target_addr cortexm_stub_stream_end(target *t);
+int cortexm_stub_done(target *t);
 
 #endif
 
@@ -42,23 +42,37 @@
 #include "cortexm.h"
 
 #define SRAM_BASE		0x20000000
-#define STUB_BUFFER_BASE	ALIGN(SRAM_BASE + sizeof(efm32_flash_write_stub), 4)
+#define STUB_BUFFER_BASE \
+	CORTEXM_STUB_RING_BASE(SRAM_BASE, \
+			       MAX(sizeof(efm32_flash_write_stub), \
+				   sizeof(efm32_flash_write_wdouble_stub)), 4)
+#define STUB_BUFFER_SIZE	0x4000
 
 static int efm32_flash_erase(struct target_flash *t, target_addr addr, size_t len);
 static int efm32_flash_write(struct target_flash *f,
 			     target_addr dest, const void *src, size_t len);
+static int efm32_flash_done(struct target_flash *f);
+static int efm32_flash_mass_erase(struct target_flash *f);
 
 static const uint16_t efm32_flash_write_stub[] = {
 #include "flashstub/efm32.stub"
 };
+static const uint16_t efm32_flash_write_wdouble_stub[] = {
+#include "flashstub/efm32_wdouble.stub"
+};
+
+struct efm32_flash {
+	struct target_flash f;
+	bool wdouble;	/* MSC can program two words at a time */
+};
 
 static bool efm32_cmd_erase_all(target *t);
 static bool efm32_cmd_serial(target *t);
 
 const struct command_s efm32_cmd_list[] = {
-	{"erase_mass", (cmd_handler)efm32_cmd_erase_all, "Erase entire flash memory"},
-	{"serial", (cmd_handler)efm32_cmd_serial, "Prints unique number"},
-	{NULL, NULL, NULL}
+	{"erase_mass", (cmd_handler)efm32_cmd_erase_all, "Erase entire flash memory", CMD_HALTED},
+	{"serial", (cmd_handler)efm32_cmd_serial, "Prints unique number", 0},
+	{NULL, NULL, NULL, 0}
 };
 
 
@@ -68,6 +82,7 @@ const struct command_s efm32_cmd_list[] = {
 /* -------------------------------------------------------------------------- */
 
 #define EFM32_MSC	       		0x400c0000
+#define EFM32_MSC_READCTRL		(EFM32_MSC+0x004)
 #define EFM32_MSC_WRITECTRL	     	(EFM32_MSC+0x008)
 #define EFM32_MSC_WRITECMD	      	(EFM32_MSC+0x00c)
 #define EFM32_MSC_ADDRB		 	(EFM32_MSC+0x010)
@@ -88,12 +103,34 @@ const struct command_s efm32_cmd_list[] = {
 #define EFM32_MSC_WRITECMD_WRITETRIG	(1<<4)
 #define EFM32_MSC_WRITECMD_ERASEABORT	(1<<5)
 #define EFM32_MSC_WRITECMD_ERASEMAIN0	(1<<8)
+#define EFM32_MSC_WRITECMD_ERASEMAIN1	(1<<9)
 
 #define EFM32_MSC_STATUS_BUSY		(1<<0)
 #define EFM32_MSC_STATUS_LOCKED		(1<<1)
 #define EFM32_MSC_STATUS_INVADDR	(1<<2)
 #define EFM32_MSC_STATUS_WDATAREADY	(1<<3)
 
+/* One wait state, or WS0SCBTP to WS1SCBTP */
+#define EFM32_MSC_READCTRL_MODE_WS1	(1<<0)
+
+
+/* -------------------------------------------------------------------------- */
+/* Clock Management Unit (CMU) Registers */
+/* -------------------------------------------------------------------------- */
+
+#define EFM32_CMU			0x400c8000
+#define EFM32_CMU_HFRCOCTRL		(EFM32_CMU+0x00c)
+#define EFM32_CMU_STATUS		(EFM32_CMU+0x02c)
+
+#define EFM32_CMU_HFRCOCTRL_BAND_MASK	(7<<8)
+#define EFM32_CMU_HFRCOCTRL_BAND(x)	((x)<<8)
+#define EFM32_CMU_HFRCOCTRL_TUNING_MASK	0xff
+#define EFM32_CMU_HFRCOCTRL_BAND_14MHZ	3
+#define EFM32_CMU_HFRCOCTRL_BAND_21MHZ	4
+#define EFM32_CMU_HFRCOCTRL_BAND_28MHZ	5
+
+#define EFM32_CMU_STATUS_HFRCOSEL	(1<<10)
+
 
 /* -------------------------------------------------------------------------- */
 /* Flash Infomation Area */
@@ -228,26 +265,87 @@ uint16_t efm32_read_radio_part_number(target *t)
 	return target_mem_read16(t, EFM32_DI_RADIO_OPN);
 }
 
+/**
+ * Moves the HFRCO up from its 14MHz reset band, with the tuning value
+ * calibrated for the new band.  The MSC times flash operations from the
+ * AUXHFRCO, so only the read wait states change with it.
+ */
+static bool efm32_hfrco_boost(target *t, uint8_t band, uint32_t calib)
+{
+	uint32_t status = target_mem_read32(t, EFM32_CMU_STATUS);
+	uint32_t hfrco = target_mem_read32(t, EFM32_CMU_HFRCOCTRL);
+	uint32_t readctrl = target_mem_read32(t, EFM32_MSC_READCTRL);
+	uint8_t tuning = target_mem_read8(t, calib);
+
+	if (target_check_error(t) || !(status & EFM32_CMU_STATUS_HFRCOSEL) ||
+	    ((hfrco & EFM32_CMU_HFRCOCTRL_BAND_MASK) !=
+	     EFM32_CMU_HFRCOCTRL_BAND(EFM32_CMU_HFRCOCTRL_BAND_14MHZ)))
+		return false;
+
+	t->clock_saved[0] = hfrco;
+	t->clock_saved[1] = readctrl;
+	target_mem_write32(t, EFM32_MSC_READCTRL,
+			   readctrl | EFM32_MSC_READCTRL_MODE_WS1);
+	hfrco &= ~(EFM32_CMU_HFRCOCTRL_BAND_MASK |
+		   EFM32_CMU_HFRCOCTRL_TUNING_MASK);
+	target_mem_write32(t, EFM32_CMU_HFRCOCTRL,
+			   hfrco | EFM32_CMU_HFRCOCTRL_BAND(band) | tuning);
+	return !target_check_error(t);
+}
+
+static bool efm32_clock_boost(target *t)
+{
+	return efm32_hfrco_boost(t, EFM32_CMU_HFRCOCTRL_BAND_28MHZ,
+				 EFM32_DI_HFRCO_CALIB_BAND_28);
+}
+
+/**
+ * Zero and Happy Gecko run at 24 and 25MHz at most
+ */
+static bool efm32_clock_boost_21(target *t)
+{
+	return efm32_hfrco_boost(t, EFM32_CMU_HFRCOCTRL_BAND_21MHZ,
+				 EFM32_DI_HFRCO_CALIB_BAND_21);
+}
+
+static void efm32_clock_restore(target *t)
+{
+	target_mem_write32(t, EFM32_CMU_HFRCOCTRL, t->clock_saved[0]);
+	target_mem_write32(t, EFM32_MSC_READCTRL, t->clock_saved[1]);
+}
+
+
 
 
+/* ERASEMAIN0 and ERASEMAIN1 each erase one 512k bank */
+#define EFM32_FLASH_BANK_SIZE	0x80000
 
 static void efm32_add_flash(target *t, target_addr addr, size_t length,
-			    size_t page_size)
+			    size_t page_size, bool wdouble)
 {
-	struct target_flash *f = calloc(1, sizeof(*f));
-	f->start = addr;
-	f->length = length;
-	f->blocksize = page_size;
-	f->erase = efm32_flash_erase;
-	f->write = target_flash_write_buffered;
-	f->done = target_flash_done_buffered;
-	f->write_buf = efm32_flash_write;
-	f->buf_size = page_size;
-	target_add_flash(t, f);
+	for (uint8_t bank = 0; (bank < 2) && length; bank++) {
+		struct efm32_flash *ef = target_alloc(sizeof(*ef));
+		struct target_flash *f = &ef->f;
+		f->start = addr;
+		f->length = MIN(length, EFM32_FLASH_BANK_SIZE);
+		f->blocksize = page_size;
+		f->erase = efm32_flash_erase;
+		f->write = target_flash_write_buffered;
+		f->done = efm32_flash_done;
+		f->write_buf = efm32_flash_write;
+		f->buf_size = page_size;
+		f->mass_erase = efm32_flash_mass_erase;
+		f->bank = bank;
+		ef->wdouble = wdouble;
+		target_add_flash(t, f);
+
+		addr += f->length;
+		length -= f->length;
+	}
 }
 
 char variant_string[40];
-bool efm32_probe(target *t)
+static bool efm32_probe(target *t)
 {
 	/* Read the IDCODE register from the SW-DP */
 	ADIv5_AP_t *ap = cortexm_ap(t);
@@ -267,6 +365,7 @@ bool efm32_probe(target *t)
 	uint8_t part_family = efm32_read_part_family(t);
 	uint16_t radio_number, radio_number_short;  /* optional, for ezr parts */
 	uint32_t flash_page_size; uint16_t flash_kb;
+	bool wdouble = false;
 
 	switch(part_family) {
 		case EFM32_DI_PART_FAMILY_GECKO:
@@ -278,6 +377,7 @@ bool efm32_probe(target *t)
 			sprintf(variant_string,
 				"EFM32 Giant Gecko");
 			flash_page_size = 2048; /* Could be 2048 or 4096, assume 2048 */
+			wdouble = true;
 			break;
 		case EFM32_DI_PART_FAMILY_TINY_GECKO:
 			sprintf(variant_string,
@@ -341,12 +441,20 @@ bool efm32_probe(target *t)
 	t->driver = variant_string;
 	tc_printf(t, "flash size %d page size %d\n", flash_size, flash_page_size);
 	target_add_ram (t, SRAM_BASE, ram_size);
-	efm32_add_flash(t, 0x00000000, flash_size, flash_page_size);
+	efm32_add_flash(t, 0x00000000, flash_size, flash_page_size, wdouble);
 	target_add_commands(t, efm32_cmd_list, "EFM32");
+	if ((part_family == EFM32_DI_PART_FAMILY_ZERO_GECKO) ||
+	    (part_family == EFM32_DI_PART_FAMILY_HAPPY_GECKO))
+		t->clock_boost = efm32_clock_boost_21;
+	else
+		t->clock_boost = efm32_clock_boost;
+	t->clock_restore = efm32_clock_restore;
 
 	return true;
 }
 
+CORTEXM_DRIVER(efm32_probe, JEP106_ENERGY_MICRO);
+
 /**
  * Erase flash row by row
  */
@@ -354,6 +462,9 @@ static int efm32_flash_erase(struct target_flash *f, target_addr addr, size_t le
 {
 	target *t = f->t;
 
+	if (cortexm_stub_sync(t))
+		return -1;
+
 	/* Set WREN bit to enabel MSC write and erase functionality */
 	target_mem_write32(t, EFM32_MSC_WRITECTRL, 1);
 
@@ -366,10 +477,8 @@ static int efm32_flash_erase(struct target_flash *f, target_addr addr, size_t le
 		target_mem_write32(t, EFM32_MSC_WRITECMD, EFM32_MSC_WRITECMD_ERASEPAGE );
 
 		/* Poll MSC Busy */
-		while ((target_mem_read32(t, EFM32_MSC_STATUS) & EFM32_MSC_STATUS_BUSY)) {
-			if (target_check_error(t))
-				return -1;
-		}
+		if (target_mem_poll32(t, EFM32_MSC_STATUS, EFM32_MSC_STATUS_BUSY, 0, 0))
+			return -1;
 
 		addr += f->blocksize;
 		len -= f->blocksize;
@@ -384,24 +493,30 @@ static int efm32_flash_erase(struct target_flash *f, target_addr addr, size_t le
 static int efm32_flash_write(struct target_flash *f,
 			     target_addr dest, const void *src, size_t len)
 {
-	(void)len;
-	target *t = f->t;
+	/* Write flashloader once, then the buffer, and run it */
+	if (((struct efm32_flash *)f)->wdouble)
+		return cortexm_stub_stream(f->t, efm32_flash_write_wdouble_stub,
+					   sizeof(efm32_flash_write_wdouble_stub),
+					   SRAM_BASE, STUB_BUFFER_BASE,
+					   STUB_BUFFER_SIZE,
+					   dest, src, len, f->blocksize);
+	return cortexm_stub_stream(f->t, efm32_flash_write_stub,
+				   sizeof(efm32_flash_write_stub),
+				   SRAM_BASE, STUB_BUFFER_BASE, STUB_BUFFER_SIZE,
+				   dest, src, len, 0);
+}
 
-	/* Write flashloader */
-	target_mem_write(t, SRAM_BASE, efm32_flash_write_stub,
-			 sizeof(efm32_flash_write_stub));
-	/* Write Buffer */
-	target_mem_write(t, STUB_BUFFER_BASE, src, len);
-	/* Run flashloader */
-	return cortexm_run_stub(t, SRAM_BASE, dest, STUB_BUFFER_BASE, len, 0);
+static int efm32_flash_done(struct target_flash *f)
+{
+	int ret = target_flash_done_buffered(f);
 
-	return 0;
+	return cortexm_stub_done(f->t) | ret;
 }
 
 /**
- * Uses the MSC ERASEMAIN0 command to erase the entire flash
+ * Uses the MSC ERASEMAIN0 or ERASEMAIN1 command to erase a whole bank
  */
-static bool efm32_cmd_erase_all(target *t)
+static bool efm32_erase_main(target *t, uint8_t bank)
 {
 	/* Set WREN bit to enabel MSC write and erase functionality */
 	target_mem_write32(t, EFM32_MSC_WRITECTRL, 1);
@@ -410,17 +525,33 @@ static bool efm32_cmd_erase_all(target *t)
 	target_mem_write32(t, EFM32_MSC_MASSLOCK, EFM32_MSC_MASSLOCK_LOCKKEY);
 
 	/* Erase operation */
-	target_mem_write32(t, EFM32_MSC_WRITECMD, EFM32_MSC_WRITECMD_ERASEMAIN0);
+	target_mem_write32(t, EFM32_MSC_WRITECMD, bank ?
+	                   EFM32_MSC_WRITECMD_ERASEMAIN1 :
+	                   EFM32_MSC_WRITECMD_ERASEMAIN0);
 
 	/* Poll MSC Busy */
-	while ((target_mem_read32(t, EFM32_MSC_STATUS) & EFM32_MSC_STATUS_BUSY)) {
-		if (target_check_error(t))
-			return false;
-	}
+	if (target_mem_poll32(t, EFM32_MSC_STATUS, EFM32_MSC_STATUS_BUSY, 0, 0))
+		return false;
 
 	/* Relock mass erase */
 	target_mem_write32(t, EFM32_MSC_MASSLOCK, 0);
 
+	return true;
+}
+
+static int efm32_flash_mass_erase(struct target_flash *f)
+{
+	if (cortexm_stub_sync(f->t) || !efm32_erase_main(f->t, f->bank))
+		return -1;
+	return 0;
+}
+
+static bool efm32_cmd_erase_all(target *t)
+{
+	for (struct target_flash *f = t->flash; f; f = f->next)
+		if (!efm32_erase_main(t, f->bank))
+			return false;
+
 	tc_printf(t, "Erase successful!\n");
 
 	return true;
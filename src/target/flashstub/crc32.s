@@ -0,0 +1,58 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* CRC-32 (polynomial 0x04C11DB7, MSB first) of a block of target memory,
+ * matching generic_crc32() on the probe.  Uses a 16 entry table, one
+ * lookup per nibble, and sticks to ARMv6-M instructions.
+ *
+ * r0: start address, r1: length, r2: initial CRC.
+ * The CRC is returned in r0.
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global crc32_stub
+	.thumb_func
+crc32_stub:
+	adr	r3, table
+	adds	r1, r0, r1
+1:	cmp	r0, r1
+	beq	2f
+	ldrb	r4, [r0]
+	adds	r0, #1
+	lsls	r4, r4, #24
+	eors	r2, r4
+	lsrs	r4, r2, #28
+	lsls	r4, r4, #2
+	ldr	r4, [r3, r4]
+	lsls	r2, r2, #4
+	eors	r2, r4
+	lsrs	r4, r2, #28
+	lsls	r4, r4, #2
+	ldr	r4, [r3, r4]
+	lsls	r2, r2, #4
+	eors	r2, r4
+	b	1b
+2:	mov	r0, r2
+	bkpt	#0
+
+	.align	2
+table:
+	.word	0x00000000, 0x04C11DB7, 0x09823B6E, 0x0D4326D9
+	.word	0x130476DC, 0x17C56B6B, 0x1A864DB2, 0x1E475005
+	.word	0x2608EDB8, 0x22C9F00F, 0x2F8AD6D6, 0x2B4BCB61
+	.word	0x350C9B64, 0x31CD86D3, 0x3C8EA00A, 0x384FBDBD
@@ -0,0 +1,62 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * Copyright (C) 2015  Richard Meadows
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* EFM32 MSC programming, a word at a time.
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global efm32_flash_write_stub
+	.thumb_func
+efm32_flash_write_stub:
+	.include "stub_ring.inc"
+
+	.thumb_func
+stub_program:
+	ldr	r4, msc
+	ldr	r5, lockkey		/* Unlock the MSC */
+	str	r5, [r4, #0x3c]
+	movs	r5, #1			/* WRITECTRL.WREN */
+	str	r5, [r4, #0x08]
+	adds	r2, r0, r2
+1:	str	r0, [r4, #0x10]		/* ADDRB */
+	movs	r5, #1			/* WRITECMD.LADDRIM */
+	str	r5, [r4, #0x0c]
+2:	ldr	r5, [r4, #0x1c]		/* Wait for STATUS.WDATAREADY */
+	lsls	r5, r5, #28
+	bpl	2b
+	ldr	r5, [r1]
+	adds	r1, #4
+	str	r5, [r4, #0x18]		/* WDATA */
+	movs	r5, #8			/* WRITECMD.WRITEONCE */
+	str	r5, [r4, #0x0c]
+3:	ldr	r5, [r4, #0x1c]		/* Wait while STATUS.BUSY */
+	lsls	r5, r5, #31
+	bmi	3b
+	adds	r0, #4
+	cmp	r0, r2
+	blo	1b
+	movs	r0, #0
+	bx	lr
+
+	.align	2
+msc:
+	.word	0x400c0000
+lockkey:
+	.word	0x00001b71
@@ -0,0 +1,100 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * Copyright (C) 2015  Richard Meadows
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* EFM32 MSC programming with WRITECTRL.WDOUBLE, two words per write.  Each
+ * page is one WRITETRIG sequence, the MSC moves on to the next double word
+ * as soon as it is written to WDATA.  Returns the LOCKED and INVADDR bits
+ * of MSC_STATUS.
+ *
+ * arg: flash page size
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global efm32_flash_write_wdouble_stub
+	.thumb_func
+efm32_flash_write_wdouble_stub:
+	.include "stub_ring.inc"
+
+	.thumb_func
+stub_program:
+	mov	r7, lr
+	ldr	r4, msc
+	ldr	r5, lockkey		/* Unlock the MSC */
+	str	r5, [r4, #0x3c]
+	movs	r5, #5			/* WRITECTRL.WREN | WDOUBLE */
+	str	r5, [r4, #0x08]
+	adds	r2, r0, r2
+	subs	r3, #1			/* r3: page offset mask */
+1:	str	r0, [r4, #0x10]		/* ADDRB */
+	movs	r5, #1			/* WRITECMD.LADDRIM */
+	str	r5, [r4, #0x0c]
+	ldr	r5, [r4, #0x1c]
+	movs	r6, #6
+	ands	r5, r6
+	bne	6f
+	bl	wdata
+	movs	r5, #0x10		/* WRITECMD.WRITETRIG */
+	str	r5, [r4, #0x0c]
+	b	3f
+2:	bl	wdata
+3:	adds	r0, #8
+	cmp	r0, r2
+	bhs	4f
+	tst	r0, r3
+	bne	2b
+	bl	busy
+	b	1b
+4:	bl	busy
+	movs	r5, #1			/* Back to single words */
+	str	r5, [r4, #0x08]
+	movs	r0, #0
+	bx	r7
+6:	movs	r0, r5
+	bx	r7
+
+/* Write the double word at r1 to WDATA, a word at a time */
+	.thumb_func
+wdata:
+	ldr	r5, [r4, #0x1c]		/* Wait for STATUS.WDATAREADY */
+	lsls	r5, r5, #28
+	bpl	wdata
+	ldr	r5, [r1]
+	str	r5, [r4, #0x18]
+1:	ldr	r5, [r4, #0x1c]
+	lsls	r5, r5, #28
+	bpl	1b
+	ldr	r5, [r1, #4]
+	str	r5, [r4, #0x18]
+	adds	r1, #8
+	bx	lr
+
+/* Wait while STATUS.BUSY, the sequence ends once WDATA isn't refilled */
+	.thumb_func
+busy:
+	ldr	r5, [r4, #0x1c]
+	lsls	r5, r5, #31
+	bmi	busy
+	bx	lr
+
+	.align	2
+msc:
+	.word	0x400c0000
+lockkey:
+	.word	0x00001b71
@@ -0,0 +1,61 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Kinetis FTFA/FTFL programming, a Program Longword command at a time.
+ * Returns FSTAT if ACCERR or FPVIOL is set.
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global kinetis_flash_write_stub
+	.thumb_func
+kinetis_flash_write_stub:
+	.include "stub_ring.inc"
+
+	.thumb_func
+stub_program:
+	ldr	r4, ftfa
+	movs	r7, #0x30		/* FSTAT.ACCERR | FSTAT.FPVIOL */
+1:	strb	r7, [r4]		/* Clear errors from the last command */
+2:	ldrb	r5, [r4]		/* Wait for FSTAT.CCIF */
+	lsls	r5, r5, #24
+	bpl	2b
+	movs	r5, #0x06		/* FCCOB0 Program Longword, FCCOB1-3 dest */
+	lsls	r5, r5, #24
+	orrs	r5, r0
+	str	r5, [r4, #0x04]
+	ldr	r5, [r1]		/* FCCOB4-7 data */
+	str	r5, [r4, #0x08]
+	movs	r5, #0x80		/* Launch by clearing FSTAT.CCIF */
+	strb	r5, [r4]
+3:	ldrb	r5, [r4]		/* Wait for FSTAT.CCIF */
+	lsls	r6, r5, #24
+	bpl	3b
+	tst	r5, r7
+	bne	4f
+	adds	r0, #4
+	adds	r1, #4
+	subs	r2, #4
+	bhi	1b
+	movs	r0, #0
+	bx	lr
+4:	movs	r0, r5
+	bx	lr
+
+	.align	2
+ftfa:
+	.word	0x40020000
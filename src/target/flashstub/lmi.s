@@ -17,25 +17,38 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
-#include "libopencm3/stm32/flash.h"
-#include "stub.h"
 
-#define SR_ERROR_MASK 0xF2
-
-void __attribute__((naked))
-stm32f4_flash_write_x32_stub(uint32_t *dest, uint32_t *src, uint32_t size)
-{
-	for (int i = 0; i < size; i += 4) {
-		FLASH_CR = FLASH_CR_PROGRAM_X32 | FLASH_CR_PG;
-		*dest++ = *src++;
-		__asm("dsb");
-		while (FLASH_SR & FLASH_SR_BSY)
-			;
-	}
-
-	if (FLASH_SR & SR_ERROR_MASK)
-		stub_exit(1);
+/* Stellaris/Tiva flash programming, a word at a time.
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global lmi_flash_write_stub
+	.thumb_func
+lmi_flash_write_stub:
+	.include "stub_ring.inc"
 
-	stub_exit(0);
-}
+	.thumb_func
+stub_program:
+	ldr	r4, flash
+	ldr	r5, fmc			/* FMC_WRKEY | FMC_WRITE */
+	adds	r2, r0, r2
+1:	str	r0, [r4, #0x00]		/* FMA */
+	ldr	r6, [r1]
+	adds	r1, #4
+	str	r6, [r4, #0x04]		/* FMD */
+	str	r5, [r4, #0x08]
+2:	ldr	r6, [r4, #0x08]		/* Wait while FMC_WRITE */
+	lsls	r6, r6, #31
+	bmi	2b
+	adds	r0, #4
+	cmp	r0, r2
+	blo	1b
+	movs	r0, #0
+	bx	lr
 
+	.align	2
+flash:
+	.word	0x400fd000
+fmc:
+	.word	0xa4420001
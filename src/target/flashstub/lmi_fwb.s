@@ -0,0 +1,67 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Tiva flash programming through the 32-word write buffer, a row at a
+ * time.  Words written to FWBn are marked valid in FWBVAL, so partial
+ * rows only program the words given.
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global lmi_fwb_write_stub
+	.thumb_func
+lmi_fwb_write_stub:
+	.include "stub_ring.inc"
+
+	.thumb_func
+stub_program:
+	ldr	r4, flash
+	ldr	r5, fwb
+	adds	r2, r0, r2
+1:	movs	r6, #0x7f
+	mov	r3, r0
+	bics	r3, r6
+	str	r3, [r4, #0x00]		/* FMA, the row */
+	adds	r3, #0x80		/* End of the row, or of the data */
+	cmp	r3, r2
+	bls	2f
+	mov	r3, r2
+2:	movs	r7, #0x7f
+	ands	r7, r0
+	ldr	r6, [r1]
+	adds	r1, #4
+	str	r6, [r5, r7]		/* FWBn */
+	adds	r0, #4
+	cmp	r0, r3
+	blo	2b
+	ldr	r6, fmc2		/* FMC_WRKEY | FMC2_WRBUF */
+	str	r6, [r4, #0x20]
+3:	ldr	r6, [r4, #0x20]		/* Wait while FMC2_WRBUF */
+	lsls	r6, r6, #31
+	bmi	3b
+	cmp	r0, r2
+	blo	1b
+	movs	r0, #0
+	bx	lr
+
+	.align	2
+flash:
+	.word	0x400fd000
+fwb:
+	.word	0x400fd100
+fmc2:
+	.word	0xa4420001
@@ -0,0 +1,88 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* LPC43xx SPIFI serial flash programming, a page at a time.  The SPIFI is
+ * taken out of memory mode for each run and put back in it afterwards, so
+ * the flash stays readable while the stub waits for data.
+ *
+ * arg: SPIFI page program command without DATALEN, then the memory mode
+ * command to restore
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global lpc43xx_spifi_write_stub
+	.thumb_func
+lpc43xx_spifi_write_stub:
+	.include "stub_ring.inc"
+
+	.thumb_func
+stub_program:
+	ldr	r4, spifi
+	adds	r2, r0, r2
+	movs	r5, #0x10		/* STAT.RESET ends memory mode */
+	str	r5, [r4, #0x1c]
+1:	ldr	r5, [r4, #0x1c]
+	lsls	r5, r5, #27
+	bmi	1b
+2:	ldr	r6, cmd_wren
+	str	r6, [r4, #0x04]
+3:	ldr	r5, [r4, #0x1c]		/* Wait while STAT.CMD */
+	lsls	r5, r5, #30
+	bmi	3b
+	movs	r5, #0xff		/* Bytes to the end of the page */
+	ands	r5, r0
+	movs	r6, #1
+	lsls	r6, r6, #8
+	subs	r5, r6, r5
+	subs	r6, r2, r0
+	cmp	r5, r6
+	bls	4f
+	movs	r5, r6
+4:	str	r0, [r4, #0x08]
+	ldr	r6, [r3]
+	orrs	r6, r5
+	str	r6, [r4, #0x04]
+5:	ldrb	r6, [r1]
+	adds	r1, #1
+	strb	r6, [r4, #0x14]
+	adds	r0, #1
+	subs	r5, #1
+	bne	5b
+6:	ldr	r5, [r4, #0x1c]
+	lsls	r5, r5, #30
+	bmi	6b
+	ldr	r6, cmd_poll		/* Poll the status for WIP clear */
+	str	r6, [r4, #0x04]
+7:	ldr	r5, [r4, #0x1c]
+	lsls	r5, r5, #30
+	bmi	7b
+	ldrb	r6, [r4, #0x14]
+	cmp	r0, r2
+	blo	2b
+	ldr	r6, [r3, #4]		/* Back to memory mode */
+	str	r6, [r4, #0x18]
+	movs	r0, #0
+	bx	lr
+
+	.align	2
+spifi:
+	.word	0x40003000
+cmd_wren:
+	.word	0x06200000
+cmd_poll:
+	.word	0x05204000
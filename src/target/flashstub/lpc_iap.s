@@ -0,0 +1,46 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* LPC IAP trampoline.  Calls the boot ROM once for each command frame in a
+ * list, stopping at the first that fails.  A frame is the IAP command and
+ * its 4 parameters followed by the 5 word result table.  Sticks to ARMv6-M
+ * instructions.
+ *
+ * r0: first frame, r1: number of frames, r2: IAP entry point, r3: stack
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global lpc_iap_stub
+	.thumb_func
+lpc_iap_stub:
+	mov	sp, r3
+	movs	r4, r0
+	movs	r5, r1
+	movs	r6, r2
+1:	movs	r0, r4
+	movs	r1, r4
+	adds	r1, #20
+	blx	r6
+	ldr	r0, [r4, #20]
+	cmp	r0, #0
+	bne	2f
+	adds	r4, #40
+	subs	r5, #1
+	bne	1b
+	bkpt	#0
+2:	bkpt	#1
@@ -0,0 +1,44 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* Fill a block of target memory with a repeated pattern, one byte at a
+ * time so any alignment and pattern length works.  Sticks to ARMv6-M
+ * instructions.
+ *
+ * r0: start address, r1: length, r2: pattern, r3: pattern length.
+ * Returns the end address in r0.
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global memfill_stub
+	.thumb_func
+memfill_stub:
+	adds	r1, r0, r1
+	movs	r4, #0
+1:	cmp	r0, r1
+	beq	3f
+	ldrb	r5, [r2, r4]
+	strb	r5, [r0]
+	adds	r0, #1
+	adds	r4, #1
+	cmp	r4, r3
+	bne	1b
+	movs	r4, #0
+	b	1b
+3:	bkpt	#0
@@ -0,0 +1,53 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+/* Find the first copy of a pattern in a block of target memory, one byte
+ * at a time so any alignment works.  Sticks to ARMv6-M instructions.
+ *
+ * r0: start address, r1: length, r2: pattern, r3: pattern length.
+ * The length must be at least the pattern length, which is at least one.
+ * Returns the address of the match in r0, or one past the last address
+ * a match could start at.
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global memsearch_stub
+	.thumb_func
+memsearch_stub:
+	subs	r1, r1, r3
+	adds	r1, r0, r1
+	ldrb	r4, [r2]
+1:	cmp	r0, r1
+	bhi	3f
+	ldrb	r5, [r0]
+	adds	r0, #1
+	cmp	r5, r4
+	bne	1b
+	movs	r6, #1
+2:	cmp	r6, r3
+	beq	4f
+	subs	r7, r0, #1
+	ldrb	r5, [r7, r6]
+	ldrb	r7, [r2, r6]
+	adds	r6, #1
+	cmp	r5, r7
+	beq	2b
+	b	1b
+4:	subs	r0, #1
+3:	bkpt	#0
@@ -17,21 +17,34 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
-#include <stdint.h>
-#include "stub.h"
 
-/* Non-Volatile Memory Controller (NVMC) Registers */
-#define NVMC           ((volatile uint32_t *)0x4001E000)
-#define NVMC_READY     NVMC[0x100]
+/* nRF51/nRF52 NVMC programming, a word at a time.  CONFIG.WEN must
+ * already be set.
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global nrf51_flash_write_stub
+	.thumb_func
+nrf51_flash_write_stub:
+	.include "stub_ring.inc"
 
-void __attribute__((naked))
-nrf51_flash_write_stub(volatile uint32_t *dest, uint32_t *src, uint32_t size)
-{
-	for (int i; i < size; i += 4) {
-		*dest++ = *src++;
-		while (!(NVMC_READY & 1))
-			;
-	}
+	.thumb_func
+stub_program:
+	ldr	r4, ready
+	adds	r2, r0, r2
+1:	ldr	r6, [r1]
+	adds	r1, #4
+	str	r6, [r0]
+	adds	r0, #4
+2:	ldr	r6, [r4]		/* Wait for READY */
+	lsls	r6, r6, #31
+	bpl	2b
+	cmp	r0, r2
+	blo	1b
+	movs	r0, #0
+	bx	lr
 
-	stub_exit(0);
-}
+	.align	2
+ready:
+	.word	0x4001e400
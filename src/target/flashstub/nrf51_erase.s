@@ -0,0 +1,45 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* nRF51/nRF52 NVMC page erase of a range of code flash.  CONFIG.EEN must
+ * already be set.  Sticks to ARMv6-M instructions.
+ *
+ * r0: first page, r2: length, whole pages, r3: page size
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global nrf51_flash_erase_stub
+	.thumb_func
+nrf51_flash_erase_stub:
+	ldr	r4, ready
+	ldr	r5, erasepage
+	adds	r2, r0, r2
+1:	str	r0, [r5]
+2:	ldr	r6, [r4]		/* Wait for READY */
+	lsls	r6, r6, #31
+	bpl	2b
+	adds	r0, r0, r3
+	cmp	r0, r2
+	blo	1b
+	bkpt	#0
+
+	.align	2
+ready:
+	.word	0x4001E400
+erasepage:
+	.word	0x4001E508
@@ -0,0 +1,69 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* SAM3/SAM4 EEFC page programming.  Each page is copied into the latch
+ * buffer once the previous write is done, and its write command issued as
+ * soon as the page is complete.  The last write is left running.  Returns
+ * the FCMDE and FLOCKE bits of EEFC_FSR.
+ *
+ * arg: EEFC base, FCR key and write command, flash start, page size shift
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global sam3x_flash_write_stub
+	.thumb_func
+sam3x_flash_write_stub:
+	.include "stub_ring.inc"
+
+	.thumb_func
+stub_program:
+	ldr	r4, [r3, #0]
+	adds	r2, r0, r2
+1:	ldr	r5, [r3, #12]
+	movs	r6, #1
+	lsls	r6, r5
+	subs	r6, #1			/* r6: page offset mask */
+	tst	r0, r6
+	bne	3f
+2:	ldr	r7, [r4, #0x08]		/* Wait for EEFC_FSR.FRDY */
+	lsrs	r7, r7, #1
+	bcc	2b
+	movs	r5, #3
+	ands	r7, r5
+	bne	5f
+	ldr	r5, [r3, #12]
+3:	ldr	r7, [r1]
+	adds	r1, #4
+	str	r7, [r0]
+	adds	r0, #4
+	tst	r0, r6
+	bne	4f
+	ldr	r7, [r3, #8]		/* Write the page just filled */
+	subs	r7, r0, r7
+	lsrs	r7, r5
+	subs	r7, #1
+	lsls	r7, r7, #8
+	ldr	r6, [r3, #4]
+	orrs	r7, r6
+	str	r7, [r4, #0x04]
+4:	cmp	r0, r2
+	blo	1b
+	movs	r0, #0
+	bx	lr
+5:	lsls	r0, r7, #1
+	bx	lr
@@ -0,0 +1,96 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* SAMD NVMCTRL page programming.  CTRLB.MANW is cleared for the call, so
+ * writing the last word of a page into the page buffer writes the page.
+ * Each lock region is unlocked once and locked again when left.  Sticks
+ * to ARMv6-M instructions.
+ *
+ * r0: destination, r1: source, r2: length, whole 64 byte pages
+ * r3: lock region size, a power of 2
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global samd_flash_write_stub
+	.thumb_func
+samd_flash_write_stub:
+	ldr	r4, nvmc
+	ldr	r5, [r4, #0x04]		/* Save CTRLB, clear MANW */
+	mov	r12, r5
+	movs	r6, #0x80
+	bics	r5, r6
+	str	r5, [r4, #0x04]
+	movs	r6, #0x1c		/* Clear STATUS.PROGE/LOCKE/NVME */
+	strh	r6, [r4, #0x18]
+	adds	r2, r0, r2
+	subs	r3, #1
+	bl	unlock
+1:	movs	r6, #64
+	adds	r6, r0, r6
+2:	ldr	r7, [r1]
+	adds	r1, #4
+	str	r7, [r0]
+	adds	r0, #4
+	cmp	r0, r6
+	bne	2b
+	bl	ready
+	ldrh	r6, [r4, #0x18]
+	movs	r7, #0x1c
+	tst	r6, r7
+	bne	4f
+	cmp	r0, r2
+	beq	3f
+	tst	r0, r3
+	bne	1b
+	ldr	r6, cmd_lock		/* Next lock region */
+	strh	r6, [r4]
+	bl	ready
+	bl	unlock
+	b	1b
+3:	ldr	r6, cmd_lock
+	strh	r6, [r4]
+	bl	ready
+	mov	r5, r12
+	str	r5, [r4, #0x04]
+	bkpt	#0
+4:	mov	r5, r12
+	str	r5, [r4, #0x04]
+	bkpt	#1
+
+/* Unlock the region of the page at r0 */
+	.thumb_func
+unlock:
+	lsrs	r6, r0, #1		/* ADDR is in halfwords */
+	str	r6, [r4, #0x1c]
+	ldr	r6, cmd_unlock
+	strh	r6, [r4]
+/* Wait for INTFLAG.READY */
+	.thumb_func
+ready:
+	ldr	r6, [r4, #0x14]
+	lsls	r6, r6, #31
+	bpl	ready
+	bx	lr
+
+	.align	2
+nvmc:
+	.word	0x41004000
+cmd_lock:
+	.word	0x0000A540
+cmd_unlock:
+	.word	0x0000A541
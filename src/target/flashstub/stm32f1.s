@@ -0,0 +1,60 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * Copyright (C) 2015  Black Sphere Technologies Ltd.
+ * Written by Gareth McMullin <gareth@blacksphere.co.nz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* STM32F1 FPEC programming, a halfword at a time.  r3 is the start of
+ * the second bank, whose registers are 0x40 on, or -1 with one bank.
+ * Stops at the first error, returning the PGERR and WRPRTERR bits of
+ * FLASH_SR.
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global stm32f1_flash_write_stub
+	.thumb_func
+stm32f1_flash_write_stub:
+	.include "stub_ring.inc"
+
+	.thumb_func
+stub_program:
+	adds	r2, r0, r2
+1:	ldr	r4, fpec
+	cmp	r0, r3
+	blo	2f
+	adds	r4, #0x40		/* Second bank */
+2:	movs	r5, #1			/* FLASH_CR_PG */
+	str	r5, [r4, #0x10]
+	ldrh	r6, [r1]
+	adds	r1, #2
+	strh	r6, [r0]
+	adds	r0, #2
+3:	ldr	r6, [r4, #0x0c]		/* Wait while FLASH_SR.BSY */
+	lsls	r7, r6, #31
+	bmi	3b
+	movs	r7, #0x14
+	ands	r7, r6
+	bne	4f
+	cmp	r0, r2
+	blo	1b
+4:	movs	r0, r7
+	bx	lr
+
+	.align	2
+fpec:
+	.word	0x40022000
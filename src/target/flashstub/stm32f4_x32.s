@@ -17,33 +17,40 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
-#include <stdint.h>
-#include "stub.h"
 
-#define LMI_FLASH_BASE       ((volatile uint32_t *)0x400FD000)
-#define LMI_FLASH_FMA        LMI_FLASH_BASE[0]
-#define LMI_FLASH_FMD        LMI_FLASH_BASE[1]
-#define LMI_FLASH_FMC        LMI_FLASH_BASE[2]
-
-#define LMI_FLASH_FMC_WRITE  (1 << 0)
-#define LMI_FLASH_FMC_ERASE  (1 << 1)
-#define LMI_FLASH_FMC_MERASE (1 << 2)
-#define LMI_FLASH_FMC_COMT   (1 << 3)
-#define LMI_FLASH_FMC_WRKEY  0xA4420000
-
-void __attribute__((naked))
-stm32f1_flash_write_stub(uint32_t *dest, uint32_t *src, uint32_t size)
-{
-	size /= 4;
-	for (int i; i < size; i++) {
-		LMI_FLASH_FMA = (uint32_t)&dest[i];
-		LMI_FLASH_FMD = src[i];
-		LMI_FLASH_FMC = LMI_FLASH_FMC_WRKEY | LMI_FLASH_FMC_WRITE;
-		while (LMI_FLASH_FMC & LMI_FLASH_FMC_WRITE)
-			;
-	}
-
-	stub_exit(0);
-}
+/* STM32F4 FPEC programming, a word at a time.  Returns the error bits
+ * of FLASH_SR.
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global stm32f4_flash_write_x32_stub
+	.thumb_func
+stm32f4_flash_write_x32_stub:
+	.include "stub_ring.inc"
 
+	.thumb_func
+stub_program:
+	ldr	r4, fpec
+	ldr	r5, cr			/* FLASH_CR_PG and PSIZE */
+	adds	r2, r0, r2
+1:	str	r5, [r4, #0x10]
+	ldr	r6, [r1]
+	adds	r1, #4
+	str	r6, [r0]
+	adds	r0, #4
+	dsb
+2:	ldr	r6, [r4, #0x0c]		/* Wait while FLASH_SR.BSY */
+	lsls	r7, r6, #15
+	bmi	2b
+	cmp	r0, r2
+	blo	1b
+	movs	r0, #0xf2
+	ands	r0, r6
+	bx	lr
 
+	.align	2
+fpec:
+	.word	0x40023c00
+cr:
+	.word	0x00000201
@@ -0,0 +1,57 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* STM32F4 FPEC programming, a double word at a time, for PSIZE x64.
+ * This needs an external VPP on the target.  Returns the error bits
+ * of FLASH_SR.
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global stm32f4_flash_write_x64_stub
+	.thumb_func
+stm32f4_flash_write_x64_stub:
+	.include "stub_ring.inc"
+
+	.thumb_func
+stub_program:
+	ldr	r4, fpec
+	ldr	r5, cr			/* FLASH_CR_PG and PSIZE */
+	adds	r2, r0, r2
+1:	str	r5, [r4, #0x10]
+	ldr	r6, [r1]
+	ldr	r7, [r1, #4]
+	adds	r1, #8
+	str	r6, [r0]		/* Both halves, in order */
+	isb
+	str	r7, [r0, #4]
+	adds	r0, #8
+	dsb
+2:	ldr	r6, [r4, #0x0c]		/* Wait while FLASH_SR.BSY */
+	lsls	r7, r6, #15
+	bmi	2b
+	cmp	r0, r2
+	blo	1b
+	movs	r0, #0xf2
+	ands	r0, r6
+	bx	lr
+
+	.align	2
+fpec:
+	.word	0x40023c00
+cr:
+	.word	0x00000301
@@ -17,28 +17,40 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
-#include "libopencm3/stm32/flash.h"
-#include "stub.h"
 
-#define SR_ERROR_MASK 0xF2
-
-void __attribute__((naked))
-stm32f4_flash_write_x8_stub(uint32_t *dest, uint32_t *src, uint32_t size)
-{
-	uint8_t *b_dest, *b_src;
-	b_dest = (void *)dest;
-	b_src = (void *)src;
-	for (int i = 0; i < size; i += 1) {
-		FLASH_CR = FLASH_CR_PROGRAM_X8 | FLASH_CR_PG;
-		*b_dest++ = *b_src++;
-		__asm("dsb");
-		while (FLASH_SR & FLASH_SR_BSY)
-			;
-	}
-
-	if (FLASH_SR & SR_ERROR_MASK)
-		stub_exit(1);
+/* STM32F4 FPEC programming, a byte at a time.  Returns the error bits
+ * of FLASH_SR.
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global stm32f4_flash_write_x8_stub
+	.thumb_func
+stm32f4_flash_write_x8_stub:
+	.include "stub_ring.inc"
 
-	stub_exit(0);
-}
+	.thumb_func
+stub_program:
+	ldr	r4, fpec
+	ldr	r5, cr			/* FLASH_CR_PG and PSIZE */
+	adds	r2, r0, r2
+1:	str	r5, [r4, #0x10]
+	ldrb	r6, [r1]
+	adds	r1, #1
+	strb	r6, [r0]
+	adds	r0, #1
+	dsb
+2:	ldr	r6, [r4, #0x0c]		/* Wait while FLASH_SR.BSY */
+	lsls	r7, r6, #15
+	bmi	2b
+	cmp	r0, r2
+	blo	1b
+	movs	r0, #0xf2
+	ands	r0, r6
+	bx	lr
 
+	.align	2
+fpec:
+	.word	0x40023c00
+cr:
+	.word	0x00000001
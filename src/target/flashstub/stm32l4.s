@@ -0,0 +1,74 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * Copyright (C) 2015  Black Sphere Technologies Ltd.
+ * Written by Gareth McMullin <gareth@blacksphere.co.nz>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* STM32L4 programming, a doubleword at a time.  The destination and
+ * length must be doubleword aligned.
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global stm32l4_flash_write_stub
+	.thumb_func
+stm32l4_flash_write_stub:
+	.include "stub_ring.inc"
+
+	.thumb_func
+stub_program:
+	movs	r4, #7
+	mov	r5, r0
+	orrs	r5, r2
+	tst	r5, r4
+	bne	3f
+	ldr	r4, sr
+	ldr	r5, cr			/* FLASH_CR_PG, EOPIE and ERRIE */
+	adds	r2, r0, r2
+1:	str	r5, [r4, #0x04]
+	ldr	r6, [r1]
+	ldr	r7, [r1, #4]
+	adds	r1, #8
+	str	r6, [r0]
+	str	r7, [r0, #4]
+	adds	r0, #8
+	dsb
+2:	ldr	r6, [r4]		/* Wait while FLASH_SR.BSY */
+	lsls	r7, r6, #15
+	bmi	2b
+	ldr	r7, errors
+	tst	r6, r7
+	bne	3f
+	lsls	r7, r6, #31		/* FLASH_SR.EOP */
+	bpl	3f
+	movs	r7, #1
+	str	r7, [r4]
+	cmp	r0, r2
+	blo	1b
+	movs	r0, #0
+	str	r0, [r4, #0x04]
+	bx	lr
+3:	movs	r0, #1
+	bx	lr
+
+	.align	2
+sr:
+	.word	0x40022010
+cr:
+	.word	0x03000001
+errors:
+	.word	0x0000c3fa
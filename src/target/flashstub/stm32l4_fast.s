@@ -0,0 +1,68 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* STM32L4 fast programming, one 32 doubleword row at a time.  Only
+ * allowed on a bank that has been mass erased.  The words of a row
+ * must follow each other without a break, so it must run on the target.
+ *
+ * r0: destination, r1: source, r2: length, whole 256 byte rows
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global stm32l4_fast_write_stub
+	.thumb_func
+stm32l4_fast_write_stub:
+	ldr	r3, flash_sr
+	ldr	r4, cr_fstpg
+	adds	r2, r0, r2
+1:	cmp	r0, r2
+	beq	4f
+	str	r4, [r3, #0x04]		/* CR = FSTPG */
+	movs	r6, #1
+	lsls	r6, r6, #8
+	adds	r6, r0, r6
+2:	ldr	r7, [r1]
+	adds	r1, #4
+	str	r7, [r0]
+	adds	r0, #4
+	cmp	r0, r6
+	bne	2b
+	dsb
+3:	ldr	r6, [r3]		/* Wait while SR.BSY */
+	lsls	r7, r6, #15
+	bmi	3b
+	ldr	r7, errors
+	tst	r6, r7
+	bne	5f
+	movs	r7, #1			/* Clear SR.EOP */
+	str	r7, [r3]
+	b	1b
+4:	movs	r7, #0
+	str	r7, [r3, #0x04]
+	bkpt	#0
+5:	movs	r7, #0
+	str	r7, [r3, #0x04]
+	bkpt	#1
+
+	.align	2
+flash_sr:
+	.word	0x40022010
+cr_fstpg:
+	.word	0x00040000
+errors:
+	.word	0x0000C3FA
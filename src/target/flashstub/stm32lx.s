@@ -0,0 +1,61 @@
+/*
+ * This file is part of the Black Magic Debug project.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* STM32L0/L1 program flash, one half-page at a time.  PECR must already
+ * be unlocked.  Sticks to ARMv6-M instructions.
+ *
+ * r0: destination, r1: source, r2: length, a multiple of the half-page
+ * r3: NVM register base plus the half-page size in bytes
+ */
+	.syntax unified
+	.thumb
+	.text
+	.global stm32lx_flash_write_stub
+	.thumb_func
+stm32lx_flash_write_stub:
+	lsls	r4, r3, #22
+	lsrs	r4, r4, #22		/* r4: half-page size */
+	subs	r3, r3, r4		/* r3: NVM base */
+	adds	r2, r0, r2
+	ldr	r5, pecr
+1:	cmp	r0, r2
+	beq	4f
+2:	ldr	r6, [r3, #0x18]		/* Wait while SR.BSY */
+	lsls	r6, r6, #31
+	bmi	2b
+	str	r5, [r3, #0x04]		/* PECR = FPRG | PROG */
+	adds	r6, r0, r4
+3:	ldr	r7, [r1]
+	adds	r1, #4
+	str	r7, [r0]
+	adds	r0, #4
+	cmp	r0, r6
+	bne	3b
+5:	ldr	r6, [r3, #0x18]
+	lsls	r7, r6, #31
+	bmi	5b
+	ldr	r7, errors
+	tst	r6, r7
+	beq	1b
+	bkpt	#1
+4:	bkpt	#0
+
+	.align	2
+pecr:
+	.word	0x00000408
+errors:
+	.word	0x00010700
@@ -20,11 +20,22 @@
 #ifndef __STUB_H
 #define __STUB_H
 
-static inline void __attribute__((always_inline))
-stub_exit(const int code)
-{
-	asm("bkpt %0"::"i"(code));
-}
+#include <stdint.h>
+
+/* Header of the ring buffer the streaming flash stubs built on
+ * stub_ring.inc take their data from, followed by the data itself.  The
+ * probe appends data and advances wp, the stub programs it and advances
+ * rp.  Both count bytes since the stub started, so the ring is empty when
+ * they are equal.  The probe sets stop to have the stub exit once the
+ * ring is empty, and the stub stores any error in status.
+ */
+struct stub_ring {
+	uint32_t wp;
+	uint32_t rp;
+	uint32_t status;
+	uint32_t stop;
+	uint8_t data[];
+};
 
 #endif
 
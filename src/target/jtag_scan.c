@@ -73,6 +73,27 @@ static const struct jtag_dev_descr_s {
 /* bucket of ones for don't care TDI */
 static const uint8_t ones[] = "\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF";
 
+/* Bits shifted in bulk to scan out the IRs of a maximal chain */
+#define JTAG_SCAN_IR_BITS	((JTAG_MAX_DEVS + 1) * JTAG_MAX_IR_LEN + 1)
+/* ... and the IDCODEs, one bit for devices without */
+#define JTAG_SCAN_DR_BITS	(JTAG_MAX_DEVS * 32)
+
+/* Shift ones through the current shift register and capture what comes
+ * out, so the chain is scanned with a single sequence.  The buffer has
+ * a spare byte as some taps write one past the last bit. */
+static void jtag_scan_shift(uint8_t *out, int ticks)
+{
+	uint8_t in[(ticks + 7) / 8];
+	memset(in, 0xff, sizeof(in));
+	memset(out, 0, sizeof(in) + 1);
+	jtagtap_tdi_tdo_seq(out, 0, in, ticks);
+}
+
+static inline bool jtag_scan_bit(const uint8_t *buf, unsigned n)
+{
+	return buf[n / 8] & (1 << (n % 8));
+}
+
 /* Scan JTAG chain for devices, store IR length and IDCODE (if present).
  * Reset TAP state machine.
  * Select Shift-IR state.
@@ -89,6 +110,9 @@ static const uint8_t ones[] = "\xFF\xFF\xFF\xFF\xFF\xFF\xFF\xFF";
  * For each device, shift out one bit. If this is zero IDCODE isn't present,
  *	continue to next device. If this is one shift out the remaining 31 bits
  *	of the IDCODE register.
+ *
+ * Each of these scans is shifted as one sequence and decoded afterwards,
+ * rather than a bit at a time.
  */
 int jtag_scan(const uint8_t *irlens)
 {
@@ -134,15 +158,18 @@ int jtag_scan(const uint8_t *irlens)
 		jtagtap_shift_ir();
 
 		DEBUG("Scanning out IRs\n");
-		if(!jtagtap_next(0, 1)) {
+		uint8_t irout[JTAG_SCAN_IR_BITS / 8 + 2];
+		jtag_scan_shift(irout, JTAG_SCAN_IR_BITS);
+		if(!jtag_scan_bit(irout, 0)) {
 			DEBUG("jtag_scan: Sanity check failed: IR[0] shifted out as 0\n");
 			jtag_dev_count = -1;
 			return -1; /* must be 1 */
 		}
 		jtag_devs[0].ir_len = 1; j = 1;
 		while((jtag_dev_count <= JTAG_MAX_DEVS) &&
-		      (jtag_devs[jtag_dev_count].ir_len <= JTAG_MAX_IR_LEN)) {
-			if(jtagtap_next(0, 1)) {
+		      (jtag_devs[jtag_dev_count].ir_len <= JTAG_MAX_IR_LEN) &&
+		      (j < JTAG_SCAN_IR_BITS)) {
+			if(jtag_scan_bit(irout, j)) {
 				if(jtag_devs[jtag_dev_count].ir_len == 1) break;
 				jtag_devs[++jtag_dev_count].ir_len = 1;
 				jtag_devs[jtag_dev_count].ir_prescan = j;
@@ -171,7 +198,9 @@ int jtag_scan(const uint8_t *irlens)
 	/* Count device on chain */
 	DEBUG("Change state to Shift-DR\n");
 	jtagtap_shift_dr();
-	for(i = 0; (jtagtap_next(0, 1) == 0) && (i <= jtag_dev_count); i++)
+	uint8_t bypass[(JTAG_MAX_DEVS + 1) / 8 + 2];
+	jtag_scan_shift(bypass, jtag_dev_count + 1);
+	for(i = 0; !jtag_scan_bit(bypass, i) && (i <= jtag_dev_count); i++)
 		jtag_devs[i].dr_postscan = jtag_dev_count - i - 1;
 
 	if(i != jtag_dev_count) {
@@ -196,11 +225,14 @@ int jtag_scan(const uint8_t *irlens)
 	/* Reset jtagtap: should take all devs to IDCODE */
 	jtagtap_reset();
 	jtagtap_shift_dr();
+	uint8_t idcodes[JTAG_SCAN_DR_BITS / 8 + 1];
+	unsigned bit = 0;
+	jtag_scan_shift(idcodes, jtag_dev_count * 32);
 	for(i = 0; i < jtag_dev_count; i++) {
-		if(!jtagtap_next(0, 1)) continue;
+		if(!jtag_scan_bit(idcodes, bit++)) continue;
 		jtag_devs[i].idcode = 1;
 		for(j = 2; j; j <<= 1)
-			if(jtagtap_next(0, 1)) jtag_devs[i].idcode |= j;
+			if(jtag_scan_bit(idcodes, bit++)) jtag_devs[i].idcode |= j;
 
 	}
 	DEBUG("Return to Run-Test/Idle\n");
@@ -224,29 +256,80 @@ int jtag_scan(const uint8_t *irlens)
 	return jtag_dev_count;
 }
 
-void jtag_dev_write_ir(jtag_dev_t *d, uint32_t ir)
+/* Most bits shifted through a chain at once, the IRs of a maximal chain
+ * and a DR scan of up to 64 bits */
+#define JTAG_DEV_SHIFT_BITS	(JTAG_MAX_DEVS * JTAG_MAX_IR_LEN + 64)
+
+/* Shift ticks bits of din through the device, with the others in the
+ * chain in bypass.  The bits for the devices before and after go in the
+ * same sequence as the payload, so the TAP sees a single shift.  Returns
+ * -1 without shifting if the whole sequence is too long. */
+static int jtag_dev_shift(uint8_t *dout, const uint8_t *din, int ticks,
+                          int prescan, int postscan)
 {
-	if(ir == d->current_ir) return;
-	for(int i = 0; i < jtag_dev_count; i++)
-		jtag_devs[i].current_ir = -1;
-	d->current_ir = ir;
+	if (ticks <= 0)
+		return 0;
+	if (!prescan && !postscan) {
+		if (dout)
+			jtagtap_tdi_tdo_seq(dout, 1, din, ticks);
+		else
+			jtagtap_tdi_seq(1, din, ticks);
+		return 0;
+	}
+
+	int len = prescan + ticks + postscan;
+	uint8_t buf[JTAG_DEV_SHIFT_BITS / 8];
+
+	if (len > JTAG_DEV_SHIFT_BITS)
+		return -1;
+	memset(buf, 0xff, (len + 7) / 8);
+	for (int i = 0; i < ticks; i++) {
+		int j = prescan + i;
+		if (!(din[i / 8] & (1 << (i % 8))))
+			buf[j / 8] &= ~(1 << (j % 8));
+	}
+	if (!dout) {
+		jtagtap_tdi_seq(1, buf, len);
+		return 0;
+	}
+	jtagtap_tdi_tdo_seq(buf, 1, buf, len);
+	memset(dout, 0, (ticks + 7) / 8);
+	for (int i = 0; i < ticks; i++) {
+		int j = prescan + i;
+		if (buf[j / 8] & (1 << (j % 8)))
+			dout[i / 8] |= 1 << (i % 8);
+	}
+	return 0;
+}
+
+int jtag_dev_write_ir(jtag_dev_t *d, uint32_t ir)
+{
+	int ret;
+
+	if(ir == d->current_ir) return 0;
+	/* The ones shifted through the rest of the chain put it in BYPASS */
+	if (jtag_dev_count > 1)
+		for(int i = 0; i < jtag_dev_count; i++)
+			jtag_devs[i].current_ir = -1;
 
 	jtagtap_shift_ir();
-	jtagtap_tdi_seq(0, ones, d->ir_prescan);
-	jtagtap_tdi_seq(d->ir_postscan?0:1, (void*)&ir, d->ir_len);
-	jtagtap_tdi_seq(1, ones, d->ir_postscan);
+	ret = jtag_dev_shift(NULL, (void*)&ir, d->ir_len, d->ir_prescan,
+	                     d->ir_postscan);
 	jtagtap_return_idle();
+	if (ret)
+		d->current_ir = -1;
+	else
+		d->current_ir = ir;
+	return ret;
 }
 
-void jtag_dev_shift_dr(jtag_dev_t *d, uint8_t *dout, const uint8_t *din, int ticks)
+int jtag_dev_shift_dr(jtag_dev_t *d, uint8_t *dout, const uint8_t *din, int ticks)
 {
+	int ret;
+
 	jtagtap_shift_dr();
-	jtagtap_tdi_seq(0, ones, d->dr_prescan);
-	if(dout)
-		jtagtap_tdi_tdo_seq((void*)dout, d->dr_postscan?0:1, (void*)din, ticks);
-	else
-		jtagtap_tdi_seq(d->dr_postscan?0:1, (void*)din, ticks);
-	jtagtap_tdi_seq(1, ones, d->dr_postscan);
+	ret = jtag_dev_shift(dout, din, ticks, d->dr_prescan, d->dr_postscan);
 	jtagtap_return_idle();
+	return ret;
 }
 
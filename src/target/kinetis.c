@@ -30,6 +30,7 @@
 #include "general.h"
 #include "target.h"
 #include "target_internal.h"
+#include "cortexm.h"
 
 #define SIM_SDID   0x40048024
 
@@ -48,11 +49,15 @@
 #define FTFA_FSTAT_FPVIOL   (1 << 4)
 #define FTFA_FSTAT_MGSTAT0  (1 << 0)
 
+#define FTFA_FCNFG_RAMRDY   (1 << 1)
+
 #define FTFA_CMD_CHECK_ERASE       0x01
 #define FTFA_CMD_PROGRAM_CHECK     0x02
 #define FTFA_CMD_READ_RESOURCE     0x03
 #define FTFA_CMD_PROGRAM_LONGWORD  0x06
+#define FTFA_CMD_ERASE_BLOCK       0x08
 #define FTFA_CMD_ERASE_SECTOR      0x09
+#define FTFA_CMD_PROGRAM_SECTION   0x0B
 #define FTFA_CMD_CHECK_ERASE_ALL   0x40
 #define FTFA_CMD_READ_ONCE         0x41
 #define FTFA_CMD_PROGRAM_ONCE      0x43
@@ -61,12 +66,25 @@
 
 #define KL_GEN_PAGESIZE 0x400
 
+/* Programming acceleration RAM, used by Program Section */
+#define KINETIS_FLEXRAM 0x14000000
+
+/* SRAM_U, which starts here on all parts */
+#define SRAM_BASE 0x20000000
+#define STUB_BUFFER_BASE \
+	CORTEXM_STUB_RING_BASE(SRAM_BASE, sizeof(kinetis_flash_write_stub), 4)
+#define STUB_BUFFER_SIZE 0x800
+
+static const uint16_t kinetis_flash_write_stub[] = {
+#include "flashstub/kinetis.stub"
+};
+
 static bool kinetis_cmd_unsafe(target *t, int argc, char *argv[]);
 static bool unsafe_enabled;
 
 const struct command_s kinetis_cmd_list[] = {
-	{"unsafe", (cmd_handler)kinetis_cmd_unsafe, "Allow programming security byte (enable|disable)"},
-	{NULL, NULL, NULL}
+	{"unsafe", (cmd_handler)kinetis_cmd_unsafe, "Allow programming security byte (enable|disable)", 0},
+	{NULL, NULL, NULL, 0}
 };
 
 static bool kinetis_cmd_unsafe(target *t, int argc, char *argv[])
@@ -83,23 +101,35 @@ static int kl_gen_flash_erase(struct target_flash *f, target_addr addr, size_t l
 static int kl_gen_flash_write(struct target_flash *f,
                               target_addr dest, const void *src, size_t len);
 static int kl_gen_flash_done(struct target_flash *f);
+static int kl_gen_flash_mass_erase(struct target_flash *f);
+
+struct kinetis_flash {
+	struct target_flash f;
+	size_t section;	/* Program Section size, 0 if not supported */
+};
 
-static void kl_gen_add_flash(target *t,
-                           uint32_t addr, size_t length, size_t erasesize)
+static void kl_gen_add_flash(target *t, uint32_t addr, size_t length,
+                             size_t erasesize, size_t section)
 {
-	struct target_flash *f = calloc(1, sizeof(*f));
+	struct kinetis_flash *kf = target_alloc(sizeof(*kf));
+	struct target_flash *f = &kf->f;
+	kf->section = section;
 	f->start = addr;
 	f->length = length;
 	f->blocksize = erasesize;
 	f->erase = kl_gen_flash_erase;
+	f->mass_erase = kl_gen_flash_mass_erase;
+	/* Each flash is a separate block */
+	f->bank = t->flash ? t->flash->bank + 1 : 0;
 	f->write = kl_gen_flash_write;
+	f->combine = true;
 	f->done = kl_gen_flash_done;
 	f->align = 4;
 	f->erased = 0xff;
 	target_add_flash(t, f);
 }
 
-bool kinetis_probe(target *t)
+static bool kinetis_probe(target *t)
 {
 	uint32_t sdid = target_mem_read32(t, SIM_SDID);
 	switch (sdid >> 20) {
@@ -107,13 +137,13 @@ bool kinetis_probe(target *t)
 		t->driver = "KL25";
 		target_add_ram(t, 0x1ffff000, 0x1000);
 		target_add_ram(t, 0x20000000, 0x3000);
-		kl_gen_add_flash(t, 0x00000000, 0x20000, 0x400);
+		kl_gen_add_flash(t, 0x00000000, 0x20000, 0x400, 0);
 		break;
 	case 0x231:
 		t->driver = "KL27";
 		target_add_ram(t, 0x1fffe000, 0x2000);
 		target_add_ram(t, 0x20000000, 0x6000);
-		kl_gen_add_flash(t, 0x00000000, 0x40000, 0x400);
+		kl_gen_add_flash(t, 0x00000000, 0x40000, 0x400, 0);
 		break;
 	case 0x021: /* KL02 family */
 		switch((sdid>>16) & 0x0f){
@@ -121,19 +151,19 @@ bool kinetis_probe(target *t)
 				t->driver = "KL02x32";
 				target_add_ram(t, 0x1FFFFC00, 0x400);
 				target_add_ram(t, 0x20000000, 0xc00);
-				kl_gen_add_flash(t, 0x00000000, 0x7FFF, 0x400);
+				kl_gen_add_flash(t, 0x00000000, 0x7FFF, 0x400, 0);
 				break;
 			case 2:
 				t->driver = "KL02x16";
 				target_add_ram(t, 0x1FFFFE00, 0x200);
 				target_add_ram(t, 0x20000000, 0x600);
-				kl_gen_add_flash(t, 0x00000000, 0x3FFF, 0x400);
+				kl_gen_add_flash(t, 0x00000000, 0x3FFF, 0x400, 0);
 				break;
 			case 1:
 				t->driver = "KL02x8";
 				target_add_ram(t, 0x1FFFFF00, 0x100);
 				target_add_ram(t, 0x20000000, 0x300);
-				kl_gen_add_flash(t, 0x00000000, 0x1FFF, 0x400);
+				kl_gen_add_flash(t, 0x00000000, 0x1FFF, 0x400, 0);
 				break;
 			default:
 				return false;
@@ -143,14 +173,14 @@ bool kinetis_probe(target *t)
 		t->driver = "KL03";
 		target_add_ram(t, 0x1ffffe00, 0x200);
 		target_add_ram(t, 0x20000000, 0x600);
-		kl_gen_add_flash(t, 0, 0x8000, 0x400);
+		kl_gen_add_flash(t, 0, 0x8000, 0x400, 0);
 		break;
 	case 0x220: /* K22F family */
 		t->driver = "K22F";
 		target_add_ram(t, 0x1c000000, 0x4000000);
 		target_add_ram(t, 0x20000000, 0x100000);
-		kl_gen_add_flash(t, 0, 0x40000, 0x800);
-		kl_gen_add_flash(t, 0x40000, 0x40000, 0x800);
+		kl_gen_add_flash(t, 0, 0x40000, 0x800, 0x400);
+		kl_gen_add_flash(t, 0x40000, 0x40000, 0x800, 0x400);
 		break;
 	default:
 		return false;
@@ -160,6 +190,8 @@ bool kinetis_probe(target *t)
 	return true;
 }
 
+CORTEXM_DRIVER(kinetis_probe, JEP106_FREESCALE);
+
 static bool
 kl_gen_command(target *t, uint8_t cmd, uint32_t addr, const uint8_t data[8])
 {
@@ -168,10 +200,9 @@ kl_gen_command(target *t, uint8_t cmd, uint32_t addr, const uint8_t data[8])
 	/* clear errors unconditionally, so we can start a new operation */
 	target_mem_write8(t,FTFA_FSTAT,(FTFA_FSTAT_ACCERR | FTFA_FSTAT_FPVIOL));
 
-	/* Wait for CCIF to be high */
-	do {
-		fstat = target_mem_read8(t, FTFA_FSTAT);
-	} while (!(fstat & FTFA_FSTAT_CCIF));
+	/* Wait for CCIF to be high, FSTAT is the low byte of the word */
+	if (target_mem_poll32(t, FTFA_FSTAT, FTFA_FSTAT_CCIF, FTFA_FSTAT_CCIF, 0))
+		return false;
 
 	/* Write command to FCCOB */
 	addr &= 0xffffff;
@@ -185,19 +216,21 @@ kl_gen_command(target *t, uint8_t cmd, uint32_t addr, const uint8_t data[8])
 	/* Enable execution by clearing CCIF */
 	target_mem_write8(t, FTFA_FSTAT, FTFA_FSTAT_CCIF);
 
-	/* Wait for execution to complete */
-	do {
-		fstat = target_mem_read8(t, FTFA_FSTAT);
-		/* Check ACCERR and FPVIOL are zero in FSTAT */
-		if (fstat & (FTFA_FSTAT_ACCERR | FTFA_FSTAT_FPVIOL))
-			return false;
-	} while (!(fstat & FTFA_FSTAT_CCIF));
+	/* Wait for execution to complete, an error also sets CCIF */
+	if (target_mem_poll32(t, FTFA_FSTAT, FTFA_FSTAT_CCIF, FTFA_FSTAT_CCIF, 0))
+		return false;
+	/* Check ACCERR and FPVIOL are zero in FSTAT */
+	fstat = target_mem_read8(t, FTFA_FSTAT);
+	if (fstat & (FTFA_FSTAT_ACCERR | FTFA_FSTAT_FPVIOL))
+		return false;
 
 	return true;
 }
 
 static int kl_gen_flash_erase(struct target_flash *f, target_addr addr, size_t len)
 {
+	if (cortexm_stub_sync(f->t))
+		return 1;
 	while (len) {
 		if (kl_gen_command(f->t, FTFA_CMD_ERASE_SECTOR, addr, NULL)) {
 			len -= KL_GEN_PAGESIZE;
@@ -209,6 +242,32 @@ static int kl_gen_flash_erase(struct target_flash *f, target_addr addr, size_t l
 	return 0;
 }
 
+/* Erase a whole block, or all of them on parts with a single block.
+ * Either clears the security byte, which kl_gen_flash_done() restores.
+ */
+static int kl_gen_flash_mass_erase(struct target_flash *f)
+{
+	target *t = f->t;
+	bool ok;
+
+	if (cortexm_stub_sync(t))
+		return 1;
+	if ((t->flash == f) && (f->next == NULL))
+		ok = kl_gen_command(t, FTFA_CMD_ERASE_ALL, 0, NULL);
+	else
+		ok = kl_gen_command(t, FTFA_CMD_ERASE_BLOCK, f->start, NULL);
+	if (ok)
+		return 0;
+
+	/* Protected sectors make these fail, go sector by sector to
+	 * find out which */
+	for (target_addr addr = f->start; addr < f->start + f->length;
+	     addr += f->blocksize)
+		if (kl_gen_flash_erase(f, addr, f->blocksize))
+			return 1;
+	return 0;
+}
+
 #define FLASH_SECURITY_BYTE_ADDRESS 0x40C
 #define FLASH_SECURITY_BYTE_UNSECURED 0xFE
 
@@ -223,20 +282,36 @@ static int kl_gen_flash_write(struct target_flash *f,
 		    FLASH_SECURITY_BYTE_UNSECURED;
 	}
 
-	while (len) {
-		if (kl_gen_command(f->t, FTFA_CMD_PROGRAM_LONGWORD, dest, src)) {
-			len -= 4;
-			dest += 4;
-			src += 4;
-		} else {
-			return 1;
+	/* Stream whole sections through FlexRAM if it is free for it */
+	size_t section = ((struct kinetis_flash *)f)->section;
+	if (section &&
+	    (target_mem_read8(f->t, FTFA_FCNFG) & FTFA_FCNFG_RAMRDY)) {
+		while (len) {
+			size_t chunk = MIN(len, section - (dest % section));
+			/* Longword count in FCCOB4-5 */
+			uint32_t count[2] = {(chunk / 4) << 16, 0};
+			target_mem_write(f->t, KINETIS_FLEXRAM, src, chunk);
+			if (!kl_gen_command(f->t, FTFA_CMD_PROGRAM_SECTION, dest,
+			                    (uint8_t *)count))
+				return 1;
+			len -= chunk;
+			dest += chunk;
+			src += chunk;
 		}
+		return 0;
 	}
-	return 0;
+
+	/* Otherwise have a stub issue Program Longword commands */
+	return cortexm_stub_stream(f->t, kinetis_flash_write_stub,
+	                           sizeof(kinetis_flash_write_stub),
+	                           SRAM_BASE, STUB_BUFFER_BASE, STUB_BUFFER_SIZE,
+	                           dest, src, len, 0);
 }
 
 static int kl_gen_flash_done(struct target_flash *f)
 {
+	if (cortexm_stub_done(f->t))
+		return 1;
 
 	if (unsafe_enabled)
 		return 0;
@@ -268,8 +343,8 @@ static int kl_gen_flash_done(struct target_flash *f)
 static bool kinetis_mdm_cmd_erase_mass(target *t);
 
 const struct command_s kinetis_mdm_cmd_list[] = {
-	{"erase_mass", (cmd_handler)kinetis_mdm_cmd_erase_mass, "Erase entire flash memory"},
-	{NULL, NULL, NULL}
+	{"erase_mass", (cmd_handler)kinetis_mdm_cmd_erase_mass, "Erase entire flash memory", CMD_HALTED},
+	{NULL, NULL, NULL, 0}
 };
 
 bool nop_function(void)
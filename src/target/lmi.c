@@ -22,6 +22,9 @@
  * the XML memory map and Flash memory programming.
  *
  * According to: TivaTM TM4C123GH6PM Microcontroller Datasheet
+ *
+ * Tiva parts program through the 32-word flash write buffer, a row in
+ * one operation, the Stellaris parts a word at a time.
  */
 
 #include "general.h"
@@ -30,7 +33,10 @@
 #include "cortexm.h"
 
 #define SRAM_BASE            0x20000000
-#define STUB_BUFFER_BASE     ALIGN(SRAM_BASE + sizeof(lmi_flash_write_stub), 4)
+#define STUB_BUFFER_BASE \
+	CORTEXM_STUB_RING_BASE(SRAM_BASE, MAX(sizeof(lmi_flash_write_stub), \
+	                                      sizeof(lmi_fwb_write_stub)), 4)
+#define STUB_BUFFER_SIZE     0x4000
 
 #define BLOCK_SIZE           0x400
 
@@ -47,9 +53,14 @@
 #define LMI_FLASH_FMC_COMT   (1 << 3)
 #define LMI_FLASH_FMC_WRKEY  0xA4420000
 
+/* Page erase takes up to 15 ms */
+#define LMI_ERASE_TIMEOUT    100
+
 static int lmi_flash_erase(struct target_flash *f, target_addr addr, size_t len);
 static int lmi_flash_write(struct target_flash *f,
                            target_addr dest, const void *src, size_t len);
+static int lmi_flash_prepare(struct target_flash *f);
+static int lmi_flash_done(struct target_flash *f);
 
 static const char lmi_driver_str[] = "TI Stellaris/Tiva";
 
@@ -57,33 +68,48 @@ static const uint16_t lmi_flash_write_stub[] = {
 #include "flashstub/lmi.stub"
 };
 
-static void lmi_add_flash(target *t, size_t length)
+/* Programs through FWBn and FMC2 */
+static const uint16_t lmi_fwb_write_stub[] = {
+#include "flashstub/lmi_fwb.stub"
+};
+
+struct lmi_flash {
+	struct target_flash f;
+	bool fwb;	/* Has the flash write buffer */
+};
+
+static void lmi_add_flash(target *t, size_t length, bool fwb)
 {
-	struct target_flash *f = calloc(1, sizeof(*f));
+	struct lmi_flash *lf = target_alloc(sizeof(*lf));
+	struct target_flash *f = &lf->f;
+	lf->fwb = fwb;
 	f->start = 0;
 	f->length = length;
 	f->blocksize = 0x400;
 	f->erase = lmi_flash_erase;
 	f->write = lmi_flash_write;
+	f->combine = true;
+	f->prepare = lmi_flash_prepare;
+	f->done = lmi_flash_done;
 	f->align = 4;
 	f->erased = 0xff;
 	target_add_flash(t, f);
 }
 
-bool lmi_probe(target *t)
+static bool lmi_probe(target *t)
 {
 	uint32_t did1 = target_mem_read32(t, LMI_SCB_DID1);
 	switch (did1 >> 16) {
 	case 0x1049:	/* LM3S3748 */
 		t->driver = lmi_driver_str;
 		target_add_ram(t, 0x20000000, 0x8000);
-		lmi_add_flash(t, 0x40000);
+		lmi_add_flash(t, 0x40000, false);
 		return true;
 
 	case 0x10A1:	/* TM4C123GH6PM */
 		t->driver = lmi_driver_str;
 		target_add_ram(t, 0x20000000, 0x10000);
-		lmi_add_flash(t, 0x80000);
+		lmi_add_flash(t, 0x80000, true);
 		/* On Tiva targets, asserting SRST results in the debug
 		 * logic also being reset.  We can't assert SRST and must
 		 * only use the AIRCR SYSRESETREQ. */
@@ -93,27 +119,30 @@ bool lmi_probe(target *t)
 	case 0x1022:    /* TM4C1230C3PM */
 		t->driver = lmi_driver_str;
 		target_add_ram(t, 0x20000000, 0x6000);
-		lmi_add_flash(t, 0x10000);
+		lmi_add_flash(t, 0x10000, true);
 		t->target_options |= CORTEXM_TOPT_INHIBIT_SRST;
 		return true;
 	}
 	return false;
 }
 
+CORTEXM_DRIVER(lmi_probe, JEP106_TI);
+
 int lmi_flash_erase(struct target_flash *f, target_addr addr, size_t len)
 {
 	target  *t = f->t;
 
+	if (cortexm_stub_sync(t))
+		return -1;
 	target_check_error(t);
 
 	while(len) {
 		target_mem_write32(t, LMI_FLASH_FMA, addr);
 		target_mem_write32(t, LMI_FLASH_FMC,
 		                   LMI_FLASH_FMC_WRKEY | LMI_FLASH_FMC_ERASE);
-		while (target_mem_read32(t, LMI_FLASH_FMC) &
-		       LMI_FLASH_FMC_ERASE);
-
-		if (target_check_error(t))
+		if (target_mem_poll32(t, LMI_FLASH_FMC, LMI_FLASH_FMC_ERASE,
+		                      0, LMI_ERASE_TIMEOUT) ||
+		    target_check_error(t))
 			return -1;
 
 		len -= BLOCK_SIZE;
@@ -122,19 +151,30 @@ int lmi_flash_erase(struct target_flash *f, target_addr addr, size_t len)
 	return 0;
 }
 
+/* Clear any stale fault before the first write of a session */
+static int lmi_flash_prepare(struct target_flash *f)
+{
+	target_check_error(f->t);
+	return 0;
+}
+
 int lmi_flash_write(struct target_flash *f,
                     target_addr dest, const void *src, size_t len)
 {
 	target  *t = f->t;
 
-	target_check_error(t);
-
-	target_mem_write(t, SRAM_BASE, lmi_flash_write_stub,
-	                 sizeof(lmi_flash_write_stub));
-	target_mem_write(t, STUB_BUFFER_BASE, src, len);
-
-	if (target_check_error(t))
-		return -1;
+	if (((struct lmi_flash *)f)->fwb)
+		return cortexm_stub_stream(t, lmi_fwb_write_stub,
+		                           sizeof(lmi_fwb_write_stub),
+		                           SRAM_BASE, STUB_BUFFER_BASE,
+		                           STUB_BUFFER_SIZE, dest, src, len, 0);
+	return cortexm_stub_stream(t, lmi_flash_write_stub,
+	                           sizeof(lmi_flash_write_stub),
+	                           SRAM_BASE, STUB_BUFFER_BASE, STUB_BUFFER_SIZE,
+	                           dest, src, len, 0);
+}
 
-	return cortexm_run_stub(t, SRAM_BASE, dest, STUB_BUFFER_BASE, len, 0);
+static int lmi_flash_done(struct target_flash *f)
+{
+	return cortexm_stub_done(f->t);
 }
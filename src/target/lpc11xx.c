@@ -25,6 +25,7 @@
 #include "lpc_common.h"
 
 #define IAP_PGM_CHUNKSIZE	512	/* should fit in RAM on any device */
+#define IAP_PGM_MINSIZE	256	/* also a valid IAP program size */
 
 #define MIN_RAM_SIZE            1024
 #define RAM_USAGE_FOR_IAP_ROUTINES	32	/* IAP routines use 32 bytes at top of ram */
@@ -40,13 +41,14 @@ void lpc11xx_add_flash(target *t, uint32_t addr, size_t len, size_t erasesize)
 	struct lpc_flash *lf = lpc_add_flash(t, addr, len);
 	lf->f.blocksize = erasesize;
 	lf->f.buf_size = IAP_PGM_CHUNKSIZE;
+	lf->f.buf_page = IAP_PGM_MINSIZE;
 	lf->f.write_buf = lpc_flash_write_magic_vect;
 	lf->iap_entry = IAP_ENTRYPOINT;
 	lf->iap_ram = IAP_RAM_BASE;
 	lf->iap_msp = IAP_RAM_BASE + MIN_RAM_SIZE - RAM_USAGE_FOR_IAP_ROUTINES;
 }
 
-bool
+static bool
 lpc11xx_probe(target *t)
 {
 	uint32_t idcode;
@@ -123,3 +125,5 @@ lpc11xx_probe(target *t)
 	return false;
 }
 
+CORTEXM_DRIVER(lpc11xx_probe, JEP106_NXP);
+
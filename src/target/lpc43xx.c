@@ -38,6 +38,13 @@
 #define LPC43XX_WDT_PERIOD_MAX 0xFFFFFF
 #define LPC43XX_WDT_PROTECT (1 << 4)
 
+/* The M0APP coprocessor is held in reset until the M4 releases it, and
+ * then boots from the address shadowed at 0 */
+#define LPC43XX_CREG_M0APPMEMMAP	0x40043404
+#define LPC43XX_RGU_RESET_CTRL1		0x40053104
+#define LPC43XX_RGU_RESET_ACTIVE_STATUS1 0x40053154
+#define LPC43XX_RGU_M0APP_RST		(1 << 24)
+
 #define IAP_RAM_SIZE	LPC43XX_ETBAHB_SRAM_SIZE
 #define IAP_RAM_BASE	LPC43XX_ETBAHB_SRAM_BASE
 
@@ -46,20 +53,98 @@
 #define FLASH_NUM_BANK		2
 #define FLASH_NUM_SECTOR	15
 
+#define LPC43XX_SPIFI_BASE	0x40003000
+#define LPC43XX_SPIFI_CTRL	(LPC43XX_SPIFI_BASE + 0x00)
+#define LPC43XX_SPIFI_CMD	(LPC43XX_SPIFI_BASE + 0x04)
+#define LPC43XX_SPIFI_ADDR	(LPC43XX_SPIFI_BASE + 0x08)
+#define LPC43XX_SPIFI_DATA	(LPC43XX_SPIFI_BASE + 0x14)
+#define LPC43XX_SPIFI_MCMD	(LPC43XX_SPIFI_BASE + 0x18)
+#define LPC43XX_SPIFI_STAT	(LPC43XX_SPIFI_BASE + 0x1C)
+
+#define SPIFI_CTRL_DUAL		(1 << 5)
+#define SPIFI_STAT_MCINIT	(1 << 0)
+#define SPIFI_STAT_CMD		(1 << 1)
+#define SPIFI_STAT_RESET	(1 << 4)
+
+#define SPIFI_CMD_DATALEN(x)	(x)
+#define SPIFI_CMD_POLL		(1 << 14)
+#define SPIFI_CMD_DOUT		(1 << 15)
+#define SPIFI_CMD_FIELDFORM(x)	((x) << 19)
+#define SPIFI_CMD_FIELDFORM_MASK SPIFI_CMD_FIELDFORM(3)
+#define SPIFI_CMD_OPCODE_ONLY	(1 << 21)
+#define SPIFI_CMD_OPCODE_ADDR3	(4 << 21)
+#define SPIFI_CMD_OPCODE(x)	((uint32_t)(x) << 24)
+
+/* Serial flash commands, with 64 KiB erase blocks and 3 address bytes */
+#define SPI_FLASH_WREN	(SPIFI_CMD_OPCODE(0x06) | SPIFI_CMD_OPCODE_ONLY)
+#define SPI_FLASH_WIP_POLL	(SPIFI_CMD_OPCODE(0x05) | SPIFI_CMD_OPCODE_ONLY | \
+				 SPIFI_CMD_POLL)
+#define SPI_FLASH_JEDEC_ID	(SPIFI_CMD_OPCODE(0x9F) | SPIFI_CMD_OPCODE_ONLY | \
+				 SPIFI_CMD_DATALEN(3))
+#define SPI_FLASH_ERASE_64K	(SPIFI_CMD_OPCODE(0xD8) | SPIFI_CMD_OPCODE_ADDR3)
+#define SPI_FLASH_CHIP_ERASE	(SPIFI_CMD_OPCODE(0xC7) | SPIFI_CMD_OPCODE_ONLY)
+#define SPI_FLASH_PP		(SPIFI_CMD_OPCODE(0x02) | SPIFI_CMD_OPCODE_ADDR3 | \
+				 SPIFI_CMD_DOUT)
+#define SPI_FLASH_QPP		(SPIFI_CMD_OPCODE(0x32) | SPIFI_CMD_OPCODE_ADDR3 | \
+				 SPIFI_CMD_DOUT | SPIFI_CMD_FIELDFORM(1))
+#define SPI_FLASH_4PP		(SPIFI_CMD_OPCODE(0x38) | SPIFI_CMD_OPCODE_ADDR3 | \
+				 SPIFI_CMD_DOUT | SPIFI_CMD_FIELDFORM(2))
+
+#define SPI_FLASH_BLOCK_SIZE	0x10000
+#define JEDEC_MFR_SPANSION	0x01
+#define JEDEC_MFR_MACRONIX	0xC2
+
+/* Memory mapped SPIFI flash, 3 address bytes reach the first 16 MiB */
+#define LPC43XX_SPIFI_MEM	0x14000000
+#define LPC43XX_SPIFI_MEM_MAX	0x01000000
+
+/* The stub runs from the local SRAM present on every part */
+#define SRAM_BASE		0x10000000
+#define STUB_PARAM_BASE		ALIGN(SRAM_BASE + sizeof(lpc43xx_spifi_write_stub), 4)
+#define STUB_BUFFER_BASE	(STUB_PARAM_BASE + 8)
+#define STUB_BUFFER_SIZE	0x2000
+
+struct lpc43xx_spifi {
+	struct target_flash f;
+	uint32_t mcmd;		/* memory mode command to restore */
+	uint32_t prog_cmd;	/* page program, quad if the flash is used so */
+};
+
 static bool lpc43xx_cmd_erase(target *t, int argc, const char *argv[]);
 static bool lpc43xx_cmd_reset(target *t, int argc, const char *argv[]);
 static bool lpc43xx_cmd_mkboot(target *t, int argc, const char *argv[]);
+static bool lpc43xx_cmd_m0app(target *t, int argc, const char *argv[]);
 static int lpc43xx_flash_init(target *t);
 static int lpc43xx_flash_erase(struct target_flash *f, target_addr addr, size_t len);
 static void lpc43xx_set_internal_clock(target *t);
 static void lpc43xx_wdt_set_period(target *t);
 static void lpc43xx_wdt_pet(target *t);
+static void lpc43xx_add_ram(target *t, target_addr end);
+static int lpc43xx_spifi_erase(struct target_flash *f,
+                               target_addr addr, size_t len);
+static int lpc43xx_spifi_mass_erase(struct target_flash *f);
+static int lpc43xx_spifi_prepare(struct target_flash *f);
+static int lpc43xx_spifi_write(struct target_flash *f,
+                               target_addr dest, const void *src, size_t len);
+static int lpc43xx_spifi_done(struct target_flash *f);
 
 const struct command_s lpc43xx_cmd_list[] = {
-	{"erase_mass", lpc43xx_cmd_erase, "Erase entire flash memory"},
-	{"reset", lpc43xx_cmd_reset, "Reset target"},
-	{"mkboot", lpc43xx_cmd_mkboot, "Make flash bank bootable"},
-	{NULL, NULL, NULL}
+	{"erase_mass", lpc43xx_cmd_erase, "Erase entire flash memory", CMD_HALTED},
+	{"reset", lpc43xx_cmd_reset, "Reset target", CMD_HALTED},
+	{"mkboot", lpc43xx_cmd_mkboot, "Make flash bank bootable", CMD_HALTED},
+	{NULL, NULL, NULL, 0}
+};
+
+const struct command_s lpc43xx_m4_cmd_list[] = {
+	{"m0app", lpc43xx_cmd_m0app, "Run the M0 coprocessor from an address, or hold it in reset: (<addr>|stop)", 0},
+	{NULL, NULL, NULL, 0}
+};
+
+static const char lpc43xx_m4_driver[] = "LPC43xx Cortex-M4";
+static const char lpc43xx_m0_driver[] = "LPC43xx Cortex-M0";
+
+static const uint16_t lpc43xx_spifi_write_stub[] = {
+#include "flashstub/lpc43xx_spifi.stub"
 };
 
 void lpc43xx_add_flash(target *t, uint32_t iap_entry,
@@ -78,7 +163,29 @@ void lpc43xx_add_flash(target *t, uint32_t iap_entry,
 	lf->wdt_kick = lpc43xx_wdt_pet;
 }
 
-bool lpc43xx_probe(target *t)
+/* The M0 cores see memory as the M4 does, so cached reads are shared with
+ * it.  With more than one LPC43xx on the chain it isn't known which cores
+ * go together, and nothing is shared. */
+static void lpc43xx_share_mem(void)
+{
+	target *m4 = NULL;
+	int n = 0, m0 = 0;
+
+	for (target *g = target_list; g; g = g->next) {
+		if (g->driver == lpc43xx_m4_driver) {
+			m4 = g;
+			n++;
+		} else if (g->driver == lpc43xx_m0_driver) {
+			m0++;
+		}
+	}
+	for (target *g = target_list; g; g = g->next)
+		if ((g->driver == lpc43xx_m4_driver) ||
+		    (g->driver == lpc43xx_m0_driver))
+			g->mem_shared = ((n == 1) && m0) ? m4 : NULL;
+}
+
+static bool lpc43xx_probe(target *t)
 {
 	uint32_t chipid, cpuid;
 	uint32_t iap_entry;
@@ -91,13 +198,14 @@ bool lpc43xx_probe(target *t)
 	case 0x7906002B:	/* LM43S?? - Undocumented? */
 		switch (cpuid & 0xFF00FFF0) {
 		case 0x4100C240:
-			t->driver = "LPC43xx Cortex-M4";
+			t->driver = lpc43xx_m4_driver;
+			target_add_commands(t, lpc43xx_m4_cmd_list, "LPC43xx M4");
 			if (cpuid == 0x410FC241)
 			{
 				/* LPC4337 */
 				iap_entry = target_mem_read32(t,
 				                  IAP_ENTRYPOINT_LOCATION);
-				target_add_ram(t, 0, 0x1A000000);
+				lpc43xx_add_ram(t, 0x1A000000);
 				lpc43xx_add_flash(t, iap_entry, 0, 0,
 				                  0x1A000000, 0x10000, 0x2000);
 				lpc43xx_add_flash(t, iap_entry, 0, 8,
@@ -113,30 +221,37 @@ bool lpc43xx_probe(target *t)
 			}
 			break;
 		case 0x4100C200:
-			t->driver = "LPC43xx Cortex-M0";
+			t->driver = lpc43xx_m0_driver;
 			break;
 		default:
 			t->driver = "LPC43xx <Unknown>";
 		}
+		lpc43xx_share_mem();
 		return true;
 	case 0x5906002B:	/* Flashless parts */
 	case 0x6906002B:
 		switch (cpuid & 0xFF00FFF0) {
 		case 0x4100C240:
-			t->driver = "LPC43xx Cortex-M4";
+			t->driver = lpc43xx_m4_driver;
+			target_add_commands(t, lpc43xx_m4_cmd_list, "LPC43xx M4");
+			/* All of the address space, around any SPIFI flash */
+			lpc43xx_add_ram(t, 0);
 			break;
 		case 0x4100C200:
-			t->driver = "LPC43xx Cortex-M0";
+			t->driver = lpc43xx_m0_driver;
 			break;
 		default:
 			t->driver = "LPC43xx <Unknown>";
 		}
+		lpc43xx_share_mem();
 		return true;
 	}
 
 	return false;
 }
 
+CORTEXM_DRIVER(lpc43xx_probe, JEP106_NXP);
+
 /* Reset all major systems _except_ debug */
 static bool lpc43xx_cmd_reset(target *t, int argc, const char *argv[])
 {
@@ -243,6 +358,37 @@ static bool lpc43xx_cmd_mkboot(target *t, int argc, const char *argv[])
 	return true;
 }
 
+/* Only the M4 is on the SW-DP, the M0APP has its own TAP and is found by
+ * a JTAG scan once it is out of reset */
+static bool lpc43xx_cmd_m0app(target *t, int argc, const char *argv[])
+{
+	if (argc != 2) {
+		tc_printf(t, "usage: monitor m0app (<addr>|stop)\n");
+		return false;
+	}
+
+	/* Leave whatever else is held in reset so */
+	uint32_t held = ~target_mem_read32(t, LPC43XX_RGU_RESET_ACTIVE_STATUS1);
+	target_mem_write32(t, LPC43XX_RGU_RESET_CTRL1,
+	                   held | LPC43XX_RGU_M0APP_RST);
+	if (!strcmp(argv[1], "stop"))
+		return !target_check_error(t);
+
+	uint32_t addr = strtoul(argv[1], NULL, 0);
+	if (addr & 0xfff) {
+		tc_printf(t, "The boot address must be 4 KiB aligned\n");
+		return false;
+	}
+	target_mem_write32(t, LPC43XX_CREG_M0APPMEMMAP, addr);
+	target_mem_write32(t, LPC43XX_RGU_RESET_CTRL1,
+	                   held & ~LPC43XX_RGU_M0APP_RST);
+	if (target_check_error(t))
+		return false;
+	tc_printf(t, "M0APP running from 0x%08"PRIx32", 'monitor jtag_scan' "
+	          "finds it\n", addr);
+	return true;
+}
+
 static void lpc43xx_wdt_set_period(target *t)
 {
 	/* Check if WDT is on */
@@ -265,3 +411,156 @@ static void lpc43xx_wdt_pet(target *t)
 	}
 }
 
+
+/* The SPIFI only accepts commands outside memory mode */
+static void lpc43xx_spifi_reset(target *t)
+{
+	target_mem_write32(t, LPC43XX_SPIFI_STAT, SPIFI_STAT_RESET);
+	target_mem_poll32(t, LPC43XX_SPIFI_STAT, SPIFI_STAT_RESET, 0, 0);
+}
+
+static void lpc43xx_spifi_cmd(target *t, uint32_t cmd)
+{
+	target_mem_write32(t, LPC43XX_SPIFI_CMD, cmd);
+	target_mem_poll32(t, LPC43XX_SPIFI_STAT, SPIFI_STAT_CMD, 0, 0);
+}
+
+/* Wait for the write in progress bit of the flash status to clear */
+static void lpc43xx_spifi_wait(target *t)
+{
+	lpc43xx_spifi_cmd(t, SPI_FLASH_WIP_POLL);
+	target_mem_read8(t, LPC43XX_SPIFI_DATA);
+}
+
+/* Reads the size of the SPIFI flash if the boot ROM or application left
+ * it in memory mode, and adds it.  Returns the size added, or 0.  The core
+ * may be running from the flash, so it is held halted while the SPIFI is
+ * out of memory mode.
+ */
+static size_t lpc43xx_spifi_probe(target *t)
+{
+	uint32_t stat = target_mem_read32(t, LPC43XX_SPIFI_STAT);
+	uint32_t ctrl = target_mem_read32(t, LPC43XX_SPIFI_CTRL);
+	uint32_t mcmd = target_mem_read32(t, LPC43XX_SPIFI_MCMD);
+	uint32_t dhcsr = target_mem_read32(t, CORTEXM_DHCSR);
+	uint8_t id[3];
+
+	if (target_check_error(t) || !(stat & SPIFI_STAT_MCINIT))
+		return 0;
+
+	if (!(dhcsr & CORTEXM_DHCSR_S_HALT))
+		target_mem_write32(t, CORTEXM_DHCSR, CORTEXM_DHCSR_DBGKEY |
+		                   CORTEXM_DHCSR_C_DEBUGEN | CORTEXM_DHCSR_C_HALT);
+	lpc43xx_spifi_reset(t);
+	target_mem_write32(t, LPC43XX_SPIFI_CMD, SPI_FLASH_JEDEC_ID);
+	for (int i = 0; i < 3; i++)
+		id[i] = target_mem_read8(t, LPC43XX_SPIFI_DATA);
+	target_mem_poll32(t, LPC43XX_SPIFI_STAT, SPIFI_STAT_CMD, 0, 0);
+	target_mem_write32(t, LPC43XX_SPIFI_MCMD, mcmd);
+	if (!(dhcsr & CORTEXM_DHCSR_S_HALT))
+		target_mem_write32(t, CORTEXM_DHCSR, CORTEXM_DHCSR_DBGKEY |
+		                   (dhcsr & CORTEXM_DHCSR_C_DEBUGEN));
+	if (target_check_error(t))
+		return 0;
+
+	/* Older Spansion parts count capacity from 0x10 for 128 KiB */
+	unsigned capacity = id[2];
+	if ((id[0] == JEDEC_MFR_SPANSION) && (id[1] == 0x02))
+		capacity++;
+	if ((capacity < 16) || (capacity > 24))
+		return 0;
+	size_t size = MIN(1ul << capacity, LPC43XX_SPIFI_MEM_MAX);
+
+	struct lpc43xx_spifi *sf = target_alloc(sizeof(*sf));
+	struct target_flash *f = &sf->f;
+	f->start = LPC43XX_SPIFI_MEM;
+	f->length = size;
+	f->blocksize = SPI_FLASH_BLOCK_SIZE;
+	f->erase = lpc43xx_spifi_erase;
+	f->write = lpc43xx_spifi_write;
+	f->prepare = lpc43xx_spifi_prepare;
+	f->done = lpc43xx_spifi_done;
+	f->mass_erase = lpc43xx_spifi_mass_erase;
+	f->erased = 0xff;
+	f->combine = true;
+	sf->mcmd = mcmd;
+	/* Program in quad mode if memory mode reads use it */
+	if ((mcmd & SPIFI_CMD_FIELDFORM_MASK) && !(ctrl & SPIFI_CTRL_DUAL))
+		sf->prog_cmd = (id[0] == JEDEC_MFR_MACRONIX) ?
+		               SPI_FLASH_4PP : SPI_FLASH_QPP;
+	else
+		sf->prog_cmd = SPI_FLASH_PP;
+	target_add_flash(t, f);
+	return size;
+}
+
+/* Map RAM up to end, leaving a hole for the SPIFI flash if it is in use */
+static void lpc43xx_add_ram(target *t, target_addr end)
+{
+	size_t spifi = lpc43xx_spifi_probe(t);
+
+	target_add_ram(t, 0, LPC43XX_SPIFI_MEM);
+	target_add_ram(t, LPC43XX_SPIFI_MEM + spifi,
+	               end - (LPC43XX_SPIFI_MEM + spifi));
+}
+
+static int lpc43xx_spifi_erase(struct target_flash *f,
+                               target_addr addr, size_t len)
+{
+	struct lpc43xx_spifi *sf = (struct lpc43xx_spifi *)f;
+	target *t = f->t;
+
+	if (cortexm_stub_sync(t))
+		return -1;
+
+	lpc43xx_spifi_reset(t);
+	while (len) {
+		lpc43xx_spifi_cmd(t, SPI_FLASH_WREN);
+		target_mem_write32(t, LPC43XX_SPIFI_ADDR, addr);
+		lpc43xx_spifi_cmd(t, SPI_FLASH_ERASE_64K);
+		lpc43xx_spifi_wait(t);
+		addr += f->blocksize;
+		len -= MIN(len, f->blocksize);
+	}
+	target_mem_write32(t, LPC43XX_SPIFI_MCMD, sf->mcmd);
+	return target_check_error(t) ? -1 : 0;
+}
+
+static int lpc43xx_spifi_mass_erase(struct target_flash *f)
+{
+	struct lpc43xx_spifi *sf = (struct lpc43xx_spifi *)f;
+	target *t = f->t;
+
+	if (cortexm_stub_sync(t))
+		return -1;
+
+	lpc43xx_spifi_reset(t);
+	lpc43xx_spifi_cmd(t, SPI_FLASH_WREN);
+	lpc43xx_spifi_cmd(t, SPI_FLASH_CHIP_ERASE);
+	lpc43xx_spifi_wait(t);
+	target_mem_write32(t, LPC43XX_SPIFI_MCMD, sf->mcmd);
+	return target_check_error(t) ? -1 : 0;
+}
+
+/* Pass the stub its program and memory mode commands */
+static int lpc43xx_spifi_prepare(struct target_flash *f)
+{
+	struct lpc43xx_spifi *sf = (struct lpc43xx_spifi *)f;
+	uint32_t param[2] = {sf->prog_cmd, sf->mcmd};
+
+	return target_mem_write(f->t, STUB_PARAM_BASE, param, sizeof(param));
+}
+
+static int lpc43xx_spifi_write(struct target_flash *f,
+                               target_addr dest, const void *src, size_t len)
+{
+	return cortexm_stub_stream(f->t, lpc43xx_spifi_write_stub,
+	                           sizeof(lpc43xx_spifi_write_stub),
+	                           SRAM_BASE, STUB_BUFFER_BASE, STUB_BUFFER_SIZE,
+	                           dest, src, len, STUB_PARAM_BASE);
+}
+
+static int lpc43xx_spifi_done(struct target_flash *f)
+{
+	return cortexm_stub_done(f->t);
+}
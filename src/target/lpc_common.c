@@ -24,18 +24,26 @@
 
 #include <stdarg.h>
 
-struct flash_param {
-	uint16_t opcode;
-	uint16_t pad0;
+/* An IAP command and its result table, as passed to the boot ROM */
+struct iap_frame {
 	uint32_t command;
-	uint32_t words[4];
-	uint32_t result;
-} __attribute__((aligned(4)));
+	uint32_t params[4];
+	uint32_t result[5];
+};
 
+/* IAP RAM holds the trampoline, its command frames, then data to program */
+#define IAP_FRAMES_MAX	3
+#define IAP_FRAMES(f)	((f)->iap_ram + ALIGN(sizeof(lpc_iap_stub), 4))
+#define IAP_DATA(f)	(IAP_FRAMES(f) + \
+			 IAP_FRAMES_MAX * sizeof(struct iap_frame))
+
+static const uint16_t lpc_iap_stub[] = {
+#include "flashstub/lpc_iap.stub"
+};
 
 struct lpc_flash *lpc_add_flash(target *t, target_addr addr, size_t length)
 {
-	struct lpc_flash *lf = calloc(1, sizeof(*lf));
+	struct lpc_flash *lf = target_alloc(sizeof(*lf));
 	struct target_flash *f = &lf->f;
 	f->start = addr;
 	f->length = length;
@@ -48,45 +56,53 @@ struct lpc_flash *lpc_add_flash(target *t, target_addr addr, size_t length)
 	return lf;
 }
 
-enum iap_status lpc_iap_call(struct lpc_flash *f, enum iap_cmd cmd, ...)
+/* Run a list of IAP commands with a single stub call.  Returns the status
+ * of the first command that failed, or -1 if the stub did not complete. */
+static enum iap_status lpc_iap_run(struct lpc_flash *f,
+                                   struct iap_frame *frames, unsigned count)
 {
 	target *t = f->f.t;
-	struct flash_param param = {
-		.opcode = ARM_THUMB_BREAKPOINT,
-		.command = cmd,
-	};
+	const size_t stub_size = ALIGN(sizeof(lpc_iap_stub), 4);
+	uint8_t buf[stub_size + IAP_FRAMES_MAX * sizeof(*frames)];
 
-	/* Pet WDT before each IAP call, if it is on */
+	/* Pet WDT before running the IAP calls, if it is on */
 	if (f->wdt_kick)
 		f->wdt_kick(t);
 
+	/* copy the trampoline and command frames to RAM */
+	memcpy(buf, lpc_iap_stub, sizeof(lpc_iap_stub));
+	memcpy(buf + stub_size, frames, count * sizeof(*frames));
+	target_mem_write(t, f->iap_ram, buf, stub_size + count * sizeof(*frames));
+
+	int ret = cortexm_run_stub(t, f->iap_ram, IAP_FRAMES(f), count,
+	                           f->iap_entry, f->iap_msp);
+	if (ret == 0)
+		return IAP_STATUS_CMD_SUCCESS;
+	if (ret != 1)
+		return -1;
+
+	/* copy back the results, the failed command is the first nonzero */
+	target_mem_read(t, frames, IAP_FRAMES(f), count * sizeof(*frames));
+	for (unsigned i = 0; i < count; i++)
+		if (frames[i].result[0])
+			return frames[i].result[0];
+	return -1;
+}
+
+enum iap_status lpc_iap_call(struct lpc_flash *f, enum iap_cmd cmd, ...)
+{
+	struct iap_frame frame = {
+		.command = cmd,
+	};
+
 	/* fill out the remainder of the parameters */
 	va_list ap;
 	va_start(ap, cmd);
 	for (int i = 0; i < 4; i++)
-		param.words[i] = va_arg(ap, uint32_t);
+		frame.params[i] = va_arg(ap, uint32_t);
 	va_end(ap);
 
-	/* copy the structure to RAM */
-	target_mem_write(t, f->iap_ram, &param, sizeof(param));
-
-	/* set up for the call to the IAP ROM */
-	uint32_t regs[t->regs_size / sizeof(uint32_t)];
-	target_regs_read(t, regs);
-	regs[0] = f->iap_ram + offsetof(struct flash_param, command);
-	regs[1] = f->iap_ram + offsetof(struct flash_param, result);
-	regs[REG_MSP] = f->iap_msp;
-	regs[REG_LR] = f->iap_ram | 1;
-	regs[REG_PC] = f->iap_entry;
-	target_regs_write(t, regs);
-
-	/* start the target and wait for it to halt again */
-	target_halt_resume(t, false);
-	while (!target_halt_poll(t, NULL));
-
-	/* copy back just the parameters structure */
-	target_mem_read(t, &param, f->iap_ram, sizeof(param));
-	return param.result;
+	return lpc_iap_run(f, &frame, 1);
 }
 
 static uint8_t lpc_sector_for_addr(struct lpc_flash *f, uint32_t addr)
@@ -100,17 +116,16 @@ int lpc_flash_erase(struct target_flash *tf, target_addr addr, size_t len)
 	uint32_t start = lpc_sector_for_addr(f, addr);
 	uint32_t end = lpc_sector_for_addr(f, addr + len - 1);
 
-	if (lpc_iap_call(f, IAP_CMD_PREPARE, start, end, f->bank))
+	/* prepare, erase and check erase ok */
+	struct iap_frame frames[] = {
+		{.command = IAP_CMD_PREPARE, .params = {start, end, f->bank}},
+		{.command = IAP_CMD_ERASE,
+		 .params = {start, end, CPU_CLK_KHZ, f->bank}},
+		{.command = IAP_CMD_BLANKCHECK, .params = {start, end, f->bank}},
+	};
+	if (lpc_iap_run(f, frames, 3))
 		return -1;
 
-	/* and now erase them */
-	if (lpc_iap_call(f, IAP_CMD_ERASE, start, end, CPU_CLK_KHZ, f->bank))
-		return -2;
-
-	/* check erase ok */
-	if (lpc_iap_call(f, IAP_CMD_BLANKCHECK, start, end, f->bank))
-		return -3;
-
 	return 0;
 }
 
@@ -118,18 +133,20 @@ int lpc_flash_write(struct target_flash *tf,
                     target_addr dest, const void *src, size_t len)
 {
 	struct lpc_flash *f = (struct lpc_flash *)tf;
-	/* prepare... */
 	uint32_t sector = lpc_sector_for_addr(f, dest);
-	if (lpc_iap_call(f, IAP_CMD_PREPARE, sector, sector, f->bank))
-		return -1;
 
 	/* Write payload to target ram */
-	uint32_t bufaddr = ALIGN(f->iap_ram + sizeof(struct flash_param), 4);
+	uint32_t bufaddr = IAP_DATA(f);
 	target_mem_write(f->f.t, bufaddr, src, len);
 
-	/* set the destination address and program */
-	if (lpc_iap_call(f, IAP_CMD_PROGRAM, dest, bufaddr, len, CPU_CLK_KHZ))
-		return -2;
+	/* prepare, then set the destination address and program */
+	struct iap_frame frames[] = {
+		{.command = IAP_CMD_PREPARE, .params = {sector, sector, f->bank}},
+		{.command = IAP_CMD_PROGRAM,
+		 .params = {dest, bufaddr, len, CPU_CLK_KHZ}},
+	};
+	if (lpc_iap_run(f, frames, 2))
+		return -1;
 
 	return 0;
 }
@@ -29,6 +29,9 @@
 static int nrf51_flash_erase(struct target_flash *f, target_addr addr, size_t len);
 static int nrf51_flash_write(struct target_flash *f,
                              target_addr dest, const void *src, size_t len);
+static int nrf51_flash_mass_erase(struct target_flash *f);
+static int nrf51_flash_prepare(struct target_flash *f);
+static int nrf51_flash_done(struct target_flash *f);
 
 static bool nrf51_cmd_erase_all(target *t);
 static bool nrf51_cmd_read_hwid(target *t);
@@ -39,17 +42,17 @@ static bool nrf51_cmd_read_help(target *t);
 static bool nrf51_cmd_read(target *t, int argc, const char *argv[]);
 
 const struct command_s nrf51_cmd_list[] = {
-	{"erase_mass", (cmd_handler)nrf51_cmd_erase_all, "Erase entire flash memory"},
-	{"read", (cmd_handler)nrf51_cmd_read, "Read device parameters"},
-	{NULL, NULL, NULL}
+	{"erase_mass", (cmd_handler)nrf51_cmd_erase_all, "Erase entire flash memory", CMD_HALTED},
+	{"read", (cmd_handler)nrf51_cmd_read, "Read device parameters", 0},
+	{NULL, NULL, NULL, 0}
 };
 const struct command_s nrf51_read_cmd_list[] = {
-	{"help", (cmd_handler)nrf51_cmd_read_help, "Display help for read commands"},
-	{"hwid", (cmd_handler)nrf51_cmd_read_hwid, "Read hardware identification number"},
-	{"fwid", (cmd_handler)nrf51_cmd_read_fwid, "Read pre-loaded firmware ID"},
-	{"deviceid", (cmd_handler)nrf51_cmd_read_deviceid, "Read unique device ID"},
-	{"deviceaddr", (cmd_handler)nrf51_cmd_read_deviceaddr, "Read device address"},
-	{NULL, NULL, NULL}
+	{"help", (cmd_handler)nrf51_cmd_read_help, "Display help for read commands", 0},
+	{"hwid", (cmd_handler)nrf51_cmd_read_hwid, "Read hardware identification number", 0},
+	{"fwid", (cmd_handler)nrf51_cmd_read_fwid, "Read pre-loaded firmware ID", 0},
+	{"deviceid", (cmd_handler)nrf51_cmd_read_deviceid, "Read unique device ID", 0},
+	{"deviceaddr", (cmd_handler)nrf51_cmd_read_deviceaddr, "Read device address", 0},
+	{NULL, NULL, NULL, 0}
 };
 
 /* Non-Volatile Memory Controller (NVMC) Registers */
@@ -77,32 +80,55 @@ const struct command_s nrf51_read_cmd_list[] = {
 
 /* User Information Configuration Registers (UICR) */
 #define NRF51_UICR				0x10001000
+/* Bytes of UICR that ERASEALL clears, up to the last register used */
+#define NRF51_UICR_SIZE				0x100
+#define NRF52832_UICR_SIZE			0x210	/* Through NFCPINS */
+#define NRF52840_UICR_SIZE			0x308	/* Through REGOUT0 */
 
 #define NRF51_PAGE_SIZE 1024
 #define NRF52_PAGE_SIZE 4096
 
 #define SRAM_BASE          0x20000000
-#define STUB_BUFFER_BASE   ALIGN(SRAM_BASE + sizeof(nrf51_flash_write_stub), 4)
+#define STUB_BUFFER_BASE   CORTEXM_STUB_RING_BASE(SRAM_BASE, \
+                           sizeof(nrf51_flash_write_stub), 4)
+#define STUB_BUFFER_SIZE   0x4000
 
 static const uint16_t nrf51_flash_write_stub[] = {
 #include "flashstub/nrf51.stub"
 };
 
-static void nrf51_add_flash(target *t,
-                            uint32_t addr, size_t length, size_t erasesize)
+static const uint16_t nrf51_flash_erase_stub[] = {
+#include "flashstub/nrf51_erase.stub"
+};
+
+struct nrf51_flash {
+	struct target_flash f;
+	size_t uicr_size;	/* UICR put back after a mass erase */
+};
+
+static void nrf51_add_flash(target *t, uint32_t addr, size_t length,
+                            size_t erasesize, size_t uicr_size)
 {
-	struct target_flash *f = calloc(1, sizeof(*f));
+	struct nrf51_flash *nf = target_alloc(sizeof(*nf));
+	struct target_flash *f = &nf->f;
 	f->start = addr;
 	f->length = length;
 	f->blocksize = erasesize;
 	f->erase = nrf51_flash_erase;
 	f->write = nrf51_flash_write;
+	f->combine = true;
+	f->prepare = nrf51_flash_prepare;
+	f->done = nrf51_flash_done;
 	f->align = 4;
 	f->erased = 0xff;
+	/* ERASEALL also erases the UICR, that is put back afterwards */
+	if (addr != NRF51_UICR)
+		f->mass_erase = nrf51_flash_mass_erase;
+	nf->uicr_size = uicr_size;
 	target_add_flash(t, f);
 }
 
-bool nrf51_probe(target *t)
+static bool nrf51_probe(target *t)
 {
 	t->idcode = target_mem_read32(t, NRF51_FICR_CONFIGID) & 0xFFFF;
 
@@ -132,8 +158,9 @@ bool nrf51_probe(target *t)
 	case 0x00D1: /* nRF51822 (rev 3) QFAA H2 */		
 		t->driver = "Nordic nRF51";
 		target_add_ram(t, 0x20000000, 0x4000);
-		nrf51_add_flash(t, 0x00000000, 0x40000, NRF51_PAGE_SIZE);
-		nrf51_add_flash(t, NRF51_UICR, 0x100, 0x100);
+		nrf51_add_flash(t, 0x00000000, 0x40000, NRF51_PAGE_SIZE,
+		                NRF51_UICR_SIZE);
+		nrf51_add_flash(t, NRF51_UICR, 0x100, 0x100, 0);
 		target_add_commands(t, nrf51_cmd_list, "nRF51");
 		return true;
 	case 0x0026: /* nRF51822 (rev 1) QFAB AA */
@@ -146,8 +173,9 @@ bool nrf51_probe(target *t)
 	case 0x007E: /* nRF51422 (rev 3) CDAB A0 */
 		t->driver = "Nordic nRF51";
 		target_add_ram(t, 0x20000000, 0x4000);
-		nrf51_add_flash(t, 0x00000000, 0x20000, NRF51_PAGE_SIZE);
-		nrf51_add_flash(t, NRF51_UICR, 0x100, 0x100);
+		nrf51_add_flash(t, 0x00000000, 0x20000, NRF51_PAGE_SIZE,
+		                NRF51_UICR_SIZE);
+		nrf51_add_flash(t, NRF51_UICR, 0x100, 0x100, 0);
 		target_add_commands(t, nrf51_cmd_list, "nRF51");
 		return true;
 	case 0x0071: /* nRF51422 (rev 3) QFAC AB */
@@ -159,23 +187,26 @@ bool nrf51_probe(target *t)
 	case 0x0088: /* nRF51422 (rev 3) CFAC A0 */
 		t->driver = "Nordic nRF51";
 		target_add_ram(t, 0x20000000, 0x8000);
-		nrf51_add_flash(t, 0x00000000, 0x40000, NRF51_PAGE_SIZE);
-		nrf51_add_flash(t, NRF51_UICR, 0x100, 0x100);
+		nrf51_add_flash(t, 0x00000000, 0x40000, NRF51_PAGE_SIZE,
+		                NRF51_UICR_SIZE);
+		nrf51_add_flash(t, NRF51_UICR, 0x100, 0x100, 0);
 		target_add_commands(t, nrf51_cmd_list, "nRF51");
 		return true;
 	case 0x00AC: /* nRF52832 Preview QFAA BA0 */
 	case 0x00C7: /* nRF52832 Revision 1 QFAA B00 */
 		t->driver = "Nordic nRF52";
 		target_add_ram(t, 0x20000000, 64*1024);
-		nrf51_add_flash(t, 0x00000000, 512*1024, NRF52_PAGE_SIZE);
-		nrf51_add_flash(t, NRF51_UICR, 0x100, 0x100);
+		nrf51_add_flash(t, 0x00000000, 512*1024, NRF52_PAGE_SIZE,
+		                NRF52832_UICR_SIZE);
+		nrf51_add_flash(t, NRF51_UICR, 0x100, 0x100, 0);
 		target_add_commands(t, nrf51_cmd_list, "nRF52");
 		return true;
 	case 0x00EB: /* nRF52840 Preview QIAA AA0 */
 		t->driver = "Nordic nRF52";
 		target_add_ram(t, 0x20000000, 256*1024);
-		nrf51_add_flash(t, 0x00000000, 1024*1024, NRF52_PAGE_SIZE);
-		nrf51_add_flash(t, NRF51_UICR, 0x100, 0x100);
+		nrf51_add_flash(t, 0x00000000, 1024*1024, NRF52_PAGE_SIZE,
+		                NRF52840_UICR_SIZE);
+		nrf51_add_flash(t, NRF51_UICR, 0x100, 0x100, 0);
 		target_add_commands(t, nrf51_cmd_list, "nRF52");
 		return true;
 	}
@@ -183,16 +214,40 @@ bool nrf51_probe(target *t)
 	return false;
 }
 
+CORTEXM_DRIVER(nrf51_probe, JEP106_NORDIC);
+
+/* Code flash and UICR share the NVMC, which an erase leaves read-only, so
+ * both need setting up for writes again.  The erase stub replaces the write
+ * stub, so that is stopped first.
+ */
+static int nrf51_flash_unprepare(target *t)
+{
+	for (struct target_flash *f = t->flash; f; f = f->next)
+		f->ready = false;
+	return cortexm_stub_done(t);
+}
+
 static int nrf51_flash_erase(struct target_flash *f, target_addr addr, size_t len)
 {
 	target *t = f->t;
+
+	if (nrf51_flash_unprepare(t))
+		return -1;
 	/* Enable erase */
 	target_mem_write32(t, NRF51_NVMC_CONFIG, NRF51_NVMC_CONFIG_EEN);
 
 	/* Poll for NVMC_READY */
-	while (target_mem_read32(t, NRF51_NVMC_READY) == 0)
-		if(target_check_error(t))
+	if (target_mem_poll32(t, NRF51_NVMC_READY, 1, 1, 0))
+		return -1;
+
+	/* Leave runs of code flash pages to the stub */
+	if ((addr != NRF51_UICR) && (len > f->blocksize)) {
+		target_mem_write(t, SRAM_BASE, nrf51_flash_erase_stub,
+		                 sizeof(nrf51_flash_erase_stub));
+		if (cortexm_run_stub(t, SRAM_BASE, addr, 0, len, f->blocksize))
 			return -1;
+		len = 0;
+	}
 
 	while (len) {
 		if (addr == NRF51_UICR) { // Special Case
@@ -205,27 +260,18 @@ static int nrf51_flash_erase(struct target_flash *f, target_addr addr, size_t le
 		}
 
 		/* Poll for NVMC_READY */
-		while (target_mem_read32(t, NRF51_NVMC_READY) == 0)
-			if(target_check_error(t))
-				return -1;
+		if (target_mem_poll32(t, NRF51_NVMC_READY, 1, 1, 0))
+			return -1;
 
 		addr += f->blocksize;
 		len -= f->blocksize;
 	}
 
-	/* Return to read-only */
-	target_mem_write32(t, NRF51_NVMC_CONFIG, NRF51_NVMC_CONFIG_REN);
-
-	/* Poll for NVMC_READY */
-	while (target_mem_read32(t, NRF51_NVMC_READY) == 0)
-		if(target_check_error(t))
-			return -1;
-
-	return 0;
+	return nrf51_flash_done(f);
 }
 
-static int nrf51_flash_write(struct target_flash *f,
-                             target_addr dest, const void *src, size_t len)
+/* Enable writes once for the flash session */
+static int nrf51_flash_prepare(struct target_flash *f)
 {
 	target *t = f->t;
 
@@ -233,20 +279,71 @@ static int nrf51_flash_write(struct target_flash *f,
 	target_mem_write32(t, NRF51_NVMC_CONFIG, NRF51_NVMC_CONFIG_WEN);
 
 	/* Poll for NVMC_READY */
-	while (target_mem_read32(t, NRF51_NVMC_READY) == 0)
-		if(target_check_error(t))
-			return -1;
+	return target_mem_poll32(t, NRF51_NVMC_READY, 1, 1, 0);
+}
+
+static int nrf51_flash_write(struct target_flash *f,
+                             target_addr dest, const void *src, size_t len)
+{
+	/* Stream the data to the stub */
+	return cortexm_stub_stream(f->t, nrf51_flash_write_stub,
+	                           sizeof(nrf51_flash_write_stub),
+	                           SRAM_BASE, STUB_BUFFER_BASE, STUB_BUFFER_SIZE,
+	                           dest, src, len, 0);
+}
+
+static int nrf51_flash_done(struct target_flash *f)
+{
+	target *t = f->t;
+
+	if (cortexm_stub_done(t))
+		return -1;
 
-	/* Write stub and data to target ram and call stub */
-	target_mem_write(t, SRAM_BASE, nrf51_flash_write_stub,
-	                 sizeof(nrf51_flash_write_stub));
-	target_mem_write(t, STUB_BUFFER_BASE, src, len);
-	int ret = cortexm_run_stub(t, SRAM_BASE, dest,
-	                           STUB_BUFFER_BASE, len, 0);
 	/* Return to read-only */
 	target_mem_write32(t, NRF51_NVMC_CONFIG, NRF51_NVMC_CONFIG_REN);
 
-	return ret;
+	/* Poll for NVMC_READY */
+	return target_mem_poll32(t, NRF51_NVMC_READY, 1, 1, 0);
+}
+
+/* Erase everything with ERASEALL, putting back the UICR if it wasn't blank.
+ * On nRF52 that includes PSELRESET, APPROTECT and NFCPINS past the
+ * customer words.
+ */
+static int nrf51_flash_mass_erase(struct target_flash *f)
+{
+	target *t = f->t;
+	static uint32_t uicr[NRF52840_UICR_SIZE / 4];
+	int words = ((struct nrf51_flash *)f)->uicr_size / 4;
+	bool blank = true;
+
+	if (nrf51_flash_unprepare(t) ||
+	    target_mem_read(t, uicr, NRF51_UICR, words * 4))
+		return -1;
+	for (int i = 0; i < words; i++)
+		blank &= uicr[i] == 0xffffffff;
+
+	/* Enable erase */
+	target_mem_write32(t, NRF51_NVMC_CONFIG, NRF51_NVMC_CONFIG_EEN);
+	if (target_mem_poll32(t, NRF51_NVMC_READY, 1, 1, 0))
+		return -1;
+
+	target_mem_write32(t, NRF51_NVMC_ERASEALL, 1);
+	if (target_mem_poll32(t, NRF51_NVMC_READY, 1, 1, 0))
+		return -1;
+
+	if (!blank) {
+		target_mem_write32(t, NRF51_NVMC_CONFIG, NRF51_NVMC_CONFIG_WEN);
+		for (int i = 0; i < words; i++) {
+			if (uicr[i] == 0xffffffff)
+				continue;
+			target_mem_write32(t, NRF51_UICR + i * 4, uicr[i]);
+			if (target_mem_poll32(t, NRF51_NVMC_READY, 1, 1, 0))
+				return -1;
+		}
+	}
+
+	return nrf51_flash_done(f);
 }
 
 static bool nrf51_cmd_erase_all(target *t)
@@ -257,17 +354,15 @@ static bool nrf51_cmd_erase_all(target *t)
 	target_mem_write32(t, NRF51_NVMC_CONFIG, NRF51_NVMC_CONFIG_EEN);
 
 	/* Poll for NVMC_READY */
-	while (target_mem_read32(t, NRF51_NVMC_READY) == 0)
-		if(target_check_error(t))
-			return false;
+	if (target_mem_poll32(t, NRF51_NVMC_READY, 1, 1, 0))
+		return false;
 
 	/* Erase all */
 	target_mem_write32(t, NRF51_NVMC_ERASEALL, 1);
 
 	/* Poll for NVMC_READY */
-	while (target_mem_read32(t, NRF51_NVMC_READY) == 0)
-		if(target_check_error(t))
-			return false;
+	if (target_mem_poll32(t, NRF51_NVMC_READY, 1, 1, 0))
+		return false;
 
 	return true;
 }
@@ -27,19 +27,22 @@
 #include "general.h"
 #include "target.h"
 #include "target_internal.h"
+#include "cortexm.h"
 
 static int sam4_flash_erase(struct target_flash *f, target_addr addr, size_t len);
 static int sam3_flash_erase(struct target_flash *f, target_addr addr, size_t len);
 static int sam3x_flash_write(struct target_flash *f, target_addr dest,
                              const void *src, size_t len);
+static int sam3x_flash_prepare(struct target_flash *f);
+static int sam3x_flash_done(struct target_flash *f);
 
 static bool sam3x_cmd_gpnvm_get(target *t);
 static bool sam3x_cmd_gpnvm_set(target *t, int argc, char *argv[]);
 
 const struct command_s sam3x_cmd_list[] = {
-	{"gpnvm_get", (cmd_handler)sam3x_cmd_gpnvm_get, "Get GPVNM value"},
-	{"gpnvm_set", (cmd_handler)sam3x_cmd_gpnvm_set, "Set GPVNM bit"},
-	{NULL, NULL, NULL}
+	{"gpnvm_get", (cmd_handler)sam3x_cmd_gpnvm_get, "Get GPVNM value", CMD_HALTED},
+	{"gpnvm_set", (cmd_handler)sam3x_cmd_gpnvm_set, "Set GPVNM bit", CMD_HALTED},
+	{NULL, NULL, NULL, 0}
 };
 
 /* Enhanced Embedded Flash Controller (EEFC) Register Map */
@@ -122,19 +125,34 @@ struct sam_flash {
 	uint8_t write_cmd;
 };
 
+static const uint16_t sam3x_flash_write_stub[] = {
+#include "flashstub/sam3x.stub"
+};
+
+/* The stub's parameters for each bank follow it, then its ring buffer.
+ * RAM is mapped larger than the smallest parts have, so the ring is kept
+ * small. */
+#define SRAM_BASE		0x20000000
+#define STUB_PARAM_BASE		ALIGN(SRAM_BASE + sizeof(sam3x_flash_write_stub), 4)
+#define STUB_PARAM_SIZE		16
+#define STUB_BUFFER_BASE	(STUB_PARAM_BASE + 2 * STUB_PARAM_SIZE)
+#define STUB_BUFFER_SIZE	0x400
+
 static void sam3_add_flash(target *t,
                            uint32_t eefc_base, uint32_t addr, size_t length)
 {
-	struct sam_flash *sf = calloc(1, sizeof(*sf));
+	struct sam_flash *sf = target_alloc(sizeof(*sf));
 	struct target_flash *f = &sf->f;
 	f->start = addr;
 	f->length = length;
 	f->blocksize = SAM3_PAGE_SIZE;
 	f->erase = sam3_flash_erase;
 	f->write = target_flash_write_buffered;
-	f->done = target_flash_done_buffered;
+	f->done = sam3x_flash_done;
+	f->prepare = sam3x_flash_prepare;
 	f->write_buf = sam3x_flash_write;
 	f->buf_size = SAM3_PAGE_SIZE;
+	f->bank = (t->flash != NULL);	/* second EEFC of two */
 	sf->eefc_base = eefc_base;
 	sf->write_cmd = EEFC_FCR_FCMD_EWP;
 	target_add_flash(t, f);
@@ -143,16 +161,18 @@ static void sam3_add_flash(target *t,
 static void sam4_add_flash(target *t,
                            uint32_t eefc_base, uint32_t addr, size_t length)
 {
-	struct sam_flash *sf = calloc(1, sizeof(*sf));
+	struct sam_flash *sf = target_alloc(sizeof(*sf));
 	struct target_flash *f = &sf->f;
 	f->start = addr;
 	f->length = length;
 	f->blocksize = SAM4_PAGE_SIZE * 8;
 	f->erase = sam4_flash_erase;
 	f->write = target_flash_write_buffered;
-	f->done = target_flash_done_buffered;
+	f->done = sam3x_flash_done;
+	f->prepare = sam3x_flash_prepare;
 	f->write_buf = sam3x_flash_write;
 	f->buf_size = SAM4_PAGE_SIZE;
+	f->bank = (t->flash != NULL);	/* second EEFC of two */
 	sf->eefc_base = eefc_base;
 	sf->write_cmd = EEFC_FCR_FCMD_WP;
 	target_add_flash(t, f);
@@ -183,7 +203,7 @@ static size_t sam_flash_size(uint32_t idcode)
 	return 0;
 }
 
-bool sam3x_probe(target *t)
+static bool sam3x_probe(target *t)
 {
 	t->idcode = target_mem_read32(t, SAM3X_CHIPID_CIDR);
 	size_t size = sam_flash_size(t->idcode);
@@ -251,11 +271,19 @@ bool sam3x_probe(target *t)
 	return false;
 }
 
+CORTEXM_DRIVER(sam3x_probe, JEP106_ATMEL);
+
 static int
 sam3x_flash_cmd(target *t, uint32_t base, uint8_t cmd, uint16_t arg)
 {
 	DEBUG("%s: base = 0x%08"PRIx32" cmd = 0x%02X, arg = 0x%06X\n",
 		__func__, base, cmd, arg);
+	/* The stub leaves its last page write running */
+	if (cortexm_stub_sync(t))
+		return -1;
+	while (!(target_mem_read32(t, EEFC_FSR(base)) & EEFC_FSR_FRDY))
+		if(target_check_error(t))
+			return -1;
 	target_mem_write32(t, EEFC_FCR(base),
 	                   EEFC_FCR_FKEY | cmd | ((uint32_t)arg << 8));
 
@@ -313,19 +341,44 @@ static int sam3_flash_erase(struct target_flash *f, target_addr addr, size_t len
 	return 0;
 }
 
+/* Pass the stub this bank's EEFC, write command and page size */
+static int sam3x_flash_prepare(struct target_flash *f)
+{
+	struct sam_flash *sf = (struct sam_flash *)f;
+	uint32_t param[STUB_PARAM_SIZE / 4] = {
+		sf->eefc_base, EEFC_FCR_FKEY | sf->write_cmd, f->start,
+		(f->buf_size == SAM4_PAGE_SIZE) ? 9 : 8,
+	};
+
+	return target_mem_write(f->t, STUB_PARAM_BASE +
+	                        f->bank * STUB_PARAM_SIZE, param, sizeof(param));
+}
+
+/* Pages are streamed to the stub, which fills the latch buffer with the
+ * next page while the EEFC writes the last. */
 static int sam3x_flash_write(struct target_flash *f, target_addr dest,
                              const void *src, size_t len)
 {
-	target *t = f->t;
-	struct sam_flash *sf = (struct sam_flash *)f;
-	uint32_t base = sf->eefc_base;
-	unsigned chunk = (dest - f->start) / f->buf_size;
+	return cortexm_stub_stream(f->t, sam3x_flash_write_stub,
+	                           sizeof(sam3x_flash_write_stub),
+	                           SRAM_BASE, STUB_BUFFER_BASE, STUB_BUFFER_SIZE,
+	                           dest, src, len,
+	                           STUB_PARAM_BASE + f->bank * STUB_PARAM_SIZE);
+}
 
-	target_mem_write(t, dest, src, len);
-	if(sam3x_flash_cmd(t, base, sf->write_cmd, chunk))
-		return -1;
+static int sam3x_flash_done(struct target_flash *f)
+{
+	target *t = f->t;
+	uint32_t base = ((struct sam_flash *)f)->eefc_base;
+	int ret = target_flash_done_buffered(f);
 
-	return 0;
+	ret |= cortexm_stub_done(t);
+	/* Check the page write the stub left running */
+	uint32_t sr;
+	while (!((sr = target_mem_read32(t, EEFC_FSR(base))) & EEFC_FSR_FRDY))
+		if (target_check_error(t))
+			return -1;
+	return ret | (sr & EEFC_FSR_ERROR);
 }
 
 static bool sam3x_cmd_gpnvm_get(target *t)
@@ -168,7 +168,7 @@ static const size_t __nvp_size[16] = {
  */
 static void sam4l_add_flash(target *t, uint32_t addr, size_t length)
 {
-	struct target_flash *f = calloc(1, sizeof(struct target_flash));
+	struct target_flash *f = target_alloc(sizeof(struct target_flash));
 	f->start = addr;
 	f->length = length;
 	f->blocksize = SAM4L_PAGE_SIZE;
@@ -221,7 +221,7 @@ static size_t sam_nvp_size(uint32_t idcode) {
  *
  * Figure out from the register how much RAM and FLASH this variant has.
  */
-bool sam4l_probe(target *t)
+static bool sam4l_probe(target *t)
 {
 	size_t	ram_size, flash_size;
 
@@ -250,6 +250,8 @@ bool sam4l_probe(target *t)
 	return false;
 }
 
+CORTEXM_DRIVER(sam4l_probe, JEP106_ATMEL);
+
 /*
  * We've been reset, make sure we take the core out of reset
  */
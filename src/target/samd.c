@@ -40,6 +40,13 @@
 static int samd_flash_erase(struct target_flash *t, target_addr addr, size_t len);
 static int samd_flash_write(struct target_flash *f,
                             target_addr dest, const void *src, size_t len);
+static int samd_flash_done(struct target_flash *f);
+static int samd_flash_mass_erase(struct target_flash *f);
+static int samd_crc32_ieee(target *t, uint32_t *crc, target_addr base,
+                           size_t len);
+
+static bool samd_clock_boost(target *t);
+static void samd_clock_restore(target *t);
 
 static bool samd_cmd_erase_all(target *t);
 static bool samd_cmd_lock_flash(target *t);
@@ -50,14 +57,14 @@ static bool samd_cmd_mbist(target *t);
 static bool samd_cmd_ssb(target *t);
 
 const struct command_s samd_cmd_list[] = {
-	{"erase_mass", (cmd_handler)samd_cmd_erase_all, "Erase entire flash memory"},
-	{"lock_flash", (cmd_handler)samd_cmd_lock_flash, "Locks flash against spurious commands"},
-	{"unlock_flash", (cmd_handler)samd_cmd_unlock_flash, "Unlocks flash"},
-	{"user_row", (cmd_handler)samd_cmd_read_userrow, "Prints user row from flash"},
-	{"serial", (cmd_handler)samd_cmd_serial, "Prints serial number"},
-	{"mbist", (cmd_handler)samd_cmd_mbist, "Runs the built-in memory test"},
-	{"set_security_bit", (cmd_handler)samd_cmd_ssb, "Sets the Security Bit"},
-	{NULL, NULL, NULL}
+	{"erase_mass", (cmd_handler)samd_cmd_erase_all, "Erase entire flash memory", CMD_HALTED},
+	{"lock_flash", (cmd_handler)samd_cmd_lock_flash, "Locks flash against spurious commands", CMD_HALTED},
+	{"unlock_flash", (cmd_handler)samd_cmd_unlock_flash, "Unlocks flash", CMD_HALTED},
+	{"user_row", (cmd_handler)samd_cmd_read_userrow, "Prints user row from flash", 0},
+	{"serial", (cmd_handler)samd_cmd_serial, "Prints serial number", 0},
+	{"mbist", (cmd_handler)samd_cmd_mbist, "Runs the built-in memory test", CMD_HALTED},
+	{"set_security_bit", (cmd_handler)samd_cmd_ssb, "Sets the Security Bit", CMD_HALTED},
+	{NULL, NULL, NULL, 0}
 };
 
 /* Non-Volatile Memory Controller (NVMC) Parameters */
@@ -91,13 +98,46 @@ const struct command_s samd_cmd_list[] = {
 /* Interrupt Flag Register (INTFLAG) */
 #define SAMD_NVMC_READY			(1 << 0)
 
+/* Control B Register (CTRLB) */
+#define SAMD_CTRLB_RWS_MASK		(0xf << 1)
+#define SAMD_CTRLB_RWS(x)		((x) << 1)
+
 /* Non-Volatile Memory Calibration and Auxiliary Registers */
 #define SAMD_NVM_USER_ROW_LOW		0x00804000
 #define SAMD_NVM_USER_ROW_HIGH		0x00804004
 #define SAMD_NVM_CALIBRATION		0x00806020
+#define SAMD_NVM_DFLL_COARSE		(SAMD_NVM_CALIBRATION + 0x4)
+#define SAMD_NVM_DFLL_FINE		(SAMD_NVM_CALIBRATION + 0x8)
 #define SAMD_NVM_SERIAL(n)		(0x0080A00C + (0x30 * ((n + 3) / 4)) + \
 					 (0x4 * n))
 
+/* -------------------------------------------------------------------------- */
+/* System Controller (SYSCTRL) and Generic Clock Controller (GCLK) */
+/* -------------------------------------------------------------------------- */
+
+#define SAMD_SYSCTRL			0x40000800
+#define SAMD_SYSCTRL_PCLKSR		(SAMD_SYSCTRL + 0x0C)
+#define SAMD_SYSCTRL_DFLLCTRL		(SAMD_SYSCTRL + 0x24)
+#define SAMD_SYSCTRL_DFLLVAL		(SAMD_SYSCTRL + 0x28)
+
+#define SAMD_PCLKSR_DFLLRDY		(1 << 4)
+#define SAMD_DFLLCTRL_ENABLE		(1 << 1)
+#define SAMD_DFLLVAL(coarse, fine)	(((coarse) << 10) | (fine))
+
+#define SAMD_GCLK			0x40000C00
+#define SAMD_GCLK_GENCTRL		(SAMD_GCLK + 0x4)
+#define SAMD_GCLK_GENDIV		(SAMD_GCLK + 0x8)
+
+/* SYNCBUSY of the STATUS byte, read as part of the first word */
+#define SAMD_GCLK_SYNCBUSY		(1 << 15)
+#define SAMD_GCLK_GENCTRL_SRC_MASK	(0x1f << 8)
+#define SAMD_GCLK_GENCTRL_SRC_OSC8M	(0x06 << 8)
+#define SAMD_GCLK_GENCTRL_SRC_DFLL48M	(0x07 << 8)
+#define SAMD_GCLK_GENCTRL_DIVSEL	(1 << 20)
+#define SAMD_GCLK_GENDIV_DIV(x)		((x) << 8)
+
+#define SAMD_CLOCK_TIMEOUT		10
+
 /* -------------------------------------------------------------------------- */
 /* Device Service Unit (DSU) Registers */
 /* -------------------------------------------------------------------------- */
@@ -113,6 +153,8 @@ const struct command_s samd_cmd_list[] = {
 #define SAMD_DSU_CID(n)			(SAMD_DSU + 0x1FF0 + \
 					 (0x4 * (n % 4)))
 
+#define SAMD_DSU_DATA			(SAMD_DSU_EXT_ACCESS + 0xC)
+
 /* Control and Status Register (CTRLSTAT) */
 #define SAMD_CTRL_CHIP_ERASE		(1 << 4)
 #define SAMD_CTRL_MBIST			(1 << 3)
@@ -343,22 +385,37 @@ struct samd_descr samd_parse_device_id(uint32_t did)
 	return samd;
 }
 
+static const uint16_t samd_flash_write_stub[] = {
+#include "flashstub/samd.stub"
+};
+
+#define SRAM_BASE 0x20000000
+#define STUB_BUFFER_BASE ALIGN(SRAM_BASE + sizeof(samd_flash_write_stub), 4)
+/* Size of each half of the double buffer at STUB_BUFFER_BASE */
+#define STUB_BUFFER_SIZE (2 * SAMD_ROW_SIZE)
+
+/* The flash is split into 16 lock regions */
+#define SAMD_LOCK_REGIONS 16
+
 static void samd_add_flash(target *t, uint32_t addr, size_t length)
 {
-	struct target_flash *f = calloc(1, sizeof(*f));
+	struct target_flash *f = target_alloc(sizeof(*f));
 	f->start = addr;
 	f->length = length;
 	f->blocksize = SAMD_ROW_SIZE;
 	f->erase = samd_flash_erase;
 	f->write = target_flash_write_buffered;
-	f->done = target_flash_done_buffered;
+	f->done = samd_flash_done;
 	f->write_buf = samd_flash_write;
-	f->buf_size = SAMD_PAGE_SIZE;
+	f->buf_size = STUB_BUFFER_SIZE;
+	f->buf_page = SAMD_PAGE_SIZE;
+	f->erased = 0xff;
+	f->mass_erase = samd_flash_mass_erase;
 	target_add_flash(t, f);
 }
 
 char variant_string[40];
-bool samd_probe(target *t)
+static bool samd_probe(target *t)
 {
 	uint32_t cid = samd_read_cid(t);
 	uint32_t pid = samd_read_pid(t);
@@ -397,6 +454,9 @@ bool samd_probe(target *t)
 	/* Setup Target */
 	t->driver = variant_string;
 	t->reset = samd_reset;
+	t->crc32_ieee = samd_crc32_ieee;
+	t->clock_boost = samd_clock_boost;
+	t->clock_restore = samd_clock_restore;
 
 	if (samd.series == 20 && samd.revision == 'B') {
 		/**
@@ -438,6 +498,100 @@ bool samd_probe(target *t)
 	return true;
 }
 
+CORTEXM_DRIVER(samd_probe, JEP106_ATMEL);
+
+static bool samd_gclk_sync(target *t)
+{
+	return !target_mem_poll32(t, SAMD_GCLK, SAMD_GCLK_SYNCBUSY, 0,
+	                          SAMD_CLOCK_TIMEOUT);
+}
+
+static bool samd_dfll_ready(target *t)
+{
+	return !target_mem_poll32(t, SAMD_SYSCTRL_PCLKSR, SAMD_PCLKSR_DFLLRDY,
+	                          SAMD_PCLKSR_DFLLRDY, SAMD_CLOCK_TIMEOUT);
+}
+
+/**
+ * Generator 0 is moved from OSC8M to the DFLL48M in open loop, from its
+ * factory calibration, and halved to keep clear of the 48MHz limit.
+ * Nothing is changed if the application already uses the DFLL or has
+ * moved the core off OSC8M.
+ */
+static bool samd_clock_boost(target *t)
+{
+	struct samd_descr samd =
+		samd_parse_device_id(target_mem_read32(t, SAMD_DSU_DID));
+	uint32_t coarse = target_mem_read32(t, SAMD_NVM_DFLL_COARSE) >> 26;
+	uint32_t fine = target_mem_read32(t, SAMD_NVM_DFLL_FINE) & 0x3ff;
+
+	/* Generator registers are read by writing the generator first */
+	target_mem_write8(t, SAMD_GCLK_GENCTRL, 0);
+	uint32_t genctrl = target_mem_read32(t, SAMD_GCLK_GENCTRL);
+	target_mem_write8(t, SAMD_GCLK_GENDIV, 0);
+	uint32_t gendiv = target_mem_read32(t, SAMD_GCLK_GENDIV);
+	uint16_t dfllctrl = target_mem_read16(t, SAMD_SYSCTRL_DFLLCTRL);
+	uint16_t dfllval = target_mem_read16(t, SAMD_SYSCTRL_DFLLVAL);
+	uint32_t ctrlb = target_mem_read32(t, SAMD_NVMC_CTRLB);
+
+	if (target_check_error(t) || (dfllctrl & SAMD_DFLLCTRL_ENABLE) ||
+	    ((genctrl & SAMD_GCLK_GENCTRL_SRC_MASK) !=
+	     SAMD_GCLK_GENCTRL_SRC_OSC8M))
+		return false;
+	/* Unprogrammed, or not calibrated on the SAM D20 */
+	if (coarse == 0x3f)
+		coarse = 0x1f;
+	if ((samd.series == 20) || (fine == 0x3ff))
+		fine = 0x200;
+
+	t->clock_saved[0] = genctrl;
+	t->clock_saved[1] = gendiv;
+	t->clock_saved[2] = dfllctrl | (dfllval << 16);
+	t->clock_saved[3] = ctrlb;
+
+	/* ONDEMAND must be off before DFLLVAL is written, errata 9905 */
+	target_mem_write16(t, SAMD_SYSCTRL_DFLLCTRL, 0);
+	if (samd_dfll_ready(t)) {
+		target_mem_write16(t, SAMD_SYSCTRL_DFLLVAL,
+		                   SAMD_DFLLVAL(coarse, fine));
+		target_mem_write16(t, SAMD_SYSCTRL_DFLLCTRL,
+		                   SAMD_DFLLCTRL_ENABLE);
+	}
+	if (samd_dfll_ready(t)) {
+		target_mem_write32(t, SAMD_NVMC_CTRLB,
+		                   (ctrlb & ~SAMD_CTRLB_RWS_MASK) |
+		                   SAMD_CTRLB_RWS(1));
+		target_mem_write32(t, SAMD_GCLK_GENDIV,
+		                   SAMD_GCLK_GENDIV_DIV(2));
+		genctrl &= ~(SAMD_GCLK_GENCTRL_SRC_MASK |
+		             SAMD_GCLK_GENCTRL_DIVSEL);
+		if (samd_gclk_sync(t)) {
+			target_mem_write32(t, SAMD_GCLK_GENCTRL, genctrl |
+			                   SAMD_GCLK_GENCTRL_SRC_DFLL48M);
+			if (samd_gclk_sync(t))
+				return true;
+		}
+	}
+	samd_clock_restore(t);
+	return false;
+}
+
+/**
+ * Back on OSC8M before the wait states and the DFLL are put back
+ */
+static void samd_clock_restore(target *t)
+{
+	target_mem_write32(t, SAMD_GCLK_GENCTRL, t->clock_saved[0]);
+	samd_gclk_sync(t);
+	target_mem_write32(t, SAMD_GCLK_GENDIV, t->clock_saved[1]);
+	samd_gclk_sync(t);
+	target_mem_write32(t, SAMD_NVMC_CTRLB, t->clock_saved[3]);
+	target_mem_write16(t, SAMD_SYSCTRL_DFLLCTRL, 0);
+	samd_dfll_ready(t);
+	target_mem_write16(t, SAMD_SYSCTRL_DFLLVAL, t->clock_saved[2] >> 16);
+	target_mem_write16(t, SAMD_SYSCTRL_DFLLCTRL, t->clock_saved[2]);
+}
+
 /**
  * Temporary (until next reset) flash memory locking / unlocking
  */
@@ -460,6 +614,10 @@ static void samd_unlock_current_address(target *t)
 static int samd_flash_erase(struct target_flash *f, target_addr addr, size_t len)
 {
 	target *t = f->t;
+
+	if (cortexm_stub_sync(t))
+		return -1;
+
 	while (len) {
 		/* Write address of first word in row to erase it */
 		/* Must be shifted right for 16-bit address, see Datasheet §20.8.8 Address */
@@ -472,9 +630,8 @@ static int samd_flash_erase(struct target_flash *f, target_addr addr, size_t len
 		target_mem_write32(t, SAMD_NVMC_CTRLA,
 		                   SAMD_CTRLA_CMD_KEY | SAMD_CTRLA_CMD_ERASEROW);
 		/* Poll for NVM Ready */
-		while ((target_mem_read32(t, SAMD_NVMC_INTFLAG) & SAMD_NVMC_READY) == 0)
-			if (target_check_error(t))
-				return -1;
+		if (target_mem_poll32(t, SAMD_NVMC_INTFLAG, SAMD_NVMC_READY, SAMD_NVMC_READY, 0))
+			return -1;
 
 		/* Lock */
 		samd_lock_current_address(t);
@@ -487,38 +644,62 @@ static int samd_flash_erase(struct target_flash *f, target_addr addr, size_t len
 }
 
 /**
- * Write flash page by page
+ * Write flash with the stub, a buffer of whole pages at a time
  */
 static int samd_flash_write(struct target_flash *f,
                             target_addr dest, const void *src, size_t len)
 {
-	target *t = f->t;
+	return cortexm_stub_write(f->t, samd_flash_write_stub,
+	                          sizeof(samd_flash_write_stub),
+	                          SRAM_BASE, STUB_BUFFER_BASE, STUB_BUFFER_SIZE,
+	                          dest, src, len,
+	                          f->length / SAMD_LOCK_REGIONS);
+}
 
-	/* Write within a single page. This may be part or all of the page */
-	target_mem_write(t, dest, src, len);
+static int samd_flash_done(struct target_flash *f)
+{
+	int ret = target_flash_done_buffered(f);
 
-	/* Unlock */
-	samd_unlock_current_address(t);
+	return cortexm_stub_done(f->t) | ret;
+}
 
-	/* Issue the write page command */
-	target_mem_write32(t, SAMD_NVMC_CTRLA,
-	                   SAMD_CTRLA_CMD_KEY | SAMD_CTRLA_CMD_WRITEPAGE);
+/**
+ * Uses the Device Service Unit to checksum memory, without the core
+ */
+static int samd_crc32_ieee(target *t, uint32_t *crc, target_addr base,
+                           size_t len)
+{
+	uint32_t status;
 
-	/* Poll for NVM Ready */
-	while ((target_mem_read32(t, SAMD_NVMC_INTFLAG) & SAMD_NVMC_READY) == 0)
+	if ((base | len) & 3)
+		return -1;
+
+	/* Clear the DSU status bits */
+	target_mem_write32(t, SAMD_DSU_CTRLSTAT,
+	                   SAMD_STATUSA_DONE | SAMD_STATUSA_BERR);
+
+	target_mem_write32(t, SAMD_DSU_ADDRESS, base);
+	target_mem_write32(t, SAMD_DSU_LENGTH, len);
+	target_mem_write32(t, SAMD_DSU_DATA, *crc);
+	target_mem_write32(t, SAMD_DSU_CTRLSTAT, SAMD_CTRL_CRC);
+
+	/* Poll for DSU Ready */
+	while (((status = target_mem_read32(t, SAMD_DSU_CTRLSTAT)) &
+		(SAMD_STATUSA_DONE | SAMD_STATUSA_BERR)) == 0)
 		if (target_check_error(t))
 			return -1;
 
-	/* Lock */
-	samd_lock_current_address(t);
+	if (status & SAMD_STATUSA_BERR)
+		return -1;
 
+	*crc = target_mem_read32(t, SAMD_DSU_DATA);
 	return 0;
 }
 
 /**
  * Uses the Device Service Unit to erase the entire flash
  */
-static bool samd_cmd_erase_all(target *t)
+static bool samd_chip_erase(target *t, uint32_t *status)
 {
 	/* Clear the DSU status bits */
 	target_mem_write32(t, SAMD_DSU_CTRLSTAT,
@@ -529,12 +710,32 @@ static bool samd_cmd_erase_all(target *t)
 	target_mem_write32(t, SAMD_DSU_CTRLSTAT, SAMD_CTRL_CHIP_ERASE);
 
 	/* Poll for DSU Ready */
-	uint32_t status;
-	while (((status = target_mem_read32(t, SAMD_DSU_CTRLSTAT)) &
+	while (((*status = target_mem_read32(t, SAMD_DSU_CTRLSTAT)) &
 		(SAMD_STATUSA_DONE | SAMD_STATUSA_PERR | SAMD_STATUSA_FAIL)) == 0)
 		if (target_check_error(t))
 			return false;
 
+	return true;
+}
+
+static int samd_flash_mass_erase(struct target_flash *f)
+{
+	uint32_t status;
+
+	if (cortexm_stub_sync(f->t) ||
+	    !samd_chip_erase(f->t, &status) ||
+	    (status & (SAMD_STATUSA_PERR | SAMD_STATUSA_FAIL)))
+		return -1;
+	return 0;
+}
+
+static bool samd_cmd_erase_all(target *t)
+{
+	uint32_t status;
+
+	if (!samd_chip_erase(t, &status))
+		return false;
+
 	/* Test the protection error bit in Status A */
 	if (status & SAMD_STATUSA_PERR) {
 		tc_printf(t, "Erase failed due to a protection error.\n");
@@ -573,9 +774,8 @@ static bool samd_set_flashlock(target *t, uint16_t value)
 	                   SAMD_CTRLA_CMD_KEY | SAMD_CTRLA_CMD_ERASEAUXROW);
 
 	/* Poll for NVM Ready */
-	while ((target_mem_read32(t, SAMD_NVMC_INTFLAG) & SAMD_NVMC_READY) == 0)
-		if (target_check_error(t))
-			return -1;
+	if (target_mem_poll32(t, SAMD_NVMC_INTFLAG, SAMD_NVMC_READY, SAMD_NVMC_READY, 0))
+		return -1;
 
 	/* Modify the high byte of the user row */
 	high = (high & 0x0000FFFF) | ((value << 16) & 0xFFFF0000);
@@ -689,9 +889,8 @@ static bool samd_cmd_ssb(target *t)
 	                   SAMD_CTRLA_CMD_KEY | SAMD_CTRLA_CMD_SSB);
 
 	/* Poll for NVM Ready */
-	while ((target_mem_read32(t, SAMD_NVMC_INTFLAG) & SAMD_NVMC_READY) == 0)
-		if (target_check_error(t))
-			return -1;
+	if (target_mem_poll32(t, SAMD_NVMC_INTFLAG, SAMD_NVMC_READY, SAMD_NVMC_READY, 0))
+		return -1;
 
 	tc_printf(t, "Set the security bit! "
 		  "You will need to issue 'monitor erase_mass' to clear this.\n");
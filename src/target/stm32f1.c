@@ -32,6 +32,10 @@
  *   Reference manual - STM32F030x4/x6/x8/xC and STM32F070x6/xB
  * ST doc - PM0075
  *   Programming manual - STM32F10xxx Flash memory microcontrollers
+ *
+ * XL density parts have a second bank with its own controller.  Both
+ * banks are erased at the same time, and the second is erased while the
+ * stub is still programming the first.
  */
 
 #include "general.h"
@@ -43,9 +47,9 @@ static bool stm32f1_cmd_erase_mass(target *t);
 static bool stm32f1_cmd_option(target *t, int argc, char *argv[]);
 
 const struct command_s stm32f1_cmd_list[] = {
-	{"erase_mass", (cmd_handler)stm32f1_cmd_erase_mass, "Erase entire flash memory"},
-	{"option", (cmd_handler)stm32f1_cmd_option, "Manipulate option bytes"},
-	{NULL, NULL, NULL}
+	{"erase_mass", (cmd_handler)stm32f1_cmd_erase_mass, "Erase entire flash memory", CMD_HALTED},
+	{"option", (cmd_handler)stm32f1_cmd_option, "Manipulate option bytes", CMD_HALTED},
+	{NULL, NULL, NULL, 0}
 };
 
 
@@ -53,6 +57,11 @@ static int stm32f1_flash_erase(struct target_flash *f,
                                target_addr addr, size_t len);
 static int stm32f1_flash_write(struct target_flash *f,
                                target_addr dest, const void *src, size_t len);
+static int stm32f1_flash_prepare(struct target_flash *f);
+static int stm32f1_flash_done(struct target_flash *f);
+static int stm32f1_flash_mass_erase(struct target_flash *f);
+static bool stm32f1_clock_boost(target *t);
+static void stm32f1_clock_restore(target *t);
 
 /* Flash Program ad Erase Controller Register Map */
 #define FPEC_BASE	0x40022000
@@ -64,8 +73,14 @@ static int stm32f1_flash_write(struct target_flash *f,
 #define FLASH_AR	(FPEC_BASE+0x14)
 #define FLASH_OBR	(FPEC_BASE+0x1C)
 #define FLASH_WRPR	(FPEC_BASE+0x20)
+/* KEYR, SR, CR and AR of the second bank are this far on */
+#define FLASH_BANK2	0x40
+#define FLASH_BANK_SIZE	0x80000
+
+#define FLASH_ACR_LATENCY_MASK	0x7
 
 #define FLASH_CR_OBL_LAUNCH (1<<13)
+#define FLASH_CR_LOCK	(1 << 7)
 #define FLASH_CR_OPTWRE	(1 << 9)
 #define FLASH_CR_STRT	(1 << 6)
 #define FLASH_CR_OPTER	(1 << 5)
@@ -87,6 +102,27 @@ static int stm32f1_flash_write(struct target_flash *f,
 #define SR_ERROR_MASK	0x14
 #define SR_EOP		0x20
 
+/* Reset and clock control, the same on F0, F1 and F3 */
+#define RCC_BASE	0x40021000
+#define RCC_CR		(RCC_BASE+0x00)
+#define RCC_CFGR	(RCC_BASE+0x04)
+
+#define RCC_CR_PLLON	(1 << 24)
+#define RCC_CR_PLLRDY	(1 << 25)
+
+#define RCC_CFGR_SW_MASK	0x3
+#define RCC_CFGR_SW_PLL		0x2
+#define RCC_CFGR_SWS_MASK	0xc
+#define RCC_CFGR_SWS_PLL	0x8
+#define RCC_CFGR_HPRE_MASK	0xf0
+/* PLLMUL, PLLXTPRE and PLLSRC, 0 is HSI/2 times 2 */
+#define RCC_CFGR_PLL_MASK	(0x3f << 16)
+/* Low bit of PLLSRC on F0 and F303xD/E, ADCPRE on F1 */
+#define RCC_CFGR_PLLSRC0	(1 << 15)
+#define RCC_CFGR_PLLMUL(x)	(((x) - 2) << 18)
+
+#define CLOCK_TIMEOUT	10
+
 #define DBGMCU_IDCODE	0xE0042000
 #define DBGMCU_IDCODE_F0	0x40015800
 
@@ -98,23 +134,43 @@ static const uint16_t stm32f1_flash_write_stub[] = {
 };
 
 #define SRAM_BASE 0x20000000
-#define STUB_BUFFER_BASE ALIGN(SRAM_BASE + sizeof(stm32f1_flash_write_stub), 4)
+#define STUB_BUFFER_BASE \
+	CORTEXM_STUB_RING_BASE(SRAM_BASE, sizeof(stm32f1_flash_write_stub), 4)
+/* The RAM map is that of the largest part of each line, so the ring is
+ * kept small */
+#define STUB_BUFFER_SIZE 0x400
+
+struct stm32f1_flash {
+	struct target_flash f;
+	/* Start of the second bank, passed to the stub, or -1 */
+	target_addr bank2_start;
+};
 
 static void stm32f1_add_flash(target *t,
                               uint32_t addr, size_t length, size_t erasesize)
 {
-	struct target_flash *f = calloc(1, sizeof(*f));
+	struct stm32f1_flash *sf = target_alloc(sizeof(*sf));
+	struct target_flash *f = &sf->f;
 	f->start = addr;
 	f->length = length;
 	f->blocksize = erasesize;
 	f->erase = stm32f1_flash_erase;
 	f->write = stm32f1_flash_write;
+	f->combine = true;
+	f->prepare = stm32f1_flash_prepare;
+	f->done = stm32f1_flash_done;
+	f->mass_erase = stm32f1_flash_mass_erase;
 	f->align = 2;
 	f->erased = 0xff;
+	sf->bank2_start = -1;
+	if (length > FLASH_BANK_SIZE)
+		sf->bank2_start = addr + FLASH_BANK_SIZE;
 	target_add_flash(t, f);
+	t->clock_boost = stm32f1_clock_boost;
+	t->clock_restore = stm32f1_clock_restore;
 }
 
-bool stm32f1_probe(target *t)
+static bool stm32f1_probe(target *t)
 {
 	size_t flash_size;
 	size_t block_size = 0x400;
@@ -136,6 +192,13 @@ bool stm32f1_probe(target *t)
 		stm32f1_add_flash(t, 0x8000000, 0x80000, 0x800);
 		target_add_commands(t, stm32f1_cmd_list, "STM32 HD/CL");
 		return true;
+	case 0x430:  /* XL density */
+		t->driver = "STM32F1 XL density";
+		flash_size = (target_mem_read32(t, FLASHSIZE) & 0xffff) * 0x400;
+		target_add_ram(t, 0x20000000, 0x18000);
+		stm32f1_add_flash(t, 0x8000000, flash_size, 0x800);
+		target_add_commands(t, stm32f1_cmd_list, "STM32 XL");
+		return true;
 	case 0x422:  /* STM32F30x */
 	case 0x432:  /* STM32F37x */
 	case 0x438:  /* STM32F303x6/8 and STM32F328 */
@@ -178,77 +241,209 @@ bool stm32f1_probe(target *t)
 	return true;
 }
 
+CORTEXM_DRIVER(stm32f1_probe, JEP106_ST);
+
+/* The PLL is run from HSI/2, to 24 MHz on value line parts and 36 MHz with
+ * one wait state on the others.  This is left alone if the application
+ * has already moved off the reset clock. */
+static bool stm32f1_clock_boost(target *t)
+{
+	uint32_t cr = target_mem_read32(t, RCC_CR);
+	uint32_t cfgr = target_mem_read32(t, RCC_CFGR);
+	uint32_t acr = target_mem_read32(t, FLASH_ACR);
+	uint32_t pll_mask = RCC_CFGR_PLL_MASK;
+	unsigned mul = 9, latency = 1;
+
+	if (target_check_error(t) || (cr & RCC_CR_PLLON) ||
+	    (cfgr & (RCC_CFGR_SWS_MASK | RCC_CFGR_HPRE_MASK)))
+		return false;
+	switch (t->idcode) {
+	case 0x420:  /* Value Line */
+	case 0x428:
+		mul = 6;
+		latency = 0;
+		break;
+	case 0x440:  /* STM32F0 */
+	case 0x442:
+	case 0x444:
+	case 0x445:
+	case 0x448:
+	case 0x446:  /* STM32F303xD/E */
+		pll_mask |= RCC_CFGR_PLLSRC0;
+		break;
+	}
+
+	t->clock_saved[0] = cfgr;
+	t->clock_saved[1] = acr;
+	/* More wait states before the clock goes up */
+	target_mem_write32(t, FLASH_ACR,
+	                   (acr & ~FLASH_ACR_LATENCY_MASK) | latency);
+	cfgr = (cfgr & ~pll_mask) | RCC_CFGR_PLLMUL(mul);
+	target_mem_write32(t, RCC_CFGR, cfgr);
+	target_mem_write32(t, RCC_CR, cr | RCC_CR_PLLON);
+	if (!target_mem_poll32(t, RCC_CR, RCC_CR_PLLRDY, RCC_CR_PLLRDY,
+	                       CLOCK_TIMEOUT)) {
+		target_mem_write32(t, RCC_CFGR, cfgr | RCC_CFGR_SW_PLL);
+		if (!target_mem_poll32(t, RCC_CFGR, RCC_CFGR_SWS_MASK,
+		                       RCC_CFGR_SWS_PLL, CLOCK_TIMEOUT))
+			return true;
+	}
+	stm32f1_clock_restore(t);
+	return false;
+}
+
+/* Back on HSI before the PLL and wait states are put back */
+static void stm32f1_clock_restore(target *t)
+{
+	uint32_t cfgr = target_mem_read32(t, RCC_CFGR);
+
+	target_mem_write32(t, RCC_CFGR, cfgr & ~RCC_CFGR_SW_MASK);
+	target_mem_poll32(t, RCC_CFGR, RCC_CFGR_SWS_MASK, 0, CLOCK_TIMEOUT);
+	target_mem_write32(t, RCC_CR,
+	                   target_mem_read32(t, RCC_CR) & ~RCC_CR_PLLON);
+	target_mem_write32(t, RCC_CFGR, t->clock_saved[0]);
+	target_mem_write32(t, FLASH_ACR, t->clock_saved[1]);
+}
+
 static void stm32f1_flash_unlock(target *t)
 {
 	target_mem_write32(t, FLASH_KEYR, KEY1);
 	target_mem_write32(t, FLASH_KEYR, KEY2);
 }
 
+static bool stm32f1_dual_bank(target *t)
+{
+	return t->idcode == 0x430;
+}
+
+/* Only unlock if locked, a second key sequence locks it until reset */
+static void stm32f1_bank_unlock(target *t, uint32_t bank)
+{
+	if (target_mem_read32(t, FLASH_CR + bank) & FLASH_CR_LOCK) {
+		target_mem_write32(t, FLASH_KEYR + bank, KEY1);
+		target_mem_write32(t, FLASH_KEYR + bank, KEY2);
+	}
+}
+
+static bool stm32f1_bank_error(target *t, uint32_t bank)
+{
+	uint16_t sr = target_mem_read32(t, FLASH_SR + bank);
+	return (sr & SR_ERROR_MASK) || !(sr & SR_EOP);
+}
+
 static int stm32f1_flash_erase(struct target_flash *f,
                                target_addr addr, size_t len)
 {
 	target *t = f->t;
-	uint16_t sr;
-
-	stm32f1_flash_unlock(t);
-
-	while(len) {
-		/* Flash page erase instruction */
-		target_mem_write32(t, FLASH_CR, FLASH_CR_PER);
-		/* write address to FMA */
-		target_mem_write32(t, FLASH_AR, addr);
-		/* Flash page erase start instruction */
-		target_mem_write32(t, FLASH_CR, FLASH_CR_STRT | FLASH_CR_PER);
+	struct stm32f1_flash *sf = (struct stm32f1_flash *)f;
+	const uint32_t bank[2] = {0, FLASH_BANK2};
+	/* The pages left in each bank */
+	target_addr next[2] = {addr, MAX(addr, sf->bank2_start)};
+	target_addr end[2] = {MIN(addr + len, sf->bank2_start), addr + len};
+
+	/* The stub can go on programming the first bank only */
+	target_addr stream = cortexm_stub_stream_end(t);
+	if (((next[0] < end[0]) || (stream > sf->bank2_start)) &&
+	    cortexm_stub_sync(t))
+		return -1;
 
-		/* Read FLASH_SR to poll for BSY bit */
-		while (target_mem_read32(t, FLASH_SR) & FLASH_SR_BSY)
-			if(target_check_error(t))
+	for (int b = 0; b < 2; b++)
+		if (next[b] < end[b])
+			stm32f1_bank_unlock(t, bank[b]);
+
+	/* A page at a time in each bank, the banks side by side */
+	while ((next[0] < end[0]) || (next[1] < end[1])) {
+		for (int b = 0; b < 2; b++) {
+			if (next[b] >= end[b])
+				continue;
+			/* Flash page erase instruction */
+			target_mem_write32(t, FLASH_CR + bank[b], FLASH_CR_PER);
+			/* write address to FMA */
+			target_mem_write32(t, FLASH_AR + bank[b], next[b]);
+			/* Flash page erase start instruction */
+			target_mem_write32(t, FLASH_CR + bank[b],
+			                   FLASH_CR_STRT | FLASH_CR_PER);
+		}
+		for (int b = 0; b < 2; b++) {
+			if (next[b] >= end[b])
+				continue;
+			/* Read FLASH_SR to poll for BSY bit */
+			if (target_mem_poll32(t, FLASH_SR + bank[b],
+			                      FLASH_SR_BSY, 0, 0))
 				return -1;
-
-		len -= f->blocksize;
-		addr += f->blocksize;
+			/* Check for error */
+			if (stm32f1_bank_error(t, bank[b]))
+				return -1;
+			next[b] += f->blocksize;
+		}
 	}
 
-	/* Check for error */
-	sr = target_mem_read32(t, FLASH_SR);
-	if ((sr & SR_ERROR_MASK) || !(sr & SR_EOP))
-		return -1;
+	return 0;
+}
+
+static int stm32f1_flash_prepare(struct target_flash *f)
+{
+	struct stm32f1_flash *sf = (struct stm32f1_flash *)f;
 
+	/* Blank blocks are written without an erase having unlocked the FPEC */
+	stm32f1_bank_unlock(f->t, 0);
+	if (sf->bank2_start < f->start + f->length)
+		stm32f1_bank_unlock(f->t, FLASH_BANK2);
 	return 0;
 }
 
 static int stm32f1_flash_write(struct target_flash *f,
                                target_addr dest, const void *src, size_t len)
 {
-	target *t = f->t;
-	/* Write stub and data to target ram and set PC */
-	target_mem_write(t, SRAM_BASE, stm32f1_flash_write_stub,
-	                 sizeof(stm32f1_flash_write_stub));
-	target_mem_write(t, STUB_BUFFER_BASE, src, len);
-	return cortexm_run_stub(t, SRAM_BASE, dest, STUB_BUFFER_BASE, len, 0);
+	struct stm32f1_flash *sf = (struct stm32f1_flash *)f;
+
+	/* Write stub and data to target ram and set PC.  The stub picks the
+	 * bank's controller from the address. */
+	return cortexm_stub_stream(f->t, stm32f1_flash_write_stub,
+	                           sizeof(stm32f1_flash_write_stub),
+	                           SRAM_BASE, STUB_BUFFER_BASE, STUB_BUFFER_SIZE,
+	                           dest, src, len, sf->bank2_start);
 }
 
-static bool stm32f1_cmd_erase_mass(target *t)
+static int stm32f1_flash_done(struct target_flash *f)
 {
-	stm32f1_flash_unlock(t);
+	return cortexm_stub_done(f->t);
+}
 
-	/* Flash mass erase start instruction */
-	target_mem_write32(t, FLASH_CR, FLASH_CR_MER);
-	target_mem_write32(t, FLASH_CR, FLASH_CR_STRT | FLASH_CR_MER);
+static bool stm32f1_cmd_erase_mass(target *t)
+{
+	const int banks = stm32f1_dual_bank(t) ? 2 : 1;
+
+	/* Both banks are erased together, each by its own controller */
+	for (int b = 0; b < banks; b++) {
+		uint32_t bank = b ? FLASH_BANK2 : 0;
+		stm32f1_bank_unlock(t, bank);
+		/* Flash mass erase start instruction */
+		target_mem_write32(t, FLASH_CR + bank, FLASH_CR_MER);
+		target_mem_write32(t, FLASH_CR + bank,
+		                   FLASH_CR_STRT | FLASH_CR_MER);
+	}
 
-	/* Read FLASH_SR to poll for BSY bit */
-	while (target_mem_read32(t, FLASH_SR) & FLASH_SR_BSY)
-		if(target_check_error(t))
+	for (int b = 0; b < banks; b++) {
+		uint32_t bank = b ? FLASH_BANK2 : 0;
+		/* Read FLASH_SR to poll for BSY bit */
+		if (target_mem_poll32(t, FLASH_SR + bank, FLASH_SR_BSY, 0, 0))
 			return false;
-
-	/* Check for error */
-	uint16_t sr = target_mem_read32(t, FLASH_SR);
-	if ((sr & SR_ERROR_MASK) || !(sr & SR_EOP))
-		return false;
+		/* Check for error */
+		if (stm32f1_bank_error(t, bank))
+			return false;
+	}
 
 	return true;
 }
 
+static int stm32f1_flash_mass_erase(struct target_flash *f)
+{
+	if (cortexm_stub_sync(f->t))
+		return -1;
+	return stm32f1_cmd_erase_mass(f->t) ? 0 : -1;
+}
+
 static bool stm32f1_option_erase(target *t)
 {
 	/* Erase option bytes instruction */
@@ -256,9 +451,8 @@ static bool stm32f1_option_erase(target *t)
 	target_mem_write32(t, FLASH_CR,
 			   FLASH_CR_STRT | FLASH_CR_OPTER | FLASH_CR_OPTWRE);
 	/* Read FLASH_SR to poll for BSY bit */
-	while (target_mem_read32(t, FLASH_SR) & FLASH_SR_BSY)
-		if(target_check_error(t))
-			return false;
+	if (target_mem_poll32(t, FLASH_SR, FLASH_SR_BSY, 0, 0))
+		return false;
 	return true;
 }
 
@@ -270,9 +464,8 @@ static bool stm32f1_option_write_erased(target *t, uint32_t addr, uint16_t value
 	target_mem_write32(t, FLASH_CR, FLASH_CR_OPTPG | FLASH_CR_OPTWRE);
 	target_mem_write16(t, addr, value);
 	/* Read FLASH_SR to poll for BSY bit */
-	while (target_mem_read32(t, FLASH_SR) & FLASH_SR_BSY)
-		if(target_check_error(t))
-			return false;
+	if (target_mem_poll32(t, FLASH_SR, FLASH_SR_BSY, 0, 0))
+		return false;
 	return true;
 }
 
@@ -41,11 +41,11 @@ static bool stm32f4_cmd_psize(target *t, int argc, char *argv[]);
 
 const struct command_s stm32f4_cmd_list[] = {
 	{"erase_mass", (cmd_handler)stm32f4_cmd_erase_mass,
-	 "Erase entire flash memory"},
-	{"option", (cmd_handler)stm32f4_cmd_option, "Manipulate option bytes"},
+	 "Erase entire flash memory", CMD_HALTED},
+	{"option", (cmd_handler)stm32f4_cmd_option, "Manipulate option bytes", CMD_HALTED},
 	{"psize", (cmd_handler)stm32f4_cmd_psize,
-	 "Configure flash write parallelism: (x8|x32(default))"},
-	{NULL, NULL, NULL}
+	 "Configure flash write parallelism: (auto(default)|x8|x32|x64)", 0},
+	{NULL, NULL, NULL, 0}
 };
 
 
@@ -53,6 +53,9 @@ static int stm32f4_flash_erase(struct target_flash *f, target_addr addr,
 							   size_t len);
 static int stm32f4_flash_write(struct target_flash *f,
                                target_addr dest, const void *src, size_t len);
+static int stm32f4_flash_prepare(struct target_flash *f);
+static int stm32f4_flash_done(struct target_flash *f);
+static int stm32f4_flash_mass_erase(struct target_flash *f);
 
 /* Flash Program ad Erase Controller Register Map */
 #define FPEC_BASE	0x40023C00
@@ -81,6 +84,9 @@ static int stm32f4_flash_write(struct target_flash *f,
 
 #define FLASH_OPTCR_OPTLOCK	(1 << 0)
 #define FLASH_OPTCR_OPTSTRT	(1 << 1)
+#define FLASH_OPTCR_BOR_LEV_MASK	(3 << 2)
+#define FLASH_OPTCR_BOR_LEV2	(1 << 2)	/* 2.4V */
+#define FLASH_OPTCR_BOR_LEV1	(2 << 2)	/* 2.1V */
 #define FLASH_OPTCR_nDBANK	(1 << 29)
 #define FLASH_OPTCR_DB1M	(1 << 30)
 
@@ -118,10 +124,18 @@ static const uint16_t stm32f4_flash_write_x8_stub[] = {
 #include "flashstub/stm32f4_x8.stub"
 };
 
+/* This routine uses double word access.  Needs an external VPP */
+static const uint16_t stm32f4_flash_write_x64_stub[] = {
+#include "flashstub/stm32f4_x64.stub"
+};
+
 #define SRAM_BASE 0x20000000
 #define STUB_BUFFER_BASE \
-	ALIGN(SRAM_BASE + MAX(sizeof(stm32f4_flash_write_x8_stub), \
-			      sizeof(stm32f4_flash_write_x32_stub)), 4)
+	CORTEXM_STUB_RING_BASE(SRAM_BASE, \
+			       MAX(MAX(sizeof(stm32f4_flash_write_x8_stub), \
+				       sizeof(stm32f4_flash_write_x32_stub)), \
+				   sizeof(stm32f4_flash_write_x64_stub)), 4)
+#define STUB_BUFFER_SIZE 0x8000
 
 #define AXIM_BASE 0x8000000
 #define ITCM_BASE 0x0200000
@@ -129,7 +143,8 @@ static const uint16_t stm32f4_flash_write_x8_stub[] = {
 struct stm32f4_flash {
 	struct target_flash f;
 	uint8_t base_sector;
-	uint8_t psize;
+	uint8_t psize;		/* 8, 32 or 64, or 0 to choose from the voltage */
+	uint8_t psize_write;	/* As chosen for this flash session */
 	uint8_t bank_split;
 };
 
@@ -154,22 +169,27 @@ static void stm32f4_add_flash(target *t,
                               uint32_t addr, size_t length, size_t blocksize,
                               unsigned int base_sector, int split)
 {
-	struct stm32f4_flash *sf = calloc(1, sizeof(*sf));
+	struct stm32f4_flash *sf = target_alloc(sizeof(*sf));
 	struct target_flash *f = &sf->f;
 	f->start = addr;
 	f->length = length;
 	f->blocksize = blocksize;
 	f->erase = stm32f4_flash_erase;
 	f->write = stm32f4_flash_write;
+	f->combine = true;
+	f->prepare = stm32f4_flash_prepare;
+	f->done = stm32f4_flash_done;
+	f->mass_erase = stm32f4_flash_mass_erase;
+	f->bank = addr < AXIM_BASE;	/* ITCM alias */
 	f->align = 4;
 	f->erased = 0xff;
 	sf->base_sector = base_sector;
-	sf->psize = 32;
+	sf->psize = 0;
 	sf->bank_split = split;
 	target_add_flash(t, f);
 }
 
-bool stm32f4_probe(target *t)
+static bool stm32f4_probe(target *t)
 {
 	uint32_t idcode;
 	const char* designator = NULL;
@@ -317,6 +337,8 @@ bool stm32f4_probe(target *t)
 	return true;
 }
 
+CORTEXM_DRIVER(stm32f4_probe, JEP106_ST);
+
 static void stm32f4_flash_unlock(target *t)
 {
 	if (target_mem_read32(t, FLASH_CR) & FLASH_CR_LOCK) {
@@ -326,6 +348,46 @@ static void stm32f4_flash_unlock(target *t)
 	}
 }
 
+/* The parallelism safe at the target's supply voltage: x32 from 2.7V,
+ * x8 below.  A measured voltage is used where the probe has one, else a
+ * brown out reset level below 2.7V shows the part is meant to run from a
+ * low supply.  With neither x32 is assumed, as it always has been.  x64
+ * needs an external VPP, so is only ever set by hand.
+ */
+static uint8_t stm32f4_psize_auto(target *t)
+{
+	const char *v = platform_target_voltage();
+
+	/* As "3.3V" */
+	if ((v[0] >= '0') && (v[0] <= '9') && (v[1] == '.') &&
+	    (v[2] >= '0') && (v[2] <= '9') && (v[3] == 'V'))
+		return ((v[0] - '0') * 10 + (v[2] - '0') >= 27) ? 32 : 8;
+
+	uint32_t bor = target_mem_read32(t, FLASH_OPTCR) &
+	               FLASH_OPTCR_BOR_LEV_MASK;
+	if ((bor == FLASH_OPTCR_BOR_LEV2) || (bor == FLASH_OPTCR_BOR_LEV1))
+		return 8;
+	return 32;
+}
+
+static uint8_t stm32f4_psize(struct stm32f4_flash *sf)
+{
+	return sf->psize ? sf->psize : stm32f4_psize_auto(sf->f.t);
+}
+
+/* Erases are faster with the larger parallelism too */
+static uint32_t stm32f4_psize_cr(uint8_t psize)
+{
+	switch (psize) {
+	case 64:
+		return FLASH_CR_PSIZE64;
+	case 32:
+		return FLASH_CR_PSIZE32;
+	default:
+		return FLASH_CR_PSIZE8;
+	}
+}
+
 static int stm32f4_flash_erase(struct target_flash *f, target_addr addr,
 							   size_t len)
 {
@@ -334,22 +396,24 @@ static int stm32f4_flash_erase(struct target_flash *f, target_addr addr,
 	uint32_t sr;
 	/* No address translation is needed here, as we erase by sector number */
 	uint8_t sector = sf->base_sector + (addr - f->start)/f->blocksize;
+	if (cortexm_stub_sync(t))
+		return -1;
 	stm32f4_flash_unlock(t);
+	uint32_t psize = stm32f4_psize_cr(stm32f4_psize(sf));
 
 	while(len) {
 		uint32_t cr = FLASH_CR_EOPIE | FLASH_CR_ERRIE | FLASH_CR_SER |
-		              (sector << 3);
+		              psize | (sector << 3);
 		/* Flash page erase instruction */
 		target_mem_write32(t, FLASH_CR, cr);
 		/* write address to FMA */
 		target_mem_write32(t, FLASH_CR, cr | FLASH_CR_STRT);
 
 		/* Read FLASH_SR to poll for BSY bit */
-		while(target_mem_read32(t, FLASH_SR) & FLASH_SR_BSY)
-			if(target_check_error(t)) {
-				DEBUG("stm32f4 flash erase: comm error\n");
-				return -1;
-			}
+		if (target_mem_poll32(t, FLASH_SR, FLASH_SR_BSY, 0, 0)) {
+			DEBUG("stm32f4 flash erase: comm error\n");
+			return -1;
+		}
 		len -= f->blocksize;
 		sector++;
 		if ((sf->bank_split) && (sector == sf->bank_split))
@@ -365,6 +429,18 @@ static int stm32f4_flash_erase(struct target_flash *f, target_addr addr,
 	return 0;
 }
 
+/* Blank blocks are written without an erase having unlocked the FPEC.
+ * x64 writes whole double words. */
+static int stm32f4_flash_prepare(struct target_flash *f)
+{
+	struct stm32f4_flash *sf = (struct stm32f4_flash *)f;
+
+	stm32f4_flash_unlock(f->t);
+	sf->psize_write = stm32f4_psize(sf);
+	f->align = (sf->psize_write == 64) ? 8 : 4;
+	return 0;
+}
+
 static int stm32f4_flash_write(struct target_flash *f,
                                target_addr dest, const void *src, size_t len)
 {
@@ -374,29 +450,41 @@ static int stm32f4_flash_write(struct target_flash *f,
 	}
 
 	/* Write buffer to target ram call stub */
-	if (((struct stm32f4_flash *)f)->psize == 32)
-		target_mem_write(f->t, SRAM_BASE, stm32f4_flash_write_x32_stub,
-		                 sizeof(stm32f4_flash_write_x32_stub));
-	else
-		target_mem_write(f->t, SRAM_BASE, stm32f4_flash_write_x8_stub,
-		                 sizeof(stm32f4_flash_write_x8_stub));
-	target_mem_write(f->t, STUB_BUFFER_BASE, src, len);
-	return cortexm_run_stub(f->t, SRAM_BASE, dest,
-	                        STUB_BUFFER_BASE, len, 0);
+	const uint16_t *stub = stm32f4_flash_write_x8_stub;
+	size_t stub_size = sizeof(stm32f4_flash_write_x8_stub);
+	switch (((struct stm32f4_flash *)f)->psize_write) {
+	case 64:
+		stub = stm32f4_flash_write_x64_stub;
+		stub_size = sizeof(stm32f4_flash_write_x64_stub);
+		break;
+	case 32:
+		stub = stm32f4_flash_write_x32_stub;
+		stub_size = sizeof(stm32f4_flash_write_x32_stub);
+		break;
+	}
+	return cortexm_stub_stream(f->t, stub, stub_size,
+	                           SRAM_BASE, STUB_BUFFER_BASE,
+	                           STUB_BUFFER_SIZE, dest, src, len, 0);
 }
 
-static bool stm32f4_cmd_erase_mass(target *t)
+static int stm32f4_flash_done(struct target_flash *f)
+{
+	return cortexm_stub_done(f->t);
+}
+
+static bool stm32f4_erase_mass(target *t, bool progress)
 {
 	const char spinner[] = "|/-\\";
 	int spinindex = 0;
 	struct target_flash *f = t->flash;
 	struct stm32f4_flash *sf = (struct stm32f4_flash *)f;
 
-	tc_printf(t, "Erasing flash... This may take a few seconds.  ");
+	if (progress)
+		tc_printf(t, "Erasing flash... This may take a few seconds.  ");
 	stm32f4_flash_unlock(t);
 
 	/* Flash mass erase start instruction */
-	uint32_t cr =  FLASH_CR_MER;
+	uint32_t cr =  FLASH_CR_MER | stm32f4_psize_cr(stm32f4_psize(sf));
 	if (sf->bank_split)
 		cr |=  FLASH_CR_MER1;
 	target_mem_write32(t, FLASH_CR, cr);
@@ -404,13 +492,16 @@ static bool stm32f4_cmd_erase_mass(target *t)
 
 	/* Read FLASH_SR to poll for BSY bit */
 	while (target_mem_read32(t, FLASH_SR) & FLASH_SR_BSY) {
-		tc_printf(t, "\b%c", spinner[spinindex++ % 4]);
+		if (progress)
+			tc_printf(t, "\b%c", spinner[spinindex++ % 4]);
 		if(target_check_error(t)) {
-			tc_printf(t, "\n");
+			if (progress)
+				tc_printf(t, "\n");
 			return false;
 		}
 	}
-	tc_printf(t, "\n");
+	if (progress)
+		tc_printf(t, "\n");
 
 	/* Check for error */
 	uint32_t sr = target_mem_read32(t, FLASH_SR);
@@ -420,6 +511,18 @@ static bool stm32f4_cmd_erase_mass(target *t)
 	return true;
 }
 
+static int stm32f4_flash_mass_erase(struct target_flash *f)
+{
+	if (cortexm_stub_sync(f->t))
+		return -1;
+	return stm32f4_erase_mass(f->t, false) ? 0 : -1;
+}
+
+static bool stm32f4_cmd_erase_mass(target *t)
+{
+	return stm32f4_erase_mass(t, true);
+}
+
 /* Dev   | DOC  |Rev|ID |OPTCR    |OPTCR   |OPTCR1   |OPTCR1 | OPTCR2
                     |hex|default  |reserved|default  |resvd  | default|resvd
  * F20x  |pm0059|5.1|411|0FFFAAED |F0000010|
@@ -489,9 +592,8 @@ static bool stm32f4_option_write(target *t, uint32_t *val, int count)
 {
 	target_mem_write32(t, FLASH_OPTKEYR, OPTKEY1);
 	target_mem_write32(t, FLASH_OPTKEYR, OPTKEY2);
-	while (target_mem_read32(t, FLASH_SR) & FLASH_SR_BSY)
-		if(target_check_error(t))
-			return -1;
+	if (target_mem_poll32(t, FLASH_SR, FLASH_SR_BSY, 0, 0))
+		return -1;
 
 	/* WRITE option bytes instruction */
 	if (((t->idcode == ID_STM32F42X) || (t->idcode == ID_STM32F46X) ||
@@ -505,9 +607,8 @@ static bool stm32f4_option_write(target *t, uint32_t *val, int count)
 	target_mem_write32(t, FLASH_OPTCR, val[0]);
 	target_mem_write32(t, FLASH_OPTCR, val[0] | FLASH_OPTCR_OPTSTRT);
 	/* Read FLASH_SR to poll for BSY bit */
-	while(target_mem_read32(t, FLASH_SR) & FLASH_SR_BSY)
-		if(target_check_error(t))
-			return false;
+	if (target_mem_poll32(t, FLASH_SR, FLASH_SR_BSY, 0, 0))
+		return false;
 	target_mem_write32(t, FLASH_OPTCR, FLASH_OPTCR_OPTLOCK);
 	return true;
 }
@@ -619,23 +720,30 @@ static bool stm32f4_cmd_option(target *t, int argc, char *argv[])
 
 static bool stm32f4_cmd_psize(target *t, int argc, char *argv[])
 {
+	struct stm32f4_flash *sf = NULL;
+
+	for (struct target_flash *f = t->flash; f; f = f->next) {
+		if (f->write == stm32f4_flash_write)
+			sf = (struct stm32f4_flash *)f;
+	}
+	if (sf == NULL)
+		return false;
+
 	if (argc == 1) {
-		uint8_t psize = 8;
-		for (struct target_flash *f = t->flash; f; f = f->next) {
-			if (f->write == stm32f4_flash_write) {
-				psize = ((struct stm32f4_flash *)f)->psize;
-			}
-		}
-		tc_printf(t, "Flash write parallelism: %s\n",
-		          psize == 32 ? "x32" : "x8");
+		tc_printf(t, "Flash write parallelism: %sx%d\n",
+		          sf->psize ? "" : "auto, ", stm32f4_psize(sf));
 	} else {
 		uint8_t psize;
-		if (!strcmp(argv[1], "x8")) {
+		if (!strcmp(argv[1], "auto")) {
+			psize = 0;
+		} else if (!strcmp(argv[1], "x8")) {
 			psize = 8;
 		} else if (!strcmp(argv[1], "x32")) {
 			psize = 32;
+		} else if (!strcmp(argv[1], "x64")) {
+			psize = 64;
 		} else {
-			tc_printf(t, "usage: monitor psize (x8|x32)\n");
+			tc_printf(t, "usage: monitor psize (auto|x8|x32|x64)\n");
 			return false;
 		}
 		for (struct target_flash *f = t->flash; f; f = f->next) {
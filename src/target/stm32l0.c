@@ -94,7 +94,14 @@
 
 #define STM32L1_NVM_PHYS             (0x40023c00ul)
 #define STM32L1_NVM_OPT_SIZE         (32)
-#define STM32L1_NVM_EEPROM_SIZE      (16*1024)
+#define STM32L1_NVM_EEPROM_CAT1_SIZE (4*1024)
+#define STM32L1_NVM_EEPROM_CAT3_SIZE (8*1024)
+#define STM32L1_NVM_EEPROM_CAT4_SIZE (12*1024)
+#define STM32L1_NVM_EEPROM_CAT5_SIZE (16*1024)
+
+/* Data EEPROM is read back in chunks of this size to skip words that
+   need no erase or write */
+#define STM32Lx_NVM_DATA_CHUNK       (0x80)
 
 #define STM32Lx_NVM_OPT_PHYS         0x1ff80000ul
 #define STM32Lx_NVM_EEPROM_PHYS      0x08080000ul
@@ -151,6 +158,9 @@ static int stm32lx_nvm_prog_write(struct target_flash* f,
                                   const void* src,
                                   size_t size);
 
+static int stm32lx_nvm_prog_prepare(struct target_flash *f);
+static int stm32lx_nvm_prog_done(struct target_flash *f);
+
 static int stm32lx_nvm_data_erase(struct target_flash* f,
                                   target_addr addr, size_t len);
 static int stm32lx_nvm_data_write(struct target_flash* f,
@@ -163,10 +173,10 @@ static bool stm32lx_cmd_eeprom     (target* t, int argc, char** argv);
 
 static const struct command_s stm32lx_cmd_list[] = {
         { "option",		(cmd_handler) stm32lx_cmd_option,
-          "Manipulate option bytes"},
+          "Manipulate option bytes", CMD_HALTED},
         { "eeprom",		(cmd_handler) stm32lx_cmd_eeprom,
-          "Manipulate EEPROM(NVM data) memory"},
-        { NULL, NULL, NULL },
+          "Manipulate EEPROM(NVM data) memory", CMD_HALTED},
+        { NULL, NULL, NULL, 0 },
 };
 
 enum {
@@ -198,8 +208,15 @@ static uint32_t stm32lx_nvm_eeprom_size(target *t)
                 return STM32L0_NVM_EEPROM_CAT3_SIZE;
         case 0x447:                   /* STM32L0xx Cat5 */
                 return STM32L0_NVM_EEPROM_CAT5_SIZE;
-        default:                      /* STM32L1xx */
-                return STM32L1_NVM_EEPROM_SIZE;
+        case 0x416:                   /* STM32L1xx Cat1 */
+        case 0x429:                   /* STM32L1xx Cat2 */
+                return STM32L1_NVM_EEPROM_CAT1_SIZE;
+        case 0x427:                   /* STM32L1xx Cat3 */
+                return STM32L1_NVM_EEPROM_CAT3_SIZE;
+        case 0x436:                   /* STM32L1xx Cat4 */
+                return STM32L1_NVM_EEPROM_CAT4_SIZE;
+        default:                      /* STM32L1xx Cat5 */
+                return STM32L1_NVM_EEPROM_CAT5_SIZE;
         }
 }
 
@@ -229,37 +246,49 @@ static uint32_t stm32lx_nvm_option_size(target *t)
         }
 }
 
+static const uint16_t stm32lx_flash_write_stub[] = {
+#include "flashstub/stm32lx.stub"
+};
+
+#define SRAM_BASE 0x20000000
+#define STUB_BUFFER_BASE ALIGN(SRAM_BASE + sizeof(stm32lx_flash_write_stub), 4)
+/* Size of each half of the double buffer, the largest page */
+#define STUB_BUFFER_SIZE 0x100
+
 static void stm32l_add_flash(target *t,
                              uint32_t addr, size_t length, size_t erasesize)
 {
-	struct target_flash *f = calloc(1, sizeof(*f));
+	struct target_flash *f = target_alloc(sizeof(*f));
 	f->start = addr;
 	f->length = length;
 	f->blocksize = erasesize;
 	f->erase = stm32lx_nvm_prog_erase;
 	f->write = target_flash_write_buffered;
-	f->done = target_flash_done_buffered;
+	f->done = stm32lx_nvm_prog_done;
 	f->write_buf = stm32lx_nvm_prog_write;
-	f->buf_size = erasesize/2;
+	f->prepare = stm32lx_nvm_prog_prepare;
+	f->buf_size = erasesize;
+	/* The stub programs half-pages */
+	f->buf_page = erasesize / 2;
 	target_add_flash(t, f);
 }
 
 static void stm32l_add_eeprom(target *t, uint32_t addr, size_t length)
 {
-	struct target_flash *f = calloc(1, sizeof(*f));
+	struct target_flash *f = target_alloc(sizeof(*f));
 	f->start = addr;
 	f->length = length;
-	f->blocksize = 4;
+	f->blocksize = STM32Lx_NVM_DATA_CHUNK;
 	f->erase = stm32lx_nvm_data_erase;
 	f->write = stm32lx_nvm_data_write;
-	f->align = 1;
+	f->align = 4;
 	target_add_flash(t, f);
 }
 
 /** Query MCU memory for an indication as to whether or not the
     currently attached target is served by this module.  We detect the
     STM32L0xx parts as well as the STM32L1xx's. */
-bool stm32l0_probe(target* t)
+static bool stm32l0_probe(target* t)
 {
 	uint32_t idcode;
 
@@ -274,7 +303,8 @@ bool stm32l0_probe(target* t)
 		t->driver = "STM32L1x";
 		target_add_ram(t, 0x20000000, 0x14000);
 		stm32l_add_flash(t, 0x8000000, 0x80000, 0x100);
-		//stm32l_add_eeprom(t, 0x8080000, 0x4000);
+		stm32l_add_eeprom(t, STM32Lx_NVM_EEPROM_PHYS,
+		                  stm32lx_nvm_eeprom_size(t));
 		target_add_commands(t, stm32lx_cmd_list, "STM32L1x");
 		return true;
 	}
@@ -291,7 +321,8 @@ bool stm32l0_probe(target* t)
 		stm32l_add_flash(t, 0x8000000, 0x10000, 0x80);
 		stm32l_add_flash(t, 0x8010000, 0x10000, 0x80);
 		stm32l_add_flash(t, 0x8020000, 0x10000, 0x80);
-		stm32l_add_eeprom(t, 0x8080000, 0x1800);
+		stm32l_add_eeprom(t, STM32Lx_NVM_EEPROM_PHYS,
+		                  stm32lx_nvm_eeprom_size(t));
 		target_add_commands(t, stm32lx_cmd_list, "STM32L0x");
 		return true;
 	}
@@ -299,11 +330,16 @@ bool stm32l0_probe(target* t)
 	return false;
 }
 
+CORTEXM_DRIVER(stm32l0_probe, JEP106_ST);
 
-/** Lock the NVM control registers preventing writes or erases. */
+
+/** Lock the NVM control registers preventing writes or erases.  Program
+    flash is unlocked again by prepare before its next write. */
 static void stm32lx_nvm_lock(target *t, uint32_t nvm)
 {
         target_mem_write32(t, STM32Lx_NVM_PECR(nvm), STM32Lx_NVM_PECR_PELOCK);
+        for (struct target_flash *f = t->flash; f; f = f->next)
+                f->ready = false;
 }
 
 
@@ -351,6 +387,9 @@ static int stm32lx_nvm_prog_erase(struct target_flash* f,
 	const size_t page_size = f->blocksize;
 	const uint32_t nvm = stm32lx_nvm_phys(t);
 
+	if (cortexm_stub_sync(t))
+		return -1;
+
 	if (!stm32lx_nvm_prog_data_unlock(t, nvm))
 	        return -1;
 
@@ -392,8 +431,28 @@ static int stm32lx_nvm_prog_erase(struct target_flash* f,
 }
 
 
-/** Write to program flash using operations through the debug
-    interface. */
+/** Unlock PECR for programming, it is left unlocked between pages until
+    something locks it again. */
+static int stm32lx_nvm_prog_prepare(struct target_flash *f)
+{
+	target *t = f->t;
+	const uint32_t nvm = stm32lx_nvm_phys(t);
+
+	if (target_mem_read32(t, STM32Lx_NVM_PECR(nvm))
+	    & STM32Lx_NVM_PECR_PRGLOCK) {
+		if (!stm32lx_nvm_prog_data_unlock(t, nvm))
+			return -1;
+		/* Errors only clear once the NVM is idle */
+		if (target_mem_poll32(t, STM32Lx_NVM_SR(nvm),
+		                      STM32Lx_NVM_SR_BSY, 0, 0))
+			return -1;
+		target_mem_write32(t, STM32Lx_NVM_SR(nvm), STM32Lx_NVM_SR_ERR_M);
+	}
+	return 0;
+}
+
+/** Write to program flash with the stub, which programs the buffer as
+    consecutive half-pages while the next one is transferred. */
 static int stm32lx_nvm_prog_write(struct target_flash *f,
                                   target_addr dest,
                                   const void* src,
@@ -402,52 +461,43 @@ static int stm32lx_nvm_prog_write(struct target_flash *f,
 	target *t = f->t;
 	const uint32_t nvm = stm32lx_nvm_phys(t);
 
-	if (!stm32lx_nvm_prog_data_unlock(t, nvm))
-	        return -1;
-
-	/* Wait for BSY to clear because we cannot write the PECR until
-	   the previous operation completes on STM32Lxxx. */
-	while (target_mem_read32(t, STM32Lx_NVM_SR(nvm))
-	       & STM32Lx_NVM_SR_BSY)
-		if (target_check_error(t))
-			return -1;
+	/* The half-page size is passed in the low bits of the NVM base */
+	return cortexm_stub_write(t, stm32lx_flash_write_stub,
+	                          sizeof(stm32lx_flash_write_stub),
+	                          SRAM_BASE, STUB_BUFFER_BASE, STUB_BUFFER_SIZE,
+	                          dest, src, size, nvm | (f->blocksize / 2));
+}
 
-	target_mem_write32(t, STM32Lx_NVM_PECR(nvm),
-	                   STM32Lx_NVM_PECR_PROG | STM32Lx_NVM_PECR_FPRG);
-	target_mem_write(t, dest, src, size);
+static int stm32lx_nvm_prog_done(struct target_flash *f)
+{
+	target *t = f->t;
+	int ret = target_flash_done_buffered(f);
 
+	ret |= cortexm_stub_done(t);
 	/* Disable further programming by locking PECR */
-	stm32lx_nvm_lock(t, nvm);
-
-	/* Wait for completion or an error */
-	uint32_t sr;
-	do {
-		sr = target_mem_read32(t, STM32Lx_NVM_SR(nvm));
-	} while (sr & STM32Lx_NVM_SR_BSY);
-
-	if ((sr & STM32Lx_NVM_SR_ERR_M) || !(sr & STM32Lx_NVM_SR_EOP) ||
-	    target_check_error(t))
-			return -1;
-
-	return 0;
+	stm32lx_nvm_lock(t, stm32lx_nvm_phys(t));
+	return ret;
 }
 
 
 /** Erase a region of data flash using operations through the debug
-    interface .  The flash is erased for all pages from addr to
-    addr+len, inclusive, on a word boundary.  NVM register file
-    address chosen from target. */
+    interface.  Data EEPROM is erased a word at a time, so words that
+    already read as erased are skipped.  NVM register file address
+    chosen from target. */
 static int stm32lx_nvm_data_erase(struct target_flash *f,
                                   target_addr addr, size_t len)
 {
 	target *t = f->t;
-	const size_t page_size = f->blocksize;
 	const uint32_t nvm = stm32lx_nvm_phys(t);
+	uint32_t data[STM32Lx_NVM_DATA_CHUNK / 4];
 
 	/* Word align */
 	len += (addr & 3);
 	addr &= ~3;
 
+	if (cortexm_stub_sync(t))
+		return -1;
+
 	if (!stm32lx_nvm_prog_data_unlock(t, nvm))
 		return -1;
 
@@ -461,11 +511,25 @@ static int stm32lx_nvm_data_erase(struct target_flash *f,
 		return -1;
 
 	while (len > 0) {
-		/* Write first word of page to 0 */
-		target_mem_write32(t, addr, 0);
+		size_t chunk = MIN(len, sizeof(data));
 
-		len  -= page_size;
-		addr += page_size;
+		/* Reads stall while a write is in progress */
+		if (target_mem_poll32(t, STM32Lx_NVM_SR(nvm),
+		                      STM32Lx_NVM_SR_BSY, 0, 0) ||
+		    target_mem_read(t, data, addr, chunk))
+			return -1;
+		for (size_t i = 0; i < chunk / 4; i++) {
+			if (data[i] == 0)
+				continue;
+			if (target_mem_poll32(t, STM32Lx_NVM_SR(nvm),
+			                      STM32Lx_NVM_SR_BSY, 0, 0))
+				return -1;
+			/* Writing a word erases it */
+			target_mem_write32(t, addr + i * 4, 0);
+		}
+
+		len  -= chunk;
+		addr += chunk;
 	}
 
 	/* Disable further programming by locking PECR */
@@ -477,18 +541,18 @@ static int stm32lx_nvm_data_erase(struct target_flash *f,
 		sr = target_mem_read32(t, STM32Lx_NVM_SR(nvm));
 	} while (sr & STM32Lx_NVM_SR_BSY);
 
-	if ((sr & STM32Lx_NVM_SR_ERR_M) || !(sr & STM32Lx_NVM_SR_EOP) ||
-	    target_check_error(t))
-			return -1;
+	if ((sr & STM32Lx_NVM_SR_ERR_M) || target_check_error(t))
+		return -1;
 
 	return 0;
 }
 
 
 /** Write to data flash using operations through the debug interface.
-    NVM register file address chosen from target.  Unaligned
-    destination writes are supported (though unaligned sources are
-    not). */
+    PECR is unlocked once for the whole transfer.  Words are programmed
+    without FTDW, so a word that is already erased is written without
+    an erase, and words that already hold the data are skipped.  NVM
+    register file address chosen from target. */
 static int stm32lx_nvm_data_write(struct target_flash *f,
                                   target_addr destination,
                                   const void* src,
@@ -497,7 +561,11 @@ static int stm32lx_nvm_data_write(struct target_flash *f,
 	target *t = f->t;
 	const uint32_t nvm = stm32lx_nvm_phys(t);
 	const bool is_stm32l1 = stm32lx_is_stm32l1(t);
-	uint32_t* source = (uint32_t*) src;
+	const uint32_t* source = (const uint32_t*) src;
+	uint32_t data[STM32Lx_NVM_DATA_CHUNK / 4];
+
+	if (cortexm_stub_sync(t))
+		return -1;
 
 	if (!stm32lx_nvm_prog_data_unlock(t, nvm))
 		return -1;
@@ -505,14 +573,31 @@ static int stm32lx_nvm_data_write(struct target_flash *f,
 	target_mem_write32(t, STM32Lx_NVM_PECR(nvm),
 	                   is_stm32l1 ? 0 : STM32Lx_NVM_PECR_DATA);
 
+	/* Clear errors left by an earlier operation */
+	target_mem_write32(t, STM32Lx_NVM_SR(nvm), STM32Lx_NVM_SR_ERR_M);
+
 	while (size) {
-		size -= 4;
-		uint32_t v = *source++;
-		target_mem_write32(t, destination, v);
-		destination += 4;
+		size_t chunk = MIN(size, sizeof(data));
 
-		if (target_check_error(t))
+		/* Reads stall while a write is in progress */
+		if (target_mem_poll32(t, STM32Lx_NVM_SR(nvm),
+		                      STM32Lx_NVM_SR_BSY, 0, 0) ||
+		    target_mem_read(t, data, destination, chunk))
 			return -1;
+		for (size_t i = 0; i < chunk / 4; i++) {
+			uint32_t v;
+			memcpy(&v, &source[i], sizeof(v));
+			if (data[i] == v)
+				continue;
+			if (target_mem_poll32(t, STM32Lx_NVM_SR(nvm),
+			                      STM32Lx_NVM_SR_BSY, 0, 0))
+				return -1;
+			target_mem_write32(t, destination + i * 4, v);
+		}
+
+		size -= chunk;
+		destination += chunk;
+		source += chunk / 4;
 	}
 
 	/* Disable further programming by locking PECR */
@@ -524,9 +609,8 @@ static int stm32lx_nvm_data_write(struct target_flash *f,
 		sr = target_mem_read32(t, STM32Lx_NVM_SR(nvm));
 	} while (sr & STM32Lx_NVM_SR_BSY);
 
-	if ((sr & STM32Lx_NVM_SR_ERR_M) || !(sr & STM32Lx_NVM_SR_EOP) ||
-	    target_check_error(t))
-			return -1;
+	if ((sr & STM32Lx_NVM_SR_ERR_M) || target_check_error(t))
+		return -1;
 
 	return 0;
 }
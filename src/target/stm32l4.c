@@ -45,17 +45,20 @@ static bool stm32l4_cmd_erase_bank2(target *t);
 static bool stm32l4_cmd_option(target *t, int argc, char *argv[]);
 
 const struct command_s stm32l4_cmd_list[] = {
-	{"erase_mass", (cmd_handler)stm32l4_cmd_erase_mass, "Erase entire flash memory"},
-	{"erase_bank1", (cmd_handler)stm32l4_cmd_erase_bank1, "Erase entire bank1 flash memory"},
-	{"erase_bank2", (cmd_handler)stm32l4_cmd_erase_bank2, "Erase entire bank2 flash memory"},
-	{"option", (cmd_handler)stm32l4_cmd_option, "Manipulate option bytes"},
-	{NULL, NULL, NULL}
+	{"erase_mass", (cmd_handler)stm32l4_cmd_erase_mass, "Erase entire flash memory", CMD_HALTED},
+	{"erase_bank1", (cmd_handler)stm32l4_cmd_erase_bank1, "Erase entire bank1 flash memory", CMD_HALTED},
+	{"erase_bank2", (cmd_handler)stm32l4_cmd_erase_bank2, "Erase entire bank2 flash memory", CMD_HALTED},
+	{"option", (cmd_handler)stm32l4_cmd_option, "Manipulate option bytes", CMD_HALTED},
+	{NULL, NULL, NULL, 0}
 };
 
 
 static int stm32l4_flash_erase(struct target_flash *f, target_addr addr, size_t len);
 static int stm32l4_flash_write(struct target_flash *f,
                                target_addr dest, const void *src, size_t len);
+static int stm32l4_flash_prepare(struct target_flash *f);
+static int stm32l4_flash_done(struct target_flash *f);
+static int stm32l4_flash_mass_erase(struct target_flash *f);
 
 static const char stm32l4_driver_str[] = "STM32L4xx";
 
@@ -117,39 +120,61 @@ static const uint16_t stm32l4_flash_write_stub[] = {
 #include "flashstub/stm32l4.stub"
 };
 
+/* Fast programming of whole rows, after a mass erase */
+static const uint16_t stm32l4_fast_write_stub[] = {
+#include "flashstub/stm32l4_fast.stub"
+};
+
 #define SRAM_BASE 0x20000000
-#define STUB_BUFFER_BASE ALIGN(SRAM_BASE + sizeof(stm32l4_flash_write_stub), 8)
+#define STUB_BUFFER_BASE \
+	CORTEXM_STUB_RING_BASE(SRAM_BASE, MAX(sizeof(stm32l4_flash_write_stub), \
+	                                      sizeof(stm32l4_fast_write_stub)), 8)
+#define STUB_BUFFER_SIZE 0x8000
+
+#define ROW_SIZE 0x100
 
 struct stm32l4_flash {
 	struct target_flash f;
 	uint32_t bank1_start;
+	uint32_t mer;		/* FLASH_CR_MERx bits that erase this flash */
+	uint8_t mass_erased;	/* Banks erased since, bit 0 is bank 1 */
 };
 
+static uint8_t stm32l4_bank_bit(struct stm32l4_flash *sf, target_addr addr)
+{
+	return (addr >= sf->bank1_start) ? 2 : 1;
+}
+
 static void stm32l4_add_flash(target *t,
                               uint32_t addr, size_t length, size_t blocksize,
-                              uint32_t bank1_start)
+                              uint32_t bank1_start, uint32_t mer)
 {
-	struct stm32l4_flash *sf = calloc(1, sizeof(*sf));
+	struct stm32l4_flash *sf = target_alloc(sizeof(*sf));
 	struct target_flash *f = &sf->f;
 	f->start = addr;
 	f->length = length;
 	f->blocksize = blocksize;
 	f->erase = stm32l4_flash_erase;
 	f->write = target_flash_write_buffered;
-	f->done = target_flash_done_buffered;
+	f->done = stm32l4_flash_done;
+	f->mass_erase = stm32l4_flash_mass_erase;
 	f->write_buf = stm32l4_flash_write;
+	f->prepare = stm32l4_flash_prepare;
 	f->buf_size = 2048;
+	f->buf_page = ROW_SIZE;
 	f->erased = 0xff;
+	f->bank = (mer == FLASH_CR_MER2);
 	sf->bank1_start = bank1_start;
+	sf->mer = mer;
 	target_add_flash(t, f);
 }
 
-bool stm32l4_probe(target *t)
+static bool stm32l4_probe(target *t)
 {
 	uint32_t idcode;
 	uint32_t size;
 	uint32_t options;
-	uint32_t bank1_start = 0x08040000;
+	uint32_t bank1_start;
 
 	idcode = target_mem_read32(t, DBGMCU_IDCODE) & 0xFFF;
 	switch(idcode) {
@@ -165,9 +190,19 @@ bool stm32l4_probe(target *t)
 		}
 		size    = (target_mem_read32(t, FLASH_SIZE_REG) & 0xffff);
 		options =  target_mem_read32(t, FLASH_OPTR);
-		if ((size < 0x400) && (options & OR_DUALBANK))
+		/* 1M parts are always dual bank, smaller ones optionally */
+		if ((size >= 0x400) || (options & OR_DUALBANK)) {
+			/* Each bank gets its own bank erase */
 			bank1_start =  0x08000000 + (size << 9);
-		stm32l4_add_flash(t, 0x08000000, size << 10, PAGE_SIZE, bank1_start);
+			stm32l4_add_flash(t, 0x08000000, size << 9, PAGE_SIZE,
+			                  bank1_start, FLASH_CR_MER1);
+			stm32l4_add_flash(t, bank1_start, size << 9, PAGE_SIZE,
+			                  bank1_start, FLASH_CR_MER2);
+		} else {
+			bank1_start = 0x08000000 + (size << 10);
+			stm32l4_add_flash(t, 0x08000000, size << 10, PAGE_SIZE,
+			                  bank1_start, FLASH_CR_MER1);
+		}
 		target_add_commands(t, stm32l4_cmd_list, "STM32L4 Dual bank");
 		return true;
 	case 0x462: /* L45x L46x / RM0394  */
@@ -182,13 +217,17 @@ bool stm32l4_probe(target *t)
 		}
 		size    = (target_mem_read32(t, FLASH_SIZE_REG) & 0xffff);
 		options =  target_mem_read32(t, FLASH_OPTR);
-		stm32l4_add_flash(t, 0x08000000, size << 10, PAGE_SIZE, bank1_start);
+		bank1_start = 0x08000000 + (size << 10);
+		stm32l4_add_flash(t, 0x08000000, size << 10, PAGE_SIZE,
+		                  bank1_start, FLASH_CR_MER1);
 		target_add_commands(t, stm32l4_cmd_list, "STM32L4");
 		return true;
 	}
 	return false;
 }
 
+CORTEXM_DRIVER(stm32l4_probe, JEP106_ST);
+
 static void stm32l4_flash_unlock(target *t)
 {
 	if (target_mem_read32(t, FLASH_CR) & FLASH_CR_LOCK) {
@@ -205,9 +244,19 @@ static int stm32l4_flash_erase(struct target_flash *f, target_addr addr, size_t
 	uint32_t bank1_start = ((struct stm32l4_flash *)f)->bank1_start;
 	uint32_t page;
 
+	if (cortexm_stub_sync(t))
+		return -1;
 	stm32l4_flash_unlock(t);
 
-	page = (addr - 0x08000000) / PAGE_SIZE;
+	/* A page erase doesn't count for fast programming */
+	((struct stm32l4_flash *)f)->mass_erased &=
+		~stm32l4_bank_bit((struct stm32l4_flash *)f, addr);
+
+	/* Pages are numbered within their bank */
+	if (addr >= bank1_start)
+		page = (addr - bank1_start) / PAGE_SIZE;
+	else
+		page = (addr - 0x08000000) / PAGE_SIZE;
 	while(len) {
 		uint32_t cr;
 
@@ -221,9 +270,8 @@ static int stm32l4_flash_erase(struct target_flash *f, target_addr addr, size_t
 		target_mem_write32(t, FLASH_CR, cr);
 
 		/* Read FLASH_SR to poll for BSY bit */
-		while(target_mem_read32(t, FLASH_SR) & FLASH_SR_BSY)
-			if(target_check_error(t))
-				return -1;
+		if (target_mem_poll32(t, FLASH_SR, FLASH_SR_BSY, 0, 0))
+			return -1;
 
 		len  -= PAGE_SIZE;
 		addr += PAGE_SIZE;
@@ -238,23 +286,48 @@ static int stm32l4_flash_erase(struct target_flash *f, target_addr addr, size_t
 	return 0;
 }
 
+/* Blank blocks are written without an erase having unlocked the FPEC */
+static int stm32l4_flash_prepare(struct target_flash *f)
+{
+	stm32l4_flash_unlock(f->t);
+	return 0;
+}
+
 static int stm32l4_flash_write(struct target_flash *f,
                                target_addr dest, const void *src, size_t len)
 {
-	/* Write buffer to target ram call stub */
-	target_mem_write(f->t, SRAM_BASE, stm32l4_flash_write_stub,
-	                 sizeof(stm32l4_flash_write_stub));
-	target_mem_write(f->t, STUB_BUFFER_BASE, src, len);
-	return cortexm_run_stub(f->t, SRAM_BASE, dest,
-	                        STUB_BUFFER_BASE, len, 0);
+	struct stm32l4_flash *sf = (struct stm32l4_flash *)f;
+
+	/* Whole rows of a mass erased bank can use fast programming.
+	 * The buffer is a page, which never crosses into the other bank. */
+	if ((sf->mass_erased & stm32l4_bank_bit(sf, dest)) &&
+	    !(dest % ROW_SIZE) && !(len % ROW_SIZE))
+		return cortexm_stub_write(f->t, stm32l4_fast_write_stub,
+		                          sizeof(stm32l4_fast_write_stub),
+		                          SRAM_BASE, STUB_BUFFER_BASE, f->buf_size,
+		                          dest, src, len, 0);
+
+	/* Stream the buffer to the stub */
+	return cortexm_stub_stream(f->t, stm32l4_flash_write_stub,
+	                           sizeof(stm32l4_flash_write_stub),
+	                           SRAM_BASE, STUB_BUFFER_BASE, STUB_BUFFER_SIZE,
+	                           dest, src, len, 0);
+}
+
+static int stm32l4_flash_done(struct target_flash *f)
+{
+	int ret = target_flash_done_buffered(f);
+
+	return cortexm_stub_done(f->t) | ret;
 }
 
-static bool stm32l4_cmd_erase(target *t, uint32_t action)
+static bool stm32l4_cmd_erase(target *t, uint32_t action, bool progress)
 {
 	const char spinner[] = "|/-\\";
 	int spinindex = 0;
 
-	tc_printf(t, "Erasing flash... This may take a few seconds.  ");
+	if (progress)
+		tc_printf(t, "Erasing flash... This may take a few seconds.  ");
 	stm32l4_flash_unlock(t);
 
 	/* Flash erase action start instruction */
@@ -263,34 +336,56 @@ static bool stm32l4_cmd_erase(target *t, uint32_t action)
 
 	/* Read FLASH_SR to poll for BSY bit */
 	while (target_mem_read32(t, FLASH_SR) & FLASH_SR_BSY) {
-		tc_printf(t, "\b%c", spinner[spinindex++ % 4]);
+		if (progress)
+			tc_printf(t, "\b%c", spinner[spinindex++ % 4]);
 		if(target_check_error(t)) {
-			tc_printf(t, "\n");
+			if (progress)
+				tc_printf(t, "\n");
 			return false;
 		}
 	}
-	tc_printf(t, "\n");
+	if (progress)
+		tc_printf(t, "\n");
 
 	/* Check for error */
 	uint16_t sr = target_mem_read32(t, FLASH_SR);
 	if (sr & FLASH_SR_ERROR_MASK)
 		return false;
+
+	/* Record the banks that may now be fast programmed */
+	for (struct target_flash *f = t->flash; f; f = f->next) {
+		struct stm32l4_flash *sf = (struct stm32l4_flash *)f;
+		if (f->erase != stm32l4_flash_erase)
+			continue;
+		if (action & FLASH_CR_MER1)
+			sf->mass_erased |= 1;
+		if (action & FLASH_CR_MER2)
+			sf->mass_erased |= 2;
+	}
 	return true;
 }
 
+static int stm32l4_flash_mass_erase(struct target_flash *f)
+{
+	if (cortexm_stub_sync(f->t) ||
+	    !stm32l4_cmd_erase(f->t, ((struct stm32l4_flash *)f)->mer, false))
+		return -1;
+	return 0;
+}
+
 static bool stm32l4_cmd_erase_mass(target *t)
 {
-	return stm32l4_cmd_erase(t, FLASH_CR_MER1 | FLASH_CR_MER2);
+	return stm32l4_cmd_erase(t, FLASH_CR_MER1 | FLASH_CR_MER2, true);
 }
 
 static bool stm32l4_cmd_erase_bank1(target *t)
 {
-	return stm32l4_cmd_erase(t, FLASH_CR_MER1);
+	return stm32l4_cmd_erase(t, FLASH_CR_MER1, true);
 }
 
 static bool stm32l4_cmd_erase_bank2(target *t)
 {
-	return stm32l4_cmd_erase(t, FLASH_CR_MER2);
+	return stm32l4_cmd_erase(t, FLASH_CR_MER2, true);
 }
 
 static const uint8_t i2offset[9] = {
@@ -302,20 +397,17 @@ static bool stm32l4_option_write(target *t, const uint32_t *values, int len)
 	stm32l4_flash_unlock(t);
 	target_mem_write32(t, FLASH_OPTKEYR, OPTKEY1);
 	target_mem_write32(t, FLASH_OPTKEYR, OPTKEY2);
-	while (target_mem_read32(t, FLASH_SR) & FLASH_SR_BSY)
-		if(target_check_error(t))
-			return true;
+	if (target_mem_poll32(t, FLASH_SR, FLASH_SR_BSY, 0, 0))
+		return true;
 	for (int i = 0; i < len; i++)
 		target_mem_write32(t, FPEC_BASE + i2offset[i], values[i]);
 	target_mem_write32(t, FLASH_CR, FLASH_CR_OPTSTRT);
-	while (target_mem_read32(t, FLASH_SR) & FLASH_SR_BSY)
-		if(target_check_error(t))
-			return true;
+	if (target_mem_poll32(t, FLASH_SR, FLASH_SR_BSY, 0, 0))
+		return true;
 	target_mem_write32(t, FLASH_CR, FLASH_CR_LOCK);
 	target_mem_write32(t, FLASH_CR, FLASH_CR_OBL_LAUNCH);
-	while (target_mem_read32(t, FLASH_CR) & FLASH_CR_OBL_LAUNCH)
-		if(target_check_error(t))
-			return true;
+	if (target_mem_poll32(t, FLASH_CR, FLASH_CR_OBL_LAUNCH, 0, 0))
+		return true;
 	return false;
 }
 
@@ -19,6 +19,7 @@
  */
 #include "general.h"
 #include "swdptap.h"
+#include "stats.h"
 
 uint32_t __attribute__((weak))
 swdptap_seq_in(int ticks)
@@ -26,6 +27,7 @@ swdptap_seq_in(int ticks)
 	uint32_t index = 1;
 	uint32_t ret = 0;
 
+	STATS_ADD(swd_bits, ticks);
 	while (ticks--) {
 		if (swdptap_bit_in())
 			ret |= index;
@@ -42,6 +44,7 @@ swdptap_seq_in_parity(uint32_t *ret, int ticks)
 	uint8_t parity = 0;
 	*ret = 0;
 
+	STATS_ADD(swd_bits, ticks + 1);
 	while (ticks--) {
 		if (swdptap_bit_in()) {
 			*ret |= index;
@@ -58,6 +61,7 @@ swdptap_seq_in_parity(uint32_t *ret, int ticks)
 void __attribute__((weak))
 swdptap_seq_out(uint32_t MS, int ticks)
 {
+	STATS_ADD(swd_bits, ticks);
 	while (ticks--) {
 		swdptap_bit_out(MS & 1);
 		MS >>= 1;
@@ -69,6 +73,7 @@ swdptap_seq_out_parity(uint32_t MS, int ticks)
 {
 	uint8_t parity = 0;
 
+	STATS_ADD(swd_bits, ticks + 1);
 	while (ticks--) {
 		swdptap_bit_out(MS & 1);
 		parity ^= MS;
@@ -21,14 +21,179 @@
 #include "general.h"
 #include "target.h"
 #include "target_internal.h"
+#include "crc32.h"
+#include "stats.h"
 
 #include <stdarg.h>
 
-target *target_list = NULL;
+target *target_lists[PLATFORM_SWD_PORTS];
+
+/* Small read cache for flash and memory marked read-only by the user, so
+ * that GDB re-reading the same lines while the target is halted doesn't go
+ * to the target each time.  Any write, flash operation, target command,
+ * resume or halt drops the whole cache, and nothing is cached while the
+ * target runs, as it may be reprogramming its own flash.  Cores sharing
+ * memory share the cache.
+ */
+#define MEM_CACHE_LINES		8
+#define MEM_CACHE_LINE_SIZE	64
+#define MEM_READONLY_MAX	4
+
+static struct {
+	target *t;
+	unsigned next;
+	struct {
+		bool valid;
+		target_addr addr;
+		uint8_t data[MEM_CACHE_LINE_SIZE];
+	} line[MEM_CACHE_LINES];
+} mem_cache;
+
+static struct {
+	target_addr start;
+	size_t length;
+} mem_readonly[MEM_READONLY_MAX];
+
+static void mem_cache_invalidate(void)
+{
+	for (unsigned i = 0; i < MEM_CACHE_LINES; i++)
+		mem_cache.line[i].valid = false;
+}
+
+static target *mem_cache_owner(target *t)
+{
+	return t->mem_shared ? t->mem_shared : t;
+}
+
+/* Everything a scan creates and target_list_free() destroys is allocated
+ * from an arena, rather than from the heap piece by piece, so repeated
+ * scans can't fragment it.  The arena starts with a static block, and
+ * further blocks come from the heap when that is full.  All are given
+ * back at once.  Each SWD port has an arena, so one port's targets can be
+ * freed without the other's.
+ */
+#ifndef TARGET_ARENA_SIZE
+#define TARGET_ARENA_SIZE	2048
+#endif
+#define TARGET_ARENA_BLOCK	1024
+
+struct target_arena_block {
+	struct target_arena_block *next;
+	size_t size;
+	size_t used;
+	uint8_t data[] __attribute__((aligned(8)));
+};
+
+static struct target_arena {
+	uint8_t data[TARGET_ARENA_SIZE] __attribute__((aligned(8)));
+	size_t used;
+	struct target_arena_block *blocks;
+} target_arenas[PLATFORM_SWD_PORTS];
+
+void *target_alloc(size_t size)
+{
+	struct target_arena *a = &target_arenas[platform_swd_port()];
+	struct target_arena_block *b = a->blocks;
+	void *p;
+
+	size = ALIGN(size, 8);
+	if (a->used + size <= sizeof(a->data)) {
+		p = a->data + a->used;
+		a->used += size;
+	} else {
+		if (!b || (b->used + size > b->size)) {
+			size_t bsize = MAX(size, TARGET_ARENA_BLOCK);
+			b = malloc(sizeof(*b) + bsize);
+			if (!b)
+				return NULL;
+			b->size = bsize;
+			b->used = 0;
+			b->next = a->blocks;
+			a->blocks = b;
+		}
+		p = b->data + b->used;
+		b->used += size;
+	}
+	memset(p, 0, size);
+	return p;
+}
+
+static void target_arena_free(void)
+{
+	struct target_arena *a = &target_arenas[platform_swd_port()];
+
+	while (a->blocks) {
+		struct target_arena_block *b = a->blocks->next;
+		free(a->blocks);
+		a->blocks = b;
+	}
+	a->used = 0;
+}
+
+/* Buffers only needed during a flash session come from a static pool, so
+ * a heap fragmented by the host's use can't make flashing fail.  The pool
+ * is a stack of blocks, each headed by the offset of the one below it.  A
+ * freed block's space is reused as soon as every block above it is freed
+ * too, so a buffer taken and handed back while others are held doesn't
+ * use the pool up.  Requests that don't fit fall back to the heap.
+ *
+ * The default holds the largest sector buffer of any driver, 4 KiB for
+ * LPC43xx IAP and EFM32 Giant Gecko, or the combine and diff buffers,
+ * along with the pending erase bitmaps.
+ */
+#ifndef FLASH_POOL_SIZE
+#define FLASH_POOL_SIZE		(4096 + 512)
+#endif
+
+struct flash_pool_block {
+	uint32_t below;
+	uint32_t freed;
+};
+
+static struct {
+	uint8_t data[FLASH_POOL_SIZE] __attribute__((aligned(8)));
+	size_t used;
+	size_t top;
+} flash_pool;
+
+static struct flash_pool_block *flash_pool_block(size_t offset)
+{
+	return (struct flash_pool_block *)(flash_pool.data + offset);
+}
+
+static void *flash_buf_alloc(size_t size)
+{
+	size_t need = sizeof(struct flash_pool_block) + ALIGN(size, 8);
+	if (flash_pool.used + need > sizeof(flash_pool.data))
+		return malloc(size);
+
+	struct flash_pool_block *b = flash_pool_block(flash_pool.used);
+	b->below = flash_pool.top;
+	b->freed = false;
+	flash_pool.top = flash_pool.used;
+	flash_pool.used += need;
+	return b + 1;
+}
+
+static void flash_buf_free(void *p)
+{
+	uint8_t *b = p;
+
+	if ((b < flash_pool.data) ||
+	    (b >= flash_pool.data + sizeof(flash_pool.data))) {
+		free(p);
+		return;
+	}
+	((struct flash_pool_block *)p - 1)->freed = true;
+	while (flash_pool.used && flash_pool_block(flash_pool.top)->freed) {
+		flash_pool.used = flash_pool.top;
+		flash_pool.top = flash_pool_block(flash_pool.top)->below;
+	}
+}
 
 target *target_new(void)
 {
-	target *t = (void*)calloc(1, sizeof(*t));
+	target *t = target_alloc(sizeof(*t));
 	if (target_list) {
 		target *c = target_list;
 		while (c->next)
@@ -50,9 +215,15 @@ bool target_foreach(void (*cb)(int, target *t, void *context), void *context)
 	return target_list != NULL;
 }
 
+bool target_list_empty(void)
+{
+	return target_list == NULL;
+}
+
 void target_list_free(void)
 {
-	struct target_command_s *tc;
+	mem_cache_invalidate();
+	mem_cache.t = NULL;
 
 	while(target_list) {
 		target *t = target_list->next;
@@ -60,33 +231,25 @@ void target_list_free(void)
 			target_list->tc->destroy_callback(target_list->tc, target_list);
 		if (target_list->priv)
 			target_list->priv_free(target_list->priv);
-		while (target_list->commands) {
-			tc = target_list->commands->next;
-			free(target_list->commands);
-			target_list->commands = tc;
-		}
-		if (target_list->dyn_mem_map)
-			free(target_list->dyn_mem_map);
-		while (target_list->ram) {
-			void * next = target_list->ram->next;
-			free(target_list->ram);
-			target_list->ram = next;
-		}
-		while (target_list->flash) {
-			void * next = target_list->flash->next;
-			if (target_list->flash->buf)
-				free(target_list->flash->buf);
-			free(target_list->flash);
-			target_list->flash = next;
+		for (struct target_flash *f = target_list->flash; f; f = f->next) {
+			if (f->buf)
+				flash_buf_free(f->buf);
+			if (f->erase_pending)
+				flash_buf_free(f->erase_pending);
+			if (f->diff_buf)
+				flash_buf_free(f->diff_buf);
+			if (f->combine_buf)
+				flash_buf_free(f->combine_buf);
 		}
 		while (target_list->bw_list) {
 			void * next = target_list->bw_list->next;
 			free(target_list->bw_list);
 			target_list->bw_list = next;
 		}
-		free(target_list);
 		target_list = t;
 	}
+	/* Targets, their descriptors and private data */
+	target_arena_free();
 }
 
 void target_add_commands(target *t, const struct command_s *cmds, const char *name)
@@ -94,9 +257,9 @@ void target_add_commands(target *t, const struct command_s *cmds, const char *na
 	struct target_command_s *tc;
 	if (t->commands) {
 		for (tc = t->commands; tc->next; tc = tc->next);
-		tc = tc->next = malloc(sizeof(*tc));
+		tc = tc->next = target_alloc(sizeof(*tc));
 	} else {
-		t->commands = tc = malloc(sizeof(*tc));
+		t->commands = tc = target_alloc(sizeof(*tc));
 	}
 	tc->specific_name = name;
 	tc->cmds = cmds;
@@ -120,22 +283,35 @@ target *target_attach(target *t, struct target_controller *tc)
 
 	t->tc = tc;
 
+	/* Switching to another core of the group keeps what is cached */
+	if (!t->mem_shared || (t->mem_shared != mem_cache.t))
+		mem_cache_invalidate();
 	if (!t->attach(t))
 		return NULL;
 
 	t->attached = true;
+	t->running = false;
 	return t;
 }
 
 void target_add_ram(target *t, target_addr start, uint32_t len)
 {
-	struct target_ram *ram = malloc(sizeof(*ram));
+	struct target_ram *ram = target_alloc(sizeof(*ram));
 	ram->start = start;
 	ram->length = len;
 	ram->next = t->ram;
 	t->ram = ram;
 }
 
+/* Bytes of RAM from addr to the end of its region, 0 if addr isn't in RAM */
+size_t target_ram_avail(target *t, target_addr addr)
+{
+	for (struct target_ram *r = t->ram; r; r = r->next)
+		if ((r->start <= addr) && (addr - r->start < r->length))
+			return r->length - (addr - r->start);
+	return 0;
+}
+
 void target_add_flash(target *t, struct target_flash *f)
 {
 	f->t = t;
@@ -169,7 +345,7 @@ const char *target_mem_map(target *t)
 
 	/* FIXME size buffer */
 	size_t len = 1024;
-	char *tmp = malloc(len);
+	char *tmp = target_alloc(len);
 	size_t i = 0;
 	i = snprintf(&tmp[i], len - i, "<memory-map>");
 	/* Map each defined RAM */
@@ -194,37 +370,469 @@ static struct target_flash *flash_for_addr(target *t, uint32_t addr)
 	return NULL;
 }
 
-int target_flash_erase(target *t, target_addr addr, size_t len)
+/* Erases requested by GDB are only recorded in a bitmap of pending blocks.
+ * A block is erased when it is first written, or at the end of the flash
+ * session if it was never written, and not at all if it is already blank.
+ *
+ * With differential flashing written data is also collected a block at a
+ * time, and a block is only erased and programmed if its contents differ
+ * from what is already in flash.  This needs a whole block buffered on the
+ * probe, so flash with blocks larger than FLASH_DIFF_BLOCK_MAX is always
+ * programmed.
+ *
+ * If every block of a bank is pending, the driver's mass_erase is used
+ * instead of erasing block by block.
+ */
+#ifndef FLASH_DIFF_BLOCK_MAX
+#define FLASH_DIFF_BLOCK_MAX	2048
+#endif
+
+/* Writes to flash with combine set are collected into aligned chunks of
+ * FLASH_COMBINE_SIZE, so the driver sees large writes whatever GDB's packet
+ * size.  A chunk is written once full, when the next write doesn't follow
+ * on from it, and at the end of the flash session.
+ */
+#ifndef FLASH_COMBINE_SIZE
+#define FLASH_COMBINE_SIZE	2048
+#endif
+
+/* Blocks erased, or found blank, during the session are known to read as
+ * f->erased, so aligned pages of FLASH_SKIP_SIZE written to them with only
+ * the erased value need not be programmed at all.
+ */
+#ifndef FLASH_SKIP_SIZE
+#define FLASH_SKIP_SIZE	256
+#endif
+
+/* With target_flash_verify set, the data of each run of consecutive
+ * flash writes is checksummed as it arrives.  At the end of the session
+ * every run is checked against the target's own CRC of that flash, on
+ * each gang member.  At most FLASH_VERIFY_RUNS runs are kept, a session
+ * with more fails verification, as some of its data went unchecked.
+ */
+#ifndef FLASH_VERIFY_RUNS
+#define FLASH_VERIFY_RUNS	16
+#endif
+
+bool target_flash_diff;
+bool target_flash_verify;
+bool target_flash_boost;
+
+static struct flash_verify_run {
+	target_addr addr;
+	size_t len;
+	uint32_t crc;
+} flash_verify_runs[FLASH_VERIFY_RUNS];
+static unsigned flash_verify_count;
+static bool flash_verify_overflow;
+/* Runs are checksummed as the target's checksum hardware does it */
+static bool flash_verify_ieee;
+
+/* Driver setup for writing, done once per flash session */
+static int flash_prepare(struct target_flash *f)
+{
+	if (f->prepare && !f->ready) {
+		if (f->prepare(f))
+			return -1;
+		f->ready = true;
+	}
+	return 0;
+}
+
+static int flash_erase_call(struct target_flash *f, target_addr addr,
+                            size_t len)
+{
+	STATS_TIME_START(start);
+	int ret = f->erase(f, addr, len);
+	STATS_TIME_ADD(flash_erase_us, start);
+	return ret;
+}
+
+static int flash_write_direct(struct target_flash *f,
+                              target_addr dest, const void *src, size_t len)
+{
+	if (flash_prepare(f))
+		return -1;
+	if ((f->align > 1) && ((dest % f->align) || (len % f->align))) {
+		/* Pad to whole words, in a copy taken from the flash pool
+		 * rather than the stack as len can be a whole packet */
+		uint32_t offset = dest % f->align;
+		size_t size = ALIGN(offset + len, f->align);
+		uint8_t *data = flash_buf_alloc(size);
+		if (data == NULL)
+			return -1;
+		memset(data, f->erased, size);
+		memcpy(data + offset, src, len);
+		int ret = f->write(f, dest - offset, data, size);
+		flash_buf_free(data);
+		return ret;
+	}
+	return f->write(f, dest, src, len);
+}
+
+static int flash_combine_flush(struct target_flash *f)
+{
+	size_t len = f->combine_len;
+
+	if (len == 0)
+		return 0;
+	f->combine_len = 0;
+	if (f->align > 1) {
+		/* Pad the end in place, the chunk's start already is */
+		size_t size = ALIGN(len, f->align);
+		memset((uint8_t *)f->combine_buf + len, f->erased, size - len);
+		len = size;
+	}
+	return flash_write_direct(f, f->combine_addr, f->combine_buf, len);
+}
+
+static int flash_write(struct target_flash *f,
+                       target_addr dest, const void *src, size_t len)
+{
+	int ret = 0;
+
+	if (f->combine && (f->combine_buf == NULL))
+		f->combine_buf = flash_buf_alloc(FLASH_COMBINE_SIZE);
+	if (!f->combine || (f->combine_buf == NULL))
+		return flash_write_direct(f, dest, src, len);
+
+	while (len) {
+		size_t chunk = MIN(len, FLASH_COMBINE_SIZE -
+		                        (dest % FLASH_COMBINE_SIZE));
+
+		if (f->combine_len &&
+		    (dest != f->combine_addr + f->combine_len))
+			ret |= flash_combine_flush(f);
+		if (f->combine_len == 0) {
+			/* Start the chunk aligned, so flushing it never
+			 * needs a padded copy */
+			f->combine_len = (f->align > 1) ? dest % f->align : 0;
+			f->combine_addr = dest - f->combine_len;
+			memset(f->combine_buf, f->erased, f->combine_len);
+		}
+		memcpy((uint8_t *)f->combine_buf + f->combine_len, src, chunk);
+		f->combine_len += chunk;
+		if ((dest + chunk) % FLASH_COMBINE_SIZE == 0)
+			ret |= flash_combine_flush(f);
+
+		dest += chunk;
+		src = (const uint8_t *)src + chunk;
+		len -= chunk;
+	}
+	return ret;
+}
+
+static size_t flash_blocks(struct target_flash *f)
+{
+	return (f->length + f->blocksize - 1) / f->blocksize;
+}
+
+static size_t flash_bitmap_len(struct target_flash *f)
+{
+	return (flash_blocks(f) + 7) / 8;
+}
+
+static bool flash_pending_start(struct target_flash *f)
+{
+	if (f->erase_pending == NULL) {
+		/* The bitmap of erased blocks follows the pending one */
+		size_t len = 2 * flash_bitmap_len(f);
+		f->erase_pending = flash_buf_alloc(len);
+		if (f->erase_pending == NULL)
+			return false;
+		memset(f->erase_pending, 0, len);
+	}
+
+	if (target_flash_diff && (f->diff_buf == NULL) &&
+	    (f->blocksize <= FLASH_DIFF_BLOCK_MAX)) {
+		f->diff_buf = flash_buf_alloc(f->blocksize);
+		f->diff_addr = -1;
+	}
+	return true;
+}
+
+/* Test and optionally clear the pending erase flag for the block at addr */
+static bool flash_pending(struct target_flash *f, target_addr addr,
+                          bool clear)
+{
+	size_t block = (addr - f->start) / f->blocksize;
+	uint8_t mask = 1 << (block % 8);
+	bool pending = f->erase_pending[block / 8] & mask;
+
+	if (clear)
+		f->erase_pending[block / 8] &= ~mask;
+	return pending;
+}
+
+/* Test or set the flag of a block erased in this session */
+static bool flash_erased(struct target_flash *f, target_addr addr, bool set)
+{
+	size_t block = (addr - f->start) / f->blocksize;
+	uint8_t *erased = f->erase_pending + flash_bitmap_len(f);
+	uint8_t mask = 1 << (block % 8);
+
+	if (set)
+		erased[block / 8] |= mask;
+	return erased[block / 8] & mask;
+}
+
+static bool flash_fill_match(const uint8_t *data, uint8_t val, size_t len)
+{
+	for (size_t i = 0; i < len; i++)
+		if (data[i] != val)
+			return false;
+	return true;
+}
+
+/* Compare a block against data, or the erased value if data is NULL, by
+ * an on-target checksum.  Returns -1 if the target can't checksum it.
+ */
+static int flash_crc_match(struct target_flash *f, target_addr addr,
+                           const uint8_t *data)
+{
+	target *t = f->t;
+	uint32_t crc = -1;
+
+	/* Checksum hardware first, it needs neither the core nor RAM */
+	if (t->crc32_ieee && (t->crc32_ieee(t, &crc, addr, f->blocksize) == 0))
+		return crc == (data ? crc32_ieee_buf(data, f->blocksize) :
+		                      crc32_ieee_fill(f->erased, f->blocksize));
+
+	crc = -1;
+	if (target_mem_crc32(t, &crc, addr, f->blocksize) == 0)
+		return crc == (data ? crc32_buf(data, f->blocksize) :
+		                      crc32_fill(f->erased, f->blocksize));
+	return -1;
+}
+
+/* Only the on-target CRC is quick enough to be worth checking */
+static bool flash_blank(struct target_flash *f, target_addr addr)
+{
+	return flash_crc_match(f, addr, NULL) == 1;
+}
+
+static bool flash_same_bank(struct target_flash *a, struct target_flash *b)
+{
+	return (a->mass_erase == b->mass_erase) && (a->bank == b->bank);
+}
+
+/* Use the bank erase if GDB asked to erase the whole bank */
+static bool flash_bank_pending(struct target_flash *bank)
+{
+	if ((bank->mass_erase == NULL) || bank->diff_buf)
+		return false;
+
+	for (struct target_flash *f = bank->t->flash; f; f = f->next) {
+		if (!flash_same_bank(f, bank))
+			continue;
+		if (f->erase_pending == NULL)
+			return false;
+		for (size_t i = 0; i < flash_blocks(f); i++)
+			if (!(f->erase_pending[i / 8] & (1 << (i % 8))))
+				return false;
+	}
+	return true;
+}
+
+static int flash_erase_block(struct target_flash *f, target_addr addr)
+{
+	if (!flash_pending(f, addr, false))
+		return 0;
+
+	if (flash_bank_pending(f)) {
+		for (struct target_flash *b = f->t->flash; b; b = b->next) {
+			if (!flash_same_bank(b, f))
+				continue;
+			size_t len = flash_bitmap_len(b);
+			memset(b->erase_pending, 0, len);
+			memset(b->erase_pending + len, 0xff, len);
+		}
+		return f->mass_erase(f);
+	}
+
+	flash_pending(f, addr, true);
+	flash_erased(f, addr, true);
+	if (flash_blank(f, addr))
+		return 0;
+	return flash_erase_call(f, addr, f->blocksize);
+}
+
+/* Write within one block, leaving out the pages that would only be
+ * programmed with the erased value if the block is known to be erased */
+static int flash_write_block(struct target_flash *f,
+                             target_addr dest, const uint8_t *src, size_t len)
+{
+	int ret = 0;
+
+	if (!flash_erased(f, dest, false))
+		return flash_write(f, dest, src, len);
+
+	while (len) {
+		size_t chunk = MIN(len, FLASH_SKIP_SIZE -
+		                        (dest % FLASH_SKIP_SIZE));
+		size_t run = 0;
+
+		/* Collect the run of pages that need programming */
+		while ((run < len) &&
+		       !flash_fill_match(src + run, f->erased, chunk)) {
+			run += chunk;
+			chunk = MIN(len - run, FLASH_SKIP_SIZE);
+		}
+		if (run) {
+			ret |= flash_write(f, dest, src, run);
+		} else {
+			run = chunk;
+			STATS_ADD(flash_skipped, chunk);
+		}
+
+		dest += run;
+		src += run;
+		len -= run;
+	}
+	return ret;
+}
+
+static bool flash_diff_match(struct target_flash *f, target_addr addr,
+                             const uint8_t *data)
+{
+	uint8_t tmp[64];
+	int match = flash_crc_match(f, addr, data);
+
+	if (match >= 0)
+		return match;
+
+	for (size_t i = 0; i < f->blocksize; i += sizeof(tmp)) {
+		size_t len = MIN(sizeof(tmp), f->blocksize - i);
+		if (target_mem_read(f->t, tmp, addr + i, len) ||
+		    memcmp(tmp, data + i, len))
+			return false;
+	}
+	return true;
+}
+
+static int flash_diff_flush(struct target_flash *f)
+{
+	target_addr addr = f->diff_addr;
+	int ret;
+
+	if (addr == (target_addr)-1)
+		return 0;
+	f->diff_addr = -1;
+
+	if (flash_diff_match(f, addr, f->diff_buf)) {
+		flash_pending(f, addr, true);
+		return 0;
+	}
+
+	ret = flash_erase_block(f, addr);
+	if (ret == 0)
+		ret = flash_write_block(f, addr, f->diff_buf, f->blocksize);
+	return ret;
+}
+
+static int flash_pending_write(struct target_flash *f,
+                               target_addr dest, const uint8_t *src, size_t len)
+{
+	int ret = 0;
+
+	while (len) {
+		uint32_t offset = (dest - f->start) % f->blocksize;
+		target_addr base = dest - offset;
+		size_t blocklen = MIN(f->blocksize - offset, len);
+
+		if (f->diff_buf && (base != f->diff_addr)) {
+			ret |= flash_diff_flush(f);
+			if (flash_pending(f, base, false)) {
+				/* Setup buffer for a new block */
+				f->diff_addr = base;
+				memset(f->diff_buf, f->erased, f->blocksize);
+			}
+		}
+		if (f->diff_buf && (base == f->diff_addr)) {
+			memcpy((uint8_t *)f->diff_buf + offset, src, blocklen);
+		} else {
+			ret |= flash_erase_block(f, base);
+			ret |= flash_write_block(f, dest, src, blocklen);
+		}
+
+		dest += blocklen;
+		src += blocklen;
+		len -= blocklen;
+	}
+	return ret;
+}
+
+static int flash_pending_done(struct target_flash *f)
+{
+	int ret = 0;
+
+	if (f->diff_buf)
+		ret = flash_diff_flush(f);
+
+	/* Erase the blocks that were never written, a run of them at a time */
+	for (size_t i = 0; i < flash_blocks(f); i++) {
+		target_addr addr = f->start + i * f->blocksize;
+		size_t len = 0;
+
+		if (flash_bank_pending(f)) {
+			ret |= flash_erase_block(f, addr);
+			continue;
+		}
+		while ((i < flash_blocks(f)) &&
+		       flash_pending(f, addr + len, true) &&
+		       !flash_blank(f, addr + len)) {
+			len += f->blocksize;
+			i++;
+		}
+		if (len)
+			ret |= flash_erase_call(f, addr, len);
+	}
+
+	flash_buf_free(f->erase_pending);
+	if (f->diff_buf)
+		flash_buf_free(f->diff_buf);
+	f->erase_pending = NULL;
+	f->diff_buf = NULL;
+	return ret;
+}
+
+static int flash_erase_target(target *t, target_addr addr, size_t len)
 {
 	int ret = 0;
 	while (len) {
 		struct target_flash *f = flash_for_addr(t, addr);
 		size_t tmptarget = MIN(addr + len, f->start + f->length);
 		size_t tmplen = tmptarget - addr;
-		ret |= f->erase(f, addr, tmplen);
+		ret |= flash_combine_flush(f);
+		/* A new session, don't trust setup left by an unfinished one */
+		f->ready = false;
+		if (flash_pending_start(f)) {
+			target_addr block = addr - (addr - f->start) % f->blocksize;
+			for (; block < tmptarget; block += f->blocksize) {
+				size_t i = (block - f->start) / f->blocksize;
+				f->erase_pending[i / 8] |= 1 << (i % 8);
+			}
+		} else {
+			ret |= flash_erase_call(f, addr, tmplen);
+		}
 		addr += tmplen;
 		len -= tmplen;
 	}
 	return ret;
 }
 
-int target_flash_write(target *t,
-                       target_addr dest, const void *src, size_t len)
+static int flash_write_target(target *t,
+                              target_addr dest, const void *src, size_t len)
 {
 	int ret = 0;
 	while (len) {
 		struct target_flash *f = flash_for_addr(t, dest);
 		size_t tmptarget = MIN(dest + len, f->start + f->length);
 		size_t tmplen = tmptarget - dest;
-		if (f->align > 1) {
-			uint32_t offset = dest % f->align;
-			uint8_t data[ALIGN(offset + tmplen, f->align)];
-			memset(data, f->erased, sizeof(data));
-			memcpy((uint8_t *)data + offset, src, tmplen);
-			ret |= f->write(f, dest - offset, data, sizeof(data));
-		} else {
-			ret |= f->write(f, dest, src, tmplen);
-		}
+		if (f->erase_pending)
+			ret |= flash_pending_write(f, dest, src, tmplen);
+		else
+			ret |= flash_write(f, dest, src, tmplen);
 		dest += tmplen;
 		src += tmplen;
 		len -= tmplen;
@@ -232,27 +840,252 @@ int target_flash_write(target *t,
 	return ret;
 }
 
-int target_flash_done(target *t)
+static int flash_done_target(target *t)
 {
 	for (struct target_flash *f = t->flash; f; f = f->next) {
-		if (f->done) {
-			int tmp = f->done(f);
+		if (f->erase_pending) {
+			int tmp = flash_pending_done(f);
 			if (tmp)
 				return tmp;
 		}
+		if (f->combine_buf) {
+			int tmp = flash_combine_flush(f);
+			flash_buf_free(f->combine_buf);
+			f->combine_buf = NULL;
+			if (tmp)
+				return tmp;
+		}
+		int tmp = f->done ? f->done(f) : 0;
+		f->ready = false;
+		if (tmp)
+			return tmp;
+	}
+	return 0;
+}
+
+/* The target after g to repeat flash operations on t on */
+static target *gang_next(target *t, target *g)
+{
+	for (g = (g == t) ? target_list : g->next; g; g = g->next)
+		if (g->gang && (g != t))
+			return g;
+	return NULL;
+}
+
+static void flash_verify_add(target *t,
+                             target_addr dest, const void *src, size_t len)
+{
+	struct flash_verify_run *run = NULL;
+
+	if (flash_verify_count == 0)
+		flash_verify_ieee = t->crc32_ieee != NULL;
+	else
+		run = &flash_verify_runs[flash_verify_count - 1];
+
+	if ((run == NULL) || (dest != run->addr + run->len)) {
+		if (flash_verify_count == FLASH_VERIFY_RUNS) {
+			DEBUG("Flash write at %08"PRIx32" not verified\n", dest);
+			flash_verify_overflow = true;
+			return;
+		}
+		run = &flash_verify_runs[flash_verify_count++];
+		run->addr = dest;
+		run->len = 0;
+		run->crc = -1;
+	}
+	run->crc = flash_verify_ieee ? crc32_ieee_update(run->crc, src, len) :
+	                               crc32_update(run->crc, src, len);
+	run->len += len;
+}
+
+static int flash_verify_target(target *t)
+{
+	if (flash_verify_overflow)
+		return -1;
+	for (unsigned i = 0; i < flash_verify_count; i++) {
+		struct flash_verify_run *run = &flash_verify_runs[i];
+		uint32_t crc = -1;
+
+		if (flash_verify_ieee) {
+			if (t->crc32_ieee(t, &crc, run->addr, run->len))
+				return -1;
+		} else {
+			crc = generic_crc32(t, run->addr, run->len);
+		}
+		if (crc != run->crc) {
+			DEBUG("Flash verify failed at %08"PRIx32"\n", run->addr);
+			return -1;
+		}
 	}
 	return 0;
 }
 
+/* Flash operations are repeated on each gang member in turn.  Drivers
+ * whose stubs program in the background return as soon as the data is
+ * handed over, so the members then program at the same time. */
+int target_flash_erase(target *t, target_addr addr, size_t len)
+{
+	int ret = 0;
+	mem_cache_invalidate();
+	for (target *g = t; g; g = gang_next(t, g)) {
+		target_clock_boost(g);
+		int tmp = flash_erase_target(g, addr, len);
+		g->gang_error |= tmp != 0;
+		ret |= tmp;
+	}
+	return ret;
+}
+
+int target_flash_write(target *t,
+                       target_addr dest, const void *src, size_t len)
+{
+	int ret = 0;
+	STATS_TIME_START(start);
+	mem_cache_invalidate();
+	if (target_flash_verify)
+		flash_verify_add(t, dest, src, len);
+	for (target *g = t; g; g = gang_next(t, g)) {
+		target_clock_boost(g);
+		int tmp = flash_write_target(g, dest, src, len);
+		g->gang_error |= tmp != 0;
+		ret |= tmp;
+	}
+	STATS_TIME_ADD(flash_write_us, start);
+	return ret;
+}
+
+int target_flash_done(target *t)
+{
+	int ret = 0;
+	STATS_TIME_START(start);
+	mem_cache_invalidate();
+	for (target *g = t; g; g = gang_next(t, g)) {
+		int tmp = flash_done_target(g);
+		if ((tmp == 0) && target_flash_verify)
+			tmp = flash_verify_target(g);
+		target_clock_restore(g);
+		g->gang_error |= tmp != 0;
+		if (tmp)
+			ret = tmp;
+	}
+	flash_verify_count = 0;
+	flash_verify_overflow = false;
+	STATS_TIME_ADD(flash_done_us, start);
+	STATS_INC(flash_sessions);
+	return ret;
+}
+
+/* The faster clock lasts until the session is done or the target runs.
+ * A reset puts the target's own clock back by itself. */
+bool target_clock_boost(target *t)
+{
+	if (!target_flash_boost || !t->clock_boost || t->clock_boosted)
+		return false;
+	t->clock_boosted = t->clock_boost(t);
+	return t->clock_boosted;
+}
+
+void target_clock_restore(target *t)
+{
+	if (!t->clock_boosted)
+		return;
+	t->clock_boosted = false;
+	t->clock_restore(t);
+}
+
+static bool flash_map_match(target *a, target *b)
+{
+	struct target_flash *fa = a->flash, *fb = b->flash;
+
+	for (; fa && fb; fa = fa->next, fb = fb->next)
+		if ((fa->start != fb->start) || (fa->length != fb->length) ||
+		    (fa->blocksize != fb->blocksize))
+			return false;
+	return !fa && !fb;
+}
+
+/* Attach the other targets with the same driver, IDCODE and flash map as
+ * t, to be flashed along with it.  They are reset like the target GDB
+ * flashes, so none is left in an interrupt handler. */
+int target_gang_enable(target *t)
+{
+	int n = 0;
+
+	target_gang_disable();
+	for (target *g = target_list; g; g = g->next) {
+		if ((g == t) || (g->driver != t->driver) ||
+		    (g->idcode != t->idcode) || !flash_map_match(g, t))
+			continue;
+		if (!g->attached && !target_attach(g, t->tc))
+			continue;
+		target_reset(g);
+		g->gang = true;
+		g->gang_error = false;
+		n++;
+	}
+	return n;
+}
+
+void target_gang_disable(void)
+{
+	for (target *g = target_list; g; g = g->next) {
+		if (!g->gang)
+			continue;
+		g->gang = false;
+		target_detach(g);
+	}
+}
+
+int target_gang_status(target *t)
+{
+	if (!t->gang)
+		return 0;
+	return t->gang_error ? -1 : 1;
+}
+
+/* Granularity of the dirty page bitmap of buffered flash */
+static size_t flash_buf_page(struct target_flash *f)
+{
+	size_t page = f->buf_page ? f->buf_page : f->buf_size;
+
+	return MAX(page, (f->buf_size + 31) / 32);
+}
+
+/* Write the runs of dirty pages in the sector buffer, skipping the rest */
+static int flash_buf_flush(struct target_flash *f)
+{
+	size_t page = flash_buf_page(f);
+	int ret = 0;
+
+	for (size_t i = 0; i < f->buf_size; ) {
+		if (!(f->buf_dirty & (1u << (i / page)))) {
+			i += page;
+			continue;
+		}
+		size_t start = i;
+		while ((i < f->buf_size) && (f->buf_dirty & (1u << (i / page))))
+			i += page;
+		ret |= f->write_buf(f, f->buf_addr + start,
+		                    (uint8_t *)f->buf + start,
+		                    MIN(i, f->buf_size) - start);
+	}
+	f->buf_dirty = 0;
+	return ret;
+}
+
 int target_flash_write_buffered(struct target_flash *f,
                                 target_addr dest, const void *src, size_t len)
 {
 	int ret = 0;
+	size_t page = flash_buf_page(f);
 
 	if (f->buf == NULL) {
 		/* Allocate flash sector buffer */
-		f->buf = malloc(f->buf_size);
+		f->buf = flash_buf_alloc(f->buf_size);
+		if (f->buf == NULL)
+			return -1;
 		f->buf_addr = -1;
+		f->buf_dirty = 0;
 	}
 	while (len) {
 		uint32_t offset = dest % f->buf_size;
@@ -260,8 +1093,7 @@ int target_flash_write_buffered(struct target_flash *f,
 		if (base != f->buf_addr) {
 			if (f->buf_addr != (uint32_t)-1) {
 				/* Write sector to flash if valid */
-				ret |= f->write_buf(f, f->buf_addr,
-				                    f->buf, f->buf_size);
+				ret |= flash_buf_flush(f);
 			}
 			/* Setup buffer for a new sector */
 			f->buf_addr = base;
@@ -270,6 +1102,8 @@ int target_flash_write_buffered(struct target_flash *f,
 		/* Copy chunk into sector buffer */
 		size_t sectlen = MIN(f->buf_size - offset, len);
 		memcpy(f->buf + offset, src, sectlen);
+		for (size_t i = offset / page; i <= (offset + sectlen - 1) / page; i++)
+			f->buf_dirty |= 1u << i;
 		dest += sectlen;
 		src += sectlen;
 		len -= sectlen;
@@ -282,9 +1116,11 @@ int target_flash_done_buffered(struct target_flash *f)
 	int ret = 0;
 	if ((f->buf != NULL) &&(f->buf_addr != (uint32_t)-1)) {
 		/* Write sector to flash if valid */
-		ret = f->write_buf(f, f->buf_addr, f->buf, f->buf_size);
+		ret = flash_prepare(f);
+		if (ret == 0)
+			ret = flash_buf_flush(f);
 		f->buf_addr = -1;
-		free(f->buf);
+		flash_buf_free(f->buf);
 		f->buf = NULL;
 	}
 
@@ -294,6 +1130,8 @@ int target_flash_done_buffered(struct target_flash *f)
 /* Wrapper functions */
 void target_detach(target *t)
 {
+	mem_cache_invalidate();
+	target_clock_restore(t);
 	t->detach(t);
 	t->attached = false;
 }
@@ -301,32 +1139,255 @@ void target_detach(target *t)
 bool target_check_error(target *t) { return t->check_error(t); }
 bool target_attached(target *t) { return t->attached; }
 
+bool target_recover(target *t)
+{
+	if (!t->recover)
+		return false;
+	DEBUG("Trying to recover %s\n", t->driver);
+	mem_cache_invalidate();
+	return t->recover(t);
+}
+
 /* Memory access functions */
+/* True while the target, or a core it shares memory with, runs */
+static bool mem_cache_running(target *t)
+{
+	for (target *s = target_list; s; s = s->next)
+		if (s->running && (mem_cache_owner(s) == mem_cache_owner(t)))
+			return true;
+	return false;
+}
+
+static bool mem_cacheable(target *t, target_addr start, target_addr end)
+{
+	if ((end < start) || mem_cache_running(t))
+		return false;
+	for (struct target_flash *f = mem_cache_owner(t)->flash; f; f = f->next)
+		if ((start >= f->start) && (end <= f->start + f->length))
+			return true;
+	for (unsigned i = 0; i < MEM_READONLY_MAX; i++)
+		if (mem_readonly[i].length && (start >= mem_readonly[i].start) &&
+		    (end <= mem_readonly[i].start + mem_readonly[i].length))
+			return true;
+	return false;
+}
+
+static int mem_cache_read(target *t, uint8_t *dest, target_addr src, size_t len)
+{
+	if (mem_cache.t != mem_cache_owner(t)) {
+		mem_cache_invalidate();
+		mem_cache.t = mem_cache_owner(t);
+	}
+
+	while (len) {
+		target_addr base = src & ~(MEM_CACHE_LINE_SIZE - 1);
+		size_t offset = src - base;
+		size_t chunk = MIN(MEM_CACHE_LINE_SIZE - offset, len);
+		unsigned i;
+
+		for (i = 0; i < MEM_CACHE_LINES; i++)
+			if (mem_cache.line[i].valid &&
+			    (mem_cache.line[i].addr == base))
+				break;
+		if (i == MEM_CACHE_LINES) {
+			/* Miss, replace lines round robin */
+			i = mem_cache.next++ % MEM_CACHE_LINES;
+			mem_cache.line[i].valid = false;
+			t->mem_read(t, mem_cache.line[i].data, base,
+			            MEM_CACHE_LINE_SIZE);
+			if (target_check_error(t))
+				return -1;
+			mem_cache.line[i].addr = base;
+			mem_cache.line[i].valid = true;
+		}
+		memcpy(dest, mem_cache.line[i].data + offset, chunk);
+
+		dest += chunk;
+		src += chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
 int target_mem_read(target *t, void *dest, target_addr src, size_t len)
 {
+	/* Only small reads, bulk transfers are quicker straight through */
+	target_addr start = src & ~(MEM_CACHE_LINE_SIZE - 1);
+	target_addr end = ALIGN(src + len, MEM_CACHE_LINE_SIZE);
+	STATS_ADD(mem_read_bytes, len);
+	if ((len <= MEM_CACHE_LINE_SIZE) && mem_cacheable(t, start, end))
+		return mem_cache_read(t, dest, src, len);
+
 	t->mem_read(t, dest, src, len);
 	return target_check_error(t);
 }
 
 int target_mem_write(target *t, target_addr dest, const void *src, size_t len)
 {
+	STATS_ADD(mem_write_bytes, len);
+	mem_cache_invalidate();
 	t->mem_write(t, dest, src, len);
 	return target_check_error(t);
 }
 
+/* Find the first copy of data, at most MEM_SEARCH_MAX bytes.  Targets
+ * that can search their own memory are asked to first */
+#define MEM_SEARCH_CHUNK	256
+
+int target_mem_search(target *t, target_addr base, size_t len,
+                      const void *data, size_t data_len, target_addr *addr)
+{
+	uint8_t buf[MEM_SEARCH_CHUNK + MEM_SEARCH_MAX];
+
+	if ((data_len == 0) || (data_len > MEM_SEARCH_MAX))
+		return -1;
+	if (len < data_len)
+		return 0;
+	if (t->mem_search) {
+		int ret = t->mem_search(t, base, len, data, data_len, addr);
+		if (ret >= 0)
+			return ret;
+	}
+
+	for (size_t off = 0; off + data_len <= len; off += MEM_SEARCH_CHUNK) {
+		/* Overlap the next chunk so matches can straddle */
+		size_t n = MIN(MEM_SEARCH_CHUNK + data_len - 1, len - off);
+		if (target_mem_read(t, buf, base + off, n))
+			return -1;
+		for (size_t i = 0; i + data_len <= n; i++) {
+			if (!memcmp(&buf[i], data, data_len)) {
+				*addr = base + off + i;
+				return 1;
+			}
+		}
+	}
+	return 0;
+}
+
+/* Fill memory with copies of data, at most MEM_SEARCH_MAX bytes.  Without
+ * help from the target, whole copies are written a chunk at a time. */
+int target_mem_fill(target *t, target_addr base, size_t len,
+                    const void *data, size_t data_len)
+{
+	uint8_t buf[MEM_SEARCH_CHUNK];
+	const uint8_t *d = data;
+
+	if ((data_len == 0) || (data_len > MEM_SEARCH_MAX))
+		return -1;
+	mem_cache_invalidate();
+	if (t->mem_fill && (t->mem_fill(t, base, len, data, data_len) == 0))
+		return 0;
+
+	size_t chunk = sizeof(buf) - sizeof(buf) % data_len;
+	for (size_t i = 0; i < chunk; i++)
+		buf[i] = d[i % data_len];
+	while (len) {
+		size_t n = MIN(chunk, len);
+		if (target_mem_write(t, base, buf, n))
+			return -1;
+		base += n;
+		len -= n;
+	}
+	return 0;
+}
+
+bool target_ram_search(target *t, const void *data, size_t len,
+                       target_addr *addr)
+{
+	for (struct target_ram *r = t->ram; r; r = r->next)
+		if (target_mem_search(t, r->start, r->length, data, len,
+		                      addr) > 0)
+			return true;
+	return false;
+}
+
+bool target_mem_readonly_add(target_addr start, size_t len)
+{
+	for (unsigned i = 0; i < MEM_READONLY_MAX; i++) {
+		if (mem_readonly[i].length == 0) {
+			mem_readonly[i].start = start;
+			mem_readonly[i].length = len;
+			return true;
+		}
+	}
+	return false;
+}
+
+void target_mem_readonly_clear(void)
+{
+	memset(mem_readonly, 0, sizeof(mem_readonly));
+	mem_cache_invalidate();
+}
+
+bool target_mem_readonly_get(unsigned i, target_addr *start, size_t *len)
+{
+	if ((i >= MEM_READONLY_MAX) || (mem_readonly[i].length == 0))
+		return false;
+	*start = mem_readonly[i].start;
+	*len = mem_readonly[i].length;
+	return true;
+}
+
+int target_mem_crc32(target *t, uint32_t *crc, target_addr base, size_t len)
+{
+	if (t->crc32 == NULL)
+		return -1;
+	return t->crc32(t, crc, base, len);
+}
+
 /* Register access functions */
 void target_regs_read(target *t, void *data) { t->regs_read(t, data); }
 void target_regs_write(target *t, const void *data) { t->regs_write(t, data); }
 
+ssize_t target_reg_read(target *t, int reg, void *data, size_t max)
+{
+	if (t->reg_read == NULL)
+		return 0;
+	return t->reg_read(t, reg, data, max);
+}
+
+ssize_t target_reg_write(target *t, int reg, const void *data, size_t size)
+{
+	if (t->reg_write == NULL)
+		return 0;
+	return t->reg_write(t, reg, data, size);
+}
+
+ssize_t target_thread_reg_read(target *t, target_addr sp, int reg,
+                               void *data, size_t max)
+{
+	if (t->thread_reg_read == NULL)
+		return -1;
+	return t->thread_reg_read(t, sp, reg, data, max);
+}
+
 /* Halt/resume functions */
-void target_reset(target *t) { t->reset(t); }
+void target_reset(target *t)
+{
+	mem_cache_invalidate();
+	t->reset(t);
+	t->clock_boosted = false;
+}
 void target_halt_request(target *t) { t->halt_request(t); }
 enum target_halt_reason target_halt_poll(target *t, target_addr *watch)
 {
-	return t->halt_poll(t, watch);
+	enum target_halt_reason reason = t->halt_poll(t, watch);
+
+	if (t->running && (reason != TARGET_HALT_RUNNING)) {
+		/* Whatever was read while it ran may be stale */
+		mem_cache_invalidate();
+		t->running = false;
+	}
+	return reason;
 }
 
-void target_halt_resume(target *t, bool step) { t->halt_resume(t, step); }
+void target_halt_resume(target *t, bool step)
+{
+	mem_cache_invalidate();
+	target_clock_restore(t);
+	t->halt_resume(t, step);
+	t->running = true;
+}
 
 /* Break-/watchpoint functions */
 int target_breakwatch_set(target *t,
@@ -392,6 +1453,12 @@ const char *target_tdesc(target *t)
 	return t->tdesc ? t->tdesc : "";
 }
 
+size_t target_regs_expedite(target *t, const uint8_t **regs)
+{
+	*regs = t->regs_expedite;
+	return t->reg_read ? t->regs_expedite_count : 0;
+}
+
 const char *target_driver_name(target *t)
 {
 	return t->driver;
@@ -409,6 +1476,29 @@ void target_mem_write32(target *t, uint32_t addr, uint32_t value)
 	t->mem_write(t, addr, &value, sizeof(value));
 }
 
+int target_mem_poll32(target *t, target_addr addr, uint32_t mask,
+                      uint32_t value, uint32_t timeout_ms)
+{
+	platform_timeout timeout;
+	int ret = 0;
+	STATS_TIME_START(start);
+
+	if (t->mem_poll32) {
+		ret = t->mem_poll32(t, addr, mask, value, timeout_ms);
+	} else {
+		platform_timeout_set(&timeout, timeout_ms);
+		while ((target_mem_read32(t, addr) & mask) != value) {
+			if (target_check_error(t) ||
+			    (timeout_ms && platform_timeout_is_expired(&timeout))) {
+				ret = -1;
+				break;
+			}
+		}
+	}
+	STATS_TIME_ADD(flash_poll_us, start);
+	return ret;
+}
+
 uint16_t target_mem_read16(target *t, uint32_t addr)
 {
 	uint16_t ret;
@@ -442,12 +1532,19 @@ void target_command_help(target *t)
 	}
 }
 
-int target_command(target *t, int argc, const char *argv[])
+int target_command(target *t, int argc, const char *argv[], bool running)
 {
+	/* Commands like mass erase change the flash behind our back */
+	mem_cache_invalidate();
 	for (struct target_command_s *tc = t->commands; tc; tc = tc->next)
 		for(const struct command_s *c = tc->cmds; c->cmd; c++)
-			if(!strncmp(argv[0], c->cmd, strlen(argv[0])))
+			if(!strncmp(argv[0], c->cmd, strlen(argv[0]))) {
+				if (running && (c->flags & CMD_HALTED)) {
+					tc_printf(t, "Halt the target first\n");
+					return 1;
+				}
 				return !c->handler(t, argc, argv);
+			}
 	return -1;
 }
 
@@ -21,8 +21,13 @@
 #ifndef __TARGET_INTERNAL_H
 #define __TARGET_INTERNAL_H
 
-extern target *target_list;
+/* Each SWD port has its own targets, target_list is the current port's */
+extern target *target_lists[PLATFORM_SWD_PORTS];
+#define target_list	(target_lists[platform_swd_port()])
 target *target_new(void);
+/* Zeroed memory for a target's descriptors and private data, released
+ * all together by target_list_free() */
+void *target_alloc(size_t size);
 
 struct target_ram {
 	target_addr start;
@@ -35,6 +40,8 @@ typedef int (*flash_erase_func)(struct target_flash *f, target_addr addr, size_t
 typedef int (*flash_write_func)(struct target_flash *f, target_addr dest,
                                 const void *src, size_t len);
 typedef int (*flash_done_func)(struct target_flash *f);
+typedef int (*flash_prepare_func)(struct target_flash *f);
+typedef int (*flash_mass_erase_func)(struct target_flash *f);
 struct target_flash {
 	target_addr start;
 	size_t length;
@@ -42,16 +49,39 @@ struct target_flash {
 	flash_erase_func erase;
 	flash_write_func write;
 	flash_done_func done;
+	/* Optional, sets up for writing once per flash session, before the
+	 * first write.  Cleared by target_flash_done(), or by the driver if
+	 * something undoes the setup. */
+	flash_prepare_func prepare;
+	bool ready;
 	target *t;
 	struct target_flash *next;
 	int align;
 	uint8_t erased;
+	/* Optional, erases every flash with the same mass_erase and bank */
+	flash_mass_erase_func mass_erase;
+	uint8_t bank;
 
 	/* For buffered flash */
 	size_t buf_size;
 	flash_write_func write_buf;
 	target_addr buf_addr;
 	void *buf;
+	/* Optional, write_buf is only called for the pages of buf_page bytes
+	 * that were written.  At most 32 pages per buffer are tracked. */
+	size_t buf_page;
+	uint32_t buf_dirty;
+
+	/* For deferred erase and differential flashing */
+	uint8_t *erase_pending;	/* Bitmap of blocks GDB asked to erase */
+	target_addr diff_addr;
+	void *diff_buf;
+
+	/* Optional, collect consecutive writes into larger ones */
+	bool combine;
+	target_addr combine_addr;
+	size_t combine_len;
+	void *combine_buf;
 };
 
 typedef bool (*cmd_handler)(target *t, int argc, const char **argv);
@@ -60,6 +90,7 @@ struct command_s {
 	const char *cmd;
 	cmd_handler handler;
 	const char *help;
+	uint8_t flags;
 };
 
 struct target_command_s {
@@ -78,24 +109,57 @@ struct breakwatch {
 
 struct target_s {
 	bool attached;
+	bool running;	/* Resumed, and not seen halting since */
 	struct target_controller *tc;
 
 	/* Attach/Detach funcitons */
 	bool (*attach)(target *t);
 	void (*detach)(target *t);
 	bool (*check_error)(target *t);
+	/* Optional, see target_recover() */
+	bool (*recover)(target *t);
 
 	/* Memory access functions */
 	void (*mem_read)(target *t, void *dest, target_addr src,
 	                 size_t len);
 	void (*mem_write)(target *t, target_addr dest,
 	                  const void *src, size_t len);
+	/* Optional, checksum memory on the target, see generic_crc32() */
+	int (*crc32)(target *t, uint32_t *crc, target_addr base, size_t len);
+	/* Optional, reflected CRC-32 as in IEEE 802.3, see crc32_ieee_buf().
+	 * Only used to check flash against data the probe already has. */
+	int (*crc32_ieee)(target *t, uint32_t *crc, target_addr base, size_t len);
+	/* Optional, search and fill memory on the target, see
+	 * target_mem_search() and target_mem_fill().  Return -1 to have
+	 * the probe do it over the debug port instead. */
+	int (*mem_search)(target *t, target_addr base, size_t len,
+	                  const void *data, size_t data_len, target_addr *addr);
+	int (*mem_fill)(target *t, target_addr base, size_t len,
+	                const void *data, size_t data_len);
+	/* Optional, see target_mem_poll32() */
+	int (*mem_poll32)(target *t, target_addr addr, uint32_t mask,
+	                  uint32_t value, uint32_t timeout_ms);
+	/* Optional, see target_clock_boost().  clock_boost returns true if
+	 * it changed the clock, clock_saved is what clock_restore puts back. */
+	bool (*clock_boost)(target *t);
+	void (*clock_restore)(target *t);
+	bool clock_boosted;
+	uint32_t clock_saved[4];
 
 	/* Register access functions */
 	size_t regs_size;
 	const char *tdesc;
+	/* Optional, see target_regs_expedite() */
+	const uint8_t *regs_expedite;
+	size_t regs_expedite_count;
 	void (*regs_read)(target *t, void *data);
 	void (*regs_write)(target *t, const void *data);
+	/* Optional, single register access by GDB register number */
+	ssize_t (*reg_read)(target *t, int reg, void *data, size_t max);
+	ssize_t (*reg_write)(target *t, int reg, const void *data, size_t size);
+	/* Optional, see target_thread_reg_read() */
+	ssize_t (*thread_reg_read)(target *t, target_addr sp, int reg,
+	                           void *data, size_t max);
 
 	/* Halt/resume functions */
 	void (*reset)(target *t);
@@ -113,10 +177,19 @@ struct target_s {
 	unsigned target_options;
 	uint32_t idcode;
 
+	/* Flashed along with the target GDB flashes, and whether that failed,
+	 * see target_gang_enable() */
+	bool gang;
+	bool gang_error;
+
 	/* Target memory map */
 	char *dyn_mem_map;
 	struct target_ram *ram;
 	struct target_flash *flash;
+	/* Optional, the core of a group sharing one view of memory whose
+	 * flash map is used, including itself.  Cached reads carry over
+	 * between the cores of the group. */
+	struct target_s *mem_shared;
 
 	/* Other stuff */
 	const char *driver;
@@ -130,6 +203,7 @@ struct target_s {
 
 void target_add_commands(target *t, const struct command_s *cmds, const char *name);
 void target_add_ram(target *t, target_addr start, uint32_t len);
+size_t target_ram_avail(target *t, target_addr addr);
 void target_add_flash(target *t, struct target_flash *f);
 int target_flash_write_buffered(struct target_flash *f,
                                 target_addr dest, const void *src, size_t len);
@@ -143,6 +217,14 @@ void target_mem_write32(target *t, uint32_t addr, uint32_t value);
 void target_mem_write16(target *t, uint32_t addr, uint16_t value);
 void target_mem_write8(target *t, uint32_t addr, uint8_t value);
 bool target_check_error(target *t);
+/* Read a word until (word & mask) == value.  Returns 0 once it matches,
+ * or -1 on a target error or after timeout_ms, if not 0. */
+int target_mem_poll32(target *t, target_addr addr, uint32_t mask,
+                      uint32_t value, uint32_t timeout_ms);
+/* Run the core faster until target_clock_restore(), if target_flash_boost
+ * is set.  Returns true if this call changed the clock. */
+bool target_clock_boost(target *t);
+void target_clock_restore(target *t);
 
 /* Access to host controller interface */
 void tc_printf(target *t, const char *fmt, ...);
@@ -164,24 +246,5 @@ int tc_gettimeofday(target *t, target_addr tv, target_addr tz);
 int tc_isatty(target *t, int fd);
 int tc_system(target *t, target_addr cmd, size_t cmdlen);
 
-/* Probe for various targets.
- * Actual functions implemented in their respective drivers.
- */
-bool stm32f1_probe(target *t);
-bool stm32f4_probe(target *t);
-bool stm32l0_probe(target *t);
-bool stm32l1_probe(target *t);
-bool stm32l4_probe(target *t);
-bool lmi_probe(target *t);
-bool lpc11xx_probe(target *t);
-bool lpc15xx_probe(target *t);
-bool lpc43xx_probe(target *t);
-bool sam3x_probe(target *t);
-bool sam4l_probe(target *t);
-bool nrf51_probe(target *t);
-bool samd_probe(target *t);
-bool kinetis_probe(target *t);
-bool efm32_probe(target *t);
-
 #endif
 
@@ -59,6 +59,10 @@
 #define DFU_STATUS_ERROR_UNKNOWN      0x0e
 #define DFU_STATUS_ERROR_STALLEDPKT   0x0f
 
+/* DFU functional descriptor type, holding wTransferSize.
+ * Refer to Section 4.1.3 */
+#define DFU_FUNCTIONAL_DESCRIPTOR     0x21
+
 /* Device status structure returned by DFU_GETSTATUS request.
  * Refer to Section 6.1.2 */
 typedef struct dfu_status {
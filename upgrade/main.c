@@ -18,10 +18,13 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #ifdef WIN32
+#   include <windows.h>
 #   include <lusb0_usb.h>
 #else
+#   include <unistd.h>
 #   include <usb.h>
 #endif
 
@@ -35,6 +38,13 @@
 
 #define LOAD_ADDRESS 0x8002000
 
+/* Used when the device doesn't describe itself */
+#define DEFAULT_TRANSFER_SIZE 1024
+#define DEFAULT_SECTOR_SIZE 1024
+
+#define DETACH_WAIT_MS 10000
+#define DETACH_POLL_MS 100
+
 void banner(void)
 {
 	puts("\nBlack Magic Probe -- Firmware Upgrade Utility -- Version " VERSION);
@@ -86,7 +96,8 @@ struct usb_device * find_dev(void)
 	return NULL;
 }
 
-usb_dev_handle * get_dfu_interface(struct usb_device *dev, uint16_t *interface)
+usb_dev_handle * get_dfu_interface(struct usb_device *dev, uint16_t *interface,
+				   struct usb_interface_descriptor **desc)
 {
 	int i, j, k;
 	struct usb_config_descriptor *config;
@@ -101,13 +112,14 @@ usb_dev_handle * get_dfu_interface(struct usb_device *dev, uint16_t *interface)
 			for(k = 0; k < config->interface[j].num_altsetting; k++) {
 				iface = &config->interface[j].altsetting[k];
 				if((iface->bInterfaceClass == 0xFE) &&
-				   (iface->bInterfaceSubClass = 0x01)) {
+				   (iface->bInterfaceSubClass == 0x01)) {
 					handle = usb_open(dev);
 					//usb_set_configuration(handle, i);
 					usb_claim_interface(handle, j);
 					//usb_set_altinterface(handle, k);
 					//*interface = j;
 					*interface = iface->bInterfaceNumber;
+					*desc = iface;
 					return handle;
 				}
 			}
@@ -116,54 +128,239 @@ usb_dev_handle * get_dfu_interface(struct usb_device *dev, uint16_t *interface)
 	return NULL;
 }
 
-int main(void)
+/* wTransferSize from the DFU functional descriptor */
+uint16_t get_transfer_size(struct usb_device *dev,
+			   struct usb_interface_descriptor *iface)
+{
+	const unsigned char *extra = iface->extra;
+	int len = iface->extralen;
+
+	/* Some hosts attach it to the configuration instead */
+	if(!extra || !len) {
+		extra = dev->config[0].extra;
+		len = dev->config[0].extralen;
+	}
+	while(extra && (len >= 2) && (extra[0] >= 2) && (extra[0] <= len)) {
+		if((extra[1] == DFU_FUNCTIONAL_DESCRIPTOR) && (extra[0] >= 7))
+			return extra[5] | (extra[6] << 8);
+		len -= extra[0];
+		extra += extra[0];
+	}
+	return 0;
+}
+
+static void sleep_ms(uint32_t ms)
+{
+#ifdef WIN32
+	Sleep(ms);
+#else
+	usleep(ms * 1000);
+#endif
+}
+
+/* Poll for the device coming back in DFU mode after a detach */
+usb_dev_handle * wait_dfu(struct usb_device **dev, uint16_t *iface,
+			  struct usb_interface_descriptor **desc)
 {
-	struct usb_device *dev;
 	usb_dev_handle *handle;
-	uint16_t iface;
-	int state;
+	int t, state;
+
+	for(t = 0; t < DETACH_WAIT_MS; t += DETACH_POLL_MS) {
+		sleep_ms(DETACH_POLL_MS);
+		if(!(*dev = find_dev()) ||
+		   !(handle = get_dfu_interface(*dev, iface, desc)))
+			continue;
+		state = dfu_getstate(handle, *iface);
+		if((state >= 0) && (state != STATE_APP_IDLE) &&
+		   (state != STATE_APP_DETACH))
+			return handle;
+		usb_release_interface(handle, *iface);
+		usb_close(handle);
+	}
+	return NULL;
+}
+
+/* Flash from addr that is erased and written as a unit: whole sectors
+ * making up whole transfer blocks */
+static uint32_t region_size(const char *layout, uint32_t addr, uint32_t size)
+{
+	uint32_t len = 0, sector;
+
+	do {
+		if(!(sector = stm32_mem_sector_size(layout, addr + len)))
+			sector = DEFAULT_SECTOR_SIZE;
+		len += sector;
+	} while(len % size);
+	return len;
+}
+
+/* A block of the image as written, padded with erased flash */
+static void image_block(uint8_t *buf, uint32_t offset, uint32_t size)
+{
+	uint32_t len = 0;
+
+	if(offset < bindatalen)
+		len = bindatalen - offset;
+	if(len > size)
+		len = size;
+	memcpy(buf, &bindata[offset], len);
+	memset(buf + len, 0xff, size - len);
+}
+
+/* Read a region back and compare it with the image.  Returns 1 if it
+ * differs, 0 if not, and < 0 if it can't be read. */
+static int region_differs(usb_dev_handle *handle, uint16_t iface,
+			  uint32_t addr, uint32_t len, uint8_t *buf, uint32_t size)
+{
+	uint8_t *flash = malloc(size);
 	uint32_t offset;
+	uint16_t block;
+	int ret = 0;
 
-	banner();
-	usb_init();
+	assert(flash);
+	if(stm32_mem_setaddr(handle, iface, addr) < 0)
+		ret = -1;
+	for(offset = 0, block = 2; !ret && (offset < len);
+	    offset += size, block++) {
+		if(dfu_upload(handle, iface, block, flash, size) != (int)size) {
+			ret = -1;
+			break;
+		}
+		image_block(buf, addr - LOAD_ADDRESS + offset, size);
+		ret = memcmp(buf, flash, size) != 0;
+	}
+	/* Back to dfuIDLE for the next download */
+	dfu_abort(handle, iface);
+	free(flash);
+	return ret;
+}
 
-retry:
-	if(!(dev = find_dev()) || !(handle = get_dfu_interface(dev, &iface))) {
-		puts("FATAL: No compatible device found!\n");
+static int fatal(const char *msg)
+{
+	puts(msg);
 #ifdef WIN32
-		system("pause");
+	system("pause");
 #endif
-		return -1;
+	return -1;
+}
+
+int main(int argc, char **argv)
+{
+	struct usb_device *dev;
+	struct usb_interface_descriptor *desc;
+	usb_dev_handle *handle;
+	uint16_t iface;
+	int state, ret, diff = 0;
+	uint32_t offset, addr, sector, size, region, nregions, skipped = 0;
+	uint16_t block;
+	char layout[256] = "";
+	uint8_t *buf, *changed;
+	int i;
+
+	for(i = 1; i < argc; i++) {
+		if(!strcmp(argv[i], "-d")) {
+			diff = 1;
+		} else {
+			printf("Usage: %s [-d]\n"
+			       "  -d  Only rewrite flash that differs from the image\n",
+			       argv[0]);
+			return -1;
+		}
 	}
 
+	banner();
+	usb_init();
+
+	if(!(dev = find_dev()) ||
+	   !(handle = get_dfu_interface(dev, &iface, &desc)))
+		return fatal("FATAL: No compatible device found!\n");
+
 	state = dfu_getstate(handle, iface);
 	if((state < 0) || (state == STATE_APP_IDLE)) {
 		puts("Resetting device in firmware upgrade mode...");
 		dfu_detach(handle, iface, 1000);
 		usb_release_interface(handle, iface);
 		usb_close(handle);
-#ifdef WIN32
-		Sleep(5000);
-#else
-		sleep(5);
-#endif
-		goto retry;
+		if(!(handle = wait_dfu(&dev, &iface, &desc)))
+			return fatal("FATAL: No compatible device found!\n");
 	}
 	printf("Found device at %s:%s\n", dev->bus->dirname, dev->filename);
 
+	if(!(size = get_transfer_size(dev, desc)))
+		size = DEFAULT_TRANSFER_SIZE;
+	if(desc->iInterface)
+		usb_get_string_simple(handle, desc->iInterface, layout,
+				      sizeof(layout));
+	buf = malloc(size);
+	/* Regions are at least a block, so there are no more than blocks */
+	nregions = (bindatalen + size - 1) / size;
+	changed = calloc(nregions, 1);
+	assert(buf && changed);
+
 	dfu_makeidle(handle, iface);
 
-	for(offset = 0; offset < bindatalen; offset += 1024) {
-		printf("Progress: %d%%\r", (offset*100)/bindatalen);
+	/* Erase everything to be written first, a sector at a time */
+	for(addr = LOAD_ADDRESS, i = 0; addr < LOAD_ADDRESS + bindatalen;
+	    addr += region, i++) {
+		region = region_size(layout, addr, size);
+		printf("%s: %d%%\r", diff ? "Comparing" : "Erasing",
+		       ((addr - LOAD_ADDRESS)*100)/bindatalen);
 		fflush(stdout);
-		assert(stm32_mem_erase(handle, iface, LOAD_ADDRESS + offset) == 0);
-		stm32_mem_write(handle, iface, (void*)&bindata[offset], 1024);
+		changed[i] = 1;
+		if(diff && ((ret = region_differs(handle, iface, addr, region,
+						     buf, size)) >= 0))
+			changed[i] = ret;
+		if(!changed[i]) {
+			skipped++;
+			continue;
+		}
+		for(offset = 0; offset < region; offset += sector) {
+			if(!(sector = stm32_mem_sector_size(layout, addr + offset)))
+				sector = DEFAULT_SECTOR_SIZE;
+			if(stm32_mem_erase(handle, iface, addr + offset) < 0)
+				return fatal("FATAL: Erase failed!\n");
+		}
+	}
+
+	/* Blocks from 2 are written on from the address pointer, which is
+	 * set again after a skipped region.  Each block is prepared while
+	 * the device is still busy with the last one. */
+	block = 0;
+	for(addr = LOAD_ADDRESS, i = 0; addr < LOAD_ADDRESS + bindatalen;
+	    addr += region, i++) {
+		region = region_size(layout, addr, size);
+		if(!changed[i]) {
+			block = 0;
+			continue;
+		}
+		if(!block) {
+			if(stm32_mem_setaddr(handle, iface, addr) < 0)
+				return fatal("FATAL: Set address failed!\n");
+			block = 2;
+		}
+		for(offset = 0; (offset < region) &&
+		    (addr + offset < LOAD_ADDRESS + bindatalen);
+		    offset += size, block++) {
+			image_block(buf, addr - LOAD_ADDRESS + offset, size);
+
+			printf("Progress: %d%%\r",
+			       ((addr + offset - LOAD_ADDRESS)*100)/bindatalen);
+			fflush(stdout);
+			if(stm32_mem_write(handle, iface, block, buf, size) < 0)
+				return fatal("FATAL: Write failed!\n");
+		}
 	}
+	if(stm32_mem_wait(handle, iface) < 0)
+		return fatal("FATAL: Write failed!\n");
 	stm32_mem_manifest(handle, iface);
+	free(changed);
+	free(buf);
 
 	usb_release_interface(handle, iface);
 	usb_close(handle);
 
+	if(diff)
+		printf("%d of %d regions already up to date\n", skipped, i);
 	puts("All operations complete!\n");
 
 #ifdef WIN32
@@ -172,4 +369,3 @@ retry:
 
 	return 0;
 }
-
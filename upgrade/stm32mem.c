@@ -17,6 +17,7 @@
  * You should have received a copy of the GNU General Public License
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
+#include <stdlib.h>
 #include <string.h>
 
 #ifdef WIN32
@@ -24,6 +25,7 @@
 #   include <lusb0_usb.h>
 #else
 #   include <unistd.h>
+#   include <sys/time.h>
 #   include <usb.h>
 #endif
 
@@ -34,29 +36,89 @@
 #define STM32_CMD_SETADDRESSPOINTER	0x21
 #define STM32_CMD_ERASE			0x41
 
-static int stm32_download(usb_dev_handle *dev, uint16_t iface, 
-			  uint16_t wBlockNum, void *data, int size)
+/* Download in progress: the device is busy with it until poll_end */
+static int pending;
+static uint32_t poll_end;
+
+static uint32_t stm32_time_ms(void)
+{
+#ifdef WIN32
+	return GetTickCount();
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+#endif
+}
+
+static void stm32_sleep_ms(uint32_t ms)
+{
+#ifdef WIN32
+	Sleep(ms);
+#else
+	usleep(ms * 1000);
+#endif
+}
+
+/* Send a block and the GETSTATUS that starts the device on it.  The
+ * host is then free until bwPollTimeout has passed. */
+static int stm32_download_start(usb_dev_handle *dev, uint16_t iface,
+				uint16_t wBlockNum, void *data, int size)
 {
 	dfu_status status;
 	int i;
 
 	if((i = dfu_dnload(dev, iface, wBlockNum, data, size)) < 0) return i;
-	while(1) {
-		if((i = dfu_getstatus(dev, iface, &status)) < 0) return i;
+	if((i = dfu_getstatus(dev, iface, &status)) < 0) return i;
+	switch(status.bState) {
+	case STATE_DFU_DOWNLOAD_BUSY:
+		pending = 1;
+		poll_end = stm32_time_ms() + status.bwPollTimeout;
+		return 0;
+	case STATE_DFU_DOWNLOAD_IDLE:
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+int stm32_mem_wait(usb_dev_handle *dev, uint16_t iface)
+{
+	dfu_status status;
+	int i;
+
+	while(pending) {
+		int32_t left = poll_end - stm32_time_ms();
+		if(left > 0)
+			stm32_sleep_ms(left);
+		if((i = dfu_getstatus(dev, iface, &status)) < 0) {
+			pending = 0;
+			return i;
+		}
 		switch(status.bState) {
 		case STATE_DFU_DOWNLOAD_BUSY:
-#ifdef WIN32
-			Sleep(status.bwPollTimeout);
-#else
-			usleep(status.bwPollTimeout * 1000);
-#endif
+			poll_end = stm32_time_ms() + status.bwPollTimeout;
 			break;
 		case STATE_DFU_DOWNLOAD_IDLE:
-			return 0;
-		default:	
+			pending = 0;
+			break;
+		default:
+			pending = 0;
 			return -1;
 		}
 	}
+	return 0;
+}
+
+static int stm32_download(usb_dev_handle *dev, uint16_t iface,
+			  uint16_t wBlockNum, void *data, int size)
+{
+	int i;
+
+	if((i = stm32_mem_wait(dev, iface)) < 0) return i;
+	if((i = stm32_download_start(dev, iface, wBlockNum, data, size)) < 0)
+		return i;
+	return stm32_mem_wait(dev, iface);
 }
 
 int stm32_mem_erase(usb_dev_handle *dev, uint16_t iface, uint32_t addr)
@@ -69,9 +131,23 @@ int stm32_mem_erase(usb_dev_handle *dev, uint16_t iface, uint32_t addr)
 	return stm32_download(dev, iface, 0, request, sizeof(request));
 }
 
-int stm32_mem_write(usb_dev_handle *dev, uint16_t iface, void *data, int size)
+int stm32_mem_setaddr(usb_dev_handle *dev, uint16_t iface, uint32_t addr)
 {
-	return stm32_download(dev, iface, 2, data, size);
+	uint8_t request[5];
+
+	request[0] = STM32_CMD_SETADDRESSPOINTER;
+	memcpy(request+1, &addr, sizeof(addr));
+
+	return stm32_download(dev, iface, 0, request, sizeof(request));
+}
+
+int stm32_mem_write(usb_dev_handle *dev, uint16_t iface,
+		    uint16_t wBlockNum, void *data, int size)
+{
+	int i;
+
+	if((i = stm32_mem_wait(dev, iface)) < 0) return i;
+	return stm32_download_start(dev, iface, wBlockNum, data, size);
 }
 
 int stm32_mem_manifest(usb_dev_handle *dev, uint16_t iface)
@@ -79,14 +155,11 @@ int stm32_mem_manifest(usb_dev_handle *dev, uint16_t iface)
 	dfu_status status;
 	int i;
 
+	if((i = stm32_mem_wait(dev, iface)) < 0) return i;
 	if((i = dfu_dnload(dev, iface, 0, NULL, 0)) < 0) return i;
 	while(1) {
 		if((i = dfu_getstatus(dev, iface, &status)) < 0) return 0;
-#ifdef WIN32
-		Sleep(status.bwPollTimeout);
-#else
-		usleep(status.bwPollTimeout * 1000);
-#endif
+		stm32_sleep_ms(status.bwPollTimeout);
 		switch(status.bState) {
 		case STATE_DFU_MANIFEST:
 			return 0;
@@ -96,3 +169,36 @@ int stm32_mem_manifest(usb_dev_handle *dev, uint16_t iface)
 	}
 }
 
+uint32_t stm32_mem_sector_size(const char *layout, uint32_t addr)
+{
+	const char *p = layout ? strchr(layout, '/') : NULL;
+	uint32_t base;
+	char *end;
+
+	/* DfuSe layout: "/<base>/<count>*<size><K|M><type>,..." */
+	if(!p)
+		return 0;
+	base = strtoul(p + 1, &end, 16);
+	if(*end != '/')
+		return 0;
+	p = end;
+	do {
+		uint32_t count = strtoul(p + 1, &end, 10);
+		uint32_t size;
+		if(*end != '*')
+			return 0;
+		size = strtoul(end + 1, &end, 10);
+		if(*end == 'K')
+			size *= 1024;
+		else if(*end == 'M')
+			size *= 1024 * 1024;
+		if(!size)
+			return 0;
+		if((addr >= base) && ((addr - base) / size < count))
+			return size;
+		base += count * size;
+		p = strchr(end, ',');
+	} while(p);
+	return 0;
+}
+
@@ -27,8 +27,17 @@
 #endif
 
 int stm32_mem_erase(usb_dev_handle *dev, uint16_t iface, uint32_t addr);
-int stm32_mem_write(usb_dev_handle *dev, uint16_t iface, void *data, int size);
+int stm32_mem_setaddr(usb_dev_handle *dev, uint16_t iface, uint32_t addr);
+/* Starts writing the block, returning while the device is still busy
+ * with it.  The next request waits, or call stm32_mem_wait(). */
+int stm32_mem_write(usb_dev_handle *dev, uint16_t iface,
+		    uint16_t wBlockNum, void *data, int size);
+int stm32_mem_wait(usb_dev_handle *dev, uint16_t iface);
 int stm32_mem_manifest(usb_dev_handle *dev, uint16_t iface);
 
+/* Size of the flash sector containing addr, from a DfuSe interface
+ * string.  0 if the layout doesn't say. */
+uint32_t stm32_mem_sector_size(const char *layout, uint32_t addr);
+
 #endif
 